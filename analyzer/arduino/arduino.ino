@@ -12,31 +12,396 @@
 
 #include "action_led.h"
 #include "avr_util.h"
+#include "binary_frames.h"
+#include "bit_errors.h"
+#include "bus_stats.h"
 #include "custom_defs.h"
+#include "edge_capture.h"
 #include "hardware_clock.h"
 #include "io_pins.h"
+#include "lin_generator.h"
+#include "lin_master.h"
 #include "lin_processor.h"
+#include "lin_tp.h"
+#include "passive_timer.h"
+#include "replay_frames.h"
 #include "sio.h"
+#include "sio_cmd.h"
 #include "system_clock.h"
+#include "trigger_capture.h"
 
 // FRAMES LED - blinks when detecting valid frames.
-static ActionLed frames_activity_led(PORTB, 0);
+static ActionLed<io_pins::Pin<io_pins::PortB, 0> > frames_activity_led;
 
 // ERRORS LED - blinks when detecting errors.
-static ActionLed errors_activity_led(PORTB, 1);
+static ActionLed<io_pins::Pin<io_pins::PortB, 1> > errors_activity_led;
+
+// The frame output settings. Initialized from custom_defs and can be 
+// changed with serial commands.
+namespace output_mode {
+  static boolean binary = custom_defs::kUseBinaryOutput;
+  static boolean changed_frames_only = custom_defs::kPrintChangedFramesOnly;
+  static boolean timestamps = custom_defs::kPrintFrameTimestamps;
+  static boolean delta = custom_defs::kUseDeltaOutput;
+  static boolean seq = custom_defs::kPrintFrameSeq;
+}
+
+// Used with output_mode::changed_frames_only and output_mode::delta.
+namespace changed_frames {
+  // The data and checksum bytes of the last printed valid frame of each id.
+  struct LastFrame {
+    uint8 num_bytes;
+    uint8 bytes[LinFrame::kMaxBytes - 1];
+  };
+  static LastFrame last_frames[64];
+
+  // Bit per id. If set, the next frame of the id is printed even if not 
+  // changed. Set for all ids on each keyframe.
+  static uint8 force_print[8] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff 
+  };
+
+  static PassiveTimer keyframe_timer;
+
+  // Have the next frame of each id printed.
+  static void startKeyframe() {
+    keyframe_timer.restart();
+    for (uint8 i = 0; i < ARRAY_SIZE(force_print); i++) {
+      force_print[i] = 0xff;
+    }
+  }
+
+  // Flag in the result of update(). The frame should be printed whole, it
+  // is the first of its id since the keyframe or its length changed.
+  static const uint16 kNewFrame = 0x100;
+
+  // Compares the given valid frame with the last printed frame of its id 
+  // and remembers it as the last printed one. Returns a mask with a bit per
+  // data byte that changed, or'ed with kNewFrame if there is no frame to 
+  // compare with. Returns 0 if the frame did not change.
+  static uint16 update(const LinFrame& frame) {
+    if (keyframe_timer.timeMillis() >= custom_defs::kKeyframeMillis) {
+      startKeyframe();
+    }
+
+    const uint8 id = LinFrame::idFromPid(frame.get_byte(0));
+    LastFrame& last = last_frames[id];
+    const uint8 n = frame.num_bytes() - 1;
+    const uint8 mask = bitMask(id & 0x07);
+    uint16 changes = 0;
+    if ((force_print[id >> 3] & mask) || (last.num_bytes != n)) {
+      changes = kNewFrame | 0xff;
+    } else {
+      // The checksum changes only with the data.
+      for (uint8 i = 0; i < n - 1; i++) {
+        if (last.bytes[i] != frame.get_byte(i + 1)) {
+          changes |= bitMask(i);
+        }
+      }
+    }
+    if (!changes) {
+      return 0;
+    }
+
+    force_print[id >> 3] &= ~mask;
+    last.num_bytes = n;
+    for (uint8 i = 0; i < n; i++) {
+      last.bytes[i] = frame.get_byte(i + 1);
+    }
+    return changes;
+  }
+}
+
+// Max length of a frame text line: the bytes, " ERR", the " L2" bus tag, 
+// the sequence number, the timestamps and the end of line.
+static const uint8 kMaxFrameLineBytes = 3 * LinFrame::kMaxBytes + 4 + 3 + 4 + 19 + 1;
+
+// Results of outputFrame().
+namespace output_results {
+  static const uint8 SKIPPED = 0;
+  static const uint8 PRINTED = 1;
+  static const uint8 DROPPED = 2;
+}
+
+// Print frame to serial port, unless only changes are printed and it did
+// not change. Frames are printed whole or dropped if the serial output 
+// can't keep up. Returns one of output_results.
+static uint8 outputFrame(const LinFrame& frame, boolean frameOk) {
+  // The data bytes that changed since the last printed frame of the id,
+  // when tracked.
+  const boolean use_delta = output_mode::binary && output_mode::delta;
+  uint16 changes = changed_frames::kNewFrame;
+  // The changes are tracked per id, for the frames of the first bus only.
+  if (frameOk && !frame.channel() && (output_mode::changed_frames_only || use_delta)) {
+    changes = changed_frames::update(frame);
+  }
+  if (!changes && output_mode::changed_frames_only) {
+    return output_results::SKIPPED;
+  }
+
+  const uint8 max_bytes = output_mode::binary ? 
+      binary_frames::kMaxPrintedBytes : kMaxFrameLineBytes;
+  if (!sio::beginRecord(max_bytes)) {
+    // The last printed frames are no longer the ones the changes are
+    // relative to.
+    changed_frames::startKeyframe();
+    return output_results::DROPPED;
+  } 
+  if (output_mode::binary) {
+    if (use_delta && !(changes & changed_frames::kNewFrame)) {
+      binary_frames::printDelta(frame, changes, output_mode::seq);
+    } else {
+      binary_frames::printFrame(frame, frameOk, output_mode::seq);
+    }
+    return output_results::PRINTED;
+  } 
+  for (int i = 0; i < frame.num_bytes(); i++) {
+    if (i > 0) {
+      sio::printchar(' ');  
+    }
+    sio::printhex2(frame.get_byte(i));  
+  }
+  if (!frameOk) {
+    sio::print(F(" ERR"));
+  }
+  if (frame.channel()) {
+    sio::print(F(" L2"));
+  }
+  if (output_mode::seq) {
+    sio::print(F(" #"));
+    sio::printhex2(frame.seq());
+  }
+  if (output_mode::timestamps) {
+    // Break time and break to frame end time, in 4us hardware clock ticks.
+    sio::out << F(" @") << frame.break_ticks() << F(" +") 
+        << (uint16)(frame.end_ticks() - frame.break_ticks());
+  }
+  sio::println();  
+  return output_results::PRINTED;
+}
+
+// Prints the frames of a trigger capture window.
+static void outputCapturedFrame(const LinFrame& frame, boolean is_valid) {
+  outputFrame(frame, is_valid);
+}
+
+// Used with custom_defs::kUseOutputBenchmark. Replays the frames of the
+// traffic profile in replay_frames.h through outputFrame(), instead of the 
+// lin processor frames, at kOutputBenchmarkSpeedup times their captured 
+// rate. Prints every second, in the current output mode, the number of 
+// frames offered, printed and dropped and the bytes per printed frame.
+namespace output_benchmark {
+  static const uint16 kNumFrames = ARRAY_SIZE(lin_generator::kReplayFrames);
+  typedef char SpeedupIsZero[custom_defs::kOutputBenchmarkSpeedup ? 1 : -1];
+
+  // Index of the next frame of the profile and its hardware clock time.
+  static uint16 next_index = 0;
+  static uint32 next_ticks = 0;
+
+  static uint16 offered = 0;
+  static uint16 printed = 0;
+  static uint16 dropped = 0;
+  static uint32 printed_bytes = 0;
+  static PassiveTimer report_timer;
+
+  // Sets the given frame to the next frame of the profile and returns true
+  // if its time has come.
+  static boolean nextFrame(LinFrame* frame) {
+    const uint32 now = hardware_clock::ticks32ForNonIsr();
+    if ((int32)(now - next_ticks) < 0) {
+      return false;
+    }
+    lin_generator::ReplayFrame replay;
+    memcpy_P(&replay, &lin_generator::kReplayFrames[next_index], sizeof(replay));
+    const uint8 n = (replay.num_data_bytes > 8) ? 8 : replay.num_data_bytes;
+    frame->reset();
+    frame->append_byte(LinFrame::pid(replay.id));
+    for (uint8 i = 0; i < n; i++) {
+      frame->append_byte(replay.data[i]);
+    }
+    if (n) {
+      // The frame sums the data bytes that are followed by another, so the
+      // checksum is computed with a place holder, on a copy.
+      LinFrame copy = *frame;
+      copy.append_byte(0);
+      const uint8 checksum = copy.computeChecksum();
+      frame->append_byte((replay.errors & lin_generator::errors::CHECKSUM) 
+          ? (uint8)~checksum : checksum);
+    }
+    frame->set_break_ticks(now);
+    frame->set_end_ticks(now);
+
+    if (++next_index >= kNumFrames) {
+      next_index = 0;
+    }
+    next_ticks += 
+        pgm_read_word(&lin_generator::kReplayFrames[next_index].delta_ticks) 
+        / custom_defs::kOutputBenchmarkSpeedup;
+    return true;
+  }
+
+  // Counts the result of outputFrame() and the bytes it queued.
+  static void count(uint8 result, uint16 bytes) {
+    offered++;
+    if (result == output_results::PRINTED) {
+      printed++;
+      printed_bytes += bytes;
+    } else if (result == output_results::DROPPED) {
+      dropped++;
+    }
+  }
+
+  static void loop() {
+    if (report_timer.timeMillis() < 1000 || !sio::beginRecord(64)) {
+      return;
+    }
+    report_timer.restart();
+    sio::print(F("bench "));
+    if (!output_mode::binary) {
+      sio::print(output_mode::timestamps ? F("text+time") : F("text"));
+    } else {
+      sio::print(output_mode::delta ? F("delta") : F("binary"));
+    }
+    sio::out << F(": offered=") << offered << F(" printed=") << printed 
+        << F(" dropped=") << dropped << F(" bytes/frame=") 
+        << (uint16)(printed ? printed_bytes / printed : 0) << '\n';
+    offered = 0;
+    printed = 0;
+    dropped = 0;
+    printed_bytes = 0;
+  }
+}
+
+// Used with custom_defs::kPrintDiagnosticMessages. Prints a line per chunk
+// with the frame id, slave node address, and the chunk range in the message.
+static void printDiagnosticChunk(const lin_tp::Chunk& chunk) {
+  sio::out << F("TP ") << sio::hex2(chunk.frame_id) << ' ' << sio::hex2(chunk.nad) 
+      << ' ' << chunk.offset << '+' << chunk.num_bytes << '/' << chunk.message_length << ':';
+  for (uint8 i = 0; i < chunk.num_bytes; i++) {
+    sio::printchar(' ');
+    sio::printhex2(chunk.bytes[i]);
+  }
+  sio::println();
+}
+
+static void printDiagnosticAbort(uint8 frame_id, uint8 nad, uint8 reason) {
+  sio::out << F("TP ") << sio::hex2(frame_id) << ' ' << sio::hex2(nad) << F(" abort ") 
+      << reason << '\n';
+}
+
+// Serial commands of the analyzer, in addition to the common ones:
+//   o <0|1>  - text or binary frame output.
+//   c <0|1>  - print all frames or only the changed ones.
+//   t <0|1>  - print the frame timestamps (text output).
+//   d <0|1>  - print the changes of the valid frames (binary output).
+//   n <0|1>  - print the frame sequence numbers.
+//   g <0|1>  - stop or start the generator bursts or replay (generator mode).
+//   m <0|1>  - stop or start the schedule of the headers (master mode).
+//   s <0|1>  - print the bus statistics, and clear them if 1.
+//   b <0|1>  - print the bit error statistics, and clear them if 1.
+//   e <id>   - capture the rx edges after the frames of the id, 255 for 
+//              after the bit errors only (edge capture).
+//   x <id>   - print the frames around the frames of the id, 255 for 
+//              around the errors only (trigger capture).
+static boolean executeCommand(const sio_cmd::Command& command) {
+  if (command.num_args != 1) {
+    return false;
+  }
+  const boolean on = command.args[0];
+  switch (command.name) {
+    case 'o':
+      output_mode::binary = on;
+      return true;
+    case 'c':
+      // The last printed frames are stale.
+      changed_frames::startKeyframe();
+      output_mode::changed_frames_only = on;
+      return true;
+    case 't':
+      output_mode::timestamps = on;
+      return true;
+    case 'd':
+      changed_frames::startKeyframe();
+      output_mode::delta = on;
+      return true;
+    case 'n':
+      output_mode::seq = on;
+      return true;
+    case 'g':
+      if (!custom_defs::kUseGenerator) {
+        return false;
+      }
+      lin_generator::setRunning(on);
+      return true;
+    case 'm':
+      if (!custom_defs::kUseMasterMode) {
+        return false;
+      }
+      lin_master::setRunning(on);
+      return true;
+    case 's':
+      if (!custom_defs::kUseBusStats) {
+        return false;
+      }
+      bus_stats::requestDump(on);
+      return true;
+    case 'b':
+      if (!custom_defs::kUseBitErrorStats) {
+        return false;
+      }
+      bit_errors::requestDump(on);
+      return true;
+    case 'e':
+      if (!custom_defs::kUseEdgeCapture) {
+        return false;
+      }
+      edge_capture::setTriggerId(command.args[0]);
+      return true;
+    case 'x':
+      if (!custom_defs::kUseTriggerCapture) {
+        return false;
+      }
+      trigger_capture::setTriggerId(command.args[0]);
+      return true;
+  }
+  return false;
+}
 
 // Arduino setup function. Called once during initialization.
 void setup()
 {
-  // Hard coded to 115.2k baud. Uses URART0, no interrupts.
+  // Baud rate is custom_defs::kSioBaud. Uses URART0, with its TX interrupt 
+  // only if custom_defs::kUseSioTxInterrupt.
   // Initialize this first since some setup methods uses it.
   sio::setup();
 
-  // Uses Timer1, no interrupts.
+  // Uses Timer1, overflow interrupt only.
   hardware_clock::setup();
 
   // Uses Timer2 with interrupts, and a few i/o pins. See source code for details.
-  lin_processor::setup();
+  // In generator mode Timer2 is used by the generator, with no interrupts.
+  // The output benchmark uses neither.
+  if (custom_defs::kUseGenerator) {
+    lin_generator::setup();
+  } else if (!custom_defs::kUseOutputBenchmark) {
+    lin_processor::setup();
+    if (custom_defs::kUseMasterMode) {
+      lin_master::setup();
+    }
+  }
+
+  lin_tp::setup(printDiagnosticChunk, printDiagnosticAbort);
+
+  bus_stats::setup();
+
+  bit_errors::setup();
+
+  // Uses the rx pin change interrupt while capturing.
+  edge_capture::setup();
+
+  trigger_capture::setup(outputCapturedFrame, kMaxFrameLineBytes);
+
+  sio_cmd::setup(executeCommand);
   
   // Enable global interrupts. We expect to have only timer1 interrupts by
   // the lin processor to reduce ISR jitter.
@@ -46,6 +411,39 @@ void setup()
   frames_activity_led.action(); 
 }
 
+// Max number of frames handled per main loop iteration, to bound the time
+// between the other loop tasks.
+static const uint8 kMaxFramesPerLoop = 4;
+
+// Handle a recieved LIN frame. Called by lin_processor::drainFrames(), the 
+// frame is borrowed from the lin processor queue, no copy.
+static void handleFrame(const LinFrame& frame) {
+  const boolean frameOk = frame.isValid();
+  if (frameOk) {
+    // Make the FRAMES led blinking.
+    frames_activity_led.action();
+  } 
+  else {
+    // Make the ERRORS frame blinking.
+    errors_activity_led.action();
+  }
+  
+  if (custom_defs::kUseTriggerCapture) {
+    trigger_capture::frameArrived(frame, frameOk);
+  } else {
+    outputFrame(frame, frameOk);
+  }
+
+  if (custom_defs::kPrintDiagnosticMessages && frameOk) {
+    lin_tp::frameArrived(frame);
+  }
+  bus_stats::frameArrived(frame, frameOk);
+  bit_errors::frameArrived(frame, frameOk);
+  if (custom_defs::kUseEdgeCapture) {
+    edge_capture::frameArrived(frame, frameOk);
+  }
+}
+
 // Arduino loop() method. Called after setup(). Never returns.
 // This is a quick loop that does not use delay() or other busy loops or 
 // blocking calls.
@@ -57,8 +455,16 @@ void loop()
     // Periodic updates.
     system_clock::loop();    
     sio::loop();
+    sio_cmd::loop();
     frames_activity_led.loop();
     errors_activity_led.loop();  
+    if (custom_defs::kPrintDiagnosticMessages) {
+      lin_tp::loop();
+    }
+    bus_stats::loop();
+    bit_errors::loop();
+    edge_capture::loop();
+    trigger_capture::loop();
 
     // Print a periodic text messages if no activiy.
     static PassiveTimer idle_timer;
@@ -69,6 +475,18 @@ void loop()
       idle_timer.restart();
     }
 
+    // Send the generator bursts.
+    if (custom_defs::kUseGenerator && lin_generator::loop()) {
+      frames_activity_led.action();
+      idle_timer.restart();
+    }
+
+    // Send the headers of the master schedule. The responses are handled
+    // below as any other frame.
+    if (custom_defs::kUseMasterMode) {
+      lin_master::loop();
+    }
+
     // Handle LIN processor error flags.
     {
       // Used to trigger periodic error printing.
@@ -77,6 +495,12 @@ void loop()
       static uint8 pending_lin_errors = 0;
       
       const uint8 new_lin_errors = lin_processor::getAndClearErrorFlags();
+      if (custom_defs::kUseEdgeCapture) {
+        edge_capture::errorsArrived(new_lin_errors);
+      }
+      if (custom_defs::kUseTriggerCapture) {
+        trigger_capture::errorsArrived(new_lin_errors);
+      }
       if (new_lin_errors) {
         // Make the ERRORS led blinking.
         errors_activity_led.action();
@@ -89,35 +513,48 @@ void loop()
         sio::print(F("LIN errors: "));
         lin_processor::printErrorFlags(pending_lin_errors);
         sio::println();
+        // Also the error counts so far.
+        lin_processor::Stats lin_stats;
+        lin_processor::getStats(&lin_stats, false);
+        sio::print(F("LIN stats: "));
+        lin_processor::printStats(lin_stats);
+        sio::println();
         lin_errors_timeout.restart();
         pending_lin_errors = 0;
       }
     }
     
-    // Handle recieved LIN frames.
-    LinFrame frame;
-    if (lin_processor::readNextFrame(&frame)) {
-      const boolean frameOk = frame.isValid();
-      if (frameOk) {
-        // Make the FRAMES led blinking.
-        frames_activity_led.action();
-      } 
-      else {
-        // Make the ERRORS frame blinking.
-        errors_activity_led.action();
-      }
-      
-      // Print frame to serial port.
-      for (int i = 0; i < frame.num_bytes(); i++) {
-        if (i > 0) {
-          sio::printchar(' ');  
+    // Report changes of the measured baud rate, once a second.
+    if (custom_defs::kUseAutoBaud) {
+      static PassiveTimer baud_timer;
+      static uint16 last_baud = 0;
+      if (baud_timer.timeMillis() >= 1000) {
+        baud_timer.restart();
+        const uint16 baud = lin_processor::autoBaudRate();
+        // Ignoring small changes due to the measurement resolution.
+        if (baud > last_baud + last_baud / 32 || baud + baud / 32 < last_baud) {
+          sio::out << F("baud: ") << baud << '\n';
+          last_baud = baud;
         }
-        sio::printhex2(frame.get_byte(i));  
       }
-      if (!frameOk) {
-        sio::print(F(" ERR"));
+    }
+
+    // Replay the benchmark traffic through the frame output. 
+    if (custom_defs::kUseOutputBenchmark) {
+      static LinFrame bench_frame;
+      if (output_benchmark::nextFrame(&bench_frame)) {
+        const uint16 bytes_before = sio::bytesQueued();
+        const uint8 result = outputFrame(bench_frame, bench_frame.isValid());
+        output_benchmark::count(result, sio::bytesQueued() - bytes_before);
+        frames_activity_led.action();
       }
-      sio::println();  
+      output_benchmark::loop();
+      idle_timer.restart();
+      continue;
+    }
+
+    // Handle recieved LIN frames, a burst per iteration.
+    if (lin_processor::drainFrames(handleFrame, kMaxFramesPerLoop)) {
       // Supress the 'waiting' messages.
       idle_timer.restart(); 
     }
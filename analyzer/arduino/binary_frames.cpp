@@ -0,0 +1,136 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "binary_frames.h"
+
+#include "sio.h"
+
+namespace binary_frames {
+
+// Max size of a record before encoding: type and flags, absolute time, 
+// sequence number, frame bytes, the changes byte of a delta and CRC.
+static const uint8 kMaxRecordBytes = 1 + 4 + 1 + LinFrame::kMaxBytes + 1 + 1;
+
+// Max size of an EDGES record before encoding: type and flags, the first
+// edge index and time, the edges and CRC.
+static const uint8 kMaxEdgesRecordBytes = 1 + 1 + 4 + 2 * kMaxRecordEdges + 1;
+
+// Break ticks of the previous frame record.
+static uint32 last_break_ticks;
+
+// True after the first record, once last_break_ticks is set.
+static boolean has_last_break_ticks;
+
+// Send the given bytes, COBS encoded. Each block of up to 254 non zero bytes
+// is prefixed with its length plus one, which replaces the zero that 
+// follows it. num_bytes is less than 254 so there is a single block of final
+// length.
+static void printCobs(const uint8* bytes, uint8 num_bytes) {
+  uint8 block_start = 0;
+  for (uint8 i = 0; i <= num_bytes; i++) {
+    if (i < num_bytes && bytes[i]) {
+      continue;
+    }
+    sio::printchar(i - block_start + 1);
+    for (uint8 j = block_start; j < i; j++) {
+      sio::printchar(bytes[j]);
+    }
+    block_start = i + 1;
+  }
+}
+
+// Append the type, flags, break time and, if with_seq, the sequence number
+// of a record. Returns the number of bytes.
+static uint8 appendHeader(uint8* record, uint8 type, uint8 flags, 
+    const LinFrame& frame, boolean with_seq) {
+  uint8 n = 0;
+  const uint32 break_ticks = frame.break_ticks();
+  const uint32 delta = break_ticks - last_break_ticks;
+  const boolean is_absolute = !has_last_break_ticks || (delta > 0xffff);
+  if (is_absolute) {
+    flags |= record_flags::kAbsoluteTimeFlag;
+  }
+  if (with_seq) {
+    flags |= record_flags::kSeqFlag;
+  }
+  record[n++] = (type << 4) | flags;
+  const uint32 ticks = is_absolute ? break_ticks : delta;
+  record[n++] = ticks;
+  record[n++] = ticks >> 8;
+  if (is_absolute) {
+    record[n++] = ticks >> 16;
+    record[n++] = ticks >> 24;
+  }
+  if (with_seq) {
+    record[n++] = frame.seq();
+  }
+  last_break_ticks = break_ticks;
+  has_last_break_ticks = true;
+  return n;
+}
+
+// Append the CRC and send the record.
+static void sendRecord(uint8* record, uint8 n) {
+  record[n] = crc8(record, n);
+  n++;
+
+  sio::printchar(0);
+  printCobs(record, n);
+  sio::printchar(0);
+}
+
+void printFrame(const LinFrame& frame, boolean is_valid, boolean with_seq) {
+  uint8 record[kMaxRecordBytes];
+  uint8 n = appendHeader(record, record_types::FRAME, 
+      (is_valid ? 0 : record_flags::kInvalidFlag) 
+          | (frame.channel() ? record_flags::kChannel2Flag : 0), frame, with_seq);
+  for (uint8 i = 0; i < frame.num_bytes(); i++) {
+    record[n++] = frame.get_byte(i);
+  }
+  sendRecord(record, n);
+}
+
+void printDelta(const LinFrame& frame, uint8 changes, boolean with_seq) {
+  uint8 record[kMaxRecordBytes];
+  uint8 n = appendHeader(record, record_types::DELTA, 0, frame, with_seq);
+  record[n++] = frame.get_byte(0);
+  record[n++] = changes;
+  // Data bytes are at [1, num_bytes - 1).
+  const uint8 last = frame.num_bytes() - 1;
+  for (uint8 i = 1; i < last; i++) {
+    if (changes & bitMask(i - 1)) {
+      record[n++] = frame.get_byte(i);
+    }
+  }
+  record[n++] = frame.get_byte(last);
+  sendRecord(record, n);
+}
+
+void printEdges(uint8 first_index, uint32 first_ticks, 
+    const uint16* edges, uint8 num_edges, boolean is_last) {
+  uint8 record[kMaxEdgesRecordBytes];
+  uint8 n = 0;
+  record[n++] = (record_types::EDGES << 4) 
+      | (is_last ? record_flags::kLastEdgesFlag : 0);
+  record[n++] = first_index;
+  record[n++] = first_ticks;
+  record[n++] = first_ticks >> 8;
+  record[n++] = first_ticks >> 16;
+  record[n++] = first_ticks >> 24;
+  for (uint8 i = 0; i < num_edges; i++) {
+    record[n++] = edges[i];
+    record[n++] = edges[i] >> 8;
+  }
+  sendRecord(record, n);
+}
+
+}  // namespace binary_frames
@@ -0,0 +1,88 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BINARY_FRAMES_H
+#define BINARY_FRAMES_H
+
+#include "avr_util.h"
+#include "lin_frame.h"
+
+// Compact binary output of frames, used instead of the text lines with 
+// custom_defs::kUseBinaryOutput. Each frame is sent as a record that is COBS
+// encoded (no zero bytes) and has a zero byte before and after it, so it can
+// be told apart from the text messages that are still sent as is. Decoded
+// by tools/serial/serial_dump.py --binary=1.
+//
+// Record layout (before COBS encoding):
+//   [0]     type [7:4] and flags [3:0]. See record_types and record_flags.
+//   [1..]   Break time. If kAbsoluteTimeFlag, 4 bytes of hardware clock 
+//           ticks, otherwise 2 bytes of ticks since the break of the 
+//           previous frame. Little endian.
+//   [..]    If kSeqFlag, the frame's sequence number (LinFrame::seq()).
+//   [..]    The frame bytes, id, data and checksum.
+//   [last]  CRC-8 (polynomial 0x07, initial value 0) of the bytes above.
+//
+// A DELTA record has instead of the frame bytes the id, a byte with a bit 
+// per data byte that changed since the last record of this id, the changed
+// data bytes and the checksum.
+//
+// An EDGES record of edge_capture has no break time. It has instead the 
+// index of its first edge in the capture, the 4 bytes hardware clock ticks
+// of that edge and 2 bytes per edge, the rx level after the edge in bit 15
+// and the ticks since the previous edge in bits [14:0] (0 for the first 
+// edge of the capture). Little endian.
+namespace binary_frames {
+  namespace record_types {
+    static const uint8 FRAME = 1;
+    static const uint8 DELTA = 2;
+    // 3 and 4 are the trace records of the injector.
+    static const uint8 EDGES = 5;
+  }
+
+  namespace record_flags {
+    // The frame's checksum or length is invalid.
+    static const uint8 kInvalidFlag = H(0);
+    // The break time is absolute, rather than a delta.
+    static const uint8 kAbsoluteTimeFlag = H(1);
+    // The frame is of the second bus (custom_defs::kUseDualBus). Sent as 
+    // FRAME records only.
+    static const uint8 kChannel2Flag = H(2);
+    // The break time is followed by the sequence number byte.
+    static const uint8 kSeqFlag = H(3);
+    // The last EDGES record of the capture.
+    static const uint8 kLastEdgesFlag = H(0);
+  }
+
+  // Max number of bytes printFrame() or printDelta() send: the record with 
+  // absolute time and sequence number, one COBS byte and the two delimiters.
+  static const uint8 kMaxPrintedBytes = 1 + 4 + 1 + LinFrame::kMaxBytes + 1 + 1 + 1 + 2;
+
+  // Send a frame record to sio, with the frame's sequence number if with_seq.
+  extern void printFrame(const LinFrame& frame, boolean is_valid, boolean with_seq);
+
+  // Send a delta record of a valid frame to sio, with bit i of changes if
+  // data byte i changed since the last record of the frame's id.
+  extern void printDelta(const LinFrame& frame, uint8 changes, boolean with_seq);
+
+  // Max number of edges of an EDGES record.
+  static const uint8 kMaxRecordEdges = 16;
+
+  // Max number of bytes printEdges() sends.
+  static const uint8 kMaxEdgesPrintedBytes = 1 + 1 + 4 + 2 * kMaxRecordEdges + 1 + 1 + 2;
+
+  // Send an EDGES record of up to kMaxRecordEdges captured edges to sio. 
+  // first_ticks is the time of the first of them.
+  extern void printEdges(uint8 first_index, uint32 first_ticks, 
+      const uint16* edges, uint8 num_edges, boolean is_last);
+}  // namespace binary_frames
+
+#endif
@@ -0,0 +1,262 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bit_errors.h"
+
+#include "custom_defs.h"
+#include "hardware_clock.h"
+#include "sio.h"
+
+namespace bit_errors {
+  // The compared bytes are the data and checksum bytes, frame bytes
+  // [1, kMaxBytes).
+  static const uint8 kNumBytes = LinFrame::kMaxBytes - 1;
+
+  // Time buckets: < 1ms, [1, 2), ... [6, 7), >= 7ms from the break.
+  static const uint8 kNumTimeBuckets = 8;
+
+  // The last valid frame of an id. Entries with a zero id byte are free, a
+  // protected id is never zero.
+  struct Reference {
+    uint8 id_byte;
+    uint8 num_bytes;
+    uint8 bytes[kNumBytes];
+  };
+
+  static Reference references[kMaxIds];
+
+  // Single bit errors per compared byte and bit. Saturate at 0xff.
+  static uint8 bit_counts[kNumBytes][8];
+  static uint16 time_buckets[kNumTimeBuckets];
+  // Single bit errors, and those of them that read a recessive 1 as a
+  // dominant 0. Saturate at 0xffff.
+  static uint16 single_bit_errors;
+  static uint16 ones_read_as_zero;
+  // Invalid frames that differ by more than one bit, and those with no
+  // reference to compare with.
+  static uint16 multi_bit_errors;
+  static uint16 not_compared;
+
+  // The next dump line to print, see printNextLine(), or kNoDump.
+  static const uint8 kNoDump = 0xff;
+  static uint8 dump_line = kNoDump;
+  static boolean clear_after_dump;
+
+  // Dump lines: the summary, the times, then a line per compared byte
+  // (skipped if it had no errors).
+  static const uint8 kFirstByteLine = 2;
+  static const uint8 kLastLine = kFirstByteLine + kNumBytes - 1;
+
+  static inline void increment(uint16* counter) {
+    if (*counter != 0xffff) {
+      (*counter)++;
+    }
+  }
+
+  // Clears the counts, keeping the references.
+  static void clear() {
+    for (uint8 i = 0; i < kNumBytes; i++) {
+      for (uint8 j = 0; j < 8; j++) {
+        bit_counts[i][j] = 0;
+      }
+    }
+    for (uint8 i = 0; i < kNumTimeBuckets; i++) {
+      time_buckets[i] = 0;
+    }
+    single_bit_errors = 0;
+    ones_read_as_zero = 0;
+    multi_bit_errors = 0;
+    not_compared = 0;
+  }
+
+  void setup() {
+    for (uint8 i = 0; i < kMaxIds; i++) {
+      references[i].id_byte = 0;
+    }
+    clear();
+  }
+
+  // Returns the reference of the given id byte, adding it if add is true
+  // and there is a free entry, or NULL.
+  static Reference* find(uint8 id_byte, boolean add) {
+    for (uint8 i = 0; i < kMaxIds; i++) {
+      Reference* const reference = &references[i];
+      if (reference->id_byte == id_byte) {
+        return reference;
+      }
+      if (!reference->id_byte) {
+        if (!add) {
+          return NULL;
+        }
+        reference->id_byte = id_byte;
+        return reference;
+      }
+    }
+    return NULL;
+  }
+
+  // Count a single bit error at bit j of frame byte i.
+  static void addBitError(const LinFrame& frame, uint8 i, uint8 j,
+      boolean read_as_zero) {
+    increment(&single_bit_errors);
+    if (read_as_zero) {
+      increment(&ones_read_as_zero);
+    }
+    uint8& count = bit_counts[i - 1][j];
+    if (count != 0xff) {
+      count++;
+    }
+    // Frames of the packed ring have no timestamps.
+    if (!frame.break_ticks()) {
+      return;
+    }
+    // Bits from the end of the break, the delimiter, the sync byte, the
+    // previous bytes and the start bit, scaled by the measured duration so
+    // the inter byte spaces are included.
+    const uint16 offset_bits = 1 + 10 + 10 * i + 1 + j;
+    const uint16 frame_bits = 1 + 10 + 10 * frame.num_bytes();
+    const uint32 ticks =
+        (frame.end_ticks() - frame.break_ticks()) * offset_bits / frame_bits;
+    uint8 bucket = ticks / hardware_clock::kTicksPerMilli;
+    if (bucket >= kNumTimeBuckets) {
+      bucket = kNumTimeBuckets - 1;
+    }
+    increment(&time_buckets[bucket]);
+  }
+
+  // Compare an invalid frame with the reference of its id.
+  static void compare(const LinFrame& frame, const Reference& reference) {
+    uint8 error_byte = 0;
+    uint8 error_bit = 0;
+    uint8 num_errors = 0;
+    for (uint8 i = 1; i < reference.num_bytes; i++) {
+      const uint8 diff = frame.get_byte(i) ^ reference.bytes[i - 1];
+      for (uint8 j = 0; diff >> j; j++) {
+        if ((diff >> j) & 1) {
+          error_byte = i;
+          error_bit = j;
+          num_errors++;
+        }
+      }
+      if (num_errors > 1) {
+        increment(&multi_bit_errors);
+        return;
+      }
+    }
+    // Same bytes, e.g. a wrong checksum model.
+    if (!num_errors) {
+      increment(&not_compared);
+      return;
+    }
+    const boolean read_as_zero =
+        !((frame.get_byte(error_byte) >> error_bit) & 1);
+    addBitError(frame, error_byte, error_bit, read_as_zero);
+  }
+
+  void frameArrived(const LinFrame& frame, boolean is_valid) {
+    if (!custom_defs::kUseBitErrorStats || frame.channel()) {
+      return;
+    }
+    const uint8 n = frame.num_bytes();
+    // Header only frames have nothing to compare.
+    if (n < 3) {
+      return;
+    }
+    const uint8 id_byte = frame.get_byte(0);
+    if (is_valid) {
+      Reference* const reference = find(id_byte, true);
+      if (reference) {
+        reference->num_bytes = n;
+        for (uint8 i = 1; i < n; i++) {
+          reference->bytes[i - 1] = frame.get_byte(i);
+        }
+      }
+      return;
+    }
+    // An invalid id byte does not tell which frame this is.
+    const Reference* const reference =
+        LinFrame::isValidPid(id_byte) ? find(id_byte, false) : NULL;
+    if (!reference || reference->num_bytes != n) {
+      increment(&not_compared);
+      return;
+    }
+    compare(frame, *reference);
+  }
+
+  void requestDump(boolean clear) {
+    if (!custom_defs::kUseBitErrorStats) {
+      return;
+    }
+    dump_line = 0;
+    clear_after_dump = clear;
+  }
+
+  // Prints dump_line. Returns false if the serial output has no room for
+  // it.
+  static boolean printNextLine() {
+    if (!sio::beginRecord(80)) {
+      return false;
+    }
+    if (dump_line == 0) {
+      sio::out << F("biterr: single ") << single_bit_errors << F(" (1 read as 0 ")
+          << ones_read_as_zero << F("), multi ") << multi_bit_errors
+          << F(", not compared ") << not_compared << '\n';
+    } else if (dump_line == 1) {
+      sio::out << F("biterr ms:");
+      for (uint8 i = 0; i < kNumTimeBuckets; i++) {
+        sio::out << ' ' << time_buckets[i];
+      }
+      sio::out << '\n';
+    } else {
+      // Byte 1 is the first data byte, the bit offset is of its bit 0 from
+      // the end of the break, without the inter byte spaces.
+      const uint8 i = dump_line - kFirstByteLine + 1;
+      sio::out << F("biterr byte ") << i << F(" @") << (uint16)(12 + 10 * i)
+          << F(" bits:");
+      for (uint8 j = 0; j < 8; j++) {
+        sio::out << ' ' << bit_counts[i - 1][j];
+      }
+      sio::out << '\n';
+    }
+    return true;
+  }
+
+  static inline boolean hasErrors(uint8 line) {
+    const uint8 index = line - kFirstByteLine;
+    for (uint8 j = 0; j < 8; j++) {
+      if (bit_counts[index][j]) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void loop() {
+    if (!custom_defs::kUseBitErrorStats || dump_line == kNoDump) {
+      return;
+    }
+    // The bytes with no errors have no line.
+    while (dump_line >= kFirstByteLine && dump_line <= kLastLine &&
+        !hasErrors(dump_line)) {
+      dump_line++;
+    }
+    if (dump_line <= kLastLine && !printNextLine()) {
+      return;
+    }
+    if (++dump_line > kLastLine) {
+      dump_line = kNoDump;
+      if (clear_after_dump) {
+        clear();
+      }
+    }
+  }
+}  // namespace bit_errors
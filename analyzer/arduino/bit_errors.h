@@ -0,0 +1,51 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BIT_ERRORS_H
+#define BIT_ERRORS_H
+
+#include "avr_util.h"
+#include "lin_frame.h"
+
+// Bit error positions, for telling sampling drift from noise bursts. The
+// last valid frame of the first kMaxIds ids is kept, and an invalid frame
+// of one of these ids with the same length is compared with it. When they
+// differ by exactly one bit, that bit is assumed to be a bit error and is
+// counted per frame byte and bit, per flip direction, and per time from the
+// break, estimated from the bit position and the measured frame duration.
+// Errors that pile up in the last bytes of the long frames point at
+// sampling drift, errors spread over all the positions at noise. Invalid
+// frames that differ by more than one bit are only counted. Meaningful for
+// periodic frames whose data rarely changes.
+//
+// Enabled with custom_defs::kUseBitErrorStats. Frames of the second bus of
+// kUseDualBus are ignored.
+namespace bit_errors {
+  // Number of ids whose last valid frame is kept, the first ids seen.
+  static const uint8 kMaxIds = 8;
+
+  // Call once from main setup().
+  extern void setup();
+
+  // Call from the main loop(). Prints the lines of a requested dump, one
+  // per call as the serial output has room.
+  extern void loop();
+
+  // Call for each received frame.
+  extern void frameArrived(const LinFrame& frame, boolean is_valid);
+
+  // Print the statistics, and then clear them if clear is true. The dump
+  // is printed by loop().
+  extern void requestDump(boolean clear);
+}  // namespace bit_errors
+
+#endif
@@ -0,0 +1,220 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "bus_stats.h"
+
+#include "custom_defs.h"
+#include "hardware_clock.h"
+#include "lin_processor.h"
+#include "sio.h"
+
+namespace bus_stats {
+  // Hardware clock ticks per bit at custom_defs::kLinSpeed, times 16.
+  static const uint16 kTicksPerBitX16 = 
+      (hardware_clock::kTicksPerMilli * 1000 * 16) / custom_defs::kLinSpeed;
+
+  // The break and the break delimiter, not included in the frame times.
+  static const uint16 kBreakTicks = (kTicksPerBitX16 * 14) >> 4;
+
+  // Gap buckets: < 1ms, [1, 2), [2, 4), ... [32, 64), >= 64ms.
+  static const uint8 kNumGapBuckets = 8;
+
+  // Per id frame counts, indexed by the 6 bit id. Saturate at 0xffff.
+  static uint16 id_frames[64];
+  static uint16 gap_buckets[kNumGapBuckets];
+  static uint32 frames;
+  static uint32 invalid_frames;
+  // Sum of the frame times.
+  static uint32 busy_ticks;
+  // Hardware clock at the start of the collection.
+  static uint32 start_ticks;
+  // End time of the previous frame, valid if has_last_end.
+  static uint32 last_end_ticks;
+  static boolean has_last_end;
+  static uint8 queue_peak_percent;
+
+  // The next dump line to print, see printNextLine(), or kNoDump. 
+  static const uint8 kNoDump = 0xff;
+  static uint8 dump_line = kNoDump;
+  static boolean clear_after_dump;
+  // Elapsed time of the dump, fixed at its start so the rates of all the 
+  // lines are over the same interval.
+  static uint32 dump_elapsed_ticks;
+
+  static void clear() {
+    for (uint8 i = 0; i < 64; i++) {
+      id_frames[i] = 0;
+    }
+    for (uint8 i = 0; i < kNumGapBuckets; i++) {
+      gap_buckets[i] = 0;
+    }
+    frames = 0;
+    invalid_frames = 0;
+    busy_ticks = 0;
+    start_ticks = hardware_clock::ticks32ForNonIsr();
+    has_last_end = false;
+    queue_peak_percent = 0;
+  }
+
+  void setup() {
+    if (custom_defs::kUseBusStats) {
+      clear();
+    }
+  }
+
+  static void addGap(uint32 gap_ticks) {
+    uint8 bucket = 0;
+    for (uint32 millis = gap_ticks / hardware_clock::kTicksPerMilli; 
+        millis && bucket < kNumGapBuckets - 1; millis >>= 1) {
+      bucket++;
+    }
+    if (gap_buckets[bucket] < 0xffff) {
+      gap_buckets[bucket]++;
+    }
+  }
+
+  void frameArrived(const LinFrame& frame, boolean is_valid) {
+    if (!custom_defs::kUseBusStats || frame.channel()) {
+      return;
+    }
+    frames++;
+    if (!is_valid) {
+      invalid_frames++;
+    }
+    uint16& id_count = id_frames[LinFrame::idFromPid(frame.get_byte(0))];
+    if (id_count < 0xffff) {
+      id_count++;
+    }
+
+    // Frames of the packed ring have no timestamps. The sync byte and the 
+    // frame bytes, with no spaces.
+    if (!frame.break_ticks()) {
+      busy_ticks += kBreakTicks + 
+          (((uint32)kTicksPerBitX16 * 10 * (frame.num_bytes() + 1)) >> 4);
+      return;
+    }
+    busy_ticks += kBreakTicks + (frame.end_ticks() - frame.break_ticks());
+    const uint32 break_start_ticks = frame.break_ticks() - kBreakTicks;
+    if (has_last_end && (int32)(break_start_ticks - last_end_ticks) >= 0) {
+      addGap(break_start_ticks - last_end_ticks);
+    }
+    last_end_ticks = frame.end_ticks();
+    has_last_end = true;
+  }
+
+  void requestDump(boolean clear) {
+    if (!custom_defs::kUseBusStats) {
+      return;
+    }
+    dump_line = 0;
+    clear_after_dump = clear;
+    dump_elapsed_ticks = hardware_clock::ticks32ForNonIsr() - start_ticks;
+  }
+
+  // Returns count per second over the dump interval, times 10.
+  static uint32 rateX10(uint32 count) {
+    const uint32 elapsed_millis = dump_elapsed_ticks / hardware_clock::kTicksPerMilli;
+    return elapsed_millis ? (count * 10000) / elapsed_millis : 0;
+  }
+
+  static void printX10(uint32 value_x10) {
+    sio::out << (value_x10 / 10) << '.' << (uint8)(value_x10 % 10);
+  }
+
+  // Dump lines: the summary, the gaps, then an optional line per id 
+  // (skipped if it had no frames) and the lin processor stats last.
+  static const uint8 kFirstIdLine = 2;
+  static const uint8 kStatsLine = kFirstIdLine + 64;
+
+  static inline boolean isIdLine(uint8 line) {
+    return line >= kFirstIdLine && line < kStatsLine;
+  }
+
+  // Prints dump_line. Returns false if the serial output has no room for 
+  // it.
+  static boolean printNextLine() {
+    if (isIdLine(dump_line)) {
+      const uint8 id = dump_line - kFirstIdLine;
+      if (!sio::beginRecord(40)) {
+        return false;
+      }
+      sio::out << F("bus id ") << sio::hex2(id) << F(": ") << id_frames[id] 
+          << F(" frames, ");
+      printX10(rateX10(id_frames[id]));
+      sio::out << F("/s\n");
+      return true;
+    }
+
+    if (!sio::beginRecord(100)) {
+      return false;
+    }
+    if (dump_line == 0) {
+      // Busy time in 1/10 percents of the elapsed time. Scaled down so the
+      // product does not overflow.
+      const uint32 elapsed_x1000 = dump_elapsed_ticks / 1000;
+      const uint32 load_x10 = elapsed_x1000 ? busy_ticks / elapsed_x1000 : 0;
+      sio::out << F("bus: ") << (dump_elapsed_ticks / hardware_clock::kTicksPerMilli) 
+          << F(" ms, ") << frames << F(" frames (");
+      printX10(rateX10(frames));
+      sio::out << F("/s), load ");
+      printX10(load_x10);
+      sio::out << F("%, invalid ") << invalid_frames << F(", queue peak ") 
+          << queue_peak_percent << F("%\n");
+    } else if (dump_line == 1) {
+      sio::out << F("bus gaps ms: <1 ") << gap_buckets[0];
+      for (uint8 i = 1; i < kNumGapBuckets; i++) {
+        sio::out << ' ' << (uint8)(1 << (i - 1));
+        if (i < kNumGapBuckets - 1) {
+          sio::out << '-' << (uint8)(1 << i);
+        } else {
+          sio::out << '+';
+        }
+        sio::out << ' ' << gap_buckets[i];
+      }
+      sio::out << '\n';
+    } else {
+      lin_processor::Stats lin_stats;
+      lin_processor::getStats(&lin_stats, false);
+      sio::print(F("bus errors: "));
+      lin_processor::printStats(lin_stats);
+      sio::println();
+    }
+    return true;
+  }
+
+  void loop() {
+    if (!custom_defs::kUseBusStats) {
+      return;
+    }
+    const uint8 queue_percent = lin_processor::queueUsagePercent();
+    if (queue_percent > queue_peak_percent) {
+      queue_peak_percent = queue_percent;
+    }
+
+    if (dump_line == kNoDump) {
+      return;
+    }
+    // The ids with no frames have no line.
+    while (isIdLine(dump_line) && !id_frames[dump_line - kFirstIdLine]) {
+      dump_line++;
+    }
+    if (!printNextLine()) {
+      return;
+    }
+    if (++dump_line > kStatsLine) {
+      dump_line = kNoDump;
+      if (clear_after_dump) {
+        clear();
+      }
+    }
+  }
+}  // namespace bus_stats
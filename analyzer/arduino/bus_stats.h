@@ -0,0 +1,50 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BUS_STATS_H
+#define BUS_STATS_H
+
+#include "avr_util.h"
+#include "lin_frame.h"
+
+// Bus load statistics, to judge if a bus has room for another node and how
+// close the analyzer is to dropping frames. Collected from the received 
+// frames in fixed memory, since setup() or the last clear:
+// * The frame count and rate of each id.
+// * The bus utilization, the time of the frames, from the start of their 
+//   break to the end of their last byte, in percents of the elapsed time.
+// * The number of invalid frames, and the lin processor error counters.
+// * A histogram of the gaps between frames, from the end of a frame to the
+//   break of the next one, in power of two milliseconds buckets.
+// * The peak use of the rx queue (see lin_processor::queueUsagePercent()).
+//
+// Enabled with custom_defs::kUseBusStats. With kUsePackedFrameRing the 
+// frames have no timestamps, so their times are estimated from their 
+// lengths and the gaps are not collected. Frames of the second bus of 
+// kUseDualBus are not counted.
+namespace bus_stats {
+  // Call once from main setup().
+  extern void setup();
+
+  // Call from the main loop(). Samples the rx queue use and prints the 
+  // lines of a requested dump, one per call as the serial output has room.
+  extern void loop();
+
+  // Call for each received frame.
+  extern void frameArrived(const LinFrame& frame, boolean is_valid);
+
+  // Print the statistics, and then clear them if clear is true. The dump
+  // is printed by loop().
+  extern void requestDump(boolean clear);
+}  // namespace bus_stats
+
+#endif
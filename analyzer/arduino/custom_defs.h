@@ -22,12 +22,220 @@
 namespace custom_defs {
 
   // True for LIN checksum V2 (enahanced). False for LIN checksum version 1.
+  // This is the model of ids whose model was not preset or learned yet 
+  // (see LinFrame::setChecksumModel()).
   const boolean kUseLinChecksumVersion2 = true;
 
+  // If true, the checksum model (classic or enhanced) of each id is learned
+  // from the first frame of that id that validates under one of them. 
+  // Diagnostic ids 0x3c, 0x3d are always classic.
+  const boolean kLearnChecksumModels = true;
+
   // LIN bus bits per second rate.
   // Supported baud range is 1000 to 20000. If out of range, using silently default
   // baud of 9600.
   const uint16 kLinSpeed = 19200;
+
+  // Number of frames the lin processor rx queue can hold. One slot is always
+  // reserved for the frame being received.
+  const uint8 kLinFrameBuffers = 16;
+
+  // If true, the rx queue stores the frames as length prefixed byte records
+  // in a single buffer of kPackedFrameRingBytes bytes instead of 
+  // kLinFrameBuffers fixed size frames, which holds more short frames in the
+  // same RAM. The frame timestamps are not kept in this mode.
+  const boolean kUsePackedFrameRing = false;
+  const uint8 kPackedFrameRingBytes = 96;
+
+  // If true, the frames are reconstructed from RX edge timestamps (INT0 + timer1)
+  // instead of timer2 per bit sampling. Listen only. Timer2 is not used in this mode.
+  const boolean kUseEdgeRxEngine = false;
+
+  // If true, a second, independent bus is received on rx2 (PC1, the rx2 of
+  // the injector board) by a second edge engine, and its frames are printed
+  // with an ' L2' tag. The buses are timed by the same hardware clock. 
+  // Requires kUseEdgeRxEngine and both buses at kLinSpeed (no kUseAutoBaud).
+  const boolean kUseDualBus = false;
+
+  // If true, the bytes are received by the second hardware USART (USART1) 
+  // with one interrupt per byte, see usart_rx in lin_processor.cpp. Requires
+  // an ATmega328PB or ATmega32U4 board. Listen only. Timer2 is not used in 
+  // this mode.
+  const boolean kUseUsartRx = false;
+
+  // If true, the analyzer is also the LIN master. It sends the headers of
+  // the schedule table of lin_master.cpp on the TX output (PC2, requires a 
+  // transceiver with TX connected) and receives the responses of the 
+  // slaves as any other frame. Uses the tick engine, so requires no 
+  // kUseEdgeRxEngine, kUseUsartRx and kUseAutoBaud, and not with 
+  // kUseGenerator. There should be no other master on the bus.
+  const boolean kUseMasterMode = false;
+
+  // If true, header only frames (no slave response) are added to the rx 
+  // queue and printed like any other frame. If false, they are only counted
+  // per id by the ISR (see lin_processor::subscribeHeaderOnlyFrames()).
+  const boolean kQueueHeaderOnlyFrames = true;
+
+  // If true, the tick engine measures the bit time of each frame from the
+  // falling edges of its sync byte and samples the rest of the frame with 
+  // it, which tolerates masters whose clock is a few percents off kLinSpeed.
+  // Adds an edge wait of about half a bit to the sync byte.
+  const boolean kUseSyncDriftCompensation = true;
+
+  // If true, frames are closed as soon as they reach the length learned for
+  // their id instead of waiting for the inter byte space timeout.
+  const boolean kUseLearnedFrameLengths = true;
+
+  // If true, the baud rate is measured from the sync byte of each frame and
+  // kLinSpeed is used only until the first measurement. Requires kUseEdgeRxEngine.
+  const boolean kUseAutoBaud = false;
+
+  // If true, each data bit is sampled three times around the middle of the
+  // bit and decided by a majority vote, to reject short noise spikes. The
+  // number of bits that needed the vote is reported in the lin stats.
+  const boolean kUseMajorityVoteSampling = false;
+
+  // If true, each printed frame is followed by its hardware clock timestamps.
+  // See serial_dump.py.
+  const boolean kPrintFrameTimestamps = false;
+
+  // If true, each printed frame carries its sequence number (see 
+  // LinFrame::seq()), so serial_dump.py can report the frames lost between
+  // the ISR and the host.
+  const boolean kPrintFrameSeq = false;
+
+  // If true, a valid frame is printed only if its data differs from the last
+  // printed frame of the same id. Every kKeyframeMillis the next frame of 
+  // each id is printed regardless. Invalid frames are always printed.
+  const boolean kPrintChangedFramesOnly = false;
+  const uint16 kKeyframeMillis = 5000;
+
+  // If true, the diagnostic transport layer messages on ids 0x3c, 0x3d are
+  // reassembled and their data is printed in chunks, in addition to the
+  // frames (see lin_tp.h).
+  const boolean kPrintDiagnosticMessages = false;
+
+  // If true, per id frame rates, the bus load, the gaps between frames and
+  // the peak rx queue use are collected and printed with the 's' serial 
+  // command (see bus_stats.h).
+  const boolean kUseBusStats = true;
+
+  // If true, invalid frames are compared with the last valid frame of the
+  // same id and single bit differences are counted by byte, bit and time 
+  // from the break, and printed with the 'b' serial command (see 
+  // bit_errors.h). For telling sampling drift from noise bursts.
+  const boolean kUseBitErrorStats = false;
+
+  // If true, the rx edges that follow a bit error or a frame of id 
+  // kEdgeCaptureId (0xff for none) are captured, up to kEdgeCaptureEdges 
+  // edges, and sent as binary records (see edge_capture.h). The trigger 
+  // id can be changed with the 'e' serial command.
+  const boolean kUseEdgeCapture = false;
+  const uint8 kEdgeCaptureEdges = 64;
+  const uint8 kEdgeCaptureId = 0xff;
+
+  // If true, the frames are printed only around a trigger: the last 
+  // kTriggerPreFrames frames are kept in RAM and when a frame of id 
+  // kTriggerId (0xff for none) whose data byte kTriggerByteIndex (1 is the 
+  // first data byte) matches kTriggerValue in the bits of kTriggerMask (0 
+  // for any) arrives, or with kTriggerOnErrors an invalid frame or a bit 
+  // error, they are printed followed by the next kTriggerPostFrames frames
+  // (see trigger_capture.h). The trigger id can be changed with the 'x' 
+  // serial command.
+  const boolean kUseTriggerCapture = false;
+  const uint8 kTriggerPreFrames = 16;
+  const uint8 kTriggerPostFrames = 32;
+  const uint8 kTriggerId = 0xff;
+  const uint8 kTriggerByteIndex = 1;
+  const uint8 kTriggerMask = 0x00;
+  const uint8 kTriggerValue = 0x00;
+  const boolean kTriggerOnErrors = true;
+
+  // If true, frames are sent as COBS framed binary records with a time
+  // delta and CRC instead of text lines (see binary_frames.h). The other 
+  // messages are still sent as text.
+  const boolean kUseBinaryOutput = false;
+
+  // If true, with kUseBinaryOutput a valid frame is sent as a record of its
+  // changed data bytes since the last frame of the same id, except for the 
+  // first frame of each id after each keyframe (every kKeyframeMillis).
+  const boolean kUseDeltaOutput = false;
+
+  // Serial output bits per second rate. 115200 is compatible with the 
+  // Arduino serial monitor. 250000, 500000 and 1000000 have exact divisors
+  // at 16Mhz and need a matching host baud rate. At the higher rates the 
+  // main loop may not keep up without kUseSioTxInterrupt.
+  const uint32 kSioBaud = 115200;
+
+  // Size of the sio output queue in bytes. A power of two, up to 1024. The
+  // analyzer has RAM to spare for bursts of frames.
+  const uint16 kSioQueueSize = 256;
+
+  // If true, the serial receiver is enabled and text commands from the host
+  // are executed by sio_cmd, e.g. to change the id filter at runtime. The
+  // frame output flags above are then the initial output modes.
+  const boolean kUseSerialCommands = true;
+
+  // If true, sio sends the queued bytes from the UART data register empty
+  // interrupt instead of from sio::loop(), which keeps the serial output at
+  // line rate regardless of the main loop time. The ISR adds a few usecs 
+  // of jitter to the other interrupts.
+  const boolean kUseSioTxInterrupt = true;
+
+  // If true, sio holds the queued bytes until they fill a batch of 
+  // kSioBatchBytes or the oldest of them waited kSioBatchHoldMillis, and 
+  // then sends them back to back. Batches have whole records. 62 bytes is 
+  // the payload of a USB packet of the FTDI, so its packets go out full 
+  // rather than on its latency timer, and each host read returns complete 
+  // records.
+  const boolean kUseSioBatching = false;
+  const uint8 kSioBatchBytes = 62;
+  const uint8 kSioBatchHoldMillis = 8;
+
+  // If true, the hardware clock runs at 16Mhz / 8, 0.5us ticks, instead of
+  // 16Mhz / 64, 4us ticks (see hardware_clock.h). For diagnostic builds: the
+  // 16 bit tick intervals then wrap at ~32ms instead of ~262ms. Requires
+  // kLinSpeed, and the rates of setBaudRate(), of at least 7843 baud.
+  const boolean kUseFineHardwareClock = false;
+
+  // If true, the frame output is fed with the traffic profile of 
+  // replay_frames.h (see tools/replay) instead of the LIN frames, at 
+  // kOutputBenchmarkSpeedup times its captured rate, and the frames 
+  // printed and dropped and the bytes per frame are printed every second.
+  // For comparing the output formats (serial commands o, d, t) and 
+  // kSioBaud rates.
+  const boolean kUseOutputBenchmark = false;
+  const uint8 kOutputBenchmarkSpeedup = 1;
+
+  // If true, the analyzer is a LIN master traffic generator instead of a 
+  // listener. It sends the schedule of lin_generator on the LIN TX output 
+  // every kGeneratorPauseMillis and the lin processor is not started. It
+  // should be the only master on the bus.
+  const boolean kUseGenerator = false;
+  const uint16 kGeneratorPauseMillis = 100;
+
+  // If true, the generator replays the captured frames of replay_frames.h
+  // at their captured times instead of the schedule bursts. Requires 
+  // kUseGenerator. See tools/replay.
+  const boolean kUseReplay = false;
+
+  // If true, each generator burst is of random frames instead of the 
+  // schedule: random ids, lengths, data, bit spaces, baud offsets and 
+  // injected errors, to test the frame decoder of the other boards. The 
+  // seed of each burst is printed as 'fuzz <burst> <seed>', setting 
+  // kGeneratorFuzzSeed to it repeats the sequence from that burst.
+  const boolean kUseGeneratorFuzz = false;
+  const uint16 kGeneratorFuzzSeed = 1;
+
+  // If true, the generator bursts sweep the baud offset from 
+  // -kSweepMaxPermille to +kSweepMaxPermille (at most 150, 15%) in steps of
+  // kSweepStepPermille, kSweepBurstsPerStep bursts of 8 frames per step.
+  // The frames identify their step, for the frame error rate table of 
+  // tools/baud_sweep from a capture of the board under test.
+  const boolean kUseGeneratorSweep = false;
+  const int16 kSweepMaxPermille = 150;
+  const int16 kSweepStepPermille = 5;
+  const uint8 kSweepBurstsPerStep = 8;
   
 }  // namepsace custom_defs
 
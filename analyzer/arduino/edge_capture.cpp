@@ -0,0 +1,152 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "edge_capture.h"
+
+#include <avr/interrupt.h>
+#include "binary_frames.h"
+#include "custom_defs.h"
+#include "hardware_clock.h"
+#include "io_pins.h"
+#include "passive_timer.h"
+#include "sio.h"
+
+namespace edge_capture {
+  // The rx input of the lin processor, PCINT18.
+  typedef io_pins::Pin<io_pins::PortD, 2> rx_pin;
+
+  namespace states {
+    static const uint8 ARMED = 1;
+    static const uint8 CAPTURING = 2;
+    static const uint8 SENDING = 3;
+  }
+
+  typedef char EdgeCaptureEdgesIsZero[custom_defs::kEdgeCaptureEdges ? 1 : -1];
+
+  static uint8 state;
+  static uint8 trigger_id;
+  static PassiveTimer capture_timer;
+
+  // Written by the ISR while capturing, read by main once the interrupt is
+  // disabled. Each edge is the rx level after the edge in bit 15 and the
+  // clock ticks since the previous edge in bits [14:0]. The first edge has
+  // zero ticks, its time is first_edge_ticks.
+  static uint16 edges[custom_defs::kEdgeCaptureEdges];
+  static volatile uint8 num_edges;
+  static uint32 first_edge_ticks;
+  static uint16 last_edge_ticks;
+
+  // The next edge to send and its time, when sending.
+  static uint8 next_edge;
+  static uint32 next_edge_ticks;
+
+  static inline void enableInterrupt(boolean enable) {
+    if (enable) {
+      PCIFR = H(PCIF2);
+      PCMSK2 |= H(PCINT18);
+      PCICR |= H(PCIE2);
+    } else {
+      PCICR &= ~H(PCIE2);
+      PCMSK2 &= ~H(PCINT18);
+    }
+  }
+
+  void setup() {
+    setTriggerId(custom_defs::kEdgeCaptureId);
+    state = states::ARMED;
+  }
+
+  static void trigger() {
+    if (!custom_defs::kUseEdgeCapture || state != states::ARMED) {
+      return;
+    }
+    num_edges = 0;
+    capture_timer.restart();
+    state = states::CAPTURING;
+    enableInterrupt(true);
+  }
+
+  void errorsArrived(uint8 error_flags) {
+    if (error_flags & kTriggerErrors) {
+      trigger();
+    }
+  }
+
+  void frameArrived(const LinFrame& frame, boolean is_valid) {
+    if (is_valid && (trigger_id != kNoId) &&
+        LinFrame::idFromPid(frame.get_byte(0)) == trigger_id) {
+      trigger();
+    }
+  }
+
+  void setTriggerId(uint8 id) {
+    trigger_id = (id == kNoId) ? kNoId : LinFrame::idFromPid(id);
+  }
+
+  // Send the next record of edges. Returns false if there is no room.
+  static boolean sendRecord() {
+    if (!sio::beginRecord(binary_frames::kMaxEdgesPrintedBytes)) {
+      return false;
+    }
+    const uint8 left = num_edges - next_edge;
+    const uint8 n = (left < binary_frames::kMaxRecordEdges) 
+        ? left : binary_frames::kMaxRecordEdges;
+    const boolean is_last = next_edge + n >= num_edges;
+    binary_frames::printEdges(next_edge, next_edge_ticks, &edges[next_edge], n, is_last);
+    for (uint8 i = 0; i < n; i++) {
+      next_edge_ticks += edges[next_edge++] & 0x7fff;
+    }
+    return true;
+  }
+
+  void loop() {
+    if (!custom_defs::kUseEdgeCapture) {
+      return;
+    }
+    if (state == states::CAPTURING) {
+      if (num_edges < custom_defs::kEdgeCaptureEdges &&
+          capture_timer.timeMillis() < kCaptureMillis) {
+        return;
+      }
+      enableInterrupt(false);
+      // Nothing to send if the bus was idle.
+      if (!num_edges) {
+        state = states::ARMED;
+        return;
+      }
+      next_edge = 0;
+      next_edge_ticks = first_edge_ticks;
+      state = states::SENDING;
+    }
+    if (state == states::SENDING && sendRecord() && next_edge >= num_edges) {
+      state = states::ARMED;
+    }
+  }
+
+  // Pin change of rx.
+  ISR(PCINT2_vect) {
+    const uint16 ticks = hardware_clock::ticksForIsr();
+    const uint16 level = rx_pin::isHigh() ? 0x8000 : 0;
+    const uint8 n = num_edges;
+    if (n >= custom_defs::kEdgeCaptureEdges) {
+      PCICR &= ~H(PCIE2);
+      return;
+    }
+    if (!n) {
+      first_edge_ticks = hardware_clock::ticks32ForIsr();
+    }
+    const uint16 delta = n ? ticks - last_edge_ticks : 0;
+    edges[n] = level | ((delta > 0x7fff) ? 0x7fff : delta);
+    last_edge_ticks = ticks;
+    num_edges = n + 1;
+  }
+}  // namespace edge_capture
@@ -0,0 +1,64 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef EDGE_CAPTURE_H
+#define EDGE_CAPTURE_H
+
+#include "avr_util.h"
+#include "lin_frame.h"
+#include "lin_processor.h"
+
+// A mini logic analyzer of the rx input, for field diagnosis of frames that
+// fail with bit errors. When triggered, the hardware clock time (4us ticks)
+// of each rx edge is recorded by a pin change interrupt into a RAM
+// buffer, up to custom_defs::kEdgeCaptureEdges edges or kCaptureMillis,
+// and then the edges are sent as binary EDGES records (see
+// binary_frames::printEdges()), also with the text frame output. Decoded by
+// tools/serial/serial_dump.py --binary=1.
+//
+// The capture is triggered by the lin processor errors of kTriggerErrors
+// or by a valid frame of the trigger id, and records the edges that follow
+// it. It is armed again once the edges were sent.
+// There is no per edge work while not capturing. While capturing, the
+// interrupt adds a few usecs of jitter to the other interrupts.
+//
+// Enabled with custom_defs::kUseEdgeCapture.
+namespace edge_capture {
+  // Max time from the trigger to the end of the capture. Keeps the edge
+  // deltas well within their 15 bits.
+  static const uint8 kCaptureMillis = 50;
+
+  // The lin processor errors that trigger a capture.
+  static const uint8 kTriggerErrors = 
+      lin_processor::errors::STOP_BIT | lin_processor::errors::SYNC_BYTE;
+
+  // The trigger id value of no id trigger.
+  static const uint8 kNoId = 0xff;
+
+  // Call once from main setup().
+  extern void setup();
+
+  // Call from the main loop(). Ends the capture and sends its edges as the
+  // serial output has room.
+  extern void loop();
+
+  // Call with the lin processor error flags of each main loop iteration.
+  extern void errorsArrived(uint8 error_flags);
+
+  // Call for each received frame.
+  extern void frameArrived(const LinFrame& frame, boolean is_valid);
+
+  // Set the 6 bit id whose frames trigger a capture, or kNoId.
+  extern void setTriggerId(uint8 id);
+}  // namespace edge_capture
+
+#endif
@@ -15,27 +15,45 @@
 
 #include <arduino.h>
 #include "avr_util.h"
+#include "custom_defs.h"
 
 // Provides a free running 16 bit counter with 250 ticks per millisecond and 
-// about 280 millis cycle time. Assuming 16Mhz clock.
+// about 280 millis cycle time. Assuming 16Mhz clock. Also provides a 32 bit
+// extension of it, with about 4.7 hours cycle time, for timestamps and time
+// intervals that are longer than a 16 bit cycle.
 //
-// USES: timer 1, no interrupts.
+// With custom_defs::kUseFineHardwareClock the counter has 2000 ticks per
+// millisecond, a 16 bit cycle of about 33 millis and a 32 bit cycle of 
+// about 36 minutes.
+//
+// USES: timer 1, overflow interrupt only.
 namespace hardware_clock {
+  namespace private_ {
+    // Number of timer 1 overflows. Incremented by the overflow ISR.
+    extern volatile uint16 overflow_count;
+  }
+
   // Call once from main setup(). Tick count starts at 0.
   extern void setup();
 
   // Free running 16 bit counter. Starts counting from zero and wraps around
   // every ~280ms.
-  // Assumes interrupts are enabled upon entry.
+  // Does not disable interrupts, so it does not add jitter to the LIN ISR.
   // DO NOT CALL THIS FROM AN ISR.
   inline uint16 ticksForNonIsr() {
-    // We disable interrupt to avoid corruption of the AVR temp byte buffer
-    // that is used to read 16 bit values.
-    // TODO: can we avoid disabling interrupts (motivation: improve LIN ISR jitter).
-    cli();
-    const uint16 result TCNT1;
-    sei();
-    return result;
+    // Reading TCNT1 latches its high byte in the AVR temp byte buffer, which
+    // an ISR that accesses a 16 bit timer 1 register (e.g. ticksForIsr()) 
+    // overwrites if it runs between the two byte reads. The two reads below 
+    // are a few cycles apart, less than a tick (64 cycles, or 8 with the
+    // fine clock), so a corrupted high byte shows as a large difference and
+    // we read again.
+    for (;;) {
+      const uint16 first = TCNT1;
+      const uint16 second = TCNT1;
+      if ((uint16)(second - first) <= 1) {
+        return second;
+      }
+    }
   }
 
   // Similar to ticksNonIsr but does not enable interrupts.
@@ -44,12 +62,84 @@ namespace hardware_clock {
     return TCNT1; 
   }
 
+  // 32 bit extension of ticksForIsr(). Bits [31:16] are the overflow count.
+  // CALL THIS FROM ISR ONLY.
+  inline uint32 ticks32ForIsr() {
+    uint16 high = private_::overflow_count;
+    const uint16 low = TCNT1;
+    // Handle an overflow whose ISR did not run yet. If low is small, the 
+    // overflow happened before we read it.
+    if ((TIFR1 & H(TOV1)) && low < 0x8000) {
+      high++;
+    }
+    return ((uint32)high << 16) | low;
+  }
+
+  // 32 bit extension of ticksForNonIsr(). Same time base as ticks32ForIsr(),
+  // so the main loop can compare it to the times taken by ISRs. Does not 
+  // disable interrupts.
+  // Assumes interrupts are enabled upon entry.
+  // DO NOT CALL THIS FROM AN ISR.
+  inline uint32 ticks32ForNonIsr() {
+    for (;;) {
+      // The overflow count is read a byte at a time, and the overflow ISR 
+      // (every ~260ms) may run in between. Read again if it changed while
+      // reading the counter.
+      const uint16 high = private_::overflow_count;
+      const uint16 low = ticksForNonIsr();
+      const boolean overflow_pending = TIFR1 & H(TOV1);
+      if (private_::overflow_count != high) {
+        continue;
+      }
+      // An overflow whose ISR did not run yet, see ticks32ForIsr().
+      if (overflow_pending && low < 0x8000) {
+        return ((uint32)(high + 1) << 16) | low;
+      }
+      return ((uint32)high << 16) | low;
+    }
+  }
+
+  // Similar to ticks32ForNonIsr() but restores the interrupt state instead
+  // of enabling interrupts. Can be called from any context, e.g. from 
+  // code that is shared by ISRs and the main loop, at the cost of a few 
+  // more cycles.
+  inline uint32 ticks32() {
+    const uint8 sreg = SREG;
+    cli();
+    const uint32 result = ticks32ForIsr();
+    SREG = sreg;
+    return result;
+  }
+
 #if F_CPU != 16000000
 #error "The existing code assumes 16Mhz CPU clk."
 #endif
 
-  // @ 16Mhz / x64 prescaler. Number of ticks per a millisecond.
-  const uint32 kTicksPerMilli = 250;
+  // @ 16Mhz / x64 prescaler, or x8 with custom_defs::kUseFineHardwareClock.
+  // Number of ticks per a millisecond.
+  const uint32 kTicksPerMilli = custom_defs::kUseFineHardwareClock ? 2000 : 250;
+
+  // Number of nanos per tick, 4000 or 500.
+  const uint16 kNanosPerTick = 1000000L / kTicksPerMilli;
+
+  // For reporting time intervals in sub usec units, regardless of the 
+  // prescaler.
+  inline uint32 ticksToNanos(uint32 ticks) {
+    return ticks * kNanosPerTick;
+  }
+
+  inline uint32 ticksToMicros(uint32 ticks) {
+    return custom_defs::kUseFineHardwareClock ? ticks / 2 : ticks * 4;
+  }
+
+  // The average of count intervals whose sum is sum_ticks, in nanos. Does
+  // not overflow with the large sums of the profiles.
+  inline uint32 averageNanos(uint32 sum_ticks, uint32 count) {
+    if (!count) {
+      return 0;
+    }
+    return ticksToNanos(sum_ticks / count) + ticksToNanos(sum_ticks % count) / count;
+  }
 }  // namespace hardware_clock
 
 #endif  
@@ -0,0 +1,396 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "lin_generator.h"
+
+#include <avr/pgmspace.h>
+#include <string.h>
+#include "custom_defs.h"
+#include "hardware_clock.h"
+#include "io_pins.h"
+#include "lin_frame.h"
+#include "passive_timer.h"
+#include "replay_frames.h"
+#include "sio.h"
+
+namespace lin_generator {
+
+#if F_CPU != 16000000
+#error "The existing code assumes 16Mhz CPU clk."
+#endif
+
+  typedef char BaudOutOfRange[
+      (custom_defs::kLinSpeed >= 1000 && custom_defs::kLinSpeed <= 20000) ? 1 : -1];
+
+  // LIN TX output, recessive when high.
+  typedef io_pins::Pin<io_pins::PortC, 2> tx_pin;
+
+  // The schedule. Like the custom_* files, should be adapted to the test. 
+  static const Slot kSchedule[] PROGMEM = {
+    // id, n, data, idle, response space, byte space, baud offset, errors.
+    //
+    // A nominal frame.
+    { 0x0d, 8, { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88 }, 20, 1, 0, 0, 0 },
+    // Back to back with the previous one.
+    { 0x0d, 8, { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88 }, 0, 0, 0, 0, 0 },
+    // Long response and inter byte spaces.
+    { 0x0d, 8, { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88 }, 20, 8, 4, 0, 0 },
+    // A header only. The idle bits of the next slot leave room for the 
+    // response.
+    { 0x39, 0, { 0 }, 20, 0, 0, 0, 0 },
+    // Fast and slow masters.
+    { 0x8e, 8, { 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, 120, 1, 0, 25, 0 },
+    { 0x8e, 8, { 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, 20, 1, 0, -25, 0 },
+    // Shortest frames, back to back.
+    { 0x3c, 1, { 0x3c }, 20, 0, 0, 0, 0 },
+    { 0x3c, 1, { 0x3c }, 0, 0, 0, 0, 0 },
+    // Injected errors, one per frame.
+    { 0x0d, 8, { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88 }, 20, 1, 0, 0, errors::SHORT_BREAK },
+    { 0x0d, 8, { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88 }, 20, 1, 0, 0, errors::SYNC },
+    { 0x0d, 8, { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88 }, 20, 1, 0, 0, errors::PARITY },
+    { 0x0d, 8, { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88 }, 20, 1, 0, 0, errors::DATA_BIT },
+    { 0x0d, 8, { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88 }, 20, 1, 0, 0, errors::CHECKSUM },
+    { 0x0d, 8, { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88 }, 20, 1, 0, 0, errors::STOP_BIT },
+  };
+
+  static const uint8 kNumSlots = ARRAY_SIZE(kSchedule);
+
+  static const uint16 kNumReplayFrames = ARRAY_SIZE(kReplayFrames);
+
+  // Max timer 2 counts per bit at the nominal baud rate. Leaves room for 
+  // the baud offsets, up to +/-15%, and for the overshot of a wait, within
+  // the 8 bit timer.
+  static const uint8 kMaxCountsPerBit = 200;
+
+  // The bit time of each slot in 1/256 timer 2 counts. Computed once, the
+  // divisions are too slow between the frames of a burst.
+  static uint16 slot_counts_x256[kNumSlots];
+  // At custom_defs::kLinSpeed, for the replay frames.
+  static uint16 nominal_counts_x256;
+
+  // Timer 2 counts per second, per its prescaling.
+  static uint32 counts_per_second;
+
+  // Returns the bit time in 1/256 timer 2 counts at the given baud offset,
+  // up to +/-15%.
+  static uint16 countsX256(int16 baud_offset_permille) {
+    const uint32 baud = 
+        ((uint32)custom_defs::kLinSpeed * (1000 + baud_offset_permille)) / 1000;
+    return (counts_per_second << 8) / baud;
+  }
+
+  // Fuzz mode state (custom_defs::kUseGeneratorFuzz). The random slots of 
+  // the next burst and their bit times.
+  static const uint8 kNumFuzzSlots = 8;
+  static Slot fuzz_slots[kNumFuzzSlots];
+  static uint16 fuzz_counts_x256[kNumFuzzSlots];
+  // xorshift PRNG state, never 0.
+  static uint16 fuzz_random = custom_defs::kGeneratorFuzzSeed ? custom_defs::kGeneratorFuzzSeed : 1;
+
+  // Sweep mode (custom_defs::kUseGeneratorSweep). Each burst is 
+  // kNumSweepSlots frames of kSweepFrameId at the baud offset of the 
+  // current step. The data bytes identify the frame in the sweep: the
+  // offset in permille (int16, little endian), the burst index in the step
+  // and the frame index in the burst, followed by a fixed bit pattern.
+  static const uint8 kNumSweepSlots = 8;
+  static const uint8 kSweepFrameId = 0x2a;
+  typedef char SweepOutOfRange[(custom_defs::kSweepMaxPermille <= 150 && 
+      custom_defs::kSweepStepPermille > 0) ? 1 : -1];
+  static int16 sweep_permille = -custom_defs::kSweepMaxPermille;
+  static uint8 sweep_burst = 0;
+
+  // Bit timing of the slot being sent. The bit ends are counted from the 
+  // start of the burst, so the delays of the code between the bits do not 
+  // accumulate.
+  //
+  // Timer 2 count at the end of the last bit.
+  static uint8 edge_count;
+  static uint8 counts_per_bit;
+  // In 1/256 counts, spread over the bits.
+  static uint8 counts_per_bit_fraction;
+  static uint8 fraction_acc;
+
+  static boolean is_running = true;
+  static uint32 bursts_sent = 0;
+  static PassiveTimer burst_timer;
+
+  // Replay state. Index of the next frame to send and the hardware clock
+  // time of its break.
+  static uint16 replay_index = 0;
+  static uint32 replay_ticks;
+
+  void setup() {
+    tx_pin::setupOutput(true);
+
+    // Use the smallest timer2 prescaling that fits a bit, as in 
+    // lin_processor.
+    counts_per_second = 16000000L / 8;
+    uint8 prescaler_bits = H(CS21);
+    if (counts_per_second / custom_defs::kLinSpeed > kMaxCountsPerBit) {
+      counts_per_second = 16000000L / 32;
+      prescaler_bits = H(CS21) | H(CS20);
+    }
+    if (counts_per_second / custom_defs::kLinSpeed > kMaxCountsPerBit) {
+      counts_per_second = 16000000L / 64;
+      prescaler_bits = H(CS22);
+    }
+    if (counts_per_second / custom_defs::kLinSpeed > kMaxCountsPerBit) {
+      counts_per_second = 16000000L / 128;
+      prescaler_bits = H(CS22) | H(CS20);
+    }
+    // Free running, no interrupts.
+    TIMSK2 = 0;
+    TCCR2A = 0;
+    TCCR2B = prescaler_bits;
+
+    for (uint8 i = 0; i < kNumSlots; i++) {
+      slot_counts_x256[i] = 
+          countsX256((int8)pgm_read_byte(&kSchedule[i].baud_offset_permille));
+    }
+    nominal_counts_x256 = countsX256(0);
+
+    replay_ticks = hardware_clock::ticks32ForNonIsr() 
+        + pgm_read_word(&kReplayFrames[0].delta_ticks);
+  }
+
+  // Holds the TX output at the given level for the given number of bits, 
+  // from the end of the last bit. Called with interrupts disabled.
+  static inline void sendBits(boolean level, uint8 num_bits) {
+    tx_pin::set(level);
+    while (num_bits--) {
+      uint8 counts = counts_per_bit;
+      const uint8 acc = fraction_acc + counts_per_bit_fraction;
+      if (acc < fraction_acc) {
+        counts++;
+      }
+      fraction_acc = acc;
+      while ((uint8)(TCNT2 - edge_count) < counts) {
+      }
+      edge_count += counts;
+    }
+  }
+
+  // Sends a byte with its start and stop bits, lsb first.
+  static void sendByte(uint8 value, boolean dominant_stop_bit) {
+    sendBits(false, 1);
+    for (uint8 i = 0; i < 8; i++) {
+      sendBits(value & 0x01, 1);
+      value >>= 1;
+    }
+    sendBits(!dominant_stop_bit, 1);
+  }
+
+  // Sends the given slot with the given bit time in 1/256 counts, from its
+  // idle bits to the stop bit of its last byte. The slot is prepared while 
+  // the output is still at the stop bit or idle level of the previous one.
+  static void sendSlot(const Slot& slot, uint16 counts_x256) {
+    const uint8 num_data_bytes = (slot.num_data_bytes > 8) ? 8 : slot.num_data_bytes;
+    const uint8 e = slot.errors;
+
+    const uint8 pid = LinFrame::pid(slot.id);
+    LinFrame frame;
+    frame.append_byte(pid);
+    for (uint8 i = 0; i < num_data_bytes; i++) {
+      frame.append_byte(slot.data[i]);
+    }
+    // A place holder for the checksum. The frame sums the data bytes that
+    // are followed by another byte.
+    frame.append_byte(0);
+    const uint8 checksum = frame.computeChecksum();
+
+    counts_per_bit = counts_x256 >> 8;
+    counts_per_bit_fraction = counts_x256;
+
+    sendBits(true, slot.idle_bits);
+    sendBits(false, (e & errors::SHORT_BREAK) ? 9 : 13);
+    // Break delimiter.
+    sendBits(true, 1);
+    sendByte((e & errors::SYNC) ? 0x54 : 0x55, false);
+    const boolean has_response = num_data_bytes > 0;
+    sendByte((e & errors::PARITY) ? (pid ^ 0xc0) : pid, 
+        (e & errors::STOP_BIT) && !has_response);
+    if (!has_response) {
+      return;
+    }
+
+    sendBits(true, slot.response_space_bits);
+    for (uint8 i = 0; i < num_data_bytes; i++) {
+      if (i > 0) {
+        sendBits(true, slot.byte_space_bits);
+      }
+      uint8 b = frame.get_byte(i + 1);
+      if (i == 0 && (e & errors::DATA_BIT)) {
+        b ^= 0x01;
+      }
+      sendByte(b, false);
+    }
+    sendBits(true, slot.byte_space_bits);
+    sendByte((e & errors::CHECKSUM) ? (uint8)~checksum : checksum, e & errors::STOP_BIT);
+  }
+
+  static inline uint8 nextRandom() {
+    uint16 x = fuzz_random;
+    x ^= x << 7;
+    x ^= x >> 9;
+    x ^= x << 8;
+    fuzz_random = x;
+    return x;
+  }
+
+  // Sets the given slot to a random frame. Mostly valid frames with small
+  // perturbations, with occassional long spaces, large baud offsets and 
+  // injected errors.
+  static void randomSlot(Slot* slot) {
+    slot->id = nextRandom();
+    slot->num_data_bytes = nextRandom() % 9;
+    for (uint8 i = 0; i < sizeof(slot->data); i++) {
+      slot->data[i] = nextRandom();
+    }
+    slot->idle_bits = nextRandom() & 0x07;
+    slot->response_space_bits = nextRandom() & 0x03;
+    slot->byte_space_bits = ((nextRandom() & 0x0f) == 0) ? 16 : (nextRandom() & 0x01);
+    slot->baud_offset_permille = ((nextRandom() & 0x0f) == 0) 
+        ? (int8)(nextRandom() % 201 - 100) : (int8)(nextRandom() % 41 - 20);
+    slot->errors = ((nextRandom() & 0x07) == 0) ? bitMask(nextRandom() % 6) : 0;
+  }
+
+  // Sends all the slots, with interrupts disabled.
+  static void sendBurst() {
+    if (custom_defs::kUseGeneratorFuzz) {
+      // The seed of the burst, to reproduce it.
+      sio::out << F("fuzz ") << bursts_sent << ' ' << fuzz_random << '\n';
+      for (uint8 i = 0; i < kNumFuzzSlots; i++) {
+        randomSlot(&fuzz_slots[i]);
+        fuzz_counts_x256[i] = countsX256(fuzz_slots[i].baud_offset_permille);
+      }
+    }
+
+    Slot sweep_slot;
+    uint16 sweep_counts_x256;
+    if (custom_defs::kUseGeneratorSweep) {
+      if (sweep_burst == 0) {
+        sio::out << F("sweep ") << sweep_permille << '\n';
+      }
+      sweep_slot.id = kSweepFrameId;
+      sweep_slot.num_data_bytes = 8;
+      sweep_slot.data[0] = (uint8)sweep_permille;
+      sweep_slot.data[1] = (uint8)((uint16)sweep_permille >> 8);
+      sweep_slot.data[2] = sweep_burst;
+      sweep_slot.data[4] = 0x55;
+      sweep_slot.data[5] = 0xaa;
+      sweep_slot.data[6] = 0x00;
+      sweep_slot.data[7] = 0xff;
+      sweep_slot.idle_bits = 20;
+      sweep_slot.response_space_bits = 1;
+      sweep_slot.byte_space_bits = 0;
+      sweep_slot.baud_offset_permille = 0;
+      sweep_slot.errors = 0;
+      sweep_counts_x256 = countsX256(sweep_permille);
+    }
+
+    const uint8 sreg = SREG;
+    cli();
+    edge_count = TCNT2;
+    fraction_acc = 0;
+    if (custom_defs::kUseGeneratorSweep) {
+      for (uint8 i = 0; i < kNumSweepSlots; i++) {
+        sweep_slot.data[3] = i;
+        sendSlot(sweep_slot, sweep_counts_x256);
+      }
+    } else if (custom_defs::kUseGeneratorFuzz) {
+      for (uint8 i = 0; i < kNumFuzzSlots; i++) {
+        sendSlot(fuzz_slots[i], fuzz_counts_x256[i]);
+      }
+    } else {
+      for (uint8 i = 0; i < kNumSlots; i++) {
+        Slot slot;
+        memcpy_P(&slot, &kSchedule[i], sizeof(slot));
+        sendSlot(slot, slot_counts_x256[i]);
+      }
+    }
+    tx_pin::setHigh();
+    SREG = sreg;
+
+    if (custom_defs::kUseGeneratorSweep && ++sweep_burst >= custom_defs::kSweepBurstsPerStep) {
+      sweep_burst = 0;
+      sweep_permille += custom_defs::kSweepStepPermille;
+      if (sweep_permille > custom_defs::kSweepMaxPermille) {
+        sweep_permille = -custom_defs::kSweepMaxPermille;
+      }
+    }
+  }
+
+  // Sends the next replay frame if its time has come. Returns true if sent.
+  static boolean replayLoop() {
+    if ((int32)(hardware_clock::ticks32ForNonIsr() - replay_ticks) < 0) {
+      return false;
+    }
+    ReplayFrame frame;
+    memcpy_P(&frame, &kReplayFrames[replay_index], sizeof(frame));
+    Slot slot;
+    slot.id = frame.id;
+    slot.num_data_bytes = frame.num_data_bytes;
+    memcpy(slot.data, frame.data, sizeof(slot.data));
+    slot.idle_bits = 0;
+    slot.response_space_bits = 1;
+    slot.byte_space_bits = 0;
+    slot.baud_offset_permille = 0;
+    slot.errors = frame.errors;
+
+    const uint8 sreg = SREG;
+    cli();
+    edge_count = TCNT2;
+    fraction_acc = 0;
+    sendSlot(slot, nominal_counts_x256);
+    tx_pin::setHigh();
+    SREG = sreg;
+
+    if (++replay_index >= kNumReplayFrames) {
+      replay_index = 0;
+      bursts_sent++;
+    }
+    // From the scheduled time rather than the actual one, so a late frame
+    // does not delay the following ones.
+    replay_ticks += pgm_read_word(&kReplayFrames[replay_index].delta_ticks);
+    return true;
+  }
+
+  boolean loop() {
+    if (!is_running) {
+      return false;
+    }
+    if (custom_defs::kUseReplay) {
+      return replayLoop();
+    }
+    if (burst_timer.timeMillis() < custom_defs::kGeneratorPauseMillis) {
+      return false;
+    }
+    sendBurst();
+    // The pause is from the end of the burst.
+    burst_timer.restart();
+    bursts_sent++;
+    return true;
+  }
+
+  void setRunning(boolean running) {
+    if (running && !is_running) {
+      // The replay resumes from the next frame, without a burst of late 
+      // frames.
+      replay_ticks = hardware_clock::ticks32ForNonIsr();
+    }
+    is_running = running;
+  }
+
+  uint32 burstsSent() {
+    return bursts_sent;
+  }
+}  // namespace lin_generator
@@ -0,0 +1,114 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef LIN_GENERATOR_H
+#define LIN_GENERATOR_H
+
+#include "avr_util.h"
+
+// A LIN master traffic generator, for stress testing the injector and 
+// another analyzer with reproducible traffic. Sends bursts of the frames of
+// a schedule (see kSchedule in lin_generator.cpp) on the LIN TX output. 
+// Each slot of the schedule sets its frame, its bit spaces, its baud 
+// offset and the errors to inject. Used instead of the lin processor when 
+// custom_defs::kUseGenerator is true.
+//
+// A burst is sent with interrupts disabled, so its bit timing does not 
+// depend on the other ISRs. The main loop runs between the bursts, every
+// custom_defs::kGeneratorPauseMillis. The schedule should be well below 
+// 250 msecs long, so no hardware clock overflow is missed.
+//
+// With custom_defs::kUseGeneratorFuzz, the bursts are of random frames,
+// with printed seeds so a burst that upsets the other board can be 
+// repeated.
+//
+// With custom_defs::kUseGeneratorSweep, the bursts sweep the baud offset,
+// for characterizing the baud tolerance of the other boards.
+//
+// With custom_defs::kUseReplay, the frames of a capture are sent instead,
+// one at a time at their captured times, with the nominal baud rate and 
+// bit spaces (see ReplayFrame). The break times are within a main loop 
+// iteration of the captured ones and do not drift.
+//
+// USES: timer 2 (no interrupts), TX output (PC2) - pin 25.
+namespace lin_generator {
+
+  // Errors to inject into a frame, bit flags. 
+  namespace errors {
+    // A break of 9 bits, below the LIN break threshold.
+    static const uint8 SHORT_BREAK = H(0);
+    // A sync byte of 0x54 instead of 0x55.
+    static const uint8 SYNC = H(1);
+    // The id parity bits are inverted.
+    static const uint8 PARITY = H(2);
+    // Bit 0 of the first data byte is inverted after the checksum was
+    // computed.
+    static const uint8 DATA_BIT = H(3);
+    // The checksum is inverted.
+    static const uint8 CHECKSUM = H(4);
+    // The stop bit of the last byte is dominant.
+    static const uint8 STOP_BIT = H(5);
+  }
+
+  // A frame of the schedule. In program memory.
+  struct Slot {
+    // The frame id. Bits [7:6] are ignored, the parity bits are computed.
+    uint8 id;
+    // Number of data bytes of the response, 0 to 8. If 0, only the header 
+    // is sent and a slave may respond within the idle bits of the next slot.
+    uint8 num_data_bytes;
+    uint8 data[8];
+    // Idle (recessive) bits before the break. 0 sends the frame back to 
+    // back with the previous one, after a few usecs of slot preparation.
+    uint8 idle_bits;
+    // Idle bits between the id byte and the first data byte.
+    uint8 response_space_bits;
+    // Idle bits before each of the other data bytes and the checksum.
+    uint8 byte_space_bits;
+    // Baud rate error of the frame in 1/10 percents of 
+    // custom_defs::kLinSpeed, e.g. -25 for -2.5%.
+    int8 baud_offset_permille;
+    // Errors to inject, errors flags.
+    uint8 errors;
+  };
+
+  // A captured frame to replay, with custom_defs::kUseReplay. The frames 
+  // are in replay_frames.h, generated from an analyzer capture by 
+  // tools/replay. In program memory.
+  struct ReplayFrame {
+    // Hardware clock ticks (4us) from the break of the previous frame. For 
+    // the first frame, from the last frame of the previous replay.
+    uint16 delta_ticks;
+    // As in Slot.
+    uint8 id;
+    uint8 num_data_bytes;
+    uint8 data[8];
+    // Errors to inject, errors flags. Frames captured with errors are 
+    // replayed with errors::CHECKSUM.
+    uint8 errors;
+  };
+
+  // Call once from main setup().
+  extern void setup();
+
+  // Call from the main loop(). Returns true if it sent a burst or a replay
+  // frame.
+  extern boolean loop();
+
+  // Start or stop sending the bursts or the replay. Initially started.
+  extern void setRunning(boolean running);
+
+  // Number of bursts, or of complete replays, sent since setup().
+  extern uint32 burstsSent();
+}  // namespace lin_generator
+
+#endif
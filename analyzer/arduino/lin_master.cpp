@@ -0,0 +1,78 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "lin_master.h"
+
+#include <avr/pgmspace.h>
+#include "custom_defs.h"
+#include "hardware_clock.h"
+#include "lin_processor.h"
+
+namespace lin_master {
+  // The schedule. Like the custom_* files, should be adapted to the bus.
+  static const Slot kSchedule[] PROGMEM = {
+    // id, slot millis.
+    { 0x0d, 20 },
+    { 0x0e, 20 },
+    { 0x0f, 20 },
+  };
+
+  static const uint8 kNumSlots = ARRAY_SIZE(kSchedule);
+
+  // If a slot is late by more than this, e.g. after the bus was busy for a
+  // long time, the schedule restarts from now instead of sending the late 
+  // headers back to back. 
+  static const uint32 kMaxLateTicks = 100 * hardware_clock::kTicksPerMilli;
+
+  static boolean is_running = true;
+  // The schedule index of the next header to send.
+  static uint8 slot_index;
+  // The scheduled hardware clock time of the next header.
+  static uint32 slot_ticks;
+
+  void setup() {
+    slot_index = 0;
+    slot_ticks = hardware_clock::ticks32ForNonIsr();
+  }
+
+  boolean loop() {
+    if (!custom_defs::kUseMasterMode || !is_running) {
+      return false;
+    }
+    const uint32 now_ticks = hardware_clock::ticks32ForNonIsr();
+    const int32 late_ticks = (int32)(now_ticks - slot_ticks);
+    if (late_ticks < 0) {
+      return false;
+    }
+    // Busy, retry on the next iteration.
+    if (!lin_processor::sendHeader(pgm_read_byte(&kSchedule[slot_index].id))) {
+      return false;
+    }
+    // From the scheduled time rather than the actual one, so a late header
+    // does not delay the following ones.
+    slot_ticks = (late_ticks > (int32)kMaxLateTicks) ? now_ticks : slot_ticks;
+    slot_ticks += pgm_read_byte(&kSchedule[slot_index].slot_millis) 
+        * hardware_clock::kTicksPerMilli;
+    if (++slot_index >= kNumSlots) {
+      slot_index = 0;
+    }
+    return true;
+  }
+
+  void setRunning(boolean running) {
+    if (running && !is_running) {
+      // Resume from the next slot, without a burst of late headers.
+      slot_ticks = hardware_clock::ticks32ForNonIsr();
+    }
+    is_running = running;
+  }
+}  // namespace lin_master
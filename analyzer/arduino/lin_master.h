@@ -0,0 +1,50 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef LIN_MASTER_H
+#define LIN_MASTER_H
+
+#include "avr_util.h"
+
+// The schedule table of the master mode (custom_defs::kUseMasterMode). 
+// Sends the header of each slot of the schedule (see kSchedule in 
+// lin_master.cpp) at the start of the slot with lin_processor::sendHeader(),
+// round robin. The responses of the slaves are received by the lin 
+// processor and printed as any other frame, so a bus with slaves only can 
+// be analyzed without its master.
+//
+// The slots are timed by the hardware clock, from the scheduled start of 
+// the previous slot, so the schedule does not drift with the main loop 
+// latency. A header is delayed while the bus is busy (e.g. a slot shorter 
+// than its frame).
+namespace lin_master {
+  // A slot of the schedule. In program memory.
+  struct Slot {
+    // The frame id. Bits [7:6] are ignored, the parity bits are computed.
+    uint8 id;
+    // Time from the header of this slot to the header of the next one. 
+    // Should be longer than the frame, about 10 msecs for 8 data bytes at 
+    // 19200 baud.
+    uint8 slot_millis;
+  };
+
+  // Call once from main setup().
+  extern void setup();
+
+  // Call from the main loop(). Returns true if it sent a header.
+  extern boolean loop();
+
+  // Start or stop sending the schedule. Initially started.
+  extern void setRunning(boolean running);
+}  // namespace lin_master
+
+#endif
@@ -18,9 +18,12 @@
 
 // Uses 
 // * Timer2 - used to generate the bit ticks.
+// * INT0, Timer1 B-match - used instead of Timer2 when
+//   custom_defs::kUseEdgeRxEngine is true.
 // * OC2B (PD3) - timer output ticks. For debugging. If needed, can be changed
 //   to not using this pin.
 // * PD2 - LIN RX input.
+// * PC2 - LIN TX output of the headers, with custom_defs::kUseMasterMode.
 // * PC0, PC1, PC2, PC3 - debugging outputs. See .cpp file for details.
 namespace lin_processor {
   // Call once in program setup. 
@@ -32,6 +35,84 @@ namespace lin_processor {
   // count are not verified. 
   extern boolean readNextFrame(LinFrame* buffer);
 
+  // Zero copy alternative to readNextFrame(). Returns a pointer to the oldest 
+  // available rx frame or NULL if none is available. The frame is not modified 
+  // by the ISR until releaseFrame() is called.
+  extern const LinFrame* peekFrame();
+
+  // Release the frame returned by peekFrame(). Call only after peekFrame() 
+  // returned a non NULL frame.
+  extern void releaseFrame();
+
+  // Called by drainFrames() with each frame. The frame is valid only during
+  // the call.
+  typedef void (*FrameHandler)(const LinFrame& frame);
+
+  // Pass the available rx frames, oldest first and up to max_frames, to the
+  // given handler, without copying, and release them. Returns the number of
+  // frames handled. Frames that arrive during the call are left to the next 
+  // call. Lets the main loop consume a burst in a single iteration.
+  extern uint8 drainFrames(FrameHandler handler, uint8 max_frames);
+
+  // Returns the momentary use of the rx queue, in percents of its capacity
+  // (frame buffers, or bytes with custom_defs::kUsePackedFrameRing). Frames
+  // are dropped with a BUFFER_OVERRUN error when it is full. Call from
+  // main.
+  extern uint8 queueUsagePercent();
+
+  // Returns the measured LIN baud rate if custom_defs::kUseAutoBaud is true and
+  // the rate is locked. Otherwise returns 0.
+  extern uint16 autoBaudRate();
+
+  // Change the LIN baud rate at runtime, for example for a diagnostic 
+  // session at another rate. Applied atomically between frames, with the 
+  // timing recomputed and the timer2 prescaler reselected. Returns false, 
+  // with no change, if baud is not in [1000, 20000] ([7843, 20000] with
+  // custom_defs::kUseFineHardwareClock) or the bus is in the middle of a
+  // frame, in which case the caller should retry later. With kUseDualBus
+  // both buses change. With kUseAutoBaud, the next sync byte measurement
+  // overrides it.
+  extern boolean setBaudRate(uint16 baud);
+
+  // The baud rate set by custom_defs::kLinSpeed or setBaudRate().
+  extern uint16 baudRate();
+
+  // Bus sleep, to save power while the bus is silent. Stops the timer 2 
+  // bit sampling interrupt and arms an INT0 interrupt on the next falling 
+  // edge of RX, the start of the next break or of a wake up pulse, which 
+  // restarts the sampling in phase with that edge, in time to detect that 
+  // break. A wake up pulse is counted in Stats::wakeups, not as an error.
+  // No effect with kUseEdgeRxEngine, which is edge driven anyway. Call from
+  // main, which can then put the CPU in SLEEP_MODE_IDLE until the next
+  // interrupt.
+  extern void enterBusSleep();
+
+  // True from enterBusSleep() until the bus activity woke the processor.
+  extern boolean isBusSleeping();
+
+  // Master mode (custom_defs::kUseMasterMode). Sends a header with the 
+  // given 6 bit id on the TX1 pin, then receives the response of the slave 
+  // as any other frame. Returns false if the bus is not idle or a header is
+  // already being sent, in which case the caller should retry later. Call 
+  // from main.
+  extern boolean sendHeader(uint8 id);
+
+  // Frames whose id is not accepted are not added to the rx queue. All 
+  // ids are accepted by default. Can be called from main at any time.
+  extern void acceptAllIds(boolean accept);
+  extern void acceptId(uint8 id, boolean accept);
+
+  // Header only frames (a header with no slave response) are not added to 
+  // the rx queue unless their id is subscribed. Instead, the ISR counts them 
+  // per id. With custom_defs::kQueueHeaderOnlyFrames all the ids are 
+  // subscribed by default. Can be called from main at any time.
+  extern void subscribeHeaderOnlyFrames(uint8 id, boolean subscribe);
+
+  // Returns the number of header only frames of the given id that were
+  // counted instead of queued since the previous call, and clears it. 
+  // Saturates at 0xff. Call from main.
+  extern uint8 getAndClearNoResponses(uint8 id);
+
   // Errors byte masks for the individual error bits.
   namespace errors {
     static const uint8 FRAME_TOO_SHORT = (1 << 0);
@@ -43,6 +124,29 @@ namespace lin_processor {
     static const uint8 OTHER = (1 << 6);
   }
 
+  // Number of error types, one per bit in errors.
+  static const uint8 kNumErrorTypes = 7;
+
+  // Saturating event counters since setup or last clear.
+  struct Stats {
+    // Number of frames added to the rx queue.
+    uint16 frames;
+    // Per error type counters, indexed by the bit index of the errors:: mask.
+    uint16 errors[kNumErrorTypes];
+    // Number of bits whose three samples did not agree and were decided by 
+    // a majority vote. Used only with kUseMajorityVoteSampling.
+    uint16 voted_bits;
+    // Number of wake up pulses, dominant pulses longer than any break. 
+    // Not counted by the edge engine.
+    uint16 wakeups;
+  };
+
+  // Copy current statistics to *stats and optionally clear them.
+  extern void getStats(Stats* stats, boolean clear);
+
+  // Print to sio the given statistics.
+  extern void printStats(const Stats& stats);
+
   // Get current error flag and clear it. 
   extern uint8 getAndClearErrorFlags();
   
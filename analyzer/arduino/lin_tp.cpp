@@ -0,0 +1,174 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "lin_tp.h"
+
+#include "passive_timer.h"
+
+namespace lin_tp {
+
+// Protocol control info types, in the high nibble of the PCI byte.
+namespace pci_types {
+  static const uint8 SINGLE_FRAME = 0x00;
+  static const uint8 FIRST_FRAME = 0x10;
+  static const uint8 CONSECUTIVE_FRAME = 0x20;
+}
+
+// Max number of message data bytes in each frame type.
+static const uint8 kSingleFrameMaxBytes = 6;
+static const uint8 kFirstFrameBytes = 5;
+static const uint8 kConsecutiveFrameBytes = 6;
+
+// Reassembly state of one direction.
+struct Channel {
+  // True while a multi frame message is in progress.
+  boolean active;
+  uint8 nad;
+  // Sequence number [0, 15] of the next consecutive frame.
+  uint8 next_sequence;
+  uint16 message_length;
+  // Number of message bytes delivered so far.
+  uint16 bytes_received;
+  // Time since the last frame of the message.
+  PassiveTimer timer;
+};
+
+// Indexed by the frame id, 0 for 0x3c, 1 for 0x3d.
+static Channel channels[2];
+
+static ChunkHandler chunk_handler;
+static AbortHandler abort_handler;
+
+void setup(ChunkHandler new_chunk_handler, AbortHandler new_abort_handler) {
+  chunk_handler = new_chunk_handler;
+  abort_handler = new_abort_handler;
+  channels[0].active = false;
+  channels[1].active = false;
+}
+
+static inline uint8 frameId(uint8 channel_index) {
+  return channel_index ? kSlaveResponseId : kMasterRequestId;
+}
+
+static void abort(uint8 channel_index, uint8 reason) {
+  Channel& channel = channels[channel_index];
+  channel.active = false;
+  if (abort_handler) {
+    abort_handler(frameId(channel_index), channel.nad, reason);
+  }
+}
+
+// Deliver num_bytes message bytes that start at the given frame byte index.
+static void deliver(uint8 channel_index, const LinFrame& frame, uint8 first_byte_index, 
+    uint8 num_bytes, uint16 offset) {
+  uint8 bytes[kConsecutiveFrameBytes];
+  for (uint8 i = 0; i < num_bytes; i++) {
+    bytes[i] = frame.get_byte(first_byte_index + i);
+  }
+  const Channel& channel = channels[channel_index];
+  Chunk chunk;
+  chunk.frame_id = frameId(channel_index);
+  chunk.nad = channel.nad;
+  chunk.message_length = channel.message_length;
+  chunk.offset = offset;
+  chunk.num_bytes = num_bytes;
+  chunk.bytes = bytes;
+  chunk_handler(chunk);
+}
+
+void loop() {
+  for (uint8 i = 0; i < ARRAY_SIZE(channels); i++) {
+    if (channels[i].active && 
+        channels[i].timer.timeMillis() >= kConsecutiveFrameTimeoutMillis) {
+      abort(i, abort_reasons::TIMEOUT);
+    }
+  }
+}
+
+void frameArrived(const LinFrame& frame) {
+  // One id byte, NAD, PCI, 6 more data bytes and checksum.
+  if (frame.num_bytes() != (1 + 8 + 1)) {
+    return;
+  }
+  const uint8 id = LinFrame::idFromPid(frame.get_byte(0));
+  if (id != kMasterRequestId && id != kSlaveResponseId) {
+    return;
+  } 
+  const uint8 nad = frame.get_byte(1);
+  // NAD 0 is the go to sleep command.
+  if (!nad) {
+    return;
+  }
+  const uint8 channel_index = (id == kSlaveResponseId) ? 1 : 0;
+  Channel& channel = channels[channel_index];
+  const uint8 pci = frame.get_byte(2);
+
+  switch (pci & 0xf0) {
+    case pci_types::SINGLE_FRAME: {
+      const uint8 length = pci & 0x0f;
+      if (!length || length > kSingleFrameMaxBytes) {
+        return;
+      }
+      if (channel.active) {
+        abort(channel_index, abort_reasons::NEW_MESSAGE);
+      }
+      channel.nad = nad;
+      channel.message_length = length;
+      deliver(channel_index, frame, 3, length, 0);
+      return;
+    }
+
+    case pci_types::FIRST_FRAME: {
+      const uint16 length = ((uint16)(pci & 0x0f) << 8) | frame.get_byte(3);
+      // Shorter messages use a single frame.
+      if (length <= kSingleFrameMaxBytes) {
+        return;
+      }
+      if (channel.active) {
+        abort(channel_index, abort_reasons::NEW_MESSAGE);
+      }
+      channel.active = true;
+      channel.nad = nad;
+      channel.next_sequence = 1;
+      channel.message_length = length;
+      channel.bytes_received = kFirstFrameBytes;
+      channel.timer.restart();
+      deliver(channel_index, frame, 4, kFirstFrameBytes, 0);
+      return;
+    }
+
+    case pci_types::CONSECUTIVE_FRAME: {
+      // Ignore frames of other slaves or with no message in progress.
+      if (!channel.active || nad != channel.nad) {
+        return;
+      }
+      if ((pci & 0x0f) != channel.next_sequence) {
+        abort(channel_index, abort_reasons::SEQUENCE);
+        return;
+      }
+      const uint16 bytes_left = channel.message_length - channel.bytes_received;
+      const uint8 num_bytes = (bytes_left < kConsecutiveFrameBytes) 
+          ? bytes_left : kConsecutiveFrameBytes;
+      const uint16 offset = channel.bytes_received;
+      channel.bytes_received += num_bytes;
+      channel.next_sequence = (channel.next_sequence + 1) & 0x0f;
+      channel.timer.restart();
+      if (channel.bytes_received >= channel.message_length) {
+        channel.active = false;
+      }
+      deliver(channel_index, frame, 3, num_bytes, offset);
+      return;
+    }
+  }
+}
+
+}  // namespace lin_tp
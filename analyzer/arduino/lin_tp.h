@@ -0,0 +1,74 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef LIN_TP_H
+#define LIN_TP_H
+
+#include "avr_util.h"
+#include "lin_frame.h"
+
+// A passive LIN transport layer (ISO 17987-2) reassembler for the 
+// diagnostic frames, master requests on id 0x3c and slave responses on id 
+// 0x3d. Single, first and consecutive frames are parsed incrementally and
+// the message data is delivered in frame size chunks to a handler, so long
+// transfers need no message buffer. Flow control is not used by LIN.
+namespace lin_tp {
+  // Frame ids of the diagnostic frames.
+  static const uint8 kMasterRequestId = 0x3c;
+  static const uint8 kSlaveResponseId = 0x3d;
+
+  // Max time between the consecutive frames of a message (N_Cr).
+  static const uint16 kConsecutiveFrameTimeoutMillis = 1000;
+
+  // A part of a message. The chunks of a message are delivered in order,
+  // the first one with offset 0 and the last one ending at message_length.
+  struct Chunk {
+    // kMasterRequestId or kSlaveResponseId.
+    uint8 frame_id;
+    // The node address of the slave.
+    uint8 nad;
+    // Total number of data bytes in the message, including the service id.
+    uint16 message_length;
+    // The offset in the message of the first byte of this chunk.
+    uint16 offset;
+    uint8 num_bytes;
+    const uint8* bytes;
+  };
+
+  // Reasons of an aborted message.
+  namespace abort_reasons {
+    // No consecutive frame within kConsecutiveFrameTimeoutMillis.
+    static const uint8 TIMEOUT = 1;
+    // A consecutive frame with an unexpected sequence number.
+    static const uint8 SEQUENCE = 2;
+    // A single or first frame started a new message.
+    static const uint8 NEW_MESSAGE = 3;
+  }
+
+  // Called for each chunk of message data.
+  typedef void (*ChunkHandler)(const Chunk& chunk);
+
+  // Called when a message ends before all its bytes were delivered.
+  typedef void (*AbortHandler)(uint8 frame_id, uint8 nad, uint8 reason);
+
+  // Call once in program setup. The abort handler may be NULL.
+  extern void setup(ChunkHandler chunk_handler, AbortHandler abort_handler);
+
+  // Call once per main loop(). Checks the consecutive frame timeouts.
+  extern void loop();
+
+  // Call with each valid recieved frame. Frames other than diagnostic frames
+  // with 8 data bytes are ignored.
+  extern void frameArrived(const LinFrame& frame);
+}  // namespace lin_tp
+
+#endif
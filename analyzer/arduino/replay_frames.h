@@ -0,0 +1,33 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REPLAY_FRAMES_H
+#define REPLAY_FRAMES_H
+
+#include <avr/pgmspace.h>
+#include "lin_generator.h"
+
+// The frames replayed by the generator with custom_defs::kUseReplay. 
+// Generated by tools/replay/capture_to_replay.py from an analyzer capture,
+// this one is a short example.
+namespace lin_generator {
+  static const ReplayFrame kReplayFrames[] PROGMEM = {
+    // delta ticks, id, n, data, errors.
+    { 12500, 0x0d, 8, { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88 }, 0 },
+    { 2500, 0x8e, 8, { 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, 0 },
+    { 2500, 0x39, 0, { 0 }, 0 },
+    { 2500, 0x0d, 8, { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88 }, 0 },
+    { 2500, 0x8e, 8, { 0x00, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, errors::CHECKSUM },
+  };
+}  // namespace lin_generator
+
+#endif
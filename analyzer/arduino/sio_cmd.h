@@ -0,0 +1,52 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SIO_CMD_H
+#define SIO_CMD_H
+
+#include "avr_util.h"
+
+// Text commands from the serial input, one per line, for changing settings
+// at runtime. A command is a single char name and up to kMaxArgs numeric 
+// arguments separated by spaces, decimal or hex with a 0x prefix. For 
+// example "a 0x8e 0" stops queueing the frames of id 0x8e. Lines are 
+// collected from the polled receiver, a byte at a time, so reading does not
+// block or disable interrupts. Requires custom_defs::kUseSerialCommands.
+//
+// Common commands:
+//   a <id> <0|1>  - reject or accept the frames of the given id.
+//   A <0|1>       - reject or accept the frames of all ids.
+//   b <baud>      - change the lin baud rate, fails in the middle of a frame.
+//   s             - print the lin processor stats.
+//
+// Other commands are passed to the handler of the application.
+namespace sio_cmd {
+  static const uint8 kMaxArgs = 6;
+
+  struct Command {
+    char name;
+    uint8 num_args;
+    uint16 args[kMaxArgs];
+  };
+
+  // Executes an application command. Returns false if the command is not
+  // known or its arguments are invalid.
+  typedef boolean (*CommandHandler)(const Command& command);
+
+  // Call once from main setup(), after sio::setup(). handler may be NULL.
+  extern void setup(CommandHandler handler);
+
+  // Call from the main loop().
+  extern void loop();
+}  // namespace sio_cmd
+
+#endif
@@ -19,14 +19,25 @@
 // Uses the hardware clock to provide a 32 bit milliseconds time since program start.
 // The 32 milliseconds time has about 54 days cycle time.
 namespace system_clock {
-  // Call once per main loop(). Updates the internal millis clock based on the hardware
-  // clock. A calling interval of larger than 280ms will result in loosing time due
-  // to hardware clock overflow.
+  // Call once per main loop(). Updates the internal millis clock based on the 32 bit
+  // hardware clock, so long calling intervals do not lose time (up to the ~4.7 hours 
+  // cycle of the 32 bit clock). Takes constant time, regardless of the interval.
   extern void loop();
 
   // Return time of last update() in millis since program start. Returns zero if update() was
   // never called. 
   extern uint32 timeMillis();
+
+  // Return time of last update() in micros since program start. Same update
+  // as timeMillis(), with the sub milli hardware clock ticks (4us resolution).
+  // Wraps around every ~71 minutes.
+  extern uint32 timeMicros();
+
+  // Millis since program start, for ISRs. Same time base as timeMillis(), 
+  // without waiting for the next update(): it is at least timeMillis() and 
+  // what timeMillis() would return after an update() now. 
+  // CALL THIS FROM ISR ONLY (or with interrupts disabled).
+  extern uint32 timeMillisForIsr();
  
 }  // namespace system_clock
 
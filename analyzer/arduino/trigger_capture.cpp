@@ -0,0 +1,230 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trigger_capture.h"
+
+#include "custom_defs.h"
+#include "sio.h"
+
+namespace trigger_capture {
+  namespace states {
+    static const uint8 ARMED = 1;
+    // Printing the kept frames and keeping the post trigger frames.
+    static const uint8 SENDING = 2;
+  }
+
+  static uint8 state;
+  static uint8 trigger_id;
+  static OutputHandler output_handler;
+  static uint8 output_record_bytes;
+
+  // Post trigger frames still to keep, and the ones that did not fit.
+  static uint8 post_frames_left;
+  static uint8 dropped_post_frames;
+
+  // True if the "trigger" line still needs to be printed.
+  static boolean trigger_line_pending;
+
+  // ----- Frame Ring -----
+  //
+  // The kept frames, oldest first. Each frame is a header byte with the
+  // number of frame bytes in bits [3:0], the channel in bit 4 and the
+  // validity in bit 5, followed by the sequence byte, the 4 bytes of break
+  // ticks, the 2 bytes of break to end ticks and the frame bytes. As the
+  // lin processor's packed frame ring, records wrap around the end of the
+  // buffer and one byte is always free. Used by main only.
+  namespace ring {
+    static const uint8 kMaxRecordBytes = 1 + 1 + 4 + 2 + LinFrame::kMaxBytes;
+    static const uint16 kSize = custom_defs::kUseTriggerCapture
+        ? custom_defs::kTriggerPreFrames * kMaxRecordBytes + 1 : 1;
+    typedef char NoPreFrames[custom_defs::kTriggerPreFrames ? 1 : -1];
+
+    static const uint8 kValidFlag = H(5);
+
+    static uint8 bytes[kSize];
+    static uint16 head;
+    static uint16 tail;
+    static uint8 num_frames;
+
+    static inline uint16 next(uint16 i) {
+      return (i + 1 < kSize) ? i + 1 : 0;
+    }
+
+    static inline uint16 used() {
+      return (head >= tail) ? head - tail : kSize - (tail - head);
+    }
+
+    // Drop the oldest frame. Call only if num_frames > 0.
+    static void dropOldest() {
+      const uint8 n = bytes[tail] & 0x0f;
+      tail += 1 + 1 + 4 + 2 + n;
+      if (tail >= kSize) {
+        tail -= kSize;
+      }
+      num_frames--;
+    }
+
+    static inline void put(uint8 b) {
+      bytes[head] = b;
+      head = next(head);
+    }
+
+    static inline uint8 get() {
+      const uint8 b = bytes[tail];
+      tail = next(tail);
+      return b;
+    }
+
+    // Append a frame. Returns false if there is no room.
+    static boolean push(const LinFrame& frame, boolean is_valid) {
+      const uint8 n = frame.num_bytes();
+      if (used() + 1 + 1 + 4 + 2 + n >= kSize) {
+        return false;
+      }
+      put(n | (frame.channel() << 4) | (is_valid ? kValidFlag : 0));
+      put(frame.seq());
+      const uint32 break_ticks = frame.break_ticks();
+      put(break_ticks);
+      put(break_ticks >> 8);
+      put(break_ticks >> 16);
+      put(break_ticks >> 24);
+      const uint16 duration = frame.end_ticks() - break_ticks;
+      put(duration);
+      put(duration >> 8);
+      for (uint8 i = 0; i < n; i++) {
+        put(frame.get_byte(i));
+      }
+      num_frames++;
+      return true;
+    }
+
+    // Remove the oldest frame into *frame. Call only if num_frames > 0.
+    // Returns its validity.
+    static boolean pop(LinFrame* frame) {
+      const uint8 header = get();
+      frame->reset();
+      frame->set_channel((header >> 4) & 1);
+      frame->set_seq(get());
+      uint32 break_ticks = get();
+      break_ticks |= (uint32)get() << 8;
+      break_ticks |= (uint32)get() << 16;
+      break_ticks |= (uint32)get() << 24;
+      uint16 duration = get();
+      duration |= get() << 8;
+      frame->set_break_ticks(break_ticks);
+      frame->set_end_ticks(break_ticks + duration);
+      for (uint8 i = 0; i < (header & 0x0f); i++) {
+        frame->append_byte(get());
+      }
+      num_frames--;
+      return header & kValidFlag;
+    }
+  }
+
+  void setup(OutputHandler handler, uint8 max_record_bytes) {
+    output_handler = handler;
+    output_record_bytes = max_record_bytes;
+    setTriggerId(custom_defs::kTriggerId);
+    state = states::ARMED;
+  }
+
+  static void trigger() {
+    if (!custom_defs::kUseTriggerCapture || state != states::ARMED) {
+      return;
+    }
+    post_frames_left = custom_defs::kTriggerPostFrames;
+    dropped_post_frames = 0;
+    trigger_line_pending = true;
+    state = states::SENDING;
+  }
+
+  void errorsArrived(uint8 error_flags) {
+    if (custom_defs::kTriggerOnErrors && (error_flags & kTriggerErrors)) {
+      trigger();
+    }
+  }
+
+  // True if the frame is a trigger frame.
+  static inline boolean isTrigger(const LinFrame& frame, boolean is_valid) {
+    if (!is_valid) {
+      return custom_defs::kTriggerOnErrors;
+    }
+    if (trigger_id == kNoId || LinFrame::idFromPid(frame.get_byte(0)) != trigger_id) {
+      return false;
+    }
+    const uint8 index = custom_defs::kTriggerByteIndex;
+    // A zero mask matches any frame of the id, including header only ones.
+    if (!custom_defs::kTriggerMask) {
+      return true;
+    }
+    return index < frame.num_bytes() - 1
+        && (frame.get_byte(index) & custom_defs::kTriggerMask)
+            == custom_defs::kTriggerValue;
+  }
+
+  void frameArrived(const LinFrame& frame, boolean is_valid) {
+    if (!custom_defs::kUseTriggerCapture) {
+      return;
+    }
+    if (state == states::SENDING) {
+      if (!post_frames_left) {
+        return;
+      }
+      post_frames_left--;
+      if (!ring::push(frame, is_valid) && dropped_post_frames != 0xff) {
+        dropped_post_frames++;
+      }
+      return;
+    }
+    // Keep the last kTriggerPreFrames frames, dropping the oldest ones also
+    // to make room. An empty ring has room for any frame.
+    while (ring::num_frames >= custom_defs::kTriggerPreFrames) {
+      ring::dropOldest();
+    }
+    while (!ring::push(frame, is_valid)) {
+      ring::dropOldest();
+    }
+    if (isTrigger(frame, is_valid)) {
+      trigger();
+    }
+  }
+
+  void setTriggerId(uint8 id) {
+    trigger_id = (id == kNoId) ? kNoId : LinFrame::idFromPid(id);
+  }
+
+  void loop() {
+    if (!custom_defs::kUseTriggerCapture || state != states::SENDING) {
+      return;
+    }
+    if (trigger_line_pending) {
+      if (!sio::beginRecord(16)) {
+        return;
+      }
+      sio::out << F("trigger ") << ring::num_frames << '\n';
+      trigger_line_pending = false;
+    }
+    while (ring::num_frames && sio::capacity() >= output_record_bytes) {
+      static LinFrame frame;
+      const boolean is_valid = ring::pop(&frame);
+      output_handler(frame, is_valid);
+    }
+    if (ring::num_frames || post_frames_left) {
+      return;
+    }
+    if (!sio::beginRecord(24)) {
+      return;
+    }
+    sio::out << F("trigger end dropped=") << dropped_post_frames << '\n';
+    state = states::ARMED;
+  }
+}  // namespace trigger_capture
@@ -0,0 +1,68 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TRIGGER_CAPTURE_H
+#define TRIGGER_CAPTURE_H
+
+#include "avr_util.h"
+#include "lin_frame.h"
+#include "lin_processor.h"
+
+// Pre/post trigger frame capture, for watching the frames around a rare
+// event without streaming the whole bus. The frames are not printed as they
+// arrive. Instead the last custom_defs::kTriggerPreFrames of them are kept
+// in a RAM ring, packed as in the lin processor's packed frame ring, and
+// when the trigger fires a "trigger" line is printed, followed by the kept
+// frames and the next kTriggerPostFrames frames, in the current output
+// format. A "trigger end" line with the number of post trigger frames that
+// did not fit in the ring closes the window, and the capture is armed again.
+// There is no serial output while armed. Frames of ids rejected by the lin
+// processor id filter (lin_processor::acceptId()) are never captured.
+//
+// The capture is triggered by a valid frame of the trigger id whose data
+// byte custom_defs::kTriggerByteIndex matches kTriggerValue in the bits of
+// kTriggerMask, and with kTriggerOnErrors also by invalid frames and the
+// lin processor errors of kTriggerErrors.
+//
+// Enabled with custom_defs::kUseTriggerCapture.
+namespace trigger_capture {
+  // The lin processor errors that trigger a capture with
+  // custom_defs::kTriggerOnErrors.
+  static const uint8 kTriggerErrors = lin_processor::errors::START_BIT
+      | lin_processor::errors::STOP_BIT | lin_processor::errors::SYNC_BYTE;
+
+  // The trigger id value of no id trigger.
+  static const uint8 kNoId = 0xff;
+
+  // Prints a captured frame. Called only when the serial output has room
+  // for a record of the max_record_bytes passed to setup().
+  typedef void (*OutputHandler)(const LinFrame& frame, boolean is_valid);
+
+  // Call once from main setup(). max_record_bytes is the max size of a
+  // frame printed by the handler.
+  extern void setup(OutputHandler handler, uint8 max_record_bytes);
+
+  // Call from the main loop(). Prints the captured frames as the serial
+  // output has room.
+  extern void loop();
+
+  // Call with the lin processor error flags of each main loop iteration.
+  extern void errorsArrived(uint8 error_flags);
+
+  // Call for each received frame, instead of printing it.
+  extern void frameArrived(const LinFrame& frame, boolean is_valid);
+
+  // Set the 6 bit id whose frames trigger a capture, or kNoId.
+  extern void setTriggerId(uint8 id);
+}  // namespace trigger_capture
+
+#endif
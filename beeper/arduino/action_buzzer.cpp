@@ -13,7 +13,8 @@
 #include "action_buzzer.h"
 
 #include "avr_util.h"
-#include "passive_timer.h"
+#include "hardware_clock.h"
+#include "io_pins.h"
 
 namespace action_buzzer {
   // 2400Hz is the resonance frequency of Soberton WT-1205.
@@ -23,7 +24,7 @@ namespace action_buzzer {
   static const uint8 kDivider = (16000000L / 256) / kFrequency;
 
   // Output is OC0B from timer 0 (same as PD5).
-  static const uint8 kPinMask =  H(PIND5);
+  typedef io_pins::Pin<io_pins::PortD, 5> buzzer_pin;
 
   // Even index slots are ON, odd index slots are off. Values are
   // slot time in millis
@@ -50,58 +51,87 @@ namespace action_buzzer {
     3000, 
     0,   // end 
   };
-  
-  static inline uint16 slotTimeMillis(uint8 sequence, uint8 slot_index) {
-    if (sequence == 1) {
-      return pgm_read_word(&kSlotTimesMillis1[slot_index]);
-    }
-    return pgm_read_word(&kSlotTimesMillis2[slot_index]);
-  }
 
-  // Action buzzer variables.
-  static PassiveTimer timer;
-  static boolean pending_actions;
+  struct Pattern {
+    // Slot times in program memory, see kSlotTimesMillis1.
+    const uint16* slot_times_millis;
+    // The pattern to play next while this pattern is still requested.
+    uint8 next_pattern;
+  };
 
-  // State of the sequence playing logic. Can be active (true) or idle (false).
-  static boolean state_is_active;
+  // Indexed by patterns. 
+  static const Pattern kPatterns[] PROGMEM = {
+    { kSlotTimesMillis2, patterns::NONE },  // NONE, never played.
+    { kSlotTimesMillis1, patterns::REVERSE_REPEAT },
+    { kSlotTimesMillis2, patterns::REVERSE_REPEAT },
+  };
 
-  // When in active state, indicates the current sequence we are playing (1 or 2).
-  static uint8 active_sequence_number;
-  
-  // When state is active, indicates the index of the current slot
-  static uint8 active_slot_index;
+  typedef char PatternsTableSize[(ARRAY_SIZE(kPatterns) == patterns::kNumPatterns) ? 1 : -1];
+
+  // The state below is shared by the ISR and the main, which updates it 
+  // with interrupts disabled.
+
+  // The last requested pattern, NONE if none. Cleared when a pattern ends,
+  // so the main needs to request it again to continue.
+  static volatile uint8 pending_pattern;
+
+  // The pattern that started the current sequence of patterns, NONE when
+  // idle.
+  static uint8 requested_pattern;
+
+  // The pattern being played and the time in the slots table of the 
+  // current slot, in program memory.
+  static uint8 active_pattern;
+  static const uint16* active_slot;
+
+  // Hardware clock ticks of the end of the current slot. 
+  static uint32 slot_end_ticks;
 
   // Turn buzzer on.
-  void buzzerOn() {
+  static inline void buzzerOn() {
     // Clear timer so we will get a nice first pules.
     TCNT0 = 0;
     // Enabled timer output on PD5.
     TCCR0A |=  H(COM0B1) | H(COM0B0) ;
     // Make sure PD5 is output.
-    DDRD |= kPinMask;  
+    buzzer_pin::setupOutput(false);
   }
 
   // Turn buzzer off.
-  void buzzerOff() {
+  static inline void buzzerOff() {
     // Disable timer output
     TCCR0A &=  ~(H(COM0B1) | H(COM0B0)); 
     // Make sure PD5 is output and force low.
-    DDRD |= kPinMask; 
-    PORTD &= ~kPinMask;  
+    buzzer_pin::setupOutput(false);
   }
 
-  inline void enterIdleState() {
-    state_is_active = false;
+  // Arms the compare interrupt at the end of the current slot. Slots longer 
+  // than the 16 bit timer cycle get interrupts at each cycle until their 
+  // end. Called with interrupts disabled.
+  static inline void armSlotEnd() {
+    OCR1A = (uint16)slot_end_ticks;
+    TIFR1 = H(OCF1A);
+    TIMSK1 |= H(OCIE1A);
+  }
+
+  // Called with interrupts disabled. 
+  static inline void enterIdleState() {
+    TIMSK1 &= ~H(OCIE1A);
+    requested_pattern = patterns::NONE;
+    active_pattern = patterns::NONE;
     buzzerOff();
   }
 
-  inline void enterActiveState() {
-    state_is_active = true;
-    active_sequence_number = 1;
-    active_slot_index = 0;
-    timer.restart();
+  // Start playing the first slot, which is always on, of the given pattern
+  // at the given time. Called with interrupts disabled.
+  static inline void startPattern(uint8 pattern, uint32 start_ticks) {
+    active_pattern = pattern;
+    active_slot = (const uint16*)pgm_read_word(&kPatterns[pattern].slot_times_millis);
+    slot_end_ticks = start_ticks + 
+        (uint32)pgm_read_word(active_slot) * hardware_clock::kTicksPerMilli;
+    armSlotEnd();
     buzzerOn();
-  } 
+  }
 
   void setup() {
     // Fast PWM mode, OC2B output active high.
@@ -120,32 +150,27 @@ namespace action_buzzer {
 
     enterIdleState();
   }
-  
-  // Called from loop() when in IDLE state.
-  static inline void loopInIdleState() {
-    if (pending_actions) {
-      enterActiveState();
-     pending_actions = false;
-    }  
-  }
-  
-  // Called from loop() when in ACTIVE state.
-  static inline void loopInActiveState() {
-    // If within current slot time then do nothing.
-    const uint16 slot_time_millis = slotTimeMillis(active_sequence_number, active_slot_index);
-    if (timer.timeMillis() < slot_time_millis) {
+
+  // Slot transitions. The next slot starts at the end time of the current
+  // one rather than at the interrupt time, so the cadence does not drift.
+  ISR(TIMER1_COMPA_vect) {
+    if ((int32)(hardware_clock::ticks32ForIsr() - slot_end_ticks) < 0) {
+      // A timer cycle of a long slot.
       return;
     }
     
     // Advance to next slot.
-    timer.restart();
-    active_slot_index++;
-    const uint16 next_slot_time_millis = slotTimeMillis(active_sequence_number, active_slot_index);
+    active_slot++;
+    const uint16 next_slot_time_millis = pgm_read_word(active_slot);
         
     // If this is a normal slot, start playing it.
     if (next_slot_time_millis) {
+      slot_end_ticks += (uint32)next_slot_time_millis * hardware_clock::kTicksPerMilli;
+      armSlotEnd();
       // Odd slots are off, even are on.
-      if (active_slot_index & 0x1) {
+      const uint8 slot_index = active_slot - 
+          (const uint16*)pgm_read_word(&kPatterns[active_pattern].slot_times_millis);
+      if (slot_index & 0x1) {
         buzzerOff();    
       } 
       else {
@@ -154,40 +179,45 @@ namespace action_buzzer {
       return;
     }
        
-    // Here when we reached a terminator slot at the end of the sequence. 
-    
-    // If there are pending action, start a new sequence.
-    if (pending_actions) {
-      // Stay in active state and start another cycle.
-      pending_actions = false;
-      // We play sequence 1 once and then switch to sequence 2.
-      active_sequence_number = 2;
-      active_slot_index = 0;
-      // First slot is always on (even index).
-      buzzerOn();
+    // Here when we reached a terminator slot at the end of the pattern. 
+    const uint8 pending = pending_pattern;
+    pending_pattern = patterns::NONE;
+
+    // If the same pattern is still requested, continue with the next
+    // pattern. A different pattern starts over.
+    if (pending != patterns::NONE) {
+      if (pending == requested_pattern) {
+        startPattern(pgm_read_byte(&kPatterns[active_pattern].next_pattern), slot_end_ticks);
+      } else {
+        requested_pattern = pending;
+        startPattern(pending, slot_end_ticks);
+      }
       return;
     } 
       
-    // Here when at end of sequence and no pending action. Switch
+    // Here when at end of pattern and no pending action. Switch
     // to off state.
     enterIdleState();
   }
- 
-  // Called periodically from main loop() to do the state transitions. 
-  void loop() {
-    if (state_is_active) {
-      loopInActiveState();
-    } else {
-      loopInIdleState();
-    }
-  }
 
-  void action(boolean flag) {
-    pending_actions = flag;
+  void action(uint8 pattern) {
+    if (pattern >= patterns::kNumPatterns) {
+      pattern = patterns::NONE;
+    }
+    pending_pattern = pattern;
     
-    // If negative action, abort buzzer immedielty. 
-    if (!flag) {
-      enterIdleState();  
+    // If negative action, abort buzzer immedielty. Otherwise start playing
+    // if idle, the ISR takes it from there.
+    if (pattern == patterns::NONE) {
+      cli();
+      enterIdleState();
+      sei();
+    } else if (requested_pattern == patterns::NONE) {
+      cli();
+      pending_pattern = patterns::NONE;
+      requested_pattern = pattern;
+      startPattern(pattern, hardware_clock::ticks32ForIsr());
+      sei();
     }
   }
 
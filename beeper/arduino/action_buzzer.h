@@ -16,18 +16,28 @@
 #include <arduino.h>
 #include "avr_util.h"
 
-// Controlled the buzzer signal on OC0B/PD5 pin. Uses timer 0.
+// Controlled the buzzer signal on OC0B/PD5 pin. Uses timer 0 for the tone
+// and the timer 1 compare A interrupt for the pattern timing, so the 
+// cadence does not depend on the main loop.
 namespace action_buzzer {
+  // Named buzzer patterns, the indexes of the pattern table. 
+  namespace patterns {
+    static const uint8 NONE = 0;
+    // Reverse gear, five beeps.
+    static const uint8 REVERSE = 1;
+    // Reverse gear, played after REVERSE while still requested.
+    static const uint8 REVERSE_REPEAT = 2;
+    static const uint8 kNumPatterns = 3;
+  }
+
   // Call once from main setup(). Buzzer starts in off state.
   extern void setup();
 
-  // Call from each main loop().
-  extern void loop();
-
-  // Buzzer wil keep beeping as long as this is called with true.
-  // Calling with false  cancels pending actions.
-  extern void action(boolean flag);  
-}  // namespace hardware_clock
+  // Buzzer will keep playing the pattern as long as this is called with 
+  // it, following the pattern with its continuation pattern. Calling with 
+  // patterns::NONE cancels pending actions and stops the buzzer.
+  extern void action(uint8 pattern);  
+}  // namespace action_buzzer
 
 #endif  
 
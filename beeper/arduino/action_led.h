@@ -17,14 +17,18 @@
 #include "io_pins.h"
 #include "passive_timer.h"
 
-// Wrapes an OutputPin with logic to blick an LED while some events occur. Design
+// Wrapes an io_pins::Pin with logic to blick an LED while some events occur. Design
 // to be visible regardless of the event frequency and duration.
-// Requires loop() calls from main loop().
+// Requires loop() calls from main loop(). LedPin is the io_pins::Pin of the
+// led, active high. For example
+//
+//   static ActionLed<io_pins::Pin<io_pins::PortB, 0> > frames_led;
+template <class LedPin>
 class ActionLed {
 public:
-  ActionLed(volatile uint8& port, uint8 bitIndex) 
-    : led_(port, bitIndex),
-      pending_actions_(false) {
+  ActionLed() 
+    : pending_actions_(false) {
+    LedPin::setupOutput(false);
     enterIdleState();
   }
   
@@ -66,9 +70,6 @@ private:
    static const uint8 kState_ACTIVE_OFF = 3; 
    uint8 state_; 
   
-  // The underlying pin of the led. Active high.
-  io_pins::OutputPin led_;
-  
   // A timer for the ACtIVE_ON and ACTIVE_OFF periods.
   PassiveTimer timer_;
   
@@ -77,19 +78,19 @@ private:
   
   inline void enterIdleState() {
     state_ = kState_IDLE;
-    led_.low();
+    LedPin::setLow();
   }
   
   inline void enterActiveOnState() {
     state_ = kState_ACTIVE_ON;
-    led_.high();
+    LedPin::setHigh();
     timer_.restart();
     
   }
   
   inline void enterActiveOffState() {
     state_ = kState_ACTIVE_OFF;
-    led_.low();
+    LedPin::setLow();
     timer_.restart();
   }
 };
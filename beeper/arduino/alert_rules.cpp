@@ -0,0 +1,146 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "alert_rules.h"
+
+#include <avr/pgmspace.h>
+#include "action_buzzer.h"
+#include "custom_config.h"
+#include "custom_signals.h"
+
+namespace alert_rules {
+  struct Rule {
+    // The bytecode, in program memory.
+    const uint8* program;
+    // The buzzer pattern while the rule is true, one of action_buzzer::patterns.
+    uint8 pattern;
+  };
+
+  // Reverse gear engaged, with the feature enabled.
+  static const uint8 kReverseProgram[] PROGMEM = {
+    ops::ON, inputs::REVERSE_GEAR,
+    ops::ON, inputs::ENABLED,
+    ops::AND,
+    ops::END,
+  };
+
+  // In priority order.
+  static const Rule kRules[] PROGMEM = {
+    { kReverseProgram, action_buzzer::patterns::REVERSE },
+  };
+
+  // The input states, 2 bits per input, at the last evaluation.
+  static uint8 last_input_states = 0xff;
+
+  // The pattern of the first true rule, NONE if none.
+  static uint8 active_pattern = action_buzzer::patterns::NONE;
+
+  typedef char InputStatesFitInByte[(inputs::kNumInputs <= 4) ? 1 : -1];
+
+  static inline uint8 inputState(uint8 input) {
+    switch (input) {
+      case inputs::IGNITION:
+        return custom_signals::ignition_state().state();
+      case inputs::CONFIG_BUTTON:
+        return custom_signals::config_button().state();
+      case inputs::REVERSE_GEAR:
+        return custom_signals::reverse_gear().state();
+      case inputs::ENABLED:
+        return custom_config::is_enabled() ? SignalTracker::States::ON : SignalTracker::States::OFF;
+    }
+    return SignalTracker::States::UNKNOWN;
+  }
+
+  static inline uint8 readInputStates() {
+    uint8 result = 0;
+    for (uint8 i = 0; i < inputs::kNumInputs; i++) {
+      result |= inputState(i) << (i * 2);
+    }
+    return result;
+  }
+
+  // Runs a program with the given input states. The stack is a bit per
+  // value, the top at bit 0.
+  static boolean evaluate(const uint8* program, uint8 input_states) {
+    uint8 stack = 0;
+    uint8 depth = 0;
+    for (uint8 i = 0; i < kMaxProgramBytes; i++) {
+      const uint8 op = pgm_read_byte(&program[i]);
+      switch (op) {
+        case ops::END:
+          return depth && (stack & 0x01);
+
+        case ops::ON:
+        case ops::OFF:
+        case ops::UNKNOWN: {
+          if (++i >= kMaxProgramBytes || depth >= 8) {
+            return false;
+          }
+          const uint8 input = pgm_read_byte(&program[i]);
+          if (input >= inputs::kNumInputs) {
+            return false;
+          }
+          const uint8 state = (input_states >> (input * 2)) & 0x03;
+          const uint8 expected = (op == ops::ON) ? SignalTracker::States::ON 
+              : (op == ops::OFF) ? SignalTracker::States::OFF : SignalTracker::States::UNKNOWN;
+          stack = (stack << 1) | (state == expected);
+          depth++;
+          break;
+        }
+
+        case ops::AND:
+        case ops::OR: {
+          if (depth < 2) {
+            return false;
+          }
+          const uint8 a = stack & 0x01;
+          stack >>= 1;
+          stack = (op == ops::AND) ? ((stack & ~0x01) | (stack & a)) : (stack | a);
+          depth--;
+          break;
+        }
+
+        case ops::NOT:
+          if (!depth) {
+            return false;
+          }
+          stack ^= 0x01;
+          break;
+
+        default:
+          return false;
+      }
+    }
+    return false;
+  }
+
+  void loop() {
+    const uint8 input_states = readInputStates();
+    const uint8 old_pattern = active_pattern;
+    if (input_states != last_input_states) {
+      last_input_states = input_states;
+      active_pattern = action_buzzer::patterns::NONE;
+      for (uint8 i = 0; i < ARRAY_SIZE(kRules); i++) {
+        const uint8* const program = (const uint8*)pgm_read_word(&kRules[i].program);
+        if (evaluate(program, input_states)) {
+          active_pattern = pgm_read_byte(&kRules[i].pattern);
+          break;
+        }
+      }
+    }
+
+    // The buzzer keeps playing while the pattern is requested. 
+    if (active_pattern != action_buzzer::patterns::NONE || active_pattern != old_pattern) {
+      action_buzzer::action(active_pattern);
+    }
+  }
+}  // namespace alert_rules
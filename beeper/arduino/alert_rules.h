@@ -0,0 +1,68 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef ALERT_RULES_H
+#define ALERT_RULES_H
+
+#include "avr_util.h"
+
+// Selects the buzzer pattern from a table of rules over the signal states.
+// A rule is a short bytecode program in program memory that combines 
+// input states with AND, OR and NOT, for example reverse gear AND enabled:
+//
+//   static const uint8 kReverseProgram[] PROGMEM = {
+//     ops::ON, inputs::REVERSE_GEAR,
+//     ops::ON, inputs::ENABLED,
+//     ops::AND,
+//     ops::END,
+//   };
+//
+// The rules are evaluated only when an input state changes, at most 
+// kMaxProgramBytes per rule. The first rule that is true, in table order, 
+// selects the buzzer pattern. New alerts need only new table rows.
+//
+// Like all the other custom_* files, the rules table in the .cpp file 
+// should be adapted to the specific application.
+namespace alert_rules {
+  // Rule inputs. Each has a SignalTracker::States state.
+  namespace inputs {
+    static const uint8 IGNITION = 0;
+    static const uint8 CONFIG_BUTTON = 1;
+    static const uint8 REVERSE_GEAR = 2;
+    // The feature enable bit of custom_config, ON or OFF.
+    static const uint8 ENABLED = 3;
+    static const uint8 kNumInputs = 4;
+  }
+
+  // Bytecode operations. ON, OFF and UNKNOWN are followed by an input and
+  // push true if the input is in that state. The other operations combine
+  // the top of the stack. END returns the top of the stack.
+  namespace ops {
+    static const uint8 END = 0;
+    static const uint8 ON = 1;
+    static const uint8 OFF = 2;
+    static const uint8 UNKNOWN = 3;
+    static const uint8 AND = 4;
+    static const uint8 OR = 5;
+    static const uint8 NOT = 6;
+  }
+
+  // A program that is longer, overflows the stack of 8 values or has a bad
+  // operation evaluates to false.
+  static const uint8 kMaxProgramBytes = 16;
+
+  // Call from the main loop(). Evaluates the rules if an input changed 
+  // and keeps the buzzer playing the pattern of the active rule.
+  extern void loop();
+}  // namespace alert_rules
+
+#endif
@@ -10,9 +10,13 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <avr/sleep.h>
+
 #include "action_led.h"
 #include "avr_util.h"
+#include "custom_defs.h"
 #include "custom_module.h"
+#include "custom_signals.h"
 #include "hardware_clock.h"
 #include "io_pins.h"
 #include "lin_processor.h"
@@ -20,16 +24,16 @@
 #include "system_clock.h"
 
 // ERRORS LED - blinks when detecting errors.
-static ActionLed errors_activity_led(PORTB, 1);
+static ActionLed<io_pins::Pin<io_pins::PortB, 1> > errors_activity_led;
 
 // Arduino setup function. Called once during initialization.
 void setup()
 {
-  // Hard coded to 115.2k baud. Uses URART0, no interrupts.
+  // Baud rate is custom_defs::kSioBaud. Uses URART0, no interrupts.
   // Initialize this first since some setup methods uses it.
   sio::setup();
 
-  // Uses Timer1, no interrupts.
+  // Uses Timer1, overflow interrupt only.
   hardware_clock::setup();
 
   // Uses Timer2 with interrupts, and a few i/o pins. See source code for details.
@@ -42,6 +46,45 @@ void setup()
   sei(); 
 }
 
+// Max number of frames handled per main loop iteration, to bound the time
+// between the other loop tasks.
+static const uint8 kMaxFramesPerLoop = 4;
+
+// Handle a recieved LIN frame. Called by lin_processor::drainFrames(), the 
+// frame is borrowed from the lin processor queue, no copy.
+static void handleFrame(const LinFrame& frame) {
+  const boolean frameOk = frame.isValid();
+  
+  if (!frameOk) {
+    // Make the ERRORS frame blinking.
+    errors_activity_led.action();
+  }
+  
+  // Print frame to serial port.
+  for (int i = 0; i < frame.num_bytes(); i++) {
+    if (i > 0) {
+      sio::printchar(' ');  
+    }
+    sio::printhex2(frame.get_byte(i));  
+  }
+  if (!frameOk) {
+    sio::print(F(" ERR"));
+  }
+  sio::println();  
+
+  if (frameOk) {
+    // Inform the custom logic about the incoming frame.
+    custom_module::frameArrived(frame);
+  }
+
+  // The master commands the cluster to sleep, no need to wait for the 
+  // bus silence.
+  if (custom_defs::kUseBusSleep && frameOk && frame.isGoToSleep()) {
+    sio::println(F("bus sleep (go-to-sleep)"));
+    lin_processor::enterBusSleep();
+  }
+}
+
 // Arduino loop() method. Called after setup(). Never returns.
 // This is a quick loop that does not use delay() or other busy loops or 
 // blocking calls.
@@ -56,6 +99,33 @@ void loop()
     errors_activity_led.loop();  
     custom_module::loop();
 
+    // Sleep while the bus is silent. Any interrupt, e.g. the next break on 
+    // the bus or the hardware clock overflow, resumes the loop. The edge 
+    // engine has no bit sampling interrupt to stop.
+    static PassiveTimer bus_silence_timer;
+    static boolean was_bus_sleeping = false;
+    if (custom_defs::kUseBusSleep && !custom_defs::kUseEdgeRxEngine) {
+      const boolean is_bus_sleeping = lin_processor::isBusSleeping();
+      // Woke up by a break or a wake up pulse. Allow the master the full 
+      // silence time to start sending frames.
+      if (was_bus_sleeping && !is_bus_sleeping) {
+        sio::println(F("bus wake-up"));
+        bus_silence_timer.restart();
+      }
+      was_bus_sleeping = is_bus_sleeping;
+      if (!is_bus_sleeping) {
+        const uint16 silence_millis = custom_signals::ignition_state().isOff() 
+            ? custom_defs::kBusSleepIgnitionOffMillis : custom_defs::kBusSleepSilenceMillis;
+        if (bus_silence_timer.timeMillis() >= silence_millis) {
+          sio::println(F("bus sleep"));
+          lin_processor::enterBusSleep();
+        }
+      } else if (sio::isEmpty()) {
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        sleep_mode();
+      }
+    }
+
     // Print a periodic text messages if no activiy.
     static PassiveTimer idle_timer;
     if (idle_timer.timeMillis() >= 5000) {
@@ -88,34 +158,11 @@ void loop()
       }
     }
 
-    // Handle recieved LIN frames.
-    LinFrame frame;
-    if (lin_processor::readNextFrame(&frame)) {
-      const boolean frameOk = frame.isValid();
-      
-      if (!frameOk) {
-        // Make the ERRORS frame blinking.
-        errors_activity_led.action();
-      }
-      
-      // Print frame to serial port.
-      for (int i = 0; i < frame.num_bytes(); i++) {
-        if (i > 0) {
-          sio::printchar(' ');  
-        }
-        sio::printhex2(frame.get_byte(i));  
-      }
-      if (!frameOk) {
-        sio::print(F(" ERR"));
-      }
-      sio::println();  
+    // Handle recieved LIN frames, a burst per iteration.
+    if (lin_processor::drainFrames(handleFrame, kMaxFramesPerLoop)) {
       // Supress the 'waiting' messages.
       idle_timer.restart(); 
-    
-      if (frameOk) {
-        // Inform the custom logic about the incoming frame.
-        custom_module::frameArrived(frame);
-      }
+      bus_silence_timer.restart();
     }
   }
 }
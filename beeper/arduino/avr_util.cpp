@@ -29,3 +29,12 @@ const byte kBitMaskArray[] = {
 
 }  // namespace avr_util_private
 
+uint8 crc8(const uint8* bytes, uint8 num_bytes) {
+  uint8 crc = 0;
+  for (uint8 i = 0; i < num_bytes; i++) {
+    crc = crc8Update(crc, bytes[i]);
+  }
+  return crc;
+}
+
+
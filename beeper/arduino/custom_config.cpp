@@ -60,7 +60,7 @@ namespace custom_config {
 
     // If the code is unknown we default to enabled.
     private_::is_enabled = eeprom_code != eeprom_uint16_code::DISABLED;
-    sio::printf(F("config loaded: %d\n"), private_::is_enabled);
+    sio::out << F("config loaded: ") << private_::is_enabled << '\n';
   }
 
   // Toggle the current configuration, with eeprom persistnce.
@@ -68,7 +68,7 @@ namespace custom_config {
     // Toggle the eeprom code.
     const uint16 eeprom_code = (private_::is_enabled) ? eeprom_uint16_code::DISABLED : eeprom_uint16_code::ENABLED;
     eeprom_write_word(0, eeprom_code);
-    sio::printf(F("config toggled\n"));
+    sio::println(F("config toggled"));
 
     // TODO: if the writing failed surface an error condition.
 
@@ -80,7 +80,7 @@ namespace custom_config {
   // Change to given state. Assumes not already in this state.
   static inline void changeToState(uint8 new_state) {
     state = new_state;
-    sio::printf(F("config state: %d\n"), state);
+    sio::out << F("config state: ") << state << '\n';
     time_in_state.restart();
   }
 
@@ -126,7 +126,7 @@ namespace custom_config {
           if ((button_last_state == SignalTracker::States::OFF) && (button_new_state == SignalTracker::States::ON)) {
             // This cannot overflow because we exist this state if exceeding kExpectedButtonClicks. 
             button_click_count++;
-            sio::printf(F("config state: %d.%d\n"), states::IGNITION_ON_COUNTING, button_click_count);
+            sio::out << F("config state: ") << states::IGNITION_ON_COUNTING << '.' << button_click_count << '\n';
           }
           button_last_state = button_new_state;
         }
@@ -145,7 +145,7 @@ namespace custom_config {
 
       // Unknown state, set to initial.
       default:
-        sio::printf(F("config state: unknown (%d)"), state);
+        sio::out << F("config state: unknown (") << state << ')';
         // Go to a default state and wait there until ignition is off.
         changeToState(states::IGNITION_ON_IDLE);
         break;
@@ -22,12 +22,120 @@
 namespace custom_defs {
 
   // True for LIN checksum V2 (enahanced). False for LIN checksum version 1.
+  // This is the model of ids whose model was not preset or learned yet 
+  // (see LinFrame::setChecksumModel()).
   const boolean kUseLinChecksumVersion2 = true;
 
+  // If true, the checksum model (classic or enhanced) of each id is learned
+  // from the first frame of that id that validates under one of them. 
+  // Diagnostic ids 0x3c, 0x3d are always classic.
+  const boolean kLearnChecksumModels = true;
+
   // LIN bus bits per second rate.
   // Supported baud range is 1000 to 20000. If out of range, using silently default
   // baud of 9600.
   const uint16 kLinSpeed = 19200;
+
+  // Number of frames the lin processor rx queue can hold. One slot is always
+  // reserved for the frame being received.
+  const uint8 kLinFrameBuffers = 8;
+
+  // If true, the rx queue stores the frames as length prefixed byte records
+  // in a single buffer of kPackedFrameRingBytes bytes instead of 
+  // kLinFrameBuffers fixed size frames, which holds more short frames in the
+  // same RAM. The frame timestamps are not kept in this mode.
+  const boolean kUsePackedFrameRing = false;
+  const uint8 kPackedFrameRingBytes = 96;
+
+  // If true, the frames are reconstructed from RX edge timestamps (INT0 + timer1)
+  // instead of timer2 per bit sampling. Listen only. Timer2 is not used in this mode.
+  const boolean kUseEdgeRxEngine = false;
+
+  // If true, a second, independent bus is received on rx2 (PC1) by a second
+  // edge engine. Requires kUseEdgeRxEngine, no kUseAutoBaud. The frames of 
+  // both buses are checked against the beeper signals.
+  const boolean kUseDualBus = false;
+
+  // If true, the bytes are received by the second hardware USART (USART1) 
+  // with one interrupt per byte, see usart_rx in lin_processor.cpp. Requires
+  // an ATmega328PB or ATmega32U4 board. Listen only. Timer2 is not used in 
+  // this mode.
+  const boolean kUseUsartRx = false;
+
+  // Master mode of the shared lin processor (see the analyzer). Not used by
+  // the beeper, which only listens.
+  const boolean kUseMasterMode = false;
+
+  // If true, header only frames (no slave response) are added to the rx 
+  // queue. If false, they are only counted per id by the ISR (see 
+  // lin_processor::subscribeHeaderOnlyFrames()), which saves queue slots on
+  // buses with unanswered schedule slots.
+  const boolean kQueueHeaderOnlyFrames = false;
+
+  // If true, the tick engine measures the bit time of each frame from the
+  // falling edges of its sync byte and samples the rest of the frame with 
+  // it, which tolerates masters whose clock is a few percents off kLinSpeed.
+  // Adds an edge wait of about half a bit to the sync byte.
+  const boolean kUseSyncDriftCompensation = true;
+
+  // If true, frames are closed as soon as they reach the length learned for
+  // their id instead of waiting for the inter byte space timeout.
+  const boolean kUseLearnedFrameLengths = true;
+
+  // If true, the baud rate is measured from the sync byte of each frame and
+  // kLinSpeed is used only until the first measurement. Requires kUseEdgeRxEngine.
+  const boolean kUseAutoBaud = false;
+
+  // If true, each data bit is sampled three times around the middle of the
+  // bit and decided by a majority vote, to reject short noise spikes. The
+  // number of bits that needed the vote is reported in the lin stats.
+  const boolean kUseMajorityVoteSampling = false;
+
+  // Serial output bits per second rate. 115200 is compatible with the 
+  // Arduino serial monitor. 250000, 500000 and 1000000 have exact divisors
+  // at 16Mhz and need a matching host baud rate. At the higher rates the 
+  // main loop may not keep up without kUseSioTxInterrupt.
+  const uint32 kSioBaud = 115200;
+
+  // Size of the sio output queue in bytes. A power of two, up to 1024.
+  const uint16 kSioQueueSize = 128;
+
+  // If true, the serial receiver is enabled and sio::readByte() returns the
+  // bytes from the host.
+  const boolean kUseSerialCommands = false;
+
+  // If true, sio sends the queued bytes from the UART data register empty
+  // interrupt instead of from sio::loop(), which keeps the serial output at
+  // line rate regardless of the main loop time. The ISR adds a few usecs 
+  // of jitter to the other interrupts. Off here to keep the lin processor
+  // jitter minimal.
+  const boolean kUseSioTxInterrupt = false;
+
+  // If true, sio holds the queued bytes until they fill a batch of 
+  // kSioBatchBytes or the oldest of them waited kSioBatchHoldMillis, and 
+  // then sends them back to back. Batches have whole records. 62 bytes is 
+  // the payload of a USB packet of the FTDI, so its packets go out full 
+  // rather than on its latency timer, and each host read returns complete 
+  // records.
+  const boolean kUseSioBatching = false;
+  const uint8 kSioBatchBytes = 62;
+  const uint8 kSioBatchHoldMillis = 8;
+
+  // If true, the hardware clock runs at 16Mhz / 8, 0.5us ticks, instead of
+  // 16Mhz / 64, 4us ticks (see hardware_clock.h). For diagnostic builds: the
+  // 16 bit tick intervals then wrap at ~32ms instead of ~262ms. Requires
+  // kLinSpeed, and the rates of setBaudRate(), of at least 7843 baud.
+  const boolean kUseFineHardwareClock = false;
+
+  // If true, the main loop puts the lin processor in bus sleep and the CPU
+  // in idle sleep when no frame arrived for kBusSleepSilenceMillis, or for
+  // kBusSleepIgnitionOffMillis with the ignition off, or immediately on a 
+  // go-to-sleep command frame. Reduces the current draw in a parked car. 
+  // The first falling edge on the bus, a break or a wake up pulse, wakes 
+  // it up.
+  const boolean kUseBusSleep = true;
+  const uint16 kBusSleepSilenceMillis = 10000;
+  const uint16 kBusSleepIgnitionOffMillis = 2000;
   
 }  // namepsace custom_defs
 
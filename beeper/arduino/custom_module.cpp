@@ -16,18 +16,27 @@
 #include "custom_signals.h"
 #include "action_buzzer.h"
 #include "action_led.h"
+#include "alert_rules.h"
+#include "lin_processor.h"
 #include "sio.h"
 
 namespace custom_module {
   
 // FRAMES LED - blinks when detecting valid frames.
-static ActionLed frame_activity_led(PORTB, 0);
+static ActionLed<io_pins::Pin<io_pins::PortB, 0> > frame_activity_led;
   
 // Used to generate slow blinking to show the board is live, even when
 // there are no frames.
 static PassiveTimer idle_timer;
 
 void setup() {
+  // The reverse gear (0x39), config button (0x97) and ignition (0x50)
+  // frames are handled in custom_signals.
+  lin_processor::acceptAllIds(false);
+  lin_processor::acceptId(0x39, true);
+  lin_processor::acceptId(0x97, true);
+  lin_processor::acceptId(0x50, true);
+
   custom_signals::setup();
   custom_config::setup();
   action_buzzer::setup();
@@ -39,7 +48,8 @@ void setup() {
 void loop() {
   custom_signals::loop();
   custom_config::loop();
-  action_buzzer::loop();
+  // The buzzer alerts, per the signal states.
+  alert_rules::loop();
   frame_activity_led.loop();
   
   if (idle_timer.timeMillis() >= 1000) {
@@ -51,24 +61,6 @@ void loop() {
 void frameArrived(const LinFrame& frame) {
   frame_activity_led.action();
   custom_signals::frameArrived(frame);
-
-  // We handle here only framed of id 39 with the reverse signal.
-  const uint8 id = frame.get_byte(0);
-  if (id != 0x39) {
-    return;
-  }
-
-  // We expect a frame with one ID byte, 6 data bytes and one checksum byte.
-  if (frame.num_bytes()  != (1 + 6 + 1)) {
-    return;
-  }
-  
-  // Specific logic for P981/CS linbus of the homelink console. Triggers the
-  // buzzer when rear gear is engaged.
-  // Test frame: 39 04 00 00 00 00 00.
-  const boolean reverse_gear = frame.get_byte(1) & H(2);
-  const boolean feature_enabled = custom_config::is_enabled();
-  action_buzzer::action(reverse_gear && feature_enabled); 
 }
 
 }  // namespace custom_module
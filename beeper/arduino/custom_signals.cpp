@@ -24,6 +24,9 @@ namespace private_ {
   // NOTE: we require only a single button report to change state. This prevents
   // missing clicks when clicking fast.
   SignalTracker button_signal_tracker(1, 1000, 2000);
+  // A single report changes the state, so the beeping starts with the
+  // first frame of the reverse gear.
+  SignalTracker reverse_gear_signal_tracker(1, 1000, 2000);
 }
 
 void setup() {
@@ -35,6 +38,7 @@ void loop() {
   // Loop dependents.
   private_::ignition_on_signal_tracker.loop();
   private_::button_signal_tracker.loop();
+  private_::reverse_gear_signal_tracker.loop();
 }
 
 // Handling of frame from sport mode button unit.
@@ -51,6 +55,17 @@ void frameArrived(const LinFrame& frame) {
     return;
   }
 
+  // Handle the frame of the homelink console with the reverse gear bit.
+  // We expect a frame with one ID byte, 6 data bytes and one checksum byte.
+  // Test frame: 39 04 00 00 00 00 00.
+  if (id == 0x39) {
+    if (frame.num_bytes() == (1 + 6 + 1)) {
+      const boolean is_reverse_gear = frame.get_byte(1) & H(2);
+      private_::reverse_gear_signal_tracker.reportSignal(is_reverse_gear);
+    }
+    return;
+  }
+
   // Handle the frame with ignition state status bit.
   if (id == 0x50) {
     if (frame.num_bytes() == (1 + 8 + 1)) {
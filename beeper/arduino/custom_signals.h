@@ -29,6 +29,9 @@ namespace custom_signals {
     // Tracks the state of the config button.
     // This button is mapped to the P981/CS Sport Mode button.
     extern SignalTracker button_signal_tracker;
+
+    // Tracks the reverse gear bit of the homelink console frame.
+    extern SignalTracker reverse_gear_signal_tracker;
   }
 
   // Called once during initialization.
@@ -48,6 +51,10 @@ namespace custom_signals {
   inline const SignalTracker& config_button() {
     return private_::button_signal_tracker;
   }
+
+  inline const SignalTracker& reverse_gear() {
+    return private_::reverse_gear_signal_tracker;
+  }
   
 }  // namespace custom_signals
 
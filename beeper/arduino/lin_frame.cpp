@@ -14,94 +14,72 @@
 
 #include "custom_defs.h"
 
-// Compute the checksum of the frame. For now using LIN checksum V2 only.
-uint8 LinFrame::computeChecksum() const {
-  // LIN V2 checksum includes the ID byte, V1 does not.
-  const uint8 startByteIndex = custom_defs::kUseLinChecksumVersion2 ? 0 : 1;
-  const uint8* p = &bytes_[startByteIndex];
-  
-  // Exclude the checksum byte at the end of the frame.
-  uint8 numBytesToChecksum = num_bytes_ - startByteIndex - 1;
-
-  // Sum bytes. We should not have 16 bit overflow here since the frame has a limited size.
-  uint16 sum = 0;
-  while (numBytesToChecksum-- > 0) {
-    sum += *(p++);
-  }
-
-  // Keep adding the high and low bytes until no carry.
-  for (;;) {
-    const uint8 highByte = (uint8)(sum >> 8);
-    if (!highByte) {
-      break;  
-    }
-    // NOTE: this can add additional carry.  
-    sum = (sum & 0xff) + highByte; 
-  }
-
-  return (uint8)(~sum);
+// Indexed by the 6 bit id. P0 = id0 ^ id1 ^ id2 ^ id4, 
+// P1 = ~(id1 ^ id3 ^ id4 ^ id5).
+const uint8 LinFrame::kPidTable[64] PROGMEM = {
+  0x80, 0xc1, 0x42, 0x03, 0xc4, 0x85, 0x06, 0x47,
+  0x08, 0x49, 0xca, 0x8b, 0x4c, 0x0d, 0x8e, 0xcf,
+  0x50, 0x11, 0x92, 0xd3, 0x14, 0x55, 0xd6, 0x97,
+  0xd8, 0x99, 0x1a, 0x5b, 0x9c, 0xdd, 0x5e, 0x1f,
+  0x20, 0x61, 0xe2, 0xa3, 0x64, 0x25, 0xa6, 0xe7,
+  0xa8, 0xe9, 0x6a, 0x2b, 0xec, 0xad, 0x2e, 0x6f,
+  0xf0, 0xb1, 0x32, 0x73, 0xb4, 0xf5, 0x76, 0x37,
+  0x78, 0x39, 0xba, 0xfb, 0x3c, 0x7d, 0xfe, 0xbf,
+};
+
+uint8 LinFrame::checksum_models_[64];
+
+void LinFrame::setChecksumModel(uint8 id, uint8 model) {
+  model &= kChecksumModelMask;
+  checksum_models_[idFromPid(id)] = 
+      (model == kChecksumUnknown) ? kChecksumUnknown : (model | kChecksumPreset);
 }
 
-
-uint8 LinFrame::setLinIdChecksumBits(uint8 id) {
-  // The algorithm is optimized for CPU time (avoiding individual shifts per id
-  // bit). Using registers for the two checksum bits. P1 is computed in bit 7 of
-  // p1_at_b7 and p0 is comptuted in bit 6 of p0_at_b6.
-  uint8 p1_at_b7 = ~0;
-  uint8 p0_at_b6 = 0;
-
-  // P1: id5, P0: id4
-  uint8 shifter = id << 2;
-  p1_at_b7 ^= shifter;
-  p0_at_b6 ^= shifter;
-
-  // P1: id4, P0: id3
-  shifter += shifter;
-  p1_at_b7 ^= shifter;
-
-  // P1: id3, P0: id2
-  shifter += shifter;
-  p1_at_b7 ^= shifter;
-  p0_at_b6 ^= shifter;
-
-  // P1: id2, P0: id1
-  shifter += shifter;
-  p0_at_b6 ^= shifter;
-
-  // P1: id1, P0: id0
-  shifter += shifter;
-  p1_at_b7 ^= shifter;
-  p0_at_b6 ^= shifter;
-
-  return (p1_at_b7 & 0b10000000) | (p0_at_b6 & 0b01000000) | (id & 0b00111111);
-}
-
-boolean LinFrame::isValid() const {
-  const uint8 n = num_bytes_;
+boolean LinFrame::checkValid() const {
+  const uint8 n = num_bytes();
 
   // Check frame size.
-  // One ID byte with optional 1-8 data bytes and 1 checksum byte.
-  // TODO: should we enforce only 1, 2, 4, or 8 data bytes?  (total size 
-  // 1, 3, 4, 6, or 10)
-  //
-  // TODO: should we pass through frames with ID only (n == 1, no response from slave).
-  if (n != 1 && (n < 3 || n > 10)) {
+  // One ID byte with optional 1-8 data bytes and 1 checksum byte. LIN 2.x
+  // allows any number of data bytes, so the LIN 1.x 2, 4, 8 bytes coding 
+  // of the ids is not enforced. An ID only frame (n == 1) is a header with
+  // no slave response and is valid. n is at most kMaxBytes, the receivers
+  // do not append beyond it.
+  if (n != 1 && (n < 3 || n > kMaxBytes)) {
     return false;
   }
 
   // Check ID byte checksum bits.
   const uint8 id_byte = bytes_[0];
-  if (id_byte != setLinIdChecksumBits(id_byte)) {
+  if (!isValidPid(id_byte)) {
     return false;
   }
 
   // If not an ID only frame, check also the overall checksum.
   if (n > 1) {
-    if (bytes_[n - 1] != computeChecksum()) {
+    const uint8 checksum = bytes_[n - 1];
+    const uint8 model = checksumModel(id_byte);
+    if (model == kChecksumClassic) {
+      return checksum == classicChecksum();
+    }
+    if (model == kChecksumEnhanced) {
+      return checksum == enhancedChecksum();
+    }
+    if (!custom_defs::kLearnChecksumModels) {
+      return checksum == computeChecksum();
+    }
+    // Unknown model. Try both and remember the one that validates. The two
+    // can't both match since the id byte is never 0x00 or 0xff.
+    uint8 learned;
+    if (checksum == enhancedChecksum()) {
+      learned = kChecksumEnhanced;
+    } else if (checksum == classicChecksum()) {
+      learned = kChecksumClassic;
+    } else {
       return false;
-    }  
+    }
+    // Single byte store, ISRs see either the old or the new value.
+    checksum_models_[idFromPid(id_byte)] = learned;
   }
-  // TODO: check protected id.
   return true;
 }
 
@@ -17,6 +17,7 @@
 #include "avr_util.h"
 #include "custom_defs.h"
 #include "hardware_clock.h"
+#include "io_pins.h"
 
 // TODO: for debugging. Remove.
 #include "sio.h"
@@ -27,48 +28,17 @@
 static const uint16 kDefaultBaud = 9600;
 
 // Wait at most N bits from the end of the stop bit of previous byte
-// to the start bit of next byte.
-//
-// TODO: seperate values for pre response space (longer, e.g. 8) and pre
-// regular byte space (shorter, e.g. 4).
-//
-static const uint8 kMaxSpaceBits = 6;
-
-// Define an input pin with fast access. Using the macro does
-// not increase the pin access time compared to direct bit manipulation.
-// Pin is setup with active pullup.
-#define DEFINE_INPUT_PIN(name, port_letter, bit_index) \
-  namespace name { \
-    static const uint8 kPinMask  = H(bit_index); \
-    static inline void setup() { \
-      DDR ## port_letter &= ~kPinMask;  \
-      PORT ## port_letter |= kPinMask;  \
-    } \
-    static inline uint8 isHigh() { \
-      return  PIN##port_letter & kPinMask; \
-    } \
-  } 
- 
-// Define an output pin with fast access. Using the macro does
-// not increase the pin access time compared to direct bit manipulation.
-#define DEFINE_OUTPUT_PIN(name, port_letter, bit_index, initial_value) \
-  namespace name { \
-    static const uint8 kPinMask  = H(bit_index); \
-    static inline void setHigh() { \
-      PORT ## port_letter |= kPinMask; \
-    } \
-    static inline void setLow() { \
-      PORT ## port_letter &= ~kPinMask; \
-    } \
-    static inline void setup() { \
-      DDR ## port_letter |= kPinMask;  \
-      (initial_value) ? setHigh() : setLow(); \
-    } \
-  }  
-  
+// to the start bit of next byte. The space before the slave response
+// (after the id byte) is typically longer than between bytes.
+static const uint8 kMaxByteSpaceBits = 4;
+static const uint8 kMaxResponseSpaceBits = 8;
 
 namespace lin_processor {
 
+  // The clock ticks per bit are 8 bits, see Config.
+  typedef char FineHardwareClockRequiresFasterLinSpeed[
+      (hardware_clock::kTicksPerMilli * 1000) / custom_defs::kLinSpeed <= 0xff ? 1 : -1];
+
   class Config {
    public:
 #if F_CPU != 16000000
@@ -78,27 +48,77 @@ namespace lin_processor {
     void setup() {
       // If baud rate out of range use default speed.
       uint16 baud = custom_defs::kLinSpeed; 
-      if (baud < 1000 || baud > 20000) {
+      if (!isValidBaud(baud)) {
         sio::println(F("ERROR: kLinSpeed out of range"));
         baud = kDefaultBaud;
       }
+      setBaud(baud);
+    }
+
+    // With custom_defs::kUseFineHardwareClock the clock ticks per bit fit
+    // in 8 bits only from 7843 baud.
+    static inline boolean isValidBaud(uint16 baud) {
+      return baud >= 1000 && baud <= 20000
+          && (hardware_clock::kTicksPerMilli * 1000) / baud <= 0xff;
+    }
+
+    // Recompute the timing for the given valid baud rate. Called from 
+    // setup() and, with interrupts disabled and the engine idle, from 
+    // setBaudRate().
+    void setBaud(uint16 baud) {
       baud_ = baud; 
-      prescaler_x64_ = baud < 8000;
-      const uint8 prescaling = prescaler_x64_ ? 64 : 8;  
-      counts_per_bit_ = (((16000000L / prescaling) / baud));
+      // Use the smallest timer2 prescaling that fits a bit in 8 bits, for
+      // best resolution.
+      prescaling_ = 8;
+      if ((16000000L / 8) / baud > 255) {
+        prescaling_ = 32;
+      }
+      if ((16000000L / 32) / baud > 255) {
+        prescaling_ = 64;
+      }
+      counts_per_bit_ = (((16000000L / prescaling_) / baud));
+      // The fractional part of the bit time, in 1/256 counts. Spread over
+      // the bits by the ISR.
+      counts_per_bit_fraction_ = 
+          ((((16000000L / prescaling_) % baud) << 8) / baud);
       // Adding two counts to compensate for software delay.
       counts_per_half_bit_ = (counts_per_bit_ / 2) + 2;
       clock_ticks_per_bit_ = (hardware_clock::kTicksPerMilli * 1000) / baud;
       clock_ticks_per_half_bit_ = clock_ticks_per_bit_ / 2;
-      clock_ticks_per_until_start_bit_ = clock_ticks_per_bit_ * kMaxSpaceBits;
+      clock_ticks_until_byte_ = clock_ticks_per_bit_ * kMaxByteSpaceBits;
+      clock_ticks_until_response_ = clock_ticks_per_bit_ * kMaxResponseSpaceBits;
+
+      // Edge engine timing. The bit time is kept in 1/16 clock ticks since at
+      // high baud rates a bit is only about 13 clock ticks.
+      setEdgeBitTicksX16((hardware_clock::kTicksPerMilli * 1000 * 16) / baud);
+    }
+
+    // Set the edge engine timing from the bit time in 1/16 clock ticks. Called
+    // also from the ISR when the bit rate is measured (auto baud).
+    inline void setEdgeBitTicksX16(uint16 ticks_x16) {
+      clock_ticks_per_bit_x16_ = ticks_x16;
+      clock_ticks_per_break_ = (ticks_x16 * 10L) >> 4;
+      // From the start bit edge to the middle of the stop bit (9.5 bits).
+      clock_ticks_until_stop_bit_ = (ticks_x16 * 19L) >> 5;
+      // From the middle of the stop bit to the latest start bit of next byte.
+      clock_ticks_per_byte_space_ = (ticks_x16 * (2L * kMaxByteSpaceBits + 1)) >> 5;
+      clock_ticks_per_response_space_ = (ticks_x16 * (2L * kMaxResponseSpaceBits + 1)) >> 5;
     }
 
     inline uint16 baud() const { 
       return baud_; 
     }
 
-    inline boolean prescaler_x64() {
-      return prescaler_x64_;
+    // Timer2 prescaling. One of 8, 32, 64.
+    inline uint8 prescaling() const {
+      return prescaling_;
+    }
+
+    // Timer2 prescaler select bits for prescaling().
+    inline uint8 prescaler_bits() const {
+      return (prescaling_ == 8) ? (L(CS22) | H(CS21) | L(CS20))
+          : (prescaling_ == 32) ? (L(CS22) | H(CS21) | H(CS20))
+          : (H(CS22) | L(CS21) | L(CS20));
     }
 
     inline uint8 counts_per_bit() const { 
@@ -107,26 +127,52 @@ namespace lin_processor {
     inline uint8 counts_per_half_bit() const { 
       return counts_per_half_bit_; 
     }
+    inline uint8 counts_per_bit_fraction() const { 
+      return counts_per_bit_fraction_; 
+    }
     inline uint8 clock_ticks_per_bit() const { 
       return clock_ticks_per_bit_; 
     }
     inline uint8 clock_ticks_per_half_bit() const { 
       return clock_ticks_per_half_bit_; 
     }
-    inline uint8 clock_ticks_per_until_start_bit() const { 
-      return clock_ticks_per_until_start_bit_; 
+    // Max space before a regular byte and before the slave response.
+    inline uint16 clock_ticks_until_byte() const { 
+      return clock_ticks_until_byte_; 
+    }
+    inline uint16 clock_ticks_until_response() const { 
+      return clock_ticks_until_response_; 
+    }
+    inline uint16 clock_ticks_per_bit_x16() const { 
+      return clock_ticks_per_bit_x16_; 
+    }
+    inline uint16 clock_ticks_per_break() const { 
+      return clock_ticks_per_break_; 
+    }
+    inline uint16 clock_ticks_until_stop_bit() const { 
+      return clock_ticks_until_stop_bit_; 
+    }
+    inline uint16 clock_ticks_per_byte_space() const { 
+      return clock_ticks_per_byte_space_; 
+    }
+    inline uint16 clock_ticks_per_response_space() const { 
+      return clock_ticks_per_response_space_; 
     }
    private:
     uint16 baud_;
-    // False -> x8, true -> x64.
-    // TODO: timer2 also have x32 scalingl Could use it for better 
-    // accuracy in the mid baude range.
-    boolean prescaler_x64_;
+    uint8 prescaling_;
     uint8 counts_per_bit_;
+    uint8 counts_per_bit_fraction_;
     uint8 counts_per_half_bit_;
     uint8 clock_ticks_per_bit_;
     uint8 clock_ticks_per_half_bit_;
-    uint8 clock_ticks_per_until_start_bit_;
+    uint16 clock_ticks_until_byte_;
+    uint16 clock_ticks_until_response_;
+    uint16 clock_ticks_per_bit_x16_;
+    uint16 clock_ticks_per_break_;
+    uint16 clock_ticks_until_stop_bit_;
+    uint16 clock_ticks_per_byte_space_;
+    uint16 clock_ticks_per_response_space_;
   };
 
   // The actual configurtion. Initialized in setup() based on baud rate.  
@@ -134,47 +180,91 @@ namespace lin_processor {
 
   // ----- Digital I/O pins
   //
-  // NOTE: we use direct register access instead the abstractions in io_pins.h. 
-  // This way we shave a few cycles from the ISR.
+  // NOTE: the io_pins::Pin templates compile to single sbi/cbi/sbic 
+  // instructions, same as direct register access.
     
   // LIN interface.
-  DEFINE_INPUT_PIN(rx_pin, D, 2);
-  // TODO: tie this pin to the TX pin of the ata6631 ic, for future applications.
-  DEFINE_OUTPUT_PIN(tx1_pin, C, 2, 1);
+  typedef io_pins::Pin<io_pins::PortD, 2> rx_pin;
+  // Second bus, with custom_defs::kUseDualBus. The rx2 of the injector 
+  // board.
+  typedef io_pins::Pin<io_pins::PortC, 1> rx2_pin;
+  // Sends the headers in master mode (custom_defs::kUseMasterMode). The 
+  // generator mode of the analyzer also sends on it (see lin_generator).
+  typedef io_pins::Pin<io_pins::PortC, 2> tx1_pin;
   
   // Debugging signals.
-  DEFINE_OUTPUT_PIN(break_pin, C, 0, 0);
-  DEFINE_OUTPUT_PIN(sample_pin, B, 4, 0);
-  DEFINE_OUTPUT_PIN(error_pin, B, 3, 0);
-  DEFINE_OUTPUT_PIN(isr_pin, C, 3, 0);
-  DEFINE_OUTPUT_PIN(gp_pin, D, 6, 0);
+  typedef io_pins::Pin<io_pins::PortC, 0> break_pin;
+  typedef io_pins::Pin<io_pins::PortB, 4> sample_pin;
+  typedef io_pins::Pin<io_pins::PortB, 3> error_pin;
+  typedef io_pins::Pin<io_pins::PortC, 3> isr_pin;
+  typedef io_pins::Pin<io_pins::PortD, 6> gp_pin;
 
   // Called one during initialization.
   static inline void setupPins() {
-    rx_pin::setup();
-    break_pin::setup();
-    sample_pin::setup();
-    error_pin::setup();
-    isr_pin::setup();
-    gp_pin::setup();
+    rx_pin::setupInput();
+    if (custom_defs::kUseMasterMode) {
+      tx1_pin::setupOutput(true);
+    }
+    if (custom_defs::kUseDualBus) {
+      rx2_pin::setupInput();
+    }
+    break_pin::setupOutput(false);
+    // On the ATmega328PB the USART engine receives on PB4.
+    if (!custom_defs::kUseUsartRx) {
+      sample_pin::setupOutput(false);
+    }
+    error_pin::setupOutput(false);
+    isr_pin::setupOutput(false);
+    gp_pin::setupOutput(false);
+  }
+
+  // ----- Statistics -----
+
+  // Written from ISR. Read/Write from main with interrupts disabled.
+  static Stats stats;
+
+  // Private. Called from ISR. 
+  static inline void incrementCounter(uint16* counter) {
+    // Saturate rather than wrapping around.
+    if (*counter != 0xffff) {
+      (*counter)++;
+    }
+  }
+
+  // Called from main. Public. Assumed interrupts are enabled. 
+  // Do not call from ISR.
+  void getStats(Stats* result, boolean clear) {
+    cli();
+    *result = stats;
+    if (clear) {
+      stats = Stats();
+    }
+    sei();
   }
 
   // ----- ISR RX Ring Buffers -----
 
-  // Frame buffer queue size.
-  static const uint8 kMaxFrameBuffers = 8;
+  // Frame buffer queue size. With the packed ring, a single buffer is used
+  // by the ISR to assemble the current frame.
+  static const uint8 kMaxFrameBuffers = 
+      custom_defs::kUsePackedFrameRing ? 1 : custom_defs::kLinFrameBuffers;
 
   // RX Frame buffers queue. Read/Writen by ISR only. 
   static LinFrame rx_frame_buffers[kMaxFrameBuffers];
 
+  // The queue is a single producer/single consumer ring. head_frame_buffer
+  // is written by the ISR only and tail_frame_buffer by the main only so no
+  // interrupt disabling is needed. Single byte indices are read and written
+  // atomically.
+
   // Index [0, kMaxFrameBuffers) of the current frame buffer being
-  // written (newest). Read/Written by ISR only.
-  static uint8  head_frame_buffer;
+  // written (newest). Written by ISR only.
+  static volatile uint8 head_frame_buffer;
 
   // Index [0, kMaxFrameBuffers) of the next frame to be read (oldest).
   // If equals head_frame_buffer then there is no available frame.
-  // Read/Written by ISR only.
-  static uint8 tail_frame_buffer;
+  // Written by main only.
+  static volatile uint8 tail_frame_buffer;
 
   // Called once from main.
   static inline void setupBuffers() {
@@ -182,51 +272,345 @@ namespace lin_processor {
     tail_frame_buffer = 0;
   }
 
-  // Called from ISR or from main with interrupts disabled.
-  static inline void incrementTailFrameBuffer() {
-    if (++tail_frame_buffer >= kMaxFrameBuffers) {
-      tail_frame_buffer = 0;
+  static inline uint8 nextFrameBufferIndex(uint8 index) {
+    return (index + 1 >= kMaxFrameBuffers) ? 0 : index + 1;
+  }
+
+  // ----- Packed Frame Ring -----
+  //
+  // Used instead of the frame buffers queue when 
+  // custom_defs::kUsePackedFrameRing. Each frame is a header byte with the 
+  // number of frame bytes in bits [3:0] and the channel in bit 4 (see 
+  // LinFrame::channel()), followed by the sequence byte (see LinFrame::seq())
+  // and the frame bytes. Records wrap around the end of the buffer. Same 
+  // single producer/single consumer scheme as the frame buffers, with one 
+  // byte always free to tell a full ring from an empty one.
+  namespace packed_ring {
+    static const uint8 kSize = custom_defs::kUsePackedFrameRing 
+        ? custom_defs::kPackedFrameRingBytes : 1;
+    typedef char RingTooSmall[(kSize == 1 || kSize > LinFrame::kMaxBytes + 2) ? 1 : -1];
+
+    static uint8 bytes[kSize];
+    
+    // Written by ISR only.
+    static volatile uint8 head;
+    // Written by main only.
+    static volatile uint8 tail;
+
+    static inline uint8 next(uint8 index) {
+      return (index + 1 >= kSize) ? 0 : index + 1;
+    }
+
+    // Called from ISR. Returns false if there is no room for the frame.
+    static inline boolean push(const LinFrame& frame) {
+      const uint8 n = frame.num_bytes();
+      uint8 h = head;
+      const uint8 t = tail;
+      const uint8 used = (h >= t) ? h - t : kSize - (t - h);
+      if (used + 2 + n >= kSize) {
+        return false;
+      }
+      bytes[h] = n | (frame.channel() << 4);
+      h = next(h);
+      bytes[h] = frame.seq();
+      h = next(h);
+      for (uint8 i = 0; i < n; i++) {
+        bytes[h] = frame.get_byte(i);
+        h = next(h);
+      }
+      // Make sure the record writes are completed before publishing it.
+      asm volatile("" ::: "memory");
+      head = h;
+      return true;
+    }
+
+    // Called from main. Returns false if the ring is empty.
+    static boolean pop(LinFrame* frame) {
+      uint8 t = tail;
+      if (t == head) {
+        return false;
+      }
+      const uint8 header = bytes[t];
+      t = next(t);
+      const uint8 seq = bytes[t];
+      t = next(t);
+      frame->reset();
+      for (uint8 i = 0; i < (header & 0x0f); i++) {
+        frame->append_byte(bytes[t]);
+        t = next(t);
+      }
+      frame->set_channel(header >> 4);
+      frame->set_seq(seq);
+      frame->set_break_ticks(0);
+      frame->set_end_ticks(0);
+      // Make sure the record reads are completed before releasing it.
+      asm volatile("" ::: "memory");
+      tail = t;
+      return true;
+    }
+
+    // Frame returned by peekFrame() and not released yet, if peeked.
+    static LinFrame peeked_frame;
+    static boolean peeked;
+  }
+
+  // The sequence number of the next published frame. Used by ISR only.
+  static uint8 next_frame_seq;
+
+  // ----- Frame Id Filter -----
+  //
+  // Bit per 6 bit id, set if frames of that id are queued. Written by main
+  // only, single byte writes.
+  namespace id_filter {
+    static uint8 accepted[8] = { 
+      0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff 
+    };
+
+    static inline boolean isAccepted(uint8 id_byte) {
+      const uint8 id = LinFrame::idFromPid(id_byte);
+      return accepted[id >> 3] & bitMask(id & 0x07);
+    }
+  }
+
+  // ----- Header Only Frames -----
+  //
+  // Header only frames (no slave response) of ids that are not subscribed
+  // are counted here instead of being queued. The subscriptions are written 
+  // by main only, single byte writes. The counts are incremented by ISR and
+  // read and cleared by main with interrupts disabled.
+  namespace no_response {
+    static const uint8 kSubscribedByDefault = 
+        custom_defs::kQueueHeaderOnlyFrames ? 0xff : 0x00;
+
+    // Bit per 6 bit id, set if header only frames of that id are queued.
+    static uint8 subscribed[8] = {
+      kSubscribedByDefault, kSubscribedByDefault, kSubscribedByDefault,
+      kSubscribedByDefault, kSubscribedByDefault, kSubscribedByDefault,
+      kSubscribedByDefault, kSubscribedByDefault
+    };
+
+    // Saturating per 6 bit id counts of the frames that were not queued.
+    static uint8 counts[64];
+
+    // Called from ISR with a complete frame. Returns true if the frame was
+    // counted and should not be queued.
+    static inline boolean countIfNotSubscribed(const LinFrame& frame) {
+      if (frame.num_bytes() != 1) {
+        return false;
+      }
+      const uint8 id_byte = frame.get_byte(0);
+      if (!LinFrame::isValidPid(id_byte)) {
+        return false;
+      }
+      const uint8 id = LinFrame::idFromPid(id_byte);
+      if (subscribed[id >> 3] & bitMask(id & 0x07)) {
+        return false;
+      }
+      if (counts[id] != 0xff) {
+        counts[id]++;
+      }
+      return true;
+    }
+  }
+
+  // Called from ISR when the frame in the head buffer is complete. Returns 
+  // false if the queue is full, in which case the frame is dropped and the 
+  // head buffer is reused for the next frame. Frames with a rejected id are
+  // dropped silently and header only frames of ids that are not subscribed are
+  // only counted. The other frames get the next sequence number, also when
+  // dropped.
+  static inline boolean publishHeadFrameBuffer() {
+    if (!id_filter::isAccepted(rx_frame_buffers[head_frame_buffer].get_byte(0))) {
+      return true;
+    }
+    if (no_response::countIfNotSubscribed(rx_frame_buffers[head_frame_buffer])) {
+      return true;
+    }
+    rx_frame_buffers[head_frame_buffer].set_seq(next_frame_seq++);
+    if (custom_defs::kUsePackedFrameRing) {
+      if (!packed_ring::push(rx_frame_buffers[head_frame_buffer])) {
+        return false;
+      }
+      incrementCounter(&stats.frames);
+      return true;
+    }
+    const uint8 next = nextFrameBufferIndex(head_frame_buffer);
+    if (next == tail_frame_buffer) {
+      return false;
     }
+    // Make sure the frame writes are completed before publishing it.
+    asm volatile("" ::: "memory");
+    head_frame_buffer = next;
+    incrementCounter(&stats.frames);
+    return true;
   }
 
-  // Called from ISR. If stepping on tail buffer, caller needs to 
-  // increment raise frame overrun error.
-  static inline void incrementHeadFrameBuffer() {
-    if (++head_frame_buffer >= kMaxFrameBuffers) {
-      head_frame_buffer = 0;
+  // ----- Learned Frame Lengths -----
+  //
+  // Number of bytes (id, data and checksum) of each frame id, learned from 
+  // frames that ended with a space timeout. Once the same length was seen
+  // twice in a row, frames with that id are closed right after their last
+  // byte instead of waiting for the timeout. If more bytes follow, the length
+  // is forgotten and learned again. Used by ISR only.
+  namespace frame_lengths {
+    // Indexed by the 6 bits id. Bits [3:0] are the length, bit 7 is set when
+    // confirmed.
+    static uint8 table[64];
+    static const uint8 kConfirmed = H(7);
+
+    // Called when a frame ended with a space timeout. Header only frames
+    // are not learned, else the next full frame of that id would be closed
+    // at its id byte.
+    static inline void learn(uint8 id_byte, uint8 num_bytes) {
+      if (num_bytes < 2) {
+        return;
+      }
+      uint8* const entry = &table[LinFrame::idFromPid(id_byte)];
+      *entry = ((*entry & 0x0f) == num_bytes) ? (num_bytes | kConfirmed) : num_bytes;
+    }
+
+    // True if a frame with this id is known to be complete with this number
+    // of bytes.
+    static inline boolean isComplete(uint8 id_byte, uint8 num_bytes) {
+      return custom_defs::kUseLearnedFrameLengths 
+          && table[LinFrame::idFromPid(id_byte)] == (num_bytes | kConfirmed);
+    }
+
+    // Called when a frame that was closed early turned out to be longer.
+    static inline void forget(uint8 id_byte) {
+      table[LinFrame::idFromPid(id_byte)] = 0;
     }
   }
 
   // ----- ISR To Main Data Transfer -----
 
-  // Increment by the ISR to indicates to the main program when the ISR returned.
-  // This is used to defered disabling interrupts until the ISR completes to 
-  // reduce ISR jitter time.
-  static volatile uint8 isr_marker;
-  
-  // Should be called from main only. 
-  static inline void waitForIsrEnd() {
-    const uint8 value = isr_marker;
-    // Wait until the next ISR ends.
-    while (value == isr_marker) {
-    } 
+  // Public. Called from main. See .h for description.
+  void acceptAllIds(boolean accept) {
+    for (uint8 i = 0; i < ARRAY_SIZE(id_filter::accepted); i++) {
+      id_filter::accepted[i] = accept ? 0xff : 0x00;
+    }
   }
-  
+
   // Public. Called from main. See .h for description.
-  boolean readNextFrame(LinFrame* buffer) {
-    boolean result = false;
-    waitForIsrEnd();
-    cli();
-    if (tail_frame_buffer != head_frame_buffer) {
-      //led::setHigh();
-      // This copies the request buffer struct.
-      *buffer = rx_frame_buffers[tail_frame_buffer];
-      incrementTailFrameBuffer();
-      result = true;
-      //led::setLow();
+  void acceptId(uint8 id, boolean accept) {
+    const uint8 id6 = LinFrame::idFromPid(id);
+    uint8* const entry = &id_filter::accepted[id6 >> 3];
+    if (accept) {
+      *entry |= bitMask(id6 & 0x07);
+    } else {
+      *entry &= ~bitMask(id6 & 0x07);
     }
+  }
+
+  // Public. Called from main. See .h for description.
+  void subscribeHeaderOnlyFrames(uint8 id, boolean subscribe) {
+    const uint8 id6 = LinFrame::idFromPid(id);
+    uint8* const entry = &no_response::subscribed[id6 >> 3];
+    if (subscribe) {
+      *entry |= bitMask(id6 & 0x07);
+    } else {
+      *entry &= ~bitMask(id6 & 0x07);
+    }
+  }
+
+  // Public. Called from main. See .h for description.
+  uint8 getAndClearNoResponses(uint8 id) {
+    uint8* const count = &no_response::counts[LinFrame::idFromPid(id)];
+    cli();
+    const uint8 result = *count;
+    *count = 0;
     sei();
-    return result; 
+    return result;
+  }
+
+  // Public. Called from main. See .h for description.
+  boolean readNextFrame(LinFrame* buffer) {
+    if (custom_defs::kUsePackedFrameRing) {
+      if (packed_ring::peeked) {
+        *buffer = packed_ring::peeked_frame;
+        packed_ring::peeked = false;
+        return true;
+      }
+      return packed_ring::pop(buffer);
+    }
+    const uint8 tail = tail_frame_buffer;
+    if (tail == head_frame_buffer) {
+      return false;
+    }
+    // This copies the request buffer struct. The ISR does not touch this
+    // buffer until we advance the tail.
+    *buffer = rx_frame_buffers[tail];
+    // Make sure the compiler completes the copy before releasing the buffer.
+    asm volatile("" ::: "memory");
+    tail_frame_buffer = nextFrameBufferIndex(tail);
+    return true; 
+  }
+
+  // Public. Called from main. See .h for description.
+  const LinFrame* peekFrame() {
+    // The packed records are unpacked to a main side frame.
+    if (custom_defs::kUsePackedFrameRing) {
+      if (!packed_ring::peeked) {
+        packed_ring::peeked = packed_ring::pop(&packed_ring::peeked_frame);
+      }
+      return packed_ring::peeked ? &packed_ring::peeked_frame : NULL;
+    }
+    const uint8 tail = tail_frame_buffer;
+    return (tail == head_frame_buffer) ? NULL : &rx_frame_buffers[tail];
+  }
+
+  // Public. Called from main. See .h for description.
+  void releaseFrame() {
+    if (custom_defs::kUsePackedFrameRing) {
+      packed_ring::peeked = false;
+      return;
+    }
+    // Make sure the compiler completes the frame reads before releasing it.
+    asm volatile("" ::: "memory");
+    tail_frame_buffer = nextFrameBufferIndex(tail_frame_buffer);
+  }
+
+  // Public. Called from main. See .h for description.
+  uint8 drainFrames(FrameHandler handler, uint8 max_frames) {
+    uint8 count = 0;
+    // The packed records are unpacked one at a time to a main side frame.
+    if (custom_defs::kUsePackedFrameRing) {
+      const LinFrame* frame;
+      while (count < max_frames && (frame = peekFrame()) != NULL) {
+        handler(*frame);
+        releaseFrame();
+        count++;
+      }
+      return count;
+    }
+    // A single snapshot of the head. Frames that the ISR adds meanwhile are 
+    // left to the next call.
+    const uint8 head = head_frame_buffer;
+    uint8 tail = tail_frame_buffer;
+    while (count < max_frames && tail != head) {
+      handler(rx_frame_buffers[tail]);
+      // Make sure the compiler completes the frame reads before releasing it.
+      asm volatile("" ::: "memory");
+      tail = nextFrameBufferIndex(tail);
+      tail_frame_buffer = tail;
+      count++;
+    }
+    return count;
+  }
+
+  // Public. Called from main. See .h for description.
+  uint8 queueUsagePercent() {
+    // One entry is always free to tell a full queue from an empty one.
+    if (custom_defs::kUsePackedFrameRing) {
+      const uint8 h = packed_ring::head;
+      const uint8 t = packed_ring::tail;
+      const uint8 used = (h >= t) ? h - t : packed_ring::kSize - (t - h);
+      return (uint16)used * 100 / ((packed_ring::kSize > 1) ? packed_ring::kSize - 1 : 1);
+    }
+    const uint8 h = head_frame_buffer;
+    const uint8 t = tail_frame_buffer;
+    const uint8 used = (h >= t) ? h - t : kMaxFrameBuffers - (t - h);
+    return (uint16)used * 100 / ((kMaxFrameBuffers > 1) ? kMaxFrameBuffers - 1 : 1);
   }
 
   // ----- State Machine Declaration -----
@@ -235,62 +619,133 @@ namespace lin_processor {
   namespace states {
     static const uint8 DETECT_BREAK = 1;
     static const uint8 READ_DATA = 2;
+    static const uint8 SEND_HEADER = 3;
   }
   static uint8 state;
 
+  // Handler of the next timer2 tick. Set with the state and, in READ_DATA, 
+  // per bit phase (start, data or stop bit), such that the tick ISR calls 
+  // it with no dispatch on the state or the bit index.
+  typedef void (*TickHandler)();
+  static TickHandler tick_handler;
+
   class StateDetectBreak {
    public:
     static inline void enter() ;
-    static inline void handleIsr();
+    static void handleIsr();
+    // Called when the wait for the end of the break is done, with false on
+    // timeout.
+    static inline void handleBreakEnd(boolean ok);
+    // Called instead of enter() when a frame was closed by its learned length.
+    static inline void enterAfterEarlyClose(uint8 id_byte);
+    // True if the bus is idle, no break is being detected and a start bit 
+    // of a frame that was closed early is not expected.
+    static inline boolean isIdle();
     
    private:
     static uint8 low_bits_counter_;
+    // When non zero, number of ticks left in which a low RX indicates that 
+    // the last frame, with id early_close_id_, was closed too early.
+    static uint8 quiet_ticks_;
+    static uint8 early_close_id_;
   };
 
   class StateReadData {
    public:
     // Should be called after the break stop bit was detected.
     static inline void enter();
-    static inline void handleIsr();
+    // Called at the end of the stop bit of a header that we sent, with its
+    // protected id. Receives the response as in a received frame.
+    static inline void enterResponse(uint8 id_byte);
+
+    // Called when the wait for the start bit of the sync byte, for the
+    // data bit 7 of the sync byte and for the start bit of next byte is
+    // done, with false on timeout.
+    static inline void handleSyncStart(boolean ok);
+    static inline void handleSyncBit7(boolean ok);
+    static inline void handleByteStart(boolean ok);
     
    private:
+    // The tick handlers of the bits of a byte.
+    static void handleStartBit();
+    static void handleDataBit();
+    static void handleStopBit();
+
+    // Called in the sync byte, at the middle of its data bit 6. See 
+    // frame_timing.
+    static inline void measureSyncByte();
+
+    // Called after the sync, id, data or checksum byte was read, with 
+    // bytes_read_ including it. Closes the frame or arms the wait for the
+    // start bit of the next byte.
+    static inline void afterByte();
+
     // Number of complete bytes read so far. Includes all bytes, even
     // sync, id and checksum.
     static uint8 bytes_read_;
-    
-    // Number of bits read so far in the current byte. Includes start bit, 
-    // 8 data bits and one stop bits.
-    static uint8 bits_read_in_byte_;
 
     // Buffer for the current byte we collect.
     static uint8 byte_buffer_;
    
-    // When collecting the data bits, this goes (1 << 0) to (1 << 7). Could
-    // be computed as (1 << (bits_read_in_byte_ - 1)). We use this cached value
-    // recude ISR computation.
+    // When collecting the data bits, this goes (1 << 0) to (1 << 7), and 
+    // to zero after the last data bit.
     static uint8 byte_buffer_bit_mask_;
   };
 
+  // Master mode. Sends the break, the sync and the protected id bit by bit
+  // on the ticks, then receives the response with StateReadData.
+  class StateSendHeader {
+   public:
+    // Called from main with interrupts disabled. Returns false if not idle.
+    static inline boolean start(uint8 id_byte);
+    static void handleIsr();
+
+   private:
+    static uint8 id_byte_;
+    // Number of break and break delimiter bits sent so far, [0, 14].
+    static uint8 break_bits_;
+    // The bits of the current byte that were not sent yet, lsb first, 
+    // including the start and stop bits. Zero when the byte is done.
+    static uint16 byte_bits_;
+    // True once the id byte was loaded, after the sync byte.
+    static boolean is_id_loaded_;
+  };
+
+  // Edge engine, defined below.
+  namespace edge_rx {
+    static inline void setup();
+  }
+
+  // USART engine, defined below.
+  namespace usart_rx {
+    static inline void setup();
+  }
+
   // ----- Error Flag. -----
 
-  // Written from ISR. Read/Write from main.
-  static volatile boolean error_flags;
+  // Written from ISR. Read/Write from main. Bit mask of pending errors.
+  static volatile uint8 error_flags;
 
   // Private. Called from ISR and from setup (beofe starting the ISR).
   static inline void setErrorFlags(uint8 flags) {
     error_pin::setHigh();
     // Non atomic when called from setup() but should be fine since ISR is not running yet.
     error_flags |= flags;
+    for (uint8 i = 0; i < kNumErrorTypes; i++) {
+      if (flags & (1 << i)) {
+        incrementCounter(&stats.errors[i]);
+      }
+    }
     error_pin::setLow();
   }
 
   // Called from main. Public. Assumed interrupts are enabled. 
   // Do not call from ISR.
-  boolean getAndClearErrorFlags() {
+  uint8 getAndClearErrorFlags() {
     // Disabling interrupts for a brief for atomicity. Need to pay attention to
     // ISR jitter due to disabled interrupts.
     cli();
-    const boolean result = error_flags;
+    const uint8 result = error_flags;
     error_flags = 0;
     sei();
     return result;
@@ -311,6 +766,32 @@ namespace lin_processor {
     { errors::OTHER, "OTHR" },
   };
 
+  // Print the given statistics. Error counters that are zero are omitted.
+  void printStats(const Stats& snapshot) {
+    sio::printf(F("frames %u"), snapshot.frames);
+    const uint8 n = ARRAY_SIZE(kErrorBitNames); 
+    for (uint8 i = 0; i < n; i++) {
+      const uint8 mask = pgm_read_byte(&kErrorBitNames[i].mask);
+      // Index of the error bit.
+      uint8 index = 0;
+      while (!(mask & (1 << index))) {
+        index++;
+      }
+      if (snapshot.errors[index]) {
+        const char* const name = (const char*)pgm_read_word(&kErrorBitNames[i].name);
+        sio::printchar(' ');
+        sio::print(name);
+        sio::printf(F(" %u"), snapshot.errors[index]);
+      }
+    }
+    if (snapshot.voted_bits) {
+      sio::printf(F(" VOTE %u"), snapshot.voted_bits);
+    }
+    if (snapshot.wakeups) {
+      sio::printf(F(" WAKE %u"), snapshot.wakeups);
+    }
+  }
+
   // Given a byte with lin processor error bitset, print the list
   // of set errors.
   void printErrorFlags(uint8 lin_errors) {
@@ -336,11 +817,8 @@ namespace lin_processor {
     DDRD |= H(DDD3);
     // Fast PWM mode, OC2B output active high.
     TCCR2A = L(COM2A1) | L(COM2A0) | H(COM2B1) | H(COM2B0) | H(WGM21) | H(WGM20);
-    const uint8 prescaler = config.prescaler_x64()
-      ? (H(CS22) | L(CS21) | L(CS20))   // x64
-        : (L(CS22) | H(CS21) | L(CS20));  // x8
-    // Prescaler: X8. Should match the definition of kPreScaler;
-    TCCR2B = L(FOC2A) | L(FOC2B) | H(WGM22) | prescaler;
+    // Prescaler: x8, x32 or x64, per config.
+    TCCR2B = L(FOC2A) | L(FOC2B) | H(WGM22) | config.prescaler_bits();
     // Clear counter.
     TCNT2 = 0;
     // Determines baud rate.
@@ -361,29 +839,99 @@ namespace lin_processor {
 
     setupPins();
     setupBuffers();
-    StateDetectBreak::enter();
-    setupTimer();
     error_flags = 0;
+    stats = Stats();
+    if (custom_defs::kUseAutoBaud && 
+        (!custom_defs::kUseEdgeRxEngine || custom_defs::kUseUsartRx)) {
+      sio::println(F("ERROR: kUseAutoBaud requires kUseEdgeRxEngine"));
+    }
+    if (custom_defs::kUseDualBus && 
+        (!custom_defs::kUseEdgeRxEngine || custom_defs::kUseAutoBaud)) {
+      sio::println(F("ERROR: kUseDualBus requires kUseEdgeRxEngine, no kUseAutoBaud"));
+    }
+    if (custom_defs::kUseMasterMode && (custom_defs::kUseEdgeRxEngine || 
+        custom_defs::kUseUsartRx || custom_defs::kUseAutoBaud)) {
+      sio::println(F("ERROR: kUseMasterMode requires the tick engine, no kUseAutoBaud"));
+    }
+    if (custom_defs::kUseUsartRx) {
+      usart_rx::setup();
+    } else if (custom_defs::kUseEdgeRxEngine) {
+      edge_rx::setup();
+    } else {
+      StateDetectBreak::enter();
+      setupTimer();
+    }
 
     sio::waitUntilFlushed();
     // TODO: move this to config class.
-    sio::printf(F("LIN: %u, %u, %u, %u, %u, %u, %u, %u\n"), 
+    sio::printf(F("LIN: %u, %u, %u, %u, %u, %u, %u, %u, %u\n"), 
         config.baud(), 
         custom_defs::kUseLinChecksumVersion2,
-        config.prescaler_x64(),
+        custom_defs::kUseEdgeRxEngine,
+        config.prescaling(),
         config.counts_per_bit(), 
         config.counts_per_half_bit(), 
         config.clock_ticks_per_bit(),  
         config.clock_ticks_per_half_bit(),  
-        config.clock_ticks_per_until_start_bit());
+        config.clock_ticks_until_byte());
   }
 
   // ----- ISR Utility Functions -----
 
-  // Set timer value to zero.
-  static inline void resetTickTimer() {
-    // TODO: also clear timer2 prescaler.
-    TCNT2 = 0;
+  // Accumulates the bit time fraction. See updateTickPeriod().
+  static uint8 bit_fraction_acc;
+
+  // ----- Per Frame Bit Timing -----
+  //
+  // The tick timing of the current frame. Nominal (per config) until the 
+  // sync byte of the frame is measured. With 
+  // custom_defs::kUseSyncDriftCompensation, the time from the falling edge of
+  // the sync start bit to the falling edge of its data bit 7, 8 bits later,
+  // sets the bit time of the rest of the frame, such that the late bits of
+  // the bytes are still sampled near their middle when the master clock is 
+  // off. The response is timed by the same clock since the slaves sync to 
+  // the master. Used by ISR only.
+  namespace frame_timing {
+    static uint8 counts_per_bit;
+    static uint8 counts_per_bit_fraction;
+    static uint8 counts_per_half_bit;
+
+    // Clock ticks of the falling edge of the sync start bit.
+    static uint16 sync_start_ticks;
+
+    static inline void setNominal() {
+      counts_per_bit = config.counts_per_bit();
+      counts_per_bit_fraction = config.counts_per_bit_fraction();
+      counts_per_half_bit = config.counts_per_half_bit();
+    }
+
+    // Set the timing from the clock ticks of the 8 sync bits. Keeps the 
+    // nominal timing if off by more than 1/8.
+    static inline void setFromSyncTicks(uint16 sync_ticks) {
+      // A clock tick is 64 cpu clocks, or 8 with
+      // custom_defs::kUseFineHardwareClock, and a timer2 count is 8, 32 or 64
+      // cpu clocks, so 256 * counts per bit are sync_ticks * 2048 / prescaling,
+      // or sync_ticks * 256 / prescaling.
+      const uint8 prescaling = config.prescaling();
+      const uint8 shift = custom_defs::kUseFineHardwareClock
+          ? ((prescaling == 8) ? 5 : (prescaling == 32) ? 3 : 2)
+          : ((prescaling == 8) ? 8 : (prescaling == 32) ? 6 : 5);
+      // Above that, more than 255 counts per bit.
+      if (sync_ticks > (0xffff >> shift)) {
+        return;
+      }
+      const uint16 counts_x256 = sync_ticks << shift;
+      const uint8 counts = counts_x256 >> 8;
+      const uint8 nominal = config.counts_per_bit();
+      const uint8 max_diff = nominal >> 3;
+      if ((counts > nominal ? counts - nominal : nominal - counts) > max_diff) {
+        return;
+      }
+      counts_per_bit = counts;
+      counts_per_bit_fraction = counts_x256 & 0xff;
+      // Adding two counts to compensate for software delay, as in config.
+      counts_per_half_bit = (counts >> 1) + 2;
+    }
   }
 
   // Set timer value to half a tick. Called at the begining of the
@@ -393,88 +941,253 @@ namespace lin_processor {
     // Adding 2 to compensate for pre calling delay. The goal is
     // to have the next ISR data sampling at the middle of the start
     // bit.
-    TCNT2 = config.counts_per_half_bit();
+    TCNT2 = frame_timing::counts_per_half_bit;
+    // Restart the fraction spreading of the new byte.
+    bit_fraction_acc = 0x80;
   }
 
-  // Perform a tight busy loop until RX is low or the given number
-  // of clock ticks passed (timeout). Retuns true if ok,
-  // false if timeout. Keeps timer reset during the wait.
-  // Called from ISR only.
-  static inline boolean waitForRxLow(uint16 max_clock_ticks) {
-    const uint16 base_clock = hardware_clock::ticksForIsr();
-    for(;;) {
-      // Keep the tick timer not ticking (no ISR).
-      resetTickTimer();
-
-      // If rx is low we are done.
-      if (!rx_pin::isHigh()) {
-        return true;
-      }
+  // Called from the tick ISR. Spreads the fractional part of the bit time
+  // by alternating the tick period between counts_per_bit and counts_per_bit + 1 
+  // such that the tick time error is always less than one count. OCR2A is
+  // double buffered so this sets the period of the next next tick.
+  static inline void updateTickPeriod() {
+    const uint8 fraction = frame_timing::counts_per_bit_fraction;
+    const uint8 acc = bit_fraction_acc + fraction;
+    bit_fraction_acc = acc;
+    // A carry adds a count.
+    OCR2A = (acc < fraction) ? frame_timing::counts_per_bit : frame_timing::counts_per_bit - 1;
+  }
 
-      // Test for timeout.
-      // Should work also in case of 16 bit clock overflow.
-      const uint16 clock_diff = hardware_clock::ticksForIsr() - base_clock;
-      if (clock_diff >= max_clock_ticks) {
-        return false; 
-      }
-    } 
+  // ----- Edge Waits -----
+  //
+  // The waits for an RX edge (the end of the break and the start bits of
+  // the bytes) stop the bit ticks and arm INT0 on the edge, with a timer1
+  // B-match timeout, rather than spinning in the tick ISR, so the main runs
+  // during the gaps. The ticks restart half a bit after the edge. Tick
+  // engine only.
+
+  // What we wait for. Like enum but 8 bits only.
+  namespace wait_events {
+    static const uint8 NONE = 0;
+    // Low to high transition at the end of the break.
+    static const uint8 BREAK_END = 1;
+    // High to low transition of the sync byte start bit.
+    static const uint8 SYNC_START = 2;
+    // High to low transition of the sync byte data bit 7. See frame_timing.
+    static const uint8 SYNC_BIT7 = 3;
+    // High to low transition of the start bit of next byte.
+    static const uint8 BYTE_START = 4;
+  }
+  static uint8 wait_event;
+
+  // Stop the bit ticks. Called from ISR only.
+  static inline void pauseTickTimer() {
+    TIMSK2 &= ~H(OCIE2A);
+  }
+
+  // Resume the bit ticks with the next tick in half a bit. Called from ISR only.
+  static inline void resumeTickTimerAtHalfTick() {
+    setTimerToHalfTick();
+    TIFR2 = H(OCF2A);
+    TIMSK2 |= H(OCIE2A);
   }
 
-  // Same as waitForRxLow but with reversed polarity.
-  // We clone to code for time optimization.
+  // Pause the bit ticks and wait for the given event, or until
+  // max_clock_ticks passed. Called from ISR only.
+  static inline void armWait(uint8 event, uint16 max_clock_ticks) {
+    pauseTickTimer();
+    wait_event = event;
+    // INT0 on rising edge for the break end, falling edge otherwise.
+    EICRA = (EICRA & ~(H(ISC01) | H(ISC00))) | ((event == wait_events::BREAK_END)
+        ? (H(ISC01) | H(ISC00))
+        : (H(ISC01) | L(ISC00)));
+    EIFR = H(INTF0);
+    EIMSK |= H(INT0);
+    OCR1B = hardware_clock::ticksForIsr() + max_clock_ticks;
+    TIFR1 = H(OCF1B);
+    TIMSK1 |= H(OCIE1B);
+  }
+
+  // Disarm the wait interrupts. Returns the event we waited for.
+  static inline uint8 disarmWait() {
+    EIMSK &= ~H(INT0);
+    TIMSK1 &= ~H(OCIE1B);
+    const uint8 event = wait_event;
+    wait_event = wait_events::NONE;
+    return event;
+  }
+
+  // ----- Bit Sampling -----
+
+  // Number of iterations of the delay loop between the majority vote samples.
+  // About 4 cycles each, so the three samples span about 8us at 16Mhz. This 
+  // also shifts the effective sampling point by about 4us.
+  static const uint8 kVoteSampleSpacingLoops = 16;
+
   // Called from ISR only.
-  static inline boolean waitForRxHigh(uint16 max_clock_ticks) {
-    const uint16 base_clock = hardware_clock::ticksForIsr();
-    for(;;) {
-      resetTickTimer();
-      if (rx_pin::isHigh()) {
-        return true;
-      }
-      // Should work also in case of an clock overflow.
-      const uint16 clock_diff = hardware_clock::ticksForIsr() - base_clock;
-      if (clock_diff >= max_clock_ticks) {
-        return false; 
-      }
-    } 
+  static inline void voteSampleDelay() {
+    for (uint8 i = kVoteSampleSpacingLoops; i; i--) {
+      asm volatile("");
+    }
+  }
+
+  // Sample the rx pin of a data bit. Returns non zero if high. Called from 
+  // ISR only.
+  static inline uint8 sampleRx() {
+    if (!custom_defs::kUseMajorityVoteSampling) {
+      return rx_pin::isHigh();
+    }
+    uint8 num_high = rx_pin::isHigh() ? 1 : 0;
+    voteSampleDelay();
+    if (rx_pin::isHigh()) {
+      num_high++;
+    }
+    voteSampleDelay();
+    if (rx_pin::isHigh()) {
+      num_high++;
+    }
+    // Count the bits where the samples disagree.
+    if (num_high == 1 || num_high == 2) {
+      incrementCounter(&stats.voted_bits);
+    }
+    return num_high >= 2;
   }
 
   // ----- Detect-Break State Implementation -----
 
+  // Max clock ticks from the detection of a break, after 10 low bits, to
+  // its end. A longer dominant pulse is a wake up pulse. About 1ms, which 
+  // allows breaks of up to 29 bits at 19200 baud.
+  static const uint16 kMaxBreakTailClockTicks = hardware_clock::kTicksPerMilli;
+
   uint8 StateDetectBreak::low_bits_counter_;
+  uint8 StateDetectBreak::quiet_ticks_;
+  uint8 StateDetectBreak::early_close_id_;
 
   inline void StateDetectBreak::enter() {
     state = states::DETECT_BREAK;
+    tick_handler = StateDetectBreak::handleIsr;
     low_bits_counter_ = 0;
+    quiet_ticks_ = 0;
+    frame_timing::setNominal();
+  }
+
+  inline void StateDetectBreak::enterAfterEarlyClose(uint8 id_byte) {
+    enter();
+    // The stop bit and the max space before the next byte.
+    quiet_ticks_ = 1 + kMaxByteSpaceBits;
+    early_close_id_ = id_byte;
   }
 
   // Return true if enough time to service rx request.
-  inline void StateDetectBreak::handleIsr() {
+  void StateDetectBreak::handleIsr() {
     if (rx_pin::isHigh()) {
       low_bits_counter_ = 0;
+      if (quiet_ticks_) {
+        quiet_ticks_--;
+      }
       return;
     } 
 
     // Here RX is low (active)  
 
+    // A start bit of a byte after a frame that we closed early. 
+    if (quiet_ticks_) {
+      quiet_ticks_ = 0;
+      frame_lengths::forget(early_close_id_);
+      setErrorFlags(errors::FRAME_TOO_LONG);
+    }
+
+    // Still low after a wake up pulse.
+    if (low_bits_counter_ >= 10) {
+      return;
+    }
+
     if (++low_bits_counter_ < 10) {
       return;
     }
 
     // Detected a break. Wait for rx high and enter data reading.
     break_pin::setHigh();
+    armWait(wait_events::BREAK_END, kMaxBreakTailClockTicks);
+  }
 
-    // TODO: set actual max count
-    waitForRxHigh(255);
+  inline void StateDetectBreak::handleBreakEnd(boolean ok) {
     break_pin::setLow();
+
+    // Too long for a break, a wake up pulse (250us to 5ms). Wait with the
+    // counter saturated for RX high and then for the next break, which the
+    // master sends 100ms to 150ms later.
+    if (!ok) {
+      incrementCounter(&stats.wakeups);
+      resumeTickTimerAtHalfTick();
+      return;
+    }
    
     // Go process the data
     StateReadData::enter();
   }
 
+  inline boolean StateDetectBreak::isIdle() {
+    return !low_bits_counter_ && !quiet_ticks_ && rx_pin::isHigh();
+  }
+
+  // ----- Send-Header State Implementation -----
+
+  uint8 StateSendHeader::id_byte_;
+  uint8 StateSendHeader::break_bits_;
+  uint16 StateSendHeader::byte_bits_;
+  boolean StateSendHeader::is_id_loaded_;
+
+  inline boolean StateSendHeader::start(uint8 id_byte) {
+    if (state != states::DETECT_BREAK || !StateDetectBreak::isIdle()) {
+      return false;
+    }
+    state = states::SEND_HEADER;
+    tick_handler = StateSendHeader::handleIsr;
+    id_byte_ = id_byte;
+    break_bits_ = 0;
+    byte_bits_ = 0;
+    is_id_loaded_ = false;
+    return true;
+  }
+
+  // Called on each tick, at the start of the next bit to send.
+  void StateSendHeader::handleIsr() {
+    // 13 bits of break and one bit of break delimiter.
+    if (break_bits_ < 14) {
+      if (++break_bits_ < 14) {
+        tx1_pin::setLow();
+        return;
+      }
+      tx1_pin::setHigh();
+      rx_frame_buffers[head_frame_buffer].reset();
+      rx_frame_buffers[head_frame_buffer].set_break_ticks(hardware_clock::ticks32ForIsr());
+      byte_bits_ = (0x55 << 1) | H(9);
+      return;
+    }
+
+    if (!byte_bits_) {
+      if (is_id_loaded_) {
+        // Here at the end of the stop bit of the id byte.
+        StateReadData::enterResponse(id_byte_);
+        return;
+      }
+      is_id_loaded_ = true;
+      byte_bits_ = ((uint16)id_byte_ << 1) | H(9);
+    }
+
+    if (byte_bits_ & 1) {
+      tx1_pin::setHigh();
+    } else {
+      tx1_pin::setLow();
+    }
+    byte_bits_ >>= 1;
+  }
+
   // ----- Read-Data State Implementation -----
 
   uint8 StateReadData::bytes_read_;
-  uint8 StateReadData::bits_read_in_byte_;
   uint8 StateReadData::byte_buffer_;
   uint8 StateReadData::byte_buffer_bit_mask_;
 
@@ -482,52 +1195,93 @@ namespace lin_processor {
   inline void StateReadData::enter() {
     state = states::READ_DATA;
     bytes_read_ = 0;
-    bits_read_in_byte_ = 0;
     rx_frame_buffers[head_frame_buffer].reset();
+    // Here right after the end of the break.
+    rx_frame_buffers[head_frame_buffer].set_break_ticks(hardware_clock::ticks32ForIsr());
 
-    // TODO: handle post break timeout errors.
     // TODO: set a reasonable time limit.
-    waitForRxLow(255);
-    setTimerToHalfTick();   
+    armWait(wait_events::SYNC_START, 255);
+  }
+
+  inline void StateReadData::handleSyncStart(boolean ok) {
+    if (!ok) {
+      setErrorFlags(errors::SYNC_BYTE);
+      StateDetectBreak::enter();
+      resumeTickTimerAtHalfTick();
+      return;
+    }
+    frame_timing::sync_start_ticks = hardware_clock::ticksForIsr();
+    tick_handler = handleStartBit;
+    resumeTickTimerAtHalfTick();
   }
 
-  inline void StateReadData::handleIsr() {
+  void StateReadData::handleStartBit() {
     // Sample data bit ASAP to avoid jitter.
     sample_pin::setHigh();
-    const uint8 is_rx_high = rx_pin::isHigh();
+    const uint8 is_rx_high = sampleRx();
     sample_pin::setLow();
-    
-    // Handle start bit.
-    if (bits_read_in_byte_ == 0) {
-      // Start bit error.
-      if (is_rx_high) {
-        // If in sync byte, report as a sync error.
-        setErrorFlags(bytes_read_ == 0 ? errors::SYNC_BYTE : errors::START_BIT);
-        StateDetectBreak::enter();
-        return;
-      }  
-      // Start bit ok.
-      bits_read_in_byte_++;
-      // Prepare buffer and mask for data bit collection.
-      byte_buffer_ = 0;
-      byte_buffer_bit_mask_ = (1 << 0);
+
+    // Start bit error.
+    if (is_rx_high) {
+      // If in sync byte, report as a sync error.
+      setErrorFlags(bytes_read_ == 0 ? errors::SYNC_BYTE : errors::START_BIT);
+      StateDetectBreak::enter();
       return;
-    }
+    }  
+    // Start bit ok. Prepare buffer and mask for data bit collection.
+    byte_buffer_ = 0;
+    byte_buffer_bit_mask_ = (1 << 0);
+    tick_handler = handleDataBit;
+  }
+
+  // Handle next data bit, 1 out of total of 8. 
+  void StateReadData::handleDataBit() {
+    sample_pin::setHigh();
+    const uint8 is_rx_high = sampleRx();
+    sample_pin::setLow();
 
-    // Handle next data bit, 1 out of total of 8. 
     // Collect the current bit into byte_buffer_, lsb first.
-    if (bits_read_in_byte_ <= 8) {
-      if (is_rx_high) {
-        byte_buffer_ |= byte_buffer_bit_mask_;
-      }
-      byte_buffer_bit_mask_ = byte_buffer_bit_mask_ << 1;
-      bits_read_in_byte_++;
+    if (is_rx_high) {
+      byte_buffer_ |= byte_buffer_bit_mask_;
+    }
+    byte_buffer_bit_mask_ = byte_buffer_bit_mask_ << 1;
+    if (!byte_buffer_bit_mask_) {
+      tick_handler = handleStopBit;
       return;
     }
-    
-    // Here when in a stop bit. 
+
+    if (custom_defs::kUseSyncDriftCompensation && bytes_read_ == 0 && 
+        byte_buffer_bit_mask_ == H(7)) {
+      measureSyncByte();
+    }
+  }
+
+  // Here after the high data bit 6 of the sync byte. Waits for the falling
+  // edge of the low data bit 7, then sets the timing of the rest of the
+  // frame and aligns the ticks to the edge. If the edge does not come, the
+  // sync byte is in error.
+  inline void StateReadData::measureSyncByte() {
+    armWait(wait_events::SYNC_BIT7, config.clock_ticks_per_bit());
+  }
+
+  inline void StateReadData::handleSyncBit7(boolean ok) {
+    if (!ok) {
+      setErrorFlags(errors::SYNC_BYTE);
+      StateDetectBreak::enter();
+      resumeTickTimerAtHalfTick();
+      return;
+    }
+    frame_timing::setFromSyncTicks(
+        hardware_clock::ticksForIsr() - frame_timing::sync_start_ticks);
+    resumeTickTimerAtHalfTick();
+  }
+
+  void StateReadData::handleStopBit() {
+    sample_pin::setHigh();
+    const uint8 is_rx_high = sampleRx();
+    sample_pin::setLow();
+
     bytes_read_++;
-    bits_read_in_byte_ = 0;
 
     // Error if stop bit is not high.
     if (!is_rx_high) {
@@ -553,74 +1307,976 @@ namespace lin_processor {
       // NOTE: the byte limit count is enforeced somewhere else so we can assume safely here that this 
       // will not cause a buffer overlow.
       rx_frame_buffers[head_frame_buffer].append_byte(byte_buffer_);
+      rx_frame_buffers[head_frame_buffer].set_end_ticks(hardware_clock::ticks32ForIsr());
+    }
+
+    afterByte();
+  }
+
+  // Called at the end of the stop bit of the id byte that we sent. The head 
+  // frame buffer was reset at the break delimiter.
+  inline void StateReadData::enterResponse(uint8 id_byte) {
+    state = states::READ_DATA;
+    bytes_read_ = 2;
+    rx_frame_buffers[head_frame_buffer].append_byte(id_byte);
+    rx_frame_buffers[head_frame_buffer].set_end_ticks(hardware_clock::ticks32ForIsr());
+    afterByte();
+  }
+
+  inline void StateReadData::afterByte() {
+    LinFrame& frame = rx_frame_buffers[head_frame_buffer];
+
+    // Ignore the rest of frames with a rejected id.
+    if (bytes_read_ == 2 && !id_filter::isAccepted(frame.get_byte(0))) {
+      StateDetectBreak::enter();
+      return;
+    }
+
+    // If the frame has its learned length, close it now rather than waiting
+    // for the space timeout.
+    if (bytes_read_ >= 2 && frame_lengths::isComplete(frame.get_byte(0), frame.num_bytes())) {
+      if (!publishHeadFrameBuffer()) {
+        setErrorFlags(errors::BUFFER_OVERRUN);
+      }
+      StateDetectBreak::enterAfterEarlyClose(frame.get_byte(0));
+      return;
     }
 
-    // Wait for the high to low transition of start bit of next byte.
-    const boolean has_more_bytes =  waitForRxLow(config.clock_ticks_per_until_start_bit());
+    // Wait for the high to low transition of start bit of next byte. The
+    // response may have a longer space.
+    armWait(wait_events::BYTE_START, (bytes_read_ == 2)
+        ? config.clock_ticks_until_response() : config.clock_ticks_until_byte());
+  }
+
+  inline void StateReadData::handleByteStart(boolean ok) {
+    LinFrame& frame = rx_frame_buffers[head_frame_buffer];
 
     // Handle the case of no more bytes in this frame.
-    if (!has_more_bytes) {
+    if (!ok) {
       // Verify min byte count.
       if (bytes_read_ < LinFrame::kMinBytes) {
         setErrorFlags(errors::FRAME_TOO_SHORT);
         StateDetectBreak::enter();
+        resumeTickTimerAtHalfTick();
         return;
       }
 
+      frame_lengths::learn(frame.get_byte(0), frame.num_bytes());
+
       // Frame looks ok so far. Move to next frame in the ring buffer.
       // NOTE: we will reset the byte_count of the new frame buffer next time we will enter data detect state.
       // NOTE: verification of sync byte, id, checksum, etc is done latter by the main code, not the ISR.
-      incrementHeadFrameBuffer();
-      if (tail_frame_buffer == head_frame_buffer) {
-        // Frame buffer overrun. We drop the oldest frame and continue with this one.       
+      if (!publishHeadFrameBuffer()) {
+        // Frame buffer overrun. We drop this frame.
         setErrorFlags(errors::BUFFER_OVERRUN);
-        incrementTailFrameBuffer();
       }
 
       StateDetectBreak::enter();
+      resumeTickTimerAtHalfTick();
       return;
     }
 
+    // Have a tick in the middle of the start bit ASAP.
+    resumeTickTimerAtHalfTick();
+    tick_handler = handleStartBit;
+
     // Here when there is at least one more byte in this frame. Error if we already had
     // the max number of bytes.
-    if (rx_frame_buffers[head_frame_buffer].num_bytes() >= LinFrame::kMaxBytes) {
+    if (frame.num_bytes() >= LinFrame::kMaxBytes) {
       setErrorFlags(errors::FRAME_TOO_LONG);
       StateDetectBreak::enter();
-      return;  
     }
+  }
 
-    // Everything is ready for the next byte. Have a tick in the middle of its
-    // start bit.
-    //
-    // TODO: move this to above the num_bytes check above for more accurate 
-    // timing of mid bit tick?
+  // ----- Bus Sleep -----
+
+  // Set by main, cleared by the INT0 ISR.
+  static volatile boolean bus_sleeping = false;
+
+  void enterBusSleep() {
+    if (custom_defs::kUseEdgeRxEngine || custom_defs::kUseUsartRx || bus_sleeping) {
+      return;
+    }
+    cli();
+    // Not in the middle of a wait, whose interrupts would resume the ticks.
+    if (wait_event != wait_events::NONE) {
+      sei();
+      return;
+    }
+    // Stop timer 2 and its interrupt.
+    TIMSK2 = L(OCIE2B) | L(OCIE2A) | L(TOIE2);
+    TCCR2B = L(FOC2A) | L(FOC2B) | H(WGM22);
+    // Interrupt on the falling edge of INT0 (PD2), the RX pin.
+    EICRA = (EICRA & ~(H(ISC01) | H(ISC00))) | H(ISC01) | L(ISC00);
+    EIFR = H(INTF0);
+    EIMSK |= H(INT0);
+    bus_sleeping = true;
+    sei();
+  }
+
+  boolean isBusSleeping() {
+    return bus_sleeping;
+  }
+
+  // ----- Master Mode -----
+
+  boolean sendHeader(uint8 id) {
+    if (!custom_defs::kUseMasterMode || bus_sleeping) {
+      return false;
+    }
+    const uint8 sreg = SREG;
+    cli();
+    const boolean ok = StateSendHeader::start(LinFrame::pid(id));
+    SREG = sreg;
+    return ok;
+  }
+
+  // Called from the INT0 ISR on the first edge after enterBusSleep().
+  static inline void wakeFromBusSleep() {
+    EIMSK &= ~H(INT0);
+    StateDetectBreak::enter();
+    setupTimer();
+    // Fast re-sync. The edge is the start of a break or a wake up pulse, 
+    // sample its bits from their middle such that the break is detected 
+    // as if the processor never slept.
     setTimerToHalfTick();
+    bus_sleeping = false;
   }
 
   // ----- ISR Handler -----
 
-  // Interrupt on Timer 2 A-match.
-  ISR(TIMER2_COMPA_vect)
-  {
-    isr_pin::setHigh();
-    // TODO: make this state a boolean instead of enum? (efficency).
-    switch (state) {
-    case states::DETECT_BREAK:
-      StateDetectBreak::handleIsr();
+  // Called from the INT0 ISR when the armed edge arrived, or from the timer1
+  // B-match ISR with false on timeout.
+  static inline void handleWaitDone(boolean ok) {
+    switch (disarmWait()) {
+    case wait_events::BREAK_END:
+      StateDetectBreak::handleBreakEnd(ok);
       break;
-    case states::READ_DATA:
-      StateReadData::handleIsr();
+    case wait_events::SYNC_START:
+      StateReadData::handleSyncStart(ok);
+      break;
+    case wait_events::SYNC_BIT7:
+      StateReadData::handleSyncBit7(ok);
+      break;
+    case wait_events::BYTE_START:
+      StateReadData::handleByteStart(ok);
       break;
     default:
       setErrorFlags(errors::OTHER);
       StateDetectBreak::enter();
+      resumeTickTimerAtHalfTick();
     }
+  }
 
-    // Increment the isr flag to indicate to the main that the ISR just
-    // exited and interrupts can be temporarily disabled without causes ISR 
-    // jitter.
-    isr_marker++;
-    
+  // Interrupt on Timer 2 A-match.
+  ISR(TIMER2_COMPA_vect)
+  {
+    isr_pin::setHigh();
+    tick_handler();
+    updateTickPeriod();
+
+    isr_pin::setLow();
+  }
+
+  // ----- Edge Timestamp Engine -----
+  //
+  // Alternative RX engine for listen only devices. Instead of sampling each bit
+  // with a timer2 tick, INT0 captures the hardware clock value of each RX edge 
+  // and the bytes are reconstructed from the edge intervals. A timer1 B-match 
+  // timeout closes bytes that end with high bits and detects end of frame. 
+  // There are no busy waits so the ISRs are short and the main can disable
+  // interrupts without corrupting the bits timing.
+  //
+  // With custom_defs::kUseDualBus a second, independent bus is received on 
+  // rx2 (PC1) by a second instance of the engine, with the PCINT9 pin change
+  // interrupt, its timeouts sharing the timer1 B-match. Each channel has its
+  // own state, so both buses can be in the middle of a frame at the same 
+  // time.
+  namespace edge_rx {
+    // Like enum but 8 bits only.
+    namespace edge_states {
+      // Waiting for the high to low transition of a break.
+      static const uint8 IDLE = 1;
+      // RX is low, may be a break.
+      static const uint8 BREAK_LOW = 2;
+      // Waiting for the start bit of next byte (or end of frame timeout).
+      static const uint8 WAIT_START = 3;
+      // Collecting the bits of a byte.
+      static const uint8 IN_BYTE = 4;
+    }
+
+    // ----- Auto baud (custom_defs::kUseAutoBaud)
+    //
+    // The bit time is measured from the falling edges of the 0x55 sync byte,
+    // at bits 0, 2, 4, 6 and 8 of the byte, and is used for the rest of the
+    // frame. Since each frame is measured, this follows also master clock drift.
+    // Channel 0 only, not used with kUseDualBus.
+
+    // Break length when the baud rate is not locked yet, 10 bits at 20k baud. 
+    static const uint16 kAutoBaudBreakTicks = (hardware_clock::kTicksPerMilli * 10) / 20;
+
+    // Sync byte timeout when measuring, 9 bits at 1k baud.
+    static const uint16 kAutoBaudSyncTicks = (hardware_clock::kTicksPerMilli * 9);
+
+    // Range of valid bit time in 1/16 clock ticks (20k to 1k baud).
+    static const uint16 kAutoBaudMinBitTicksX16 = (hardware_clock::kTicksPerMilli * 16) / 20; 
+    static const uint16 kAutoBaudMaxBitTicksX16 = (hardware_clock::kTicksPerMilli * 16); 
+
+    // Number of consecutive sync failures that unlock the baud rate.
+    static const uint8 kAutoBaudMaxFailures = 3;
+
+    // True if the bit time was measured from a valid sync byte. Written by
+    // ISR only.
+    static volatile boolean baud_locked;
+
+    // Consecutive sync measurement failures.
+    static uint8 sync_failures;
+
+    // Number of falling edges seen so far in the sync byte, including the
+    // start bit.
+    static uint8 sync_falls;
+
+    // Clock value of the previous falling edge of the sync byte.
+    static uint16 sync_prev_fall_ticks;
+
+    // Clock ticks between the first two falling edges of the sync byte (2 bits).
+    static uint16 sync_first_interval;
+
+    // The frames being received by the channels with kUseDualBus. They are
+    // copied to the queue when complete. Otherwise channel 0 receives in the
+    // head frame buffer.
+    static LinFrame dual_bus_frames[custom_defs::kUseDualBus ? 2 : 1];
+
+    // With kUseDualBus, the timeouts of both channels share the timer1 
+    // B-match (the A-match is used by the beeper buzzer). The clock values 
+    // of the armed timeouts, indexed by channel, and a bit mask of the armed
+    // channels. OCR1B is set to the earliest one.
+    static uint16 timeout_ticks[2];
+    static uint8 timeouts_armed;
+
+    // Set OCR1B to the earliest armed timeout, or disable the B-match 
+    // interrupt if none is armed. A timeout that already passed fires a 
+    // few ticks from now.
+    static inline void rearmSharedTimeout() {
+      if (!timeouts_armed) {
+        TIMSK1 &= ~H(OCIE1B);
+        return;
+      }
+      uint16 ticks = timeout_ticks[(timeouts_armed & H(0)) ? 0 : 1];
+      if (timeouts_armed == (H(0) | H(1)) && 
+          (int16)(timeout_ticks[1] - timeout_ticks[0]) < 0) {
+        ticks = timeout_ticks[1];
+      }
+      const uint16 min_ticks = hardware_clock::ticksForIsr() + 2;
+      if ((int16)(ticks - min_ticks) < 0) {
+        ticks = min_ticks;
+      }
+      OCR1B = ticks;
+      TIFR1 = H(OCF1B);
+      TIMSK1 |= H(OCIE1B);
+    }
+
+    // An engine instance. kChannel is 0 for rx (INT0) and 1 for rx2 
+    // (PCINT9), both with timeouts on the timer1 B-match. The state is static per instance, 
+    // so the channel 0 code is the same as with a single engine.
+    template <uint8 kChannel>
+    class Channel {
+    public:
+      static const boolean kAutoBaud = custom_defs::kUseAutoBaud && kChannel == 0;
+
+      static uint8 edge_state;
+
+      // Clock value of the last high to low edge (break or start bit).
+      static uint16 low_start_ticks;
+
+      // Number of bits assigned so far in current byte [0, 10]. Includes start and
+      // stop bits.
+      static uint8 bits_in_byte;
+      
+      // Bit k is the value of bit k of current byte (0 = start bit, 9 = stop bit).
+      static uint16 bits_buffer;
+
+      // The offset of the middle of next unassigned bit from the start bit edge. 
+      // In 1/16 clock ticks.
+      static uint16 next_bit_middle_x16;
+
+      // Number of complete bytes read so far, including the sync byte.
+      static uint8 bytes_read;
+
+      // True while watching for an unexpected byte after a frame that was
+      // closed by its learned length (see frame_lengths). 
+      static boolean early_closed;
+      static uint8 early_close_id;
+
+      static inline boolean isRxHigh() {
+        return (kChannel == 0) ? rx_pin::isHigh() : rx2_pin::isHigh();
+      }
+
+      // True if between frames, not watching for a byte after an early close.
+      static inline boolean isIdle() {
+        return edge_state == edge_states::IDLE && !early_closed;
+      }
+
+      // The frame being received.
+      static inline LinFrame& frame() {
+        return custom_defs::kUseDualBus 
+            ? dual_bus_frames[kChannel] : rx_frame_buffers[head_frame_buffer];
+      }
+
+      static inline boolean publishFrame() {
+        if (!custom_defs::kUseDualBus) {
+          return publishHeadFrameBuffer();
+        }
+        // The head buffer is not used by the channels.
+        rx_frame_buffers[head_frame_buffer] = dual_bus_frames[kChannel];
+        return publishHeadFrameBuffer();
+      }
+
+      // Arm the timeout ISR to fire at the given clock value.
+      static inline void armTimeout(uint16 ticks) {
+        if (custom_defs::kUseDualBus) {
+          timeout_ticks[kChannel] = ticks;
+          timeouts_armed |= H(kChannel);
+          rearmSharedTimeout();
+          return;
+        }
+        OCR1B = ticks;
+        TIFR1 = H(OCF1B);
+        TIMSK1 |= H(OCIE1B);
+      }
+
+      static inline void disarmTimeout() {
+        if (custom_defs::kUseDualBus) {
+          timeouts_armed &= ~H(kChannel);
+          rearmSharedTimeout();
+          return;
+        }
+        TIMSK1 &= ~H(OCIE1B);
+      }
+
+      // With kUseDualBus, called from the timer1 B-match ISR. Handles the
+      // timeout of this channel if it passed.
+      static inline void handleSharedTimeout(uint16 now) {
+        if ((timeouts_armed & H(kChannel)) && 
+            (int16)(now - timeout_ticks[kChannel]) >= 0) {
+          // The handler may arm it again.
+          timeouts_armed &= ~H(kChannel);
+          handleTimeout();
+        }
+      }
+
+      static inline void enterIdle() {
+        disarmTimeout();
+        early_closed = false;
+        edge_state = edge_states::IDLE;
+      }
+
+      // Called on the start bit edge.
+      static inline void enterByte(uint16 now) {
+        low_start_ticks = now;
+        bits_in_byte = 0;
+        bits_buffer = 0;
+        next_bit_middle_x16 = config.clock_ticks_per_bit_x16() >> 1;
+        edge_state = edge_states::IN_BYTE;
+        if (kAutoBaud && bytes_read == 0) {
+          sync_falls = 1;
+          sync_prev_fall_ticks = now;
+          armTimeout(now + kAutoBaudSyncTicks);
+          return;
+        }
+        armTimeout(now + config.clock_ticks_until_stop_bit());
+      }
+
+      // Called when the sync byte could not be measured.
+      static inline void syncFailed() {
+        setErrorFlags(errors::SYNC_BYTE);
+        if (++sync_failures >= kAutoBaudMaxFailures) {
+          baud_locked = false;
+        }
+        enterIdle();
+      }
+
+      // Called on each edge of the sync byte when auto baud is enabled.
+      static inline void measureSyncEdge(uint16 now, uint8 is_rx_high) {
+        if (is_rx_high) {
+          return;
+        }
+        // Each fall to fall interval is two bits. They should be similar.
+        const uint16 interval = now - sync_prev_fall_ticks;
+        sync_prev_fall_ticks = now;
+        if (sync_falls == 1) {
+          sync_first_interval = interval;
+        } else {
+          const uint16 diff = (interval > sync_first_interval)
+              ? interval - sync_first_interval : sync_first_interval - interval;
+          if (diff > (sync_first_interval >> 2) + 1) {
+            syncFailed();
+            return;
+          }
+        }
+        if (++sync_falls < 5) {
+          return;
+        }
+
+        // Here at the begining of the last data bit, 8 bits after the start 
+        // bit edge. x16 / 8 = x2.
+        const uint16 ticks_x16 = (uint16)(now - low_start_ticks) << 1;
+        if (ticks_x16 < kAutoBaudMinBitTicksX16 || ticks_x16 > kAutoBaudMaxBitTicksX16) {
+          syncFailed();
+          return;
+        }
+        config.setEdgeBitTicksX16(ticks_x16);
+        baud_locked = true;
+        sync_failures = 0;
+
+        // The start and data bits are known. Let the timeout sample the stop bit.
+        bits_in_byte = 9;
+        bits_buffer = (0x55 << 1);
+        next_bit_middle_x16 = ((uint32)ticks_x16 * 19) >> 1;
+        armTimeout(low_start_ticks + config.clock_ticks_until_stop_bit());
+      }
+
+      // Assign the given bit value to all the bits whose middle is before the 
+      // given offset from the start bit edge.
+      static inline void assignBits(uint16 offset_ticks, uint8 is_high) {
+        // Avoid x16 overflow. Edges that late complete the byte anyway.
+        if (offset_ticks > 0x0fff) {
+          offset_ticks = 0x0fff;
+        }
+        const uint16 offset_x16 = offset_ticks << 4;
+        while (bits_in_byte < 10 && next_bit_middle_x16 <= offset_x16) {
+          if (is_high) {
+            bits_buffer |= (1 << bits_in_byte);
+          }
+          bits_in_byte++;
+          next_bit_middle_x16 += config.clock_ticks_per_bit_x16();
+        }
+      }
+
+      // Called when the frame has its learned length. Publish it and stay idle
+      // but watch for unexpected bytes until the byte space timeout.
+      static inline void closeFrameEarly() {
+        early_close_id = frame().get_byte(0);
+        if (!publishFrame()) {
+          setErrorFlags(errors::BUFFER_OVERRUN);
+        }
+        edge_state = edge_states::IDLE;
+        early_closed = true;
+        armTimeout(low_start_ticks + config.clock_ticks_until_stop_bit() 
+            + config.clock_ticks_per_byte_space());
+      }
+
+      // Called on a high to low edge in the idle state.
+      static inline void handleIdleFall(uint16 now) {
+        // A start bit right after a frame that was closed early.
+        if (early_closed) {
+          early_closed = false;
+          disarmTimeout();
+          frame_lengths::forget(early_close_id);
+          setErrorFlags(errors::FRAME_TOO_LONG);
+        }
+        low_start_ticks = now;
+        edge_state = edge_states::BREAK_LOW;
+      }
+
+      // Called when all the 10 bits of the byte were assigned. Returns true if
+      // waiting for next byte, false if error (error flag is set and the state
+      // is idle) or the frame was completed.
+      static inline boolean closeByte() {
+        const uint8 value = (bits_buffer >> 1) & 0xff;
+        // Start bit error. If in sync byte, report as a sync error.
+        if (bits_buffer & (1 << 0)) {
+          setErrorFlags(bytes_read == 0 ? errors::SYNC_BYTE : errors::START_BIT);
+          enterIdle();
+          return false;
+        }
+        // Stop bit error.
+        if (!(bits_buffer & (1 << 9))) {
+          setErrorFlags(bytes_read == 0 ? errors::SYNC_BYTE : errors::STOP_BIT);
+          enterIdle();
+          return false;
+        }
+        bytes_read++;
+        if (bytes_read == 1) {
+          // Sync byte, should be exactly 0x55. We don't append it to the buffer.
+          if (value != 0x55) {
+            setErrorFlags(errors::SYNC_BYTE);
+            enterIdle();
+            return false;
+          }
+        } else {
+          frame().append_byte(value);
+          frame().set_end_ticks(hardware_clock::ticks32ForIsr());
+        }
+        if (bytes_read >= 2 && frame_lengths::isComplete(frame().get_byte(0), frame().num_bytes())) {
+          closeFrameEarly();
+          return false;
+        }
+        edge_state = edge_states::WAIT_START;
+        armTimeout(low_start_ticks + config.clock_ticks_until_stop_bit() 
+            + ((bytes_read == 2) 
+                ? config.clock_ticks_per_response_space() 
+                : config.clock_ticks_per_byte_space()));
+        return true;
+      }
+
+      // Called on the high to low edge of a start bit while waiting for next byte.
+      static inline void startNextByte(uint16 now) {
+        if (frame().num_bytes() >= LinFrame::kMaxBytes) {
+          setErrorFlags(errors::FRAME_TOO_LONG);
+          enterIdle();
+          return;
+        }
+        enterByte(now);
+      }
+
+      // Called on the end of frame timeout.
+      static inline void closeFrame() {
+        if (bytes_read < LinFrame::kMinBytes) {
+          setErrorFlags(errors::FRAME_TOO_SHORT);
+          enterIdle();
+          return;
+        }
+        frame_lengths::learn(frame().get_byte(0), frame().num_bytes());
+        if (!publishFrame()) {
+          // Frame buffer overrun. We drop this frame.
+          setErrorFlags(errors::BUFFER_OVERRUN);
+        }
+        enterIdle();
+      }
+
+      // Called from the pin change ISR with the clock and the pin sampled 
+      // at its start.
+      static inline void handleEdge(uint16 now, uint8 is_rx_high) {
+        switch (edge_state) {
+        case edge_states::IDLE:
+          if (!is_rx_high) {
+            handleIdleFall(now);
+          }
+          break;
+
+        case edge_states::BREAK_LOW:
+          if (!is_rx_high) {
+            // Missed the rising edge. Restart break measurement.
+            low_start_ticks = now;
+            break;
+          }
+          if ((uint16)(now - low_start_ticks) < 
+              ((kAutoBaud && !baud_locked) 
+                  ? kAutoBaudBreakTicks : config.clock_ticks_per_break())) {
+            edge_state = edge_states::IDLE;
+            break;
+          }
+          // Detected a break. Wait for the start bit of the sync byte.
+          break_pin::setHigh();
+          bytes_read = 0;
+          frame().reset();
+          frame().set_channel(kChannel);
+          frame().set_break_ticks(hardware_clock::ticks32ForIsr());
+          edge_state = edge_states::WAIT_START;
+          armTimeout(now + config.clock_ticks_per_byte_space());
+          break_pin::setLow();
+          break;
+
+        case edge_states::WAIT_START:
+          if (!is_rx_high) {
+            startNextByte(now);
+          }
+          break;
+
+        case edge_states::IN_BYTE:
+          if (kAutoBaud && bytes_read == 0 && bits_in_byte < 9) {
+            measureSyncEdge(now, is_rx_high);
+            break;
+          }
+          // The bits before this edge have the opposite value of the new level.
+          sample_pin::setHigh();
+          assignBits(now - low_start_ticks, !is_rx_high);
+          sample_pin::setLow();
+          // A start bit of next byte that came before the stop bit timeout.
+          if (bits_in_byte >= 10 && !is_rx_high) {
+            if (closeByte()) {
+              startNextByte(now);
+            } else if (early_closed) {
+              handleIdleFall(now);
+            }
+          }
+          break;
+
+        default:
+          setErrorFlags(errors::OTHER);
+          enterIdle();
+        }
+      }
+
+      // Called from the timer1 B-match ISR when the timeout of the channel
+      // passed.
+      static inline void handleTimeout() {
+        switch (edge_state) {
+        case edge_states::IN_BYTE:
+          // Sync byte too slow or incomplete.
+          if (kAutoBaud && bytes_read == 0 && bits_in_byte < 9) {
+            syncFailed();
+            break;
+          }
+          // No edges since the last one so the remaining bits have the current level.
+          assignBits(0x0fff, isRxHigh());
+          closeByte();
+          break;
+
+        case edge_states::WAIT_START:
+          // No more bytes. 
+          closeFrame();
+          break;
+
+        default:
+          // Including the end of the watch after an early close.
+          early_closed = false;
+          disarmTimeout();
+        }
+      }
+    };
+
+    template <uint8 kChannel> uint8 Channel<kChannel>::edge_state;
+    template <uint8 kChannel> uint16 Channel<kChannel>::low_start_ticks;
+    template <uint8 kChannel> uint8 Channel<kChannel>::bits_in_byte;
+    template <uint8 kChannel> uint16 Channel<kChannel>::bits_buffer;
+    template <uint8 kChannel> uint16 Channel<kChannel>::next_bit_middle_x16;
+    template <uint8 kChannel> uint8 Channel<kChannel>::bytes_read;
+    template <uint8 kChannel> boolean Channel<kChannel>::early_closed;
+    template <uint8 kChannel> uint8 Channel<kChannel>::early_close_id;
+
+    static inline void setup() {
+      Channel<0>::edge_state = edge_states::IDLE;
+      baud_locked = false;
+      sync_failures = 0;
+      // Interrupt on any logical change of INT0 (PD2).
+      EICRA = (EICRA & ~(H(ISC01) | H(ISC00))) | L(ISC01) | H(ISC00);
+      EIFR = H(INTF0);
+      EIMSK |= H(INT0);
+      if (custom_defs::kUseDualBus) {
+        Channel<1>::edge_state = edge_states::IDLE;
+        // Interrupt on any change of PCINT9 (PC1).
+        PCMSK1 |= H(PCINT9);
+        PCIFR = H(PCIF1);
+        PCICR |= H(PCIE1);
+      }
+    }
+  }  // namespace edge_rx
+
+  // ----- USART Engine -----
+  //
+  // Alternative RX engine for listen only devices on MCUs with a second 
+  // USART, the ATmega328PB (RXD1 is PB4) and the ATmega32U4 (RXD1 is PD2). 
+  // The USART receives the bytes and interrupts once per byte instead of 
+  // once per bit. A break is received as a 0x00 byte with a framing error,
+  // the USART then waits for the falling edge of the sync start bit. A 
+  // timer1 B-match timeout detects the end of frame. Timer2 and INT0 are 
+  // not used in this mode.
+  namespace usart_rx {
+#if defined(UDR1)
+    static const boolean kHasUsart = true;
+#else
+    static const boolean kHasUsart = false;
+#endif
+    typedef char UsartRxRequiresUsart1[(!custom_defs::kUseUsartRx || kHasUsart) ? 1 : -1];
+
+    // Like enum but 8 bits only.
+    namespace usart_states {
+      // Waiting for a break.
+      static const uint8 IDLE = 1;
+      // Break received, waiting for the sync byte.
+      static const uint8 WAIT_SYNC = 2;
+      // Receiving the id, data and checksum bytes.
+      static const uint8 IN_FRAME = 3;
+    }
+    static uint8 usart_state;
+
+    // Max clock ticks from a byte to the next one, which is received 10 bits
+    // after its start bit. After the id byte and after other bytes. Set in 
+    // setup().
+    static uint16 response_timeout_ticks;
+    static uint16 byte_timeout_ticks;
+
+    // True while watching for an unexpected byte after a frame that was
+    // closed by its learned length (see frame_lengths).
+    static boolean early_closed;
+    static uint8 early_close_id;
+
+    // Arm the timeout ISR to fire at the given clock value.
+    static inline void armTimeout(uint16 ticks) {
+      OCR1B = ticks;
+      TIFR1 = H(OCF1B);
+      TIMSK1 |= H(OCIE1B);
+    }
+
+    static inline void disarmTimeout() {
+      TIMSK1 &= ~H(OCIE1B);
+    }
+
+    static inline void enterIdle() {
+      disarmTimeout();
+      early_closed = false;
+      usart_state = usart_states::IDLE;
+    }
+
+    // True if between frames, not watching for a byte after an early close.
+    static inline boolean isIdle() {
+      return usart_state == usart_states::IDLE && !early_closed;
+    }
+
+    // Called on the end of frame timeout.
+    static inline void closeFrame() {
+      if (usart_state != usart_states::IN_FRAME) {
+        // Including the end of the watch after an early close and a missing
+        // sync byte.
+        if (usart_state == usart_states::WAIT_SYNC) {
+          setErrorFlags(errors::SYNC_BYTE);
+        }
+        enterIdle();
+        return;
+      }
+      LinFrame& frame = rx_frame_buffers[head_frame_buffer];
+      if (frame.num_bytes() < LinFrame::kMinBytes) {
+        setErrorFlags(errors::FRAME_TOO_SHORT);
+        enterIdle();
+        return;
+      }
+      frame_lengths::learn(frame.get_byte(0), frame.num_bytes());
+      if (!publishHeadFrameBuffer()) {
+        // Frame buffer overrun. We drop this frame.
+        setErrorFlags(errors::BUFFER_OVERRUN);
+      }
+      enterIdle();
+    }
+
+    // Called on a received break. The break ticks of the frame are of the 
+    // 10th bit of the break.
+    static inline void handleBreak() {
+      break_pin::setHigh();
+      if (usart_state == usart_states::IN_FRAME) {
+        // The timeout did not close the previous frame yet.
+        closeFrame();
+      }
+      early_closed = false;
+      rx_frame_buffers[head_frame_buffer].reset();
+      rx_frame_buffers[head_frame_buffer].set_break_ticks(hardware_clock::ticks32ForIsr());
+      usart_state = usart_states::WAIT_SYNC;
+      armTimeout(hardware_clock::ticksForIsr() + byte_timeout_ticks);
+      break_pin::setLow();
+    }
+
+    // Called on a byte received with no framing error in a frame.
+    static inline void handleFrameByte(uint8 value) {
+      LinFrame& frame = rx_frame_buffers[head_frame_buffer];
+      if (frame.num_bytes() >= LinFrame::kMaxBytes) {
+        setErrorFlags(errors::FRAME_TOO_LONG);
+        enterIdle();
+        return;
+      }
+      frame.append_byte(value);
+      frame.set_end_ticks(hardware_clock::ticks32ForIsr());
+      if (frame_lengths::isComplete(frame.get_byte(0), frame.num_bytes())) {
+        early_close_id = frame.get_byte(0);
+        if (!publishHeadFrameBuffer()) {
+          setErrorFlags(errors::BUFFER_OVERRUN);
+        }
+        usart_state = usart_states::IDLE;
+        early_closed = true;
+        armTimeout(hardware_clock::ticksForIsr() + byte_timeout_ticks);
+        return;
+      }
+      armTimeout(hardware_clock::ticksForIsr() + 
+          ((frame.num_bytes() == 1) ? response_timeout_ticks : byte_timeout_ticks));
+    }
+
+    // Called on each received byte, with the USART status of the byte.
+    static inline void handleByte(uint8 has_frame_error, uint8 value) {
+      // A break, or a stop bit error.
+      if (has_frame_error) {
+        if (value == 0x00) {
+          handleBreak();
+          return;
+        }
+        if (usart_state != usart_states::IDLE) {
+          setErrorFlags(usart_state == usart_states::WAIT_SYNC 
+              ? errors::SYNC_BYTE : errors::STOP_BIT);
+        }
+        enterIdle();
+        return;
+      }
+
+      switch (usart_state) {
+      case usart_states::IDLE:
+        // A byte right after a frame that was closed early.
+        if (early_closed) {
+          frame_lengths::forget(early_close_id);
+          setErrorFlags(errors::FRAME_TOO_LONG);
+          enterIdle();
+        }
+        break;
+
+      case usart_states::WAIT_SYNC:
+        // Sync byte, should be exactly 0x55. We don't append it to the buffer.
+        if (value != 0x55) {
+          setErrorFlags(errors::SYNC_BYTE);
+          enterIdle();
+          break;
+        }
+        usart_state = usart_states::IN_FRAME;
+        armTimeout(hardware_clock::ticksForIsr() + byte_timeout_ticks);
+        break;
+
+      case usart_states::IN_FRAME:
+        handleFrameByte(value);
+        break;
+
+      default:
+        setErrorFlags(errors::OTHER);
+        enterIdle();
+      }
+    }
+
+    static inline void setup() {
+      usart_state = usart_states::IDLE;
+      early_closed = false;
+      // Eleven bits, one as a margin for the USART sampling.
+      const uint16 byte_ticks = (config.clock_ticks_per_bit_x16() * 11) >> 4;
+      response_timeout_ticks = byte_ticks + config.clock_ticks_per_response_space();
+      byte_timeout_ticks = byte_ticks + config.clock_ticks_per_byte_space();
+#if defined(UDR1)
+      // Double speed for a smaller baud rate error, 0.2% at 19200.
+      UBRR1 = ((F_CPU / 8) + (config.baud() / 2)) / config.baud() - 1;
+      UCSR1A = H(U2X1);
+      // 8 data bits, no parity, 1 stop bit. Receiver only, with the RX 
+      // complete interrupt.
+      UCSR1C = H(UCSZ11) | H(UCSZ10);
+      UCSR1B = H(RXCIE1) | H(RXEN1);
+#endif
+    }
+  }  // namespace usart_rx
+
+#if defined(UDR1)
+  // Interrupt on a byte received by USART1.
+  ISR(USART1_RX_vect)
+  {
+    isr_pin::setHigh();
+    // The status should be read before the data.
+    const uint8 status = UCSR1A;
+    const uint8 value = UDR1;
+    if (status & H(DOR1)) {
+      // A byte was lost, the ISR was blocked for more than a byte time.
+      setErrorFlags(errors::OTHER);
+      usart_rx::enterIdle();
+    } else {
+      usart_rx::handleByte(status & H(FE1), value);
+    }
+    isr_pin::setLow();
+  }
+#endif
+
+  // Public. Called from main. See .h for description.
+  uint16 autoBaudRate() {
+    if (!custom_defs::kUseAutoBaud || !edge_rx::baud_locked) {
+      return 0;
+    }
+    cli();
+    const uint16 ticks_x16 = config.clock_ticks_per_bit_x16();
+    sei();
+    return (hardware_clock::kTicksPerMilli * 1000 * 16) / ticks_x16;
+  }
+
+  // Public. Called from main. See .h for description.
+  boolean setBaudRate(uint16 baud) {
+    if (!Config::isValidBaud(baud)) {
+      return false;
+    }
+    const uint8 sreg = SREG;
+    cli();
+    boolean is_idle;
+    if (custom_defs::kUseUsartRx) {
+      is_idle = usart_rx::isIdle();
+    } else if (custom_defs::kUseEdgeRxEngine) {
+      is_idle = edge_rx::Channel<0>::isIdle() && 
+          (!custom_defs::kUseDualBus || edge_rx::Channel<1>::isIdle());
+    } else {
+      is_idle = state == states::DETECT_BREAK && StateDetectBreak::isIdle();
+    }
+    if (is_idle) {
+      config.setBaud(baud);
+      frame_timing::setNominal();
+      if (custom_defs::kUseUsartRx) {
+        usart_rx::setup();
+      } else if (!custom_defs::kUseEdgeRxEngine && !bus_sleeping) {
+        // New bit period and prescaler. In bus sleep the timer is set up
+        // again on the wake up.
+        setupTimer();
+      }
+    }
+    SREG = sreg;
+    return is_idle;
+  }
+
+  uint16 baudRate() {
+    const uint8 sreg = SREG;
+    cli();
+    const uint16 baud = config.baud();
+    SREG = sreg;
+    return baud;
+  }
+
+  // Interrupt on RX (INT0) change. 
+  ISR(INT0_vect)
+  {
+    // Without the edge engine, INT0 wakes from the bus sleep or ends an
+    // edge wait.
+    if (!custom_defs::kUseEdgeRxEngine) {
+      if (bus_sleeping) {
+        wakeFromBusSleep();
+        return;
+      }
+      isr_pin::setHigh();
+      handleWaitDone(true);
+      isr_pin::setLow();
+      return;
+    }
+    // Sample clock and pin ASAP to avoid jitter.
+    const uint16 now = hardware_clock::ticksForIsr();
+    const uint8 is_rx_high = rx_pin::isHigh();
+    isr_pin::setHigh();
+    edge_rx::Channel<0>::handleEdge(now, is_rx_high);
+    isr_pin::setLow();
+  }
+
+  // Interrupt on rx2 (PCINT9) change. Second bus of the edge engine with
+  // custom_defs::kUseDualBus.
+  ISR(PCINT1_vect)
+  {
+    const uint16 now = hardware_clock::ticksForIsr();
+    const uint8 is_rx_high = rx2_pin::isHigh();
+    isr_pin::setHigh();
+    edge_rx::Channel<1>::handleEdge(now, is_rx_high);
+    isr_pin::setLow();
+  }
+
+  // Interrupt on Timer 1 B-match. Byte and frame timeouts of the edge and the
+  // USART engines, of both buses with kUseDualBus, and the edge wait timeouts
+  // of the tick engine.
+  ISR(TIMER1_COMPB_vect)
+  {
+    isr_pin::setHigh();
+    if (custom_defs::kUseUsartRx) {
+      usart_rx::closeFrame();
+    } else if (!custom_defs::kUseEdgeRxEngine) {
+      handleWaitDone(false);
+    } else if (custom_defs::kUseDualBus) {
+      const uint16 now = hardware_clock::ticksForIsr();
+      edge_rx::Channel<0>::handleSharedTimeout(now);
+      edge_rx::Channel<1>::handleSharedTimeout(now);
+      edge_rx::rearmSharedTimeout();
+    } else {
+      edge_rx::Channel<0>::handleTimeout();
+    }
     isr_pin::setLow();
   }
 }  // namespace lin_processor
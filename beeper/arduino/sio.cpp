@@ -13,82 +13,252 @@
 #include "sio.h"
 
 #include <stdarg.h>
+#include "custom_defs.h"
+#include "passive_timer.h"
 
 namespace sio {
   // TODO: do we need to set the i/o pins (PD0, PD1)? Do we rely on setting by 
   // the bootloader?
   
-  // Size of output bytes queue. Shuold be <= 128 to avoid overflow.
-  // TODO: reduce buffer size? Do we have enough RAM?
-  // TODO: increase index size to 16 bit and increase buffer size to 200?
-  static const uint8 kQueueSize = 120;
+  // Size of output bytes queue. A power of two, so the indices are masked
+  // rather than compared and wrapped around.
+  static const uint16 kQueueSize = custom_defs::kSioQueueSize;
+  static const uint16 kQueueMask = kQueueSize - 1;
+  typedef char QueueSizeNotPowerOfTwo[
+      (kQueueSize >= 2 && kQueueSize <= 1024 && !(kQueueSize & kQueueMask)) ? 1 : -1];
   static uint8 buffer[kQueueSize];
-  // Index of the oldest entry in buffer.
-  static uint8 start;
-  // Number of bytes in queue.
-  static uint8 count;
+  // Free running counts of the enqueued and dequeued bytes. The queue 
+  // entries are at [tail, head), masked. Volatile since with 
+  // custom_defs::kUseSioTxInterrupt the tail is updated by the ISR.
+  static volatile uint16 head;
+  static volatile uint16 tail;
 
-  // Caller need to verify that count < kQueueSize before calling this.
-  static void unsafe_enqueue(byte b) {
-    // kQueueSize is small enough that this will not overflow.
-    uint8 next = start + count;
-    if (next >= kQueueSize) {
-      next -= kQueueSize;
-    } 
-    buffer[next] = b;  
-    count++; 
+  // With custom_defs::kUseSioBatching, the free running count of the bytes
+  // released for sending. The bytes at [tail, released) are sent and the 
+  // ones at [released, head) are held. Written by the main only, with 
+  // interrupts disabled since the ISR reads it.
+  static volatile uint16 released;
+
+  static const uint8 kBatchBytes = custom_defs::kSioBatchBytes;
+  typedef char BatchTooLarge[(kBatchBytes <= kQueueSize / 2) ? 1 : -1];
+
+  // True while bytes are held, since hold_timer was restarted.
+  static boolean is_holding;
+  static PassiveTimer hold_timer;
+
+  // Number of records rejected by beginRecord() since the last drop report.
+  static uint16 dropped_records;
+
+  // Free running count of the records rejected by beginRecord().
+  static uint16 total_dropped_records;
+
+  // Max size of the drop report line, "dropped 65535\n".
+  static const uint8 kDropReportBytes = 14;
+
+  // Max number of bytes loop() writes to the UART per call. The UART 
+  // accepts up to two bytes at once, into its data and shift registers.
+  static const uint8 kMaxBurstBytes = 2;
+
+  // UBRR0 divisor of custom_defs::kSioBaud with U2X0, rounded.
+  static const uint16 kBaudDivisor = 
+      (F_CPU / 8 + custom_defs::kSioBaud / 2) / custom_defs::kSioBaud - 1;
+
+  // Number of bytes in queue. The 16 bit indices are not read atomically,
+  // so with the interrupt this should be called with interrupts disabled
+  // or use count().
+  static inline uint16 unsafe_count() {
+    return head - tail;
   }
 
-  // Caller need to verify that count > 1 before calling this.
-  static byte unsafe_dequeue() {
-    const uint8 b = buffer[start];
-    if (++start >= kQueueSize) {
-      start = 0;
+  // Number of queued bytes that can be sent now. Same atomicity as 
+  // unsafe_count().
+  static inline uint16 unsafe_sendable() {
+    return (custom_defs::kUseSioBatching ? released : head) - tail;
+  }
+
+  static inline uint16 count() {
+    if (!custom_defs::kUseSioTxInterrupt) {
+      return unsafe_count();
     }
-    count--;
+    const uint8 sreg = SREG;
+    cli();
+    const uint16 result = unsafe_count();
+    SREG = sreg;
+    return result;
+  }
+
+  // Caller need to verify that count < kQueueSize before calling this.
+  static inline void unsafe_enqueue(byte b) {
+    buffer[head & kQueueMask] = b;  
+    head++; 
+  }
+
+  // Caller need to verify that count > 0 before calling this.
+  static inline byte unsafe_dequeue() {
+    const uint8 b = buffer[tail & kQueueMask];
+    tail++;
     return b;  
   }
 
   void setup() {
-    start = 0;
-    count = 0;
+    head = 0;
+    tail = 0;
+    released = 0;
+    is_holding = false;
     
 #if F_CPU != 16000000
 #error "The existing code assumes 16Mhz CPU clk."
 #endif
     // For devisors see table 19-12 in the atmega328p datasheet.
-    // U2X0, 16 -> 115.2k baud @ 16MHz. 
+    // U2X0, 16 -> 115.2k baud @ 16MHz (2.1% error). 
     // U2X0, 207 -> 9600 baud @ 16Mhz.
-    UBRR0H = 0;
-    UBRR0L = 16;
+    // U2X0, 7, 3, 1 -> 250k, 500k, 1M baud @ 16Mhz (exact).
+    UBRR0H = kBaudDivisor >> 8;
+    UBRR0L = kBaudDivisor;
     UCSR0A = H(U2X0);
-    // Enable  the transmitter. Reciever is disabled.
-    UCSR0B = H(TXEN0);
+    // Enable  the transmitter. Reciever is enabled only for the serial 
+    // commands, without its interrupt.
+    UCSR0B = custom_defs::kUseSerialCommands ? (H(TXEN0) | H(RXEN0)) : H(TXEN0);
     UCSR0C = H(UDORD0) | H(UCPHA0);  //(3 << UCSZ00);  
   }
 
   void printchar(uint8 c) {
-    // If buffer is full, drop this char.
-    // TODO: drop last byte to make room for the new byte?
-    if (count >= kQueueSize) {
+    if (!custom_defs::kUseSioTxInterrupt) {
+      // If buffer is full, drop this char.
+      // TODO: drop last byte to make room for the new byte?
+      if (unsafe_count() < kQueueSize) {
+        unsafe_enqueue(c);
+      }
+      return;
+    }
+    // Exclude the ISR, which may also be called before interrupts
+    // are enabled.
+    const uint8 sreg = SREG;
+    cli();
+    if (unsafe_count() < kQueueSize) {
+      unsafe_enqueue(c);
+      // With batching, the interrupt is enabled when the bytes are released.
+      if (!custom_defs::kUseSioBatching) {
+        UCSR0B |= H(UDRIE0);
+      }
+    }
+    SREG = sreg;
+  }
+
+  boolean beginRecord(uint8 num_bytes) {
+    const uint8 needed = dropped_records ? num_bytes + kDropReportBytes : num_bytes;
+    if (capacity() < needed) {
+      total_dropped_records++;
+      if (dropped_records != 0xffff) {
+        dropped_records++;
+      }
+      return false;
+    }
+    if (dropped_records) {
+      out << F("dropped ") << dropped_records << '\n';
+      dropped_records = 0;
+    }
+    return true;
+  }
+
+  // Write to the UART as many queued bytes as it accepts, up to 
+  // kMaxBurstBytes.
+  static inline void burst() {
+    for (uint8 i = 0; i < kMaxBurstBytes; i++) {
+      if (!unsafe_sendable() || !(UCSR0A & H(UDRE0))) {
+        return;
+      }
+      UDR0 = unsafe_dequeue();
+    }
+  }
+
+  // Release the bytes up to the given head for sending.
+  static inline void release(uint16 h) {
+    const uint8 sreg = SREG;
+    cli();
+    released = h;
+    if (custom_defs::kUseSioTxInterrupt && h != tail) {
+      UCSR0B |= H(UDRIE0);
+    }
+    SREG = sreg;
+    is_holding = false;
+  }
+
+  // Release the held bytes once they fill a batch or the oldest of them was
+  // held custom_defs::kSioBatchHoldMillis. Records are printed whole between
+  // loop() calls, so the batches end at a record boundary.
+  static inline void releaseBatch() {
+    // head and released are written by the main only.
+    const uint16 h = head;
+    const uint16 held = h - released;
+    if (!held) {
       return;
     }
-    unsafe_enqueue(c);
+    if (!is_holding) {
+      is_holding = true;
+      hold_timer.restart();
+    }
+    if (held >= kBatchBytes 
+        || hold_timer.timeMillis() >= custom_defs::kSioBatchHoldMillis) {
+      release(h);
+    }
   }
 
   void loop() {
-    if (count && (UCSR0A & H(UDRE0))) {
+    if (custom_defs::kUseSioBatching) {
+      releaseBatch();
+    }
+    // With the interrupt, loop() sends only while interrupts are disabled,
+    // e.g. in waitUntilFlushed() during setup.
+    if (custom_defs::kUseSioTxInterrupt && (SREG & H(SREG_I))) {
+      return;
+    }
+    burst();
+  }
+
+  // Called when the UART data register is empty. Enabled only with 
+  // custom_defs::kUseSioTxInterrupt, while there are bytes to send.
+  ISR(USART_UDRE_vect) {
+    if (unsafe_sendable()) {
       UDR0 = unsafe_dequeue();
     }
+    if (!unsafe_sendable()) {
+      UCSR0B &= ~H(UDRIE0);
+    }
+  }
+
+  boolean readByte(uint8* b) {
+    if (!custom_defs::kUseSerialCommands || !(UCSR0A & H(RXC0))) {
+      return false;
+    }
+    *b = UDR0;
+    return true;
   }
 
   uint8 capacity() {
-    return kQueueSize - count;
+    const uint16 result = kQueueSize - count();
+    return (result > 0xff) ? 0xff : result;
+  }
+
+  boolean isEmpty() {
+    return !count();
+  }
+
+  uint16 bytesQueued() {
+    // Written only by printchar(), from the main.
+    return head;
+  }
+
+  uint16 droppedRecords() {
+    return total_dropped_records;
   }
 
   void waitUntilFlushed() {
+    if (custom_defs::kUseSioBatching) {
+      release(head);
+    }
     // Busy loop until all flushed to UART. 
-    while (count) {
+    while (count()) {
       loop();
     }  
   }
@@ -108,6 +278,56 @@ namespace sio {
     printHexDigit(b & 0xf);
   }
 
+  void printu16(uint16 n) {
+    // Digits are generated from the lowest one.
+    char digits[5];
+    uint8 i = 0;
+    do {
+      digits[i++] = '0' + (n % 10);
+      n /= 10;
+    } while (n);
+    while (i) {
+      printchar(digits[--i]);
+    }
+  }
+
+  void printu32(uint32 n) {
+    // The 16 bit division is much faster, use it once possible.
+    if (n <= 0xffff) {
+      printu16(n);
+      return;
+    }
+    char digits[10];
+    uint8 i = 0;
+    do {
+      digits[i++] = '0' + (n % 10);
+      n /= 10;
+    } while (n);
+    while (i) {
+      printchar(digits[--i]);
+    }
+  }
+
+  void printi16(int16 n) {
+    if (n < 0) {
+      printchar('-');
+      printu16(-(uint16)n);
+      return;
+    }
+    printu16(n);
+  }
+
+  void printi32(int32 n) {
+    if (n < 0) {
+      printchar('-');
+      printu32(-(uint32)n);
+      return;
+    }
+    printu32(n);
+  }
+
+  Out out;
+
   void println() {
     printchar('\n');
   }
@@ -160,3 +380,6 @@ namespace sio {
   }
 }  // namespace sio
 
+
+
+
@@ -18,21 +18,41 @@
 
 // A serial output that uses hardware UART0 and no interrupts (for lower
 // interrupt jitter). Requires periodic calls to update() to send buffered
-// bytes to the uart. 
+// bytes to the uart. With custom_defs::kUseSioBatching the bytes are sent
+// in batches of whole records (see custom_defs.h).
 //
 // TX Output - TXD (PD1) - pin 31
-// TX Input  - TXD (PD0) - pin 30 (currently not used).
+// RX Input  - RXD (PD0) - pin 30 (used only with custom_defs::kUseSerialCommands).
 namespace sio {
   
   // Call from main setup() and loop() respectivly.
   extern void setup();
   extern void loop();
   
-  // Momentary size of free space in the output buffer. Sending at most this number
-  // of characters will not loose any byte.
+  // Momentary size of free space in the output buffer, up to 255. Sending at most
+  // this number of characters will not loose any byte.
   extern uint8 capacity(); 
+
+  // True if all the buffered bytes were passed to the UART.
+  extern boolean isEmpty();
+
+  // Free running count of the bytes queued since setup(). Bytes dropped 
+  // since the buffer was full are not counted. For measuring the output 
+  // size of a message format.
+  extern uint16 bytesQueued();
   
   extern void printchar(uint8 b);
+
+  // Call before printing a record of up to num_bytes bytes (at most 200), 
+  // such as a frame line, to print it whole or not at all. Returns true if 
+  // the output buffer has room for it. Otherwise the record should not be 
+  // printed and it is counted as dropped. The number of dropped records, if 
+  // any, is printed as a "dropped <n>" line before the next accepted record.
+  extern boolean beginRecord(uint8 num_bytes);
+
+  // Free running count of the records rejected by beginRecord() since 
+  // setup(). For health monitoring, as the difference of two reads.
+  extern uint16 droppedRecords();
   extern void print(const __FlashStringHelper *str);
   extern void println(const __FlashStringHelper *str);
   extern void print(const char* str);
@@ -40,7 +60,104 @@ namespace sio {
   extern void println();
   extern void printf(const __FlashStringHelper *format, ...);
   extern void printhex2(uint8 b); 
+
+  // Print the decimal value of n. Cheaper than printf(), no format parsing
+  // and no intermediate buffer.
+  extern void printu16(uint16 n);
+  extern void printu32(uint32 n);
+  extern void printi16(int16 n);
+  extern void printi32(int32 n);
+
+  // Typed output that writes directly to the output buffer. For example
+  //
+  //   sio::out << F("id ") << sio::hex2(id) << ' ' << count << '\n';
+  //
+  // Integers are printed in decimal, chars as is, and strings from ram or 
+  // program memory with F().
+  struct Out {};
+  extern Out out;
+
+  // Prints a byte as two hex digits.
+  struct Hex2 {
+    uint8 value;
+  };
+
+  inline Hex2 hex2(uint8 b) {
+    const Hex2 result = { b };
+    return result;
+  }
+
+  inline Out& operator<<(Out& o, char c) {
+    printchar(c);
+    return o;
+  }
+
+  inline Out& operator<<(Out& o, const __FlashStringHelper* str) {
+    print(str);
+    return o;
+  }
+
+  inline Out& operator<<(Out& o, const char* str) {
+    print(str);
+    return o;
+  }
+
+  inline Out& operator<<(Out& o, Hex2 h) {
+    printhex2(h.value);
+    return o;
+  }
+
+  // Prints a time in nanos as usecs, with a tenths digit if not zero, e.g.
+  // 12 or 12.5.
+  struct Micros {
+    uint32 nanos;
+  };
+
+  inline Micros micros(uint32 nanos) {
+    const Micros result = { nanos };
+    return result;
+  }
+
+  inline Out& operator<<(Out& o, Micros m) {
+    printu32(m.nanos / 1000);
+    const uint8 tenths = (m.nanos % 1000) / 100;
+    if (tenths) {
+      printchar('.');
+      printchar('0' + tenths);
+    }
+    return o;
+  }
+
+  inline Out& operator<<(Out& o, uint8 n) {
+    printu16(n);
+    return o;
+  }
+
+  inline Out& operator<<(Out& o, uint16 n) {
+    printu16(n);
+    return o;
+  }
+
+  inline Out& operator<<(Out& o, uint32 n) {
+    printu32(n);
+    return o;
+  }
+
+  inline Out& operator<<(Out& o, int16 n) {
+    printi16(n);
+    return o;
+  }
+
+  inline Out& operator<<(Out& o, int32 n) {
+    printi32(n);
+    return o;
+  }
  
+  // Try to read a received byte. Returns false if none is available. The
+  // receiver is enabled only with custom_defs::kUseSerialCommands. Polled,
+  // the UART holds up to two received bytes.
+  extern boolean readByte(uint8* b);
+
   // Wait in a busy loop until all bytes were flushed to the UART. 
   // Avoid using this when possible. Useful when needing to print
   // during setup() more than the output buffer can contain.
@@ -18,38 +18,92 @@
 
 namespace system_clock {
   static const uint16 kTicksPerMilli = hardware_clock::kTicksPerMilli;
-  static const uint16 kTicksPer10Millis = 10 * kTicksPerMilli;
+  // 2^16 / kTicksPerMilli in 16.16 fixed point, rounded down so the 
+  // estimated millis never exceed the exact quotient. Short by less than one
+  // milli over a 16 bit delta at both prescalers.
+  static const uint16 kMillisPerTickFixed = 0x10000UL / kTicksPerMilli;
 
-  static uint16 accounted_ticks = 0;
+  static uint32 accounted_ticks = 0;
   static uint32 time_millis = 0;
+  // Ticks of the last update that do not add up to a milli yet.
+  static uint16 remainder_ticks = 0;
+
+  // The millis and ticks of the last update, for the ISRs. Double buffered,
+  // the main writes the inactive copy and then switches epoch_index, a 
+  // single byte, so an ISR always reads a consistent copy.
+  struct Epoch {
+    uint32 millis;
+    uint32 ticks;
+  };
+  static Epoch epochs[2];
+  static volatile uint8 epoch_index = 0;
+
+  // Sets *millis and *remainder to the millis and remaining ticks of a 16 bit
+  // ticks delta, in constant time. The estimate of the reciprocal multiply 
+  // is short by at most one milli, corrected by the remainder.
+  static inline void ticksToMillis(uint16 ticks, uint16* millis, uint16* remainder) {
+    uint16 m = ((uint32)ticks * kMillisPerTickFixed) >> 16;
+    uint16 r = ticks - m * kTicksPerMilli;
+    if (r >= kTicksPerMilli) {
+      r -= kTicksPerMilli;
+      m++;
+    }
+    *millis = m;
+    *remainder = r;
+  }
 
   void loop() {
-    const uint16 current_ticks = hardware_clock::ticksForNonIsr();
-
-    // This 16 bit unsigned arithmetic works well also in case of a timer overflow.
-    // Assuming at least two loops per timer cycle.
-    uint16  delta_ticks = current_ticks - accounted_ticks;
-
-    // A course increment loop in case we have a large update interval. Improves
-    // runtime over the single milli update loop below.
-    while (delta_ticks >= kTicksPer10Millis) {
-      delta_ticks -= kTicksPer10Millis;
-      accounted_ticks += kTicksPer10Millis;
-      time_millis += 10; 
+    const uint32 current_ticks = hardware_clock::ticks32ForNonIsr();
+
+    // This 32 bit unsigned arithmetic works well also in case of a timer overflow.
+    // The 32 bit clock keeps counting while the loop stalls so no time is lost.
+    const uint32 delta_ticks = current_ticks - accounted_ticks;
+
+    // Constant time conversion. Longer deltas (a stall of over ~260ms) are 
+    // rare and use a division.
+    uint32 delta_millis;
+    uint16 delta_remainder;
+    if (delta_ticks <= 0xffff) {
+      uint16 millis;
+      ticksToMillis(delta_ticks, &millis, &delta_remainder);
+      delta_millis = millis;
+    } else {
+      delta_millis = delta_ticks / kTicksPerMilli;
+      delta_remainder = delta_ticks - delta_millis * kTicksPerMilli;
     }
+    accounted_ticks += delta_millis * kTicksPerMilli;
+    time_millis += delta_millis;
+    remainder_ticks = delta_remainder;
+
+    Epoch& epoch = epochs[epoch_index ^ 1];
+    epoch.millis = time_millis;
+    epoch.ticks = accounted_ticks;
+    asm volatile("" ::: "memory");
+    epoch_index ^= 1;
+  }
 
-    // Single millis update loop.
-    while (delta_ticks >= kTicksPerMilli) {
-      delta_ticks -= kTicksPerMilli;
-      accounted_ticks += kTicksPerMilli;
-      time_millis++; 
+  uint32 timeMillisForIsr() {
+    const Epoch& epoch = epochs[epoch_index];
+    const uint32 delta_ticks = hardware_clock::ticks32ForIsr() - epoch.ticks;
+    // The main loop normally updates the epoch far more often than a 16 bit
+    // cycle. Avoid the slow 32 bit division otherwise.
+    if (delta_ticks > 0xffff) {
+      return epoch.millis + delta_ticks / kTicksPerMilli;
     }
+    uint16 millis;
+    uint16 remainder;
+    ticksToMillis(delta_ticks, &millis, &remainder);
+    return epoch.millis + millis;
   }
 
   uint32 timeMillis() {
     return time_millis;
   }
 
+  uint32 timeMicros() {
+    return time_millis * 1000 + hardware_clock::ticksToMicros(remainder_ticks);
+  }
+
 }  // namespace system_clock
 
 
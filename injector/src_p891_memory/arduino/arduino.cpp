@@ -11,38 +11,343 @@
 // limitations under the License.
 
 #include "avr_util.h"
+#include "burst_capture.h"
 #include "custom_defs.h"
 #include "custom_module.h"
+#include "frame_insertion.h"
+#include "frame_periods.h"
 #include "hardware_clock.h"
+#include "health_report.h"
 #include "io_pins.h"
 #include "leds.h"
 #include "lin_processor.h"
+#include "main_loop_bench.h"
+#include "passive_timer.h"
+#include "post_mortem.h"
+#include "proxy_self_test.h"
 #include "sio.h"
+#include "slave_emulation.h"
+#include "stack_monitor.h"
 #include "system_clock.h"
+#include "task_scheduler.h"
+#include "timer_wheel.h"
+#include "trace.h"
+#include "watchdog.h"
+
+// The next ISR profile path to print, kNumPaths if not printing.
+static uint8 next_isr_profile_path = lin_processor::isr_paths::kNumPaths;
+
+// Called every kIsrProfileDumpMillis.
+static void requestIsrProfileDump()
+{
+  next_isr_profile_path = 0;
+}
+
+// The next response timing entry to print, or kMaxResponseTimingIds if 
+// none.
+static uint8 next_response_timing = lin_processor::kMaxResponseTimingIds;
+
+// Called every kResponseTimingDumpMillis.
+static void requestResponseTimingDump()
+{
+  next_response_timing = 0;
+}
+
+// Prints the boot diagnostics once the serial output has room for them, 
+// so setup() never waits for the serial output.
+static void bootReport()
+{
+  if (sio::capacity() < 64) {
+    timer_wheel::start(timer_wheel::kTickMillis, 0, bootReport);
+    return;
+  }
+  lin_processor::printConfig();
+}
 
 // Arduino setup function. Called once during initialization.
 void setup()
 {
-  // Hard coded to 115.2k baud. Uses URART0, no interrupts.
+  // Stops the watchdog left running by a watchdog reset, if any.
+  watchdog::setup();
+
+  // Baud rate is custom_defs::kSioBaud. Uses URART0, no interrupts.
   // Initialize this first since some setup methods uses it.
   sio::setup();
 
-  // Uses Timer1, no interrupts.
+  // Uses Timer1, overflow interrupt only.
   hardware_clock::setup();
 
+  // Should be before the setups that start timers.
+  timer_wheel::setup();
+
+  // Ports B and D, a 100Hz timer wheel timer.
+  leds::setup();
+
   // Uses Timer2 with interrupts, and a few i/o pins. See source code for details.
   lin_processor::setup();
-  
-  custom_module::setup();
 
   // Enable global interrupts. We expect to have only timer1 interrupts by
-  // the lin processor to reduce ISR jitter.
+  // the lin processor to reduce ISR jitter. Done before the rest of the 
+  // setups, which do not block, so the first frames after reset are not 
+  // missed. They are queued until the main loop runs.
   sei(); 
+
+  // The settings and the config come from the eeprom cache, the messages 
+  // are only buffered.
+  custom_module::setup();
+
+  // Binds the emulated ids to injector responses.
+  slave_emulation::setup();
+
+  // Reads the eeprom ring and the watchdog reset record.
+  post_mortem::setup();
+
+  // Reads the stored capture, if any, and prints it.
+  burst_capture::setup();
+
+  if (custom_defs::kTrackLoopLatency) {
+    timer_wheel::start(custom_defs::kLoopLatencyDumpMillis, 
+        custom_defs::kLoopLatencyDumpMillis, task_scheduler::requestStatsDump);
+  }
+  if (custom_defs::kProfileIsr || custom_defs::kDetectLateSamples) {
+    timer_wheel::start(custom_defs::kIsrProfileDumpMillis, 
+        custom_defs::kIsrProfileDumpMillis, requestIsrProfileDump);
+  }
+  if (custom_defs::kTrackResponseTiming) {
+    timer_wheel::start(custom_defs::kResponseTimingDumpMillis, 
+        custom_defs::kResponseTimingDumpMillis, requestResponseTimingDump);
+  }
+  health_report::setup();
+  if (custom_defs::kTrackFramePeriods) {
+    frame_periods::setup();
+    timer_wheel::start(custom_defs::kFramePeriodsDumpMillis, 
+        custom_defs::kFramePeriodsDumpMillis, frame_periods::requestDump);
+  }
+  if (custom_defs::kUseFrameInsertion) {
+    frame_insertion::setup();
+    timer_wheel::start(custom_defs::kFrameInsertionDumpMillis, 
+        custom_defs::kFrameInsertionDumpMillis, frame_insertion::requestDump);
+  }
+  if (custom_defs::kUseProxySelfTest) {
+    // Uses Timer0, no interrupts.
+    proxy_self_test::setup();
+    timer_wheel::start(custom_defs::kProxySelfTestDumpMillis, 
+        custom_defs::kProxySelfTestDumpMillis, proxy_self_test::requestDump);
+  }
+  timer_wheel::start(0, 0, bootReport);
   
   // Have an early 'waiting' led bling to indicate normal operation.
-  leds::frames.action(); 
+  leds::action(leds::ids::FRAMES); 
+
+  // Supervision of the main loop. Last, so it covers only the main loop.
+  if (custom_defs::kUseWatchdog) {
+    watchdog::start();
+  }
+}
+
+// Restarted on any activity. Triggers the periodic 'waiting' message.
+static PassiveTimer idle_timer;
+
+// Print a periodic text messages if no activiy.
+static void idleTask()
+{
+  if (idle_timer.timeMillis() >= 3000) {
+    // Slow blinking indicates waiting.
+    leds::action(leds::ids::FRAMES); 
+    sio::println(F("waiting..."));
+    idle_timer.restart();
+  }
+}
+
+// Handle LIN processor error flags.
+static void linErrorsTask()
+{
+  // Used to trigger periodic error printing.
+  static PassiveTimer lin_errors_timeout;
+  // Accomulates error flags until next printing.
+  static uint8 pending_lin_errors = 0;
+  
+  const uint8 new_lin_errors = lin_processor::getAndClearErrorFlags();
+  if (new_lin_errors) {
+    // Make the ERRORS led blinking.
+    leds::action(leds::ids::ERRORS);
+    post_mortem::reportLinErrors(new_lin_errors);
+    burst_capture::trigger(new_lin_errors);
+    idle_timer.restart();
+  }
+
+  // If pending errors and time to print errors then print and clear.
+  pending_lin_errors |= new_lin_errors;
+  if (pending_lin_errors && lin_errors_timeout.timeMillis() > 1000) {
+    sio::print(F("LIN errors: "));
+    lin_processor::printErrorFlags(pending_lin_errors);
+    sio::println();
+    lin_errors_timeout.restart();
+    pending_lin_errors = 0;
+  }
+}
+
+// Print the error context records, when the serial output has room.
+static void errorRecordsTask()
+{
+  if (custom_defs::kRecordErrorContext && sio::capacity() >= 64) {
+    lin_processor::ErrorRecord record;
+    if (lin_processor::readNextErrorRecord(&record)) {
+      lin_processor::printErrorRecord(record);
+    }
+  }
+}
+
+// Print the records of a stopped ISR trace, when the serial output has room.
+static void isrTraceTask()
+{
+  if (custom_defs::kIsrTracePolicy == custom_defs::isr_trace_policies::RING
+      && sio::capacity() >= 32) {
+    lin_processor::IsrTraceRecord record;
+    if (lin_processor::readNextIsrTraceRecord(&record)) {
+      lin_processor::printIsrTraceRecord(record);
+    }
+  }
+}
+
+// Print the ISR profile, a path per call as the serial output has room.
+static void isrProfileTask()
+{
+  if (!custom_defs::kProfileIsr && !custom_defs::kDetectLateSamples) {
+    return;
+  }
+  if (next_isr_profile_path < lin_processor::isr_paths::kNumPaths && sio::beginRecord(80)) {
+    lin_processor::IsrPathStats stats;
+    lin_processor::getAndClearIsrProfile(next_isr_profile_path, &stats);
+    lin_processor::printIsrProfile(next_isr_profile_path, stats);
+    next_isr_profile_path++;
+  }
+}
+
+// Prints a line of the response timing per call, as the serial output has
+// room.
+static void responseTimingTask()
+{
+  if (!custom_defs::kTrackResponseTiming) {
+    return;
+  }
+  if (next_response_timing < lin_processor::kMaxResponseTimingIds && sio::beginRecord(80)) {
+    lin_processor::ResponseTiming timing;
+    if (lin_processor::getAndClearResponseTiming(next_response_timing, &timing)) {
+      lin_processor::printResponseTiming(timing);
+      next_response_timing++;
+    } else {
+      // The entries are used in order.
+      next_response_timing = lin_processor::kMaxResponseTimingIds;
+    }
+  }
+}
+
+// Max number of frames handled per run of the frames task, to bound the
+// time between the other tasks.
+static const uint8 kMaxFramesPerTask = 4;
+
+// True while the main loop is behind on the frames, see 
+// custom_defs::kBehindQueuePercent.
+static boolean is_behind;
+
+// Updates is_behind from the rx queue fill level, with hysteresis.
+static boolean updateIsBehind()
+{
+  const uint8 percent = lin_processor::rxQueuePercent();
+  if (percent >= custom_defs::kBehindQueuePercent) {
+    is_behind = true;
+  } else if (percent <= custom_defs::kCaughtUpQueuePercent) {
+    is_behind = false;
+  }
+  return is_behind;
+}
+
+// Handle a recieved LIN frame. Called by lin_processor::drainFrames(), the 
+// frame is borrowed from the lin processor queue, no copy.
+static void handleFrame(const LinFrame& frame)
+{
+  const boolean frameOk = frame.isValid();
+  if (frameOk) {
+    // Make the FRAMES led blinking.
+    leds::action(leds::ids::FRAMES);
+  } 
+  else {
+    // Make the ERRORS frame blinking.
+    leds::action(leds::ids::ERRORS);
+  }
+
+  // The original bytes of a frame with injected bits. Printed if the serial
+  // output has room.
+  lin_processor::InjectionAudit audit;
+  const boolean has_audit = frame.hasInjectedBits() && 
+      lin_processor::readInjectionAuditOf(frame, &audit);
+  if (has_audit && custom_defs::kPrintInjectionAudits && sio::capacity() >= 64) {
+    lin_processor::printInjectionAudit(audit);
+  }
+
+  // Log the frame, or drop it if the serial output has no room.
+  if (custom_defs::kUseSnifferLog && 
+      sio::beginRecord(trace::kMaxFramePrintedBytes)) {
+    trace::sendFrame(frame, frameOk);
+  }
+
+  // The break time of the frame, valid or not.
+  frame_periods::frameArrived(frame);
+  burst_capture::frameArrived(frame, frameOk);
+
+  // Inform the custom module about the incoming frame in case it
+  // needs to intercept signals. This call by itself does not do signal
+  // injection since the frame was already transfered. However, the custom
+  // module can use it to influence injection of future frames.
+  if (frameOk) {
+    health_report::frameArrived();
+    custom_module::frameArrived(frame, has_audit ? &audit : NULL);
+  }
 }
 
+// Handle recieved LIN frames, a burst per run.
+static void framesTask()
+{
+  // While behind, the whole queue. The frames that arrive meanwhile are 
+  // left to the next run.
+  const uint8 max_frames = is_behind ? 0xff : kMaxFramesPerTask;
+  if (lin_processor::drainFrames(handleFrame, max_frames)) {
+    // Supress the 'waiting' messages.
+    idle_timer.restart(); 
+  }
+}
+
+// The main loop tasks, in decreasing priority order. Frames and the serial
+// output are handled on every iteration, the rest at 1-200Hz. The 
+// deferrable ones (true) are skipped while the main loop is behind on the 
+// frames.
+static task_scheduler::Task tasks[] = {
+  { framesTask, 0, 0, false },
+  { sio::loop, 0, 0, false },
+  { timer_wheel::loop, 0, 0, false },
+  { custom_module::loop, 5, 0, false },
+  { linErrorsTask, 10, 0, true },
+  { errorRecordsTask, 5, 0, true },
+  { isrTraceTask, 5, 0, true },
+  { isrProfileTask, 10, 0, true },
+  { responseTimingTask, 10, 0, true },
+  { health_report::loop, 100, 0, true },
+  { idleTask, 100, 0, true },
+  { post_mortem::loop, 10, 0, false },
+  { burst_capture::loop, 1, 0, true },
+  { stack_monitor::loop, 1000, 0, true },
+  { proxy_self_test::loop, 20, 0, true },
+  { main_loop_bench::loop, 10, 0, true },
+  { slave_emulation::loop, 5, 0, false },
+  { frame_periods::loop, 10, 0, true },
+  { frame_insertion::loop, 1, 0, true },
+};
+
+// custom_defs::kMainLoopBudgetMicros in hardware clock ticks.
+static const uint16 kMainLoopBudgetTicks = 
+    (custom_defs::kMainLoopBudgetMicros * hardware_clock::kTicksPerMilli) / 1000;
+
 // Arduino loop() method. Called after setup(). Never returns.
 // This is a quick loop that does not use delay() or other busy loops or 
 // blocking calls.
@@ -51,88 +356,8 @@ void loop()
   // Having our own loop shaves about 4 usec per iteration. It also eliminate
   // any underlying functionality that we may not want.
   for(;;) {    
-    // Periodic updates.
     system_clock::loop();    
-    sio::loop();
-    leds::loop(); 
-    custom_module::loop();
-
-    // Print a periodic text messages if no activiy.
-    static PassiveTimer idle_timer;
-    if (idle_timer.timeMillis() >= 3000) {
-      // Slow blinking indicates waiting.
-      leds::frames.action(); 
-      sio::println(F("waiting..."));
-      idle_timer.restart();
-    }
-
-    // Handle LIN processor error flags.
-    {
-      // Used to trigger periodic error printing.
-      static PassiveTimer lin_errors_timeout;
-      // Accomulates error flags until next printing.
-      static uint8 pending_lin_errors = 0;
-      
-      const uint8 new_lin_errors = lin_processor::getAndClearErrorFlags();
-      if (new_lin_errors) {
-        // Make the ERRORS led blinking.
-        leds::errors.action();
-        idle_timer.restart();
-      }
-
-      // If pending errors and time to print errors then print and clear.
-      pending_lin_errors |= new_lin_errors;
-      if (pending_lin_errors && lin_errors_timeout.timeMillis() > 1000) {
-        sio::print(F("LIN errors: "));
-        lin_processor::printErrorFlags(pending_lin_errors);
-        sio::println();
-        lin_errors_timeout.restart();
-        pending_lin_errors = 0;
-      }
-    }
-    
-    // Handle recieved LIN frames.
-    LinFrame frame;
-    if (lin_processor::readNextFrame(&frame)) {
-      const boolean frameOk = frame.isValid();
-      if (frameOk) {
-        // Make the FRAMES led blinking.
-        leds::frames.action();
-      } 
-      else {
-        // Make the ERRORS frame blinking.
-        leds::errors.action();
-      }
-
-#if 0
-      // Print frame to serial port.
-      for (int i = 0; i < frame.num_bytes(); i++) {
-        if (i > 0) {
-          sio::printchar(' ');  
-        }
-        sio::printhex2(frame.get_byte(i));  
-      }
-      if (frame.hasInjectedBits()) {
-        sio::print(F(" *"));
-      }
-
-      if (!frameOk) {
-        sio::print(F(" ERR"));
-      }
-      sio::println();  
-#endif
-
-      // Supress the 'waiting' messages.
-      idle_timer.restart(); 
-
-      // Inform the custom module about the incoming frame in case it
-      // needs to intercept signals. This call by itself does not do signal
-      // injection since the frame was already transfered. However, the custom
-      // module can use it to influence injection of future frames.
-      if (frameOk) {
-        custom_module::frameArrived(frame);
-      }
-    }
+    task_scheduler::loop(tasks, ARRAY_SIZE(tasks), kMainLoopBudgetTicks, updateIsBehind());
   }
 }
 
@@ -0,0 +1,406 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "burst_capture.h"
+
+#include <avr/eeprom.h>
+#include "custom_defs.h"
+#include "sio.h"
+#include "system_clock.h"
+
+namespace burst_capture {
+  // After the event program, to the end of the 1K eeprom.
+  static const uint16 kAddress = 640;
+  static const uint16 kRegionBytes = 1024 - kAddress;
+
+  static const uint8 kMagic = 0xc5;
+
+  // At kAddress. The magic byte is written last, so a capture interrupted
+  // by a reset is not valid.
+  struct Header {
+    // The lin_processor::errors of the trigger, zero for a manual trigger.
+    uint8 trigger_flags;
+    // Bytes of the records, and their number.
+    uint16 num_bytes;
+    uint16 num_frames;
+    // Frames of the window that were not recorded. Saturates at 255.
+    uint8 lost_frames;
+    // CRC-8 of the record bytes.
+    uint8 crc;
+    uint8 magic;
+  };
+
+  static const uint16 kDataAddress = kAddress + sizeof(Header);
+  static const uint16 kDataBytes = kRegionBytes - sizeof(Header);
+
+  // A FULL record of the longest frame.
+  static const uint8 kMaxRecordBytes = 3 + LinFrame::kMaxBytes - 1;
+
+  static const uint8 kFullFlag = H(7);
+  static const uint8 kInvalidFlag = H(7);
+  static const uint8 kMaxTime = 0x7f;
+
+  namespace states {
+    // Armed, no capture is stored.
+    static const uint8 IDLE = 0;
+    static const uint8 CAPTURING = 1;
+    // The window ended. Writing the staged bytes and then the header.
+    static const uint8 FLUSHING = 2;
+    // A capture is stored, until clear().
+    static const uint8 STORED = 3;
+  }
+
+  static uint8 state;
+
+  // The last recorded frame of an id. Entries with a zero id byte are free,
+  // a protected id is never zero. Filled the same way by the encoder and
+  // by the dump, from the valid FULL records.
+  struct Reference {
+    uint8 id_byte;
+    uint8 num_data_bytes;
+    uint8 data[LinFrame::kMaxBytes - 2];
+  };
+
+  static Reference references[kMaxIds];
+
+  // The header of the capture being taken, or of the stored one.
+  static Header header;
+
+  // The encoded bytes not written yet, a ring of num_staged bytes from
+  // staged_head.
+  static uint8 staged[kStagingBytes];
+  static uint8 staged_head;
+  static uint8 num_staged;
+
+  // Offset from kDataAddress of the next byte to write, and the next byte
+  // of the header to write once all the records were written.
+  static uint16 write_offset;
+  static uint8 header_index;
+
+  // True once the magic byte of a previous capture was invalidated.
+  static boolean is_magic_cleared;
+
+  static uint32 trigger_millis;
+  // The time the time field of the next record is relative to.
+  static uint32 record_millis;
+
+  // Offset from kDataAddress of the next record to print, kNoDump if not
+  // printing, and the time of the last printed record from the trigger.
+  static const uint16 kNoDump = 0xffff;
+  static uint16 dump_offset = kNoDump;
+  static boolean is_dump_header_printed;
+  static uint32 dump_millis;
+
+  static inline uint8 readDataByte(uint16 offset) {
+    return eeprom_read_byte((const uint8*)(kDataAddress + offset));
+  }
+
+  static inline uint8* magicAddress() {
+    return (uint8*)(kAddress + sizeof(Header) - 1);
+  }
+
+  static void clearReferences() {
+    for (uint8 i = 0; i < kMaxIds; i++) {
+      references[i].id_byte = 0;
+    }
+  }
+
+  // Returns the reference of the given id byte, adding it if add is true
+  // and there is a free entry, or NULL.
+  static Reference* find(uint8 id_byte, boolean add) {
+    for (uint8 i = 0; i < kMaxIds; i++) {
+      Reference* const reference = &references[i];
+      if (reference->id_byte == id_byte) {
+        return reference;
+      }
+      if (!reference->id_byte) {
+        if (!add) {
+          return NULL;
+        }
+        reference->id_byte = id_byte;
+        return reference;
+      }
+    }
+    return NULL;
+  }
+
+  void setup() {
+    state = states::IDLE;
+    if (!custom_defs::kUseBurstCapture) {
+      return;
+    }
+    eeprom_read_block(&header, (const void*)kAddress, sizeof(Header));
+    if (header.magic != kMagic || header.num_bytes > kDataBytes) {
+      return;
+    }
+    uint8 crc = 0;
+    for (uint16 i = 0; i < header.num_bytes; i++) {
+      crc = crc8Update(crc, readDataByte(i));
+    }
+    if (crc != header.crc) {
+      return;
+    }
+    state = states::STORED;
+    requestDump();
+  }
+
+  void trigger(uint8 flags) {
+    if (!custom_defs::kUseBurstCapture || state != states::IDLE) {
+      return;
+    }
+    header.trigger_flags = flags;
+    header.num_bytes = 0;
+    header.num_frames = 0;
+    header.lost_frames = 0;
+    header.crc = 0;
+    header.magic = kMagic;
+    clearReferences();
+    num_staged = 0;
+    write_offset = 0;
+    header_index = 0;
+    is_magic_cleared = false;
+    trigger_millis = system_clock::timeMillis();
+    record_millis = trigger_millis;
+    state = states::CAPTURING;
+  }
+
+  static inline void countLostFrame() {
+    if (header.lost_frames != 0xff) {
+      header.lost_frames++;
+    }
+  }
+
+  // Stage the given record. Returns false if the staging ring has no room
+  // for it.
+  static boolean stage(const uint8* bytes, uint8 num_bytes) {
+    if (num_staged + num_bytes > kStagingBytes) {
+      return false;
+    }
+    for (uint8 i = 0; i < num_bytes; i++) {
+      staged[(staged_head + num_staged) % kStagingBytes] = bytes[i];
+      num_staged++;
+      header.crc = crc8Update(header.crc, bytes[i]);
+    }
+    header.num_bytes += num_bytes;
+    return true;
+  }
+
+  void frameArrived(const LinFrame& frame, boolean is_valid) {
+    if (!custom_defs::kUseBurstCapture || state != states::CAPTURING) {
+      return;
+    }
+    const uint8 n = frame.num_bytes();
+    const uint8 id_byte = frame.get_byte(0);
+    const uint32 now = system_clock::timeMillis();
+    const uint32 units = (now - record_millis) / kTimeUnitMillis;
+    const uint8 time = (units > kMaxTime) ? kMaxTime : units;
+
+    // Deltas are of valid frames with data and the same length as the
+    // last recorded frame of the id.
+    const boolean has_data = is_valid && n >= 2;
+    const uint8 num_data_bytes = has_data ? n - 2 : 0;
+    const Reference* const reference = has_data ? find(id_byte, false) : NULL;
+    uint8 record[kMaxRecordBytes];
+    uint8 size = 3;
+    record[1] = id_byte;
+    if (reference && reference->num_data_bytes == num_data_bytes) {
+      record[0] = time;
+      uint8 changes = 0;
+      for (uint8 i = 0; i < num_data_bytes; i++) {
+        const uint8 b = frame.get_byte(i + 1);
+        if (b != reference->data[i]) {
+          changes |= H(i);
+          record[size++] = b;
+        }
+      }
+      record[2] = changes;
+    } else {
+      record[0] = kFullFlag | time;
+      record[2] = (n - 1) | (is_valid ? 0 : kInvalidFlag);
+      for (uint8 i = 1; i < n; i++) {
+        record[size++] = frame.get_byte(i);
+      }
+    }
+
+    // The region is full, end the window.
+    if (header.num_bytes + size > kDataBytes) {
+      countLostFrame();
+      state = states::FLUSHING;
+      return;
+    }
+    if (!stage(record, size)) {
+      countLostFrame();
+      return;
+    }
+    header.num_frames++;
+    record_millis = (units > kMaxTime) ? now : record_millis + units * kTimeUnitMillis;
+
+    // Only once recorded, so the dump finds the same references.
+    if (has_data) {
+      Reference* const recorded = find(id_byte, true);
+      if (recorded) {
+        recorded->num_data_bytes = num_data_bytes;
+        for (uint8 i = 0; i < num_data_bytes; i++) {
+          recorded->data[i] = frame.get_byte(i + 1);
+        }
+      }
+    }
+  }
+
+  void requestDump() {
+    if (!custom_defs::kUseBurstCapture || state != states::STORED) {
+      return;
+    }
+    dump_offset = 0;
+    is_dump_header_printed = false;
+  }
+
+  boolean clear() {
+    if (!custom_defs::kUseBurstCapture || state == states::CAPTURING ||
+        state == states::FLUSHING) {
+      return false;
+    }
+    dump_offset = kNoDump;
+    if (state == states::STORED) {
+      eeprom_write_byte(magicAddress(), 0xff);
+    }
+    state = states::IDLE;
+    return true;
+  }
+
+  // Print the record at dump_offset as the time from the trigger, the id
+  // and the data bytes, or all the bytes followed by '!' for an invalid
+  // frame.
+  static void printNextRecord() {
+    const uint8 flags_and_time = readDataByte(dump_offset++);
+    const uint8 id_byte = readDataByte(dump_offset++);
+    const uint8 third = readDataByte(dump_offset++);
+    dump_millis += (flags_and_time & kMaxTime) * kTimeUnitMillis;
+    sio::out << F("cap +") << dump_millis << ' ' << sio::hex2(id_byte) << ':';
+    if (flags_and_time & kFullFlag) {
+      const uint8 n = third & ~kInvalidFlag;
+      const boolean is_valid = !(third & kInvalidFlag);
+      // The data bytes of a valid frame are followed by its checksum.
+      Reference* const reference = (is_valid && n >= 1) ? find(id_byte, true) : NULL;
+      if (reference) {
+        reference->num_data_bytes = n - 1;
+      }
+      for (uint8 i = 0; i < n; i++) {
+        const uint8 b = readDataByte(dump_offset++);
+        if (is_valid && i == n - 1) {
+          break;
+        }
+        if (reference) {
+          reference->data[i] = b;
+        }
+        sio::out << ' ' << sio::hex2(b);
+      }
+      if (!is_valid) {
+        sio::out << F(" !");
+      }
+    } else {
+      Reference* const reference = find(id_byte, false);
+      if (!reference) {
+        // Not decodable, the rest is skipped.
+        sio::out << F(" ?");
+        dump_offset = header.num_bytes;
+      } else {
+        for (uint8 i = 0; i < reference->num_data_bytes; i++) {
+          if (third & H(i)) {
+            reference->data[i] = readDataByte(dump_offset++);
+          }
+          sio::out << ' ' << sio::hex2(reference->data[i]);
+        }
+      }
+    }
+    sio::out << '\n';
+  }
+
+  static void loopDump() {
+    if (!sio::beginRecord(64)) {
+      return;
+    }
+    if (!is_dump_header_printed) {
+      sio::out << F("cap: trigger=") << sio::hex2(header.trigger_flags) << F(" frames=")
+          << header.num_frames << F(" lost=") << header.lost_frames << F(" bytes=")
+          << header.num_bytes << '\n';
+      clearReferences();
+      dump_millis = 0;
+      is_dump_header_printed = true;
+      return;
+    }
+    if (dump_offset >= header.num_bytes) {
+      dump_offset = kNoDump;
+      return;
+    }
+    printNextRecord();
+  }
+
+  // Write the next changed byte of the staged records, or else of the
+  // header. Called when the eeprom is ready.
+  static void writeNextByte() {
+    // The old capture is invalid before any of its bytes is overwritten.
+    if (!is_magic_cleared) {
+      is_magic_cleared = true;
+      if (eeprom_read_byte(magicAddress()) == kMagic) {
+        eeprom_write_byte(magicAddress(), 0xff);
+        return;
+      }
+    }
+    // Skip the unchanged bytes.
+    while (num_staged) {
+      const uint8 b = staged[staged_head];
+      staged_head = (staged_head + 1) % kStagingBytes;
+      num_staged--;
+      uint8* const address = (uint8*)(kDataAddress + write_offset++);
+      if (eeprom_read_byte(address) != b) {
+        eeprom_write_byte(address, b);
+        return;
+      }
+    }
+    if (state != states::FLUSHING) {
+      return;
+    }
+    const uint8* const bytes = (const uint8*)&header;
+    while (header_index < sizeof(Header)) {
+      const uint8 i = header_index++;
+      uint8* const address = (uint8*)kAddress + i;
+      if (eeprom_read_byte(address) != bytes[i]) {
+        eeprom_write_byte(address, bytes[i]);
+        break;
+      }
+    }
+    if (header_index >= sizeof(Header)) {
+      state = states::STORED;
+    }
+  }
+
+  void loop() {
+    if (!custom_defs::kUseBurstCapture) {
+      return;
+    }
+    if (dump_offset != kNoDump) {
+      loopDump();
+    }
+    if (state == states::CAPTURING &&
+        system_clock::timeMillis() - trigger_millis >= custom_defs::kBurstCaptureMillis) {
+      state = states::FLUSHING;
+    }
+    if (state != states::CAPTURING && state != states::FLUSHING) {
+      return;
+    }
+    // The eeprom writes a byte in the background. Don't wait for it.
+    if (eeprom_is_ready()) {
+      writeNextByte();
+    }
+  }
+}  // namespace burst_capture
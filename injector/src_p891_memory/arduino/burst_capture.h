@@ -0,0 +1,79 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BURST_CAPTURE_H
+#define BURST_CAPTURE_H
+
+#include "avr_util.h"
+#include "lin_frame.h"
+
+// Capture of the frames that follow a trigger (the first LIN errors of the
+// run, or a serial command) to the eeprom, for intermittent problems that
+// happen with no host attached. The frames of the window are encoded per
+// id as the data bytes that changed since the last recorded frame of that
+// id, staged in RAM and written by loop() a byte at a time when the eeprom
+// is ready, skipping the unchanged bytes. The header is written last, so
+// a capture interrupted by a reset is not valid.
+//
+// Wear is bounded: a stored capture is kept, and no new capture is taken,
+// until it is cleared with clear(), so the eeprom is written at most once
+// per clear. A stored capture is printed at setup, so it shows up at the 
+// next connection, and by requestDump().
+//
+// Record layout, after the header:
+//   [0]    Bit 7 set for a FULL record. Bits [6:0] time since the previous
+//          record, or the trigger, in kTimeUnitMillis units, saturated.
+//   [1]    The id byte.
+//   FULL:  [2] number of the bytes that follow, data and checksum, with
+//          bit 7 set if the frame is invalid. [3..] the bytes.
+//   DELTA: [2] bit i set if data byte i changed since the last record of
+//          this id. [3..] the changed data bytes. Valid frames of the same
+//          length only, the checksum is not recorded.
+//
+// Enabled with custom_defs::kUseBurstCapture.
+namespace burst_capture {
+  // Number of ids whose last recorded frame is kept for the deltas. Frames
+  // of other ids are recorded as FULL records.
+  static const uint8 kMaxIds = 8;
+
+  // Bytes of encoded frames not written to the eeprom yet. Frames that do
+  // not fit are counted as lost.
+  static const uint8 kStagingBytes = 64;
+
+  // Resolution of the record times.
+  static const uint8 kTimeUnitMillis = 2;
+
+  // Call once from main setup(). Reads the stored capture, if any, and
+  // requests its dump.
+  extern void setup();
+
+  // Call from the main loop. Ends the capture window, writes a staged byte
+  // when the eeprom is ready, and prints the lines of a requested dump.
+  extern void loop();
+
+  // Start a capture of custom_defs::kBurstCaptureMillis, if armed. flags
+  // are the lin_processor::errors of the trigger, zero for a manual
+  // trigger.
+  extern void trigger(uint8 flags);
+
+  // Call for each frame taken from the rx queue.
+  extern void frameArrived(const LinFrame& frame, boolean is_valid);
+
+  // Print the stored capture, one line per frame, if any.
+  extern void requestDump();
+
+  // Invalidate the stored capture and arm a new one. Returns false while a
+  // capture is being taken or written.
+  extern boolean clear();
+}  // namespace burst_capture
+
+#endif
@@ -0,0 +1,209 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef COMPACT_SIGNAL_TRACKER_H
+#define COMPACT_SIGNAL_TRACKER_H
+
+#include <avr/pgmspace.h>
+#include "avr_util.h"
+#include "signal_tracker.h"
+#include "system_clock.h"
+
+// Configuration of CompactSignalTracker. Same meaning as the SignalTracker
+// constructor arguments. In program memory, can be shared by trackers.
+struct SignalTrackerParams {
+  // At most 15.
+  uint8 required_pending_reports_count;
+  uint16 pending_report_ttl_millis;
+  uint16 supporting_report_ttl_millis;
+};
+
+// A RAM compact alternative to SignalTracker with the same logic and 
+// accessors. Uses 9 bytes instead of about 20, with 16 bit millis time 
+// stamps and the configuration in program memory. 
+//
+// Time in state is reported up to 32768 millis and then stays at 32768,
+// provided that loop() or reportSignal() is called at least every 32 secs.
+class CompactSignalTracker {
+public:
+  typedef SignalTracker::States States;
+
+  // The params should be in program memory.
+  explicit CompactSignalTracker(const SignalTrackerParams* params) 
+  : 
+    params_(params) 
+    {
+      enterStateUnknown(nowMillis());
+    }
+
+  // Called from the main loop() method.
+  // May change the state to UNKNOWN.
+  inline void loop() {
+    const uint16 now = nowMillis();
+    updateLongInState(now);
+    // Check for state expiration due to lack of supporting reports.
+    if (state() == States::UNKNOWN || 
+        (uint16)(now - last_supporting_report_millis_) < supportingReportTtlMillis()) {
+      return;
+    }
+    // This also resets the pending reports.
+    enterStateUnknown(now);
+  }
+
+  // Accept a report about the current value of the signal. apply filtering
+  // logic and if conditions met, change the state to ON or OFF.
+  inline void reportSignal(boolean is_on) {
+    const uint16 now = nowMillis();
+    updateLongInState(now);
+
+    // Handle the case where the report matches the current state.
+    if (doesReportSupportCurrentState(is_on)) {
+      last_supporting_report_millis_ = now;
+      return;
+    }
+
+    // Here when the report contradicts the current state. That is, this is a 
+    // pending report.
+    const uint8 count = bits_ >> kPendingCountShift;
+    const boolean isFirstConsecutiveReport = 
+      (count == 0) || 
+      (((bits_ & kPendingValueOn) != 0) != is_on) || 
+      ((uint16)(now - last_pending_report_millis_) >= 
+          pgm_read_word(&params_->pending_report_ttl_millis));
+
+    if (isFirstConsecutiveReport) {
+      bits_ = (bits_ & kStateMask) | (1 << kPendingCountShift) 
+          | (is_on ? kPendingValueOn : 0);
+    } else {
+      // NOTE: should not overflow since we limit this to required_report_count.
+      bits_ += (1 << kPendingCountShift);
+    }
+
+    last_pending_report_millis_ = now;
+
+    // If insufficient number of consecutive pending reports to change state, do nothing.
+    if ((bits_ >> kPendingCountShift) < 
+        pgm_read_byte(&params_->required_pending_reports_count)) {
+      return;
+    }
+
+    // Here when enough consecutive pending reports to change state. This 
+    // also clears the pending count.
+    last_supporting_report_millis_ = now;
+    state_start_millis_ = now;
+    bits_ = is_on ? States::ON : States::OFF;
+  }
+
+  // Same as reportSignal() with the value of a previous report that 
+  // supported the current state, with no other report since. Requires a 
+  // known state.
+  inline void refreshSupportingReport() {
+    const uint16 now = nowMillis();
+    updateLongInState(now);
+    last_supporting_report_millis_ = now;
+  }
+
+  // Retrieves the current state. Returns one of States values. Does not change state.
+  inline uint8 state() const {
+    return bits_ & kStateMask;
+  }
+  
+  inline boolean isOn() const {
+    return state() == States::ON;
+  }
+  
+  inline boolean isOff() const {
+    return state() == States::OFF;
+  }
+  
+  inline boolean isOnForAtLeastMillis(uint32 min_time_in_state) const {
+    return isOn() &&  (timeInStateMillis() >= min_time_in_state);
+  }
+  
+  inline boolean isKnown() const {
+    return state() != States::UNKNOWN;
+  }
+
+  // See SignalTracker::millisUntilExpiry().
+  inline uint16 millisUntilExpiry() const {
+    if (state() == States::UNKNOWN) {
+      return 0xffff;
+    }
+    const uint16 elapsed = nowMillis() - last_supporting_report_millis_;
+    const uint16 ttl = supportingReportTtlMillis();
+    return (elapsed >= ttl) ? 0 : ttl - elapsed;
+  }
+
+  // Returns time in millis in current state, up to kMaxTimeInStateMillis.
+  inline uint32 timeInStateMillis() const {
+    const uint16 elapsed = nowMillis() - state_start_millis_;
+    return ((bits_ & kLongInState) || elapsed >= kMaxTimeInStateMillis) 
+        ? kMaxTimeInStateMillis : elapsed;
+  }
+
+  static const uint16 kMaxTimeInStateMillis = 0x8000;
+
+private:
+  // bits_ layout. Bits [1:0] are the state.
+  static const uint8 kStateMask = 0x03;
+  // Valid only if pending count > 0. The value of the pending reports.
+  static const uint8 kPendingValueOn = H(2);
+  // Set once the time in state reached kMaxTimeInStateMillis.
+  static const uint8 kLongInState = H(3);
+  // Bits [7:4] are the number of consecutive and equal reports that do not
+  // match the current state.
+  static const uint8 kPendingCountShift = 4;
+
+  static inline uint16 nowMillis() {
+    return (uint16)system_clock::timeMillis();
+  }
+
+  inline uint16 supportingReportTtlMillis() const {
+    return pgm_read_word(&params_->supporting_report_ttl_millis);
+  }
+
+  // Latch the long time in state before the 16 bit time stamp wraps around.
+  inline void updateLongInState(uint16 now) {
+    if ((uint16)(now - state_start_millis_) >= kMaxTimeInStateMillis) {
+      bits_ |= kLongInState;
+    }
+  }
+
+  inline boolean doesReportSupportCurrentState(boolean report_is_on) const {
+    switch (state()) {
+      case States::ON: 
+        return report_is_on;
+      case States::OFF: 
+        return !report_is_on;
+    }
+    // No report matches the UNKNOWN state.
+    return false;
+  }
+
+  inline void enterStateUnknown(uint16 now) {
+    bits_ = States::UNKNOWN;
+    state_start_millis_ = now;
+  }
+
+  const SignalTrackerParams* const params_;
+
+  // State, pending reports count and value and flags. See above.
+  uint8 bits_;
+
+  // Low 16 bits of the system clock millis of the state change, the last 
+  // supporting report and the last pending report.
+  uint16 state_start_millis_;
+  uint16 last_supporting_report_millis_;
+  uint16 last_pending_report_millis_;
+};
+
+#endif
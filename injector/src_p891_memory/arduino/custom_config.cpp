@@ -15,8 +15,10 @@
 #include <avr/eeprom.h>
 
 #include "custom_signals.h"
-#include "passive_timer.h"
+#include "settings.h"
+#include "signal_pattern.h"
 #include "sio.h"
+#include "system_clock.h"
 
 // Like all the other custom_* files, this file should be adapted to the specific application. 
 // The example provided is for a Sport/PSE button memory feature for 981/Cayman.
@@ -35,128 +37,98 @@ namespace custom_config {
     boolean is_enabled;
   }
 
-  // A single byte enum representing the states of the config sequence state machine.
-  namespace states {
-    static const uint8 IGNITION_OFF_IDLE = 0;
-    static const uint8 IGNITION_ON_COUNTING = 1;
-    static const uint8 IGNITION_ON_IDLE = 2;
-    static const uint8 IGNITION_OFF_TOGGLE_CONFIG = 3;
-  }
-
-  // Current button recognizer state. One of states:: values. 
-  static uint8 state;
-
-  // Time in current state.
-  static PassiveTimer time_in_state;
-
-  // Arbitrary 16bit code to store in the eeprom for on/off state.
+  // Arbitrary 16bit code of the on/off state at eeprom address 0, before the
+  // settings config block.
   namespace eeprom_uint16_code {
     static const uint16 ENABLED = 0x1234;
     static const uint16 DISABLED = 0x4568;
   }
 
-  // Set is_enabled flag from the configuration stored in the eeprom.
+  // Set is_enabled flag from the settings config block. Without a valid
+  // block, the flag is taken from the old eeprom code and saved to the 
+  // block.
   static inline void loadEepromConfig() {
-    const uint16 eeprom_code = eeprom_read_word(0);
-
-    // If the code is unknown we default to enabled.
-    private_::is_enabled = eeprom_code != eeprom_uint16_code::DISABLED;
-    sio::printf(F("config loaded: %d\n"), private_::is_enabled);
+    if (!settings::isConfigValid()) {
+      settings::ConfigBlock block = settings::config();
+      // If the code is unknown we default to enabled.
+      block.enabled = eeprom_read_word(0) != eeprom_uint16_code::DISABLED;
+      settings::setConfig(block);
+    }
+    private_::is_enabled = settings::config().enabled;
+    sio::out << F("config loaded: ") << private_::is_enabled << '\n';
   }
 
-  // Toggle the current configuration, with eeprom persistnce.
+  // Toggle the current configuration, with eeprom persistnce. The block is
+  // written behind by settings::loop().
   static inline void toggleConfig() {
-    // Toggle the eeprom code.
-    const uint16 eeprom_code = (private_::is_enabled) ? eeprom_uint16_code::DISABLED : eeprom_uint16_code::ENABLED;
-    eeprom_write_word(0, eeprom_code);
-    sio::printf(F("config toggled\n"));
-
-    // TODO: if the writing failed surface an error condition.
-
-    // Read the new eeprom code. If writing to the eeprom failed, we
-    // will stay with the actual config stored in the eeprom.
-    loadEepromConfig();
+    settings::ConfigBlock block = settings::config();
+    block.enabled = !private_::is_enabled;
+    settings::setConfig(block);
+    sio::println(F("config toggled"));
+    private_::is_enabled = block.enabled;
   }
 
-  // Change to given state. Assumes not already in this state.
-  static inline void changeToState(uint8 new_state) {
-    state = new_state;
-    sio::printf(F("config state: %d\n"), state);
-    time_in_state.restart();
+  // The config toggle gesture: ignition on, kExpectedButtonClicks clicks
+  // of the config button and ignition off. Any other click or ignition 
+  // change in between restarts it.
+  static const signal_pattern::Step kToggleSteps[] PROGMEM = {
+    { custom_signals::signal_ids::ignition_state, SignalTracker::States::ON, 1, 0, 0xffff },
+    { custom_signals::signal_ids::config_button, SignalTracker::States::ON, 
+      kExpectedButtonClicks, 0, 0xffff },
+    { custom_signals::signal_ids::ignition_state, SignalTracker::States::OFF, 1, 0, 0xffff },
+  };
+
+  // A recognized gesture and its action. Adding a gesture requires only a 
+  // steps table and a new row in gestures[].
+  struct Gesture {
+    signal_pattern::Matcher matcher;
+    void (*action)();
+  };
+
+  static Gesture gestures[] = {
+    { signal_pattern::Matcher(kToggleSteps, ARRAY_SIZE(kToggleSteps), kSequenceTimeoutMillis), 
+      toggleConfig },
+  };
+
+  static inline void printGestureState(uint8 gesture_index) {
+    const signal_pattern::Matcher& matcher = gestures[gesture_index].matcher;
+    sio::out << F("config state: ") << gesture_index << '.' << matcher.stepIndex() 
+        << '.' << matcher.count() << '\n';
   }
 
   void setup() {
     loadEepromConfig();
-    changeToState(states::IGNITION_OFF_IDLE);
   }
 
-  // Called periodically from loop() to update the state machine.
-  static inline void updateState() {
-    // Valid in IGNITION_ON_COUNTING state only.
-    static uint8 button_click_count;
-    static uint8 button_last_state;
-
-    // Handle the state transitions.
-    switch (state) {
-      case states::IGNITION_OFF_IDLE:
-        if (custom_signals::ignition_state().isOn()) {
-          button_click_count = 0;
-          button_last_state = custom_signals::config_button().state();
-          changeToState(states::IGNITION_ON_COUNTING);  
-        }
-        break;
-
-      case states::IGNITION_ON_COUNTING: 
-        {
-          // If sequence takes too long too long or too many clicks then ignore.
-          if (time_in_state.timeMillis() > kSequenceTimeoutMillis || button_click_count > kExpectedButtonClicks) {
-            changeToState(states::IGNITION_ON_IDLE);  
-            break;
-          }
-  
-          // If ignition turned off, see if we have the conditions to toggle configuration.
-          if (custom_signals::ignition_state().isOff()) {
-            changeToState(button_click_count == kExpectedButtonClicks 
-                ? states::IGNITION_OFF_TOGGLE_CONFIG 
-                : states::IGNITION_OFF_IDLE);
-            break;
-          }
-  
-          const uint8 button_new_state = custom_signals::config_button().state();
-          // Count change from non pressed to pressed.
-          if ((button_last_state == SignalTracker::States::OFF) && (button_new_state == SignalTracker::States::ON)) {
-            // This cannot overflow because we exist this state if exceeding kExpectedButtonClicks. 
-            button_click_count++;
-            sio::printf(F("config state: %d.%d\n"), states::IGNITION_ON_COUNTING, button_click_count);
-          }
-          button_last_state = button_new_state;
-        }
-        break;
-
-      case states::IGNITION_ON_IDLE:
-        if (custom_signals::ignition_state().isOff()) {
-          changeToState(states::IGNITION_OFF_IDLE);  
-        }
-        break;
-
-      case states::IGNITION_OFF_TOGGLE_CONFIG:
-        toggleConfig();
-        changeToState(states::IGNITION_OFF_IDLE);
-        break;
-
-      // Unknown state, set to initial.
-      default:
-        sio::printf(F("config state: unknown (%d)"), state);
-        // Go to a default state and wait there until ignition is off.
-        changeToState(states::IGNITION_ON_IDLE);
-        break;
-    } 
+  void signalEvent(const custom_signals::SignalEvent& event) {
+    for (uint8 i = 0; i < ARRAY_SIZE(gestures); i++) {
+      switch (gestures[i].matcher.eventArrived(event)) {
+        case signal_pattern::results::ADVANCED:
+        case signal_pattern::results::RESTARTED:
+          printGestureState(i);
+          break;
+        case signal_pattern::results::MATCHED:
+          gestures[i].action();
+          break;
+      }
+    }
+  }
+
+  void signalEventsDropped() {
+    for (uint8 i = 0; i < ARRAY_SIZE(gestures); i++) {
+      gestures[i].matcher.restart();
+    }
   }
 
   // Called repeatidly from the main loop().
   void loop() {
-    // Update the state machine.
-    updateState();
+    // The gestures are matched by signalEvent(), here we only expire them.
+    const uint16 time_millis = system_clock::timeMillis();
+    for (uint8 i = 0; i < ARRAY_SIZE(gestures); i++) {
+      if (gestures[i].matcher.checkTimeout(time_millis)) {
+        printGestureState(i);
+      }
+    }
   }
 
 }  // namespace custom_module
@@ -14,6 +14,7 @@
 #define CUSTOM_CONFIG_H
 
 #include "avr_util.h"
+#include "custom_signals.h"
 #include "lin_frame.h"
 
 // Implements the application specific configuration control. It exports a single 'enable'
@@ -23,6 +24,7 @@
 // 2. Click the Sport Mode button 6 times at a rate of about one click per second.
 // 3. Turn ignition off.
 // The entire sequence must be completed within 20 seconds, otherwise it is ignored.
+// The sequence is recognized by a signal_pattern table fed with the signal events.
 //
 // Like all the other custom_* files, this file should be adapted to the specific application. 
 // The example provided is for a Sport Mode button press injector for 981/Cayman.
@@ -37,6 +39,11 @@ namespace custom_config {
 
   // Called once on each iteration of the Arduino main loop().
   extern void loop();
+
+  // Called with each custom_signals event, by the single reader of the 
+  // event queue, and when events were dropped.
+  extern void signalEvent(const custom_signals::SignalEvent& event);
+  extern void signalEventsDropped();
   
   inline boolean is_enabled() {
     return private_::is_enabled;
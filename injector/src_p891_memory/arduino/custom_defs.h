@@ -22,12 +22,325 @@
 namespace custom_defs {
 
   // True for LIN checksum V2 (enahanced). False for LIN checksum version 1.
+  // This is the model of ids whose model was not preset or learned yet 
+  // (see LinFrame::setChecksumModel()).
   const boolean kUseLinChecksumVersion2 = true;
 
+  // If true, the checksum model (classic or enhanced) of each id is learned
+  // from the first frame of that id that validates under one of them. 
+  // Diagnostic ids 0x3c, 0x3d are always classic.
+  const boolean kLearnChecksumModels = true;
+
   // LIN bus bits per second rate.
   // Supported baud range is 1000 to 20000. If out of range, using silently default
   // baud of 9600.
   const uint16 kLinSpeed = 19200;
+
+  // Number of frames the lin processor rx queue can hold. One slot is always
+  // reserved for the frame being received.
+  const uint8 kLinFrameBuffers = 8;
+
+  // If true, the rx queue stores the frames as length prefixed byte records
+  // in a single buffer of kPackedFrameRingBytes bytes instead of 
+  // kLinFrameBuffers fixed size frames, which holds more short frames in the
+  // same RAM. The frame timestamps are not kept in this mode.
+  const boolean kUsePackedFrameRing = false;
+  const uint8 kPackedFrameRingBytes = 96;
+
+  // What the ISR does with a complete frame when the rx frame queue is 
+  // full. kOverrunDropNewest drops that frame, which keeps the queued 
+  // history intact, e.g. for capture. kOverrunDropOldest drops the oldest 
+  // queued frame instead, unless main is reading it. kOverrunCoalesce 
+  // replaces the queued frame of the same id, if any, in place, which keeps
+  // the newest state of each id for state tracking consumers, and drops the
+  // frame otherwise. Dropped frames set the BUFFER_OVERRUN error, coalesced
+  // ones are counted in the lin stats. Applies to the kLinFrameBuffers 
+  // queue, the packed ring and the priority lane always drop the newest.
+  const uint8 kOverrunDropNewest = 0;
+  const uint8 kOverrunDropOldest = 1;
+  const uint8 kOverrunCoalesce = 2;
+  const uint8 kOverrunPolicy = kOverrunDropNewest;
+
+  // If true, the frames of kPriorityFrameIds are queued in a separate 
+  // queue of kPriorityFrameBuffers frames that the main reads first, so a 
+  // burst of other frames neither delays nor drops them. 6 bit ids or 
+  // protected ids.
+  const boolean kUsePriorityLane = false;
+  const uint8 kPriorityFrameIds[] = { 0x0d };
+  const uint8 kPriorityFrameBuffers = 2;
+
+  // If true, the LIN bit timing is computed at compile time from kLinSpeed
+  // (which then must be in range) for a shorter ISR path.
+  const boolean kUseStaticLinConfig = false;
+
+  // If true, header only frames (no slave response) are added to the rx 
+  // queue. If false, they are only counted per id by the ISR (see 
+  // lin_processor::subscribeHeaderOnlyFrames()), which saves queue slots on
+  // buses with unanswered schedule slots.
+  const boolean kQueueHeaderOnlyFrames = false;
+
+  // If true, frames are closed as soon as they reach the length learned for
+  // their id instead of waiting for the inter byte space timeout. Off by 
+  // default on the injector since bytes of a frame that is longer than 
+  // learned are not proxied.
+  const boolean kUseLearnedFrameLengths = false;
+
+  // If true, bits of frames that are not modified by the injector are 
+  // forwarded on each RX edge rather than at the middle of the bit, which
+  // removes the half bit delay of the other side. The mid bit sampling is 
+  // still used to read and to confirm the bits.
+  const boolean kUseLowLatencyProxy = false;
+
+  // If true, the injector sends test frames on both buses and prints the 
+  // forwarding delay of the low latency proxy per direction and bit 
+  // position every kProxySelfTestDumpMillis (see proxy_self_test.h). 
+  // Requires kUseLowLatencyProxy. For the bench only, not in the car.
+  const boolean kUseProxySelfTest = false;
+  const uint16 kProxySelfTestDumpMillis = 5000;
+
+  // If true, the 'n' serial command prints the per call cost of the main 
+  // loop components (see main_loop_bench.h). The resolution is of the 
+  // hardware clock over the calls of a case, finer with 
+  // kUseFineHardwareClock. For the bench only, not in the car.
+  const boolean kUseMainLoopBench = false;
+
+  // If true, the injector responds to the headers of the ids of 
+  // slave_emulation.cpp with their ram data, instead of proxying the 
+  // responses of the slaves (see slave_emulation.h). For the bench, without
+  // the emulated slaves.
+  const boolean kUseSlaveEmulation = false;
+
+  // If true, each proxied bit is sampled three times around the middle of 
+  // the bit and decided by a majority vote, to reject short noise spikes. This
+  // delays the proxied output by the sampling time, about 8us. The number of
+  // bits that needed the vote is reported in the lin stats.
+  const boolean kUseMajorityVoteSampling = false;
+
+  // If true, the tick ISR is entered through a naked stub that copies the 
+  // bits that are proxied as is to the other bus within a few cycles of the
+  // interrupt, instead of after the full ISR prologue, for a fixed minimal 
+  // forwarding latency. Forced and inverted bits are still proxied by the 
+  // ISR body. Not used with kUseMajorityVoteSampling. Set with the macro,
+  // which selects the ISR entry at compile time, so the default build has
+  // no stub.
+#define CUSTOM_DEFS_USE_FAST_PROXY_ISR 0
+  const boolean kUseFastProxyIsr = CUSTOM_DEFS_USE_FAST_PROXY_ISR;
+
+  // If true, the proxied bits of the slave side are output by the timer 2
+  // B compare unit (OC2B, PD3) instead of by pin writes in the tick ISR. The
+  // ISR preloads the level of the next bit and the timer produces the edge
+  // at an exact count, so the edges have no ISR latency jitter, at the cost
+  // of one more bit of delay. Requires the next board revision that has tx2
+  // on PD3 instead of PD4, and loses the OC2B debug pulse. Not used with
+  // kUseLowLatencyProxy or kUseFastProxyIsr.
+  const boolean kUseHardwareTxEdges = false;
+
+  // If true, each injected bit is read back from the rx pin of the bus it 
+  // was sent to, at the next bit tick, and a mismatch, e.g. a slave that 
+  // drives dominant at the same time, is reported as a collision to 
+  // custom_injector and in the injection audit records. Not supported with
+  // kUseHardwareTxEdges, where the output is a bit later.
+  const boolean kUseInjectionReadback = true;
+
+  // Ids whose newest frame is also kept by the lin processor in a per id 
+  // slot that is updated even when the rx queue is full (see 
+  // lin_processor::readLatestFrame()). Each id costs one frame buffer of RAM.
+  // 6 bit ids or protected ids.
+  const uint8 kLatestFrameIds[] = { 0x0d, 0x8e };
+
+  // If true, custom_signals checks the signal trackers for expiration only
+  // when the earliest expiry time of the known signals has passed, instead
+  // of checking all the trackers on each loop.
+  const boolean kUseSignalExpiryDeadline = true;
+
+  // If true, custom_signals keeps the data bytes of the last frame of each
+  // signal frame id and, when a frame repeats a payload whose signals all 
+  // supported their tracker states, only refreshes the trackers instead of
+  // extracting and reporting each signal. Costs 9 bytes of RAM per frame id.
+  const boolean kSkipUnchangedSignalFrames = true;
+
+  // If true, custom_signals collects per signal metrics (report count, max 
+  // time between supporting reports and number of expirations to UNKNOWN) 
+  // and prints them every kSignalMetricsDumpMillis. Used to tune the 
+  // tracker TTLs to the actual frame rates.
+  const boolean kTrackSignalMetrics = false;
+  const uint16 kSignalMetricsDumpMillis = 10000;
+
+  // If true, the period and the jitter of the schedule slot of each id are
+  // measured from the frame timestamps and printed every 
+  // kFramePeriodsDumpMillis (see frame_periods.h). Not with 
+  // kUsePackedFrameRing.
+  const boolean kTrackFramePeriods = false;
+  const uint16 kFramePeriodsDumpMillis = 10000;
+
+  // If true, frames of the injector are inserted toward the slaves in the
+  // gaps of the master schedule learned with kTrackFramePeriods (see
+  // frame_insertion.h). A frame starts only after kInsertIdleBits idle bits
+  // on both buses and must end kInsertGuardMillis before the predicted
+  // break of the master. The counts are printed every
+  // kFrameInsertionDumpMillis.
+  const boolean kUseFrameInsertion = false;
+  const uint8 kInsertIdleBits = 4;
+  const uint8 kInsertGuardMillis = 1;
+  const uint16 kFrameInsertionDumpMillis = 10000;
+
+  // If true, the main loop prints a line for each frame with injected bits,
+  // with the original and resulting bytes. The records are collected by the 
+  // ISR regardless of this flag.
+  const boolean kPrintInjectionAudits = false;
+
+  // Serial output bits per second rate. 115200 is compatible with the 
+  // Arduino serial monitor. 250000, 500000 and 1000000 have exact divisors
+  // at 16Mhz and need a matching host baud rate. At the higher rates the 
+  // main loop may not keep up without kUseSioTxInterrupt.
+  const uint32 kSioBaud = 115200;
+
+  // Size of the sio output queue in bytes. A power of two, up to 1024.
+  const uint16 kSioQueueSize = 128;
+
+  // If true, the serial receiver is enabled and text commands from the host
+  // are executed by sio_cmd, e.g. to change the id filter at runtime.
+  const boolean kUseSerialCommands = true;
+
+  // If true, sio sends the queued bytes from the UART data register empty
+  // interrupt instead of from sio::loop(), which keeps the serial output at
+  // line rate regardless of the main loop time. The ISR adds a few usecs 
+  // of jitter to the other interrupts. Off here to keep the lin processor
+  // jitter minimal.
+  const boolean kUseSioTxInterrupt = false;
+
+  // If true, sio holds the queued bytes until they fill a batch of 
+  // kSioBatchBytes or the oldest of them waited kSioBatchHoldMillis, and 
+  // then sends them back to back. Batches have whole records. 62 bytes is 
+  // the payload of a USB packet of the FTDI, so its packets go out full 
+  // rather than on its latency timer, and each host read returns complete 
+  // records.
+  const boolean kUseSioBatching = false;
+  const uint8 kSioBatchBytes = 62;
+  const uint8 kSioBatchHoldMillis = 8;
+
+  // If true, the diagnostic messages are sent as tokenized binary trace 
+  // records, a few bytes each instead of a text line, and expanded on the
+  // host by serial_dump.py --binary=1. See trace.h.
+  const boolean kUseTraceOutput = false;
+
+  // If true, the main loop logs each received frame as a binary record of
+  // a few bytes, tagged with its direction and with its injection (see 
+  // trace.h), decoded by serial_dump.py --binary=1. A record is dropped,
+  // and counted in the next "dropped" line, if the serial output buffer
+  // has no room for it, so the log does not stall the proxy loop.
+  const boolean kUseSnifferLog = false;
+
+  // Main loop time budget per iteration of the periodic tasks, in usecs.
+  // Bounds the delay they add to the frame handling. See task_scheduler.h.
+  const uint16 kMainLoopBudgetMicros = 1000;
+
+  // The main loop is behind on the frames once the rx queue is at least 
+  // kBehindQueuePercent full, and catches up once it is down to 
+  // kCaughtUpQueuePercent. While behind, the deferrable tasks (the
+  // diagnostics and the dumps) are skipped and the frames task drains the 
+  // whole queue per run. See task_scheduler::loop().
+  const uint8 kBehindQueuePercent = 50;
+  const uint8 kCaughtUpQueuePercent = 0;
+
+  // If true, task_scheduler keeps a histogram of the main loop iteration
+  // times, with the max and the task that caused it, and prints it every
+  // kLoopLatencyDumpMillis and on the 'l' serial command. 
+  const boolean kTrackLoopLatency = false;
+  const uint16 kLoopLatencyDumpMillis = 10000;
+
+  // If true, the lin processor ISRs measure their run time with the hardware
+  // clock and keep min/avg/max per state (see lin_processor::isr_paths), 
+  // printed every kIsrProfileDumpMillis. Adds a few usecs to each ISR.
+  const boolean kProfileIsr = false;
+  const uint16 kIsrProfileDumpMillis = 10000;
+
+  // If true, the tick ISR checks at its entry that it runs within a quarter
+  // bit of its timer match, so its sample was not taken late, e.g. after a
+  // main cli() or another ISR, and at its exit that the next match is not 
+  // pending yet, so it did not overrun the next bit. Both are counted per 
+  // state in the ISR profile, printed every kIsrProfileDumpMillis. With 
+  // kInvalidateLateFrames the frame of a late sample is also marked 
+  // invalid. About 1us per tick ISR.
+  const boolean kDetectLateSamples = false;
+  const boolean kInvalidateLateFrames = false;
+
+  // If true, the ISR records the context of each error, the frame id, the
+  // byte and bit position and the time, in a small queue whose records the
+  // main loop prints, one line each. Tells which ISR phase fails under 
+  // load, e.g. stop bits of a given byte or right after slave responses.
+  const boolean kRecordErrorContext = false;
+
+  // The debug signals of the LIN ISRs, the ISR run, the bit sampling, the 
+  // break and the errors. With NONE, the production setting, the ISRs do 
+  // nothing for them. With PINS each is a pin that the ISRs toggle, for a
+  // scope. With RING the ISRs write each edge as a record of the event, 
+  // the tick timer count and the state to a small RAM ring, which the 't'
+  // serial command stops and prints (see lin_processor::stopIsrTrace()).
+  namespace isr_trace_policies {
+    const uint8 NONE = 0;
+    const uint8 PINS = 1;
+    const uint8 RING = 2;
+  }
+  const uint8 kIsrTracePolicy = isr_trace_policies::NONE;
+
+  // If true, the time from the end of the header to the response start bit,
+  // and the space between the first two response bytes, are measured for 
+  // the first lin_processor::kMaxResponseTimingIds ids and printed every 
+  // kResponseTimingDumpMillis as min/avg/max. For tuning the response 
+  // timeout and checking the slack of the slaves for injection.
+  const boolean kTrackResponseTiming = false;
+  const uint16 kResponseTimingDumpMillis = 10000;
+
+  // If true, the time each frame waits in the rx queue, from the ISR closing
+  // it to main taking it, is counted in a histogram with its max in the lin
+  // processor stats (see lin_processor::Stats). For tuning the main loop
+  // task periods and the queue depth. Not with kUsePackedFrameRing.
+  const boolean kTrackQueueDelay = false;
+
+  // If true, a binary health record with the uptime, the frame rate, the
+  // lin error counters, the max loop and ISR times, the free RAM margin and
+  // the sio drops is sent every kHealthReportMillis (see health_report.h).
+  // About 35 bytes per record.
+  const boolean kUseHealthReport = false;
+  const uint16 kHealthReportMillis = 60000;
+
+  // If true, custom_module runs the bytecode program of event_program.h,
+  // loaded from the eeprom and over the 'y' and 'z' serial commands, with 
+  // the signal events.
+  const boolean kUseEventProgram = false;
+
+  // If true, the first LIN errors of a run, or the 'c 2' serial command, 
+  // trigger a capture of the frames of the next kBurstCaptureMillis to the
+  // eeprom, printed at the next boot. See burst_capture.h.
+  const boolean kUseBurstCapture = false;
+  const uint16 kBurstCaptureMillis = 3000;
+
+  // If true, the hardware clock (Timer1) runs at 16Mhz / 8, 0.5us ticks, 
+  // instead of 16Mhz / 64, 4us ticks, so the ISR profile, the response 
+  // timing, the queue delays and the loop latency resolve sub usec 
+  // differences. For diagnostic builds: the 16 bit tick intervals, e.g. the
+  // loop and queue delay maxes, then saturate at ~32ms instead of ~262ms, 
+  // the 8 bit ISR run times at 127us, and the overflow ISR runs every 
+  // 32ms. Requires kLinSpeed of at least 7843 baud.
+  const boolean kUseFineHardwareClock = false;
+
+  // ISR run time budget of the profile, in usecs. ISR runs longer than this
+  // are counted per path and flagged as OVER when printed. At 19200 baud a
+  // bit is 52us (832 cycles) and an ISR that runs longer may miss the next
+  // bit sample.
+  const uint16 kIsrBudgetMicros = 40;
+
+  // If true, the free RAM margin below the deepest stack use is printed 
+  // when it shrinks, and flagged as LOW below kMinFreeRamBytes (see 
+  // stack_monitor.h). Use when sizing buffers and RAM hungry features.
+  const boolean kUseStackMonitor = false;
+  const uint16 kMinFreeRamBytes = 128;
+
+  // If true, the main loop is supervised by the watchdog timer. A main loop
+  // that stalls for watchdog::kTimeoutMillis disables all the injection and 
+  // resets the device. See watchdog.h.
+  const boolean kUseWatchdog = true;
   
 }  // namepsace custom_defs
 
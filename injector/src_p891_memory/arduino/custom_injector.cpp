@@ -1,41 +1,385 @@
-// Licensed under the Apache License, Version 2.0 (the "License");
-// you may not use this file except in compliance with the License.
-// You may obtain a copy of the License at
-//
-//    http://www.apache.org/licenses/LICENSE-2.0
-//
-// Unless required by applicable law or agreed to in writing, software
-// distributed under the License is distributed on an "AS IS" BASIS,
-// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
-// See the License for the specific language governing permissions and
-// limitations under the License.
-
-#include "custom_injector.h"
-
-// The state variables of the injector.
-//
-// Like all the other custom_* files, this file should be adapted to the specific application. 
-// The example provided is for a Sport/PSE button memory feature for 981/Cayman.
-namespace custom_injector {
-  
-  // Private state of the injector. Do not use from other files.
-  namespace private_ {
-
-    byte sport_inject_action = injector_actions::COPY_BIT;
-    byte PSE_inject_action = injector_actions::COPY_BIT;
-    byte ASS_inject_action = injector_actions::COPY_BIT;
-    
-    // True if the current linbus frame is transformed by the injector. Othrwise, the 
-    // frame is passed as is.
-    boolean frame_id_matches;
-    
-    // Used to calculate the modified frame checksum.
-    uint16 sum;
-    
-    // The modified frame checksum byte. 
-    uint8 checksum;
-  }
-}  // namepsace custom_injector
-
-
-
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "custom_injector.h"
+
+// The state variables of the injector.
+//
+// Like all the other custom_* files, this file should be adapted to the specific application. 
+// The example provided is for a Sport/PSE button memory feature for 981/Cayman.
+namespace custom_injector {
+  
+  // Private state of the injector. Do not use from other files.
+  namespace private_ {
+
+    Rule rules[kMaxRules];
+    
+    uint8 num_rules = 0;
+    
+    volatile uint8 learning_rules = 0;
+    
+    uint8 id_to_rule[64];
+    
+    const Rule* active_rule;
+    
+    // Used to calculate the modified frame checksum.
+    uint16 sum;
+    
+    // The modified frame checksum byte. 
+    uint8 checksum;
+    
+    // Same as sum and checksum but for the original frame, before injection.
+    uint16 raw_sum;
+    uint8 raw_checksum;
+    
+    ResponseSlot response_slots[kMaxResponseSlots];
+    
+    uint8 num_response_slots = 0;
+    
+    uint8 id_to_response[64];
+    
+    const Response* volatile sending_response;
+    
+    Reaction reactions[kMaxReactions];
+    
+    volatile uint8 num_reactions = 0;
+    
+    typedef char MaxConditionsAboveEight[(kMaxConditions <= 8) ? 1 : -1];
+    
+    Condition conditions[kMaxConditions];
+    
+    uint8 num_conditions = 0;
+    
+    uint8 failed_bytes;
+    
+    Pulse pulses[kMaxPulses];
+    
+    ButtonBit button_bits[kNumButtons] = {
+      { kSportByteIndex, kSportBitIndex },
+      { kPSEByteIndex, kPSEBitIndex },
+      { kASSByteIndex, kASSBitIndex },
+    };
+    
+    volatile uint8 active_pulses = 0;
+    
+    volatile uint8 collided_pulses = 0;
+    
+    // True if num_data_bytes is a rule length or kLearnDataBytes and 
+    // byte_index is within it. A learned length is not known yet, so any 
+    // data byte index is accepted.
+    static boolean isValidByteIndex(uint8 num_data_bytes, uint8 byte_index) {
+      if (num_data_bytes > kMaxRuleDataBytes) {
+        return false;
+      }
+      return byte_index < (num_data_bytes ? num_data_bytes : kMaxRuleDataBytes);
+    }
+    
+    // Returns the index of the rule of the given id, adding a new pass 
+    // through rule if needed. num_data_bytes of kLearnDataBytes leaves the
+    // length of a new rule to the ISR. Returns kNoRule if the table is full,
+    // the parity bits of id are not valid or the rule has another length.
+    static uint8 findOrAddRule(uint8 id, uint8 num_data_bytes) {
+      if (!LinFrame::isValidPid(id)) {
+        return kNoRule;
+      }
+      
+      for (uint8 i = 0; i < num_rules; i++) {
+        Rule& rule = rules[i];
+        if (rule.id != id) {
+          continue;
+        }
+        if (num_data_bytes == kLearnDataBytes) {
+          return i;
+        }
+        // A given length ends the learning. The ISR may learn it concurrently.
+        cli();
+        if (learning_rules & bitMask(i)) {
+          rule.num_data_bytes = num_data_bytes;
+          learning_rules &= ~bitMask(i);
+          updateIdToRule(i);
+        }
+        const boolean is_same_length = rule.num_data_bytes == num_data_bytes;
+        sei();
+        return is_same_length ? i : kNoRule;
+      }
+      
+      if (num_rules >= kMaxRules) {
+        return kNoRule;
+      }
+      
+      Rule& rule = rules[num_rules];
+      rule.id = id;
+      rule.num_data_bytes = num_data_bytes;
+      for (uint8 i = 0; i < kMaxRuleDataBytes; i++) {
+        rule.and_mask[i] = 0xff;
+        rule.or_mask[i] = 0x00;
+      }
+      rule.condition_mask = 0;
+      rule.direction = rule_directions::ANY;
+      if (num_data_bytes == kLearnDataBytes) {
+        cli();
+        learning_rules |= bitMask(num_rules);
+        sei();
+      }
+      return num_rules++;
+    }
+    
+    // Shared by injectForFrames() and injectForMillis().
+    static boolean startPulse(uint8 pulse_index, uint8 id, uint8 num_data_bytes, 
+        uint8 byte_index, uint8 bit_index, uint8 action, uint8 num_frames, 
+        uint32 duration_ticks) {
+      if (pulse_index >= kMaxPulses || !isValidByteIndex(num_data_bytes, byte_index) || 
+          bit_index > 7) {
+        return false;
+      }
+      const uint8 rule_index = findOrAddRule(id, num_data_bytes);
+      if (rule_index == kNoRule) {
+        return false;
+      }
+      
+      Pulse& pulse = pulses[pulse_index];
+      const uint8 pulse_mask = bitMask(pulse_index);
+      cli();
+      // End the previous pulse of this slot, if any.
+      if (active_pulses & pulse_mask) {
+        applyBitAction(pulse.rule_index, pulse.byte_index, pulse.bit_mask, 
+            injector_actions::COPY_BIT);
+      }
+      pulse.rule_index = rule_index;
+      pulse.byte_index = byte_index;
+      pulse.bit_mask = bitMask(bit_index);
+      pulse.frames_left = num_frames;
+      pulse.duration_ticks = duration_ticks;
+      pulse.is_started = false;
+      applyBitAction(rule_index, byte_index, pulse.bit_mask, action);
+      active_pulses |= pulse_mask;
+      collided_pulses &= ~pulse_mask;
+      sei();
+      return true;
+    }
+  }
+  
+  boolean setResponse(uint8 id, const uint8* data, uint8 num_data_bytes) {
+    if (num_data_bytes > kMaxRuleDataBytes || !LinFrame::isValidPid(id)) {
+      return false;
+    }
+    
+    // Find or add the slot of this id.
+    uint8 slot_index = 0;
+    while (slot_index < private_::num_response_slots && 
+        private_::response_slots[slot_index].id != id) {
+      slot_index++;
+    }
+    if (slot_index >= kMaxResponseSlots) {
+      return false;
+    }
+    private_::ResponseSlot& slot = private_::response_slots[slot_index];
+    if (slot_index == private_::num_response_slots) {
+      slot.id = id;
+      private_::num_response_slots++;
+    }
+    
+    // The ISR reads only the front buffer, so once it is done with the back 
+    // buffer it will not start using it before we swap.
+    private_::Response& back = slot.buffers[(slot.seq + 1) & 1];
+    if (private_::sending_response == &back) {
+      return false;
+    }
+    
+    // Enhanced checksum includes also the ID byte. 
+    uint16 sum = LinFrame::isEnhancedChecksum(id) ? id : 0;
+    for (uint8 i = 0; i < num_data_bytes; i++) {
+      back.bytes[i] = data[i];
+      sum += data[i];
+      if (sum & 0xff00) {
+        sum = (sum & 0xff) + 1;
+      }
+    }
+    back.bytes[num_data_bytes] = (uint8)(~sum);
+    back.num_bytes = num_data_bytes + 1;
+    
+    // Swap the buffers and make the slot visible to the ISR. Single byte 
+    // writes, atomic with respect to the ISR.
+    slot.seq++;
+    private_::id_to_response[LinFrame::idFromPid(id)] = slot_index + 1;
+    return true;
+  }
+  
+  boolean addReaction(uint8 trigger_id, uint8 trigger_byte_index, uint8 trigger_mask,
+      uint8 trigger_value, uint8 target_id, uint8 target_num_data_bytes, 
+      uint8 target_byte_index, uint8 target_bit_index, uint8 action) {
+    if (private_::num_reactions >= kMaxReactions || !LinFrame::isValidPid(trigger_id) ||
+        trigger_byte_index >= kMaxRuleDataBytes ||
+        !private_::isValidByteIndex(target_num_data_bytes, target_byte_index) || 
+        target_bit_index > 7) {
+      return false;
+    }
+    
+    // The rule is allocated here so the ISR never needs to.
+    const uint8 rule_index = private_::findOrAddRule(target_id, target_num_data_bytes);
+    if (rule_index == private_::kNoRule) {
+      return false;
+    }
+    
+    private_::Reaction& reaction = private_::reactions[private_::num_reactions];
+    reaction.trigger_id = trigger_id;
+    reaction.trigger_byte_index = trigger_byte_index;
+    reaction.trigger_mask = trigger_mask;
+    reaction.trigger_value = trigger_value;
+    reaction.rule_index = rule_index;
+    reaction.target_byte_index = target_byte_index;
+    reaction.target_bit_mask = bitMask(target_bit_index);
+    reaction.action = action;
+    
+    // Make it visible to the ISR only once complete.
+    private_::num_reactions++;
+    return true;
+  }
+  
+  boolean addCondition(uint8 id, uint8 num_data_bytes, uint8 trigger_byte_index,
+      uint8 trigger_mask, uint8 trigger_value, uint8 target_byte_index) {
+    if (private_::num_conditions >= kMaxConditions || 
+        !private_::isValidByteIndex(num_data_bytes, target_byte_index) || 
+        trigger_byte_index >= target_byte_index) {
+      return false;
+    }
+    
+    const uint8 rule_index = private_::findOrAddRule(id, num_data_bytes);
+    if (rule_index == private_::kNoRule) {
+      return false;
+    }
+    
+    const uint8 condition_index = private_::num_conditions++;
+    private_::Condition& condition = private_::conditions[condition_index];
+    condition.rule_index = rule_index;
+    condition.trigger_byte_index = trigger_byte_index;
+    condition.trigger_mask = trigger_mask;
+    condition.trigger_value = trigger_value & trigger_mask;
+    condition.target_byte_mask = bitMask(target_byte_index);
+    
+    // Make it visible to the ISR only once complete.
+    cli();
+    private_::rules[rule_index].condition_mask |= bitMask(condition_index);
+    sei();
+    return true;
+  }
+  
+  void clearConditions() {
+    cli();
+    for (uint8 i = 0; i < private_::num_rules; i++) {
+      private_::rules[i].condition_mask = 0;
+    }
+    sei();
+    private_::num_conditions = 0;
+  }
+  
+  boolean injectForFrames(uint8 pulse_index, uint8 id, uint8 num_data_bytes, 
+      uint8 byte_index, uint8 bit_index, uint8 action, uint8 num_frames) {
+    return private_::startPulse(pulse_index, id, num_data_bytes, byte_index, bit_index, 
+        action, num_frames, 0);
+  }
+  
+  boolean injectForMillis(uint8 pulse_index, uint8 id, uint8 num_data_bytes, 
+      uint8 byte_index, uint8 bit_index, uint8 action, uint16 millis) {
+    // At least one tick so this is not taken as a frame count pulse.
+    const uint32 duration_ticks = millis ? millis * hardware_clock::kTicksPerMilli : 1;
+    return private_::startPulse(pulse_index, id, num_data_bytes, byte_index, bit_index, 
+        action, 0, duration_ticks);
+  }
+  
+  void disableAllForIsr() {
+    private_::active_pulses = 0;
+    private_::num_reactions = 0;
+    for (uint8 i = 0; i < 64; i++) {
+      private_::id_to_rule[i] = 0;
+      private_::id_to_response[i] = 0;
+    }
+  }
+
+  void setButtonLocation(uint8 pulse_index, uint8 byte_index, uint8 bit_index) {
+    private_::button_bits[pulse_index].byte_index = byte_index;
+    private_::button_bits[pulse_index].bit_index = bit_index;
+  }
+
+  void cancelPulse(uint8 pulse_index) {
+    cli();
+    private_::active_pulses &= ~bitMask(pulse_index);
+    sei();
+  }
+  
+  boolean getAndClearPulseCollision(uint8 pulse_index) {
+    const uint8 pulse_mask = bitMask(pulse_index);
+    cli();
+    const boolean result = private_::collided_pulses & pulse_mask;
+    private_::collided_pulses &= ~pulse_mask;
+    sei();
+    return result;
+  }
+  
+  void clearReactions() {
+    private_::num_reactions = 0;
+  }
+  
+  void disableResponse(uint8 id) {
+    private_::id_to_response[LinFrame::idFromPid(id)] = 0;
+  }
+  
+  boolean setBitAction(uint8 id, uint8 num_data_bytes, uint8 byte_index, 
+      uint8 bit_index, uint8 action) {
+    if (!private_::isValidByteIndex(num_data_bytes, byte_index) || bit_index > 7) {
+      return false;
+    }
+    
+    const uint8 rule_index = private_::findOrAddRule(id, num_data_bytes);
+    if (rule_index == private_::kNoRule) {
+      return false;
+    }
+    
+    // Update the masks at once so the ISR never sees a partial update. 
+    // Reactions may update the same rule from the ISR.
+    cli();
+    private_::applyBitAction(rule_index, byte_index, bitMask(bit_index), action);
+    sei();
+    return true;
+  }
+  
+  void disableInjection(uint8 id) {
+    for (uint8 i = 0; i < private_::num_rules; i++) {
+      private_::Rule& rule = private_::rules[i];
+      if (rule.id == id) {
+        // Remove from the ISR view first.
+        private_::id_to_rule[LinFrame::idFromPid(id)] = 0;
+        for (uint8 j = 0; j < kMaxRuleDataBytes; j++) {
+          rule.and_mask[j] = 0xff;
+          rule.or_mask[j] = 0x00;
+        }
+        return;
+      }
+    }
+  }
+  
+  boolean setRuleDirection(uint8 id, uint8 direction) {
+    if (direction > rule_directions::FROM_SLAVE) {
+      return false;
+    }
+    for (uint8 i = 0; i < private_::num_rules; i++) {
+      private_::Rule& rule = private_::rules[i];
+      if (rule.id == id) {
+        // A single byte, read once per frame by the ISR.
+        rule.direction = direction;
+        return true;
+      }
+    }
+    return false;
+  }
+}  // namepsace custom_injector
+
@@ -1,168 +1,715 @@
-// Licensed under the Apache License, Version 2.0 (the "License");
-// you may not use this file except in compliance with the License.
-// You may obtain a copy of the License at
-//
-//    http://www.apache.org/licenses/LICENSE-2.0
-//
-// Unless required by applicable law or agreed to in writing, software
-// distributed under the License is distributed on an "AS IS" BASIS,
-// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
-// See the License for the specific language governing permissions and
-// limitations under the License.
-
-#ifndef CUSTOM_INJECTOR_H
-#define CUSTOM_INJECTOR_H
-
-#include "avr_util.h"
-#include "custom_defs.h"
-#include "lin_frame.h"
-#include "injector_actions.h"
-
-// Controls signals injected into linbus framed passed between the master and the
-// slave (set/reset selected data bits and adjust the checksum byte). 
-//
-// Like all the other custom_* files, this file should be adapted to the specific application. 
-// The example provided is for a Sport Mode button press injector for 981/Cayman.
-namespace custom_injector {
-  
-  // Private state of the injector. Do not use from other files.
-  namespace private_ {
-    // Target injection bits for 981CS Sport and PSE buttons
-    static const uint8 kTargetedFrameId = 0x8e;
-    static const uint8 kTargetedFrameDataBytes = 8;
-    static const uint8 kSportByteIndex = 1;
-    static const uint8 kSportBitIndex = 2;
-    static const uint8 kPSEByteIndex = 1;
-    static const uint8 kPSEBitIndex = 7;
-    static const uint8 kASSByteIndex = 3;
-    static const uint8 kASSBitIndex = 2;
-    
-    extern byte sport_inject_action;
-    extern byte PSE_inject_action;
-    extern byte ASS_inject_action;
-    
-    // True if the current linbus frame is transformed by the injector. Othrwise, the 
-    // frame is passed as is.
-    extern boolean frame_id_matches;
-    
-    // Used to calculate the modified frame checksum.
-    extern uint16 sum;
-    
-    // The modified frame checksum byte. 
-    extern uint8 checksum;
-  }
-  
-  // ====== These functions should be called from main thread only ================
-  
-  inline void disableSportInject(void) {
-    private_::sport_inject_action = injector_actions::COPY_BIT;
-  }
-
-  inline void disablePSEInject(void) {
-    private_::PSE_inject_action = injector_actions::COPY_BIT;
-  }
-
-  inline void disableASSInject(void) {
-    private_::ASS_inject_action = injector_actions::COPY_BIT;
-  }
-
-  inline void setSportInject(boolean on) {
-    private_::sport_inject_action = on ? injector_actions::FORCE_BIT_1 : injector_actions::FORCE_BIT_0;
-  }
-    
-  inline void setPSEInject(boolean on) {
-    private_::PSE_inject_action = on ? injector_actions::FORCE_BIT_1 : injector_actions::FORCE_BIT_0;
-  }
-
-  inline void setASSInject(boolean on) {
-    private_::ASS_inject_action = on ? injector_actions::FORCE_BIT_1 : injector_actions::FORCE_BIT_0;
-  }  
-
-  // ====== These function should be called from lib_processor ISR only =============
-
-  // Called when the id byte is recieved.
-  // Called from lin_processor's ISR.
-  inline void onIsrFrameIdRecieved(uint8 id) {
-    private_::frame_id_matches = false;
-
-    if (id == private_::kTargetedFrameId)
-      {
-      if (private_::sport_inject_action != injector_actions::COPY_BIT)
-         {
-         private_::frame_id_matches = true;
-         }
-      else if (private_::PSE_inject_action != injector_actions::COPY_BIT)
-         {
-         private_::frame_id_matches = true;
-         }
-      else if (private_::ASS_inject_action != injector_actions::COPY_BIT)
-         {
-         private_::frame_id_matches = true;
-         }   
-      }
-    // Linbus checksum V2 includes also the ID byte. 
-    private_::sum = custom_defs::kUseLinChecksumVersion2 ? id : 0;
-    private_::checksum = 0x00;
-  }
-
-  // Called when a data or checksum byte is sent (but not the sync or id bytes). 
-  // The injector uses it to compute the modified frame checksum.
-  // Called from lin_processor's ISR.
-  inline void onIsrByteSent(uint8 byte_index, uint8 b) {
-    // If this is not a frame we modify then do nothing.
-    if (!private_::frame_id_matches) {
-      return;
-    }
-    
-    // Collect the sum. Used later to compute the checksum byte.
-    private_::sum += b;
-    
-    // If we just recieved the last data byte, compute the modified frame checksum.
-    if (byte_index == (private_::kTargetedFrameDataBytes - 1)) {
-      // Keep adding the high and low bytes until no carry.
-      for (;;) {
-        const uint8 highByte = (uint8)(private_::sum >> 8);
-        if (!highByte) {
-          break;  
-        }
-        // NOTE: this can add additional carry.  
-        private_::sum = (private_::sum & 0xff) + highByte; 
-      }
-      private_::checksum = (uint8)(~private_::sum);
-    }
-  }
-
-  // Called before sending a data bit of the the data or checksum bytes to get the 
-  // transfer function for it.
-  // byte_index = 0 for first data byte, 1 for second data byte, ...
-  // bit_index = 0 for LSB, 7 for MSB.
-  // Called from lin_processor's ISR.
-  inline byte onIsrNextBitAction(uint8 byte_index, uint8 bit_index) {
-    if (!private_::frame_id_matches) {
-      return injector_actions::COPY_BIT;
-    }
-
-    // Handle a bit of one of the data bytes.
-    if (byte_index < private_::kTargetedFrameDataBytes) {
-      if ((byte_index == private_::kSportByteIndex) && (bit_index == private_::kSportBitIndex))
-         return private_::sport_inject_action;
-      else if ((byte_index == private_::kPSEByteIndex) && (bit_index == private_::kPSEBitIndex))
-         return private_::PSE_inject_action;
-      else if ((byte_index == private_::kASSByteIndex) && (bit_index == private_::kASSBitIndex))
-         return private_::ASS_inject_action;   
-      else 
-         return injector_actions::COPY_BIT;
-    }
-    
-    // Handle a checksum bit.
-    const boolean checksumBit = private_::checksum & bitMask(bit_index);
-    return checksumBit ? injector_actions::FORCE_BIT_1 : injector_actions::FORCE_BIT_0;
-    
-    // TODO: handle the unexpected case of more than 6 + 1 bytes in the frame. For
-    // now we will repeat the checksum byte blindly.
-  }  
-}  // namepsace custom_injector
-
-#endif
-
-
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CUSTOM_INJECTOR_H
+#define CUSTOM_INJECTOR_H
+
+#include "avr_util.h"
+#include "custom_defs.h"
+#include "hardware_clock.h"
+#include "lin_frame.h"
+#include "injector_actions.h"
+
+// Controls signals injected into linbus framed passed between the master and the
+// slave (set/reset selected data bits and adjust the checksum byte). Injected bits
+// are kept in a small table of per frame id rules.
+//
+// Like all the other custom_* files, this file should be adapted to the specific application. 
+// The example provided is for a Sport Mode button press injector for 981/Cayman.
+namespace custom_injector {
+  
+  // Max number of frame ids that can be injected at the same time.
+  static const uint8 kMaxRules = 4;
+  
+  // Max number of data bytes, excluding the checksum, of an injected frame.
+  static const uint8 kMaxRuleDataBytes = 8;
+  
+  // The num_data_bytes of a frame whose length is learned from the bus. The
+  // frame is passed as is until a valid frame with that id was seen.
+  static const uint8 kLearnDataBytes = 0;
+  
+  // Max number of frame ids whose slave response is sent by the injector.
+  static const uint8 kMaxResponseSlots = 2;
+  
+  // Max number of reactions evaluated by the ISR at the end of each frame.
+  static const uint8 kMaxReactions = 4;
+  
+  // Max number of same frame conditions evaluated by the ISR at the data
+  // byte boundaries. At most 8, they are tracked by bit masks.
+  static const uint8 kMaxConditions = 4;
+  
+  // Number of pulse slots. Each slot can run one bounded injection at a time.
+  static const uint8 kMaxPulses = 4;
+  
+  // The side that publishes the response of a frame a rule applies to. The
+  // master is on lin1, the slaves on lin2.
+  namespace rule_directions {
+    // Applies to the response of either side.
+    static const uint8 ANY = 0;
+    // Applies only to a response published by the master.
+    static const uint8 FROM_MASTER = 1;
+    // Applies only to a response published by a slave.
+    static const uint8 FROM_SLAVE = 2;
+  }
+  
+  // Private state of the injector. Do not use from other files.
+  namespace private_ {
+    // Target injection bits for 981CS Sport and PSE buttons. The defaults 
+    // of button_bits.
+    static const uint8 kTargetedFrameId = 0x8e;
+    static const uint8 kTargetedFrameDataBytes = 8;
+    // The button panel is a slave.
+    static const uint8 kTargetedFrameDirection = rule_directions::FROM_SLAVE;
+    static const uint8 kSportByteIndex = 1;
+    static const uint8 kSportBitIndex = 2;
+    static const uint8 kPSEByteIndex = 1;
+    static const uint8 kPSEBitIndex = 7;
+    static const uint8 kASSByteIndex = 3;
+    static const uint8 kASSBitIndex = 2;
+    
+    // Pulse slots of the button presses.
+    static const uint8 kSportPulse = 0;
+    static const uint8 kPSEPulse = 1;
+    static const uint8 kASSPulse = 2;
+    static const uint8 kNumButtons = 3;
+    
+    // The data byte and bit of a button in the targeted frame.
+    struct ButtonBit {
+      uint8 byte_index;
+      uint8 bit_index;
+    };
+    
+    // Indexed by the pulse slot of the button. Set by the vehicle profile,
+    // see setButtonLocation().
+    extern ButtonBit button_bits[kNumButtons];
+    
+    // Returned by rule lookups when there is no such rule.
+    static const uint8 kNoRule = 0xff;
+    
+    // An injection rule for a single frame id. Each output data byte is 
+    // (input & and_mask) | or_mask.
+    struct Rule {
+      // The protected id byte (with the parity bits) of the frame. 
+      uint8 id;
+      // Number of data bytes, excluding the checksum.
+      uint8 num_data_bytes;
+      uint8 and_mask[kMaxRuleDataBytes];
+      uint8 or_mask[kMaxRuleDataBytes];
+      // Bit i is set if conditions[i] gates a data byte of this rule.
+      uint8 condition_mask;
+      // One of rule_directions.
+      uint8 direction;
+    };
+    
+    extern Rule rules[kMaxRules];
+    
+    // Number of rules slots in use, each one bound to a frame id.
+    extern uint8 num_rules;
+    
+    // Bit i is set while rules[i] waits for its length to be learned. Its
+    // num_data_bytes is then zero so it forces no bits.
+    extern volatile uint8 learning_rules;
+    
+    // Indexed by the 6 bit frame id. One plus the index in rules of the rule
+    // that currently forces at least one bit of that frame, or zero if none.
+    // Zero based so the table is valid without an explicit initialization.
+    extern uint8 id_to_rule[64];
+    
+    // The rule of the current linbus frame or NULL if the frame is passed 
+    // as is.
+    extern const Rule* active_rule;
+    
+    // Used to calculate the modified frame checksum. Kept folded to 8 bits
+    // after each byte.
+    extern uint16 sum;
+    
+    // The modified frame checksum byte. 
+    extern uint8 checksum;
+    
+    // Same as sum and checksum but for the original frame, before injection.
+    extern uint16 raw_sum;
+    extern uint8 raw_checksum;
+    
+    // A complete slave response, data bytes followed by the checksum byte.
+    struct Response {
+      uint8 num_bytes;
+      uint8 bytes[kMaxRuleDataBytes + 1];
+    };
+    
+    // A double buffered response of a frame id. The ISR reads 
+    // buffers[seq & 1]. The main thread writes the other buffer and then 
+    // increments seq to swap them.
+    struct ResponseSlot {
+      // The protected id byte (with the parity bits) of the frame. 
+      uint8 id;
+      volatile uint8 seq;
+      Response buffers[2];
+    };
+    
+    extern ResponseSlot response_slots[kMaxResponseSlots];
+    
+    // Number of response slots in use, each one bound to a frame id.
+    extern uint8 num_response_slots;
+    
+    // Indexed by the 6 bit frame id. One plus the index in response_slots
+    // of the enabled response of that frame, or zero if none.
+    extern uint8 id_to_response[64];
+    
+    // The response buffer currently sent by the ISR or NULL if none.
+    extern const Response* volatile sending_response;
+    
+    // If data byte trigger_byte_index of a valid frame with id trigger_id 
+    // matches trigger_value under trigger_mask, set the action of the
+    // target bit of rules[rule_index].
+    struct Reaction {
+      uint8 trigger_id;
+      uint8 trigger_byte_index;
+      uint8 trigger_mask;
+      uint8 trigger_value;
+      uint8 rule_index;
+      uint8 target_byte_index;
+      uint8 target_bit_mask;
+      uint8 action;
+    };
+    
+    extern Reaction reactions[kMaxReactions];
+    
+    // Number of reactions in use. Incremented only after the new reaction 
+    // is filled in.
+    extern volatile uint8 num_reactions;
+    
+    // The forced bits of data byte target_byte_index of rules[rule_index]
+    // are applied only if the earlier data byte trigger_byte_index of the 
+    // same frame, as recieved, matches trigger_value under trigger_mask.
+    struct Condition {
+      uint8 rule_index;
+      uint8 trigger_byte_index;
+      uint8 trigger_mask;
+      uint8 trigger_value;
+      uint8 target_byte_mask;
+    };
+    
+    extern Condition conditions[kMaxConditions];
+    
+    // Number of conditions in use. Conditions are made visible to the ISR
+    // by the condition_mask of their rule.
+    extern uint8 num_conditions;
+    
+    // Bit i is set if a condition of data byte i of the current frame
+    // failed. Cleared at each frame header.
+    extern uint8 failed_bytes;
+    
+    // A bit action that the ISR sets back to COPY_BIT after a number of 
+    // frames or an amount of time.
+    struct Pulse {
+      uint8 rule_index;
+      uint8 byte_index;
+      uint8 bit_mask;
+      // Used when duration_ticks is zero. Number of frame headers left.
+      uint8 frames_left;
+      // Duration in hardware clock ticks, counted from the first frame header.
+      uint32 duration_ticks;
+      // Set by the ISR on the first frame header.
+      boolean is_started;
+      uint32 end_ticks;
+    };
+    
+    extern Pulse pulses[kMaxPulses];
+    
+    // Bit i is set while pulses[i] is active. 
+    extern volatile uint8 active_pulses;
+    
+    // Bit i is set if a bit injected by pulses[i] collided with another 
+    // node on the bus since the pulse started. 
+    extern volatile uint8 collided_pulses;
+    
+    // Make the rule visible to the ISR iff it forces any bit. Frames with 
+    // no forced bits are passed as is, including their original checksum.
+    inline void updateIdToRule(uint8 rule_index) {
+      const Rule& rule = rules[rule_index];
+      boolean has_forced_bits = false;
+      for (uint8 i = 0; i < rule.num_data_bytes; i++) {
+        if (rule.and_mask[i] != 0xff || rule.or_mask[i]) {
+          has_forced_bits = true;
+          break;
+        }
+      }
+      // Single byte write, atomic with respect to the ISR.
+      id_to_rule[LinFrame::idFromPid(rule.id)] = has_forced_bits ? rule_index + 1 : 0;
+    }
+    
+    // Set the action of the bits in mask of the given byte of a rule. 
+    // Called from ISR or from main with interrupts disabled.
+    inline void applyBitAction(uint8 rule_index, uint8 byte_index, uint8 mask, 
+        uint8 action) {
+      Rule& rule = rules[rule_index];
+      rule.and_mask[byte_index] |= mask;
+      rule.or_mask[byte_index] &= ~mask;
+      if (action == injector_actions::FORCE_BIT_1) {
+        rule.or_mask[byte_index] |= mask;
+      } else if (action == injector_actions::FORCE_BIT_0) {
+        rule.and_mask[byte_index] &= ~mask;
+      }
+      updateIdToRule(rule_index);
+    }
+    
+    // Count down the active pulses of the frame with the given id and end the 
+    // ones that are done. Called from ISR at each frame header.
+    inline void updatePulses(uint8 id) {
+      for (uint8 i = 0; i < kMaxPulses; i++) {
+        const uint8 pulse_mask = bitMask(i);
+        if (!(active_pulses & pulse_mask)) {
+          continue;
+        }
+        Pulse& pulse = pulses[i];
+        if (rules[pulse.rule_index].id != id) {
+          continue;
+        }
+        boolean is_done;
+        if (!pulse.duration_ticks) {
+          is_done = !pulse.frames_left;
+          pulse.frames_left--;
+        } else {
+          const uint32 now = hardware_clock::ticks32ForIsr();
+          if (!pulse.is_started) {
+            pulse.is_started = true;
+            pulse.end_ticks = now + pulse.duration_ticks;
+          }
+          is_done = (int32)(now - pulse.end_ticks) >= 0;
+        }
+        if (is_done) {
+          applyBitAction(pulse.rule_index, pulse.byte_index, pulse.bit_mask, 
+              injector_actions::COPY_BIT);
+          active_pulses &= ~pulse_mask;
+        }
+      }
+    }
+  }
+  
+  // Stop all the injection: bit actions, substituted responses, reactions 
+  // and pulses. The rules themselves are kept but no frame maps to them 
+  // anymore. For emergencies such as a main loop stall.
+  // CALL THIS FROM ISR ONLY (or with interrupts disabled).
+  extern void disableAllForIsr();
+
+  // ====== These functions should be called from main thread only ================
+  
+  // Set the action of a single data bit of the frame with given protected id
+  // and number of data bytes, 1 to kMaxRuleDataBytes or kLearnDataBytes. 
+  // The checksum byte follows the last data byte. Returns false if the rules
+  // table is full, the id has invalid parity bits, the indices are out of 
+  // range or the frame already has a rule with another length.
+  extern boolean setBitAction(uint8 id, uint8 num_data_bytes, uint8 byte_index, 
+      uint8 bit_index, uint8 action);
+  
+  // Set all the bits of the frame with given id to COPY_BIT.
+  extern void disableInjection(uint8 id);
+  
+  // Limit the rule of the frame with the given protected id to responses
+  // published by the given side, one of rule_directions. New rules apply to
+  // either side. Returns false if the frame has no rule or the direction is
+  // invalid.
+  extern boolean setRuleDirection(uint8 id, uint8 direction);
+  
+  // Have the injector send the response of the frame with the given protected
+  // id, instead of proxying the slave's response. The checksum is computed 
+  // here. Returns false if the slots table is full, the id has invalid parity
+  // bits, the data is too long or 
+  // the ISR is still sending the previous update (try again later).
+  extern boolean setResponse(uint8 id, const uint8* data, uint8 num_data_bytes);
+  
+  // Go back to proxying the response of the frame with the given id.
+  extern void disableResponse(uint8 id);
+  
+  // Add a reaction that is evaluated by the ISR at the end of each frame: 
+  // if data byte trigger_byte_index of a valid frame with the protected id
+  // trigger_id matches trigger_value under trigger_mask, the action of the
+  // given bit of the target frame is set, as with setBitAction(). This lets 
+  // the injection follow a signal from the very next frame, without a round 
+  // trip through the main loop. Returns false if the tables are full or the 
+  // indices are out of range.
+  extern boolean addReaction(uint8 trigger_id, uint8 trigger_byte_index, uint8 trigger_mask,
+      uint8 trigger_value, uint8 target_id, uint8 target_num_data_bytes, 
+      uint8 target_byte_index, uint8 target_bit_index, uint8 action);
+  
+  // Remove all the reactions. Actions already set by them are kept.
+  extern void clearReactions();
+  
+  // Make the forced bits of a data byte depend on an earlier data byte of the
+  // same frame: the bits of target_byte_index of the frame with the given
+  // protected id are forced only if data byte trigger_byte_index, as recieved,
+  // matches trigger_value under trigger_mask. Otherwise the byte is passed
+  // as is and the checksum follows. A byte with several conditions is 
+  // forced only if all of them match. The condition is checked by the ISR 
+  // when the trigger byte ends, before the target byte starts. Returns false
+  // if the tables are full, the id has invalid parity bits or the trigger
+  // byte is not before the target byte.
+  extern boolean addCondition(uint8 id, uint8 num_data_bytes, uint8 trigger_byte_index,
+      uint8 trigger_mask, uint8 trigger_value, uint8 target_byte_index);
+  
+  // Remove all the conditions. The forced bits apply again unconditionally.
+  extern void clearConditions();
+  
+  // Set the action of a single data bit, as with setBitAction(), for the next
+  // num_frames frames of that id. The ISR then sets the bit back to COPY_BIT. 
+  // Uses the given pulse slot, replacing its current pulse if any. Returns false 
+  // if the rules table is full or the indices are out of range.
+  extern boolean injectForFrames(uint8 pulse_index, uint8 id, uint8 num_data_bytes, 
+      uint8 byte_index, uint8 bit_index, uint8 action, uint8 num_frames);
+  
+  // Similar to injectForFrames() but for frames whose header starts within the 
+  // given time, counted from the first injected frame.
+  extern boolean injectForMillis(uint8 pulse_index, uint8 id, uint8 num_data_bytes, 
+      uint8 byte_index, uint8 bit_index, uint8 action, uint16 millis);
+      
+  // Move the button of the given pulse slot (kSportPulse, ...) to another
+  // bit of the targeted frame. Used by vehicle_profiles before any press.
+  extern void setButtonLocation(uint8 pulse_index, uint8 byte_index, uint8 bit_index);
+      
+  // Stop counting the pulse in the given slot. Its bit action is kept as is.
+  extern void cancelPulse(uint8 pulse_index);
+  
+  // True while the pulse in the given slot did not end yet.
+  inline boolean isPulseActive(uint8 pulse_index) {
+    return private_::active_pulses & bitMask(pulse_index);
+  }
+  
+  // Returns true if a bit injected by the pulse in the given slot was read 
+  // back from the bus with another level since the pulse started or since 
+  // the last call, and clears it. Requires custom_defs::kUseInjectionReadback.
+  extern boolean getAndClearPulseCollision(uint8 pulse_index);
+  
+  // Set the action of the button bit of the given pulse slot, see
+  // private_::button_bits.
+  inline void setButtonAction(uint8 pulse_index, uint8 action) {
+    const private_::ButtonBit& button = private_::button_bits[pulse_index];
+    setBitAction(private_::kTargetedFrameId, private_::kTargetedFrameDataBytes, 
+        button.byte_index, button.bit_index, action);
+    setRuleDirection(private_::kTargetedFrameId, private_::kTargetedFrameDirection);
+  }
+
+  inline void disableButtonInject(uint8 pulse_index) {
+    cancelPulse(pulse_index);
+    setButtonAction(pulse_index, injector_actions::COPY_BIT);
+  }
+
+  // Press the button of the given pulse slot for the given time.
+  inline void pressButtonFor(uint8 pulse_index, uint16 millis) {
+    const private_::ButtonBit& button = private_::button_bits[pulse_index];
+    injectForMillis(pulse_index, private_::kTargetedFrameId, 
+        private_::kTargetedFrameDataBytes, button.byte_index, button.bit_index, 
+        injector_actions::FORCE_BIT_1, millis);
+    setRuleDirection(private_::kTargetedFrameId, private_::kTargetedFrameDirection);
+  }
+  
+  inline void disableSportInject(void) {
+    disableButtonInject(private_::kSportPulse);
+  }
+
+  inline void disablePSEInject(void) {
+    disableButtonInject(private_::kPSEPulse);
+  }
+
+  inline void disableASSInject(void) {
+    disableButtonInject(private_::kASSPulse);
+  }
+  
+  // Press the button for the given time.
+  inline void pressSportFor(uint16 millis) {
+    pressButtonFor(private_::kSportPulse, millis);
+  }
+
+  inline void pressPSEFor(uint16 millis) {
+    pressButtonFor(private_::kPSEPulse, millis);
+  }
+
+  inline void pressASSFor(uint16 millis) {
+    pressButtonFor(private_::kASSPulse, millis);
+  }
+  
+  inline boolean isSportPressed() {
+    return isPulseActive(private_::kSportPulse);
+  }
+  
+  inline boolean isPSEPressed() {
+    return isPulseActive(private_::kPSEPulse);
+  }
+  
+  inline boolean isASSPressed() {
+    return isPulseActive(private_::kASSPulse);
+  }
+  
+  inline boolean getAndClearSportCollision() {
+    return getAndClearPulseCollision(private_::kSportPulse);
+  }
+  
+  inline boolean getAndClearPSECollision() {
+    return getAndClearPulseCollision(private_::kPSEPulse);
+  }
+  
+  inline boolean getAndClearASSCollision() {
+    return getAndClearPulseCollision(private_::kASSPulse);
+  }
+
+  inline void setSportInject(boolean on) {
+    setButtonAction(private_::kSportPulse, 
+        on ? injector_actions::FORCE_BIT_1 : injector_actions::FORCE_BIT_0);
+  }
+    
+  inline void setPSEInject(boolean on) {
+    setButtonAction(private_::kPSEPulse, 
+        on ? injector_actions::FORCE_BIT_1 : injector_actions::FORCE_BIT_0);
+  }
+
+  inline void setASSInject(boolean on) {
+    setButtonAction(private_::kASSPulse, 
+        on ? injector_actions::FORCE_BIT_1 : injector_actions::FORCE_BIT_0);
+  }  
+
+  // ====== These function should be called from lib_processor ISR only =============
+
+  // Called when the id byte is recieved.
+  // Called from lin_processor's ISR.
+  inline void onIsrFrameIdRecieved(uint8 id) {
+    // End pulses before the rule lookup, so this frame is already passed as is.
+    if (private_::active_pulses) {
+      private_::updatePulses(id);
+    }
+    
+    // O(1) lookup, regardless of the number of rules.
+    const uint8 rule_entry = private_::id_to_rule[LinFrame::idFromPid(id)];
+    private_::active_rule = NULL;
+    if (rule_entry) {
+      const private_::Rule* const rule = &private_::rules[rule_entry - 1];
+      // Reject ids with different parity bits.
+      if (rule->id == id) {
+        private_::active_rule = rule;
+      }
+    }
+    
+    // Enhanced checksum includes also the ID byte. 
+    private_::sum = LinFrame::isEnhancedChecksum(id) ? id : 0;
+    private_::checksum = 0x00;
+    private_::raw_sum = private_::sum;
+    private_::raw_checksum = 0x00;
+    private_::failed_bytes = 0;
+  }
+
+  // Called once per frame, when the first response byte starts, with the
+  // side that publishes the response. A rule for the other side is dropped,
+  // so the rest of the frame is passed as is without checking the direction
+  // again at each byte.
+  // Called from lin_processor's ISR.
+  inline void onIsrResponseDirection(boolean from_slave) {
+    const private_::Rule* const rule = private_::active_rule;
+    if (rule && rule->direction != rule_directions::ANY &&
+        (rule->direction == rule_directions::FROM_SLAVE) != from_slave) {
+      private_::active_rule = NULL;
+    }
+  }
+
+  // True if the injector may modify the current frame. Valid after 
+  // onIsrFrameIdRecieved() was called.
+  // Called from lin_processor's ISR.
+  inline boolean isFrameModifiedForIsr() {
+    return private_::active_rule != NULL;
+  }
+
+  // Called after the id byte is recieved. Returns the response the injector
+  // should send for this frame instead of the slave, or NULL to proxy the frame.
+  // Called from lin_processor's ISR.
+  inline const private_::Response* onIsrResponseToSend(uint8 id) {
+    const uint8 slot_entry = private_::id_to_response[LinFrame::idFromPid(id)];
+    if (!slot_entry) {
+      return NULL;
+    }
+    const private_::ResponseSlot& slot = private_::response_slots[slot_entry - 1];
+    if (slot.id != id) {
+      return NULL;
+    }
+    const private_::Response* const response = &slot.buffers[slot.seq & 1];
+    private_::sending_response = response;
+    return response;
+  }
+  
+  // Called when the ISR completed sending the response returned by 
+  // onIsrResponseToSend().
+  // Called from lin_processor's ISR.
+  inline void onIsrResponseSent() {
+    private_::sending_response = NULL;
+  }
+
+  // Called when a frame is complete, before it is passed to the main thread.
+  // Evaluates the reactions.
+  // Called from lin_processor's ISR.
+  inline void onIsrFrameEnd(const LinFrame& frame) {
+    const uint8 id = frame.get_byte(0);
+    // 0 = not checked yet, 1 = valid, 2 = invalid. Checked at most once, and
+    // only for trigger frames.
+    uint8 validity = 0;
+    
+    // Learn the length of the rules that wait for it from a valid frame. 
+    const uint8 learning = private_::learning_rules;
+    if (learning) {
+      for (uint8 i = 0; i < kMaxRules; i++) {
+        private_::Rule& rule = private_::rules[i];
+        if (!(learning & bitMask(i)) || rule.id != id) {
+          continue;
+        }
+        if (!validity) {
+          validity = frame.isValid() ? 1 : 2;
+        }
+        const uint8 num_data_bytes = frame.num_bytes() - 2;
+        if (validity == 1 && num_data_bytes && num_data_bytes <= kMaxRuleDataBytes) {
+          rule.num_data_bytes = num_data_bytes;
+          private_::learning_rules = learning & ~bitMask(i);
+          private_::updateIdToRule(i);
+        }
+        break;
+      }
+    }
+    
+    const uint8 n = private_::num_reactions;
+    for (uint8 i = 0; i < n; i++) {
+      const private_::Reaction& reaction = private_::reactions[i];
+      // The trigger byte and the checksum should be in the frame.
+      if (reaction.trigger_id != id || 
+          (uint8)(reaction.trigger_byte_index + 2) >= frame.num_bytes()) {
+        continue;
+      }
+      if (!validity) {
+        validity = frame.isValid() ? 1 : 2;
+      }
+      if (validity != 1) {
+        return;
+      }
+      if ((frame.get_byte(1 + reaction.trigger_byte_index) & reaction.trigger_mask) == 
+          reaction.trigger_value) {
+        private_::applyBitAction(reaction.rule_index, reaction.target_byte_index, 
+            reaction.target_bit_mask, reaction.action);
+      }
+    }
+  }
+
+  // Called after the last data bit of a data or checksum byte was sent (but not 
+  // the sync or id bytes), with the byte as sent and as recieved. The injector 
+  // uses it to compute the modified and the original frame checksums 
+  // incrementally, in constant time per byte.
+  // Called from lin_processor's ISR.
+  inline void onIsrByteSent(uint8 byte_index, uint8 b, uint8 raw_b) {
+    // If this is not a frame we modify then do nothing.
+    if (!private_::active_rule) {
+      return;
+    }
+    
+    // Collect the sum with an end around carry. Since sum is <= 0xff before
+    // the addition, a single fold brings it back to <= 0xff.
+    private_::sum += b;
+    if (private_::sum & 0xff00) {
+      private_::sum = (private_::sum & 0xff) + 1; 
+    }
+    private_::raw_sum += raw_b;
+    if (private_::raw_sum & 0xff00) {
+      private_::raw_sum = (private_::raw_sum & 0xff) + 1; 
+    }
+    
+    // Evaluate the conditions whose trigger is this byte. Most rules have
+    // none, so this costs a single test.
+    const uint8 condition_mask = private_::active_rule->condition_mask;
+    if (condition_mask) {
+      for (uint8 i = 0; i < kMaxConditions; i++) {
+        const private_::Condition& condition = private_::conditions[i];
+        if ((condition_mask & bitMask(i)) && condition.trigger_byte_index == byte_index &&
+            (raw_b & condition.trigger_mask) != condition.trigger_value) {
+          private_::failed_bytes |= condition.target_byte_mask;
+        }
+      }
+    }
+    
+    // If we just recieved the last data byte, compute the modified frame checksum.
+    if (byte_index == (private_::active_rule->num_data_bytes - 1)) {
+      private_::checksum = (uint8)(~private_::sum);
+      private_::raw_checksum = (uint8)(~private_::raw_sum);
+    }
+  }
+
+  // Called at the stop bit of a data or checksum byte with the injected bits
+  // of that byte that were read back from the bus with another level. Flags
+  // the active pulses of these bits.
+  // byte_index = 0 for first data byte, 1 for second data byte, ...
+  // Called from lin_processor's ISR.
+  inline void onIsrInjectionCollision(uint8 byte_index, uint8 collided_mask) {
+    const private_::Rule* const rule = private_::active_rule;
+    if (!rule) {
+      return;
+    }
+    for (uint8 i = 0; i < kMaxPulses; i++) {
+      const private_::Pulse& pulse = private_::pulses[i];
+      if ((private_::active_pulses & bitMask(i)) && 
+          &private_::rules[pulse.rule_index] == rule &&
+          pulse.byte_index == byte_index && (pulse.bit_mask & collided_mask)) {
+        private_::collided_pulses |= bitMask(i);
+      }
+    }
+  }
+
+  // Called at the start bit of a data or checksum byte to get the bits of that
+  // byte that should be forced to 1 and to 0. Bits that are in neither mask are 
+  // copied as is. Bits in the invert mask are inverted after that.
+  // byte_index = 0 for first data byte, 1 for second data byte, ...
+  // Mask bit 0 is the LSB, which is also the first bit sent.
+  // Called from lin_processor's ISR.
+  inline void onIsrByteStart(uint8 byte_index, uint8* force_1_mask, uint8* force_0_mask,
+      uint8* invert_mask) {
+    *invert_mask = 0;
+    const private_::Rule* const rule = private_::active_rule;
+    if (!rule) {
+      *force_1_mask = 0;
+      *force_0_mask = 0;
+      return;
+    }
+
+    // Handle one of the data bytes. Bytes whose condition failed are copied.
+    if (byte_index < rule->num_data_bytes) {
+      if (private_::failed_bytes & bitMask(byte_index)) {
+        *force_1_mask = 0;
+        *force_0_mask = 0;
+        return;
+      }
+      const uint8 or_mask = rule->or_mask[byte_index];
+      *force_1_mask = or_mask;
+      *force_0_mask = ~(rule->and_mask[byte_index] | or_mask);
+      return;
+    }
+    
+    // Bytes past the checksum byte are copied as is. The frame is then 
+    // longer than the rule and its checksum was already corrupted. 
+    if (byte_index > rule->num_data_bytes) {
+      *force_1_mask = 0;
+      *force_0_mask = 0;
+      return;
+    }
+    
+    // Handle the checksum byte. Rather than forcing the modified checksum, we
+    // copy the recieved checksum and invert the bits where the original and 
+    // modified checksums differ. If the recieved checksum is valid the output 
+    // is the modified checksum, otherwise it is off by the same bits, so frames 
+    // that were corrupted on the input side are not passed with a valid checksum.
+    *force_1_mask = 0;
+    *force_0_mask = 0;
+    *invert_mask = private_::checksum ^ private_::raw_checksum;
+  }  
+}  // namepsace custom_injector
+
+#endif
+
+
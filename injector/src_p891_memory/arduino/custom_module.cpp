@@ -10,34 +10,37 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-#include <avr/eeprom.h>
-
 #include "custom_module.h"
 
+#include "burst_capture.h"
 #include "custom_config.h"
+#include "custom_defs.h"
 #include "custom_injector.h"
 #include "custom_signals.h"
+#include "event_program.h"
 #include "io_pins.h"
+#include "latency_probe.h"
 #include "leds.h"
+#include "lin_processor.h"
+#include "main_loop_bench.h"
+#include "post_mortem.h"
+#include "settings.h"
 #include "signal_tracker.h"
 #include "sio.h"
+#include "sio_cmd.h"
+#include "task_scheduler.h"
+#include "trace.h"
+#include "vehicle_profiles.h"
 
 // Like all the other custom_* files, this file should be adapted to the specific application. 
 // The example provided is for a Sport/PSE button memory feature for 981 Boxster/Cayman 
 // (probably compatible with 991 models as well)
 namespace custom_module {
 
-// (0 and 1 are the 16-bit word for config enable/disable)
-uint8_t *EEPROM_SPORT_BYTE_ADDR = (uint8_t *) 2;
-uint8_t *EEPROM_PSE_BYTE_ADDR   = (uint8_t *) 3;
-uint8_t *EEPROM_ASS_BYTE_ADDR   = (uint8_t *) 4;
-  
 namespace states {
   static const uint8 WAIT_IGNITION = 0;
   static const uint8 POLL          = 1;
-  static const uint8 INJECT_SPORT  = 2;
-  static const uint8 INJECT_PSE    = 3;
-  static const uint8 INJECT_ASS    = 4;
+  static const uint8 INJECT        = 2;
 }
 
 // The current state. One of states:: values. 
@@ -45,16 +48,268 @@ static uint8 state;
 
 // Tracks since change to current state.
 static PassiveTimer time_in_state;
+
+// Latency from an injected button frame to the change of the LED of the 
+// button.
+struct InjectionProbe {
+  LatencyProbe latency;
+  // The LED state at the trigger. The response is its first change.
+  uint8 led_state_at_trigger;
+};
+
+// A button whose LED state is remembered in the settings and restored by 
+// injecting a press of the button. Adding a button requires only a new 
+// row in toggles[].
+struct RememberedToggle {
+  // The signals of the button, custom_signals::signal_ids.
+  uint8 led_signal_id;
+  uint8 switch_signal_id;
+  // A signal that inhibits the injection while on, or kNoSignal. 
+  uint8 inhibit_signal_id;
+  // The remembered setting, one of settings::ids.
+  uint8 setting_id;
+  // The injection of the button press, see custom_injector.
+  void (*press_for)(uint16 millis);
+  boolean (*is_pressed)();
+  boolean (*get_and_clear_collision)();
+  void (*disable)();
+  // The name for the serial output, in program memory.
+  const char* name;
+  InjectionProbe probe;
+};
+
+static const uint8 kNoSignal = 0xff;
+
+static const char kSportName[] PROGMEM = "Sport";
+static const char kPSEName[] PROGMEM = "PSE";
+static const char kASSName[] PROGMEM = "ASS";
+
+// Sport is inhibited while Sport Plus is on, so we don't cancel a user 
+// initiated transition from Sport to Sport Plus mode.
+static RememberedToggle toggles[] = {
+  { custom_signals::signal_ids::sport_LED, custom_signals::signal_ids::sport_switch, 
+    custom_signals::signal_ids::sport_plus_LED, settings::ids::SPORT_MODE, 
+    custom_injector::pressSportFor, custom_injector::isSportPressed, 
+    custom_injector::getAndClearSportCollision, 
+    custom_injector::disableSportInject, kSportName, { LatencyProbe(2000), 0 } },
+  { custom_signals::signal_ids::PSE_LED, custom_signals::signal_ids::PSE_switch, 
+    kNoSignal, settings::ids::PSE_MODE, 
+    custom_injector::pressPSEFor, custom_injector::isPSEPressed, 
+    custom_injector::getAndClearPSECollision, 
+    custom_injector::disablePSEInject, kPSEName, { LatencyProbe(2000), 0 } },
+  { custom_signals::signal_ids::autostart_LED, custom_signals::signal_ids::autostart_switch, 
+    kNoSignal, settings::ids::ASS_MODE, 
+    custom_injector::pressASSFor, custom_injector::isASSPressed, 
+    custom_injector::getAndClearASSCollision, 
+    custom_injector::disableASSInject, kASSName, { LatencyProbe(2000), 0 } },
+};
+
+static const uint8 kNumToggles = ARRAY_SIZE(toggles);
+
+// The bit masks below have a bit per toggle.
+typedef char toggles_fit_in_mask[(kNumToggles <= 8) ? 1 : -1];
+
+static inline const __FlashStringHelper* toggleName(uint8 toggle_index) {
+  return reinterpret_cast<const __FlashStringHelper*>(toggles[toggle_index].name);
+}
+
+// The toggle whose press is injected in the INJECT state.
+static uint8 injected_toggle;
+
+// A press whose injected bits collided on the bus is restarted at once, up
+// to this number of times.
+static const uint8 kMaxInjectRetries = 2;
+
+// Number of restarts of the current press.
+static uint8 inject_retries;
+
+// Bit i is set if the POLL state needs to compare the LED of toggle i with
+// its setting. Set when entering the state and by the signal events of 
+// the toggle, cleared once they match.
+static uint8 poll_pending;
   
+// Called with each injected button frame.
+static void triggerProbe(uint8 toggle_index, const LinFrame& frame, 
+    const custom_signals::SignalSnapshot& snapshot) {
+  InjectionProbe* const probe = &toggles[toggle_index].probe;
+  if (!probe->latency.isArmed()) {
+    probe->led_state_at_trigger = snapshot.state(toggles[toggle_index].led_signal_id);
+  }
+  probe->latency.trigger(frame.end_ticks());
+}
+
+// Called with each LED frame, after its signals were tracked.
+static void respondProbe(uint8 toggle_index, const LinFrame& frame, 
+    const custom_signals::SignalSnapshot& snapshot) {
+  InjectionProbe* const probe = &toggles[toggle_index].probe;
+  if (!probe->latency.isArmed() || 
+      snapshot.state(toggles[toggle_index].led_signal_id) == probe->led_state_at_trigger) {
+    return;
+  }
+  // The stats line is printed only if it fits whole in the serial output.
+  if (probe->latency.respond(frame.end_ticks()) && sio::beginRecord(64)) {
+    probe->latency.print(toggleName(toggle_index));
+  }
+}
+
+// Mark the toggles that use the given signal for polling.
+static void signalChanged(uint8 signal_id) {
+  for (uint8 i = 0; i < kNumToggles; i++) {
+    const RememberedToggle& toggle = toggles[i];
+    if (signal_id == toggle.led_signal_id || signal_id == toggle.switch_signal_id 
+        || signal_id == toggle.inhibit_signal_id) {
+      poll_pending |= bitMask(i);
+    }
+  }
+}
+
 static inline void changeToState(uint8 new_state) {
   state = new_state;
   // We assume this is a new state and always reset the time in state.
   time_in_state.restart();
+  poll_pending = 0xff;
+}
+
+// Serial commands of the injector, in addition to the common ones:
+//   b <pid> <num data bytes> <byte index> <bit index> <action> - set the
+//       injector action of a bit, see injector_actions.
+//   x <pid>             - copy all the bits of the frame.
+//   w <pid> <direction> - limit the rule of the frame to responses of
+//                         0 (any), 1 (the master) or 2 (a slave).
+//   p <button> <millis> - press button 0 (Sport), 1 (PSE) or 2 (ASS).
+//   m                   - print the signal metrics.
+//   l                   - print the main loop latency stats.
+//   r                   - print the post mortem records.
+//   v <profile>         - set the vehicle profile of the next boots, 0 (981),
+//                         1 (991) or 255 (auto detect).
+//   k <0|1>             - print the break timing, and clear it if 1.
+//   y <offset> <byte>.. - write up to 5 bytes of a new event program.
+//   z <length>          - start and persist the new event program, or
+//                         clear it if 0. See event_program.h.
+//   c <0|1|2>           - print the burst capture, clear it and arm a new
+//                         one, or trigger it now. See burst_capture.h.
+//   n                   - print the main loop benchmark, see 
+//                         main_loop_bench.h.
+//   t                   - stop and print the ISR trace, see 
+//                         custom_defs::kIsrTracePolicy.
+static boolean executeCommand(const sio_cmd::Command& command) {
+  const uint16* const args = command.args;
+  switch (command.name) {
+    case 'b':
+      return command.num_args == 5 && args[0] <= 0xff && args[1] <= 8 
+          && args[2] <= 8 && args[3] <= 7 && args[4] <= injector_actions::FORCE_BIT_0 
+          && custom_injector::setBitAction(args[0], args[1], args[2], args[3], args[4]);
+    case 'x':
+      if (command.num_args != 1 || args[0] > 0xff) {
+        return false;
+      }
+      custom_injector::disableInjection(args[0]);
+      return true;
+    case 'w':
+      return command.num_args == 2 && args[0] <= 0xff && args[1] <= 0xff
+          && custom_injector::setRuleDirection(args[0], args[1]);
+    case 'p':
+      if (command.num_args != 2) {
+        return false;
+      }
+      if (args[0] >= kNumToggles) {
+        return false;
+      }
+      toggles[args[0]].press_for(args[1]);
+      return true;
+    case 'm':
+      if (!custom_defs::kTrackSignalMetrics) {
+        return false;
+      }
+      custom_signals::requestMetricsDump();
+      return true;
+    case 'l':
+      if (!custom_defs::kTrackLoopLatency) {
+        return false;
+      }
+      task_scheduler::requestStatsDump();
+      return true;
+    case 'r':
+      post_mortem::requestDump();
+      return true;
+    case 'v':
+      return command.num_args == 1 && args[0] <= 0xff 
+          && vehicle_profiles::select(args[0]);
+    case 'k': {
+      if (command.num_args != 1) {
+        return false;
+      }
+      lin_processor::BreakTiming timing;
+      lin_processor::getBreakTiming(&timing, args[0]);
+      lin_processor::printBreakTiming(timing);
+      return true;
+    }
+    case 'y': {
+      if (command.num_args < 2 || args[0] > 0xff) {
+        return false;
+      }
+      uint8 bytes[sio_cmd::kMaxArgs - 1];
+      for (uint8 i = 1; i < command.num_args; i++) {
+        if (args[i] > 0xff) {
+          return false;
+        }
+        bytes[i - 1] = args[i];
+      }
+      return event_program::writeBytes(args[0], bytes, command.num_args - 1);
+    }
+    case 'z':
+      return command.num_args == 1 && args[0] <= 0xff && event_program::commit(args[0]);
+    case 'c':
+      if (!custom_defs::kUseBurstCapture || command.num_args != 1) {
+        return false;
+      }
+      if (args[0] == 0) {
+        burst_capture::requestDump();
+        return true;
+      }
+      if (args[0] == 1) {
+        return burst_capture::clear();
+      }
+      if (args[0] == 2) {
+        burst_capture::trigger(0);
+        return true;
+      }
+      return false;
+    case 'n':
+      return main_loop_bench::requestRun();
+    case 't':
+      return lin_processor::stopIsrTrace();
+  }
+  return false;
 }
 
 void setup() {
+  sio_cmd::setup(executeCommand);
+  settings::setup();
+
+  // Only the frames of the ids we track are queued, per the config block
+  // (by default 0x0d and 0x8e). Other frames are still proxied.
+  const settings::ConfigBlock& config = settings::config();
+  lin_processor::acceptAllIds(false);
+  for (uint8 id = 0; id < 64; id++) {
+    if (config.accepted_ids[id >> 3] & bitMask(id & 0x07)) {
+      lin_processor::acceptId(id, true);
+    }
+  }
+
+  // The signal and button locations of the vehicle.
+  vehicle_profiles::setup();
+
+  // The configured injection rules.
+  for (uint8 i = 0; i < config.num_rules; i++) {
+    const settings::ConfigRule& rule = config.rules[i];
+    custom_injector::setBitAction(rule.id, rule.num_data_bytes, rule.byte_index, 
+        rule.bit_index, rule.action);
+  }
+
   custom_signals::setup();
   custom_config::setup();
+  event_program::setup();
   changeToState(states::WAIT_IGNITION);
 }
   
@@ -65,12 +320,12 @@ static inline void updateState()
    //
    // - Inhibit further processing if memory function disabled or ignition off
    //
-   // - If Sport LED state disagrees with EEPROM, see if the physical button is down.  If so, update the EEPROM
-   //   to store the user's new setting.  Otherwise, if Sport Plus isn't enabled, inject a Sport button press
-   //   for 500 ms.  (We don't want to cancel a user-initiated transition from Sport to Sport Plus mode.)
+   // - If the LED state of a remembered toggle disagrees with EEPROM, see if the physical button is down.  
+   //   If so, update the EEPROM to store the user's new setting.  Otherwise, unless the toggle's inhibit 
+   //   signal is on, inject a button press for 500 ms.  (For Sport, we don't want to cancel a user-initiated
+   //   transition from Sport to Sport Plus mode.)
    //
-   // - If PSE LED state disagrees with EEPROM, see if the physical button is down.  If so, update the EEPROM
-   //   to store the user's new setting.  Otherwise, inject a PSE button press for 500 ms
+   // - The press durations are timed by the injector's ISR, from the first injected frame
    //
    // - A button is considered to be pressed by the user if it is either down ("on") when polled, or has 
    //   been off for less than 250 milliseconds.  This lag keeps us from reverting quick button presses that
@@ -86,9 +341,10 @@ static inline void updateState()
       {
       case states::WAIT_IGNITION:
          {
-         custom_injector::disableSportInject();
-         custom_injector::disablePSEInject();
-         custom_injector::disableASSInject();
+         for (uint8 i = 0; i < kNumToggles; i++)
+            {
+            toggles[i].disable();
+            }
 
          if (custom_config::is_enabled() && custom_signals::ignition_state().isOnForAtLeastMillis(1000))
             {
@@ -100,106 +356,88 @@ static inline void updateState()
 
       case states::POLL:
          {
-         boolean sport_plus_active = custom_signals::sport_plus_LED().isOn();
-         boolean sport_remembered  = eeprom_read_byte(EEPROM_SPORT_BYTE_ADDR);
-         boolean sport_active      = custom_signals::sport_LED().isOn();
-         boolean sport_button_down = custom_signals::sport_switch().isOn() || (custom_signals::sport_switch().timeInStateMillis() < 250);
-
-         if (sport_active != sport_remembered)
+         // Nothing changed since the LEDs matched the EEPROM.
+         if (!poll_pending)
             {
-            if (sport_button_down)
-               {
-               eeprom_write_byte(EEPROM_SPORT_BYTE_ADDR, sport_active);
-               }
-            else
-               {
-               if (!sport_plus_active)
-                  {
-                  sio::printf(F("Sport inject\n"));
-                  custom_injector::setSportInject(true);
-                  changeToState(states::INJECT_SPORT);
-                  break;
-                  }
-               }
+            break;
             }
 
-         boolean PSE_remembered  = eeprom_read_byte(EEPROM_PSE_BYTE_ADDR);
-         boolean PSE_active      = custom_signals::PSE_LED().isOn();
-         boolean PSE_button_down = custom_signals::PSE_switch().isOn() || (custom_signals::PSE_switch().timeInStateMillis() < 250); 
+         // Read all the LEDs at once, consistent with each other.
+         custom_signals::SignalSnapshot snapshot;
+         custom_signals::readSnapshot(&snapshot);
 
-         if (PSE_active != PSE_remembered)
+         for (uint8 i = 0; i < kNumToggles; i++)
             {
-            if (PSE_button_down)
+            if (!(poll_pending & bitMask(i)))
                {
-               eeprom_write_byte(EEPROM_PSE_BYTE_ADDR, PSE_active);
+               continue;
                }
-            else
+
+            const RememberedToggle& toggle = toggles[i];
+            const boolean remembered = settings::get(toggle.setting_id);
+            const boolean active = snapshot.isOn(toggle.led_signal_id);
+            if (active == remembered)
                {
-               sio::printf(F("PSE inject\n"));
-               custom_injector::setPSEInject(true);
-               changeToState(states::INJECT_PSE);
-               break;
+               poll_pending &= ~bitMask(i);
+               continue;
                }
-            }
-
-         boolean ASS_remembered  = eeprom_read_byte(EEPROM_ASS_BYTE_ADDR);
-         boolean ASS_active      = custom_signals::autostart_LED().isOn();
-         boolean ASS_button_down = custom_signals::autostart_switch().isOn() || (custom_signals::autostart_switch().timeInStateMillis() < 250); 
 
-         if (ASS_active != ASS_remembered)
-            {
-            if (ASS_button_down)
+            const CompactSignalTracker& button = custom_signals::tracker(toggle.switch_signal_id);
+            if (button.isOn() || (button.timeInStateMillis() < 250))
                {
-               eeprom_write_byte(EEPROM_ASS_BYTE_ADDR, ASS_active);
+               settings::set(toggle.setting_id, active);
+               poll_pending &= ~bitMask(i);
+               continue;
                }
-            else
+
+            // While a mismatch waits for the button lag or the inhibit 
+            // signal, the toggle stays pending and is polled again.
+            if (toggle.inhibit_signal_id != kNoSignal && snapshot.isOn(toggle.inhibit_signal_id))
                {
-               sio::printf(F("ASS inject\n"));
-               custom_injector::setASSInject(true);
-               changeToState(states::INJECT_ASS);
-               break;
+               continue;
                }
-            }
-
-         break;
-         }
 
-      case states::INJECT_SPORT:
-         {
-         uint32 btime = time_in_state.timeMillis();
-
-         if (btime > 500)
-            {
-            sio::printf(F("Sport release after %d ms\n"), btime);
-            custom_injector::disableSportInject();
-            changeToState(states::POLL);
+            sio::out << toggleName(i) << F(" inject\n");
+            toggle.press_for(500);
+            injected_toggle = i;
+            inject_retries = 0;
+            changeToState(states::INJECT);
+            break;
             }
 
          break;
          }
 
-      case states::INJECT_PSE:
+      case states::INJECT:
          {
-         uint32 btime = time_in_state.timeMillis();
+         const RememberedToggle& toggle = toggles[injected_toggle];
 
-         if (btime > 500)
+         // Another node drove the bus during an injected bit, so the press 
+         // may not have been seen. Restart it rather than pressing blindly 
+         // for the rest of the 500 ms.
+         if (toggle.get_and_clear_collision())
             {
-            sio::printf(F("PSE release after %d ms\n"), btime);
-            custom_injector::disablePSEInject();
+            toggle.disable();
+            if (inject_retries < kMaxInjectRetries)
+               {
+               inject_retries++;
+               sio::out << toggleName(injected_toggle) << F(" collision, retry ") 
+                     << inject_retries << '\n';
+               toggle.press_for(500);
+               break;
+               }
+            sio::out << toggleName(injected_toggle) << F(" collision, give up\n");
             changeToState(states::POLL);
+            // Polled again on the next change of its signals.
+            poll_pending &= ~bitMask(injected_toggle);
+            break;
             }
 
-         break;
-         }
-
-      case states::INJECT_ASS:
-         {
-         uint32 btime = time_in_state.timeMillis();
-
-         if (btime > 500)
+         // The injector releases the button on its own after 500 ms.
+         if (!toggle.is_pressed())
             {
-            sio::printf(F("ASS release after %d ms\n"), btime);
-            custom_injector::disableASSInject();
+            sio::out << toggleName(injected_toggle) << F(" release after ") 
+                  << time_in_state.timeMillis() << F(" ms\n");
             changeToState(states::POLL);
             }
 
@@ -208,15 +446,48 @@ static inline void updateState()
 
       default:
          {
-         sio::printf(F("BS: unknown state (%d)"), state);
+         sio::out << F("BS: unknown state (") << state << ')';
          changeToState(states::WAIT_IGNITION);
          break;
          }
       }
 }
  
+// The panel signals of the diagnostic mode, in the order of the printed
+// fields. Bit i of the PANEL_STATE trace argument is signal i.
+static const uint8 kPanelSignalIds[] = {
+   custom_signals::signal_ids::autostart_switch,
+   custom_signals::signal_ids::autostart_LED,
+   custom_signals::signal_ids::PASM_switch,
+   custom_signals::signal_ids::PASM_LED,
+   custom_signals::signal_ids::PSE_switch,
+   custom_signals::signal_ids::PSE_LED,
+   custom_signals::signal_ids::PSM_switch,
+   custom_signals::signal_ids::PSM_LED,
+   custom_signals::signal_ids::roof_close_switch,
+   custom_signals::signal_ids::roof_open_switch,
+   custom_signals::signal_ids::spoiler_switch,
+   custom_signals::signal_ids::spoiler_LED,
+   custom_signals::signal_ids::sport_switch,
+   custom_signals::signal_ids::sport_LED,
+   custom_signals::signal_ids::sport_plus_switch,
+   custom_signals::signal_ids::sport_plus_LED,
+};
+
 static inline void showPanelState()
 {
+   if (custom_defs::kUseTraceOutput) {
+      custom_signals::SignalSnapshot snapshot;
+      custom_signals::readSnapshot(&snapshot);
+      uint16 bits = 0;
+      for (uint8 i = 0; i < ARRAY_SIZE(kPanelSignalIds); i++) {
+         if (snapshot.isOn(kPanelSignalIds[i])) {
+            bits |= (uint16)1 << i;
+         }
+      }
+      trace::send(trace::tokens::PANEL_STATE, bits);
+      return;
+   }
    sio::printf(F("AS=%d/%d PASM=%d/%d PSE=%d/%d PSM=%d/%d RC=%d RO=%d Spoil=%d/%d S=%d/%d SP=%d/%d\n"),
       custom_signals::autostart_switch().isOn(),
       custom_signals::autostart_LED().isOn(),
@@ -238,29 +509,74 @@ static inline void showPanelState()
 
 void loop() {
   // Update dependents.
+  sio_cmd::loop();
+  settings::loop();
+  vehicle_profiles::loop();
   custom_signals::loop();
   custom_config::loop();
+  event_program::loop();
+
+  // Any signal change may need an action in the POLL state or advance a
+  // config gesture.
+  custom_signals::SignalEvent event;
+  while (custom_signals::readNextEvent(&event)) {
+    signalChanged(event.signal_id);
+    custom_config::signalEvent(event);
+    event_program::signalEvent(event);
+  }
+  if (custom_signals::getAndClearEventsDropped()) {
+    poll_pending = 0xff;
+    custom_config::signalEventsDropped();
+  }
   
 #if 1
    // Update the state machine
    updateState();
 #else
-   // Diagnostic mode: print button and LED states
-   showPanelState();
+   // Diagnostic mode: print button and LED states, when the serial output 
+   // has room for a whole line.
+   if (sio::beginRecord(custom_defs::kUseTraceOutput ? trace::kMaxPrintedBytes : 80))
+      {
+      showPanelState();
+      }
 #endif
 
-   sio::waitUntilFlushed();
+   // The messages are sent by sio::loop(), a few bytes per main loop 
+   // iteration, so printing never waits for the serial output and the 
+   // frames are consumed at the loop rate.
 }
 
-void frameArrived(const LinFrame& frame) {
+void frameArrived(const LinFrame& frame, const lin_processor::InjectionAudit* audit) {
+  // The signal locations are known once the vehicle profile is resolved.
+  vehicle_profiles::frameArrived(frame);
+  if (!vehicle_profiles::isResolved()) {
+    return;
+  }
+
   // Track the signals in this frame.
-  custom_signals::frameArrived(frame);
+  custom_signals::frameArrived(frame, audit);
+
+  // Measure the latency of the injected presses, using the frame times.
+  const uint8 id = frame.get_byte(0);
+  if (id == 0x8e && frame.hasInjectedBits()) {
+    custom_signals::SignalSnapshot snapshot;
+    custom_signals::readSnapshot(&snapshot);
+    if (state == states::INJECT) {
+      triggerProbe(injected_toggle, frame, snapshot);
+    }
+  } else if (id == 0x0d) {
+    custom_signals::SignalSnapshot snapshot;
+    custom_signals::readSnapshot(&snapshot);
+    for (uint8 i = 0; i < kNumToggles; i++) {
+      respondProbe(i, frame, snapshot);
+    }
+  }
   
   // Report an error if the Sport Mode assembly does not respond as expected
   // to its frame.
   if (frame.get_byte(0) == 0x8e) {
     if (frame.num_bytes() != (1 + 8 + 1)) {
-      leds::errors.action();
+      leds::action(leds::ids::ERRORS);
       sio::println(F("slave error")); 
     }
   }
@@ -15,6 +15,7 @@
 
 #include "avr_util.h"
 #include "lin_frame.h"
+#include "lin_processor.h"
 
 // Implement the application specific functionality.
 //
@@ -27,8 +28,10 @@ namespace custom_module {
   // Called once on each iteration of the Arduino main loop().
   extern void loop();
 
-  // Called once when a new valid frame was recieved.
-  extern void frameArrived(const LinFrame& frame);
+  // Called once when a new valid frame was recieved, with the injection 
+  // audit record of the frame, or NULL if it has none.
+  extern void frameArrived(const LinFrame& frame, 
+      const lin_processor::InjectionAudit* audit);
   
 }  // namespace custom_module
 
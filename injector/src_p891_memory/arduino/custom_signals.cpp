@@ -12,123 +12,455 @@
 
 #include "custom_signals.h"
 
-#include "signal_tracker.h"
+#include "compact_signal_tracker.h"
+#include "custom_defs.h"
+#include "sio.h"
+#include "system_clock.h"
+#include "timer_wheel.h"
 
 // Like all the other custom_* files, this file should be adapted to the specific application. 
 // The example provided is for a Sport/PSE button memory feature for 981/Cayman.
 namespace custom_signals {
 
+// Tracker parameters, indexed by signal id. In program memory.
+static const SignalTrackerParams kTrackerParams[signal_ids::kNumSignals] PROGMEM = {
+#define CUSTOM_SIGNALS_PARAMS(name, byte_index, bit_index, count, pending_ttl, supporting_ttl) \
+  { count, pending_ttl, supporting_ttl },
+#define CUSTOM_SIGNALS_PARAMS_FRAME(id, num_data_bytes, signals) \
+  signals(CUSTOM_SIGNALS_PARAMS)
+  CUSTOM_SIGNALS_FRAMES(CUSTOM_SIGNALS_PARAMS_FRAME)
+#undef CUSTOM_SIGNALS_PARAMS_FRAME
+#undef CUSTOM_SIGNALS_PARAMS
+};
+
 // Variables used in .h file.
 namespace private_ {
-  SignalTracker ignition_on_signal_tracker(3, 1000, 2000);
-  // NOTE: we require only a single button report to change state. This prevents
-  // missing clicks when clicking fast.
-  SignalTracker button_signal_tracker(1, 1000, 2000);
-
-  //
-  // 981 buttons and LEDs
-  //
-
-  SignalTracker autostart_switch    (1, 1000, 2000); 
-  SignalTracker autostart_LED       (1, 1000, 2000); 
-                                    
-  SignalTracker PASM_switch         (1, 1000, 2000); 
-  SignalTracker PASM_LED            (1, 1000, 2000); 
-                                    
-  SignalTracker PSE_switch          (1, 1000, 2000);
-  SignalTracker PSE_LED             (1, 1000, 2000);
-                                    
-  SignalTracker PSM_switch          (1, 1000, 2000); 
-  SignalTracker PSM_LED             (1, 1000, 2000); 
-
-  SignalTracker roof_close_switch   (1, 1000, 2000); 
-  SignalTracker roof_open_switch    (1, 1000, 2000); 
-
-  SignalTracker spoiler_switch      (1, 1000, 2000); 
-  SignalTracker spoiler_LED         (1, 1000, 2000); 
-                                    
-  SignalTracker sport_switch        (1, 1000, 2000);
-  SignalTracker sport_LED           (1, 1000, 2000);
-                                    
-  SignalTracker sport_plus_switch   (1, 1000, 2000); 
-  SignalTracker sport_plus_LED      (1, 1000, 2000); 
+#define CUSTOM_SIGNALS_DEFINE(name, byte_index, bit_index, count, pending_ttl, supporting_ttl) \
+  CompactSignalTracker(&kTrackerParams[signal_ids::name]),
+#define CUSTOM_SIGNALS_DEFINE_FRAME(id, num_data_bytes, signals) \
+  signals(CUSTOM_SIGNALS_DEFINE)
+  CompactSignalTracker trackers[signal_ids::kNumSignals] = {
+    CUSTOM_SIGNALS_FRAMES(CUSTOM_SIGNALS_DEFINE_FRAME)
+  };
+#undef CUSTOM_SIGNALS_DEFINE_FRAME
+#undef CUSTOM_SIGNALS_DEFINE
+}
+
+// Location of a signal bit in its frame.
+struct SignalBit {
+  uint8 byte_index;
+  uint8 mask;
+};
+
+// Indexed by signal id. In RAM, the locations of custom_signals.h with the
+// overrides of the vehicle profile, see setSignalLocation().
+static SignalBit signal_bits[signal_ids::kNumSignals] = {
+#define CUSTOM_SIGNALS_BIT(name, byte_index, bit_index, count, pending_ttl, supporting_ttl) \
+  { byte_index, H(bit_index) },
+#define CUSTOM_SIGNALS_BIT_FRAME(id, num_data_bytes, signals) \
+  signals(CUSTOM_SIGNALS_BIT)
+  CUSTOM_SIGNALS_FRAMES(CUSTOM_SIGNALS_BIT_FRAME)
+#undef CUSTOM_SIGNALS_BIT_FRAME
+#undef CUSTOM_SIGNALS_BIT
+};
+
+// Frame indices, for the per frame state below.
+namespace frame_indices {
+#define CUSTOM_SIGNALS_INDEX_FRAME(id, num_data_bytes, signals) \
+  signals##_index,
+  enum {
+    CUSTOM_SIGNALS_FRAMES(CUSTOM_SIGNALS_INDEX_FRAME)
+    kNumFrames
+  };
+#undef CUSTOM_SIGNALS_INDEX_FRAME
+}
+
+// The data bytes of the last frame of each frame id, see 
+// custom_defs::kSkipUnchangedSignalFrames. 
+static const uint8 kMaxDataBytes = LinFrame::kMaxBytes - 2;
+struct LastPayload {
+  uint8 data[kMaxDataBytes];
+  // True if the last frame was decoded with no skipped bits and each of its 
+  // signals supported the tracker state. A repeat of it is then a 
+  // supporting report of each of the signals.
+  boolean is_settled;
+};
+static LastPayload last_payloads[frame_indices::kNumFrames];
+
+#define CUSTOM_SIGNALS_ASSERT_FRAME(id, num_data_bytes, signals) \
+  typedef char signals##_fits_payload[(num_data_bytes <= kMaxDataBytes) ? 1 : -1];
+CUSTOM_SIGNALS_FRAMES(CUSTOM_SIGNALS_ASSERT_FRAME)
+#undef CUSTOM_SIGNALS_ASSERT_FRAME
+
+// Signal names, for the metrics dump. In program memory.
+#define CUSTOM_SIGNALS_NAME(name, byte_index, bit_index, count, pending_ttl, supporting_ttl) \
+  static const char kName_##name[] PROGMEM = #name;
+#define CUSTOM_SIGNALS_NAME_FRAME(id, num_data_bytes, signals) \
+  signals(CUSTOM_SIGNALS_NAME)
+CUSTOM_SIGNALS_FRAMES(CUSTOM_SIGNALS_NAME_FRAME)
+#undef CUSTOM_SIGNALS_NAME_FRAME
+#undef CUSTOM_SIGNALS_NAME
+
+// Indexed by signal id. In program memory.
+static const char* const kSignalNames[signal_ids::kNumSignals] PROGMEM = {
+#define CUSTOM_SIGNALS_NAME(name, byte_index, bit_index, count, pending_ttl, supporting_ttl) \
+  kName_##name,
+#define CUSTOM_SIGNALS_NAME_FRAME(id, num_data_bytes, signals) \
+  signals(CUSTOM_SIGNALS_NAME)
+  CUSTOM_SIGNALS_FRAMES(CUSTOM_SIGNALS_NAME_FRAME)
+#undef CUSTOM_SIGNALS_NAME_FRAME
+#undef CUSTOM_SIGNALS_NAME
+};
+
+// With custom_defs::kUseSignalExpiryDeadline, the trackers are checked for 
+// expiration only once this time passed. It is never later than the earliest
+// expiry of a known signal, it may be earlier.
+static uint32 next_expiry_millis;
+
+// Max time between tracker checks, for their 16 bit time stamps.
+static const uint16 kMaxExpiryCheckIntervalMillis = 16000;
+
+// Called after reporting to the given tracker. Advances next_expiry_millis
+// if the tracker now expires before it. 
+static inline void updateExpiryDeadline(const CompactSignalTracker& tracker, uint32 now) {
+  const uint16 millis_until_expiry = tracker.millisUntilExpiry();
+  if (millis_until_expiry == 0xffff) {
+    return;
+  }
+  const uint32 expiry_millis = now + millis_until_expiry;
+  if ((int32)(expiry_millis - next_expiry_millis) < 0) {
+    next_expiry_millis = expiry_millis;
+  }
+}
+
+// ----- Signal Events -----
+//
+// Single producer/single consumer ring, both in main. One slot is unused to
+// tell a full queue from an empty one.
+
+static const uint8 kEventQueueSize = 8;
+static SignalEvent events[kEventQueueSize];
+static uint8 events_head;
+static uint8 events_tail;
+static boolean events_dropped;
+
+static inline uint8 nextEventIndex(uint8 index) {
+  return (index + 1 < kEventQueueSize) ? index + 1 : 0;
+}
+
+static void pushEvent(uint8 signal_id, uint8 new_state) {
+  const uint8 next = nextEventIndex(events_head);
+  if (next == events_tail) {
+    events_dropped = true;
+    return;
+  }
+  SignalEvent& event = events[events_head];
+  event.signal_id = signal_id;
+  event.new_state = new_state;
+  event.time_millis = system_clock::timeMillis();
+  events_head = next;
+}
+
+boolean readNextEvent(SignalEvent* event) {
+  if (events_tail == events_head) {
+    return false;
+  }
+  *event = events[events_tail];
+  events_tail = nextEventIndex(events_tail);
+  return true;
+}
+
+boolean getAndClearEventsDropped() {
+  const boolean result = events_dropped;
+  events_dropped = false;
+  return result;
+}
+
+// ----- Signal Metrics -----
+
+static SignalMetrics signal_metrics[signal_ids::kNumSignals];
+
+// Low 16 bits of the system clock millis of the last supporting report or
+// of the change to a known state, indexed by signal id.
+static uint16 last_supporting_millis[signal_ids::kNumSignals];
+
+// Index of the next metrics line to print. kNumSignals if not dumping.
+static uint8 next_dump_index = signal_ids::kNumSignals;
+
+// Time since the last periodic metrics dump.
+
+const SignalMetrics& metrics(uint8 signal_id) {
+  return signal_metrics[signal_id];
+}
+
+void requestMetricsDump() {
+  next_dump_index = 0;
+}
+
+static inline void saturatingIncrement(uint16* counter) {
+  if (*counter != 0xffff) {
+    (*counter)++;
+  }
+}
+
+// Called after a report of the signal. old_state is the tracker state 
+// before the report.
+static inline void updateReportMetrics(uint8 signal_id, uint8 old_state, 
+    boolean is_on, uint16 now) {
+  SignalMetrics& m = signal_metrics[signal_id];
+  saturatingIncrement(&m.reports);
+  const CompactSignalTracker& tracker = private_::trackers[signal_id];
+  if (!tracker.isKnown()) {
+    return;
+  }
+  if (tracker.state() == old_state) {
+    // Pending reports do not change the last supporting report time.
+    if (tracker.isOn() != is_on) {
+      return;
+    }
+    const uint16 gap = now - last_supporting_millis[signal_id];
+    if (gap > m.max_supporting_gap_millis) {
+      m.max_supporting_gap_millis = gap;
+    }
+  }
+  last_supporting_millis[signal_id] = now;
+}
+
+// Print the next metrics line of a pending dump, if the serial output has 
+// room.
+static void loopMetricsDump() {
+  if (next_dump_index >= signal_ids::kNumSignals || sio::capacity() < 48) {
+    return;
+  }
+  const uint8 i = next_dump_index++;
+  const SignalMetrics& m = signal_metrics[i];
+  sio::print((const __FlashStringHelper*)pgm_read_word(&kSignalNames[i]));
+  sio::out << F(": reports=") << m.reports << F(" gap=") << m.max_supporting_gap_millis
+      << F(" expiries=") << m.expiries << '\n';
+}
+
+// ----- Signal Snapshot -----
+//
+// Sequence counter based. The seq is odd while the states are updated and
+// readers retry until they copied the states with the same even seq before 
+// and after.
+
+static volatile uint8 snapshot_seq;
+static uint8 snapshot_states[SignalSnapshot::kNumBytes];
+
+static void updateSnapshot(uint8 signal_id, uint8 new_state) {
+  const uint8 shift = (signal_id & 0x03) << 1;
+  uint8& states = snapshot_states[signal_id >> 2];
+  snapshot_seq++;
+  asm volatile("" ::: "memory");
+  states = (states & ~(0x03 << shift)) | (new_state << shift);
+  asm volatile("" ::: "memory");
+  snapshot_seq++;
+}
+
+void readSnapshot(SignalSnapshot* snapshot) {
+  for (;;) {
+    const uint8 seq = snapshot_seq;
+    asm volatile("" ::: "memory");
+    for (uint8 i = 0; i < SignalSnapshot::kNumBytes; i++) {
+      snapshot->states[i] = snapshot_states[i];
+    }
+    asm volatile("" ::: "memory");
+    if (!(seq & 0x01) && seq == snapshot_seq) {
+      snapshot->seq = seq;
+      return;
+    }
+  }
+}
+
+// Publish a state change of a tracker.
+static inline void stateChanged(uint8 signal_id, uint8 new_state) {
+  updateSnapshot(signal_id, new_state);
+  pushEvent(signal_id, new_state);
+}
+
+// Call the loop() of the given tracker and queue an event if it expired.
+static inline void loopTracker(uint8 signal_id) {
+  CompactSignalTracker& tracker = private_::trackers[signal_id];
+  const uint8 old_state = tracker.state();
+  tracker.loop();
+  if (tracker.state() != old_state) {
+    stateChanged(signal_id, tracker.state());
+    if (custom_defs::kTrackSignalMetrics) {
+      saturatingIncrement(&signal_metrics[signal_id].expiries);
+    }
+  }
+}
+
+void setSignalLocation(uint8 signal_id, uint8 byte_index, uint8 bit_index) {
+  signal_bits[signal_id].byte_index = byte_index;
+  signal_bits[signal_id].mask = H(bit_index);
+  // The next frame of each id is decoded in full.
+  for (uint8 i = 0; i < frame_indices::kNumFrames; i++) {
+    last_payloads[i].is_settled = false;
+  }
 }
 
 void setup() {
-  // Nothing to do here.
+  if (custom_defs::kTrackSignalMetrics) {
+    timer_wheel::start(custom_defs::kSignalMetricsDumpMillis, 
+        custom_defs::kSignalMetricsDumpMillis, requestMetricsDump);
+  }
 }
   
 // Called repeatidly from the main loop().
 void loop() {
+  if (custom_defs::kTrackSignalMetrics) {
+    loopMetricsDump();
+  }
+
+  if (custom_defs::kUseSignalExpiryDeadline) {
+    const uint32 now = system_clock::timeMillis();
+    if ((int32)(now - next_expiry_millis) < 0) {
+      return;
+    }
+    // Expire the due trackers and find the next deadline.
+    uint16 min_millis_until_expiry = kMaxExpiryCheckIntervalMillis;
+    for (uint8 i = 0; i < signal_ids::kNumSignals; i++) {
+      loopTracker(i);
+      const uint16 millis_until_expiry = private_::trackers[i].millisUntilExpiry();
+      if (millis_until_expiry < min_millis_until_expiry) {
+        min_millis_until_expiry = millis_until_expiry;
+      }
+    }
+    next_expiry_millis = now + min_millis_until_expiry;
+    return;
+  }
+
   // Loop dependents.
-  private_::ignition_on_signal_tracker.loop();
-  private_::button_signal_tracker.loop();
-
-  private_::autostart_switch.loop();
-  private_::autostart_LED.loop();
-  private_::PASM_switch.loop();
-  private_::PASM_LED.loop();
-  private_::PSE_switch.loop();
-  private_::PSE_LED.loop();
-  private_::PSM_switch.loop();
-  private_::PSM_LED.loop();
-  private_::roof_close_switch.loop();
-  private_::roof_open_switch.loop();
-  private_::spoiler_switch.loop();
-  private_::spoiler_LED.loop();
-  private_::sport_switch.loop();
-  private_::sport_LED.loop();
-  private_::sport_plus_switch.loop();
-  private_::sport_plus_LED.loop();
+  for (uint8 i = 0; i < signal_ids::kNumSignals; i++) {
+    loopTracker(i);
+  }
 }
 
-// Handling of frame from sport mode button unit.
-void frameArrived(const LinFrame& frame) {
-  // We ignore injected frames, not to be influence by own injections.
-  if (frame.hasInjectedBits()) {
-    return;
+// True if the given bit of the frame of the given audit record was forced
+// by the injector. byte_index is the frame byte index, 1 for the first data
+// byte.
+static inline boolean isInjectedBit(const lin_processor::InjectionAudit* audit, 
+    uint8 byte_index, uint8 mask) {
+  if (!audit || !byte_index) {
+    return false;
   }
+  const uint8 i = byte_index - 1;
+  return (audit->injected_bytes & (1 << i)) && (audit->forced[i] & mask);
+}
 
-  // Get frame id.
-  const uint8 id = frame.get_byte(0);
-  
-  // Handle slave-to-master frames (physical switches)
-  if (id == 0x8e) {
-    if (frame.num_bytes() == (1 + 8 + 1)) {
-      const boolean button_is_pressed = frame.get_byte(2) & H(2);
-      private_::button_signal_tracker.reportSignal(button_is_pressed);
-
-      private_::autostart_switch.reportSignal   (frame.get_byte(4) & H(2));
-      private_::PASM_switch.reportSignal        (frame.get_byte(1) & H(3));
-      private_::PSE_switch.reportSignal         (frame.get_byte(2) & H(7));
-      private_::PSM_switch.reportSignal         (frame.get_byte(3) & H(0));
-      private_::roof_close_switch.reportSignal  (frame.get_byte(3) & H(7));
-      private_::roof_open_switch.reportSignal   (frame.get_byte(3) & H(6));
-      private_::spoiler_switch.reportSignal     (frame.get_byte(2) & H(3));
-      private_::sport_switch.reportSignal       (frame.get_byte(2) & H(2));
-      private_::sport_plus_switch.reportSignal  (frame.get_byte(2) & H(4));
+// Report the registry signals [begin, end) from the given frame, except 
+// the bits injected per the given audit record, if not NULL. Returns true
+// if all the signals were reported and each supports its tracker state.
+static boolean reportSignals(const LinFrame& frame, 
+    const lin_processor::InjectionAudit* audit, uint8 begin, uint8 end) {
+  const uint32 now = system_clock::timeMillis();
+  boolean is_settled = !audit;
+  for (uint8 i = begin; i < end; i++) {
+    const uint8 byte_index = signal_bits[i].byte_index;
+    const uint8 mask = signal_bits[i].mask;
+    // The other bits of the byte are as sent by the slave.
+    if (isInjectedBit(audit, byte_index, mask)) {
+      is_settled = false;
+      continue;
+    }
+    CompactSignalTracker& tracker = private_::trackers[i];
+    const uint8 old_state = tracker.state();
+    const boolean is_on = frame.get_byte(byte_index) & mask;
+    tracker.reportSignal(is_on);
+    if (tracker.state() != old_state) {
+      stateChanged(i, tracker.state());
+    }
+    if (custom_defs::kTrackSignalMetrics) {
+      updateReportMetrics(i, old_state, is_on, now);
+    }
+    if (custom_defs::kUseSignalExpiryDeadline) {
+      updateExpiryDeadline(tracker, now);
+    }
+    if (!tracker.isKnown() || tracker.isOn() != is_on) {
+      is_settled = false;
     }
-    return;
   }
+  return is_settled;
+}
 
-  // Handle master-to-slave frames (ignition state, button LEDs...)
-  if (id == 0x0d) {
-    if (frame.num_bytes() == (1 + 8 + 1)) {
-      const boolean is_ignition_bit_on = frame.get_byte(6) & H(7);
-      private_::ignition_on_signal_tracker.reportSignal(is_ignition_bit_on);
+// Report again the signals [begin, end) of a settled frame, with no 
+// extraction of the bits. Returns false, with no change, if any of the 
+// trackers expired to UNKNOWN since.
+static boolean refreshSignals(uint8 begin, uint8 end) {
+  for (uint8 i = begin; i < end; i++) {
+    if (!private_::trackers[i].isKnown()) {
+      return false;
+    }
+  }
+  const uint32 now = system_clock::timeMillis();
+  for (uint8 i = begin; i < end; i++) {
+    CompactSignalTracker& tracker = private_::trackers[i];
+    tracker.refreshSupportingReport();
+    if (custom_defs::kTrackSignalMetrics) {
+      updateReportMetrics(i, tracker.state(), tracker.isOn(), now);
+    }
+    if (custom_defs::kUseSignalExpiryDeadline) {
+      updateExpiryDeadline(tracker, now);
+    }
+  }
+  return true;
+}
 
-      private_::autostart_LED.reportSignal      (frame.get_byte(4) & H(4));
-      private_::PASM_LED.reportSignal           (frame.get_byte(1) & H(4));   // (both H(4) and H(5) observed on 2013 981BS USA model, neither are turned on by Sport Plus button...?)
-      private_::PSE_LED.reportSignal            (frame.get_byte(3) & H(6));
-      private_::PSM_LED.reportSignal            (frame.get_byte(4) & H(2));   // (both H(2) and H(7) observed on 2013 981BS USA model)
-      private_::spoiler_LED.reportSignal        (frame.get_byte(3) & H(3));
-      private_::sport_LED.reportSignal          (frame.get_byte(4) & H(0));
-      private_::sport_plus_LED.reportSignal     (frame.get_byte(4) & H(5));
+// Copy the data bytes of the frame to the given last payload. Returns true
+// if they are unchanged.
+static boolean updateLastPayload(LastPayload* last, const LinFrame& frame, 
+    uint8 num_data_bytes) {
+  boolean is_unchanged = true;
+  for (uint8 i = 0; i < num_data_bytes; i++) {
+    const uint8 b = frame.get_byte(i + 1);
+    if (last->data[i] != b) {
+      last->data[i] = b;
+      is_unchanged = false;
     }
+  }
+  return is_unchanged;
+}
+
+// Report the signals [begin, end) of a frame with the given number of data
+// bytes. A repeat of a settled payload only refreshes the trackers.
+static void handleSignalsFrame(const LinFrame& frame, 
+    const lin_processor::InjectionAudit* audit, LastPayload* last, 
+    uint8 num_data_bytes, uint8 begin, uint8 end) {
+  if (!custom_defs::kSkipUnchangedSignalFrames) {
+    reportSignals(frame, audit, begin, end);
     return;
   }
+  const boolean is_unchanged = updateLastPayload(last, frame, num_data_bytes);
+  if (is_unchanged && last->is_settled && !audit && refreshSignals(begin, end)) {
+    return;
+  }
+  last->is_settled = reportSignals(frame, audit, begin, end);
 }
 
-}  // namespace custom_signals
+// Handling of frame from sport mode button unit.
+void frameArrived(const LinFrame& frame, const lin_processor::InjectionAudit* audit) {
+  // Not to be influenced by own injections, the injected bits are skipped. 
+  // Without the record they are unknown, so the frame is ignored.
+  if (frame.hasInjectedBits() && !audit) {
+    return;
+  }
+
+  // Dispatch on the frame id to the registry range of its signals.
+  switch (frame.get_byte(0)) {
+#define CUSTOM_SIGNALS_REPORT_FRAME(id, num_data_bytes, signals) \
+    case id: \
+      if (frame.num_bytes() == (1 + num_data_bytes + 1)) { \
+        handleSignalsFrame(frame, audit, \
+            &last_payloads[frame_indices::signals##_index], num_data_bytes, \
+            signal_ids::signals##_begin, signal_ids::signals##_end); \
+      } \
+      return;
+    CUSTOM_SIGNALS_FRAMES(CUSTOM_SIGNALS_REPORT_FRAME)
+#undef CUSTOM_SIGNALS_REPORT_FRAME
+  }
+}
 
+}  // namespace custom_signals
 
@@ -14,133 +14,204 @@
 #define CUSTOM_SIGNALS_H
 
 #include "avr_util.h"
+#include "compact_signal_tracker.h"
 #include "lin_frame.h"
-#include "signal_tracker.h"
+#include "lin_processor.h"
 
 // Tracks signals on the linbus that we use for this custom application.
 //
 // Like all the other custom_* files, this file should be adapted to the specific application. 
 // The example provided is for a Sport Mode button press injector for 981/Cayman.
-namespace custom_signals {
-  namespace private_ {
-    // Tracks the ingition-on status.
-    extern SignalTracker ignition_on_signal_tracker;
-    
-    // Tracks the state of the config button.
-    // This button is mapped to the P981/CS Sport Mode button.
-    extern SignalTracker button_signal_tracker;
-
-    // 
-    // 981 buttons and LED indicators
-    //
-
-    extern SignalTracker autostart_switch;
-    extern SignalTracker autostart_LED;
-
-    extern SignalTracker PASM_switch;
-    extern SignalTracker PASM_LED;
-
-    extern SignalTracker PSE_switch;
-    extern SignalTracker PSE_LED;
-
-    extern SignalTracker PSM_switch;
-    extern SignalTracker PSM_LED;
 
-    extern SignalTracker roof_close_switch;
-    extern SignalTracker roof_open_switch;
-
-    extern SignalTracker spoiler_switch;
-    extern SignalTracker spoiler_LED;
+// The signal database. Each frame has a list with one line per signal bit:
+//
+//   X(name, byte index, bit index, required_pending_reports_count, 
+//     pending_report_ttl_millis, supporting_report_ttl_millis)
+//
+// where name() is the accessor of the signal tracker and the last three 
+// are its tracker parameters (see SignalTracker). The trackers are
+// CompactSignalTracker's. Adding a signal requires only a new line
+// here. The lists are expanded at compile time into the signal ids, the 
+// tracker registry and its bit locations, the accessors and the 
+// frameArrived() dispatch.
+//
+// NOTE: use only /* */ comments within the lists.
+// The host tool tools/serial/signal_db.py parses the same lists to decode
+// the signals of the raw frames. Keep the ids, byte and bit indices numeric.
+
+// Slave-to-master frame of the sport mode button unit (physical switches).
+// NOTE: we require only a single button report to change state. This prevents
+// missing clicks when clicking fast.
+#define CUSTOM_SIGNALS_FRAME_0X8E(X) \
+  /* The config button is mapped to the P981/CS Sport Mode button. */ \
+  X(config_button,      2, 2, 1, 1000, 2000) \
+  X(autostart_switch,   4, 2, 1, 1000, 2000) \
+  X(PASM_switch,        1, 3, 1, 1000, 2000) \
+  X(PSE_switch,         2, 7, 1, 1000, 2000) \
+  X(PSM_switch,         3, 0, 1, 1000, 2000) \
+  X(roof_close_switch,  3, 7, 1, 1000, 2000) \
+  X(roof_open_switch,   3, 6, 1, 1000, 2000) \
+  X(spoiler_switch,     2, 3, 1, 1000, 2000) \
+  X(sport_switch,       2, 2, 1, 1000, 2000) \
+  X(sport_plus_switch,  2, 4, 1, 1000, 2000)
+
+// Master-to-slave frame (ignition state, button LEDs...)
+#define CUSTOM_SIGNALS_FRAME_0X0D(X) \
+  X(ignition_state,     6, 7, 3, 1000, 2000) \
+  X(autostart_LED,      4, 4, 1, 1000, 2000) \
+  /* Both bits 4 and 5 observed on 2013 981BS USA model, neither are */ \
+  /* turned on by Sport Plus button...? */ \
+  X(PASM_LED,           1, 4, 1, 1000, 2000) \
+  X(PSE_LED,            3, 6, 1, 1000, 2000) \
+  /* Both bits 2 and 7 observed on 2013 981BS USA model. */ \
+  X(PSM_LED,            4, 2, 1, 1000, 2000) \
+  X(spoiler_LED,        3, 3, 1, 1000, 2000) \
+  X(sport_LED,          4, 0, 1, 1000, 2000) \
+  X(sport_plus_LED,     4, 5, 1, 1000, 2000)
+
+// The frames with signals, one line per frame id:
+//
+//   F(id, number of data bytes, signal list)
+//
+// Frames with other number of data bytes are ignored.
+#define CUSTOM_SIGNALS_FRAMES(F) \
+  F(0x8e, 8, CUSTOM_SIGNALS_FRAME_0X8E) \
+  F(0x0d, 8, CUSTOM_SIGNALS_FRAME_0X0D)
 
-    extern SignalTracker sport_switch;
-    extern SignalTracker sport_LED;
+namespace custom_signals {
+  // Signal ids, the indices of the signals in the tracker registry. The
+  // signals of each frame are contiguous, from <signal list>_begin to 
+  // <signal list>_end (exclusive). Enum is used only for the compile time 
+  // numbering, the ids are stored as uint8.
+  namespace signal_ids {
+#define CUSTOM_SIGNALS_ID(name, byte_index, bit_index, count, pending_ttl, supporting_ttl) \
+    name,
+#define CUSTOM_SIGNALS_ID_FRAME(id, num_data_bytes, signals) \
+    signals##_begin, signals##_begin_back = signals##_begin - 1, \
+    signals(CUSTOM_SIGNALS_ID) \
+    signals##_end, signals##_end_back = signals##_end - 1,
+    enum {
+      CUSTOM_SIGNALS_FRAMES(CUSTOM_SIGNALS_ID_FRAME)
+      kNumSignals
+    };
+#undef CUSTOM_SIGNALS_ID_FRAME
+#undef CUSTOM_SIGNALS_ID
+  }
 
-    extern SignalTracker sport_plus_switch;
-    extern SignalTracker sport_plus_LED;
+  namespace private_ {
+    // The tracker registry, one tracker per signal, indexed by signal id.
+    extern CompactSignalTracker trackers[signal_ids::kNumSignals];
   }
 
   // Called once during initialization.
   extern void setup();
 
+  // Move a signal to another bit of its frame. byte_index is of the frame
+  // bytes, as in the lists above. Used by vehicle_profiles before the frames
+  // are tracked.
+  extern void setSignalLocation(uint8 signal_id, uint8 byte_index, uint8 bit_index);
+
   // Called once on each iteration of the Arduino main loop().
   extern void loop();
 
   // Called once when a new valid frame was recieved. Used to intercept
-  // signals of buttons that affects the config.
-  extern void frameArrived(const LinFrame& frame);
-
-  inline const SignalTracker& ignition_state() {
-    return private_::ignition_on_signal_tracker;
-  }
-
-  inline const SignalTracker& config_button() {
-    return private_::button_signal_tracker;
-  }
-
-  // 981 button/LED accessors
-  inline const SignalTracker& autostart_switch() {
-    return private_::autostart_switch;
-  }
-
-  inline const SignalTracker& autostart_LED() {
-    return private_::autostart_LED;
-  }
-
-  inline const SignalTracker& PASM_switch() {
-    return private_::PASM_switch;
-  }
-
-  inline const SignalTracker& PASM_LED() {
-    return private_::PASM_LED;
-  }
-
-  inline const SignalTracker& PSE_switch() {
-    return private_::PSE_switch;
-  }
-
-  inline const SignalTracker& PSE_LED() {
-    return private_::PSE_LED;
-  }
-
-  inline const SignalTracker& PSM_switch() {
-    return private_::PSM_switch;
-  }
-
-  inline const SignalTracker& PSM_LED() {
-    return private_::PSM_LED;
-  }
-
-  inline const SignalTracker& roof_close_switch() {
-    return private_::roof_close_switch;
-  }
-
-  inline const SignalTracker& roof_open_switch() {
-    return private_::roof_open_switch;
-  }
-
-  inline const SignalTracker& spoiler_switch() {
-    return private_::spoiler_switch;
-  }
-
-  inline const SignalTracker& spoiler_LED() {
-    return private_::spoiler_LED;
-  }
-
-  inline const SignalTracker& sport_switch() {
-    return private_::sport_switch;
-  }
-
-  inline const SignalTracker& sport_LED() {
-    return private_::sport_LED;
-  }
-
-  inline const SignalTracker& sport_plus_switch() {
-    return private_::sport_plus_switch;
-  }
-
-  inline const SignalTracker& sport_plus_LED() {
-    return private_::sport_plus_LED;
-  }
+  // signals of buttons that affects the config. audit is the injection 
+  // audit record of the frame, or NULL. The bits injected by the injector
+  // are not reported, the other signals of the frame are. A frame with 
+  // injected bits and no record is ignored.
+  extern void frameArrived(const LinFrame& frame, 
+      const lin_processor::InjectionAudit* audit);
+
+  // A change of the state of a signal tracker.
+  struct SignalEvent {
+    // One of signal_ids.
+    uint8 signal_id;
+    // One of SignalTracker::States.
+    uint8 new_state;
+    // Low 16 bits of the system clock millis of the change.
+    uint16 time_millis;
+  };
+
+  // Try to read the oldest signal event. If available, return true and set
+  // given buffer. Otherwise return false. The queue holds a few events and
+  // newer events are dropped when it is full, so it should have a single 
+  // consumer that reads it on each loop.
+  extern boolean readNextEvent(SignalEvent* event);
+
+  // Returns true if events were dropped since the last call.
+  extern boolean getAndClearEventsDropped();
+
+  // A consistent copy of the states of all the signals, 2 bits per signal.
+  // Lets logic that combines several signals read them all at once, even if
+  // the trackers are updated between its reads.
+  struct SignalSnapshot {
+    static const uint8 kNumBytes = (signal_ids::kNumSignals + 3) / 4;
+
+    // Advanced by two on each state change since startup. Equal values
+    // mean equal states.
+    uint8 seq;
+    // Signal i is in bits [2*(i%4)+1 : 2*(i%4)] of states[i/4].
+    uint8 states[kNumBytes];
+
+    // Returns one of SignalTracker::States.
+    inline uint8 state(uint8 signal_id) const {
+      return (states[signal_id >> 2] >> ((signal_id & 0x03) << 1)) & 0x03;
+    }
+
+    inline boolean isOn(uint8 signal_id) const {
+      return state(signal_id) == SignalTracker::States::ON;
+    }
+
+    inline boolean isOff(uint8 signal_id) const {
+      return state(signal_id) == SignalTracker::States::OFF;
+    }
+
+    inline boolean isKnown(uint8 signal_id) const {
+      return state(signal_id) != SignalTracker::States::UNKNOWN;
+    }
+  };
+
+  // Copy the current states of all the signals to the given snapshot. 
+  // Retries if a state changed during the copy, so it should not be called 
+  // from a context that preempts the tracker updates.
+  extern void readSnapshot(SignalSnapshot* snapshot);
+
+  // Per signal metrics. Collected only with custom_defs::kTrackSignalMetrics.
+  // Counters saturate at their max value.
+  struct SignalMetrics {
+    // Number of reports of the signal.
+    uint16 reports;
+    // Max time between two reports that supported the known state. Should
+    // be well below the supporting_report_ttl_millis of the signal.
+    uint16 max_supporting_gap_millis;
+    // Number of changes to UNKNOWN due to expiry of the supporting report 
+    // ttl.
+    uint16 expiries;
+  };
+
+  // Returns the metrics of the signal with the given id.
+  extern const SignalMetrics& metrics(uint8 signal_id);
+
+  // Print the metrics of all the signals, one line per signal. The lines
+  // are printed by loop(), as the serial output buffer has room.
+  extern void requestMetricsDump();
+
+  // Returns the tracker of the signal with the given id. For code that
+  // selects signals by id, such as tables of signals.
+  inline const CompactSignalTracker& tracker(uint8 signal_id) {
+    return private_::trackers[signal_id];
+  }
+
+  // Signal accessors. For example, ignition_state() and sport_LED().
+#define CUSTOM_SIGNALS_ACCESSOR(name, byte_index, bit_index, count, pending_ttl, supporting_ttl) \
+  inline const CompactSignalTracker& name() { \
+    return private_::trackers[signal_ids::name]; \
+  }
+#define CUSTOM_SIGNALS_ACCESSOR_FRAME(id, num_data_bytes, signals) \
+  signals(CUSTOM_SIGNALS_ACCESSOR)
+  CUSTOM_SIGNALS_FRAMES(CUSTOM_SIGNALS_ACCESSOR_FRAME)
+#undef CUSTOM_SIGNALS_ACCESSOR_FRAME
+#undef CUSTOM_SIGNALS_ACCESSOR
 }  // namespace custom_signals
 
 #endif
@@ -0,0 +1,317 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "event_program.h"
+
+#include <avr/eeprom.h>
+#include "custom_defs.h"
+#include "custom_injector.h"
+#include "leds.h"
+#include "passive_timer.h"
+#include "settings.h"
+#include "signal_tracker.h"
+
+namespace event_program {
+  // After the post mortem ring.
+  static const uint16 kAddress = 512;
+
+  // The format version of the stored program. Increment on incompatible
+  // changes of the ops.
+  static const uint8 kVersion = 1;
+
+  // The CRC is written last, so a program interrupted by a reset fails it.
+  struct Stored {
+    uint8 version;
+    uint8 length;
+    uint8 bytes[kMaxProgramBytes];
+    uint8 crc;
+  };
+
+  // The program. Also the buffer of writeBytes(). Stored in the eeprom
+  // layout so it can be written as is.
+  static Stored program;
+
+  // True while the program is valid and running.
+  static boolean is_running;
+
+  // The offsets of the triggers of the handlers.
+  static uint8 handler_offsets[kMaxHandlers];
+  static uint8 num_handlers;
+
+  // Bit i is flag i.
+  static uint8 flags;
+
+  // Bit i is set while timer i runs.
+  static uint8 active_timers;
+  static PassiveTimer timers[kNumTimers];
+  static uint16 timer_millis[kNumTimers];
+
+  // The index of the next program byte to write to the eeprom, or
+  // sizeof(Stored) when idle.
+  static uint8 write_index = sizeof(Stored);
+
+  // Returns the number of bytes of the op at pc, including its operands,
+  // or zero if it is not valid or does not fit in the program.
+  static uint8 opBytes(uint8 pc, uint8 length) {
+    const uint8* const op = &program.bytes[pc];
+    uint8 num_bytes;
+    boolean is_valid;
+    switch (op[0]) {
+      case ops::END:
+        return 1;
+      case ops::ON_SIGNAL:
+      case ops::IF_STATE:
+        num_bytes = 3;
+        is_valid = op[1] < custom_signals::signal_ids::kNumSignals
+            && op[2] <= SignalTracker::States::ON;
+        break;
+      case ops::ON_TIMER:
+      case ops::STOP_TIMER:
+        num_bytes = 2;
+        is_valid = op[1] < kNumTimers;
+        break;
+      case ops::START_TIMER:
+        num_bytes = 4;
+        is_valid = op[1] < kNumTimers;
+        break;
+      case ops::IF_FLAG:
+      case ops::IF_NOT_FLAG:
+      case ops::SET_FLAG:
+      case ops::CLEAR_FLAG:
+        num_bytes = 2;
+        is_valid = op[1] < kNumFlags;
+        break;
+      case ops::IF_SETTING:
+      case ops::SET_SETTING:
+        num_bytes = 3;
+        is_valid = op[1] < settings::ids::kNumSettings;
+        break;
+      case ops::PRESS:
+        num_bytes = 4;
+        is_valid = op[1] < custom_injector::private_::kNumButtons;
+        break;
+      case ops::RELEASE:
+        num_bytes = 2;
+        is_valid = op[1] < custom_injector::private_::kNumButtons;
+        break;
+      case ops::LED:
+        num_bytes = 3;
+        is_valid = op[1] < leds::ids::kNumLeds && op[2] < leds::patterns::kNumPatterns;
+        break;
+      default:
+        return 0;
+    }
+    // The operands are read only if they are within the program.
+    return (num_bytes <= length - pc && is_valid) ? num_bytes : 0;
+  }
+
+  static inline boolean isTrigger(uint8 op) {
+    return op == ops::ON_SIGNAL || op == ops::ON_TIMER;
+  }
+
+  // Check the program and find its handlers. Returns true if valid.
+  static boolean parse() {
+    const uint8 length = program.length;
+    if (length > kMaxProgramBytes) {
+      return false;
+    }
+    num_handlers = 0;
+    uint8 pc = 0;
+    while (pc < length) {
+      const uint8 trigger_bytes = opBytes(pc, length);
+      if (!trigger_bytes || !isTrigger(program.bytes[pc]) || num_handlers >= kMaxHandlers) {
+        return false;
+      }
+      handler_offsets[num_handlers++] = pc;
+      pc += trigger_bytes;
+      // The instructions, up to and including END.
+      for (;;) {
+        if (pc >= length) {
+          return false;
+        }
+        const uint8 op = program.bytes[pc];
+        const uint8 op_bytes = opBytes(pc, length);
+        if (!op_bytes || isTrigger(op)) {
+          return false;
+        }
+        pc += op_bytes;
+        if (op == ops::END) {
+          break;
+        }
+      }
+    }
+    return true;
+  }
+
+  static void start() {
+    flags = 0;
+    active_timers = 0;
+    is_running = parse() && program.length;
+  }
+
+  // Run the instructions of a handler, starting at pc, up to END or to a
+  // failed condition. The program was parsed, so the operands are valid.
+  static void runHandler(uint8 pc) {
+    for (;;) {
+      const uint8* const op = &program.bytes[pc];
+      switch (op[0]) {
+        case ops::END:
+          return;
+        case ops::IF_STATE:
+          if (custom_signals::tracker(op[1]).state() != op[2]) {
+            return;
+          }
+          break;
+        case ops::IF_FLAG:
+          if (!(flags & bitMask(op[1]))) {
+            return;
+          }
+          break;
+        case ops::IF_NOT_FLAG:
+          if (flags & bitMask(op[1])) {
+            return;
+          }
+          break;
+        case ops::IF_SETTING:
+          if (settings::get(op[1]) != op[2]) {
+            return;
+          }
+          break;
+        case ops::SET_FLAG:
+          flags |= bitMask(op[1]);
+          break;
+        case ops::CLEAR_FLAG:
+          flags &= ~bitMask(op[1]);
+          break;
+        case ops::START_TIMER:
+          timer_millis[op[1]] = ((uint16)op[2] << 8) | op[3];
+          timers[op[1]].restart();
+          active_timers |= bitMask(op[1]);
+          break;
+        case ops::STOP_TIMER:
+          active_timers &= ~bitMask(op[1]);
+          break;
+        case ops::PRESS:
+          custom_injector::pressButtonFor(op[1], ((uint16)op[2] << 8) | op[3]);
+          break;
+        case ops::RELEASE:
+          custom_injector::disableButtonInject(op[1]);
+          break;
+        case ops::LED:
+          leds::setPattern(op[1], op[2]);
+          break;
+        case ops::SET_SETTING:
+          settings::set(op[1], op[2]);
+          break;
+      }
+      pc += opBytes(pc, program.length);
+    }
+  }
+
+  void setup() {
+    if (!custom_defs::kUseEventProgram) {
+      return;
+    }
+    eeprom_read_block(&program, (const void*)kAddress, sizeof(program));
+    const boolean is_valid = program.version == kVersion
+        && crc8((const uint8*)&program, sizeof(program) - 1) == program.crc;
+    if (!is_valid) {
+      program.length = 0;
+    }
+    start();
+  }
+
+  void signalEvent(const custom_signals::SignalEvent& event) {
+    if (!is_running) {
+      return;
+    }
+    for (uint8 i = 0; i < num_handlers; i++) {
+      const uint8 pc = handler_offsets[i];
+      const uint8* const trigger = &program.bytes[pc];
+      if (trigger[0] == ops::ON_SIGNAL && trigger[1] == event.signal_id
+          && trigger[2] == event.new_state) {
+        runHandler(pc + 3);
+      }
+    }
+  }
+
+  // Run the handlers of the timers that expired.
+  static void checkTimers() {
+    for (uint8 t = 0; t < kNumTimers; t++) {
+      if (!(active_timers & bitMask(t)) || timers[t].timeMillis() < timer_millis[t]) {
+        continue;
+      }
+      active_timers &= ~bitMask(t);
+      for (uint8 i = 0; i < num_handlers; i++) {
+        const uint8 pc = handler_offsets[i];
+        if (program.bytes[pc] == ops::ON_TIMER && program.bytes[pc + 1] == t) {
+          runHandler(pc + 2);
+        }
+      }
+    }
+  }
+
+  // Write the next changed byte of the program, skipping unchanged bytes.
+  static void writeByte() {
+    const uint8* const bytes = (const uint8*)&program;
+    while (write_index < sizeof(Stored)) {
+      uint8* const address = (uint8*)kAddress + write_index;
+      const uint8 value = bytes[write_index++];
+      if (eeprom_read_byte(address) != value) {
+        eeprom_write_byte(address, value);
+        return;
+      }
+    }
+  }
+
+  void loop() {
+    if (!custom_defs::kUseEventProgram) {
+      return;
+    }
+    if (active_timers) {
+      checkTimers();
+    }
+    // The eeprom writes a byte in the background. Don't wait for it.
+    if (write_index < sizeof(Stored) && eeprom_is_ready()) {
+      writeByte();
+    }
+  }
+
+  boolean writeBytes(uint8 offset, const uint8* bytes, uint8 num_bytes) {
+    if (!custom_defs::kUseEventProgram || offset > kMaxProgramBytes ||
+        num_bytes > kMaxProgramBytes - offset) {
+      return false;
+    }
+    // Stop the program and its eeprom write, its bytes are replaced.
+    is_running = false;
+    write_index = sizeof(Stored);
+    for (uint8 i = 0; i < num_bytes; i++) {
+      program.bytes[offset + i] = bytes[i];
+    }
+    return true;
+  }
+
+  boolean commit(uint8 num_bytes) {
+    if (!custom_defs::kUseEventProgram || num_bytes > kMaxProgramBytes) {
+      return false;
+    }
+    program.length = num_bytes;
+    start();
+    if (num_bytes && !is_running) {
+      return false;
+    }
+    program.version = kVersion;
+    program.crc = crc8((const uint8*)&program, sizeof(program) - 1);
+    write_index = 0;
+    return true;
+  }
+}  // namespace event_program
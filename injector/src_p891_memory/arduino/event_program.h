@@ -0,0 +1,104 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef EVENT_PROGRAM_H
+#define EVENT_PROGRAM_H
+
+#include "avr_util.h"
+#include "custom_signals.h"
+
+// A small bytecode program that reacts to the signal events and to its own
+// timers with injector, led and settings actions, so new behaviors can be
+// loaded over the serial port instead of coded as a state machine in
+// custom_module. The program is kept in the eeprom and loaded at setup.
+//
+// A program is a list of handlers. A handler is a trigger followed by
+// instructions and END. Each op is a byte followed by its operand bytes:
+//
+//   ON_SIGNAL <signal id> <state>  - trigger, a signal changed to the state.
+//   ON_TIMER <timer>               - trigger, the timer expired.
+//   END                            - end of the handler.
+//   IF_STATE <signal id> <state>   - end the handler unless the signal is
+//                                    in the state.
+//   IF_FLAG <flag>, IF_NOT_FLAG <flag>             - same, for a flag.
+//   IF_SETTING <setting id> <value>                - same, for a setting.
+//   SET_FLAG <flag>, CLEAR_FLAG <flag>
+//   START_TIMER <timer> <millis high> <millis low>, STOP_TIMER <timer>
+//   PRESS <button> <millis high> <millis low>      - custom_injector::pressButtonFor()
+//   RELEASE <button>                               - custom_injector::disableButtonInject()
+//   LED <led id> <pattern>                         - leds::setPattern()
+//   SET_SETTING <setting id> <value>               - settings::set()
+//
+// For example, light the status led while Sport is on, and press PSE
+// 2 seconds after Sport is turned on:
+//
+//   0x01 sport_LED ON  0x32 2 1  0x22 0 0x07 0xd0  0x00
+//   0x01 sport_LED OFF 0x32 2 0  0x23 0  0x00
+//   0x02 0  0x30 1 0x01 0xf4  0x00
+//
+// There are no jumps, so a handler runs its instructions at most once and
+// the cost of an event is bounded by the program length. The operands are
+// checked once, when the program is loaded, so the interpreter does not
+// check them again.
+//
+// Enabled with custom_defs::kUseEventProgram.
+namespace event_program {
+  namespace ops {
+    static const uint8 END = 0x00;
+    static const uint8 ON_SIGNAL = 0x01;
+    static const uint8 ON_TIMER = 0x02;
+    static const uint8 IF_STATE = 0x10;
+    static const uint8 IF_FLAG = 0x11;
+    static const uint8 IF_NOT_FLAG = 0x12;
+    static const uint8 IF_SETTING = 0x13;
+    static const uint8 SET_FLAG = 0x20;
+    static const uint8 CLEAR_FLAG = 0x21;
+    static const uint8 START_TIMER = 0x22;
+    static const uint8 STOP_TIMER = 0x23;
+    static const uint8 PRESS = 0x30;
+    static const uint8 RELEASE = 0x31;
+    static const uint8 LED = 0x32;
+    static const uint8 SET_SETTING = 0x33;
+  }
+
+  // Max program length in bytes, including all the handlers.
+  static const uint8 kMaxProgramBytes = 64;
+
+  // Max number of handlers in a program.
+  static const uint8 kMaxHandlers = 8;
+
+  static const uint8 kNumFlags = 8;
+  static const uint8 kNumTimers = 2;
+
+  // Call once from setup(), after settings::setup(). Loads the program from
+  // the eeprom, if valid.
+  extern void setup();
+
+  // Call from the main loop. Runs the handlers of the expired timers and
+  // writes a newly loaded program to the eeprom, a byte at a time.
+  extern void loop();
+
+  // Call with each custom_signals event. Runs the handlers of the event.
+  extern void signalEvent(const custom_signals::SignalEvent& event);
+
+  // Write bytes of a new program at the given offset. Stops the current
+  // program. Returns false if out of range.
+  extern boolean writeBytes(uint8 offset, const uint8* bytes, uint8 num_bytes);
+
+  // Check the first num_bytes bytes written by writeBytes() and if valid,
+  // start them as the program, with clear flags and timers, and persist
+  // it. A zero length clears the program. Returns false if the program is
+  // not valid.
+  extern boolean commit(uint8 num_bytes);
+}  // namespace event_program
+
+#endif
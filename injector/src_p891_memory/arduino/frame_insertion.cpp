@@ -0,0 +1,210 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "frame_insertion.h"
+
+#include <avr/pgmspace.h>
+#include "custom_defs.h"
+#include "frame_periods.h"
+#include "hardware_clock.h"
+#include "lin_frame.h"
+#include "lin_processor.h"
+#include "sio.h"
+#include "system_clock.h"
+
+namespace frame_insertion {
+  typedef char FrameInsertionRequiresFramePeriods[
+      (!custom_defs::kUseFrameInsertion || custom_defs::kTrackFramePeriods) ? 1 : -1];
+
+  // A frame inserted every period_millis. In program memory.
+  struct PeriodicFrame {
+    // The 6 bit frame id.
+    uint8 id;
+    uint16 period_millis;
+    uint8 num_data_bytes;
+    uint8 data[LinFrame::kMaxBytes - 2];
+  };
+
+  // The periodic frames. Like the custom_* files, should be adapted to the
+  // car.
+  static const PeriodicFrame kPeriodicFrames[] PROGMEM = {
+    // A master request to all the slaves (NAD 0x7f) to read their product
+    // identification (read by identifier 0).
+    { 0x3c, 5000, 8, { 0x7f, 0x06, 0xb2, 0x00, 0xff, 0x7f, 0xff, 0xff } },
+  };
+
+  static const uint8 kNumPeriodicFrames = ARRAY_SIZE(kPeriodicFrames);
+
+  // Clock ticks per bit at custom_defs::kLinSpeed.
+  static const uint16 kTicksPerBit =
+      (hardware_clock::kTicksPerMilli * 1000L) / custom_defs::kLinSpeed;
+
+  // Spare time left before the predicted break of the master.
+  static const uint16 kGuardTicks =
+      custom_defs::kInsertGuardMillis * hardware_clock::kTicksPerMilli;
+
+  // Time of the last insert of each periodic frame.
+  static uint32 last_millis[kNumPeriodicFrames];
+
+  // The queued frames, a ring of num_queued frames from the head.
+  static lin_processor::InsertedFrame queue[kMaxQueuedFrames];
+  static uint8 queue_head;
+  static uint8 num_queued;
+
+  // True while the head frame is with the lin processor, and the number of
+  // gaps it was tried in.
+  static boolean is_pending;
+  static uint8 attempts;
+
+  // Result counts since setup, saturating.
+  static uint16 sent;
+  static uint16 aborted;
+  static uint16 expired;
+  static uint16 dropped;
+
+  static boolean dump_requested;
+
+  static inline void saturatingIncrement(uint16* counter) {
+    if (*counter != 0xffff) {
+      (*counter)++;
+    }
+  }
+
+  // Time the frame takes on the bus, from the idle bits the ISR waits for,
+  // through the break and the delimiter, to the last stop bit.
+  static uint32 frameTicks(const lin_processor::InsertedFrame& frame) {
+    const uint16 bits = custom_defs::kInsertIdleBits + 13 + 1
+        + 10 * (2 + frame.num_bytes);
+    return (uint32)bits * kTicksPerBit;
+  }
+
+  void setup() {
+    num_queued = 0;
+    is_pending = false;
+    // The periodic frames are due after a period.
+    const uint32 now = system_clock::timeMillis();
+    for (uint8 i = 0; i < kNumPeriodicFrames; i++) {
+      last_millis[i] = now;
+    }
+  }
+
+  boolean insert(uint8 id, const uint8* data, uint8 num_data_bytes) {
+    if (!custom_defs::kUseFrameInsertion || num_queued >= kMaxQueuedFrames ||
+        num_data_bytes > LinFrame::kMaxBytes - 2 || !LinFrame::isValidPid(id)) {
+      return false;
+    }
+    lin_processor::InsertedFrame& frame =
+        queue[(queue_head + num_queued) % kMaxQueuedFrames];
+    frame.id = id;
+    // Enhanced checksum includes also the ID byte.
+    uint16 sum = LinFrame::isEnhancedChecksum(id) ? id : 0;
+    for (uint8 i = 0; i < num_data_bytes; i++) {
+      frame.bytes[i] = data[i];
+      sum += data[i];
+      if (sum & 0xff00) {
+        sum = (sum & 0xff) + 1;
+      }
+    }
+    frame.bytes[num_data_bytes] = (uint8)(~sum);
+    frame.num_bytes = num_data_bytes + 1;
+    num_queued++;
+    return true;
+  }
+
+  void requestDump() {
+    dump_requested = true;
+  }
+
+  // Queue the periodic frames that are due. Retried on the next call if
+  // the queue is full.
+  static void queuePeriodicFrames() {
+    const uint32 now = system_clock::timeMillis();
+    for (uint8 i = 0; i < kNumPeriodicFrames; i++) {
+      const PeriodicFrame* const periodic = &kPeriodicFrames[i];
+      if (now - last_millis[i] < pgm_read_word(&periodic->period_millis)) {
+        continue;
+      }
+      uint8 data[LinFrame::kMaxBytes - 2];
+      const uint8 n = pgm_read_byte(&periodic->num_data_bytes);
+      memcpy_P(data, periodic->data, n);
+      if (insert(LinFrame::pid(pgm_read_byte(&periodic->id)), data, n)) {
+        last_millis[i] = now;
+      }
+    }
+  }
+
+  // Count the result of the pending frame, once done. The head frame is
+  // removed if sent or out of attempts.
+  static void checkResult() {
+    const uint8 result = lin_processor::getAndClearInsertResult();
+    if (result == lin_processor::insert_results::NONE) {
+      return;
+    }
+    is_pending = false;
+    if (result == lin_processor::insert_results::SENT) {
+      saturatingIncrement(&sent);
+    } else {
+      saturatingIncrement(result == lin_processor::insert_results::ABORTED
+          ? &aborted : &expired);
+      if (++attempts < kMaxAttempts) {
+        return;
+      }
+      saturatingIncrement(&dropped);
+    }
+    attempts = 0;
+    queue_head = (queue_head + 1) % kMaxQueuedFrames;
+    num_queued--;
+  }
+
+  // Pass the head frame to the lin processor if the next break of the
+  // master is far enough. The ISR must start it by the deadline, so it
+  // ends kGuardTicks before that break.
+  static void scheduleHead() {
+    uint32 gap_ticks;
+    if (!frame_periods::ticksUntilAnyNext(&gap_ticks)) {
+      return;
+    }
+    const lin_processor::InsertedFrame& frame = queue[queue_head];
+    const uint32 needed_ticks = frameTicks(frame) + kGuardTicks;
+    if (gap_ticks < needed_ticks) {
+      return;
+    }
+    const uint32 deadline_ticks = hardware_clock::ticks32ForNonIsr()
+        + (gap_ticks - needed_ticks);
+    is_pending = lin_processor::insertFrame(frame, deadline_ticks);
+  }
+
+  static void loopDump() {
+    if (!sio::beginRecord(64)) {
+      return;
+    }
+    dump_requested = false;
+    sio::out << F("insert sent=") << sent << F(" aborted=") << aborted
+        << F(" expired=") << expired << F(" dropped=") << dropped << '\n';
+  }
+
+  void loop() {
+    if (!custom_defs::kUseFrameInsertion) {
+      return;
+    }
+    if (dump_requested) {
+      loopDump();
+    }
+    queuePeriodicFrames();
+    if (is_pending) {
+      checkResult();
+    }
+    if (!is_pending && num_queued) {
+      scheduleHead();
+    }
+  }
+}  // namespace frame_insertion
@@ -0,0 +1,56 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FRAME_INSERTION_H
+#define FRAME_INSERTION_H
+
+#include "avr_util.h"
+
+// Insertion of complete frames of the injector, header and response,
+// toward the slave side, e.g. a diagnostic request to a slave. The frames
+// are queued by insert() and by the periodic frames of kPeriodicFrames (see
+// frame_insertion.cpp), and one at a time is passed to the lin processor
+// (lin_processor::insertFrame()) when the schedule learned by frame_periods
+// predicts a gap of the master long enough for the frame. The ISR then
+// sends it at the bit ticks once both buses are idle, unless the gap
+// passed, and aborts it if the master starts a break anyway. Frames that
+// were not sent are retried in the next gaps, up to kMaxAttempts times.
+//
+// The slave response to an inserted header is not read, the inserted
+// frames carry their own response. Enabled with
+// custom_defs::kUseFrameInsertion, requires kTrackFramePeriods.
+namespace frame_insertion {
+  // Max number of queued frames.
+  static const uint8 kMaxQueuedFrames = 4;
+
+  // Number of gaps a frame is tried in before it is dropped.
+  static const uint8 kMaxAttempts = 8;
+
+  // Call once during initialization.
+  extern void setup();
+
+  // Main loop task. Queues the due periodic frames and passes the next
+  // frame to the lin processor when a gap is due.
+  extern void loop();
+
+  // Queue a frame of the given protected id with the given data bytes. The
+  // checksum is computed here, per the checksum model of the id. Returns
+  // false if the queue is full, the id has invalid parity bits or the data
+  // is too long.
+  extern boolean insert(uint8 id, const uint8* data, uint8 num_data_bytes);
+
+  // Print the counts of the sent, aborted, expired and dropped frames, in
+  // one line, when the serial output has room.
+  extern void requestDump();
+}  // namespace frame_insertion
+
+#endif
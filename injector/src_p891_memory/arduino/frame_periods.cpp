@@ -0,0 +1,263 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "frame_periods.h"
+
+#include "custom_defs.h"
+#include "hardware_clock.h"
+#include "sio.h"
+
+namespace frame_periods {
+  typedef char FramePeriodsRequireTimestamps[
+      (!custom_defs::kTrackFramePeriods || !custom_defs::kUsePackedFrameRing) ? 1 : -1];
+
+  // EWMA weight of a new period, 1/2^kEwmaShift.
+  static const uint8 kEwmaShift = 3;
+
+  // Periods measured before the period is considered known and missed 
+  // slots are detected.
+  static const uint8 kMinPeriods = 4;
+
+  // Longer break to break times restart the tracking of the id (e.g. the 
+  // bus was idle). About a second.
+  static const uint32 kMaxPeriodTicks = 1000 * hardware_clock::kTicksPerMilli;
+
+  struct Entry {
+    // Protected id byte, or zero if the entry is free.
+    uint8 id;
+    boolean is_overdue;
+    uint32 last_break_ticks;
+    // The period and the jitter with kEwmaShift fraction bits.
+    uint32 period_x8;
+    uint32 jitter_x8;
+    Period period;
+  };
+
+  static Entry entries[kMaxIds];
+  static uint8 num_entries;
+
+  // Index of the next entry to print in a dump, or kMaxIds if none.
+  static uint8 next_dump_index = kMaxIds;
+
+  static inline void saturatingIncrement(uint16* counter, uint16 n) {
+    *counter = (*counter > 0xffff - n) ? 0xffff : *counter + n;
+  }
+
+  static Entry* findEntry(uint8 id) {
+    for (uint8 i = 0; i < num_entries; i++) {
+      if (entries[i].id == id) {
+        return &entries[i];
+      }
+    }
+    return NULL;
+  }
+
+  static inline boolean isKnown(const Entry& entry) {
+    return entry.period.periods >= kMinPeriods;
+  }
+
+  void setup() {
+    num_entries = 0;
+  }
+
+  // Update the entry with a period of the given length.
+  static void addPeriod(Entry* entry, uint32 ticks) {
+    Period& period = entry->period;
+    if (!period.periods) {
+      entry->period_x8 = ticks << kEwmaShift;
+      entry->jitter_x8 = 0;
+      period.min_ticks = ticks;
+      period.max_ticks = ticks;
+    } else {
+      const uint32 average = entry->period_x8 >> kEwmaShift;
+      const uint32 deviation = (ticks > average) ? ticks - average : average - ticks;
+      // x8 is the average times 2^kEwmaShift, so adding the sample and 
+      // subtracting the average moves it 1/2^kEwmaShift of the way.
+      entry->period_x8 = entry->period_x8 - average + ticks;
+      entry->jitter_x8 = entry->jitter_x8 - (entry->jitter_x8 >> kEwmaShift) + deviation;
+      if (ticks < period.min_ticks) {
+        period.min_ticks = ticks;
+      }
+      if (ticks > period.max_ticks) {
+        period.max_ticks = ticks;
+      }
+    }
+    saturatingIncrement(&period.periods, 1);
+    period.period_ticks = entry->period_x8 >> kEwmaShift;
+    period.jitter_ticks = entry->jitter_x8 >> kEwmaShift;
+  }
+
+  void frameArrived(const LinFrame& frame) {
+    if (!custom_defs::kTrackFramePeriods || !frame.num_bytes()) {
+      return;
+    }
+    const uint8 id = frame.get_byte(0);
+    Entry* entry = findEntry(id);
+    if (!entry) {
+      if (num_entries >= kMaxIds) {
+        return;
+      }
+      entry = &entries[num_entries++];
+      entry->id = id;
+      entry->is_overdue = false;
+      entry->period = Period();
+      entry->last_break_ticks = frame.break_ticks();
+      return;
+    }
+
+    const uint32 ticks = frame.break_ticks() - entry->last_break_ticks;
+    entry->last_break_ticks = frame.break_ticks();
+    entry->is_overdue = false;
+    if (ticks > kMaxPeriodTicks) {
+      // Keeps the stats, the period is measured again from this break.
+      return;
+    }
+    if (!isKnown(*entry)) {
+      addPeriod(entry, ticks);
+      return;
+    }
+
+    // A break n periods after the previous one means n - 1 missed slots. The
+    // period is then measured over the n slots.
+    const uint32 average = entry->period.period_ticks;
+    uint8 slots = 1;
+    uint32 slots_ticks = average;
+    while (ticks > slots_ticks + (average >> 1) && slots < 255) {
+      slots++;
+      slots_ticks += average;
+    }
+    if (slots > 1) {
+      saturatingIncrement(&entry->period.missed, slots - 1);
+    }
+    addPeriod(entry, ticks / slots);
+  }
+
+  boolean getPeriod(uint8 id, Period* period) {
+    const Entry* const entry = findEntry(id);
+    if (!entry || !isKnown(*entry)) {
+      return false;
+    }
+    *period = entry->period;
+    return true;
+  }
+
+  boolean ticksUntilNext(uint8 id, int32* ticks) {
+    const Entry* const entry = findEntry(id);
+    if (!entry || !isKnown(*entry)) {
+      return false;
+    }
+    *ticks = (int32)(entry->last_break_ticks + entry->period.period_ticks 
+        - hardware_clock::ticks32ForNonIsr());
+    return true;
+  }
+
+  boolean ticksUntilAnyNext(uint32* ticks) {
+    if (!num_entries) {
+      return false;
+    }
+    const uint32 now = hardware_clock::ticks32ForNonIsr();
+    uint32 result = 0xffffffff;
+    for (uint8 i = 0; i < num_entries; i++) {
+      const Entry& entry = entries[i];
+      if (!isKnown(entry)) {
+        return false;
+      }
+      // The master stopped sending it, e.g. a sleeping node.
+      if (entry.is_overdue) {
+        continue;
+      }
+      const int32 until = (int32)(entry.last_break_ticks 
+          + entry.period.period_ticks - now);
+      if (until <= 0) {
+        *ticks = 0;
+        return true;
+      }
+      if ((uint32)until < result) {
+        result = until;
+      }
+    }
+    *ticks = result;
+    return true;
+  }
+
+  boolean isOverdue(uint8 id) {
+    const Entry* const entry = findEntry(id);
+    return entry && entry->is_overdue;
+  }
+
+  void requestDump() {
+    next_dump_index = 0;
+  }
+
+  // Print ticks as millis with two decimal digits.
+  static void printTicksAsMillis(uint32 ticks) {
+    const uint32 hundredths = (ticks * 100) / hardware_clock::kTicksPerMilli;
+    sio::printu32(hundredths / 100);
+    sio::printchar('.');
+    const uint8 fraction = hundredths % 100;
+    if (fraction < 10) {
+      sio::printchar('0');
+    }
+    sio::printu16(fraction);
+  }
+
+  static void loopDump() {
+    if (next_dump_index >= num_entries) {
+      next_dump_index = kMaxIds;
+      return;
+    }
+    if (!sio::beginRecord(80)) {
+      return;
+    }
+    const Entry& entry = entries[next_dump_index++];
+    const Period& period = entry.period;
+    sio::print(F("period "));
+    sio::printhex2(entry.id);
+    if (!isKnown(entry)) {
+      sio::println(F(": unknown"));
+      return;
+    }
+    sio::print(F(": "));
+    printTicksAsMillis(period.period_ticks);
+    sio::print(F(" ms, jitter "));
+    printTicksAsMillis(period.jitter_ticks);
+    sio::print(F(", min "));
+    printTicksAsMillis(period.min_ticks);
+    sio::print(F(", max "));
+    printTicksAsMillis(period.max_ticks);
+    sio::print(F(", missed "));
+    sio::printu16(period.missed);
+    sio::println();
+  }
+
+  void loop() {
+    if (!custom_defs::kTrackFramePeriods) {
+      return;
+    }
+    // Flag the ids whose frame is a period and a half late, once per entry
+    // per frame.
+    const uint32 now = hardware_clock::ticks32ForNonIsr();
+    for (uint8 i = 0; i < num_entries; i++) {
+      Entry& entry = entries[i];
+      if (entry.is_overdue || !isKnown(entry)) {
+        continue;
+      }
+      const uint32 period_ticks = entry.period.period_ticks;
+      if (now - entry.last_break_ticks > period_ticks + (period_ticks >> 1)) {
+        entry.is_overdue = true;
+      }
+    }
+    if (next_dump_index < kMaxIds) {
+      loopDump();
+    }
+  }
+}  // namespace frame_periods
@@ -0,0 +1,86 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef FRAME_PERIODS_H
+#define FRAME_PERIODS_H
+
+#include "avr_util.h"
+#include "lin_frame.h"
+
+// Schedule reconstruction. The master sends each id from a fixed schedule 
+// table, so the break times of an id are periodic. Tracks, for the first 
+// kMaxIds ids seen, the period (EWMA of the break to break times), its 
+// jitter (EWMA of the deviation from the period) and min/max, and counts 
+// the missed slots, breaks that came a whole period or more late. From 
+// these the time of the next frame of an id, and so the latency of an 
+// injection into it, can be predicted.
+//
+// Times are in hardware clock ticks (4 usecs, 0.5 with the fine clock). Periods longer than about 
+// a second are not tracked. A measured period could also serve as the 
+// report ttl of the signals of the frame (see SignalTracker), instead of 
+// the hand set constants of custom_signals.h.
+//
+// Enabled with custom_defs::kTrackFramePeriods. Requires the frame
+// timestamps, so not with kUsePackedFrameRing.
+namespace frame_periods {
+  // Max number of tracked ids.
+  static const uint8 kMaxIds = 8;
+
+  // The period of an id.
+  struct Period {
+    // EWMA of the period and of its absolute deviation, in ticks.
+    uint32 period_ticks;
+    uint32 jitter_ticks;
+    // Shortest and longest periods seen, in ticks.
+    uint32 min_ticks;
+    uint32 max_ticks;
+    // Number of periods measured, saturating.
+    uint16 periods;
+    // Number of missed slots, saturating.
+    uint16 missed;
+  };
+
+  // Call once during initialization.
+  extern void setup();
+
+  // Main loop task. Flags the overdue ids and prints the lines of a 
+  // requested dump.
+  extern void loop();
+
+  // Call for each received frame.
+  extern void frameArrived(const LinFrame& frame);
+
+  // If the period of the given protected id is known, set *period and 
+  // return true.
+  extern boolean getPeriod(uint8 id, Period* period);
+
+  // Returns the ticks from now until the expected break of the next frame 
+  // of the given protected id, or a negative value if it is late. Returns
+  // false if its period is not known yet.
+  extern boolean ticksUntilNext(uint8 id, int32* ticks);
+
+  // Returns in *ticks the ticks from now until the earliest expected break
+  // of the tracked ids that are not overdue, zero if one of them is late. 
+  // Returns false if no id is tracked or the period of one of them is not
+  // known yet, in which case the schedule can't be predicted.
+  extern boolean ticksUntilAnyNext(uint32* ticks);
+
+  // True if the frame of the given protected id is more than a period and 
+  // a half late. Cleared when it arrives.
+  extern boolean isOverdue(uint8 id);
+
+  // Print the periods, a line per id per call of loop() as the serial 
+  // output has room.
+  extern void requestDump();
+}  // namespace frame_periods
+
+#endif
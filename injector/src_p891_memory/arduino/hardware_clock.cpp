@@ -16,6 +16,9 @@
 #include "avr_util.h"
 
 namespace hardware_clock {
+  namespace private_ {
+    volatile uint16 overflow_count;
+  }
 
 #if F_CPU != 16000000
 #error "The existing code assumes 16Mhz CPU clk."
@@ -26,16 +29,29 @@ void setup() {
     TCCR1A = L(COM1A1) | L(COM1A0) | L(COM1B1) | L(COM1B0) | L(WGM11) | L(WGM10);
     // Prescaler: X64 (250 clocks per ms @ 16MHz). 2^16 clock cycle every ~260ms.
     // This also defines the max update() interval to avoid missing a counter overflow. 
-    TCCR1B = L(ICNC1) | L(ICES1) | L(WGM13) | L(WGM12) | L(CS12) | H(CS11) | H(CS10);
+    // With the fine clock X8 (2000 clocks per ms), 2^16 clock cycle every ~33ms.
+    if (custom_defs::kUseFineHardwareClock) {
+      TCCR1B = L(ICNC1) | L(ICES1) | L(WGM13) | L(WGM12) | L(CS12) | H(CS11) | L(CS10);
+    } else {
+      TCCR1B = L(ICNC1) | L(ICES1) | L(WGM13) | L(WGM12) | L(CS12) | H(CS11) | H(CS10);
+    }
     // Clear counter.
     TCNT1 = 0;
     // Compare A. Not used.
     OCR1A = 0;
     // Compare B. Used to output cycle pulses, for debugging.
     OCR1B = 0;
-    // Diabled interrupts.
-    TIMSK1 = L(ICIE1) | L(OCIE1B) | L(OCIE1A) | L(TOIE1);
-    TIFR1 = L(ICF1) | L(OCF1B) | L(OCF1A) | L(TOV1);     
+    // Only the overflow interrupt, for the 32 bit extension. 
+    TIMSK1 = L(ICIE1) | L(OCIE1B) | L(OCIE1A) | H(TOIE1);
+    // Clear pending overflow interrupt.
+    TIFR1 = L(ICF1) | L(OCF1B) | L(OCF1A) | H(TOV1);     
+    private_::overflow_count = 0;
+  }
+
+  // Interrupt on timer 1 overflow, every ~260ms (~33ms with the fine clock).
+  ISR(TIMER1_OVF_vect)
+  {
+    private_::overflow_count++;
   }
   
 }  // namespace hardware_clock
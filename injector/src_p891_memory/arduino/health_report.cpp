@@ -0,0 +1,96 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "health_report.h"
+
+#include "custom_defs.h"
+#include "sio.h"
+#include "stack_monitor.h"
+#include "system_clock.h"
+#include "task_scheduler.h"
+#include "timer_wheel.h"
+#include "trace.h"
+
+namespace health_report {
+  namespace private_ {
+    uint16 frames;
+  }
+
+  // Record type of the health records, in the high nibble of the first byte.
+  static const uint8 kHealthRecordType = 6;
+
+  typedef char HealthRecordTooLong[(kRecordBytes <= trace::kMaxRecordBytes) ? 1 : -1];
+
+  // True when a record is due.
+  static boolean is_pending;
+
+  // The system clock at the previous record.
+  static uint32 last_record_millis;
+
+  // Called every kHealthReportMillis.
+  static void requestRecord() {
+    is_pending = true;
+  }
+
+  void setup() {
+    if (!custom_defs::kUseHealthReport) {
+      return;
+    }
+    last_record_millis = system_clock::timeMillis();
+    timer_wheel::start(custom_defs::kHealthReportMillis, 
+        custom_defs::kHealthReportMillis, requestRecord);
+  }
+
+  static inline uint8* putU16(uint8* p, uint16 value) {
+    *p++ = value;
+    *p++ = value >> 8;
+    return p;
+  }
+
+  static void sendRecord() {
+    const uint32 now_millis = system_clock::timeMillis();
+    const uint32 period_millis = now_millis - last_record_millis;
+    last_record_millis = now_millis;
+    const uint32 frames_per_second = period_millis 
+        ? (uint32)private_::frames * 1000 / period_millis : 0;
+    private_::frames = 0;
+
+    lin_processor::Stats stats;
+    lin_processor::getStats(&stats, false);
+
+    uint8 record[kRecordBytes];
+    uint8* p = record;
+    const uint32 uptime_seconds = now_millis / 1000;
+    p = putU16(p, uptime_seconds);
+    p = putU16(p, uptime_seconds >> 16);
+    p = putU16(p, (frames_per_second > 0xffff) ? 0xffff : frames_per_second);
+    for (uint8 i = 0; i < lin_processor::kNumErrorTypes; i++) {
+      p = putU16(p, stats.errors[i]);
+    }
+    p = putU16(p, custom_defs::kTrackLoopLatency 
+        ? task_scheduler::loopStats().max_ticks : 0);
+    *p++ = lin_processor::getAndClearMaxIsrTicks();
+    p = putU16(p, stack_monitor::minFreeBytes());
+    p = putU16(p, sio::droppedRecords());
+    trace::sendRecord(kHealthRecordType << 4, record, p - record);
+  }
+
+  void loop() {
+    if (!custom_defs::kUseHealthReport || !is_pending) {
+      return;
+    }
+    if (sio::beginRecord(trace::maxRecordPrintedBytes(kRecordBytes))) {
+      is_pending = false;
+      sendRecord();
+    }
+  }
+}  // namespace health_report
@@ -0,0 +1,66 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HEALTH_REPORT_H
+#define HEALTH_REPORT_H
+
+#include "avr_util.h"
+#include "lin_frame.h"
+#include "lin_processor.h"
+
+// A fixed format binary record of the device health, sent every 
+// custom_defs::kHealthReportMillis for the monitoring of installed 
+// devices. Sent with trace::sendRecord(), as the COBS encoding of
+//   [0]        record type HEALTH (6) in bits [7:4].
+//   [1..4]     uptime in seconds.
+//   [5..6]     valid frames per second since the previous record.
+//   [7..20]    the lin_processor error counters, a uint16 per error type,
+//              since setup. Saturate.
+//   [21..22]   max main loop iteration in hardware clock ticks (4us, or 0.5us
+//              with custom_defs::kUseFineHardwareClock) since the last loop
+//              latency dump, with custom_defs::kTrackLoopLatency.
+//   [23]       max ISR run time in ticks since the previous record, with 
+//              custom_defs::kProfileIsr.
+//   [24..25]   the lowest free RAM margin in bytes, see stack_monitor.h.
+//   [26..27]   free running count of the sio records dropped.
+//   [last]     CRC-8 of the bytes above.
+// Multi byte fields are little endian. Zero if not collected. Decoded by 
+// tools/serial/serial_dump.py --binary=1 as a 'health' line. A record 
+// that does not fit the serial output is retried on the next loop.
+//
+// Enabled with custom_defs::kUseHealthReport.
+namespace health_report {
+  // Number of bytes of the record, after its first byte and without the CRC.
+  static const uint8 kRecordBytes = 
+      4 + 2 + 2 * lin_processor::kNumErrorTypes + 2 + 1 + 2 + 2;
+
+  namespace private_ {
+    // Valid frames since the previous record. Saturates.
+    extern uint16 frames;
+  }
+
+  // Call once from setup(), after timer_wheel::setup().
+  extern void setup();
+
+  // Main loop task. Sends the pending record when the serial output has
+  // room.
+  extern void loop();
+
+  // Call with each valid frame.
+  inline void frameArrived() {
+    if (private_::frames != 0xffff) {
+      private_::frames++;
+    }
+  }
+}  // namespace health_report
+
+#endif
@@ -13,99 +13,76 @@
 #ifndef IO_PINS_H
 #define IO_PINS_H
 
+#include <avr/io.h>
 #include "avr_util.h"
 
+// Digital I/O pins with compile time port and bit. For example
+//
+//   typedef io_pins::Pin<io_pins::PortB, 0> led_pin;
+//   led_pin::setupOutput(false);
+//   led_pin::setHigh();
+//
+// The port registers are in the AVR I/O space, so with a constant port and 
+// bit setHigh(), setLow() and toggle() compile to a single sbi or cbi and 
+// isHigh() to sbic/sbis. These instructions are atomic, so the pins can be
+// changed from both the main and ISRs without disabling interrupts, and a
+// pin takes no RAM.
 namespace io_pins {
-  // A class to abstract an output pin that is not necesarily an arduino 
-  // digital pin. Also optimized for fast setOn/Off.
-  //
-  // Assumes that interrupts are enabled and thus should not be called
-  // from ISRs.
-  class OutputPin {
-   public:
-    // port is either PORTB, PORTC, or PORTD.
-    // bit index is one of [7, 6, 5, 4, 3, 2, 1, 0] (lsb).
-    // NOTE: ddr port is is always one address below portx.
-    // NOTE: pin port is is always two addresses below portx.
-    OutputPin(volatile uint8& port, uint8 bitIndex) :
-    port_(port),
-    pin_(*((&port)-2)),
-    bit_mask_(1 << bitIndex) {
-      // NOTE: ddr port is is always one address below port.
-      volatile uint8& ddr = *((&port)-1);
-      ddr |= bit_mask_;
-      low();  // default state.
-    } 
-
-    inline void high() {
-      // Wrapping in cli/sei in case any pin of this port is changed
-      // from an ISR. Keeping this as short as possible to avoid jitter
-      // in the ISR invocation.
-      cli();
-      port_ |= bit_mask_;
-      sei();
+// Accessors of the registers of a port, for Pin's Port parameter.
+#define IO_PINS_DEFINE_PORT(name, port_letter) \
+  struct name { \
+    static inline volatile uint8& port() { return PORT ## port_letter; } \
+    static inline volatile uint8& ddr() { return DDR ## port_letter; } \
+    static inline volatile uint8& pin() { return PIN ## port_letter; } \
+  };
+  IO_PINS_DEFINE_PORT(PortB, B)
+  IO_PINS_DEFINE_PORT(PortC, C)
+  IO_PINS_DEFINE_PORT(PortD, D)
+#undef IO_PINS_DEFINE_PORT
+
+  // Port is one of PortB, PortC, PortD. kBit is one of [7, 6, 5, 4, 3, 2, 
+  // 1, 0] (lsb).
+  template <class Port, uint8 kBit>
+  struct Pin {
+    static const uint8 kPinMask = H(kBit);
+
+    // Make the pin an output with the given initial level.
+    static inline void setupOutput(boolean is_high) {
+      set(is_high);
+      Port::ddr() |= kPinMask;
     }
 
-    inline void low() {
-      // Wrapping in cli/sei in case any pin of this port is changed
-      // from an ISR. Keeping this as short as possible to avoid jitter
-      // in the ISR invocation.
-      cli();
-      port_ &= ~bit_mask_;
-      sei();
+    // Make the pin an input with active pullup.
+    static inline void setupInput() {
+      Port::ddr() &= ~kPinMask;
+      Port::port() |= kPinMask;
     }
 
-    inline void set(boolean v) {
-      if (v) {
-        high();
-      } 
-      else {
-        low();
-      }
+    static inline void setHigh() {
+      Port::port() |= kPinMask;
     }
 
-    inline void toggle() {
-      set(!isHigh());
+    static inline void setLow() {
+      Port::port() &= ~kPinMask;
     }
 
-    inline boolean isHigh() {
-      return pin_ & bit_mask_;
+    static inline void set(boolean is_high) {
+      if (is_high) {
+        setHigh();
+      } else {
+        setLow();
+      }
     }
 
-   private:
-    volatile uint8& port_;
-    volatile uint8& pin_;
-    const uint8 bit_mask_;
-  };
-
-  // A class to abstract an input pin that is not necesarily an arduino 
-  // digital pin. Also optimized for quick access.
-  class InputPin {
-   public:
-    // See OutputPin() for description of the args.
-    InputPin(volatile uint8& port, uint8 bitIndex) 
-    : 
-      pin_(*((&port)-2)),
-      bit_mask_(1 << bitIndex) { 
-        volatile uint8& ddr = *((&port)-1);
-        ddr &= ~bit_mask_;  // input
-        port |= bit_mask_;  // pullup
-      } 
-
-    inline boolean isHigh() {
-      return pin_ & bit_mask_;
+    // Writing a one to the PIN register toggles the output.
+    static inline void toggle() {
+      Port::pin() = kPinMask;
     }
 
-   private:
-    volatile uint8& pin_;
-    const uint8 bit_mask_;
+    static inline boolean isHigh() {
+      return Port::pin() & kPinMask;
+    }
   };
-  
 }  // namespace io_pins
 
 #endif
-
-
-
-
-
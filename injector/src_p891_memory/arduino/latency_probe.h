@@ -0,0 +1,129 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef LATENCY_PROBE_H
+#define LATENCY_PROBE_H
+
+#include "avr_util.h"
+#include "hardware_clock.h"
+#include "sio.h"
+
+// Measures the latency from a trigger event to the first response event,
+// for example from an injected button press to the LED that it turns on.
+// Times are hardware clock ticks, typically frame end_ticks() so the 
+// latency does not include the main loop delays. Keeps the min, average 
+// and max of the measured latencies.
+//
+// A response that did not arrive within the timeout is counted as missed.
+class LatencyProbe {
+public:
+  explicit LatencyProbe(uint16 timeout_millis) 
+  :
+    timeout_ticks_(timeout_millis * hardware_clock::kTicksPerMilli),
+    is_armed_(false),
+    count_(0),
+    missed_(0),
+    last_millis_(0),
+    min_millis_(0xffff),
+    max_millis_(0),
+    sum_millis_(0) {
+  }
+
+  // Start a measurement at the given time, unless already measuring.
+  inline void trigger(uint32 ticks) {
+    expireIfTimedOut(ticks);
+    if (is_armed_) {
+      return;
+    }
+    trigger_ticks_ = ticks;
+    is_armed_ = true;
+  }
+
+  // Ends the measurement with a response at the given time. Returns true
+  // if a latency was recorded, then lastMillis() is its value.
+  inline boolean respond(uint32 ticks) {
+    expireIfTimedOut(ticks);
+    if (!is_armed_) {
+      return false;
+    }
+    is_armed_ = false;
+    last_millis_ = (ticks - trigger_ticks_) / hardware_clock::kTicksPerMilli;
+    count_++;
+    sum_millis_ += last_millis_;
+    if (last_millis_ < min_millis_) {
+      min_millis_ = last_millis_;
+    }
+    if (last_millis_ > max_millis_) {
+      max_millis_ = last_millis_;
+    }
+    return true;
+  }
+
+  // True if triggered and waiting for a response.
+  inline boolean isArmed() const {
+    return is_armed_;
+  }
+
+  inline uint16 lastMillis() const {
+    return last_millis_;
+  }
+
+  inline uint16 count() const {
+    return count_;
+  }
+
+  inline uint16 missed() const {
+    return missed_;
+  }
+
+  // The min, average and max are valid only if count() > 0.
+  inline uint16 minMillis() const {
+    return min_millis_;
+  }
+
+  inline uint16 avgMillis() const {
+    return count_ ? sum_millis_ / count_ : 0;
+  }
+
+  inline uint16 maxMillis() const {
+    return max_millis_;
+  }
+
+  // Print a line with the last latency and the stats, with the given
+  // name as a prefix.
+  void print(const __FlashStringHelper* name) const {
+    sio::out << name << F(" latency ") << last_millis_ << F(" ms (n=") << count_ 
+        << F(" min=") << min_millis_ << F(" avg=") << avgMillis() << F(" max=") 
+        << max_millis_ << F(" missed=") << missed_ << F(")\n");
+  }
+
+private:
+  inline void expireIfTimedOut(uint32 ticks) {
+    if (is_armed_ && (ticks - trigger_ticks_) > timeout_ticks_) {
+      is_armed_ = false;
+      missed_++;
+    }
+  }
+
+  const uint32 timeout_ticks_;
+  uint32 trigger_ticks_;
+  boolean is_armed_;
+
+  uint16 count_;
+  uint16 missed_;
+  uint16 last_millis_;
+  uint16 min_millis_;
+  uint16 max_millis_;
+  uint32 sum_millis_;
+};
+
+#endif
@@ -12,11 +12,115 @@
 
 #include "leds.h"
 
+#include <avr/pgmspace.h>
+#include "timer_wheel.h"
+
 namespace leds {
-  io_pins::OutputPin status(PORTD, 7);
-  ActionLed frames(PORTB, 0);
-  ActionLed errors(PORTB, 1);
-}  // namepsace leds
+  namespace private_ {
+    uint8 pending_actions;
+  }
+
+  // Pattern times are in timer_wheel ticks. After period_ticks a repeating
+  // pattern starts over and a pulse pattern waits for the next action.
+  struct Pattern {
+    uint8 on_ticks;
+    uint8 period_ticks;
+    boolean repeat;
+  };
+
+  // Indexed by patterns.
+  static const Pattern kPatterns[] PROGMEM = {
+    { 0, 1, true },    // OFF
+    { 1, 1, true },    // ON
+    { 2, 5, false },   // PULSE
+    { 50, 100, true }, // BLINK_SLOW
+  };
+
+  typedef char PatternsTableSize[(ARRAY_SIZE(kPatterns) == patterns::kNumPatterns) ? 1 : -1];
+
+  // The leds, active high. Indexed by ids.
+  static const uint8 kPortB = 0;
+  static const uint8 kPortD = 1;
+  struct Led {
+    uint8 port;
+    uint8 mask;
+  };
+  static const Led kLeds[] PROGMEM = {
+    { kPortB, H(0) },  // FRAMES
+    { kPortB, H(1) },  // ERRORS
+    { kPortD, H(7) },  // STATUS
+  };
 
+  typedef char LedsTableSize[(ARRAY_SIZE(kLeds) == ids::kNumLeds) ? 1 : -1];
 
+  // The pattern of each led and the ticks since its start, up to its 
+  // period_ticks.
+  static uint8 led_patterns[ids::kNumLeds];
+  static uint8 led_phases[ids::kNumLeds];
 
+  // The led bits of each port.
+  static uint8 port_b_mask;
+  static uint8 port_d_mask;
+
+  // Write the levels of all the leds. Other pins of the ports may be 
+  // written by ISRs, so each port is a read-modify-write with interrupts
+  // disabled, a few cycles per port.
+  static inline void writeLevels(uint8 port_b_levels, uint8 port_d_levels) {
+    const uint8 sreg = SREG;
+    cli();
+    PORTB = (PORTB & ~port_b_mask) | port_b_levels;
+    PORTD = (PORTD & ~port_d_mask) | port_d_levels;
+    SREG = sreg;
+  }
+
+  // Called by the timer wheel, every tick.
+  static void tick() {
+    uint8 levels[2] = { 0, 0 };
+    for (uint8 i = 0; i < ids::kNumLeds; i++) {
+      Pattern pattern;
+      memcpy_P(&pattern, &kPatterns[led_patterns[i]], sizeof(pattern));
+      uint8 phase = led_phases[i];
+      // An ended pulse, restarted by a pending action. Actions during a 
+      // pulse wait for its end.
+      if (phase >= pattern.period_ticks && (private_::pending_actions & bitMask(i))) {
+        private_::pending_actions &= ~bitMask(i);
+        phase = 0;
+      }
+      if (phase < pattern.on_ticks) {
+        levels[pgm_read_byte(&kLeds[i].port)] |= pgm_read_byte(&kLeds[i].mask);
+      }
+      if (phase < pattern.period_ticks) {
+        phase++;
+        if (phase == pattern.period_ticks && pattern.repeat) {
+          phase = 0;
+        }
+      }
+      led_phases[i] = phase;
+    }
+    writeLevels(levels[kPortB], levels[kPortD]);
+  }
+
+  void setup() {
+    for (uint8 i = 0; i < ids::kNumLeds; i++) {
+      const uint8 mask = pgm_read_byte(&kLeds[i].mask);
+      if (pgm_read_byte(&kLeds[i].port) == kPortB) {
+        port_b_mask |= mask;
+      } else {
+        port_d_mask |= mask;
+      }
+      setPattern(i, patterns::PULSE);
+    }
+    writeLevels(0, 0);
+    DDRB |= port_b_mask;
+    DDRD |= port_d_mask;
+    timer_wheel::start(timer_wheel::kTickMillis, timer_wheel::kTickMillis, tick);
+  }
+
+  void setPattern(uint8 led_id, uint8 pattern) {
+    led_patterns[led_id] = pattern;
+    private_::pending_actions &= ~bitMask(led_id);
+    // A pulse pattern starts ended, waiting for an action.
+    led_phases[led_id] = pgm_read_byte(&kPatterns[pattern].repeat) 
+        ? 0 : pgm_read_byte(&kPatterns[pattern].period_ticks);
+  }
+}  // namepsace leds
@@ -14,27 +14,50 @@
 #define LEDS_H
 
 #include "avr_util.h"
-#include "io_pins.h"
-#include "action_led.h"
 
-// Defines the three leds.
+// Drives the three leds. The levels of all the leds are computed on a 
+// 100Hz timer_wheel tick, from a table of blink patterns, and written with 
+// one short atomic read-modify-write per port.
 namespace leds {
-  // STATUS LED - indicates custom module and injector events.
-  extern io_pins::OutputPin status;
+  namespace ids {
+    // FRAMES LED - indicates normal activity.
+    static const uint8 FRAMES = 0;
+    // ERRORS LED - blinks when detecting errors.
+    static const uint8 ERRORS = 1;
+    // STATUS LED - indicates custom module and injector events.
+    static const uint8 STATUS = 2;
+    static const uint8 kNumLeds = 3;
+  }
+
+  namespace patterns {
+    static const uint8 OFF = 0;
+    static const uint8 ON = 1;
+    // A 20ms pulse per action() followed by a 30ms blackout before the next
+    // pulse. Visible regardless of the event frequency and duration.
+    static const uint8 PULSE = 2;
+    // 500ms on, 500ms off.
+    static const uint8 BLINK_SLOW = 3;
+    static const uint8 kNumPatterns = 4;
+  }
 
-  // FRAMES LED - indicates normal activity.
-  extern ActionLed frames;
+  namespace private_ {
+    // Bit i is set if led i has a pending action. 
+    extern uint8 pending_actions;
+  }
 
-  // ERRORS LED - blinks when detecting errors.
-  extern ActionLed errors;
+  // Call once from main setup(), after timer_wheel::setup(). All the leds
+  // start off, with the PULSE pattern.
+  extern void setup();
 
-  // Called from the main loop()
-  inline void loop() {
-    frames.loop();
-    errors.loop();  
+  // Request a pulse of a PULSE led. Called from main only. Cheap, the pulse
+  // starts on the next tick.
+  inline void action(uint8 led_id) {
+    private_::pending_actions |= bitMask(led_id);
   }
+
+  // Set the pattern of the led, one of patterns. Repeating patterns start 
+  // on the next tick.
+  extern void setPattern(uint8 led_id, uint8 pattern);
 }  // namepsace leds
 
 #endif
-
-
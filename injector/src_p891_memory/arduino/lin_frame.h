@@ -13,7 +13,9 @@
 #ifndef LIN_FRAME_H
 #define LIN_FRAME_H
 
+#include <avr/pgmspace.h>
 #include "avr_util.h"
+#include "custom_defs.h"
 
 // A buffer for a single frame.
 class LinFrame {
@@ -29,27 +31,120 @@ public:
   // Number of bytes in the longest frame. One ID byte, 8 data bytes, one checksum byte.
   static const uint8 kMaxBytes = 1 + 8 + 1;
 
-  // Compute the to checkum bits [P1,P0] of the lin id in bits [5:0] and return
-  // [P1,P0][5:0] which is the wire representation of this id.
-  static uint8 setLinIdChecksumBits(uint8 id);
+  // Return the protected id [P1,P0][5:0] of the lin id in bits [5:0], which 
+  // is the wire representation of this id. Bits [7:6] of id are ignored.
+  // Table based, can be called from ISRs.
+  static inline uint8 pid(uint8 id) {
+    return pgm_read_byte(&kPidTable[id & 0x3f]);
+  }
+
+  // True if the parity bits of the given id byte are valid.
+  static inline boolean isValidPid(uint8 id_byte) {
+    return pid(id_byte) == id_byte;
+  }
+
+  // Return the 6 bit lin id of an id byte. Use this to index per id tables.
+  static inline uint8 idFromPid(uint8 id_byte) {
+    return id_byte & 0x3f;
+  }
+
+  // Checksum models. Classic (LIN 1.x) sums only the data bytes, enhanced
+  // (LIN 2.x) sums also the protected id byte.
+  static const uint8 kChecksumUnknown = 0;
+  static const uint8 kChecksumClassic = 1;
+  static const uint8 kChecksumEnhanced = 2;
+
+  // Set the checksum model of the given id. A preset model is never changed
+  // by learning. Passing kChecksumUnknown lets the id learn again.
+  static void setChecksumModel(uint8 id, uint8 model);
+
+  // Return the checksum model of the given id. One of kChecksumUnknown, 
+  // kChecksumClassic or kChecksumEnhanced. The diagnostic ids 0x3c and 0x3d
+  // always use the classic model. Can be called from ISRs.
+  static inline uint8 checksumModel(uint8 id) {
+    const uint8 id6 = idFromPid(id);
+    if (id6 >= 0x3c && id6 <= 0x3d) {
+      return kChecksumClassic;
+    }
+    return checksum_models_[id6] & kChecksumModelMask;
+  }
+
+  // True if the checksum of the given id includes the id byte. Ids with 
+  // unknown model use custom_defs::kUseLinChecksumVersion2. Can be called
+  // from ISRs.
+  static inline boolean isEnhancedChecksum(uint8 id) {
+    const uint8 model = checksumModel(id);
+    if (model == kChecksumUnknown) {
+      return custom_defs::kUseLinChecksumVersion2;
+    }
+    return model == kChecksumEnhanced;
+  }
   
-  boolean isValid() const;
+  // If the checksum model of the frame's id is not known yet and 
+  // custom_defs::kLearnChecksumModels is true, the model that validates the
+  // frame is remembered for the id. The result is cached in the frame, call 
+  // only once the frame is complete.
+  inline boolean isValid() const {
+    if (!(num_bytes_ & kValidityKnownFlag)) {
+      num_bytes_ |= checkValid() 
+          ? (kValidityKnownFlag | kValidFlag) : kValidityKnownFlag;
+    }
+    return num_bytes_ & kValidFlag;
+  }
   
-  // Compute LIN frame checksum. Assuming buffer has at least one byte. A valid 
-  // frame should contain one byte for id, 1-8 bytes for data, one byte for checksum.
-  uint8 computeChecksum() const;
+  // Mark the frame invalid regardless of its bytes, e.g. when one of its 
+  // bits was sampled late. Called from ISR, before the frame is published.
+  inline void setInvalid() {
+    num_bytes_ = (num_bytes_ & ~kValidFlag) | kValidityKnownFlag;
+  }
+
+  // Compute LIN frame checksum using the checksum model of the frame's id. 
+  // Assuming buffer has at least one byte. A valid frame should contain one 
+  // byte for id, 1-8 bytes for data, one byte for checksum.
+  // O(1), the sum is accumulated as the bytes are appended.
+  inline uint8 computeChecksum() const {
+    return isEnhancedChecksum(bytes_[0]) 
+        ? enhancedChecksum() : classicChecksum();
+  }
+
+  // Checksum of the frame's data bytes per the classic model.
+  inline uint8 classicChecksum() const {
+    return (uint8)(~sum_);
+  }
+
+  // Checksum of the frame's id and data bytes per the enhanced model.
+  inline uint8 enhancedChecksum() const {
+    uint16 sum = sum_ + bytes_[0];
+    if (sum & 0xff00) {
+      sum = (sum & 0xff) + 1;
+    }
+    return (uint8)(~sum);
+  }
 
   inline void reset() {
     num_bytes_ = 0;
-    has_injected_bits_ = false;
+    sum_ = 0;
   }
   
+  // For recieved frames, this is true if the frame had signal injection. That
+  // is, the injector forced a 0 or 1 bit, regardless if the original value of 
+  // the bit was the same or not.
   inline boolean hasInjectedBits() const {
-    return has_injected_bits_;
+    return num_bytes_ & kInjectedBitsFlag;
+  }
+
+  // True if the response (data and checksum bytes) came from the slave side 
+  // (lin2) or was substituted by the injector, false if from the master side.
+  inline boolean isSlaveResponse() const {
+    return num_bytes_ & kSlaveResponseFlag;
+  }
+
+  inline void setSlaveResponse() {
+    num_bytes_ |= kSlaveResponseFlag;
   }
 
   inline uint8 num_bytes() const {
-    return num_bytes_;
+    return num_bytes_ & kNumBytesMask;
   }
   
   // Get a the frame byte of given inde.
@@ -63,25 +158,84 @@ public:
   
   // Caller should check that num_bytes < kMaxBytes;
   inline void append_byte(uint8 value, boolean byte_has_injected_bits) {
-    bytes_[num_bytes_++] = value;
-    has_injected_bits_ |= byte_has_injected_bits;
+    // The last byte is assumed to be the checksum, so we sum the previous 
+    // byte. The ID byte is not included, enhancedChecksum() adds it.
+    const uint8 n = num_bytes();
+    if (n > 1) {
+      uint16 sum = sum_ + bytes_[n - 1];
+      // End around carry.
+      if (sum & 0xff00) {
+        sum = (sum & 0xff) + 1;
+      }
+      sum_ = sum;
+    }
+    bytes_[n] = value;
+    // Does not overflow into the flags since n < kMaxBytes.
+    num_bytes_++;
+    if (byte_has_injected_bits) {
+      num_bytes_ |= kInjectedBitsFlag;
+    }
+  }
+  
+  // Hardware clock time (hardware_clock::ticks32ForIsr()) of the end of 
+  // the break, that is, the begining of the break delimiter. Set by the ISR.
+  inline uint32 break_ticks() const {
+    return break_ticks_;
+  }
+
+  // Hardware clock time of the end of the last byte of the frame. Set by
+  // the ISR.
+  inline uint32 end_ticks() const {
+    return end_ticks_;
+  }
+
+  inline void set_break_ticks(uint32 ticks) {
+    break_ticks_ = ticks;
+  }
+
+  inline void set_end_ticks(uint32 ticks) {
+    end_ticks_ = ticks;
   }
   
   // TODO: make this stuff private without sacrifying performance.
   
 private:
-  // Number of bytes in bytes_ buffer. At most kMaxBytes.
-  uint8 num_bytes_;
+  // Protected id of each 6 bit id. In program memory.
+  static const uint8 kPidTable[64];
+
+  // Flag in checksum_models_ entries of models set by setChecksumModel().
+  static const uint8 kChecksumPreset = 0x80;
+  static const uint8 kChecksumModelMask = 0x03;
+
+  // Checksum model of each 6 bit id, with kChecksumPreset flag.
+  static uint8 checksum_models_[64];
+
+  // Flags in the high bits of num_bytes_.
+  static const uint8 kInjectedBitsFlag = H(7);
+  static const uint8 kSlaveResponseFlag = H(6);
+  static const uint8 kValidityKnownFlag = H(5);
+  static const uint8 kValidFlag = H(4);
+  static const uint8 kNumBytesMask = 0x0f;
+
+  // The full validity check, see isValid().
+  boolean checkValid() const;
+
+  // Number of bytes in bytes_ buffer, at most kMaxBytes, in bits [3:0] and 
+  // the flags above in bits [7:4]. Mutable for the isValid() cache.
+  mutable uint8 num_bytes_;
 
   // Recieved frame bytes. Includes id, data and checksum. Does not 
   // include the 0x55 sync byte.
   uint8 bytes_[kMaxBytes];
-  
-  // For recieved frames, this is true if the frame had signal injection. That is, the
-  // injector forced a 0 or 1 bit, regardless if the original value of the bit was
-  // the same or not.
-  boolean has_injected_bits_;
-};
+
+  // Checksum sum, with end around carry, of the data bytes before the last
+  // one.
+  uint8 sum_;
+
+  // See break_ticks() and end_ticks().
+  uint32 break_ticks_;
+  uint32 end_ticks_;
+  };
 
 #endif  
 
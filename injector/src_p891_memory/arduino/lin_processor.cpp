@@ -16,7 +16,9 @@
 
 #include "avr_util.h"
 #include "hardware_clock.h"
+#include "io_pins.h"
 #include "custom_injector.h"
+#include "proxy_self_test.h"
 
 // TODO: for debugging. Remove.
 #include "sio.h"
@@ -27,48 +29,21 @@
 static const uint16 kDefaultBaud = 9600;
 
 // Wait at most N bits from the end of the stop bit of previous byte
-// to the start bit of next byte.
-//
-// TODO: seperate values for pre response space (longer, e.g. 8) and pre
-// regular byte space (shorter, e.g. 4).
-//
-static const uint8 kMaxSpaceBits = 6;
-
-// Define an input pin with fast access. Using the macro does
-// not increase the pin access time compared to direct bit manipulation.
-// Pin is setup with active pullup.
-#define DEFINE_INPUT_PIN(name, port_letter, bit_index) \
-  namespace name { \
-    static const uint8 kPinMask  = H(bit_index); \
-    static inline void setup() { \
-      DDR ## port_letter &= ~kPinMask;  \
-      PORT ## port_letter |= kPinMask;  \
-    } \
-    static inline uint8 isHigh() { \
-      return  PIN##port_letter & kPinMask; \
-    } \
-  } 
- 
-// Define an output pin with fast access. Using the macro does
-// not increase the pin access time compared to direct bit manipulation.
-#define DEFINE_OUTPUT_PIN(name, port_letter, bit_index, initial_value) \
-  namespace name { \
-    static const uint8 kPinMask  = H(bit_index); \
-    static inline void setHigh() { \
-      PORT ## port_letter |= kPinMask; \
-    } \
-    static inline void setLow() { \
-      PORT ## port_letter &= ~kPinMask; \
-    } \
-    static inline void setup() { \
-      DDR ## port_letter |= kPinMask;  \
-      (initial_value) ? setHigh() : setLow(); \
-    } \
-  }  
-  
+// to the start bit of next byte. The space before the slave response
+// (after the id byte) is typically longer than between bytes.
+static const uint8 kMaxByteSpaceBits = 4;
+static const uint8 kMaxResponseSpaceBits = 8;
+
+// Number of idle bits the injector leaves between the id byte and a 
+// response it sends instead of the slave.
+static const uint8 kInjectedResponseSpaceBits = 1;
 
 namespace lin_processor {
 
+  // The clock ticks per bit are 8 bits, see Config.
+  typedef char FineHardwareClockRequiresFasterLinSpeed[
+      (hardware_clock::kTicksPerMilli * 1000) / custom_defs::kLinSpeed <= 0xff ? 1 : -1];
+
   class Config {
    public:
 #if F_CPU != 16000000
@@ -83,22 +58,42 @@ namespace lin_processor {
         baud = kDefaultBaud;
       }
       baud_ = baud; 
-      prescaler_x64_ = baud < 8000;
-      const uint8 prescaling = prescaler_x64_ ? 64 : 8;  
-      counts_per_bit_ = (((16000000L / prescaling) / baud));
+      // Use the smallest timer2 prescaling that fits a bit in 8 bits, for
+      // best resolution.
+      prescaling_ = 8;
+      if ((16000000L / 8) / baud > 255) {
+        prescaling_ = 32;
+      }
+      if ((16000000L / 32) / baud > 255) {
+        prescaling_ = 64;
+      }
+      counts_per_bit_ = (((16000000L / prescaling_) / baud));
+      // The fractional part of the bit time, in 1/256 counts. Spread over
+      // the bits by the ISR.
+      counts_per_bit_fraction_ = 
+          ((((16000000L / prescaling_) % baud) << 8) / baud);
       // Adding two counts to compensate for software delay.
       counts_per_half_bit_ = (counts_per_bit_ / 2) + 2;
       clock_ticks_per_bit_ = (hardware_clock::kTicksPerMilli * 1000) / baud;
       clock_ticks_per_half_bit_ = clock_ticks_per_bit_ / 2;
-      clock_ticks_per_until_start_bit_ = clock_ticks_per_bit_ * kMaxSpaceBits;
+      clock_ticks_until_byte_ = clock_ticks_per_bit_ * kMaxByteSpaceBits;
+      clock_ticks_until_response_ = clock_ticks_per_bit_ * kMaxResponseSpaceBits;
     }
 
     inline uint16 baud() const { 
       return baud_; 
     }
 
-    inline boolean prescaler_x64() {
-      return prescaler_x64_;
+    // Timer2 prescaling. One of 8, 32, 64.
+    inline uint8 prescaling() const {
+      return prescaling_;
+    }
+
+    // Timer2 prescaler select bits for prescaling().
+    inline uint8 prescaler_bits() const {
+      return (prescaling_ == 8) ? (L(CS22) | H(CS21) | L(CS20))
+          : (prescaling_ == 32) ? (L(CS22) | H(CS21) | H(CS20))
+          : (H(CS22) | L(CS21) | L(CS20));
     }
 
     inline uint8 counts_per_bit() const { 
@@ -107,80 +102,363 @@ namespace lin_processor {
     inline uint8 counts_per_half_bit() const { 
       return counts_per_half_bit_; 
     }
+    inline uint8 counts_per_bit_fraction() const { 
+      return counts_per_bit_fraction_; 
+    }
     inline uint8 clock_ticks_per_bit() const { 
       return clock_ticks_per_bit_; 
     }
     inline uint8 clock_ticks_per_half_bit() const { 
       return clock_ticks_per_half_bit_; 
     }
-    inline uint8 clock_ticks_per_until_start_bit() const { 
-      return clock_ticks_per_until_start_bit_; 
+    // Max space before a regular byte and before the slave response.
+    inline uint16 clock_ticks_until_byte() const { 
+      return clock_ticks_until_byte_; 
+    }
+    inline uint16 clock_ticks_until_response() const { 
+      return clock_ticks_until_response_; 
     }
    private:
     uint16 baud_;
-    // False -> x8, true -> x64.
-    // TODO: timer2 also have x32 scalingl Could use it for better 
-    // accuracy in the mid baude range.
-    boolean prescaler_x64_;
+    uint8 prescaling_;
     uint8 counts_per_bit_;
+    uint8 counts_per_bit_fraction_;
     uint8 counts_per_half_bit_;
     uint8 clock_ticks_per_bit_;
     uint8 clock_ticks_per_half_bit_;
-    uint8 clock_ticks_per_until_start_bit_;
+    uint16 clock_ticks_until_byte_;
+    uint16 clock_ticks_until_response_;
+  };
+
+  // Alternative to Config with the same interface, computed at compile time
+  // from the baud rate. Lets the compiler use immediate values in the ISR
+  // instead of loading them from RAM. Selected with custom_defs::kUseStaticLinConfig.
+  template <uint16 kBaud>
+  class StaticConfig {
+   public:
+    // Compile time check of the baud range (negative array size if out of range).
+    typedef char BaudOutOfRange[(kBaud >= 1000 && kBaud <= 20000) ? 1 : -1];
+
+    static const uint8 kPrescaling = ((16000000L / 8) / kBaud <= 255) ? 8
+        : ((16000000L / 32) / kBaud <= 255) ? 32 : 64;
+    static const uint8 kCountsPerBit = (16000000L / kPrescaling) / kBaud;
+    static const uint8 kCountsPerBitFraction = 
+        (((16000000L / kPrescaling) % kBaud) << 8) / kBaud;
+    // Adding two counts to compensate for software delay.
+    static const uint8 kCountsPerHalfBit = (kCountsPerBit / 2) + 2;
+    static const uint8 kClockTicksPerBit = (hardware_clock::kTicksPerMilli * 1000) / kBaud;
+    typedef char ClockTicksPerBitOutOfRange[
+        (hardware_clock::kTicksPerMilli * 1000) / kBaud <= 0xff ? 1 : -1];
+    static const uint8 kClockTicksPerHalfBit = kClockTicksPerBit / 2;
+    static const uint16 kClockTicksUntilByte = kClockTicksPerBit * kMaxByteSpaceBits;
+    static const uint16 kClockTicksUntilResponse = kClockTicksPerBit * kMaxResponseSpaceBits;
+
+    // Nothing to do, for compatibility with Config.
+    void setup() {
+    }
+
+    static inline uint16 baud() { 
+      return kBaud; 
+    }
+    static inline uint8 prescaling() {
+      return kPrescaling;
+    }
+    static inline uint8 prescaler_bits() {
+      return (kPrescaling == 8) ? (L(CS22) | H(CS21) | L(CS20))
+          : (kPrescaling == 32) ? (L(CS22) | H(CS21) | H(CS20))
+          : (H(CS22) | L(CS21) | L(CS20));
+    }
+    static inline uint8 counts_per_bit() { 
+      return kCountsPerBit; 
+    }
+    static inline uint8 counts_per_half_bit() { 
+      return kCountsPerHalfBit; 
+    }
+    static inline uint8 counts_per_bit_fraction() { 
+      return kCountsPerBitFraction; 
+    }
+    static inline uint8 clock_ticks_per_bit() { 
+      return kClockTicksPerBit; 
+    }
+    static inline uint8 clock_ticks_per_half_bit() { 
+      return kClockTicksPerHalfBit; 
+    }
+    static inline uint16 clock_ticks_until_byte() { 
+      return kClockTicksUntilByte; 
+    }
+    static inline uint16 clock_ticks_until_response() { 
+      return kClockTicksUntilResponse; 
+    }
+  };
+
+  // Selects Config or StaticConfig.
+  template <bool kUseStatic> 
+  struct ConfigSelector { 
+    typedef Config Type; 
+  };
+  template <> 
+  struct ConfigSelector<true> { 
+    typedef StaticConfig<custom_defs::kLinSpeed> Type; 
   };
 
   // The actual configurtion. Initialized in setup() based on baud rate.  
-  Config config;
+  static ConfigSelector<custom_defs::kUseStaticLinConfig>::Type config;
 
   // ----- Digital I/O pins
   //
-  // NOTE: we use direct register access instead the abstractions in io_pins.h. 
-  // This way we shave a few cycles from the ISR.
+  // NOTE: the io_pins::Pin templates compile to single sbi/cbi/sbic 
+  // instructions, same as direct register access.
     
   // Master LIN interface.
-  DEFINE_INPUT_PIN(rx1_pin, D, 2);
-  DEFINE_OUTPUT_PIN(tx1_pin, C, 2, 1);
+  typedef io_pins::Pin<io_pins::PortD, 2> rx1_pin;
+  typedef io_pins::Pin<io_pins::PortC, 2> tx1_pin;
   
-  // Slave LIN interface.  
-  DEFINE_INPUT_PIN(rx2_pin, C, 1);
-  DEFINE_OUTPUT_PIN(tx2_pin, D, 4, 1);
+  // Slave LIN interface. With custom_defs::kUseHardwareTxEdges, tx2 is on 
+  // OC2B (PD3) of the next board revision.
+  typedef io_pins::Pin<io_pins::PortC, 1> rx2_pin;
+  typedef io_pins::Pin<io_pins::PortD, 
+      custom_defs::kUseHardwareTxEdges ? 3 : 4> tx2_pin;
   
-  // Debugging signals.
-  DEFINE_OUTPUT_PIN(break_pin, C, 0, 0);
-  DEFINE_OUTPUT_PIN(sample_pin, B, 4, 0);
-  DEFINE_OUTPUT_PIN(error_pin, B, 3, 0);
-  DEFINE_OUTPUT_PIN(isr_pin, C, 3, 0);
-  DEFINE_OUTPUT_PIN(gp_pin, D, 6, 0);
+  // Debugging signals, per custom_defs::kIsrTracePolicy. The high and low
+  // edges are written as the given events, zero for none.
+  static inline void traceIsrEvent(uint8 event);
+
+  template <class Pin, uint8 kHighEvent, uint8 kLowEvent>
+  struct DebugSignal {
+    static inline void setupOutput(boolean is_high) {
+      if (custom_defs::kIsrTracePolicy == custom_defs::isr_trace_policies::PINS) {
+        Pin::setupOutput(is_high);
+      }
+    }
+
+    static inline void setHigh() {
+      if (custom_defs::kIsrTracePolicy == custom_defs::isr_trace_policies::PINS) {
+        Pin::setHigh();
+      } else if (custom_defs::kIsrTracePolicy == custom_defs::isr_trace_policies::RING
+          && kHighEvent) {
+        traceIsrEvent(kHighEvent);
+      }
+    }
+
+    static inline void setLow() {
+      if (custom_defs::kIsrTracePolicy == custom_defs::isr_trace_policies::PINS) {
+        Pin::setLow();
+      } else if (custom_defs::kIsrTracePolicy == custom_defs::isr_trace_policies::RING
+          && kLowEvent) {
+        traceIsrEvent(kLowEvent);
+      }
+    }
+  };
+
+  typedef DebugSignal<io_pins::Pin<io_pins::PortC, 0>,
+      isr_events::BREAK_START, isr_events::BREAK_END> break_pin;
+  typedef DebugSignal<io_pins::Pin<io_pins::PortB, 4>,
+      isr_events::SAMPLE_START, isr_events::SAMPLE_END> sample_pin;
+  typedef DebugSignal<io_pins::Pin<io_pins::PortB, 3>,
+      isr_events::ERROR, 0> error_pin;
+  typedef DebugSignal<io_pins::Pin<io_pins::PortC, 3>,
+      isr_events::ISR_START, isr_events::ISR_END> isr_pin;
+  typedef DebugSignal<io_pins::Pin<io_pins::PortD, 6>, 0, 0> gp_pin;
+
+  // The rx and tx bits as hard coded in the fast proxy tick ISR below.
+  static const uint8 kFastRx1Bit = 2;
+  static const uint8 kFastTx1Bit = 2;
+  static const uint8 kFastRx2Bit = 1;
+  static const uint8 kFastTx2Bit = custom_defs::kUseHardwareTxEdges ? 3 : 4;
+  typedef char FastProxyPinsMatchIoPins[(rx1_pin::kPinMask == H(kFastRx1Bit) &&
+      tx1_pin::kPinMask == H(kFastTx1Bit) && rx2_pin::kPinMask == H(kFastRx2Bit) &&
+      tx2_pin::kPinMask == H(kFastTx2Bit)) ? 1 : -1];
 
   // Called one during initialization.
   static inline void setupPins() {
-    rx1_pin::setup();
-    tx1_pin::setup();
-    rx2_pin::setup();
-    tx2_pin::setup();
-    break_pin::setup();
-    sample_pin::setup();
-    error_pin::setup();
-    isr_pin::setup();
-    gp_pin::setup();
+    rx1_pin::setupInput();
+    tx1_pin::setupOutput(true);
+    rx2_pin::setupInput();
+    tx2_pin::setupOutput(true);
+    break_pin::setupOutput(false);
+    sample_pin::setupOutput(false);
+    error_pin::setupOutput(false);
+    isr_pin::setupOutput(false);
+    gp_pin::setupOutput(false);
+  }
+
+  // ----- Statistics -----
+
+  // Written from ISR. Read/Write from main with interrupts disabled.
+  static Stats stats;
+
+  // Private. Called from ISR. 
+  static inline void incrementCounter(uint16* counter) {
+    // Saturate rather than wrapping around.
+    if (*counter != 0xffff) {
+      (*counter)++;
+    }
+  }
+
+  // Called from main. Public. Assumed interrupts are enabled. 
+  // Do not call from ISR.
+  void getStats(Stats* result, boolean clear) {
+    cli();
+    *result = stats;
+    if (clear) {
+      stats = Stats();
+    }
+    sei();
+  }
+
+  // ----- Queue Delay -----
+  //
+  // Used with custom_defs::kTrackQueueDelay. Written and read by main only, 
+  // the ISR does not touch these stats fields.
+  namespace queue_delay {
+    typedef char QueueDelayRequiresTimestamps[
+        (!custom_defs::kTrackQueueDelay || !custom_defs::kUsePackedFrameRing) ? 1 : -1];
+
+    // End ticks of the last counted frame, so a frame peeked more than once
+    // is counted once.
+    static uint32 last_end_ticks;
+
+    // Called when main takes a frame from the rx queue.
+    static inline void frameTaken(const LinFrame& frame) {
+      if (!custom_defs::kTrackQueueDelay || frame.end_ticks() == last_end_ticks) {
+        return;
+      }
+      last_end_ticks = frame.end_ticks();
+      const uint32 delta = hardware_clock::ticks32ForNonIsr() - last_end_ticks;
+      const uint16 ticks = delta > 0xffff ? 0xffff : delta;
+      uint8 bucket = 0;
+      for (uint16 t = ticks >> 6; t && bucket < kNumQueueDelayBuckets - 1; t >>= 1) {
+        bucket++;
+      }
+      incrementCounter(&stats.queue_delays[bucket]);
+      if (ticks > stats.max_queue_delay_ticks) {
+        stats.max_queue_delay_ticks = ticks;
+      }
+    }
+  }
+
+  // ----- Break Timing -----
+  //
+  // The lengths of the break and of the break delimiter of each header, in
+  // hardware clock ticks, from the rx1 edges: the falling edge that started
+  // the break, its rising edge and the falling edge of the sync start bit.
+  // Collected as histograms of bits, see BreakTiming. Written by ISR.
+  namespace break_timing {
+    // Clock ticks of the given number of bits at kLinSpeed (the baud rate 
+    // of the injector is fixed).
+    template <uint8 kBits>
+    struct BitTicks {
+      static const uint16 kValue = 
+          (kBits * hardware_clock::kTicksPerMilli * 1000L) / custom_defs::kLinSpeed;
+    };
+
+    // A longer low is a wake up pulse or a stuck bus, rather than a break.
+    static const uint8 kMaxBreakBits = 30;
+    // The max time from the end of the break to the sync start bit.
+    static const uint8 kMaxDelimiterBits = 16;
+
+    // The break detection is after 10 low bits.
+    static const uint16 kMaxBreakTailClockTicks = BitTicks<kMaxBreakBits - 10>::kValue;
+    static const uint16 kMaxDelimiterClockTicks = BitTicks<kMaxDelimiterBits>::kValue;
+
+    // Clock ticks of the last falling rx1 edge in DETECT_BREAK.
+    static uint16 fall_ticks;
+    // Clock ticks of the end of the current break.
+    static uint16 break_end_ticks;
+
+    static BreakTiming timing;
+
+    // Return the BreakTiming bucket of the given clock ticks.
+    static inline uint8 breakBucket(uint16 ticks) {
+      return (ticks < BitTicks<12>::kValue) ? 0
+          : (ticks < BitTicks<13>::kValue) ? 1
+          : (ticks < BitTicks<14>::kValue) ? 2
+          : (ticks < BitTicks<15>::kValue) ? 3
+          : (ticks < BitTicks<16>::kValue) ? 4
+          : (ticks < BitTicks<20>::kValue) ? 5 : 6;
+    }
+
+    static inline uint8 delimiterBucket(uint16 ticks) {
+      return (ticks < BitTicks<1>::kValue) ? 0
+          : (ticks < BitTicks<2>::kValue) ? 1
+          : (ticks < BitTicks<3>::kValue) ? 2
+          : (ticks < BitTicks<5>::kValue) ? 3 : 4;
+    }
+
+    // Called at the end of a break.
+    static inline void breakEnded() {
+      break_end_ticks = hardware_clock::ticksForIsr();
+      const uint16 ticks = break_end_ticks - fall_ticks;
+      incrementCounter(&timing.breaks[breakBucket(ticks)]);
+      if (ticks < timing.min_break_ticks) {
+        timing.min_break_ticks = ticks;
+      }
+    }
+
+    // Called at the start bit of the sync byte.
+    static inline void delimiterEnded() {
+      const uint16 ticks = hardware_clock::ticksForIsr() - break_end_ticks;
+      incrementCounter(&timing.delimiters[delimiterBucket(ticks)]);
+      if (ticks < timing.min_delimiter_ticks) {
+        timing.min_delimiter_ticks = ticks;
+      }
+    }
+
+    static inline void clear() {
+      timing = BreakTiming();
+      timing.min_break_ticks = 0xffff;
+      timing.min_delimiter_ticks = 0xffff;
+    }
+  }
+
+  // Called from main. Public. See .h for description.
+  void getBreakTiming(BreakTiming* result, boolean clear) {
+    cli();
+    *result = break_timing::timing;
+    if (clear) {
+      break_timing::clear();
+    }
+    sei();
+  }
+
+  // Called from main. Public. See .h for description.
+  void printBreakTiming(const BreakTiming& timing) {
+    sio::print(F("break bits: <12:"));
+    sio::out << timing.breaks[0] << F(" 12:") << timing.breaks[1] 
+        << F(" 13:") << timing.breaks[2] << F(" 14:") << timing.breaks[3]
+        << F(" 15:") << timing.breaks[4] << F(" 16-19:") << timing.breaks[5]
+        << F(" 20+:") << timing.breaks[6] << F(" long:") << timing.long_breaks
+        << F(" min_ticks:") << timing.min_break_ticks;
+    sio::out << F(", delimiter bits: <1:") << timing.delimiters[0] 
+        << F(" 1:") << timing.delimiters[1] << F(" 2:") << timing.delimiters[2]
+        << F(" 3-4:") << timing.delimiters[3] << F(" 5+:") << timing.delimiters[4]
+        << F(" min_ticks:") << timing.min_delimiter_ticks << '\n';
   }
 
   // ----- ISR RX Ring Buffers -----
 
-  // Frame buffer queue size.
-  static const uint8 kMaxFrameBuffers = 8;
+  // Frame buffer queue size. With the packed ring, a single buffer is used
+  // by the ISR to assemble the current frame.
+  static const uint8 kMaxFrameBuffers = 
+      custom_defs::kUsePackedFrameRing ? 1 : custom_defs::kLinFrameBuffers;
 
   // RX Frame buffers queue. Read/Writen by ISR only. 
   static LinFrame rx_frame_buffers[kMaxFrameBuffers];
 
+  // The queue is a single producer/single consumer ring. head_frame_buffer
+  // is written by the ISR only and tail_frame_buffer by the main only so no
+  // interrupt disabling is needed. Single byte indices are read and written
+  // atomically.
+
   // Index [0, kMaxFrameBuffers) of the current frame buffer being
-  // written (newest). Read/Written by ISR only.
-  static uint8  head_frame_buffer;
+  // written (newest). Written by ISR only.
+  static volatile uint8 head_frame_buffer;
 
   // Index [0, kMaxFrameBuffers) of the next frame to be read (oldest).
   // If equals head_frame_buffer then there is no available frame.
-  // Read/Written by ISR only.
-  static uint8 tail_frame_buffer;
+  // Written by main only, and with custom_defs::kOverrunDropOldest also by
+  // the ISR while main does not hold the tail frame (see overrun).
+  static volatile uint8 tail_frame_buffer;
 
   // Called once from main.
   static inline void setupBuffers() {
@@ -188,51 +466,968 @@ namespace lin_processor {
     tail_frame_buffer = 0;
   }
 
-  // Called from ISR or from main with interrupts disabled.
-  static inline void incrementTailFrameBuffer() {
-    if (++tail_frame_buffer >= kMaxFrameBuffers) {
-      tail_frame_buffer = 0;
+  static inline uint8 nextFrameBufferIndex(uint8 index) {
+    return (index + 1 >= kMaxFrameBuffers) ? 0 : index + 1;
+  }
+
+  // ----- Overrun Policy -----
+  //
+  // Used with the custom_defs::kOverrunPolicy other than kOverrunDropNewest,
+  // when a complete frame finds the frame buffers queue full. Since the 
+  // queue is full, all the buffers other than the head one are queued 
+  // frames, and the ISR may replace or drop any of them except the tail 
+  // frame while main holds it. Main sets tail_held before it reads 
+  // tail_frame_buffer and clears it after it advanced it, so the ISR, which
+  // is atomic to main, either moves the tail before main reads it or not at
+  // all.
+  namespace overrun {
+    static const boolean kEnabled = 
+        custom_defs::kOverrunPolicy != custom_defs::kOverrunDropNewest;
+
+    // True while main reads the tail frame. Written by main only.
+    static volatile boolean tail_held;
+
+    // The buffer index of the newest queued frame of each 6 bit id. Stale
+    // entries are rejected by the id check. Used by ISR only, with 
+    // kOverrunCoalesce.
+    static uint8 slot_of_id[64];
+
+    static inline void holdTail(boolean hold) {
+      if (kEnabled) {
+        tail_held = hold;
+      }
+    }
+
+    // Called from ISR when the head frame is published.
+    static inline void framePublished(uint8 index) {
+      if (custom_defs::kOverrunPolicy == custom_defs::kOverrunCoalesce) {
+        slot_of_id[LinFrame::idFromPid(rx_frame_buffers[index].get_byte(0))] = index;
+      }
+    }
+
+    // Called from ISR when the queue is full. Returns true if the head 
+    // frame replaced the queued frame of its id. O(1).
+    static inline boolean coalesce() {
+      if (custom_defs::kOverrunPolicy != custom_defs::kOverrunCoalesce) {
+        return false;
+      }
+      const uint8 head = head_frame_buffer;
+      const LinFrame& frame = rx_frame_buffers[head];
+      const uint8 slot = slot_of_id[LinFrame::idFromPid(frame.get_byte(0))];
+      if (slot == head || rx_frame_buffers[slot].get_byte(0) != frame.get_byte(0) ||
+          (slot == tail_frame_buffer && tail_held)) {
+        return false;
+      }
+      rx_frame_buffers[slot] = frame;
+      return true;
+    }
+
+    // Called from ISR when the queue is full. Returns true if the oldest 
+    // frame was dropped to make room.
+    static inline boolean dropOldest() {
+      if (custom_defs::kOverrunPolicy != custom_defs::kOverrunDropOldest || tail_held) {
+        return false;
+      }
+      tail_frame_buffer = nextFrameBufferIndex(tail_frame_buffer);
+      return true;
     }
   }
 
-  // Called from ISR. If stepping on tail buffer, caller needs to 
-  // increment raise frame overrun error.
-  static inline void incrementHeadFrameBuffer() {
-    if (++head_frame_buffer >= kMaxFrameBuffers) {
-      head_frame_buffer = 0;
+  // ----- Packed Frame Ring -----
+  //
+  // Used instead of the frame buffers queue when 
+  // custom_defs::kUsePackedFrameRing. Each frame is a header byte with the 
+  // number of frame bytes in bits [3:0], followed by the frame bytes. Records
+  // wrap around the end of the buffer. Same single producer/single consumer
+  // scheme as the frame buffers, with one byte always free to tell a full 
+  // ring from an empty one.
+  namespace packed_ring {
+    static const uint8 kSize = custom_defs::kUsePackedFrameRing 
+        ? custom_defs::kPackedFrameRingBytes : 1;
+    typedef char RingTooSmall[(kSize == 1 || kSize > LinFrame::kMaxBytes + 1) ? 1 : -1];
+
+    // Header flags of frames with injected bits and with a slave response.
+    static const uint8 kInjectedBits = H(7);
+    static const uint8 kSlaveResponse = H(6);
+
+    static uint8 bytes[kSize];
+    
+    // Written by ISR only.
+    static volatile uint8 head;
+    // Written by main only.
+    static volatile uint8 tail;
+
+    static inline uint8 next(uint8 index) {
+      return (index + 1 >= kSize) ? 0 : index + 1;
+    }
+
+    // Called from ISR. Returns false if there is no room for the frame.
+    static inline boolean push(const LinFrame& frame) {
+      const uint8 n = frame.num_bytes();
+      uint8 h = head;
+      const uint8 t = tail;
+      const uint8 used = (h >= t) ? h - t : kSize - (t - h);
+      if (used + 1 + n >= kSize) {
+        return false;
+      }
+      bytes[h] = n | (frame.hasInjectedBits() ? kInjectedBits : 0)
+          | (frame.isSlaveResponse() ? kSlaveResponse : 0);
+      h = next(h);
+      for (uint8 i = 0; i < n; i++) {
+        bytes[h] = frame.get_byte(i);
+        h = next(h);
+      }
+      // Make sure the record writes are completed before publishing it.
+      asm volatile("" ::: "memory");
+      head = h;
+      return true;
+    }
+
+    // Called from main. Returns false if the ring is empty.
+    static boolean pop(LinFrame* frame) {
+      uint8 t = tail;
+      if (t == head) {
+        return false;
+      }
+      const uint8 header = bytes[t];
+      t = next(t);
+      frame->reset();
+      for (uint8 i = 0; i < (header & 0x0f); i++) {
+        frame->append_byte(bytes[t], header & kInjectedBits);
+        t = next(t);
+      }
+      if (header & kSlaveResponse) {
+        frame->setSlaveResponse();
+      }
+      frame->set_break_ticks(0);
+      frame->set_end_ticks(0);
+      // Make sure the record reads are completed before releasing it.
+      asm volatile("" ::: "memory");
+      tail = t;
+      return true;
+    }
+
+    // Frame returned by peekFrame() and not released yet, if peeked.
+    static LinFrame peeked_frame;
+    static boolean peeked;
+  }
+
+  // ----- Priority Lane -----
+  //
+  // Used with custom_defs::kUsePriorityLane. The frames of the ids in 
+  // custom_defs::kPriorityFrameIds are queued here instead of in the bulk
+  // queue (the frame buffers or the packed ring), and the main reads this 
+  // queue first. A full bulk queue thus drops only bulk frames. Same single
+  // producer/single consumer scheme as the frame buffers, with one slot 
+  // always free.
+  namespace priority_lane {
+    static const uint8 kSize = custom_defs::kUsePriorityLane 
+        ? custom_defs::kPriorityFrameBuffers + 1 : 1;
+
+    static LinFrame frames[kSize];
+
+    // Written by ISR only.
+    static volatile uint8 head;
+    // Written by main only.
+    static volatile uint8 tail;
+
+    // True if the frame last returned by peekFrame() is from this queue.
+    // Used by main only.
+    static boolean peeked;
+
+    // Called once from main.
+    static inline void setup() {
+      head = 0;
+      tail = 0;
+    }
+
+    static inline uint8 next(uint8 index) {
+      return (index + 1 >= kSize) ? 0 : index + 1;
+    }
+
+    // True if frames of the given id byte are queued here. The list is
+    // short and known at compile time.
+    static inline boolean isPriority(uint8 id_byte) {
+      const uint8 id = LinFrame::idFromPid(id_byte);
+      for (uint8 i = 0; i < ARRAY_SIZE(custom_defs::kPriorityFrameIds); i++) {
+        if (LinFrame::idFromPid(custom_defs::kPriorityFrameIds[i]) == id) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // Called from ISR. Returns false if the queue is full.
+    static inline boolean push(const LinFrame& frame) {
+      const uint8 h = head;
+      const uint8 n = next(h);
+      if (n == tail) {
+        return false;
+      }
+      frames[h] = frame;
+      // Make sure the frame writes are completed before publishing it.
+      asm volatile("" ::: "memory");
+      head = n;
+      return true;
+    }
+
+    // Called from main. Returns the oldest frame or NULL if none.
+    static inline const LinFrame* peek() {
+      const uint8 t = tail;
+      return (t == head) ? NULL : &frames[t];
+    }
+
+    // Called from main after peek() returned a frame.
+    static inline void release() {
+      // Make sure the compiler completes the frame reads before releasing it.
+      asm volatile("" ::: "memory");
+      tail = next(tail);
+    }
+  }
+
+  // ----- Frame Insertion -----
+  //
+  // The frame of insertFrame(). The main writes the frame and the deadline
+  // and then sets pending. The ISR sets the result and then clears pending.
+  namespace insertion {
+    static InsertedFrame frame;
+    static uint32 deadline_ticks;
+    static volatile boolean pending;
+    static volatile uint8 result;
+
+    // Number of break bits sent before the delimiter.
+    static const uint8 kBreakBits = 13;
+  }
+
+  // ----- Latest Frame Per Id -----
+  //
+  // The newest frame of each id in custom_defs::kLatestFrameIds, updated in
+  // place by the ISR. The main reads a slot with interrupts enabled and uses
+  // the sequence number to detect that the ISR replaced the frame during the
+  // copy.
+  namespace latest_frames {
+    static const uint8 kNumSlots = ARRAY_SIZE(custom_defs::kLatestFrameIds);
+
+    struct Slot {
+      // Incremented after each update, skipping 0 which means no frame yet.
+      volatile uint8 seq;
+      LinFrame frame;
+    };
+
+    static Slot slots[kNumSlots];
+
+    // Return the slot index of the given id or kNumSlots if not cached. The
+    // list is short and known at compile time.
+    static inline uint8 slotIndex(uint8 id_byte) {
+      const uint8 id = LinFrame::idFromPid(id_byte);
+      for (uint8 i = 0; i < kNumSlots; i++) {
+        if (LinFrame::idFromPid(custom_defs::kLatestFrameIds[i]) == id) {
+          return i;
+        }
+      }
+      return kNumSlots;
+    }
+
+    // Called from ISR with each complete frame.
+    static inline void update(const LinFrame& frame) {
+      const uint8 index = slotIndex(frame.get_byte(0));
+      if (index >= kNumSlots) {
+        return;
+      }
+      Slot& slot = slots[index];
+      slot.frame = frame;
+      asm volatile("" ::: "memory");
+      const uint8 seq = slot.seq + 1;
+      slot.seq = seq ? seq : 1;
+    }
+  }
+
+  // ----- Frame Id Filter -----
+  //
+  // Bit per 6 bit id, set if frames of that id are queued. Written by main
+  // only, single byte writes.
+  namespace id_filter {
+    static uint8 accepted[8] = { 
+      0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff 
+    };
+
+    static inline boolean isAccepted(uint8 id_byte) {
+      const uint8 id = LinFrame::idFromPid(id_byte);
+      return accepted[id >> 3] & bitMask(id & 0x07);
+    }
+  }
+
+  // ----- Header Only Frames -----
+  //
+  // Header only frames (no slave response) of ids that are not subscribed
+  // are counted here instead of being queued. The subscriptions are written 
+  // by main only, single byte writes. The counts are incremented by ISR and
+  // read and cleared by main with interrupts disabled.
+  namespace no_response {
+    static const uint8 kSubscribedByDefault = 
+        custom_defs::kQueueHeaderOnlyFrames ? 0xff : 0x00;
+
+    // Bit per 6 bit id, set if header only frames of that id are queued.
+    static uint8 subscribed[8] = {
+      kSubscribedByDefault, kSubscribedByDefault, kSubscribedByDefault,
+      kSubscribedByDefault, kSubscribedByDefault, kSubscribedByDefault,
+      kSubscribedByDefault, kSubscribedByDefault
+    };
+
+    // Saturating per 6 bit id counts of the frames that were not queued.
+    static uint8 counts[64];
+
+    // Called from ISR with a complete frame. Returns true if the frame was
+    // counted and should not be queued.
+    static inline boolean countIfNotSubscribed(const LinFrame& frame) {
+      if (frame.num_bytes() != 1) {
+        return false;
+      }
+      const uint8 id_byte = frame.get_byte(0);
+      if (!LinFrame::isValidPid(id_byte)) {
+        return false;
+      }
+      const uint8 id = LinFrame::idFromPid(id_byte);
+      if (subscribed[id >> 3] & bitMask(id & 0x07)) {
+        return false;
+      }
+      if (counts[id] != 0xff) {
+        counts[id]++;
+      }
+      return true;
+    }
+  }
+
+  // Called from ISR when the frame in the head buffer is complete. Returns 
+  // false if a frame was dropped because the queue is full, per 
+  // custom_defs::kOverrunPolicy: this frame, whose head buffer is then 
+  // reused for the next frame, or the oldest one. Frames with a rejected id are
+  // dropped silently and header only frames of ids that are not subscribed are
+  // only counted. Frames of the priority lane ids go to that queue.
+  static inline boolean publishHeadFrameBuffer() {
+    latest_frames::update(rx_frame_buffers[head_frame_buffer]);
+    if (!id_filter::isAccepted(rx_frame_buffers[head_frame_buffer].get_byte(0))) {
+      return true;
+    }
+    if (no_response::countIfNotSubscribed(rx_frame_buffers[head_frame_buffer])) {
+      return true;
+    }
+    if (custom_defs::kUsePriorityLane && 
+        priority_lane::isPriority(rx_frame_buffers[head_frame_buffer].get_byte(0))) {
+      if (!priority_lane::push(rx_frame_buffers[head_frame_buffer])) {
+        return false;
+      }
+      incrementCounter(&stats.frames);
+      return true;
+    }
+    if (custom_defs::kUsePackedFrameRing) {
+      if (!packed_ring::push(rx_frame_buffers[head_frame_buffer])) {
+        return false;
+      }
+      incrementCounter(&stats.frames);
+      return true;
+    }
+    const uint8 next = nextFrameBufferIndex(head_frame_buffer);
+    boolean dropped_oldest = false;
+    if (next == tail_frame_buffer) {
+      if (overrun::coalesce()) {
+        incrementCounter(&stats.coalesced);
+        return true;
+      }
+      if (!overrun::dropOldest()) {
+        return false;
+      }
+      dropped_oldest = true;
+    }
+    overrun::framePublished(head_frame_buffer);
+    // Make sure the frame writes are completed before publishing it.
+    asm volatile("" ::: "memory");
+    head_frame_buffer = next;
+    incrementCounter(&stats.frames);
+    return !dropped_oldest;
+  }
+
+  // ----- Learned Frame Lengths -----
+  //
+  // Number of bytes (id, data and checksum) of each frame id, learned from 
+  // frames that ended with a space timeout. Once the same length was seen
+  // twice in a row, frames with that id are closed right after their last
+  // byte instead of waiting for the timeout. If more bytes follow, the length
+  // is forgotten and learned again. Used by ISR only.
+  namespace frame_lengths {
+    // Indexed by the 6 bits id. Bits [3:0] are the length, bit 7 is set when
+    // confirmed.
+    static uint8 table[64];
+    static const uint8 kConfirmed = H(7);
+
+    // Called when a frame ended with a space timeout. Header only frames
+    // are not learned, else the next full frame of that id would be closed
+    // at its id byte.
+    static inline void learn(uint8 id_byte, uint8 num_bytes) {
+      if (num_bytes < 2) {
+        return;
+      }
+      uint8* const entry = &table[LinFrame::idFromPid(id_byte)];
+      *entry = ((*entry & 0x0f) == num_bytes) ? (num_bytes | kConfirmed) : num_bytes;
+    }
+
+    // True if a frame with this id is known to be complete with this number
+    // of bytes.
+    static inline boolean isComplete(uint8 id_byte, uint8 num_bytes) {
+      return custom_defs::kUseLearnedFrameLengths 
+          && table[LinFrame::idFromPid(id_byte)] == (num_bytes | kConfirmed);
+    }
+
+    // Called when a frame that was closed early turned out to be longer.
+    static inline void forget(uint8 id_byte) {
+      table[LinFrame::idFromPid(id_byte)] = 0;
     }
   }
 
   // ----- ISR To Main Data Transfer -----
 
-  // Increment by the ISR to indicates to the main program when the ISR returned.
-  // This is used to defered disabling interrupts until the ISR completes to 
-  // reduce ISR jitter time.
-  static volatile uint8 isr_marker;
-  
-  // Should be called from main only. 
-  static inline void waitForIsrEnd() {
-    const uint8 value = isr_marker;
-    // Wait until the next ISR ends.
-    while (value == isr_marker) {
-    } 
+  // Public. Called from main. See .h for description.
+  boolean insertFrame(const InsertedFrame& frame, uint32 deadline_ticks) {
+    if (!custom_defs::kUseFrameInsertion || insertion::pending) {
+      return false;
+    }
+    insertion::frame = frame;
+    insertion::deadline_ticks = deadline_ticks;
+    insertion::result = insert_results::NONE;
+    // Make sure the frame writes are completed before publishing it.
+    asm volatile("" ::: "memory");
+    insertion::pending = true;
+    return true;
   }
-  
+
+  // Public. Called from main. See .h for description.
+  uint8 getAndClearInsertResult() {
+    if (insertion::pending) {
+      return insert_results::NONE;
+    }
+    const uint8 result = insertion::result;
+    insertion::result = insert_results::NONE;
+    return result;
+  }
+
+  // Public. Called from main. See .h for description.
+  void acceptAllIds(boolean accept) {
+    for (uint8 i = 0; i < ARRAY_SIZE(id_filter::accepted); i++) {
+      id_filter::accepted[i] = accept ? 0xff : 0x00;
+    }
+  }
+
+  // Public. Called from main. See .h for description.
+  void acceptId(uint8 id, boolean accept) {
+    const uint8 id6 = LinFrame::idFromPid(id);
+    uint8* const entry = &id_filter::accepted[id6 >> 3];
+    if (accept) {
+      *entry |= bitMask(id6 & 0x07);
+    } else {
+      *entry &= ~bitMask(id6 & 0x07);
+    }
+  }
+
+  // Public. Called from main. See .h for description.
+  void subscribeHeaderOnlyFrames(uint8 id, boolean subscribe) {
+    const uint8 id6 = LinFrame::idFromPid(id);
+    uint8* const entry = &no_response::subscribed[id6 >> 3];
+    if (subscribe) {
+      *entry |= bitMask(id6 & 0x07);
+    } else {
+      *entry &= ~bitMask(id6 & 0x07);
+    }
+  }
+
+  // Public. Called from main. See .h for description.
+  uint8 getAndClearNoResponses(uint8 id) {
+    uint8* const count = &no_response::counts[LinFrame::idFromPid(id)];
+    cli();
+    const uint8 result = *count;
+    *count = 0;
+    sei();
+    return result;
+  }
+
   // Public. Called from main. See .h for description.
   boolean readNextFrame(LinFrame* buffer) {
-    boolean result = false;
-    waitForIsrEnd();
+    if (custom_defs::kUsePriorityLane) {
+      const LinFrame* const frame = priority_lane::peek();
+      if (frame) {
+        queue_delay::frameTaken(*frame);
+        *buffer = *frame;
+        priority_lane::release();
+        return true;
+      }
+    }
+    if (custom_defs::kUsePackedFrameRing) {
+      if (packed_ring::peeked) {
+        *buffer = packed_ring::peeked_frame;
+        packed_ring::peeked = false;
+        return true;
+      }
+      return packed_ring::pop(buffer);
+    }
+    overrun::holdTail(true);
+    const uint8 tail = tail_frame_buffer;
+    if (tail == head_frame_buffer) {
+      overrun::holdTail(false);
+      return false;
+    }
+    // This copies the request buffer struct. The ISR does not touch this
+    // buffer until we advance the tail.
+    *buffer = rx_frame_buffers[tail];
+    // Make sure the compiler completes the copy before releasing the buffer.
+    asm volatile("" ::: "memory");
+    tail_frame_buffer = nextFrameBufferIndex(tail);
+    overrun::holdTail(false);
+    queue_delay::frameTaken(*buffer);
+    return true; 
+  }
+
+  // Public. Called from main. See .h for description.
+  const LinFrame* peekFrame() {
+    if (custom_defs::kUsePriorityLane) {
+      const LinFrame* const frame = priority_lane::peek();
+      priority_lane::peeked = (frame != NULL);
+      if (frame) {
+        queue_delay::frameTaken(*frame);
+        return frame;
+      }
+    }
+    // The packed records are unpacked to a main side frame.
+    if (custom_defs::kUsePackedFrameRing) {
+      if (!packed_ring::peeked) {
+        packed_ring::peeked = packed_ring::pop(&packed_ring::peeked_frame);
+      }
+      return packed_ring::peeked ? &packed_ring::peeked_frame : NULL;
+    }
+    // Held until releaseFrame().
+    overrun::holdTail(true);
+    const uint8 tail = tail_frame_buffer;
+    if (tail == head_frame_buffer) {
+      overrun::holdTail(false);
+      return NULL;
+    }
+    queue_delay::frameTaken(rx_frame_buffers[tail]);
+    return &rx_frame_buffers[tail];
+  }
+
+  // Public. Called from main. See .h for description.
+  void releaseFrame() {
+    if (custom_defs::kUsePriorityLane && priority_lane::peeked) {
+      priority_lane::peeked = false;
+      priority_lane::release();
+      return;
+    }
+    if (custom_defs::kUsePackedFrameRing) {
+      packed_ring::peeked = false;
+      return;
+    }
+    // Make sure the compiler completes the frame reads before releasing it.
+    asm volatile("" ::: "memory");
+    tail_frame_buffer = nextFrameBufferIndex(tail_frame_buffer);
+    overrun::holdTail(false);
+  }
+
+  // The capacities of the two queues, one slot less than their sizes. The 
+  // queue that is not used has a size of 1, so it is guarded against a 
+  // zero divisor.
+  static const uint8 kPackedRingCapacity = 
+      (packed_ring::kSize > 1) ? packed_ring::kSize - 1 : 1;
+  static const uint8 kFrameBuffersCapacity = 
+      (kMaxFrameBuffers > 1) ? kMaxFrameBuffers - 1 : 1;
+
+  // Public. Called from main. See .h for description.
+  uint8 rxQueuePercent() {
+    if (custom_defs::kUsePackedFrameRing) {
+      const uint8 h = packed_ring::head;
+      const uint8 t = packed_ring::tail;
+      const uint8 used = (h >= t) ? h - t : packed_ring::kSize - (t - h);
+      return (uint16)used * 100 / kPackedRingCapacity;
+    }
+    // One slot is the frame being received.
+    const uint8 h = head_frame_buffer;
+    const uint8 t = tail_frame_buffer;
+    const uint8 used = (h >= t) ? h - t : kMaxFrameBuffers - (t - h);
+    return (uint16)used * 100 / kFrameBuffersCapacity;
+  }
+
+  // Public. Called from main. See .h for description.
+  uint8 drainFrames(FrameHandler handler, uint8 max_frames) {
+    uint8 count = 0;
+    // The priority frames first, in place.
+    if (custom_defs::kUsePriorityLane) {
+      const LinFrame* frame;
+      while (count < max_frames && (frame = priority_lane::peek()) != NULL) {
+        queue_delay::frameTaken(*frame);
+        handler(*frame);
+        priority_lane::release();
+        count++;
+      }
+    }
+    // The packed records are unpacked one at a time to a main side frame.
+    // With an overrun policy that moves the tail or replaces queued frames,
+    // each frame is held while handled.
+    if (custom_defs::kUsePackedFrameRing || overrun::kEnabled) {
+      const LinFrame* frame;
+      while (count < max_frames && (frame = peekFrame()) != NULL) {
+        handler(*frame);
+        releaseFrame();
+        count++;
+      }
+      return count;
+    }
+    // A single snapshot of the head. Frames that the ISR adds meanwhile are 
+    // left to the next call.
+    const uint8 head = head_frame_buffer;
+    uint8 tail = tail_frame_buffer;
+    while (count < max_frames && tail != head) {
+      queue_delay::frameTaken(rx_frame_buffers[tail]);
+      handler(rx_frame_buffers[tail]);
+      // Make sure the compiler completes the frame reads before releasing it.
+      asm volatile("" ::: "memory");
+      tail = nextFrameBufferIndex(tail);
+      tail_frame_buffer = tail;
+      count++;
+    }
+    return count;
+  }
+
+  // Public. Called from main. See .h for description.
+  boolean readLatestFrame(uint8 id, LinFrame* buffer, uint8* seq) {
+    const uint8 index = latest_frames::slotIndex(id);
+    if (index >= latest_frames::kNumSlots) {
+      return false;
+    }
+    const latest_frames::Slot& slot = latest_frames::slots[index];
+    // The ISR never runs concurrently with its own update, so a copy with
+    // the same seq before and after is not torn.
+    for (;;) {
+      const uint8 seq_before = slot.seq;
+      if (!seq_before) {
+        return false;
+      }
+      asm volatile("" ::: "memory");
+      *buffer = slot.frame;
+      asm volatile("" ::: "memory");
+      if (slot.seq == seq_before) {
+        *seq = seq_before;
+        return true;
+      }
+    }
+  }
+
+  // ----- Injection Audit Records -----
+  //
+  // Audit records of frames with injected bits, passed from the ISR to main 
+  // the same way as the frames, with one slot always owned by the ISR.
+
+  static const uint8 kInjectionAuditBuffers = 4;
+
+  static InjectionAudit audit_buffers[kInjectionAuditBuffers];
+
+  static volatile uint8 audit_head;
+  static volatile uint8 audit_tail;
+  
+  // Number of records dropped since the last published one.
+  static uint8 audit_dropped;
+
+  static inline uint8 nextAuditIndex(uint8 index) {
+    return (index + 1 < kInjectionAuditBuffers) ? index + 1 : 0;
+  }
+
+  // Called from ISR at the begining of a frame.
+  static inline void resetAudit() {
+    audit_buffers[audit_head].injected_bytes = 0;
+    audit_buffers[audit_head].collided_bytes = 0;
+  }
+
+  // Called from ISR for each data or checksum byte that has injected bits.
+  static inline void auditByte(uint8 byte_index, uint8 original, uint8 result, uint8 forced,
+      uint8 collided) {
+    InjectionAudit& audit = audit_buffers[audit_head];
+    audit.injected_bytes |= (1 << byte_index);
+    if (collided) {
+      audit.collided_bytes |= (1 << byte_index);
+    }
+    audit.original[byte_index] = original;
+    audit.result[byte_index] = result;
+    audit.forced[byte_index] = forced;
+  }
+
+  // Called from ISR when the frame is complete. Publishes the record if the
+  // frame had any injected byte.
+  static inline void publishAudit(const LinFrame& frame) {
+    InjectionAudit& audit = audit_buffers[audit_head];
+    if (!audit.injected_bytes) {
+      return;
+    }
+    const uint8 next = nextAuditIndex(audit_head);
+    if (next == audit_tail) {
+      if (audit_dropped != 0xff) {
+        audit_dropped++;
+      }
+      return;
+    }
+    audit.id = frame.get_byte(0);
+    audit.num_bytes = frame.num_bytes() - 1;
+    audit.end_ticks = (uint16)frame.end_ticks();
+    audit.dropped_before = audit_dropped;
+    audit_dropped = 0;
+    asm volatile("" ::: "memory");
+    audit_head = next;
+  }
+
+  boolean readInjectionAuditOf(const LinFrame& frame, InjectionAudit* buffer) {
+    if (custom_defs::kUsePackedFrameRing) {
+      return false;
+    }
+    const uint16 end_ticks = (uint16)frame.end_ticks();
+    while (audit_tail != audit_head) {
+      const InjectionAudit& audit = audit_buffers[audit_tail];
+      const int16 age = (int16)(end_ticks - audit.end_ticks);
+      // A record of a later frame, this frame has none.
+      if (age < 0) {
+        return false;
+      }
+      if (age == 0) {
+        *buffer = audit;
+      }
+      asm volatile("" ::: "memory");
+      audit_tail = nextAuditIndex(audit_tail);
+      if (age == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Print as id followed by original>result(forced) per injected byte, with
+  // a '!' after the bytes that collided.
+  void printInjectionAudit(const InjectionAudit& audit) {
+    sio::print(F("INJ "));
+    sio::printhex2(audit.id);
+    for (uint8 i = 0; i < audit.num_bytes; i++) {
+      if (!(audit.injected_bytes & (1 << i))) {
+        continue;
+      }
+      sio::printf(F(" %u:"), i);
+      sio::printhex2(audit.original[i]);
+      sio::printchar('>');
+      sio::printhex2(audit.result[i]);
+      sio::printchar('(');
+      sio::printhex2(audit.forced[i]);
+      sio::printchar(')');
+      if (audit.collided_bytes & (1 << i)) {
+        sio::printchar('!');
+      }
+    }
+    if (audit.dropped_before) {
+      sio::printf(F(" +%u lost"), audit.dropped_before);
+    }
+    sio::println();
+  }
+
+  // ----- ISR Profile -----
+
+  // Written by the ISRs only, read by the main with interrupts disabled.
+  static IsrPathStats isr_profile[isr_paths::kNumPaths];
+  static uint8 max_isr_ticks;
+
+  // The ISR budget in hardware clock ticks, rounded down.
+  static const uint8 kIsrBudgetTicks = 
+      (custom_defs::kIsrBudgetMicros * hardware_clock::kTicksPerMilli) / 1000;
+  typedef char IsrBudgetOutOfRange[
+      (custom_defs::kIsrBudgetMicros * hardware_clock::kTicksPerMilli) / 1000 < 0xff ? 1 : -1];
+
+  // Called at the exit of an ISR with the hardware clock at its entry.
+  static inline void profileIsr(uint8 path, uint16 start_ticks) {
+    if (!custom_defs::kProfileIsr) {
+      return;
+    }
+    const uint16 delta = hardware_clock::ticksForIsr() - start_ticks;
+    const uint8 ticks = (delta > 0xff) ? 0xff : delta;
+    IsrPathStats& stats = isr_profile[path];
+    if (!stats.count || ticks < stats.min_ticks) {
+      stats.min_ticks = ticks;
+    }
+    if (ticks > stats.max_ticks) {
+      stats.max_ticks = ticks;
+    }
+    if (ticks > max_isr_ticks) {
+      max_isr_ticks = ticks;
+    }
+    if (ticks > kIsrBudgetTicks && stats.over_budget < 0xffff) {
+      stats.over_budget++;
+    }
+    stats.count++;
+    stats.sum_ticks += ticks;
+  }
+
+  // Called at the entry of the tick ISR with the timer 2 count, the timer
+  // counts since the match that triggered it. Returns true if the sample of
+  // this run is late.
+  static inline boolean checkLateSample(uint8 path, uint8 entry_counts) {
+    if (entry_counts <= (config.counts_per_bit() >> 2)) {
+      return false;
+    }
+    incrementCounter(&isr_profile[path].late_samples);
+    return true;
+  }
+
+  // Called at the exit of the tick ISR. Counts an overrun if the next match
+  // already happened while the ticks run.
+  static inline void checkOverrun(uint8 path) {
+    if ((TIMSK2 & H(OCIE2A)) && (TIFR2 & H(OCF2A))) {
+      incrementCounter(&isr_profile[path].overruns);
+    }
+  }
+
+  void getAndClearIsrProfile(uint8 path, IsrPathStats* stats) {
+    const uint8 sreg = SREG;
+    cli();
+    *stats = isr_profile[path];
+    isr_profile[path] = IsrPathStats();
+    SREG = sreg;
+  }
+
+  uint8 getAndClearMaxIsrTicks() {
+    const uint8 sreg = SREG;
+    cli();
+    const uint8 result = max_isr_ticks;
+    max_isr_ticks = 0;
+    SREG = sreg;
+    return result;
+  }
+
+  void printIsrProfile(uint8 path, const IsrPathStats& stats) {
+    static const char kPathNames[isr_paths::kNumPaths][6] PROGMEM = 
+        { "BREAK", "DATA", "RESP", "FRAME", "WAIT" };
+    sio::print(F("ISR "));
+    sio::print((const __FlashStringHelper*)kPathNames[path]);
+    sio::out << F(": n=") << stats.count 
+        << F(" min=") << sio::micros(hardware_clock::ticksToNanos(stats.min_ticks))
+        << F("us avg=") << sio::micros(hardware_clock::averageNanos(stats.sum_ticks, stats.count))
+        << F("us max=") << sio::micros(hardware_clock::ticksToNanos(stats.max_ticks))
+        << F("us over=") << stats.over_budget;
+    if (stats.over_budget) {
+      sio::print(F(" OVER"));
+    }
+    if (custom_defs::kDetectLateSamples) {
+      sio::out << F(" late=") << stats.late_samples << F(" overrun=") << stats.overruns;
+    }
+    sio::println();
+  }
+
+  // ----- Response Timing -----
+  //
+  // Used with custom_defs::kTrackResponseTiming. Written by ISR, read and 
+  // cleared by main with interrupts disabled. 
+  namespace response_timing {
+    // The first ids seen. Entries with a zero id are free, a protected id is
+    // never zero.
+    static ResponseTiming entries[kMaxResponseTimingIds];
+
+    // The entry of the current frame, or NULL if not tracked.
+    static ResponseTiming* current;
+
+    // Clears the stats of an entry, keeping its id.
+    static inline void clearEntry(ResponseTiming* entry) {
+      const uint8 id = entry->id;
+      *entry = ResponseTiming();
+      entry->id = id;
+      entry->min_ticks = 0xffff;
+      entry->min_space_ticks = 0xffff;
+    }
+
+    // Returns the entry of the given protected id, or NULL if all the 
+    // entries are used by other ids.
+    static inline ResponseTiming* findOrAdd(uint8 id) {
+      for (uint8 i = 0; i < kMaxResponseTimingIds; i++) {
+        ResponseTiming* const entry = &entries[i];
+        if (entry->id == id) {
+          return entry;
+        }
+        if (!entry->id) {
+          entry->id = id;
+          clearEntry(entry);
+          return entry;
+        }
+      }
+      return NULL;
+    }
+
+    // Called at the start bit of the first and of the second response 
+    // bytes, with the number of bytes read before it and the clock ticks of
+    // its falling edge. The end ticks of the frame are of the middle of the
+    // stop bit of the last byte.
+    static inline void byteStarted(const LinFrame& frame, uint8 bytes_read, 
+        uint16 start_ticks, boolean is_slave_response) {
+      const uint16 stop_bit_end_ticks = 
+          (uint16)frame.end_ticks() + config.clock_ticks_per_half_bit();
+      const int16 diff = start_ticks - stop_bit_end_ticks;
+      const uint16 ticks = (diff > 0) ? diff : 0;
+      if (bytes_read == 2) {
+        current = findOrAdd(frame.get_byte(0));
+        if (!current) {
+          return;
+        }
+        incrementCounter(&current->count);
+        if (is_slave_response) {
+          incrementCounter(&current->slave_responses);
+        }
+        current->sum_ticks += ticks;
+        if (ticks < current->min_ticks) {
+          current->min_ticks = ticks;
+        }
+        if (ticks > current->max_ticks) {
+          current->max_ticks = ticks;
+        }
+        return;
+      }
+      if (!current) {
+        return;
+      }
+      if (ticks < current->min_space_ticks) {
+        current->min_space_ticks = ticks;
+      }
+      if (ticks > current->max_space_ticks) {
+        current->max_space_ticks = ticks;
+      }
+    }
+  }
+
+  // Called from main. Public. See .h for description.
+  boolean getAndClearResponseTiming(uint8 index, ResponseTiming* timing) {
+    ResponseTiming* const entry = &response_timing::entries[index];
     cli();
-    if (tail_frame_buffer != head_frame_buffer) {
-      //led::setHigh();
-      // This copies the request buffer struct.
-      *buffer = rx_frame_buffers[tail_frame_buffer];
-      incrementTailFrameBuffer();
-      result = true;
-      //led::setLow();
+    *timing = *entry;
+    if (entry->id) {
+      response_timing::clearEntry(entry);
     }
     sei();
-    return result; 
+    return timing->id;
+  }
+
+  // Called from main. Public. See .h for description.
+  void printResponseTiming(const ResponseTiming& timing) {
+    sio::print(F("response "));
+    sio::printhex2(timing.id);
+    if (!timing.count) {
+      sio::println(F(": none"));
+      return;
+    }
+    sio::out << F(": n=") << timing.count << F(" slave=") << timing.slave_responses
+        << F(" min=") << sio::micros(hardware_clock::ticksToNanos(timing.min_ticks)) 
+        << F("us avg=") << sio::micros(hardware_clock::averageNanos(timing.sum_ticks, timing.count))
+        << F("us max=") << sio::micros(hardware_clock::ticksToNanos(timing.max_ticks)) << F("us");
+    if (timing.max_space_ticks || timing.min_space_ticks != 0xffff) {
+      sio::out << F(" space min=") << sio::micros(hardware_clock::ticksToNanos(timing.min_space_ticks))
+          << F("us max=") << sio::micros(hardware_clock::ticksToNanos(timing.max_space_ticks)) 
+          << F("us");
+    }
+    sio::println();
   }
 
   // ----- State Machine Declaration -----
@@ -241,6 +1436,8 @@ namespace lin_processor {
   namespace states {
     static const uint8 DETECT_BREAK = 1;
     static const uint8 READ_DATA = 2;
+    static const uint8 SEND_RESPONSE = 3;
+    static const uint8 SEND_FRAME = 4;
   }
   static uint8 state;
 
@@ -248,9 +1445,23 @@ namespace lin_processor {
    public:
     static inline void enter() ;
     static inline void handleIsr();
+    // Called when the end of the break was detected or timeout.
+    static inline void handleBreakEnd(boolean ok);
+    // Called instead of enter() when a frame was closed by its learned length.
+    static inline void enterAfterEarlyClose(uint8 id_byte);
     
    private:
     static uint8 low_bits_counter_;
+    // When non zero, number of ticks left in which a low RX indicates that 
+    // the last frame, with id early_close_id_, was closed too early.
+    static uint8 quiet_ticks_;
+    static uint8 early_close_id_;
+    // True when the break ended and the next tick is the half bit delayed
+    // break end on the slave side.
+    static boolean break_ended_;
+    // Number of ticks both buses were idle (high), saturating. Used with 
+    // custom_defs::kUseFrameInsertion.
+    static uint8 idle_bits_;
   };
 
   class StateReadData {
@@ -258,14 +1469,30 @@ namespace lin_processor {
     // Should be called after the break stop bit was detected.
     static inline void enter();
     static inline void handleIsr();
+    // Called on the high to low transition of the sync byte start bit or 
+    // timeout.
+    static inline void handleSyncStart(boolean ok);
+    // Called on the high to low transition of the start bit of next byte
+    // on given channel (rx_channels::RX1 or RX2), or with 0 on timeout.
+    static inline void handleByteStart(uint8 channel);
+    // Returns the fast_proxy_op of the next tick.
+    static inline uint8 fastProxyOp();
+    // Sets the frame position fields of the given error record.
+    static inline void getErrorPosition(ErrorRecord* record);
     
    private:
     // Indicates if we read bytes from master (true) or slave (false).
     static boolean rx_from_lin1_;
     
-    // Indicates the transfer function of the next rx bit. One of rx_bit_transfer_functions
-    // values.
-    static byte rx_bit_transfer_function_;
+    // Data bits of the current byte that are forced to 1 or 0 by the injector,
+    // in the same bit order as byte_buffer_bit_mask_. Set once per byte at the
+    // start bit, so the per bit work is independent of the injection rules.
+    static uint8 force_1_mask_;
+    static uint8 force_0_mask_;
+    // Data bits of the current byte that are inverted after the force masks
+    // are applied. Used to carry errors of the original checksum byte into 
+    // the modified one.
+    static uint8 invert_mask_;
     
     // Number of complete bytes read so far. Includes all bytes: sync, id,
     // data and checksum.
@@ -279,19 +1506,250 @@ namespace lin_processor {
     // injection done on this frame.
     static uint8 byte_buffer_;
     
+    // The current byte as recieved, before any signal injection.
+    static uint8 raw_byte_buffer_;
+    
     // When collecting the data bits, this goes (1 << 0) to (1 << 7). Could
     // be computed as (1 << (bits_read_in_byte_ - 1)). We use this cached value
-    // recude ISR computation.
+    // recude ISR computation. Zero during start and stop bits so they are 
+    // never forced.
     static uint8 byte_buffer_bit_mask_;
     
     // When true, the byte buffer has at least one injected bit. That is, a bit that 
     // was forced to 1 or 0 by the injector, regardless of the original bit value.
     static boolean byte_buffer_has_injected_bits_;
+
+    // The bit mask of the previous output bit if it was injected, otherwise 
+    // zero, and its output level. Checked against the bus at the next tick, 
+    // before the next bit is output, to detect collisions.
+    static uint8 readback_mask_;
+    static boolean readback_high_;
+
+    // Injected bits of the current byte whose readback did not match.
+    static uint8 collided_mask_;
         
+    static inline boolean transformBit(boolean is_input_high);
     static inline boolean proxyRxBit();
-    static inline uint8 nextBitFunction();
+    static inline void setForceMasks();
+  };
+
+  // Sends a response provided by the injector to the master, instead of 
+  // proxying the response of the slave. The slave's response, if any, is
+  // ignored.
+  class StateSendResponse {
+   public:
+    // Called at the middle of the stop bit of the id byte.
+    static inline void enter(const custom_injector::private_::Response* response);
+    static inline void handleIsr();
+    
+   private:
+    static const custom_injector::private_::Response* response_;
+    // Number of response bytes fully sent so far.
+    static uint8 bytes_sent_;
+    // Bit slot of the current byte. 0 = start bit, 1-8 data bits, 9 stop bit.
+    static uint8 bit_index_;
+    // Remaining bits of the current byte, lsb first.
+    static uint8 byte_buffer_;
+    // Number of ticks to wait before the first start bit.
+    static uint8 space_ticks_;
+  };
+
+  // Sends a frame of the injector, header and response, to the slave side
+  // in an idle gap of the master (see insertFrame()). The master side is 
+  // watched at each tick and a break from the master aborts the frame.
+  class StateSendFrame {
+   public:
+    // Called at a tick of the detect break state, with both buses idle.
+    static inline void enter();
+    static inline void handleIsr();
+
+   private:
+    // Number of break bits left to send, then of delimiter bits.
+    static uint8 break_bits_;
+    // Number of bytes fully sent so far, including the sync and id bytes.
+    static uint8 bytes_sent_;
+    // Bit slot of the current byte. 0 = start bit, 1-8 data bits, 9 stop bit.
+    static uint8 bit_index_;
+    // Remaining bits of the current byte, lsb first.
+    static uint8 byte_buffer_;
+  };
+
+  // ----- Fast Proxy -----
+  //
+  // With custom_defs::kUseFastProxyIsr, the tick ISR entry is a naked stub 
+  // that copies the rx bit to the other tx within a few cycles, before the
+  // prologue of the regular ISR body, which then does the bookkeeping. Used
+  // for the bits that are proxied as is, the other bits (forced or 
+  // inverted) are proxied by the body.
+
+  namespace fast_proxy_ops {
+    // The body proxies the bit.
+    static const uint8 NONE = 0;
+    // The stub copied rx1 to tx2, or rx2 to tx1. Bit indices, tested by the
+    // stub with sbrc.
+    static const uint8 kRx1ToTx2Bit = 0;
+    static const uint8 kRx2ToTx1Bit = 1;
+  }
+
+  // What the stub does on the next tick. Set at the end of the ISRs that
+  // change the state of the bit engine, read by the stub.
+  static volatile uint8 fast_proxy_op;
+
+  // The input port as read by the stub, PIND or PINC, valid when 
+  // fast_proxy_op is not NONE.
+  static volatile uint8 fast_proxy_pins;
+
+  // ----- Hardware TX Edges -----
+  //
+  // With custom_defs::kUseHardwareTxEdges, OC2B drives tx2 in the fast PWM 
+  // mode of the tick timer with OCR2B above TOP, so it never matches and
+  // OC2B takes at each BOTTOM, one count after the tick, the level that the
+  // COM2B bits select: set (non inverting) or clear (inverting). The tick
+  // ISR preloads the level of the next bit and the timer produces the edge
+  // at an exact count, independent of the ISR latency. This delays the 
+  // proxied slave side by one more bit. The timer keeps counting when the 
+  // ticks are paused so a preloaded level is always applied.
+
+  // TCCR2A without the COM2B bits. Fast PWM mode, TOP = OCR2A.
+  static const uint8 kTccr2aMode = L(COM2A1) | L(COM2A0) | H(WGM21) | H(WGM20);
+
+  // The edges are timed by the ticks, not by the rx edges.
+  typedef char HardwareTxEdgesExcludeLowLatencyProxy[(!custom_defs::kUseHardwareTxEdges ||
+      (!custom_defs::kUseLowLatencyProxy && !custom_defs::kUseFastProxyIsr)) ? 1 : -1];
+
+  // The slave side tx output. Same interface as tx2_pin, with the hardware
+  // timing when enabled. Called from ISR only.
+  struct tx2_out {
+    static inline void setHigh() {
+      if (custom_defs::kUseHardwareTxEdges) {
+        TCCR2A = kTccr2aMode | H(COM2B1) | L(COM2B0);
+      } else {
+        tx2_pin::setHigh();
+      }
+    }
+
+    static inline void setLow() {
+      if (custom_defs::kUseHardwareTxEdges) {
+        TCCR2A = kTccr2aMode | H(COM2B1) | H(COM2B0);
+      } else {
+        tx2_pin::setLow();
+      }
+    }
   };
 
+  // ----- Error Context Records -----
+  //
+  // Passed from the ISR to main the same way as the injection audit 
+  // records. Used only with custom_defs::kRecordErrorContext.
+
+  static const uint8 kErrorRecordBuffers = 4;
+
+  static ErrorRecord error_records[kErrorRecordBuffers];
+
+  static volatile uint8 error_record_head;
+  static volatile uint8 error_record_tail;
+
+  // Number of records dropped since the last published one.
+  static uint8 error_records_dropped;
+
+  // The id byte of the current or last frame. Set by the ISR.
+  static uint8 last_id;
+
+  static inline uint8 nextErrorRecordIndex(uint8 index) {
+    return (index + 1 < kErrorRecordBuffers) ? index + 1 : 0;
+  }
+
+  // Called from ISR with the flags of an error.
+  static inline void recordError(uint8 flags) {
+    const uint8 next = nextErrorRecordIndex(error_record_head);
+    if (next == error_record_tail) {
+      if (error_records_dropped != 0xff) {
+        error_records_dropped++;
+      }
+      return;
+    }
+    ErrorRecord& record = error_records[error_record_head];
+    record.flags = flags;
+    record.state = state;
+    record.id = last_id;
+    StateReadData::getErrorPosition(&record);
+    record.ticks = hardware_clock::ticksForIsr();
+    record.dropped_before = error_records_dropped;
+    error_records_dropped = 0;
+    asm volatile("" ::: "memory");
+    error_record_head = next;
+  }
+
+  boolean readNextErrorRecord(ErrorRecord* buffer) {
+    if (error_record_tail == error_record_head) {
+      return false;
+    }
+    *buffer = error_records[error_record_tail];
+    asm volatile("" ::: "memory");
+    error_record_tail = nextErrorRecordIndex(error_record_tail);
+    return true;
+  }
+
+  // ----- ISR Trace -----
+  //
+  // Used only with the RING custom_defs::kIsrTracePolicy. The ISRs write 
+  // the ring until main stops it to read it.
+
+  typedef char IsrTraceRecordsPowerOf2[
+      (kIsrTraceRecords & (kIsrTraceRecords - 1)) == 0 ? 1 : -1];
+
+  // Records with a zero event were not written yet.
+  static IsrTraceRecord isr_trace[kIsrTraceRecords];
+
+  // The next record to write, the oldest one once the ring is full.
+  static uint8 isr_trace_head;
+
+  // Set by main to stop the trace while it reads it.
+  static volatile boolean is_isr_trace_stopped;
+
+  // Number of records read since the trace was stopped. Main only.
+  static uint8 isr_trace_records_read;
+
+  // Called from ISR.
+  static inline void traceIsrEvent(uint8 event) {
+    if (is_isr_trace_stopped) {
+      return;
+    }
+    IsrTraceRecord& record = isr_trace[isr_trace_head];
+    record.event = event;
+    record.counts = TCNT2;
+    record.state = state;
+    isr_trace_head = (isr_trace_head + 1) & (kIsrTraceRecords - 1);
+  }
+
+  boolean stopIsrTrace() {
+    if (custom_defs::kIsrTracePolicy != custom_defs::isr_trace_policies::RING) {
+      return false;
+    }
+    is_isr_trace_stopped = true;
+    isr_trace_records_read = 0;
+    return true;
+  }
+
+  boolean readNextIsrTraceRecord(IsrTraceRecord* buffer) {
+    if (!is_isr_trace_stopped) {
+      return false;
+    }
+    // The ISR does not write the ring while stopped.
+    asm volatile("" ::: "memory");
+    while (isr_trace_records_read < kIsrTraceRecords) {
+      const uint8 index =
+          (isr_trace_head + isr_trace_records_read++) & (kIsrTraceRecords - 1);
+      if (isr_trace[index].event) {
+        *buffer = isr_trace[index];
+        return true;
+      }
+    }
+    asm volatile("" ::: "memory");
+    is_isr_trace_stopped = false;
+    return false;
+  }
+
   // ----- Error Flag. -----
 
   // Written from ISR. Read/Write from main.
@@ -302,6 +1760,14 @@ namespace lin_processor {
     error_pin::setHigh();
     // Non atomic when called from setup() but should be fine since ISR is not running yet.
     error_flags |= flags;
+    for (uint8 i = 0; i < kNumErrorTypes; i++) {
+      if (flags & (1 << i)) {
+        incrementCounter(&stats.errors[i]);
+      }
+    }
+    if (custom_defs::kRecordErrorContext) {
+      recordError(flags);
+    }
     error_pin::setLow();
   }
 
@@ -332,6 +1798,41 @@ namespace lin_processor {
     { errors::OTHER, "OTHR" },
   };
 
+  // Print the given statistics. Error counters that are zero are omitted.
+  void printStats(const Stats& snapshot) {
+    sio::printf(F("frames %u"), snapshot.frames);
+    const uint8 n = ARRAY_SIZE(kErrorBitNames); 
+    for (uint8 i = 0; i < n; i++) {
+      const uint8 mask = pgm_read_byte(&kErrorBitNames[i].mask);
+      // Index of the error bit.
+      uint8 index = 0;
+      while (!(mask & (1 << index))) {
+        index++;
+      }
+      if (snapshot.errors[index]) {
+        const char* const name = (const char*)pgm_read_word(&kErrorBitNames[i].name);
+        sio::printchar(' ');
+        sio::print(name);
+        sio::printf(F(" %u"), snapshot.errors[index]);
+      }
+    }
+    if (snapshot.voted_bits) {
+      sio::printf(F(" VOTE %u"), snapshot.voted_bits);
+    }
+    if (snapshot.coalesced) {
+      sio::printf(F(" COAL %u"), snapshot.coalesced);
+    }
+    if (custom_defs::kTrackQueueDelay) {
+      // The buckets, then the max in usecs.
+      sio::print(F(" QUEUE"));
+      for (uint8 i = 0; i < kNumQueueDelayBuckets; i++) {
+        sio::printf(i ? F("/%u") : F(" %u"), snapshot.queue_delays[i]);
+      }
+      sio::out << F(" max=") 
+          << sio::micros(hardware_clock::ticksToNanos(snapshot.max_queue_delay_ticks)) << F("us");
+    }
+  }
+
   // Given a byte with lin processor error bitset, print the list
   // of set errors.
   void printErrorFlags(uint8 lin_errors) {
@@ -350,25 +1851,70 @@ namespace lin_processor {
     }
   }
 
+  // Print as the error names, the id, the state, byte and bit position, the
+  // response side and the time.
+  void printErrorRecord(const ErrorRecord& record) {
+    sio::print(F("ERR "));
+    printErrorFlags(record.flags);
+    sio::print(F(" id="));
+    sio::printhex2(record.id);
+    sio::printf(F(" st=%u byte=%u bit=%u rx=%u t=%u"), record.state, 
+        record.bytes_read, record.bits_read_in_byte, record.from_slave ? 2 : 1,
+        record.ticks);
+    if (record.dropped_before) {
+      sio::printf(F(" +%u lost"), record.dropped_before);
+    }
+    sio::println();
+  }
+
+  // Indexed by isr_events, in program memory.
+  static const char kIsrEventName0[] PROGMEM = "?";
+  static const char kIsrEventName1[] PROGMEM = "isr_start";
+  static const char kIsrEventName2[] PROGMEM = "isr_end";
+  static const char kIsrEventName3[] PROGMEM = "sample_start";
+  static const char kIsrEventName4[] PROGMEM = "sample_end";
+  static const char kIsrEventName5[] PROGMEM = "break_start";
+  static const char kIsrEventName6[] PROGMEM = "break_end";
+  static const char kIsrEventName7[] PROGMEM = "error";
+  static const char* const kIsrEventNames[] PROGMEM = {
+    kIsrEventName0, kIsrEventName1, kIsrEventName2, kIsrEventName3,
+    kIsrEventName4, kIsrEventName5, kIsrEventName6, kIsrEventName7
+  };
+
+  // Print as the event name, the tick timer count and the state.
+  void printIsrTraceRecord(const IsrTraceRecord& record) {
+    const uint8 event =
+        (record.event <= isr_events::ERROR) ? record.event : 0;
+    sio::print(F("ISR "));
+    sio::print((const __FlashStringHelper*)pgm_read_word(&kIsrEventNames[event]));
+    sio::printf(F(" c=%u st=%u\n"), record.counts, record.state);
+  }
+
   // ----- Initialization -----
 
   static void setupTimer() {    
-    // OC2B cycle pulse (Arduino digital pin 3, PD3). For debugging.
-    DDRD |= H(DDD3);
-    // Fast PWM mode, OC2B output active high.
-    TCCR2A = L(COM2A1) | L(COM2A0) | H(COM2B1) | H(COM2B0) | H(WGM21) | H(WGM20);
-    const uint8 prescaler = config.prescaler_x64()
-      ? (H(CS22) | L(CS21) | L(CS20))   // x64
-        : (L(CS22) | H(CS21) | L(CS20));  // x8
-    // Prescaler: X8. Should match the definition of kPreScaler;
-    TCCR2B = L(FOC2A) | L(FOC2B) | H(WGM22) | prescaler;
+    if (custom_defs::kUseHardwareTxEdges) {
+      // OC2B is tx2. Force its register high while in the normal mode, for 
+      // a passive output when connected below.
+      TCCR2A = H(COM2B1) | H(COM2B0);
+      TCCR2B = H(FOC2B);
+      // Fast PWM mode, OC2B set at each BOTTOM.
+      TCCR2A = kTccr2aMode | H(COM2B1) | L(COM2B0);
+    } else {
+      // OC2B cycle pulse (Arduino digital pin 3, PD3). For debugging.
+      DDRD |= H(DDD3);
+      // Fast PWM mode, OC2B output active high.
+      TCCR2A = kTccr2aMode | H(COM2B1) | H(COM2B0);
+    }
+    // Prescaler: x8, x32 or x64, per config.
+    TCCR2B = L(FOC2A) | L(FOC2B) | H(WGM22) | config.prescaler_bits();
     // Clear counter.
     TCNT2 = 0;
     // Determines baud rate.
     OCR2A = config.counts_per_bit() - 1;
     // A short 8 clocks pulse on OC2B at the end of each cycle,
-    // just before triggering the ISR.
-    OCR2B = config.counts_per_bit() - 2; 
+    // just before triggering the ISR. Above TOP for the hardware tx edges.
+    OCR2B = custom_defs::kUseHardwareTxEdges ? 0xff : config.counts_per_bit() - 2; 
     // Interrupt on A match.
     TIMSK2 = L(OCIE2B) | H(OCIE2A) | L(TOIE2);
     // Clear pending Compare A interrupts.
@@ -382,30 +1928,34 @@ namespace lin_processor {
 
     setupPins();
     setupBuffers();
+    priority_lane::setup();
     StateDetectBreak::enter();
     setupTimer();
+    // Pin change interrupt of rx2 (PC1). Enabled with PCIE1 only while waiting.
+    PCMSK1 |= H(PCINT9);
     error_flags = 0;
+    stats = Stats();
+    break_timing::clear();
+  }
 
-    sio::waitUntilFlushed();
+  // Public. Called from main. See .h for description.
+  void printConfig() {
     // TODO: move this to config class.
     sio::printf(F("LIN: %u, %u, %u, %u, %u, %u, %u, %u\n"), 
         config.baud(), 
         custom_defs::kUseLinChecksumVersion2,
-        config.prescaler_x64(),
+        config.prescaling(),
         config.counts_per_bit(), 
         config.counts_per_half_bit(), 
         config.clock_ticks_per_bit(),  
         config.clock_ticks_per_half_bit(),  
-        config.clock_ticks_per_until_start_bit());
+        config.clock_ticks_until_byte());
   }
 
   // ----- ISR Utility Functions -----
 
-  // Set timer value to zero.
-  static inline void resetTickTimer() {
-    // TODO: also clear timer2 prescaler.
-    TCNT2 = 0;
-  }
+  // Accumulates the bit time fraction. See updateTickPeriod().
+  static uint8 bit_fraction_acc;
 
   // Set timer value to half a tick. Called at the begining of the
   // start bit to generate sampling ticks at the middle of the next
@@ -415,133 +1965,282 @@ namespace lin_processor {
     // to have the next ISR data sampling at the middle of the start
     // bit.
     TCNT2 = config.counts_per_half_bit();
+    // Restart the fraction spreading of the new byte.
+    bit_fraction_acc = 0x80;
   }
-  
-  // Perform a tight busy loop for a given number of clock ticks.
-  // Keeps the lin tick timer reset.
-  // Called from ISR only.
-  static inline void wait(uint16 clock_ticks) {
-    const uint16 base_clock = hardware_clock::ticksForIsr();
-    for(;;) {
-      // Keep the tick timer not ticking (no ISR).
-      resetTickTimer();
 
-      // Should work also in case of 16 bit clock overflow.
-      const uint16 clock_diff = hardware_clock::ticksForIsr() - base_clock;
-      if (clock_diff >= clock_ticks) {
-        return; 
-      }
-    } 
+  // Called from the tick ISR. Spreads the fractional part of the bit time
+  // by alternating the tick period between counts_per_bit and counts_per_bit + 1 
+  // such that the tick time error is always less than one count. OCR2A is
+  // double buffered so this sets the period of the next next tick.
+  static inline void updateTickPeriod() {
+    const uint8 fraction = config.counts_per_bit_fraction();
+    const uint8 acc = bit_fraction_acc + fraction;
+    bit_fraction_acc = acc;
+    // A carry adds a count.
+    OCR2A = (acc < fraction) ? config.counts_per_bit() : config.counts_per_bit() - 1;
   }
   
-  static inline boolean isRxHigh(boolean use_rx1) {
-    return use_rx1 ? rx1_pin::isHigh() : rx2_pin::isHigh(); 
-  } 
+  // ----- Event Driven Waits -----
+  //
+  // Instead of spinning in the ISR until an RX transition, the tick interrupt
+  // is paused and an RX pin interrupt (INT0 for rx1, PCINT9 for rx2) is armed
+  // together with a timer1 B-match timeout. The main loop runs during the
+  // wait, e.g. in the space between bytes and before the response.
+
+  // Like enum but 8 bits only. Channel bit masks.
+  namespace rx_channels {
+    static const uint8 RX1 = (1 << 0);
+    static const uint8 RX2 = (1 << 1);
+  }
 
-  // Perform a tight busy loop until RX is low or the given number
-  // of clock ticks passed (timeout). Retuns true if ok,
-  // false if timeout. Keeps timer reset during the wait.
-  // Called from ISR only.
-  static inline boolean waitForRxLow(uint16 max_clock_ticks, boolean use_rx1) {
-    const uint16 base_clock = hardware_clock::ticksForIsr();
-    for(;;) {
-      // Keep the tick timer not ticking (no ISR).
-      resetTickTimer();
-
-      // If selected rx is low we are done.
-      if (!isRxHigh(use_rx1)) {
-        return true;
+  // What we wait for. Like enum but 8 bits only.
+  namespace wait_events {
+    static const uint8 NONE = 0;
+    // Low to high transition at the end of the break (rx1).
+    static const uint8 BREAK_END = 1;
+    // High to low transition of the sync byte start bit (rx1).
+    static const uint8 SYNC_START = 2;
+    // High to low transition of the start bit of next byte.
+    static const uint8 BYTE_START = 3;
+  }
+  static uint8 wait_event;
+
+  // Channels armed for the current wait. Bit mask of rx_channels.
+  static uint8 wait_channels;
+
+  // ----- Low Latency Proxy -----
+  //
+  // When enabled, the RX edges of the followed channel are copied to the TX
+  // of the other side as they happen, using the same pin interrupts as the
+  // waits. INT0 then senses any edge and the wait ISR filters the edge
+  // direction. The tick ISR still samples each bit and drives the same value,
+  // which confirms the output in case an edge interrupt was missed.
+
+  // Channels whose edges are currently forwarded. Bit mask of rx_channels.
+  static uint8 follow_channels;
+
+  // Set the channels to follow. At most one channel. Called from ISR only.
+  static inline void setFollowChannels(uint8 channels) {
+    if (!custom_defs::kUseLowLatencyProxy || channels == follow_channels) {
+      return;
+    }
+    const uint8 old_channels = follow_channels;
+    follow_channels = channels;
+
+    if (channels & rx_channels::RX1) {
+      EIMSK &= ~H(INT0);
+      EICRA = H(ISC00);
+      EIFR = H(INTF0);
+      EIMSK |= H(INT0);
+      // Catch up with an edge we may have missed.
+      const boolean is_edge = custom_defs::kUseProxySelfTest && 
+          rx1_pin::isHigh() != tx2_pin::isHigh();
+      if (rx1_pin::isHigh()) {
+        tx2_out::setHigh();
+      } else {
+        tx2_out::setLow();
       }
+      if (is_edge) {
+        proxy_self_test::edgeForwarded();
+      }
+    } else if (old_channels & rx_channels::RX1) {
+      // Back to the wait only setting.
+      EIMSK &= ~H(INT0);
+      if (wait_event != wait_events::NONE && (wait_channels & rx_channels::RX1)) {
+        EICRA = (wait_event == wait_events::BREAK_END)
+            ? (H(ISC01) | H(ISC00))
+            : (H(ISC01) | L(ISC00));
+        EIFR = H(INTF0);
+        EIMSK |= H(INT0);
+      }
+    }
 
-      // Test for timeout.
-      // Should work also in case of 16 bit clock overflow.
-      const uint16 clock_diff = hardware_clock::ticksForIsr() - base_clock;
-      if (clock_diff >= max_clock_ticks) {
-        return false; 
+    if (channels & rx_channels::RX2) {
+      PCIFR = H(PCIF1);
+      PCICR |= H(PCIE1);
+      const boolean is_edge = custom_defs::kUseProxySelfTest && 
+          rx2_pin::isHigh() != tx1_pin::isHigh();
+      if (rx2_pin::isHigh()) {
+        tx1_pin::setHigh();
+      } else {
+        tx1_pin::setLow();
       }
-    } 
+      if (is_edge) {
+        proxy_self_test::edgeForwarded();
+      }
+    } else if ((old_channels & rx_channels::RX2) && 
+        !(wait_event != wait_events::NONE && (wait_channels & rx_channels::RX2))) {
+      PCICR &= ~H(PCIE1);
+    }
+  }
+
+  // Stop the bit ticks. Called from ISR only.
+  static inline void pauseTickTimer() {
+    TIMSK2 &= ~H(OCIE2A);
   }
 
-  // Same as waitForRxLow but with reversed polarity.
-  // We clone to code for time optimization.
+  // Resume the bit ticks with the next tick in half a bit. Called from ISR only.
+  static inline void resumeTickTimerAtHalfTick() {
+    setTimerToHalfTick();
+    TIFR2 = H(OCF2A);
+    TIMSK2 |= H(OCIE2A);
+  }
+
+  // Pause the bit ticks and wait for the given event on the given channels, or
+  // until max_clock_ticks passed. Called from ISR only.
+  static inline void armWait(uint8 event, uint8 channels, uint16 max_clock_ticks) {
+    pauseTickTimer();
+    wait_event = event;
+    wait_channels = channels;
+    // A followed channel already has its interrupt enabled, sensing any edge.
+    if ((channels & rx_channels::RX1) && !(follow_channels & rx_channels::RX1)) {
+      // INT0 on rising edge for the break end, falling edge otherwise.
+      EICRA = (event == wait_events::BREAK_END)
+          ? (H(ISC01) | H(ISC00))
+          : (H(ISC01) | L(ISC00));
+      EIFR = H(INTF0);
+      EIMSK |= H(INT0);
+    }
+    if ((channels & rx_channels::RX2) && !(follow_channels & rx_channels::RX2)) {
+      PCIFR = H(PCIF1);
+      PCICR |= H(PCIE1);
+    }
+    OCR1B = hardware_clock::ticksForIsr() + max_clock_ticks;
+    TIFR1 = H(OCF1B);
+    TIMSK1 |= H(OCIE1B);
+  }
+
+  // Disarm all the wait interrupts. Returns the event we waited for.
+  static inline uint8 disarmWait() {
+    if (!(follow_channels & rx_channels::RX1)) {
+      EIMSK &= ~H(INT0);
+    }
+    if (!(follow_channels & rx_channels::RX2)) {
+      PCICR &= ~H(PCIE1);
+    }
+    TIMSK1 &= ~H(OCIE1B);
+    const uint8 event = wait_event;
+    wait_event = wait_events::NONE;
+    return event;
+  }
+
+  // ----- Bit Sampling -----
+
+  // Number of iterations of the delay loop between the majority vote samples.
+  // About 4 cycles each, so the three samples span about 8us at 16Mhz.
+  static const uint8 kVoteSampleSpacingLoops = 16;
+
   // Called from ISR only.
-  static inline boolean waitForRxHigh(uint16 max_clock_ticks, boolean use_rx1) {
-    const uint16 base_clock = hardware_clock::ticksForIsr();
-    for(;;) {
-      resetTickTimer();
-      if (isRxHigh(use_rx1)) {
-        return true;
-      }
-      // Should work also in case of an clock overflow.
-      const uint16 clock_diff = hardware_clock::ticksForIsr() - base_clock;
-      if (clock_diff >= max_clock_ticks) {
-        return false; 
-      }
-    } 
+  static inline void voteSampleDelay() {
+    for (uint8 i = kVoteSampleSpacingLoops; i; i--) {
+      asm volatile("");
+    }
   }
 
+  // Read rx1 or rx2. Call with a constant from_lin1 so the test is 
+  // optimized out. 
+  static inline uint8 readRx(boolean from_lin1) {
+    return from_lin1 ? rx1_pin::isHigh() : rx2_pin::isHigh();
+  }
 
-  // Wait for a high to low transition in any of the two channels or timeout
-  // if max clock ticks elapsed. Return 0 if timeout, 1 if rx1 or 2 if rx2.
-  // Keeps the tick timer reset to avoid interrupts.
-  // Called from an ISR.
-  static inline byte waitForResponseStartBit(uint16 max_clock_ticks) {
-    const uint16 base_clock = hardware_clock::ticksForIsr();
-    boolean state1 = rx1_pin::isHigh();
-    boolean state2 = rx2_pin::isHigh();
-    for(;;) {
-      resetTickTimer();  
-      // Look for high to low transition on channel 1.    
-      {
-        const boolean new_state1 = rx1_pin::isHigh();
-        if (state1 && !new_state1) {
-          return 1;
-        }
-        state1 = new_state1;
-      }
-      // Look for high to low transition on channel 2.   
-      {
-        const boolean new_state2 = rx2_pin::isHigh();
-        if (state2 && !new_state2) {
-          return 2;
-        }
-        state2 = new_state2;
-      }
-      
-      // Check for timeout.
-      // NOTE: substraction should work also in case of an clock overflow.
-      const uint16 clock_diff = hardware_clock::ticksForIsr() - base_clock;
-      if (clock_diff >= max_clock_ticks) {
-        return 0; 
-      }
-    } 
+  // Sample the rx pin of a proxied bit. Returns non zero if high. Called 
+  // from ISR only.
+  static inline uint8 sampleRx(boolean from_lin1) {
+    if (!custom_defs::kUseMajorityVoteSampling) {
+      return readRx(from_lin1);
+    }
+    uint8 num_high = readRx(from_lin1) ? 1 : 0;
+    voteSampleDelay();
+    if (readRx(from_lin1)) {
+      num_high++;
+    }
+    voteSampleDelay();
+    if (readRx(from_lin1)) {
+      num_high++;
+    }
+    // Count the bits where the samples disagree.
+    if (num_high == 1 || num_high == 2) {
+      incrementCounter(&stats.voted_bits);
+    }
+    return num_high >= 2;
   }
-  
+
   // ----- Detect-Break State Implementation -----
 
   uint8 StateDetectBreak::low_bits_counter_;
+  boolean StateDetectBreak::break_ended_;
+  uint8 StateDetectBreak::quiet_ticks_;
+  uint8 StateDetectBreak::early_close_id_;
+  uint8 StateDetectBreak::idle_bits_;
 
   inline void StateDetectBreak::enter() {
     state = states::DETECT_BREAK;
     low_bits_counter_ = 0;
+    break_ended_ = false;
+    quiet_ticks_ = 0;
+    idle_bits_ = 0;
+    // The header comes from the master.
+    setFollowChannels(rx_channels::RX1);
     // Make sure we don't assert a break on the lin1 bus.
     tx1_pin::setHigh();
     // Make slave TX output passive.
-    tx2_pin::setHigh();
+    tx2_out::setHigh();
+  }
+
+  inline void StateDetectBreak::enterAfterEarlyClose(uint8 id_byte) {
+    enter();
+    // The stop bit and the max space before the next byte.
+    quiet_ticks_ = 1 + kMaxByteSpaceBits;
+    early_close_id_ = id_byte;
   }
 
   // Return true if enough time to service rx request.
   inline void StateDetectBreak::handleIsr() {
+    // A start bit on any side right after a frame that we closed early.
+    if (quiet_ticks_) {
+      quiet_ticks_--;
+      if (!rx1_pin::isHigh() || !rx2_pin::isHigh()) {
+        quiet_ticks_ = 0;
+        frame_lengths::forget(early_close_id_);
+        setErrorFlags(errors::FRAME_TOO_LONG);
+      }
+    }
+
     if (rx1_pin::isHigh()) {
-      tx2_pin::setHigh();
+      tx2_out::setHigh();
       low_bits_counter_ = 0;
+      // Here half a bit after the end of the break. Go process the data.
+      if (break_ended_) {
+        break_pin::setLow();
+        StateReadData::enter();
+        return;
+      }
+      // An inserted frame starts once both buses were idle long enough, 
+      // but not right after a frame that we closed early.
+      if (custom_defs::kUseFrameInsertion && rx2_pin::isHigh() && !quiet_ticks_) {
+        if (idle_bits_ < 0xff) {
+          idle_bits_++;
+        }
+        if (insertion::pending && idle_bits_ >= custom_defs::kInsertIdleBits) {
+          if ((int32)(insertion::deadline_ticks - hardware_clock::ticks32ForIsr()) >= 0) {
+            StateSendFrame::enter();
+          } else {
+            insertion::result = insert_results::EXPIRED;
+            insertion::pending = false;
+          }
+        }
+      } else {
+        idle_bits_ = 0;
+      }
       return;
     } 
 
     // Here RX is low (active)  
+    idle_bits_ = 0;
     // TODO: since the slave is delayed by 1/2 bit, will be nice to delay also
     // the begining of the break.
-    tx2_pin::setLow();
+    tx2_out::setLow();
 
     if (++low_bits_counter_ < 10) {
       return;
@@ -550,17 +2249,23 @@ namespace lin_processor {
     // Detected a break. Wait for rx high and enter data reading.
     break_pin::setHigh();
 
-    // TODO: set actual max count
-    waitForRxHigh(255, true);
-    break_pin::setLow();
+    // A break of more than kMaxBreakBits times out.
+    armWait(wait_events::BREAK_END, rx_channels::RX1, 
+        break_timing::kMaxBreakTailClockTicks);
+  }
 
-    // Wait for half a bit before we propogate the end of the break
-    // to the slave. The slave is delayed by half a bit.
-    wait(config.clock_ticks_per_half_bit());
-    tx2_pin::setHigh();
-   
-    // Go process the data
-    StateReadData::enter();
+  inline void StateDetectBreak::handleBreakEnd(boolean ok) {
+    // We propogate the end of the break to the slave on the next tick, half
+    // a bit from now. The slave is delayed by half a bit.
+    if (ok) {
+      break_timing::breakEnded();
+      break_ended_ = true;
+    } else {
+      incrementCounter(&break_timing::timing.long_breaks);
+      break_pin::setLow();
+      low_bits_counter_ = 0;
+    }
+    resumeTickTimerAtHalfTick();
   }
 
   // ----- Read-Data State Implementation -----
@@ -568,116 +2273,164 @@ namespace lin_processor {
   uint8 StateReadData::bytes_read_;
   uint8 StateReadData::bits_read_in_byte_;
   boolean StateReadData::rx_from_lin1_;
-  byte StateReadData::rx_bit_transfer_function_;
+  uint8 StateReadData::force_1_mask_;
+  uint8 StateReadData::force_0_mask_;
+  uint8 StateReadData::invert_mask_;
   uint8 StateReadData::byte_buffer_;
+  uint8 StateReadData::raw_byte_buffer_;
   uint8 StateReadData::byte_buffer_bit_mask_;
   boolean StateReadData::byte_buffer_has_injected_bits_;
+  uint8 StateReadData::readback_mask_;
+  boolean StateReadData::readback_high_;
+  uint8 StateReadData::collided_mask_;
 
   // Called after half a bit after the low to high transition at the end of the break.
   inline void StateReadData::enter() {
     state = states::READ_DATA;
     bytes_read_ = 0;
     bits_read_in_byte_ = 0;
+    // The sync start bit is not forced nor read back.
+    byte_buffer_bit_mask_ = 0;
+    readback_mask_ = 0;
     rx_frame_buffers[head_frame_buffer].reset();
+    resetAudit();
+    // Here half a bit after the end of the break.
+    rx_frame_buffers[head_frame_buffer].set_break_ticks(
+        hardware_clock::ticks32ForIsr() - config.clock_ticks_per_half_bit());
     
     // True = reading from master, sending to slave.
     rx_from_lin1_ = true;
-    rx_bit_transfer_function_ = injector_actions::COPY_BIT;
+    byte_buffer_bit_mask_ = 0;
 
-    // TODO: handle post break timeout errors.
-    // TODO: set a reasonable time limit.
-    waitForRxLow(255, true);
-    setTimerToHalfTick();   
+    armWait(wait_events::SYNC_START, rx_channels::RX1, 
+        break_timing::kMaxDelimiterClockTicks);
+  }
+
+  inline void StateReadData::handleSyncStart(boolean ok) {
+    if (ok) {
+      break_timing::delimiterEnded();
+    } else {
+      setErrorFlags(errors::SYNC_BYTE);
+      StateDetectBreak::enter();
+    }
+    resumeTickTimerAtHalfTick();
+  }
+
+  // Applies the force and invert masks to an input bit.
+  inline boolean StateReadData::transformBit(boolean is_input_high) {
+    boolean is_output_high = is_input_high;
+    if (force_1_mask_ & byte_buffer_bit_mask_) {
+      is_output_high = true;
+    } else if (force_0_mask_ & byte_buffer_bit_mask_) {
+      is_output_high = false;
+    }
+    if (invert_mask_ & byte_buffer_bit_mask_) {
+      is_output_high = !is_output_high;
+    }
+    return is_output_high;
   }
 
   // Called from ISR. Read an rx bit and transfer to the other interface with
   // possible transformation. Uses rx_from_lin1_ to determine direction and uses
-  // rx_bit_transfer_function to determine bit transformation function.
-  // Returns the read bit post transformation.
-  //
-  // TODO: currently when forcing a 1 or 0 bit, we completely ignore the input
-  // bit. Ideally we should read it, verify the checksum of the incoming frame
-  // and if invalid (e.g. due to electrical noise), corrupt the checksum of 
-  // the modify frame. Otherwise we may laundering bad bits when recaclulating
-  // the checksum for the transformed frame.
+  // the force and invert masks to determine bit transformation function.
+  // Returns the read bit post transformation. The input bit is always sampled, 
+  // also when forced, and is collected into raw_byte_buffer_.
   inline boolean StateReadData::proxyRxBit() {
+    // Already copied by the stub, with no transformation.
+    if (custom_defs::kUseFastProxyIsr && fast_proxy_op) {
+      const boolean is_input_high = fast_proxy_pins & 
+          (rx_from_lin1_ ? rx1_pin::kPinMask : rx2_pin::kPinMask);
+      if (is_input_high) {
+        raw_byte_buffer_ |= byte_buffer_bit_mask_;
+      }
+      return is_input_high;
+    }
+
     sample_pin::setHigh();
 
+    boolean is_input_high;
     // Represent proxied bit (after transformation).
-    boolean is_rx_high = true;  
+    boolean is_rx_high;  
+    // The output side bus, still with the previous output bit.
+    boolean is_bus_high;
     
     if (rx_from_lin1_) {
       // Master interface to slave interface transfer.
-      switch (rx_bit_transfer_function_) {
-        case injector_actions::COPY_BIT:
-          is_rx_high = rx1_pin::isHigh();
-          if (is_rx_high) {
-            tx2_pin::setHigh();
-          } else {
-            tx2_pin::setLow();
-          }
-          break;
-
-        case injector_actions::FORCE_BIT_1:
-          is_rx_high = true;
-          tx2_pin::setHigh();
-          break;
-  
-        case injector_actions::FORCE_BIT_0:
-          is_rx_high = false;
-          tx2_pin::setLow();
-          break;
-
-        default:
-          // TODO: set an error flag.
-          // For errors, we use the passive state of the LIN bus.
-          is_rx_high = true;
-          break;
+      is_input_high = sampleRx(true);
+      is_bus_high = rx2_pin::isHigh();
+      is_rx_high = transformBit(is_input_high);
+      if (is_rx_high) {
+        tx2_out::setHigh();
+      } else {
+        tx2_out::setLow();
       }
     } else {
       // Slave interface to master interface transfer.
-      switch (rx_bit_transfer_function_) {
-        case injector_actions::COPY_BIT:
-          is_rx_high = rx2_pin::isHigh();
-          if (is_rx_high) {
-            tx1_pin::setHigh();
-          } else {
-            tx1_pin::setLow();
-          }
-          break;
-
-        case injector_actions::FORCE_BIT_1:
-          is_rx_high = true;
-          tx1_pin::setHigh();
-          break;
-  
-        case injector_actions::FORCE_BIT_0:
-          is_rx_high = false;
-          tx1_pin::setLow();
-          break;
+      is_input_high = sampleRx(false);
+      is_bus_high = rx1_pin::isHigh();
+      is_rx_high = transformBit(is_input_high);
+      if (is_rx_high) {
+        tx1_pin::setHigh();
+      } else {
+        tx1_pin::setLow();
+      }
+    }
+    
+    // Off the critical path. No op for start and stop bits since the mask is zero.
+    if (is_input_high) {
+      raw_byte_buffer_ |= byte_buffer_bit_mask_;
+    }
 
-        default:
-          // TODO: set an error flag.
-          // For errors, we use the passive state of the LIN bus.
-          is_rx_high = true;
-          break;
+    // An injected bit that did not appear on the bus, e.g. a slave drove 
+    // dominant at the same time.
+    if (custom_defs::kUseInjectionReadback && !custom_defs::kUseHardwareTxEdges) {
+      if (readback_mask_ && is_bus_high != readback_high_) {
+        collided_mask_ |= readback_mask_;
       }
+      readback_mask_ = (force_1_mask_ | force_0_mask_ | invert_mask_) & byte_buffer_bit_mask_;
+      readback_high_ = is_rx_high;
     }
     
     sample_pin::setLow();
     return is_rx_high;
   }
 
-  // Returns the transfer function of the next bit.
-  inline uint8 StateReadData::nextBitFunction() {
-    // Force copy if sync byte, id byte, any start bit or any stop bit.
-    if (bytes_read_ < 2 || bits_read_in_byte_ == 0 || bits_read_in_byte_ >= 9) {
-      return injector_actions::COPY_BIT;
+  inline uint8 StateReadData::fastProxyOp() {
+    // The mask is of the next data bit, zero for the start and stop bits. The 
+    // stub does not read back the bus.
+    if (state != states::READ_DATA || readback_mask_ ||
+        ((force_1_mask_ | force_0_mask_ | invert_mask_) & byte_buffer_bit_mask_)) {
+      return fast_proxy_ops::NONE;
     }
-    
-    // First data bit is <0, 0>
-    // Ignore the sync and id bytes and all the start bits.
-    return custom_injector::onIsrNextBitAction(bytes_read_ - 2, bits_read_in_byte_ - 1);  
+    return rx_from_lin1_ ? H(fast_proxy_ops::kRx1ToTx2Bit) : H(fast_proxy_ops::kRx2ToTx1Bit);
+  }
+
+  inline void StateReadData::getErrorPosition(ErrorRecord* record) {
+    record->bytes_read = bytes_read_;
+    record->bits_read_in_byte = bits_read_in_byte_;
+    record->from_slave = !rx_from_lin1_;
+  }
+
+  // Called at the end of the ISRs that change the state of the bit engine.
+  static inline void updateFastProxyOp() {
+    if (custom_defs::kUseFastProxyIsr && !custom_defs::kUseMajorityVoteSampling) {
+      fast_proxy_op = StateReadData::fastProxyOp();
+    }
+  }
+
+  // Called at the start bit to set the force masks of the 8 data bits that follow.
+  inline void StateReadData::setForceMasks() {
+    // Never force the sync and id bytes.
+    if (bytes_read_ < 2) {
+      force_1_mask_ = 0;
+      force_0_mask_ = 0;
+      invert_mask_ = 0;
+    } else {
+      // Ignore the sync and id bytes. First data byte is 0.
+      custom_injector::onIsrByteStart(bytes_read_ - 2, &force_1_mask_, &force_0_mask_,
+          &invert_mask_);
+    }
+    byte_buffer_has_injected_bits_ = (force_1_mask_ | force_0_mask_ | invert_mask_) != 0;
   }
   
   inline void StateReadData::handleIsr() {
@@ -701,9 +2454,10 @@ namespace lin_processor {
       bits_read_in_byte_++;
       // Prepare buffer and mask for data bit collection.
       byte_buffer_ = 0;
+      raw_byte_buffer_ = 0;
       byte_buffer_bit_mask_ = (1 << 0);
-      byte_buffer_has_injected_bits_ = false;
-      rx_bit_transfer_function_ = nextBitFunction();
+      collided_mask_ = 0;
+      setForceMasks();
       return;
     }
 
@@ -713,22 +2467,21 @@ namespace lin_processor {
       if (is_rx_high) {
         byte_buffer_ |= byte_buffer_bit_mask_;
       }
+      // NOTE: after the 8th data bit this becomes zero, so the stop bit is copied.
       byte_buffer_bit_mask_ = byte_buffer_bit_mask_ << 1;
       bits_read_in_byte_++;
-      // If that bit value was forced by the injector, mark this byte as having injected bits.
-      if (rx_bit_transfer_function_ != injector_actions::COPY_BIT) {
-        byte_buffer_has_injected_bits_ = true;
+      // Report data and checksum bytes, skipping the sync and frame id bytes. 
+      // Done after the 8th data bit rather than at the stop bit so the injector
+      // has a full bit time to update the checksum before the next start bit.
+      if (bits_read_in_byte_ > 8 && bytes_read_ >= 2) {
+        custom_injector::onIsrByteSent(bytes_read_ - 2, byte_buffer_, raw_byte_buffer_);
       }
-      // Set the transfer function for the next rx bit.
-      rx_bit_transfer_function_ = nextBitFunction();
       return;
     }
     
     // Here when in a stop bit.
-    bytes_read_++;
-    bits_read_in_byte_ = 0;
-
-    // Error if stop bit is not high.
+    // Error if stop bit is not high. Checked before counting the byte, so
+    // the error position is that of this byte.
     if (!is_rx_high) {
       // If in sync byte, report as sync error.
       setErrorFlags(bytes_read_ == 0 ? errors::SYNC_BYTE : errors::STOP_BIT);
@@ -736,6 +2489,9 @@ namespace lin_processor {
       // No need to set bit function, we exit the data reading state.
       return;
     }  
+
+    bytes_read_++;
+    bits_read_in_byte_ = 0;
     
     // Here when we just finished reading a byte. 
     // bytes_read is already incremented for this byte.
@@ -755,87 +2511,346 @@ namespace lin_processor {
       // NOTE: the byte limit count is enforeced somewhere else so we can assume safely here that this 
       // will not cause a buffer overlow.
       rx_frame_buffers[head_frame_buffer].append_byte(byte_buffer_, byte_buffer_has_injected_bits_);    
+      if (byte_buffer_has_injected_bits_) {
+        // Only data and checksum bytes can have injected bits.
+        auditByte(bytes_read_ - 3, raw_byte_buffer_, byte_buffer_, 
+            force_1_mask_ | force_0_mask_ | invert_mask_, collided_mask_);
+        // The readback of the last data bit was done at this stop bit.
+        if (collided_mask_) {
+          custom_injector::onIsrInjectionCollision(bytes_read_ - 3, collided_mask_);
+        }
+      }
+      rx_frame_buffers[head_frame_buffer].set_end_ticks(hardware_clock::ticks32ForIsr());
     }
     
-    // Report data and checksum bytes, skipping the sync and frame id bytes.
-    if (bytes_read_ >= 3) {     
-      // TODO: call this after the 8th data bit, before the stop bit, this way we will have
-      // a full bit slot to comptue the checksum rather than half a bit, until the high to low
-      // transition of the next start bit.
-      custom_injector::onIsrByteSent(bytes_read_ - 3, byte_buffer_);
-    }
-        
-    // Determine if there are more bytes.
-    boolean has_more_bytes = false;
+    // Wait for the start bit of the next byte.
     if (bytes_read_ == 2) {  
       // This is the case where we just read the id byte from the master.
       // Inform the injector.      
       custom_injector::onIsrFrameIdRecieved(byte_buffer_);
-            
+      if (custom_defs::kRecordErrorContext) {
+        last_id = byte_buffer_;
+      }
+      
+      // If the injector provides the response, send it ourselves. The 
+      // tick timer keeps running to time the response bits.
+      const custom_injector::private_::Response* const response = 
+          custom_injector::onIsrResponseToSend(byte_buffer_);
+      if (response) {
+        StateSendResponse::enter(response);
+        return;
+      }
+      
+      // Frames that may be modified are proxied at the middle of the bits.
+      // The added half bit delay only extends the response space.
+      if (custom_injector::isFrameModifiedForIsr()) {
+        setFollowChannels(0);
+      }
+    }
+
+    // If the frame has its learned length, close it now rather than waiting
+    // for the space timeout.
+    LinFrame& frame = rx_frame_buffers[head_frame_buffer];
+    if (bytes_read_ >= 2 && frame_lengths::isComplete(frame.get_byte(0), frame.num_bytes())) {
+      custom_injector::onIsrFrameEnd(frame);
+      publishAudit(frame);
+      if (!publishHeadFrameBuffer()) {
+        setErrorFlags(errors::BUFFER_OVERRUN);
+      }
+      StateDetectBreak::enterAfterEarlyClose(frame.get_byte(0));
+      return;
+    }
+
+    if (bytes_read_ == 2) {  
       // Master sent sync and ID bytes and now we need to wait for the response. It can 
-      // come from the master (1) or the slave (2), or 0 for timeout.
-      // TODO: user longer timeout than for normal bytes.
-      const byte lin_channel_ = waitForResponseStartBit(config.clock_ticks_per_until_start_bit());
-      has_more_bytes = lin_channel_;
-      rx_from_lin1_ = (lin_channel_ != 2);
+      // come from the master or the slave.
+      armWait(wait_events::BYTE_START, rx_channels::RX1 | rx_channels::RX2,
+          config.clock_ticks_until_response());
     } else {
       // This is the case where we don't need to check where the next byte is comming 
-      // from.
-      //
-      // Wait for the high to low transition of start bit of next byte. Using existing channel.
-      has_more_bytes =  waitForRxLow(config.clock_ticks_per_until_start_bit(), rx_from_lin1_);
+      // from. Using existing channel.
+      armWait(wait_events::BYTE_START, 
+          rx_from_lin1_ ? rx_channels::RX1 : rx_channels::RX2,
+          config.clock_ticks_until_byte());
     }
+  }
 
+  inline void StateReadData::handleByteStart(uint8 channel) {
     // Handle the case of no more bytes in this frame.
-    if (!has_more_bytes) {
+    if (!channel) {
       // Verify min byte count.
       if (bytes_read_ < LinFrame::kMinBytes) {
         setErrorFlags(errors::FRAME_TOO_SHORT);
         StateDetectBreak::enter();
-        // No need to set the next bit function, we exit the data reading state.
+        resumeTickTimerAtHalfTick();
         return;
       }
 
+      LinFrame& frame = rx_frame_buffers[head_frame_buffer];
+      frame_lengths::learn(frame.get_byte(0), frame.num_bytes());
+      custom_injector::onIsrFrameEnd(frame);
+      publishAudit(frame);
+
       // Frame looks ok so far. Move to next frame in the ring buffer.
       // NOTE: we will reset the byte_count of the new frame buffer next time we will enter data detect state.
       // NOTE: verification of sync byte, id, checksum, etc is done latter by the main code, not the ISR.
-      incrementHeadFrameBuffer();
-      if (tail_frame_buffer == head_frame_buffer) {
-        // Frame buffer overrun. We drop the oldest frame and continue with this one.       
+      if (!publishHeadFrameBuffer()) {
+        // Frame buffer overrun. A frame was dropped.
         setErrorFlags(errors::BUFFER_OVERRUN);
-        incrementTailFrameBuffer();
       }
 
       StateDetectBreak::enter();
-      // No need to set the next bit function, we exit the data reading state.
+      resumeTickTimerAtHalfTick();
       return;
     }
 
+    const uint16 start_ticks = 
+        custom_defs::kTrackResponseTiming ? hardware_clock::ticksForIsr() : 0;
+
+    // Have a tick in the middle of the start bit ASAP. The start bit is always
+    // copied since byte_buffer_bit_mask_ is zero.
+    resumeTickTimerAtHalfTick();
+
+    // The response can come from the master or the slave.
+    if (bytes_read_ == 2) {
+      rx_from_lin1_ = (channel != rx_channels::RX2);
+      if (!rx_from_lin1_) {
+        rx_frame_buffers[head_frame_buffer].setSlaveResponse();
+      }
+      // The publisher is known now, drop a rule for the other side.
+      custom_injector::onIsrResponseDirection(!rx_from_lin1_);
+      // Stop following rx1 before driving tx1, otherwise its echo on the 
+      // lin1 bus would be forwarded back to the slave.
+      if (follow_channels && !rx_from_lin1_) {
+        setFollowChannels(rx_channels::RX2);
+      }
+    }
+
+    if (custom_defs::kTrackResponseTiming && bytes_read_ <= 3) {
+      response_timing::byteStarted(rx_frame_buffers[head_frame_buffer], 
+          bytes_read_, start_ticks, !rx_from_lin1_);
+    }
+
     // Here when there is at least one more byte in this frame. Error if we already had
     // the max number of bytes.
     if (rx_frame_buffers[head_frame_buffer].num_bytes() >= LinFrame::kMaxBytes) {
       setErrorFlags(errors::FRAME_TOO_LONG);
       StateDetectBreak::enter();
-      // No need to set the next bit function, we exit the data reading state.
       return;  
     }
+  }
 
-    // Everything is ready for the next byte. Have a tick in the middle of its
-    // start bit, alsywas with a copy function.
-    //
-    //    
-    // TODO: move this to above the num_bytes check above for more accurate 
-    // timing of mid bit tick? 
-    rx_bit_transfer_function_ = injector_actions::COPY_BIT;
-    setTimerToHalfTick();
+  // ----- Send-Response State Implementation -----
+
+  const custom_injector::private_::Response* StateSendResponse::response_;
+  uint8 StateSendResponse::bytes_sent_;
+  uint8 StateSendResponse::bit_index_;
+  uint8 StateSendResponse::byte_buffer_;
+  uint8 StateSendResponse::space_ticks_;
+
+  inline void StateSendResponse::enter(const custom_injector::private_::Response* response) {
+    state = states::SEND_RESPONSE;
+    response_ = response;
+    bytes_sent_ = 0;
+    bit_index_ = 0;
+    space_ticks_ = kInjectedResponseSpaceBits;
+    // The response replaces the slave's one.
+    rx_frame_buffers[head_frame_buffer].setSlaveResponse();
+    setFollowChannels(0);
+    // Keep the slave side passive.
+    tx2_out::setHigh();
+  }
+
+  // Called at each tick. Each call outputs a single bit to the master.
+  inline void StateSendResponse::handleIsr() {
+    if (space_ticks_) {
+      space_ticks_--;
+      return;
+    }
+    
+    // Start bit.
+    if (bit_index_ == 0) {
+      tx1_pin::setLow();
+      byte_buffer_ = response_->bytes[bytes_sent_];
+      bit_index_++;
+      return;
+    }
+    
+    // Data bits, lsb first.
+    if (bit_index_ <= 8) {
+      if (byte_buffer_ & 0x01) {
+        tx1_pin::setHigh();
+      } else {
+        tx1_pin::setLow();
+      }
+      byte_buffer_ >>= 1;
+      bit_index_++;
+      return;
+    }
+    
+    // Stop bit.
+    tx1_pin::setHigh();
+    bit_index_ = 0;
+    LinFrame& frame = rx_frame_buffers[head_frame_buffer];
+    frame.append_byte(response_->bytes[bytes_sent_], true);    
+    frame.set_end_ticks(hardware_clock::ticks32ForIsr());
+    if (++bytes_sent_ < response_->num_bytes) {
+      return;
+    }
+    
+    // Here when the last byte is sent. The stop bit continues as the idle
+    // state of the bus.
+    custom_injector::onIsrResponseSent();
+    custom_injector::onIsrFrameEnd(frame);
+    if (!publishHeadFrameBuffer()) {
+      setErrorFlags(errors::BUFFER_OVERRUN);
+    }
+    StateDetectBreak::enter();
+  }
+
+  // ----- Send-Frame State Implementation -----
+
+  uint8 StateSendFrame::break_bits_;
+  uint8 StateSendFrame::bytes_sent_;
+  uint8 StateSendFrame::bit_index_;
+  uint8 StateSendFrame::byte_buffer_;
+
+  inline void StateSendFrame::enter() {
+    state = states::SEND_FRAME;
+    break_bits_ = insertion::kBreakBits + 1;
+    bytes_sent_ = 0;
+    bit_index_ = 0;
+    // The tick ISR drives the slave side and watches the master side.
+    setFollowChannels(0);
+    tx2_out::setLow();
+  }
+
+  // Called at each tick. Each call outputs a single bit to the slave.
+  inline void StateSendFrame::handleIsr() {
+    // A break of the master has the bus. Release the slave side and 
+    // proxy the break from this tick.
+    if (!rx1_pin::isHigh()) {
+      insertion::result = insert_results::ABORTED;
+      insertion::pending = false;
+      StateDetectBreak::enter();
+      StateDetectBreak::handleIsr();
+      return;
+    }
+
+    // The break, the first low bit was sent by enter(), then the delimiter.
+    if (break_bits_) {
+      if (--break_bits_ > 1) {
+        tx2_out::setLow();
+      } else if (break_bits_) {
+        tx2_out::setHigh();
+      }
+      if (break_bits_) {
+        return;
+      }
+    }
+
+    // Start bit. The sync byte, the id byte and then the response.
+    if (bit_index_ == 0) {
+      tx2_out::setLow();
+      byte_buffer_ = (bytes_sent_ == 0) ? 0x55 
+          : (bytes_sent_ == 1) ? insertion::frame.id 
+          : insertion::frame.bytes[bytes_sent_ - 2];
+      bit_index_++;
+      return;
+    }
+
+    // Data bits, lsb first.
+    if (bit_index_ <= 8) {
+      if (byte_buffer_ & 0x01) {
+        tx2_out::setHigh();
+      } else {
+        tx2_out::setLow();
+      }
+      byte_buffer_ >>= 1;
+      bit_index_++;
+      return;
+    }
+
+    // Stop bit.
+    tx2_out::setHigh();
+    bit_index_ = 0;
+    if (++bytes_sent_ < 2 + insertion::frame.num_bytes) {
+      return;
+    }
+
+    // Here when the last byte is sent. The stop bit continues as the idle
+    // state of the bus.
+    insertion::result = insert_results::SENT;
+    insertion::pending = false;
+    StateDetectBreak::enter();
   }
 
   // ----- ISR Handler -----
 
+#if CUSTOM_DEFS_USE_FAST_PROXY_ISR
+  // Interrupt on Timer 2 A-match.
+  // The body of the tick ISR, entered by a jump from the stub below, with 
+  // the regular ISR prologue and epilogue.
+  extern "C" void __vector_lin_tick_body() __attribute__((signal, used));
+
+  // Interrupt on Timer 2 A-match. With fast_proxy_op set, copies the rx bit
+  // to the tx pin and saves the port for the body. Uses only r24 and 
+  // instructions that don't change SREG, so no other state is saved. About
+  // 10 cycles from the vector to the tx write, vs. 40 or so of the regular
+  // prologue. With fast_proxy_op NONE, about 13 cycles are added before the 
+  // body.
+  ISR(TIMER2_COMPA_vect, ISR_NAKED)
+  {
+    asm volatile(
+        "push r24\n\t"
+        "lds r24, %[op]\n\t"
+        "sbrc r24, %[rx1_to_tx2]\n\t"
+        "rjmp 1f\n\t"
+        "sbrs r24, %[rx2_to_tx1]\n\t"
+        "rjmp 3f\n\t"
+        "in r24, %[pinc]\n\t"
+        "sbrs r24, %[rx2_bit]\n\t"
+        "cbi %[portc], %[tx1_bit]\n\t"
+        "sbrc r24, %[rx2_bit]\n\t"
+        "sbi %[portc], %[tx1_bit]\n\t"
+        "rjmp 2f\n\t"
+        "1:\n\t"
+        "in r24, %[pind]\n\t"
+        "sbrs r24, %[rx1_bit]\n\t"
+        "cbi %[portd], %[tx2_bit]\n\t"
+        "sbrc r24, %[rx1_bit]\n\t"
+        "sbi %[portd], %[tx2_bit]\n\t"
+        "2:\n\t"
+        "sts %[pins], r24\n\t"
+        "3:\n\t"
+        "pop r24\n\t"
+        "jmp __vector_lin_tick_body\n\t"
+        :: [op] "i" (&fast_proxy_op), [pins] "i" (&fast_proxy_pins),
+           [rx1_to_tx2] "I" (fast_proxy_ops::kRx1ToTx2Bit), 
+           [rx2_to_tx1] "I" (fast_proxy_ops::kRx2ToTx1Bit),
+           [pinc] "I" (_SFR_IO_ADDR(PINC)), [portc] "I" (_SFR_IO_ADDR(PORTC)),
+           [pind] "I" (_SFR_IO_ADDR(PIND)), [portd] "I" (_SFR_IO_ADDR(PORTD)),
+           [rx1_bit] "I" (kFastRx1Bit), [tx1_bit] "I" (kFastTx1Bit),
+           [rx2_bit] "I" (kFastRx2Bit), [tx2_bit] "I" (kFastTx2Bit));
+  }
+
+  void __vector_lin_tick_body()
+#else
   // Interrupt on Timer 2 A-match.
   ISR(TIMER2_COMPA_vect)
+#endif
   {
+    // First, so it is the latency of this sample.
+    const uint8 entry_counts = custom_defs::kDetectLateSamples ? TCNT2 : 0;
     isr_pin::setHigh();
+    const uint16 start_ticks = custom_defs::kProfileIsr ? hardware_clock::ticksForIsr() : 0;
+    const uint8 path = state - states::DETECT_BREAK;
+    if (custom_defs::kDetectLateSamples && path < isr_paths::WAIT_DONE &&
+        checkLateSample(path, entry_counts) && custom_defs::kInvalidateLateFrames &&
+        (state == states::READ_DATA || state == states::SEND_RESPONSE)) {
+      // The bit of this run belongs to the frame in the head buffer.
+      rx_frame_buffers[head_frame_buffer].setInvalid();
+    }
     // TODO: make this state a boolean instead of enum? (efficency).
     switch (state) {
     case states::DETECT_BREAK:
@@ -844,16 +2859,108 @@ namespace lin_processor {
     case states::READ_DATA:
       StateReadData::handleIsr();
       break;
+    case states::SEND_RESPONSE:
+      StateSendResponse::handleIsr();
+      break;
+    case states::SEND_FRAME:
+      StateSendFrame::handleIsr();
+      break;
     default:
       setErrorFlags(errors::OTHER);
       StateDetectBreak::enter();
     }
 
-    // Increment the isr flag to indicate to the main that the ISR just
-    // exited and interrupts can be temporarily disabled without causes ISR 
-    // jitter.
-    isr_marker++;
-    
+    updateTickPeriod();
+    updateFastProxyOp();
+
+    if (path < isr_paths::WAIT_DONE) {
+      profileIsr(path, start_ticks);
+      if (custom_defs::kDetectLateSamples) {
+        checkOverrun(path);
+      }
+    }
+    isr_pin::setLow();
+  }
+
+  // Called from the wait ISRs below when the armed event arrived on
+  // the given channel, or with 0 on timeout.
+  static inline void handleWaitDone(uint8 channel) {
+    switch (disarmWait()) {
+    case wait_events::BREAK_END:
+      StateDetectBreak::handleBreakEnd(channel);
+      break;
+    case wait_events::SYNC_START:
+      StateReadData::handleSyncStart(channel);
+      break;
+    case wait_events::BYTE_START:
+      StateReadData::handleByteStart(channel);
+      break;
+    default:
+      setErrorFlags(errors::OTHER);
+      StateDetectBreak::enter();
+      resumeTickTimerAtHalfTick();
+    }
+    updateFastProxyOp();
+  }
+
+  // Interrupt on rx1 (INT0) edge.
+  ISR(INT0_vect)
+  {
+    const boolean is_rx1_high = rx1_pin::isHigh();
+    if (follow_channels & rx_channels::RX1) {
+      // Forward the edge first, to minimize the latency.
+      if (is_rx1_high) {
+        tx2_out::setHigh();
+      } else {
+        tx2_out::setLow();
+      }
+      proxy_self_test::edgeForwarded();
+      // INT0 senses any edge. Ignore edges that are not the armed wait.
+      if (wait_event == wait_events::NONE || !(wait_channels & rx_channels::RX1) ||
+          is_rx1_high != (wait_event == wait_events::BREAK_END)) {
+        // The last falling edge before a break is its start.
+        if (!is_rx1_high && state == states::DETECT_BREAK) {
+          break_timing::fall_ticks = hardware_clock::ticksForIsr();
+        }
+        return;
+      }
+    }
+    isr_pin::setHigh();
+    const uint16 start_ticks = custom_defs::kProfileIsr ? hardware_clock::ticksForIsr() : 0;
+    handleWaitDone(rx_channels::RX1);
+    profileIsr(isr_paths::WAIT_DONE, start_ticks);
+    isr_pin::setLow();
+  }
+
+  // Interrupt on rx2 (PCINT9) change. We care only about high to low.
+  ISR(PCINT1_vect)
+  {
+    if (follow_channels & rx_channels::RX2) {
+      // Forward the edge first, to minimize the latency.
+      if (rx2_pin::isHigh()) {
+        tx1_pin::setHigh();
+      } else {
+        tx1_pin::setLow();
+      }
+      proxy_self_test::edgeForwarded();
+    }
+    if (!rx2_pin::isHigh() && wait_event != wait_events::NONE &&
+        (wait_channels & rx_channels::RX2)) {
+      isr_pin::setHigh();
+      const uint16 start_ticks = custom_defs::kProfileIsr ? hardware_clock::ticksForIsr() : 0;
+      handleWaitDone(rx_channels::RX2);
+      profileIsr(isr_paths::WAIT_DONE, start_ticks);
+      isr_pin::setLow();
+    }
+  }
+
+  // Interrupt on Timer 1 B-match. Wait timeout.
+  ISR(TIMER1_COMPB_vect)
+  {
+    isr_pin::setHigh();
+    const uint16 start_ticks = custom_defs::kProfileIsr ? hardware_clock::ticksForIsr() : 0;
+    handleWaitDone(0);
+    profileIsr(isr_paths::WAIT_DONE, start_ticks);
     isr_pin::setLow();
   }
 }  // namespace lin_processor
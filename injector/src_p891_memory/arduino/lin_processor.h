@@ -18,20 +18,78 @@
 
 // Uses 
 // * Timer2 - used to generate the bit ticks.
+// * INT0, PCINT9, Timer1 B-match - used to wait for RX transitions.
 // * OC2B (PD3) - timer output ticks. For debugging. If needed, can be changed
-//   to not using this pin.
+//   to not using this pin. With custom_defs::kUseHardwareTxEdges, the LIN TX 
+//   output of the slave side instead.
 // * PD2 - LIN RX input.
 // * PC0, PC1, PC2, PC3 - debugging outputs. See .cpp file for details.
 namespace lin_processor {
-  // Call once in program setup. 
+  // Call once in program setup. Does not print, arms the ISR as soon as
+  // the global interrupts are enabled.
   extern void setup();
 
+  // Print to sio the baud rate and timing of the configuration. Part of 
+  // the deferred boot report.
+  extern void printConfig();
+
   // Try to read next available rx frame. If available, return true and set
   // given buffer. Otherwise, return false and leave *buffer unmodified. 
   // The sync, id and checksum bytes of the frame as well as the total byte
   // count are not verified. 
   extern boolean readNextFrame(LinFrame* buffer);
 
+  // Zero copy alternative to readNextFrame(). Returns a pointer to the oldest 
+  // available rx frame or NULL if none is available. With 
+  // custom_defs::kUsePriorityLane, the frames of the priority ids come 
+  // before the older other frames. The frame is not modified 
+  // by the ISR until releaseFrame() is called.
+  extern const LinFrame* peekFrame();
+
+  // Release the frame returned by peekFrame(). Call only after peekFrame() 
+  // returned a non NULL frame.
+  extern void releaseFrame();
+
+  // The fill level of the rx queue, in percent of the frames (or with 
+  // custom_defs::kUsePackedFrameRing, the bytes) it can hold, excluding the
+  // priority lane. Call from main.
+  extern uint8 rxQueuePercent();
+
+  // Called by drainFrames() with each frame. The frame is valid only during
+  // the call.
+  typedef void (*FrameHandler)(const LinFrame& frame);
+
+  // Pass the available rx frames, oldest first and up to max_frames, to the
+  // given handler, without copying, and release them. Returns the number of
+  // frames handled. Frames that arrive during the call are left to the next 
+  // call. Lets the main loop consume a burst in a single iteration.
+  extern uint8 drainFrames(FrameHandler handler, uint8 max_frames);
+
+  // Copy the newest frame of the given id to *buffer and set *seq to its
+  // sequence number, which changes each time the ISR stores a newer frame
+  // of that id, including frames that were dropped by a full rx queue. 
+  // Returns false, leaving *buffer and *seq unmodified, if the id is not in 
+  // custom_defs::kLatestFrameIds or no frame of it was recieved yet. As with 
+  // readNextFrame(), the frame is not verified.
+  extern boolean readLatestFrame(uint8 id, LinFrame* buffer, uint8* seq);
+
+  // Frames whose id is not accepted are not added to the rx queue. They are
+  // still proxied and seen by the injector. All 
+  // ids are accepted by default. Can be called from main at any time.
+  extern void acceptAllIds(boolean accept);
+  extern void acceptId(uint8 id, boolean accept);
+
+  // Header only frames (a header with no slave response) are not added to 
+  // the rx queue unless their id is subscribed. Instead, the ISR counts them 
+  // per id. With custom_defs::kQueueHeaderOnlyFrames all the ids are 
+  // subscribed by default. Can be called from main at any time.
+  extern void subscribeHeaderOnlyFrames(uint8 id, boolean subscribe);
+
+  // Returns the number of header only frames of the given id that were
+  // counted instead of queued since the previous call, and clears it. 
+  // Saturates at 0xff. Call from main.
+  extern uint8 getAndClearNoResponses(uint8 id);
+
   // Errors byte masks for the individual error bits.
   namespace errors {
     static const uint8 FRAME_TOO_SHORT = (1 << 0);
@@ -43,6 +101,271 @@ namespace lin_processor {
     static const uint8 OTHER = (1 << 6);
   }
 
+  // Number of error types, one per bit in errors.
+  static const uint8 kNumErrorTypes = 7;
+
+  // Saturating event counters since setup or last clear.
+  // Number of queue delay buckets in Stats.
+  static const uint8 kNumQueueDelayBuckets = 8;
+
+  struct Stats {
+    // Number of frames added to the rx queue.
+    uint16 frames;
+    // Per error type counters, indexed by the bit index of the errors:: mask.
+    uint16 errors[kNumErrorTypes];
+    // Number of bits whose three samples did not agree and were decided by 
+    // a majority vote. Used only with kUseMajorityVoteSampling.
+    uint16 voted_bits;
+    // Time from the ISR closing a frame to main taking it from the rx queue,
+    // in log2 buckets of hardware clock ticks: <64 (256us), <128, ..., 
+    // <4096 (16ms) and the rest. The max is saturated at 0xffff (~262ms). 
+    // An eighth of these with custom_defs::kUseFineHardwareClock.
+    // Used only with kTrackQueueDelay.
+    uint16 queue_delays[kNumQueueDelayBuckets];
+    uint16 max_queue_delay_ticks;
+    // Number of queued frames replaced by a newer frame of the same id when 
+    // the queue was full. Used only with kOverrunCoalesce.
+    uint16 coalesced;
+  };
+
+  // Copy current statistics to *stats and optionally clear them.
+  extern void getStats(Stats* stats, boolean clear);
+
+  // Print to sio the given statistics.
+  extern void printStats(const Stats& stats);
+
+  // Histograms of the lengths of the header breaks and break delimiters, 
+  // measured with the hardware clock, since setup or the last clear. LIN 
+  // requires a break of at least 13 bits and a delimiter of at least one 
+  // bit. Counters saturate at 0xffff.
+  struct BreakTiming {
+    // Per length bucket: <12, 12, 13, 14, 15, 16-19 and 20+ bits.
+    uint16 breaks[7];
+    // Number of lows that were too long for a break, e.g. wake up pulses.
+    uint16 long_breaks;
+    // Per length bucket: <1, 1, 2, 3-4 and 5+ bits.
+    uint16 delimiters[5];
+    // The shortest break and delimiter, in clock ticks, 0xffff if none.
+    uint16 min_break_ticks;
+    uint16 min_delimiter_ticks;
+  };
+
+  // Copy the break timing to *timing and optionally clear it.
+  extern void getBreakTiming(BreakTiming* timing, boolean clear);
+
+  // Print to sio the given break timing, in a single line.
+  extern void printBreakTiming(const BreakTiming& timing);
+
+  // A record of the bytes of a frame that had bits injected. Byte index 0 is
+  // the first data byte. Substituted responses are not recorded.
+  struct InjectionAudit {
+    // The frame id byte.
+    uint8 id;
+    // Number of data and checksum bytes in the frame.
+    uint8 num_bytes;
+    // Number of records dropped before this one since the queue was full.
+    // Saturates at 255.
+    uint8 dropped_before;
+    // The low 16 bits of the end_ticks() of the frame, to match the record
+    // with the frame.
+    uint16 end_ticks;
+    // Bit i is set if byte i had injected bits. Other bytes are not recorded.
+    uint16 injected_bytes;
+    // Bit i is set if an injected bit of byte i was read back from the bus
+    // with another level, see custom_defs::kUseInjectionReadback.
+    uint16 collided_bytes;
+    // Per byte, the byte as recieved, as sent, and the mask of the bits that 
+    // were forced or inverted by the injector.
+    uint8 original[LinFrame::kMaxBytes - 1];
+    uint8 result[LinFrame::kMaxBytes - 1];
+    uint8 forced[LinFrame::kMaxBytes - 1];
+  };
+
+  // Try to read the injection audit record of the given frame, a frame with
+  // injected bits that was just taken from the rx queue. If available, 
+  // return true and set given buffer. Otherwise, e.g. if the record was
+  // dropped, return false. The records of earlier frames, e.g. of frames
+  // that were not queued, are discarded. Always false with 
+  // custom_defs::kUsePackedFrameRing, whose frames have no end ticks.
+  extern boolean readInjectionAuditOf(const LinFrame& frame, InjectionAudit* buffer);
+
+  // Print to sio the given injection audit record, in one line.
+  extern void printInjectionAudit(const InjectionAudit& audit);
+
+  // The ISR context of an error, see custom_defs::kRecordErrorContext.
+  struct ErrorRecord {
+    // The errors:: flags that were set.
+    uint8 flags;
+    // The state of the ISR state machine, 1 (DETECT_BREAK), 2 (READ_DATA),
+    // 3 (SEND_RESPONSE) or 4 (SEND_FRAME).
+    uint8 state;
+    // The id byte of the current frame, or of the last one if the error
+    // came before the id byte.
+    uint8 id;
+    // Number of complete bytes of the frame, including the sync and id 
+    // bytes, and number of bits read in the next byte, start bit included.
+    // 9 at a stop bit. Meaningful in the READ_DATA state.
+    uint8 bytes_read;
+    uint8 bits_read_in_byte;
+    // True if the response bytes were read from the slave side.
+    boolean from_slave;
+    // Hardware clock ticks at the error, 16 bits.
+    uint16 ticks;
+    // Number of records dropped before this one since the queue was full.
+    // Saturates at 255.
+    uint8 dropped_before;
+  };
+
+  // Try to read the next error record. If available, return true and set
+  // given buffer. Otherwise, return false.
+  extern boolean readNextErrorRecord(ErrorRecord* buffer);
+
+  // Print to sio the given error record, in one line.
+  extern void printErrorRecord(const ErrorRecord& record);
+
+  // The events of the ISR trace, see custom_defs::kIsrTracePolicy. The 
+  // start and end of each ISR run, of the sampling of a bit, of a break 
+  // (from its detection to the read of the sync byte) and an error flag.
+  namespace isr_events {
+    static const uint8 ISR_START = 1;
+    static const uint8 ISR_END = 2;
+    static const uint8 SAMPLE_START = 3;
+    static const uint8 SAMPLE_END = 4;
+    static const uint8 BREAK_START = 5;
+    static const uint8 BREAK_END = 6;
+    static const uint8 ERROR = 7;
+  }
+
+  // A record of the ISR trace.
+  struct IsrTraceRecord {
+    // One of isr_events.
+    uint8 event;
+    // The tick timer (Timer2) count, the time within the current bit.
+    uint8 counts;
+    // The state of the ISR state machine, as in ErrorRecord.
+    uint8 state;
+  };
+
+  // Number of records of the ISR trace ring, a power of 2.
+  static const uint8 kIsrTraceRecords = 32;
+
+  // Stop the ISR trace, so its last records can be read, oldest first, 
+  // with readNextIsrTraceRecord(). Returns false if the policy is not 
+  // RING.
+  extern boolean stopIsrTrace();
+
+  // Try to read the next record of a stopped ISR trace. If available, 
+  // return true and set given buffer. Otherwise, return false and restart
+  // the trace.
+  extern boolean readNextIsrTraceRecord(IsrTraceRecord* buffer);
+
+  // Print to sio the given ISR trace record, in one line.
+  extern void printIsrTraceRecord(const IsrTraceRecord& record);
+
+  // ISR profile paths. The timer ISR is profiled by the state it handled,
+  // and the edge and timeout ISRs of the waits (e.g. the wait for the 
+  // response bytes) as WAIT_DONE.
+  namespace isr_paths {
+    static const uint8 DETECT_BREAK = 0;
+    static const uint8 READ_DATA = 1;
+    static const uint8 SEND_RESPONSE = 2;
+    static const uint8 SEND_FRAME = 3;
+    static const uint8 WAIT_DONE = 4;
+    static const uint8 kNumPaths = 5;
+  }
+
+  // ISR run times of a path in hardware clock ticks (4us, 0.5us with 
+  // custom_defs::kUseFineHardwareClock), from the ISR entry to its exit.
+  // Collected if custom_defs::kProfileIsr.
+  struct IsrPathStats {
+    uint32 count;
+    uint32 sum_ticks;
+    uint8 min_ticks;
+    uint8 max_ticks;
+    // Number of runs longer than custom_defs::kIsrBudgetMicros. Saturates.
+    uint16 over_budget;
+    // Number of tick ISR runs that started more than a quarter bit after 
+    // their timer match, and that ended after the next match. Collected if
+    // custom_defs::kDetectLateSamples, even without kProfileIsr. Saturate.
+    uint16 late_samples;
+    uint16 overruns;
+  };
+
+  // Copy the stats of the given path and clear them.
+  extern void getAndClearIsrProfile(uint8 path, IsrPathStats* stats);
+
+  // Print to sio the given stats of a path, in one line.
+  extern void printIsrProfile(uint8 path, const IsrPathStats& stats);
+
+  // The max run time of all the paths in ticks, saturated at 0xff, since 
+  // the last call. Kept apart from the path stats, which are cleared by 
+  // their dump. Zero without custom_defs::kProfileIsr.
+  extern uint8 getAndClearMaxIsrTicks();
+
+  // Max number of ids whose response timing is tracked, the first ids seen.
+  static const uint8 kMaxResponseTimingIds = 8;
+
+  // The response timing of an id in hardware clock ticks (4us, 0.5us with 
+  // custom_defs::kUseFineHardwareClock), since setup or the last clear. Collected if custom_defs::kTrackResponseTiming.
+  struct ResponseTiming {
+    // The protected id.
+    uint8 id;
+    // Number of responses, and how many of them came from the slave side.
+    // Saturate.
+    uint16 count;
+    uint16 slave_responses;
+    // Time from the end of the header (the id stop bit) to the response 
+    // start bit.
+    uint32 sum_ticks;
+    uint16 min_ticks;
+    uint16 max_ticks;
+    // Space from the stop bit of the first response byte to the start bit
+    // of the second, 0xffff min if none.
+    uint16 min_space_ticks;
+    uint16 max_space_ticks;
+  };
+
+  // Copy the timing of the given entry, [0, kMaxResponseTimingIds), and 
+  // clear its stats. Returns false if the entry has no id yet.
+  extern boolean getAndClearResponseTiming(uint8 index, ResponseTiming* timing);
+
+  // Print to sio the given response timing, in one line.
+  extern void printResponseTiming(const ResponseTiming& timing);
+
+  // A complete frame that the injector sends on its own to the slave side,
+  // header and response. Used with custom_defs::kUseFrameInsertion, see 
+  // frame_insertion.h for the scheduling.
+  struct InsertedFrame {
+    // The protected id byte.
+    uint8 id;
+    // Number of data and checksum bytes.
+    uint8 num_bytes;
+    uint8 bytes[LinFrame::kMaxBytes - 1];
+  };
+
+  // Results of an inserted frame.
+  namespace insert_results {
+    // Not done yet, or no frame was inserted.
+    static const uint8 NONE = 0;
+    static const uint8 SENT = 1;
+    // The master started a break while sending. The slave side was released 
+    // and the break proxied.
+    static const uint8 ABORTED = 2;
+    // The buses were not idle before the deadline.
+    static const uint8 EXPIRED = 3;
+  }
+
+  // Have the ISR send the given frame on the slave side, at the bit ticks, 
+  // once both buses were idle for custom_defs::kInsertIdleBits bits, if 
+  // that happens before the hardware clock time deadline_ticks 
+  // (hardware_clock::ticks32ForNonIsr()). Returns false if the previous 
+  // frame is still pending. Call from main.
+  extern boolean insertFrame(const InsertedFrame& frame, uint32 deadline_ticks);
+
+  // Returns the insert_results of the last inserted frame once it is done,
+  // and clears it. NONE while pending. Call from main.
+  extern uint8 getAndClearInsertResult();
+
   // Get current error flag and clear it. 
   extern uint8 getAndClearErrorFlags();
   
@@ -0,0 +1,202 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "main_loop_bench.h"
+
+#include <avr/interrupt.h>
+#include "compact_signal_tracker.h"
+#include "custom_defs.h"
+#include "custom_signals.h"
+#include "hardware_clock.h"
+#include "lin_frame.h"
+#include "signal_tracker.h"
+#include "sio.h"
+#include "system_clock.h"
+
+namespace main_loop_bench {
+  // The fixtures of the cases. Frames of the sport mode button unit, the
+  // second differs in the last data byte, which has no signals.
+  static LinFrame frame_a;
+  static LinFrame frame_b;
+  static boolean use_frame_b;
+  static SignalTracker tracker(1, 1000, 2000);
+  static const SignalTrackerParams kCompactTrackerParams PROGMEM = { 1, 1000, 2000 };
+  static CompactSignalTracker compact_tracker(&kCompactTrackerParams);
+
+  // Sink of the computed values, so they are not optimized away.
+  static volatile uint8 sink;
+
+  static void benchEmpty() {
+  }
+
+  static void benchCopy() {
+    const LinFrame frame = frame_a;
+    sink = frame.num_bytes();
+  }
+
+  static void benchIsValid() {
+    const LinFrame frame = frame_a;
+    sink = frame.isValid();
+  }
+
+  static void benchComputeChecksum() {
+    sink = frame_a.computeChecksum();
+  }
+
+  static void benchSignalsSame() {
+    custom_signals::frameArrived(frame_a, NULL);
+  }
+
+  static void benchSignalsChanged() {
+    use_frame_b = !use_frame_b;
+    custom_signals::frameArrived(use_frame_b ? frame_b : frame_a, NULL);
+  }
+
+  static void benchTrackerReport() {
+    tracker.reportSignal(true);
+  }
+
+  static void benchTrackerLoop() {
+    tracker.loop();
+  }
+
+  static void benchCompactTrackerReport() {
+    compact_tracker.reportSignal(true);
+  }
+
+  static void benchCompactTrackerLoop() {
+    compact_tracker.loop();
+  }
+
+  static void benchPrintf() {
+    sio::printf(F("bench %u\n"), 12345);
+  }
+
+  static void benchTypedOut() {
+    sio::out << F("bench ") << (uint16)12345 << '\n';
+  }
+
+  static void benchSystemClock() {
+    system_clock::loop();
+  }
+
+  struct Case {
+    const char* name;
+    void (*function)();
+    // Serial output room needed, including the result line.
+    uint8 min_capacity;
+  };
+
+#define MAIN_LOOP_BENCH_CASES(X) \
+  X(empty, benchEmpty, 0) \
+  X(copy, benchCopy, 0) \
+  X(isValid, benchIsValid, 0) \
+  X(computeChecksum, benchComputeChecksum, 0) \
+  X(signals_same, benchSignalsSame, 0) \
+  X(signals_changed, benchSignalsChanged, 0) \
+  X(tracker_report, benchTrackerReport, 0) \
+  X(tracker_loop, benchTrackerLoop, 0) \
+  X(compact_report, benchCompactTrackerReport, 0) \
+  X(compact_loop, benchCompactTrackerLoop, 0) \
+  X(printf, benchPrintf, 13 * kIterations) \
+  X(typed_out, benchTypedOut, 13 * kIterations) \
+  X(system_clock, benchSystemClock, 0)
+
+#define MAIN_LOOP_BENCH_NAME(name, function, min_capacity) \
+  static const char kName_##name[] PROGMEM = #name;
+  MAIN_LOOP_BENCH_CASES(MAIN_LOOP_BENCH_NAME)
+#undef MAIN_LOOP_BENCH_NAME
+
+  static const Case kCases[] PROGMEM = {
+#define MAIN_LOOP_BENCH_CASE(name, function, min_capacity) \
+    { kName_##name, function, min_capacity },
+    MAIN_LOOP_BENCH_CASES(MAIN_LOOP_BENCH_CASE)
+#undef MAIN_LOOP_BENCH_CASE
+  };
+
+  static const uint8 kNumCases = sizeof(kCases) / sizeof(kCases[0]);
+
+  // The longest result line, after the output of the case.
+  static const uint8 kResultLineBytes = 48;
+
+  // The next case to run, or kNoRun.
+  static const uint8 kNoRun = 0xff;
+  static uint8 next_case = kNoRun;
+
+  // Set frame to the 0x8e frame with the given last data byte and a valid
+  // checksum per the checksum model of the id.
+  static void buildFrame(LinFrame* frame, uint8 last_data_byte) {
+    static const uint8 kData[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    // The checksum covers the bytes before the last one, see append_byte().
+    // Append a placeholder to compute it, then build again with it.
+    uint8 checksum = 0;
+    for (uint8 pass = 0; pass < 2; pass++) {
+      frame->reset();
+      frame->append_byte(0x8e, false);
+      for (uint8 i = 0; i < sizeof(kData); i++) {
+        frame->append_byte(kData[i], false);
+      }
+      frame->append_byte(last_data_byte, false);
+      if (pass == 0) {
+        frame->append_byte(0, false);
+        checksum = frame->computeChecksum();
+      } else {
+        frame->append_byte(checksum, false);
+      }
+    }
+  }
+
+  boolean requestRun() {
+    if (!custom_defs::kUseMainLoopBench) {
+      return false;
+    }
+    buildFrame(&frame_a, 0x00);
+    buildFrame(&frame_b, 0x01);
+    next_case = 0;
+    return true;
+  }
+
+  // Time kIterations calls of the given function. Returns the sum of the
+  // ticks.
+  static uint16 timeCalls(void (*function)()) {
+    const uint8 sreg = SREG;
+    cli();
+    const uint16 start = hardware_clock::ticksForNonIsr();
+    for (uint8 i = 0; i < kIterations; i++) {
+      function();
+    }
+    const uint16 ticks = hardware_clock::ticksForNonIsr() - start;
+    SREG = sreg;
+    return ticks;
+  }
+
+  void loop() {
+    if (!custom_defs::kUseMainLoopBench || next_case == kNoRun) {
+      return;
+    }
+    const Case* const c = &kCases[next_case];
+    const uint8 min_capacity = pgm_read_byte(&c->min_capacity);
+    if (sio::capacity() < min_capacity + kResultLineBytes) {
+      return;
+    }
+    void (*const function)() = (void (*)())pgm_read_word(&c->function);
+    const uint16 ticks = timeCalls(function);
+    const uint32 nanos = hardware_clock::averageNanos(ticks, kIterations);
+    const uint32 cycles = (nanos * (F_CPU / 1000000L)) / 1000;
+    sio::out << F("bench ") 
+        << (const __FlashStringHelper*)pgm_read_word(&c->name) << F(": ") 
+        << sio::micros(nanos) << F(" us, ") << cycles << F(" cycles\n");
+    if (++next_case >= kNumCases) {
+      next_case = kNoRun;
+    }
+  }
+}  // namespace main_loop_bench
@@ -0,0 +1,47 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef MAIN_LOOP_BENCH_H
+#define MAIN_LOOP_BENCH_H
+
+#include "avr_util.h"
+
+// Per call cost of the main loop components, measured on the target with
+// the hardware clock, to rank main loop optimizations on real numbers. 
+// Each case is timed over kIterations calls with interrupts disabled, and
+// printed as a line of the average time and the equivalent cpu cycles:
+//
+//   bench <case>: <usecs> us, <cycles> cycles
+//
+// The 'empty' case is the overhead of the call and the loop, included in 
+// the other cases. The 'isValid' case includes a frame copy ('copy') since
+// the validity is cached in the frame. The printf and typed output cases 
+// print their test lines. The signals cases feed synthetic 0x8e frames to
+// custom_signals, with the same payload and with a changing unused byte.
+// The tracker cases report a signal that supports the tracker state, the
+// common case, after the first report.
+//
+// The LIN frames are not processed while a case is timed. Enabled with 
+// custom_defs::kUseMainLoopBench, for the bench only, not in the car.
+namespace main_loop_bench {
+  // Number of calls per case.
+  static const uint8 kIterations = 8;
+
+  // Start a run, a case per call of loop() as the serial output has room.
+  // Returns false if disabled.
+  extern boolean requestRun();
+
+  // Call from the main loop.
+  extern void loop();
+}  // namespace main_loop_bench
+
+#endif
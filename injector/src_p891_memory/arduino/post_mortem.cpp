@@ -0,0 +1,163 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "post_mortem.h"
+
+#include <avr/eeprom.h>
+#include "custom_injector.h"
+#include "lin_processor.h"
+#include "passive_timer.h"
+#include "sio.h"
+#include "system_clock.h"
+#include "watchdog.h"
+
+namespace post_mortem {
+  // After the settings config block.
+  static const uint16 kRingAddress = 256;
+
+  // The CRC is written last, so a record interrupted by a reset fails it.
+  struct Record {
+    // Incremented per run.
+    uint8 seq;
+    // MCUSR at the start of the run.
+    uint8 reset_flags;
+    // The watchdog tag of the stall that reset the previous run, or 
+    // watchdog::kNoTag.
+    uint8 stall_tag;
+    // Saturates at 0xffff.
+    uint16 uptime_seconds;
+    // All the LIN error flags of the run, and the number of reports.
+    uint8 lin_error_flags;
+    uint16 lin_error_count;
+    // custom_injector::private_::active_pulses at the last update.
+    uint8 active_pulses;
+    uint8 crc;
+  };
+
+  // The record of this run, and its slot.
+  static Record record;
+  static uint8 slot;
+
+  // The copy of the record that is being written, and the index of its 
+  // next byte to write, or sizeof(Record) when idle.
+  static Record pending;
+  static uint8 write_index = sizeof(Record);
+
+  static PassiveTimer update_timer;
+
+  // The slot of the next record to print, kNumRecords if not printing.
+  static uint8 next_dump_slot = kNumRecords;
+  static uint8 dump_count = kNumRecords;
+
+  static inline uint8* recordAddress(uint8 slot) {
+    return (uint8*)(kRingAddress + slot * sizeof(Record));
+  }
+
+  // Read the record in the given slot. Returns true if it is valid.
+  static boolean readRecord(uint8 slot, Record* result) {
+    eeprom_read_block(result, recordAddress(slot), sizeof(Record));
+    return crc8((const uint8*)result, sizeof(Record) - 1) == result->crc;
+  }
+
+  // Update the record and start writing it.
+  static void updateRecord() {
+    const uint32 uptime_seconds = system_clock::timeMillis() / 1000;
+    record.uptime_seconds = (uptime_seconds > 0xffff) ? 0xffff : uptime_seconds;
+    record.active_pulses = custom_injector::private_::active_pulses;
+    record.crc = crc8((const uint8*)&record, sizeof(Record) - 1);
+    pending = record;
+    write_index = 0;
+  }
+
+  void setup() {
+    // The newest record is a valid record whose next slot does not have
+    // the next sequence. This run takes the slot after it.
+    Record newest;
+    Record next;
+    uint8 seq = 0;
+    slot = 0;
+    for (uint8 i = 0; i < kNumRecords; i++) {
+      if (!readRecord(i, &newest)) {
+        continue;
+      }
+      const uint8 next_slot = (i + 1) % kNumRecords;
+      if (readRecord(next_slot, &next) && next.seq == (uint8)(newest.seq + 1)) {
+        continue;
+      }
+      seq = newest.seq + 1;
+      slot = next_slot;
+      break;
+    }
+    record.seq = seq;
+    record.reset_flags = watchdog::resetFlags();
+    record.stall_tag = watchdog::stallTag();
+    record.lin_error_flags = 0;
+    record.lin_error_count = 0;
+    updateRecord();
+  }
+
+  void reportLinErrors(uint8 error_flags) {
+    record.lin_error_flags |= error_flags;
+    if (record.lin_error_count != 0xffff) {
+      record.lin_error_count++;
+    }
+  }
+
+  void requestDump() {
+    next_dump_slot = slot;
+    dump_count = 0;
+  }
+
+  // Print the next record of the dump, if the output has room for it.
+  static void dumpNextRecord() {
+    if (sio::capacity() < 64) {
+      return;
+    }
+    next_dump_slot = (next_dump_slot + 1) % kNumRecords;
+    dump_count++;
+    Record r;
+    if (!readRecord(next_dump_slot, &r)) {
+      return;
+    }
+    sio::out << F("pm ") << r.seq << F(": reset=") << sio::hex2(r.reset_flags) 
+        << F(" stall=") << r.stall_tag << F(" up=") << r.uptime_seconds 
+        << F("s lin=") << sio::hex2(r.lin_error_flags) << '/' << r.lin_error_count 
+        << F(" pulses=") << sio::hex2(r.active_pulses) << '\n';
+  }
+
+  void loop() {
+    if (dump_count < kNumRecords) {
+      dumpNextRecord();
+    }
+    if (write_index >= sizeof(Record)) {
+      if (update_timer.timeMillis() < kUpdateMillis) {
+        return;
+      }
+      update_timer.restart();
+      updateRecord();
+    }
+    // The eeprom writes a byte in the background. Don't wait for it.
+    if (!eeprom_is_ready()) {
+      return;
+    }
+    // Skip the unchanged bytes, the CRC is the last byte.
+    const uint8* const bytes = (const uint8*)&pending;
+    uint8* const address = recordAddress(slot);
+    while (write_index < sizeof(Record)) {
+      const uint8 i = write_index++;
+      if (eeprom_read_byte(address + i) != bytes[i]) {
+        eeprom_write_byte(address + i, bytes[i]);
+        return;
+      }
+    }
+  }
+}  // namespace post_mortem
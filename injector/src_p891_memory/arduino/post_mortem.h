@@ -0,0 +1,45 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef POST_MORTEM_H
+#define POST_MORTEM_H
+
+#include "avr_util.h"
+
+// Keeps a record per run in an eeprom ring, for the analysis of resets and
+// LIN errors after the fact, without a serial connection. A record has the
+// reset cause of the run, the watchdog tag of a stall reset, the uptime, 
+// the LIN error flags and count, and the active injection pulses. The 
+// record of the current run is updated every kUpdateMillis, and written 
+// lazily by loop(), a byte per call and only the changed bytes. The 
+// ring holds the last kNumRecords runs.
+namespace post_mortem {
+  static const uint16 kUpdateMillis = 10000;
+  static const uint8 kNumRecords = 16;
+
+  // Call once from main setup(), after watchdog::setup() and before 
+  // watchdog::start().
+  extern void setup();
+
+  // Call from the main loop, at low priority.
+  extern void loop();
+
+  // Accumulate LIN error flags, as returned by 
+  // lin_processor::getAndClearErrorFlags(), into the record.
+  extern void reportLinErrors(uint8 error_flags);
+
+  // Print the records, oldest first. The lines are printed by loop(), as 
+  // the serial output buffer has room.
+  extern void requestDump();
+}  // namespace post_mortem
+
+#endif
@@ -0,0 +1,336 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "proxy_self_test.h"
+
+#include <avr/interrupt.h>
+#include "io_pins.h"
+#include "lin_frame.h"
+#include "sio.h"
+
+namespace proxy_self_test {
+  // The self test measures the edges forwarded by the low latency proxy.
+  typedef char SelfTestRequiresLowLatencyProxy[
+      (!custom_defs::kUseProxySelfTest || custom_defs::kUseLowLatencyProxy) ? 1 : -1];
+
+  // The pins of the test frames, the tx pins of lin_processor.
+  typedef io_pins::Pin<io_pins::PortC, 2> tx1_pin;
+  typedef io_pins::Pin<io_pins::PortD, 4> tx2_pin;
+
+  // Timer0 counts, 0.5 usec each with the /8 prescaler.
+  static const uint16 kCountsPerBitX256 = ((F_CPU / 8) * 256) / custom_defs::kLinSpeed;
+
+  // A bit must fit in the 8 bit Timer0 with room for the main loop being 
+  // preempted by the ISRs.
+  typedef char LinSpeedTooSlowForSelfTest[(kCountsPerBitX256 >> 8) <= 200 ? 1 : -1];
+
+  namespace directions {
+    static const uint8 MASTER_TO_SLAVE = 0;
+    static const uint8 SLAVE_TO_MASTER = 1;
+    static const uint8 kNum = 2;
+  }
+
+  // Bit positions of an edge. The start bit, the data bits d0-d7, the stop
+  // bit and the break.
+  namespace positions {
+    static const uint8 START = 0;
+    static const uint8 STOP = 9;
+    static const uint8 BREAK = 10;
+    static const uint8 kNum = 11;
+  }
+
+  // Number of 1 usec histogram buckets. The last one has the longer delays.
+  static const uint8 kHistogramBuckets = 16;
+
+  // The ids of the test frames. The response of the first is sent by the 
+  // master, of the second by the slave.
+  static const uint8 kMasterResponseId = 0x2a;
+  static const uint8 kSlaveResponseId = 0x2b;
+
+  // Cover all the bit positions with both edge directions.
+  static const uint8 kTestData[] = { 0x55, 0x33 };
+
+  struct EdgeStats {
+    uint16 count;
+    uint16 missed;
+    uint8 min_counts;
+    uint8 max_counts;
+    uint32 sum_counts;
+  };
+
+  static EdgeStats edge_stats[directions::kNum][positions::kNum];
+  static uint16 histograms[directions::kNum][kHistogramBuckets];
+
+  namespace private_ {
+    volatile boolean is_armed;
+    volatile uint8 forward_counts;
+  }
+
+  // ----- Stimulus -----
+
+  // Timer0 at the start of the current bit. 
+  static uint8 bit_start_counts;
+  // Fraction of a count carried to the next bit, in 1/256 counts.
+  static uint8 bit_fraction;
+  // The level driven by the current frame, on the current direction pin.
+  static boolean is_level_high;
+
+  // The edge waiting for its forward, if any.
+  static boolean is_edge_pending;
+  static uint8 edge_direction;
+  static uint8 edge_position;
+  static uint8 edge_counts;
+
+  static void clearStats() {
+    for (uint8 d = 0; d < directions::kNum; d++) {
+      for (uint8 p = 0; p < positions::kNum; p++) {
+        EdgeStats& stats = edge_stats[d][p];
+        stats.count = 0;
+        stats.missed = 0;
+        stats.min_counts = 0xff;
+        stats.max_counts = 0;
+        stats.sum_counts = 0;
+      }
+      for (uint8 i = 0; i < kHistogramBuckets; i++) {
+        histograms[d][i] = 0;
+      }
+    }
+  }
+
+  // Record the delay of the pending edge. Called before the next edge, at 
+  // least a bit time after it.
+  static void finishEdge() {
+    if (!is_edge_pending) {
+      return;
+    }
+    is_edge_pending = false;
+
+    const uint8 sreg = SREG;
+    cli();
+    const boolean was_forwarded = !private_::is_armed;
+    private_::is_armed = false;
+    const uint8 forward_counts = private_::forward_counts;
+    SREG = sreg;
+
+    EdgeStats& stats = edge_stats[edge_direction][edge_position];
+    if (!was_forwarded) {
+      stats.missed++;
+      return;
+    }
+    const uint8 delay_counts = forward_counts - edge_counts;
+    stats.count++;
+    stats.sum_counts += delay_counts;
+    if (delay_counts < stats.min_counts) {
+      stats.min_counts = delay_counts;
+    }
+    if (delay_counts > stats.max_counts) {
+      stats.max_counts = delay_counts;
+    }
+    const uint8 bucket = delay_counts / 2;
+    histograms[edge_direction][bucket < kHistogramBuckets ? bucket : kHistogramBuckets - 1]++;
+  }
+
+  // Drive a bit of the given direction. An edge, if the level changes, is
+  // armed for the measurement at the start of the bit. Returns at the end 
+  // of the bit.
+  static void sendBit(uint8 direction, uint8 position, boolean is_high) {
+    if (is_high != is_level_high) {
+      finishEdge();
+      is_level_high = is_high;
+      // The write and its time stamp are atomic, so the ISRs are delayed
+      // by at most a few cycles and the forward is timed from the write.
+      const uint8 sreg = SREG;
+      cli();
+      if (direction == directions::MASTER_TO_SLAVE) {
+        tx1_pin::set(is_high);
+      } else {
+        tx2_pin::set(is_high);
+      }
+      private_::is_armed = true;
+      edge_counts = TCNT0;
+      SREG = sreg;
+      is_edge_pending = true;
+      edge_direction = direction;
+      edge_position = position;
+    }
+
+    const uint16 counts_x256 = kCountsPerBitX256 + bit_fraction;
+    const uint8 counts = counts_x256 >> 8;
+    bit_fraction = (uint8)counts_x256;
+    while ((uint8)(TCNT0 - bit_start_counts) < counts) {
+    }
+    bit_start_counts += counts;
+  }
+
+  static void sendIdleBits(uint8 direction, uint8 n) {
+    for (uint8 i = 0; i < n; i++) {
+      sendBit(direction, positions::STOP, true);
+    }
+  }
+
+  static void sendByte(uint8 direction, uint8 b) {
+    sendBit(direction, positions::START, false);
+    for (uint8 i = 0; i < 8; i++) {
+      sendBit(direction, positions::START + 1 + i, b & H(i));
+    }
+    sendBit(direction, positions::STOP, true);
+  }
+
+  // Send a frame with the given id and the test data. The header is sent 
+  // by the master, the response by the master or the slave per the id.
+  static void sendFrame(uint8 id) {
+    const uint8 response_direction = (id == kMasterResponseId) 
+        ? directions::MASTER_TO_SLAVE : directions::SLAVE_TO_MASTER;
+
+    LinFrame frame;
+    frame.reset();
+    frame.append_byte(LinFrame::pid(id), false);
+    for (uint8 i = 0; i < ARRAY_SIZE(kTestData); i++) {
+      frame.append_byte(kTestData[i], false);
+    }
+    // Placeholder, computeChecksum() sums the bytes before the last one.
+    frame.append_byte(0, false);
+    const uint8 checksum = frame.computeChecksum();
+
+    is_level_high = true;
+    is_edge_pending = false;
+    bit_fraction = 0;
+    bit_start_counts = TCNT0;
+
+    // Break, break delimiter, sync and protected id.
+    for (uint8 i = 0; i < 13; i++) {
+      sendBit(directions::MASTER_TO_SLAVE, positions::BREAK, false);
+    }
+    sendBit(directions::MASTER_TO_SLAVE, positions::BREAK, true);
+    sendByte(directions::MASTER_TO_SLAVE, 0x55);
+    sendByte(directions::MASTER_TO_SLAVE, frame.get_byte(0));
+    sendIdleBits(directions::MASTER_TO_SLAVE, 1);
+
+    // Response space and response.
+    for (uint8 i = 0; i < ARRAY_SIZE(kTestData); i++) {
+      sendByte(response_direction, kTestData[i]);
+    }
+    sendByte(response_direction, checksum);
+    // Let the last edge be forwarded.
+    sendIdleBits(response_direction, 2);
+    finishEdge();
+  }
+
+  // ----- Report -----
+
+  static const uint8 kNoDump = 0xff;
+
+  // Next line of the dump, kNoDump if none. The lines of each direction are
+  // its positions and then its histogram.
+  static uint8 next_dump_line = kNoDump;
+
+  static void printDirection(uint8 direction) {
+    sio::print(direction == directions::MASTER_TO_SLAVE ? F("proxy m2s ") : F("proxy s2m "));
+  }
+
+  // Print a delay of the given number of counts, in usecs with one decimal.
+  static void printCounts(uint16 counts) {
+    sio::out << (uint16)(counts / 2) << (counts & 1 ? F(".5") : F(".0"));
+  }
+
+  static void printPosition(uint8 direction, uint8 position) {
+    const EdgeStats& stats = edge_stats[direction][position];
+    if (!stats.count && !stats.missed) {
+      return;
+    }
+    printDirection(direction);
+    if (position == positions::START) {
+      sio::print(F("start"));
+    } else if (position == positions::STOP) {
+      sio::print(F("stop"));
+    } else if (position == positions::BREAK) {
+      sio::print(F("break"));
+    } else {
+      sio::out << 'd' << (uint8)(position - positions::START - 1);
+    }
+    sio::out << F(": n=") << stats.count;
+    if (stats.count) {
+      sio::print(F(" min="));
+      printCounts(stats.min_counts);
+      sio::print(F(" avg="));
+      // Average with one decimal, rounded down.
+      const uint16 avg_x10 = (stats.sum_counts * 5) / stats.count; 
+      sio::out << (uint16)(avg_x10 / 10) << '.' << (uint8)(avg_x10 % 10);
+      sio::print(F(" max="));
+      printCounts(stats.max_counts);
+    }
+    sio::out << F(" missed=") << stats.missed << '\n';
+  }
+
+  static void printHistogram(uint8 direction) {
+    printDirection(direction);
+    sio::print(F("usec:"));
+    for (uint8 i = 0; i < kHistogramBuckets; i++) {
+      sio::out << ' ' << histograms[direction][i];
+    }
+    sio::println();
+  }
+
+  // Print the next line of the dump, if any. Returns true if the dump is
+  // not done.
+  static boolean dumpNextLine() {
+    static const uint8 kLinesPerDirection = positions::kNum + 1;
+    if (next_dump_line >= directions::kNum * kLinesPerDirection) {
+      return false;
+    }
+    if (!sio::beginRecord(120)) {
+      return true;
+    }
+    const uint8 direction = next_dump_line / kLinesPerDirection;
+    const uint8 line = next_dump_line % kLinesPerDirection;
+    if (line < positions::kNum) {
+      printPosition(direction, line);
+    } else {
+      printHistogram(direction);
+    }
+    next_dump_line++;
+    return true;
+  }
+
+  void setup() {
+    if (!custom_defs::kUseProxySelfTest) {
+      return;
+    }
+    // Normal mode, running free at clk/8 with no interrupts.
+    TCCR0A = 0;
+    TCCR0B = H(CS01);
+    TIMSK0 = 0;
+    clearStats();
+  }
+
+  void requestDump() {
+    next_dump_line = 0;
+  }
+
+  void loop() {
+    if (!custom_defs::kUseProxySelfTest) {
+      return;
+    }
+    // The dump does not overlap with the test frames, so the printed
+    // stats are of whole frames.
+    if (next_dump_line != kNoDump) {
+      if (!dumpNextLine()) {
+        next_dump_line = kNoDump;
+        clearStats();
+      }
+      return;
+    }
+    static boolean is_slave_response;
+    sendFrame(is_slave_response ? kSlaveResponseId : kMasterResponseId);
+    is_slave_response = !is_slave_response;
+  }
+}  // namespace proxy_self_test
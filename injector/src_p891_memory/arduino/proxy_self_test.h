@@ -0,0 +1,64 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PROXY_SELF_TEST_H
+#define PROXY_SELF_TEST_H
+
+#include <avr/io.h>
+#include "avr_util.h"
+#include "custom_defs.h"
+
+// End to end latency self test of the low latency proxy (see 
+// custom_defs::kUseLowLatencyProxy). The main loop drives test frames as 
+// the master on tx1 and as the slave on tx2, and the proxy ISRs time stamp 
+// each edge they forward. The delay of each edge is measured from the 
+// stimulus write to the forwarding write, per direction and per bit 
+// position, with Timer0 running free at 0.5 usec per count.
+//
+// The delay includes the TX to RX loop of the transceiver, the pin 
+// interrupt latency and the preemption by the other ISRs, but not the 
+// output transceiver. Edges that the proxy did not forward, for example 
+// when it was confirmed only by the mid bit sampling, are counted as 
+// missed.
+//
+// Enabled with custom_defs::kUseProxySelfTest. The injector should not be
+// connected to the car, the test frames are sent on both buses.
+namespace proxy_self_test {
+  namespace private_ {
+    // Set by the stimulus write, cleared by the first forwarded edge.
+    extern volatile boolean is_armed;
+    // Timer0 at the first forwarded edge.
+    extern volatile uint8 forward_counts;
+  }
+
+  // Uses Timer0, no interrupts. Call once during initialization.
+  extern void setup();
+
+  // Main loop task. Sends a test frame per call, alternating the direction
+  // of the response, and prints the stats when requested. Blocks for the
+  // duration of the frame, a few millis.
+  extern void loop();
+
+  // Print the stats, a line per call of loop() as the serial output has 
+  // room, and clear them.
+  extern void requestDump();
+
+  // Called by the proxy ISRs right after forwarding an edge.
+  inline void edgeForwarded() {
+    if (custom_defs::kUseProxySelfTest && private_::is_armed) {
+      private_::forward_counts = TCNT0;
+      private_::is_armed = false;
+    }
+  }
+}  // namespace proxy_self_test
+
+#endif
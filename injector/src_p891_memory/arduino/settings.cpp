@@ -0,0 +1,197 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "settings.h"
+
+#include <avr/eeprom.h>
+
+namespace settings {
+  namespace private_ {
+    uint8 values[ids::kNumSettings];
+    ConfigBlock config;
+  }
+
+  // The config block, after the record ring.
+  static const uint16 kConfigAddress = 128;
+
+  // The record ring. A record is a sequence byte, the settings and a CRC-8 
+  // of both. The sequence byte is written last, so a record interrupted by
+  // a reset keeps a stale sequence and fails the CRC.
+  static const uint16 kRingAddress = 16;
+  static const uint8 kNumRecords = 16;
+  static const uint8 kRecordBytes = 1 + ids::kNumSettings + 1;
+
+  // Pre ring address of the first setting.
+  static const uint16 kLegacyAddress = 2;
+
+  // The ring slot of the newest record, and its sequence.
+  static uint8 current_slot;
+  static uint8 current_seq;
+
+  // True if values changed since the last record started.
+  static boolean dirty;
+
+  // The record being written, and the index of its next byte to write, or 
+  // kRecordBytes when idle.
+  static uint8 pending_record[kRecordBytes];
+  static uint8 pending_index = kRecordBytes;
+
+  static boolean config_valid;
+  // The index of the next config block byte to write, or sizeof(ConfigBlock)
+  // when idle.
+  static uint8 config_write_index = sizeof(ConfigBlock);
+
+  static inline uint8* recordAddress(uint8 slot) {
+    return (uint8*)(kRingAddress + slot * kRecordBytes);
+  }
+
+  // Read the record in the given slot. Returns true if it is valid.
+  static boolean readRecord(uint8 slot, uint8* record) {
+    eeprom_read_block(record, recordAddress(slot), kRecordBytes);
+    return crc8(record, kRecordBytes - 1) == record[kRecordBytes - 1];
+  }
+
+  // Read the config block, or set the defaults if it is not valid.
+  static void loadConfig() {
+    ConfigBlock& block = private_::config;
+    eeprom_read_block(&block, (const void*)kConfigAddress, sizeof(block));
+    config_valid = block.version == kConfigVersion && block.length == sizeof(block)
+        && block.num_rules <= kMaxConfigRules
+        && crc8((const uint8*)&block, sizeof(block) - 1) == block.crc;
+    if (config_valid) {
+      return;
+    }
+    block.enabled = 1;
+    // vehicle_profiles::kAuto.
+    block.vehicle_profile = 0xff;
+    for (uint8 i = 0; i < sizeof(block.accepted_ids); i++) {
+      block.accepted_ids[i] = 0;
+    }
+    block.accepted_ids[0x0d >> 3] |= bitMask(0x0d & 0x07);
+    block.accepted_ids[0x0e >> 3] |= bitMask(0x0e & 0x07);
+    block.num_rules = 0;
+  }
+
+  void setup() {
+    loadConfig();
+    config_write_index = sizeof(ConfigBlock);
+
+    // The newest record is a valid record whose next slot does not have
+    // the next sequence.
+    uint8 record[kRecordBytes];
+    uint8 next_record[kRecordBytes];
+    boolean found = false;
+    for (uint8 slot = 0; slot < kNumRecords && !found; slot++) {
+      if (!readRecord(slot, record)) {
+        continue;
+      }
+      const uint8 next_slot = (slot + 1) % kNumRecords;
+      if (readRecord(next_slot, next_record) && next_record[0] == (uint8)(record[0] + 1)) {
+        continue;
+      }
+      found = true;
+      current_slot = slot;
+      current_seq = record[0];
+      for (uint8 i = 0; i < ids::kNumSettings; i++) {
+        private_::values[i] = record[1 + i];
+      }
+    }
+    if (!found) {
+      current_slot = kNumRecords - 1;
+      current_seq = 0;
+      for (uint8 i = 0; i < ids::kNumSettings; i++) {
+        private_::values[i] = eeprom_read_byte((const uint8*)(kLegacyAddress + i));
+      }
+    }
+    dirty = false;
+    pending_index = kRecordBytes;
+  }
+
+  void set(uint8 id, uint8 value) {
+    if (private_::values[id] != value) {
+      private_::values[id] = value;
+      dirty = true;
+    }
+  }
+
+  boolean isFlushed() {
+    return !dirty && pending_index >= kRecordBytes 
+        && config_write_index >= sizeof(ConfigBlock);
+  }
+
+  boolean isConfigValid() {
+    return config_valid;
+  }
+
+  void setConfig(const ConfigBlock& block) {
+    ConfigBlock& config = private_::config;
+    config = block;
+    config.version = kConfigVersion;
+    config.length = sizeof(config);
+    config.crc = crc8((const uint8*)&config, sizeof(config) - 1);
+    config_valid = true;
+    config_write_index = 0;
+  }
+
+  // Write the next byte of the config block, skipping unchanged bytes. 
+  // A block interrupted by a reset fails the CRC and reverts to the defaults.
+  static void writeConfigByte() {
+    const uint8* const bytes = (const uint8*)&private_::config;
+    while (config_write_index < sizeof(ConfigBlock)) {
+      uint8* const address = (uint8*)kConfigAddress + config_write_index;
+      const uint8 value = bytes[config_write_index++];
+      if (eeprom_read_byte(address) != value) {
+        eeprom_write_byte(address, value);
+        return;
+      }
+    }
+  }
+
+  // Start the record of the current values in the next slot.
+  static void startRecord() {
+    current_slot = (current_slot + 1) % kNumRecords;
+    current_seq++;
+    pending_record[0] = current_seq;
+    for (uint8 i = 0; i < ids::kNumSettings; i++) {
+      pending_record[1 + i] = private_::values[i];
+    }
+    pending_record[kRecordBytes - 1] = crc8(pending_record, kRecordBytes - 1);
+    // The settings and CRC first, the sequence last.
+    pending_index = 1;
+    dirty = false;
+  }
+
+  void loop() {
+    if (pending_index >= kRecordBytes) {
+      if (!dirty) {
+        // The eeprom writes a byte in the background. Don't wait for it.
+        if (config_write_index < sizeof(ConfigBlock) && eeprom_is_ready()) {
+          writeConfigByte();
+        }
+        return;
+      }
+      startRecord();
+    }
+    // The eeprom writes a byte in the background. Don't wait for it.
+    if (!eeprom_is_ready()) {
+      return;
+    }
+    uint8* const address = recordAddress(current_slot);
+    if (pending_index) {
+      eeprom_write_byte(address + pending_index, pending_record[pending_index]);
+      pending_index = (pending_index + 1 < kRecordBytes) ? pending_index + 1 : 0;
+    } else {
+      eeprom_write_byte(address, pending_record[0]);
+      pending_index = kRecordBytes;
+    }
+  }
+}  // namespace settings
@@ -0,0 +1,110 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include "avr_util.h"
+
+// Application settings persisted in the eeprom. The settings are loaded to
+// RAM by setup() and read from RAM. Changes are written behind by loop(), 
+// a byte per call when the eeprom is ready, so a change never stalls the 
+// main loop on the ~3.3ms eeprom byte write. Consecutive changes are 
+// coalesced into a single record.
+//
+// For wear leveling, each write is a new record in a ring of kNumRecords 
+// records, so each eeprom byte is written once per kNumRecords changes.
+//
+// The rarely changed configuration is a separate versioned block, read at
+// setup with a single eeprom_read_block and validated by its version, 
+// length and CRC-8.
+namespace settings {
+  // The settings. Each is a byte.
+  namespace ids {
+    // The remembered modes of the memory feature. Non zero if on.
+    static const uint8 SPORT_MODE = 0;
+    static const uint8 PSE_MODE = 1;
+    static const uint8 ASS_MODE = 2;
+    static const uint8 kNumSettings = 3;
+  }
+
+  // The config block format version. Increment on incompatible changes.
+  static const uint8 kConfigVersion = 2;
+  static const uint8 kMaxConfigRules = 4;
+
+  // An injector bit action applied at setup, see 
+  // custom_injector::setBitAction().
+  struct ConfigRule {
+    uint8 id;
+    uint8 num_data_bytes;
+    uint8 byte_index;
+    uint8 bit_index;
+    uint8 action;
+  };
+
+  struct ConfigBlock {
+    // Set by setConfig().
+    uint8 version;
+    uint8 length;
+    // Non zero if the memory feature is enabled, see custom_config.
+    uint8 enabled;
+    // One of vehicle_profiles::ids, or vehicle_profiles::kAuto to detect the
+    // profile at boot.
+    uint8 vehicle_profile;
+    // Bit per 6 bit frame id of the ids accepted to the lin processor rx 
+    // queue, bit (id & 7) of byte (id >> 3).
+    uint8 accepted_ids[8];
+    uint8 num_rules;
+    ConfigRule rules[kMaxConfigRules];
+    // CRC-8 of the bytes above. Set by setConfig().
+    uint8 crc;
+  };
+
+  namespace private_ {
+    extern uint8 values[ids::kNumSettings];
+    extern ConfigBlock config;
+  }
+
+  // Call once from setup(). Reads the newest valid record. Without one, the
+  // settings are read from their fixed pre ring addresses 2-4.
+  extern void setup();
+
+  // Call from the main loop. Writes the pending change, if any, a byte at 
+  // a time.
+  extern void loop();
+
+  inline uint8 get(uint8 id) {
+    return private_::values[id];
+  }
+
+  // Change a setting. Persisted by the following loop() calls.
+  extern void set(uint8 id, uint8 value);
+
+  // True if all the changes were written to the eeprom.
+  extern boolean isFlushed();
+
+  // The config block. If the eeprom had no valid block, the defaults: 
+  // enabled, auto detected vehicle profile, frame ids 0x0d and 0x0e 
+  // accepted and no rules.
+  inline const ConfigBlock& config() {
+    return private_::config;
+  }
+
+  // True if the config block was read from the eeprom (or set since).
+  extern boolean isConfigValid();
+
+  // Change the config block, e.g. a modified copy of config(). Persisted,
+  // like the settings, by the following loop() calls.
+  extern void setConfig(const ConfigBlock& block);
+}  // namespace settings
+
+#endif
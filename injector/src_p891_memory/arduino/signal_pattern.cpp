@@ -0,0 +1,81 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "signal_pattern.h"
+
+namespace signal_pattern {
+
+boolean Matcher::isRelevant(const custom_signals::SignalEvent& event) const {
+  for (uint8 i = 0; i < num_steps_; i++) {
+    Step step;
+    readStep(i, &step);
+    if (step.signal_id == event.signal_id && step.state == event.new_state) {
+      return true;
+    }
+  }
+  return false;
+}
+
+uint8 Matcher::advance(const custom_signals::SignalEvent& event) {
+  Step step;
+  readStep(step_index_, &step);
+  if (step.signal_id != event.signal_id || step.state != event.new_state) {
+    return results::IGNORED;
+  }
+  if (isActive()) {
+    const uint16 delta_millis = event.time_millis - last_millis_;
+    if (delta_millis < step.min_millis || delta_millis > step.max_millis) {
+      return results::IGNORED;
+    }
+  } else {
+    start_millis_ = event.time_millis;
+  }
+  last_millis_ = event.time_millis;
+  if (++count_ < step.count) {
+    return results::ADVANCED;
+  }
+  count_ = 0;
+  if (++step_index_ < num_steps_) {
+    return results::ADVANCED;
+  }
+  restart();
+  return results::MATCHED;
+}
+
+uint8 Matcher::eventArrived(const custom_signals::SignalEvent& event) {
+  if (!isRelevant(event)) {
+    return results::IGNORED;
+  }
+  boolean restarted = false;
+  if (isActive() && (uint16)(event.time_millis - start_millis_) > timeout_millis_) {
+    restart();
+    restarted = true;
+  }
+  uint8 result = advance(event);
+  if (result == results::IGNORED && isActive()) {
+    // A mismatch, the event may still be the first change of the pattern.
+    restart();
+    restarted = true;
+    result = advance(event);
+  }
+  return (result == results::IGNORED && restarted) ? results::RESTARTED : result;
+}
+
+boolean Matcher::checkTimeout(uint16 time_millis) {
+  if (isActive() && (uint16)(time_millis - start_millis_) > timeout_millis_) {
+    restart();
+    return true;
+  }
+  return false;
+}
+
+}  // namespace signal_pattern
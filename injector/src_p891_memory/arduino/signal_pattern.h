@@ -0,0 +1,127 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SIGNAL_PATTERN_H
+#define SIGNAL_PATTERN_H
+
+#include <avr/pgmspace.h>
+#include "avr_util.h"
+#include "custom_signals.h"
+
+// Recognizes sequences of signal changes, such as button gestures, from 
+// the custom_signals events. A pattern is a table of steps in program 
+// memory. Each step expects a signal to change to a state a given number 
+// of times, each change within a time window from the previous matched 
+// change. For example, ignition on, 6 button clicks, ignition off:
+//
+//   static const signal_pattern::Step kSteps[] PROGMEM = {
+//     { signal_ids::ignition_state, SignalTracker::States::ON,  1, 0, 0xffff },
+//     { signal_ids::config_button,  SignalTracker::States::ON,  6, 0, 0xffff },
+//     { signal_ids::ignition_state, SignalTracker::States::OFF, 1, 0, 0xffff },
+//   };
+//
+// Only the events of a (signal, state) pair that appear in the steps count.
+// Such an event that does not match the next step restarts the matching, 
+// as does a pattern that is not completed within its timeout. The cost 
+// is a few steps compares per event and pattern, with no polling.
+namespace signal_pattern {
+
+  struct Step {
+    // One of custom_signals::signal_ids.
+    uint8 signal_id;
+    // The new state of the signal, one of SignalTracker::States.
+    uint8 state;
+    // Number of the changes to the state, at least 1.
+    uint8 count;
+    // Allowed time from the previous matched change, for all the changes
+    // of this step except the first change of the pattern.
+    uint16 min_millis;
+    uint16 max_millis;
+  };
+
+  // Returned by Matcher::eventArrived().
+  namespace results {
+    static const uint8 IGNORED = 0;
+    // The event matched the next step, the pattern is not completed yet.
+    static const uint8 ADVANCED = 1;
+    // The event completed the pattern. The matcher is restarted.
+    static const uint8 MATCHED = 2;
+    // The event or the timeout restarted the matching.
+    static const uint8 RESTARTED = 3;
+  }
+
+  // Matches one pattern. Several matchers can be fed the same events to 
+  // recognize several patterns in parallel.
+  class Matcher {
+  public:
+    // The steps are in program memory.
+    Matcher(const Step* steps, uint8 num_steps, uint16 timeout_millis) 
+    :
+      steps_(steps),
+      num_steps_(num_steps),
+      timeout_millis_(timeout_millis) {
+      restart();
+    }
+
+    // Forget the changes matched so far.
+    inline void restart() {
+      step_index_ = 0;
+      count_ = 0;
+    }
+
+    // True if some of the changes were matched.
+    inline boolean isActive() const {
+      return step_index_ || count_;
+    }
+
+    // Progress of an active pattern, the index of the next step to match 
+    // and the number of its changes matched so far.
+    inline uint8 stepIndex() const {
+      return step_index_;
+    }
+    inline uint8 count() const {
+      return count_;
+    }
+
+    // Call with each signal event. Returns one of results.
+    uint8 eventArrived(const custom_signals::SignalEvent& event);
+
+    // Call periodically with the low 16 bits of the system clock millis,
+    // at least once per 65 seconds, so a stale pattern does not outlive 
+    // the 16 bit event times. Returns true if the matching was restarted.
+    boolean checkTimeout(uint16 time_millis);
+
+  private:
+    inline void readStep(uint8 index, Step* step) const {
+      memcpy_P(step, &steps_[index], sizeof(Step));
+    }
+
+    // True if any of the steps is a change of the event.
+    boolean isRelevant(const custom_signals::SignalEvent& event) const;
+
+    // Try to match the event as the next change. Returns one of results,
+    // IGNORED if the event does not match.
+    uint8 advance(const custom_signals::SignalEvent& event);
+
+    const Step* const steps_;
+    const uint8 num_steps_;
+    const uint16 timeout_millis_;
+    uint8 step_index_;
+    uint8 count_;
+    // Event times of the first and last matched changes.
+    uint16 start_millis_;
+    uint16 last_millis_;
+  };
+
+}  // namespace signal_pattern
+
+#endif
@@ -133,6 +133,18 @@ public:
     return state_ != States::UNKNOWN;
   }
 
+  // Returns the time in millis until the state expires to UNKNOWN unless a
+  // supporting report arrives, or 0 if already due. Returns 0xffff in the 
+  // UNKNOWN state, which does not expire.
+  inline uint16 millisUntilExpiry() const {
+    if (state_ == States::UNKNOWN) {
+      return 0xffff;
+    }
+    const uint32 elapsed = time_since_last_supporting_report_.timeMillis();
+    return (elapsed >= supporting_report_ttl_millis_) 
+        ? 0 : (uint16)(supporting_report_ttl_millis_ - elapsed);
+  }
+
   // Returns time in millis in current state. Since getState() does not change state, calling it
   // after getState() will return the time for the state returns by getState().  (that is, no race
   // condition.). 
@@ -0,0 +1,166 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sio_cmd.h"
+
+#include "custom_defs.h"
+#include "lin_processor.h"
+#include "sio.h"
+
+namespace sio_cmd {
+
+// Max length of a command line, without the end of line.
+static const uint8 kMaxLineLength = 40;
+
+// The line received so far.
+static char line[kMaxLineLength + 1];
+static uint8 line_length;
+
+// True if the current line is too long. It is ignored.
+static boolean line_overflow;
+
+static CommandHandler command_handler;
+
+void setup(CommandHandler handler) {
+  command_handler = handler;
+}
+
+static inline boolean isSpace(char c) {
+  return c == ' ' || c == '\t';
+}
+
+// Parse a decimal or 0x prefixed hex number at *p and advance *p after it.
+// Returns false if there is no valid number.
+static boolean parseNumber(const char** p, uint16* value) {
+  const char* s = *p;
+  uint8 base = 10;
+  if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+    base = 16;
+    s += 2;
+  }
+  uint16 result = 0;
+  uint8 num_digits = 0;
+  for (;; s++, num_digits++) {
+    const char c = *s;
+    uint8 digit;
+    if (c >= '0' && c <= '9') {
+      digit = c - '0';
+    } else if (base == 16 && c >= 'a' && c <= 'f') {
+      digit = c - ('a' - 10);
+    } else if (base == 16 && c >= 'A' && c <= 'F') {
+      digit = c - ('A' - 10);
+    } else {
+      break;
+    }
+    result = result * base + digit;
+  }
+  if (!num_digits || (*s && !isSpace(*s))) {
+    return false;
+  }
+  *value = result;
+  *p = s;
+  return true;
+}
+
+// Parse the line into *command. Returns false if the syntax is invalid.
+static boolean parseLine(Command* command) {
+  const char* p = line;
+  while (isSpace(*p)) {
+    p++;
+  }
+  command->name = *p++;
+  command->num_args = 0;
+  for (;;) {
+    while (isSpace(*p)) {
+      p++;
+    }
+    if (!*p) {
+      return true;
+    }
+    if (command->num_args >= kMaxArgs || 
+        !parseNumber(&p, &command->args[command->num_args])) {
+      return false;
+    }
+    command->num_args++;
+  }
+}
+
+// Executes the common commands. Returns false if the command is not one of 
+// them or its arguments are invalid.
+static boolean executeCommonCommand(const Command& command) {
+  switch (command.name) {
+    case 'a':
+      if (command.num_args != 2 || command.args[0] > 0xff) {
+        return false;
+      }
+      lin_processor::acceptId(command.args[0], command.args[1]);
+      return true;
+    case 'A':
+      if (command.num_args != 1) {
+        return false;
+      }
+      lin_processor::acceptAllIds(command.args[0]);
+      return true;
+    case 's': {
+      lin_processor::Stats stats;
+      lin_processor::getStats(&stats, false);
+      sio::print(F("LIN stats: "));
+      lin_processor::printStats(stats);
+      sio::println();
+      return true;
+    }
+  }
+  return false;
+}
+
+// Called with each complete line.
+static void executeLine() {
+  Command command;
+  if (!parseLine(&command) || !command.name) {
+    // Ignore empty lines.
+    if (line_length) {
+      sio::out << F("cmd? ") << line << '\n';
+    }
+    return;
+  }
+  if (executeCommonCommand(command) || 
+      (command_handler && command_handler(command))) {
+    sio::println(F("cmd ok"));
+  } else {
+    sio::out << F("cmd? ") << line << '\n';
+  }
+}
+
+void loop() {
+  if (!custom_defs::kUseSerialCommands) {
+    return;
+  }
+  uint8 b;
+  while (sio::readByte(&b)) {
+    if (b == '\n' || b == '\r') {
+      if (!line_overflow) {
+        line[line_length] = 0;
+        executeLine();
+      }
+      line_length = 0;
+      line_overflow = false;
+      continue;
+    }
+    if (line_length < kMaxLineLength) {
+      line[line_length++] = b;
+    } else {
+      line_overflow = true;
+    }
+  }
+}
+
+}  // namespace sio_cmd
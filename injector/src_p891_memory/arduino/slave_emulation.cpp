@@ -0,0 +1,96 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "slave_emulation.h"
+
+#include <avr/pgmspace.h>
+#include <string.h>
+#include "custom_defs.h"
+#include "custom_injector.h"
+#include "lin_frame.h"
+
+namespace slave_emulation {
+  // An emulated slave frame. In program memory.
+  struct Slave {
+    // The 6 bit frame id.
+    uint8 id;
+    // One of LinFrame::kChecksumClassic or LinFrame::kChecksumEnhanced.
+    uint8 checksum_model;
+    uint8 num_data_bytes;
+    // The response until changed by setData().
+    uint8 initial_data[custom_injector::kMaxRuleDataBytes];
+  };
+
+  // The emulated frames. Like the custom_* files, should be adapted to the 
+  // bench.
+  static const Slave kSlaves[] PROGMEM = {
+    // The sport mode button unit with no button pressed.
+    { 0x0e, LinFrame::kChecksumEnhanced, 8, 
+        { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 } },
+  };
+
+  static const uint8 kNumSlaves = ARRAY_SIZE(kSlaves);
+
+  // Each emulated id has its own response slot.
+  typedef char TooManyEmulatedSlaves[
+      (kNumSlaves <= custom_injector::kMaxResponseSlots) ? 1 : -1];
+
+  // The response data of the slaves, indexed as kSlaves.
+  static uint8 data[kNumSlaves][custom_injector::kMaxRuleDataBytes];
+
+  // Bit i is set if data[i] was not passed to the injector yet.
+  static uint8 pending_mask;
+  typedef char TooManySlavesForPendingMask[(kNumSlaves <= 8) ? 1 : -1];
+
+  void setup() {
+    if (!custom_defs::kUseSlaveEmulation) {
+      return;
+    }
+    for (uint8 i = 0; i < kNumSlaves; i++) {
+      const uint8 id = pgm_read_byte(&kSlaves[i].id);
+      LinFrame::setChecksumModel(LinFrame::pid(id), 
+          pgm_read_byte(&kSlaves[i].checksum_model));
+      memcpy_P(data[i], kSlaves[i].initial_data, sizeof(data[i]));
+    }
+    pending_mask = (1 << kNumSlaves) - 1;
+    loop();
+  }
+
+  void loop() {
+    if (!custom_defs::kUseSlaveEmulation || !pending_mask) {
+      return;
+    }
+    for (uint8 i = 0; i < kNumSlaves; i++) {
+      const uint8 mask = 1 << i;
+      if (!(pending_mask & mask)) {
+        continue;
+      }
+      // Fails if the ISR is sending the back buffer, retried on the next
+      // call.
+      if (custom_injector::setResponse(LinFrame::pid(pgm_read_byte(&kSlaves[i].id)), 
+          data[i], pgm_read_byte(&kSlaves[i].num_data_bytes))) {
+        pending_mask &= ~mask;
+      }
+    }
+  }
+
+  boolean setData(uint8 id, const uint8* new_data) {
+    for (uint8 i = 0; i < kNumSlaves; i++) {
+      if (pgm_read_byte(&kSlaves[i].id) == LinFrame::idFromPid(id)) {
+        memcpy(data[i], new_data, pgm_read_byte(&kSlaves[i].num_data_bytes));
+        pending_mask |= 1 << i;
+        return true;
+      }
+    }
+    return false;
+  }
+}  // namespace slave_emulation
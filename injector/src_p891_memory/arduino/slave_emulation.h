@@ -0,0 +1,43 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SLAVE_EMULATION_H
+#define SLAVE_EMULATION_H
+
+#include "avr_util.h"
+
+// Slave node emulation, for bench work without the real slaves (e.g. the 
+// switch panel). The injector responds to the headers of the ids in 
+// kSlaves (see slave_emulation.cpp) with the data of per id buffers in 
+// ram, sent by the response substitution of the lin processor (see 
+// custom_injector::setResponse()). The checksums are computed when the 
+// data is set, so the ISR only shifts out the bytes, one bit per tick, 
+// starting a bit after the stop bit of the id byte.
+//
+// Enabled with custom_defs::kUseSlaveEmulation. A real slave of an emulated
+// id should be disconnected, its response is ignored.
+namespace slave_emulation {
+  // Call once during initialization, after custom_module::setup(). Sets 
+  // the initial data of the emulated ids.
+  extern void setup();
+
+  // Main loop task. Passes the changed data to the injector, retrying the
+  // responses that the ISR is sending at the moment.
+  extern void loop();
+
+  // Set the data of the emulated 6 bit id. The number of data bytes is 
+  // that of kSlaves. Sent from the next header after the following loop().
+  // Returns false if the id is not emulated.
+  extern boolean setData(uint8 id, const uint8* data);
+}  // namespace slave_emulation
+
+#endif
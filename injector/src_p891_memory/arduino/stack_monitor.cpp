@@ -0,0 +1,81 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stack_monitor.h"
+
+#include "custom_defs.h"
+#include "leds.h"
+#include "sio.h"
+
+namespace stack_monitor {
+  // Linker symbols of the end of .bss and the top of the RAM.
+  extern "C" uint8 _end;
+  extern "C" uint8 __stack;
+
+  static const uint8 kPaint = 0xc5;
+
+  // Paints from the end of .bss to the top of the RAM. Runs as part of the
+  // startup code, in .init1 and falling through to .init2, before the stack
+  // pointer and the zero register are set, so it uses only registers.
+  extern "C" void stackMonitorPaint() __attribute__((naked, used, section(".init1")));
+  void stackMonitorPaint() {
+    __asm volatile (
+        "    ldi r30, lo8(_end)\n"
+        "    ldi r31, hi8(_end)\n"
+        "    ldi r24, %0\n"
+        "    ldi r25, hi8(__stack)\n"
+        "    rjmp 2f\n"
+        "1:  st Z+, r24\n"
+        "2:  cpi r30, lo8(__stack)\n"
+        "    cpc r31, r25\n"
+        "    brlo 1b\n"
+        "    breq 1b\n"
+        :: "M" (kPaint));
+  }
+
+  uint16 minFreeBytes() {
+    const uint8* p = &_end;
+    // The stack is never lower than the current stack pointer, the scan 
+    // stops there at most.
+    const uint8* const sp = (const uint8*)SP;
+    while (p < sp && *p == kPaint) {
+      p++;
+    }
+    return p - &_end;
+  }
+
+  // The margin is printed again when it shrinks by this many bytes.
+  static const uint8 kReportStepBytes = 16;
+
+  // Last printed margin, 0xffff if none yet.
+  static uint16 reported_bytes = 0xffff;
+
+  void loop() {
+    if (!custom_defs::kUseStackMonitor) {
+      return;
+    }
+    const uint16 free_bytes = minFreeBytes();
+    if (reported_bytes != 0xffff && free_bytes + kReportStepBytes > reported_bytes) {
+      return;
+    }
+    if (!sio::beginRecord(24)) {
+      return;
+    }
+    reported_bytes = free_bytes;
+    sio::out << F("ram: ") << free_bytes << F(" free");
+    if (free_bytes < custom_defs::kMinFreeRamBytes) {
+      sio::print(F(" LOW"));
+      leds::action(leds::ids::ERRORS);
+    }
+    sio::println();
+  }
+}  // namespace stack_monitor
@@ -0,0 +1,37 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef STACK_MONITOR_H
+#define STACK_MONITOR_H
+
+#include "avr_util.h"
+
+// Measures the free RAM margin, the bytes between the end of the static 
+// data (.data and .bss, there is no heap) and the deepest stack use so 
+// far, of the main loop and the ISRs together. The RAM above the static 
+// data is painted at reset, before the C runtime initialization, and the
+// margin is the number of painted bytes that were never overwritten.
+//
+// Enabled with custom_defs::kUseStackMonitor. The painting is always done,
+// it takes about 1ms at reset.
+namespace stack_monitor {
+  // The lowest free margin so far, in bytes. Scans the margin, a few usecs
+  // per 16 bytes, so it should be called only once in a while.
+  extern uint16 minFreeBytes();
+
+  // Main loop task. Prints the margin as 'ram: <n> free' at start and when
+  // it shrinks by 16 bytes or more, with LOW and an ERRORS led blink when it is less than 
+  // custom_defs::kMinFreeRamBytes.
+  extern void loop();
+}  // namespace stack_monitor
+
+#endif
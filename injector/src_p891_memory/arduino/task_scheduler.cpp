@@ -0,0 +1,158 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "task_scheduler.h"
+
+#include "custom_defs.h"
+#include "hardware_clock.h"
+#include "sio.h"
+#include "system_clock.h"
+#include "watchdog.h"
+
+namespace task_scheduler {
+
+// ----- Loop Stats -----
+
+static LoopStats loop_stats;
+
+// Start time of the previous loop() call.
+static uint32 last_start_ticks;
+static boolean has_last_start;
+
+// The longest task of the current and previous iterations, and its time.
+static uint8 longest_task;
+static uint16 longest_task_ticks;
+static uint8 last_longest_task;
+
+// The next line to print, past the last line if not dumping.
+static uint8 next_dump_line = kNumLatencyBuckets + 1;
+
+const LoopStats& loopStats() {
+  return loop_stats;
+}
+
+void requestStatsDump() {
+  next_dump_line = 0;
+}
+
+static void updateStats(uint32 start_ticks) {
+  if (has_last_start) {
+    const uint32 delta = start_ticks - last_start_ticks;
+    const uint16 ticks = delta > 0xffff ? 0xffff : delta;
+    uint8 bucket = 0;
+    for (uint16 t = ticks; t; t >>= 1) {
+      bucket++;
+    }
+    if (bucket >= kNumLatencyBuckets) {
+      bucket = kNumLatencyBuckets - 1;
+    }
+    if (loop_stats.buckets[bucket] != 0xffff) {
+      loop_stats.buckets[bucket]++;
+    }
+    if (ticks > loop_stats.max_ticks) {
+      loop_stats.max_ticks = ticks;
+      loop_stats.max_task = last_longest_task;
+    }
+  }
+  last_start_ticks = start_ticks;
+  has_last_start = true;
+  last_longest_task = longest_task;
+  longest_task = 0;
+  longest_task_ticks = 0;
+}
+
+static void loopStatsDump() {
+  if (next_dump_line > kNumLatencyBuckets || !sio::beginRecord(40)) {
+    return;
+  }
+  if (next_dump_line == 0) {
+    sio::out << F("loop: max=") 
+        << sio::micros(hardware_clock::ticksToNanos(loop_stats.max_ticks))
+        << F("us task=") << loop_stats.max_task 
+        << F(" behind=") << loop_stats.behind_loops << '\n';
+    next_dump_line++;
+  }
+  // One non empty bucket per call, with its upper bound in usecs.
+  while (next_dump_line <= kNumLatencyBuckets) {
+    const uint8 i = next_dump_line++ - 1;
+    if (loop_stats.buckets[i]) {
+      sio::out << F("loop: <") << sio::micros(hardware_clock::ticksToNanos((uint32)1 << i)) 
+          << F("us ") 
+          << loop_stats.buckets[i] << '\n';
+      break;
+    }
+  }
+  if (next_dump_line > kNumLatencyBuckets) {
+    for (uint8 i = 0; i < kNumLatencyBuckets; i++) {
+      loop_stats.buckets[i] = 0;
+    }
+    loop_stats.max_ticks = 0;
+    loop_stats.max_task = 0;
+    loop_stats.behind_loops = 0;
+  }
+}
+
+// ----- Scheduler -----
+
+void loop(Task* tasks, uint8 num_tasks, uint16 budget_ticks, 
+    boolean is_behind) {
+  const uint16 start_ticks = hardware_clock::ticksForNonIsr();
+  if (custom_defs::kTrackLoopLatency) {
+    updateStats(hardware_clock::ticks32ForNonIsr());
+    if (is_behind && loop_stats.behind_loops != 0xffff) {
+      loop_stats.behind_loops++;
+    }
+    // A dump line is a deferrable piece of work.
+    if (!is_behind) {
+      loopStatsDump();
+    }
+  }
+  if (custom_defs::kUseWatchdog) {
+    watchdog::kick();
+  }
+  const uint32 now_millis = system_clock::timeMillis();
+  boolean ran_periodic_task = false;
+  for (uint8 i = 0; i < num_tasks; i++) {
+    Task& task = tasks[i];
+    if (is_behind && task.deferrable) {
+      continue;
+    }
+    if (task.period_millis) {
+      if (now_millis - task.last_run_millis < task.period_millis) {
+        continue;
+      }
+      // Out of budget, try again next iteration.
+      if (ran_periodic_task && 
+          (uint16)(hardware_clock::ticksForNonIsr() - start_ticks) >= budget_ticks) {
+        continue;
+      }
+      ran_periodic_task = true;
+      task.last_run_millis = now_millis;
+    }
+    if (custom_defs::kUseWatchdog) {
+      watchdog::setTag(i);
+    }
+    if (custom_defs::kTrackLoopLatency) {
+      const uint16 task_start_ticks = hardware_clock::ticksForNonIsr();
+      task.run();
+      const uint16 task_ticks = hardware_clock::ticksForNonIsr() - task_start_ticks;
+      if (task_ticks > longest_task_ticks) {
+        longest_task_ticks = task_ticks;
+        longest_task = i;
+      }
+    } else {
+      task.run();
+    }
+  }
+}
+
+}  // namespace task_scheduler
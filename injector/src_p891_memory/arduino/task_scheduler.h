@@ -0,0 +1,77 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TASK_SCHEDULER_H
+#define TASK_SCHEDULER_H
+
+#include "avr_util.h"
+
+// A cooperative scheduler of the main loop tasks. Each task is a function 
+// that does a short piece of work and returns, and runs once per its 
+// period. Tasks with a zero period (e.g. LIN frame consumption) run on every
+// loop iteration. The other tasks share a time budget per iteration, a due 
+// task that does not fit in it is delayed to the next iteration.
+//
+// The tasks are kept in a static table, in decreasing priority order.
+namespace task_scheduler {
+  struct Task {
+    // Does the work of the task. Should not block.
+    void (*run)();
+    // Min time between runs. Zero for every loop iteration.
+    uint16 period_millis;
+    // System clock time of the last run. Internal state, initialize to 0.
+    uint32 last_run_millis;
+    // If true, the task is skipped while the main loop is behind on the 
+    // frames, see loop(). For the diagnostics and dumps.
+    boolean deferrable;
+  };
+
+  // Run the due tasks of the table, in table order. Call once per main 
+  // loop iteration, after system_clock::loop(). The first due periodic task
+  // always runs, the following ones only while the iteration took less than
+  // budget_ticks hardware clock ticks, so a task can't starve the ones 
+  // after it forever. Kicks the watchdog, if custom_defs::kUseWatchdog, and
+  // tags its post mortem record with the index of the running task.
+  // While is_behind, e.g. the rx frame queue is filling up, the deferrable 
+  // tasks are skipped, so the iterations go to the tasks that consume the 
+  // frames. They run once the caller clears is_behind, with their periods
+  // already due.
+  extern void loop(Task* tasks, uint8 num_tasks, uint16 budget_ticks, 
+      boolean is_behind);
+
+  // Loop latency stats, if custom_defs::kTrackLoopLatency. The time between
+  // the starts of consecutive loop() calls, of the whole main loop 
+  // iteration, is counted in a histogram of log2 buckets of hardware clock 
+  // ticks. Bucket i has the iterations of [2^(i-1), 2^i) ticks.
+  static const uint8 kNumLatencyBuckets = 17;
+
+  struct LoopStats {
+    uint16 buckets[kNumLatencyBuckets];
+    // Max iteration time in ticks, saturated at 0xffff (~262ms, ~33ms with
+    // custom_defs::kUseFineHardwareClock).
+    uint16 max_ticks;
+    // Index of the longest task of the max iteration, ie. its cause.
+    uint8 max_task;
+    // Number of iterations with the deferrable tasks skipped.
+    uint16 behind_loops;
+  };
+
+  // The stats since the last dump. Counts saturate.
+  extern const LoopStats& loopStats();
+
+  // Print the stats and reset them, a line per loop() call as the serial 
+  // output has room. Called every custom_defs::kLoopLatencyDumpMillis by a
+  // timer_wheel timer.
+  extern void requestStatsDump();
+}  // namespace task_scheduler
+
+#endif
@@ -0,0 +1,137 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "timer_wheel.h"
+
+#include "system_clock.h"
+
+namespace timer_wheel {
+
+// Compile time check of the slot index masking.
+typedef char kNumSlotsIsPowerOfTwo[!(kNumSlots & (kNumSlots - 1)) ? 1 : -1];
+// The expired periodic timers are collected in a byte mask.
+typedef char kMaxTimersFitsMask[(kMaxTimers <= 8) ? 1 : -1];
+
+struct Timer {
+  Callback callback;
+  uint16 period_millis;
+  // Remaining full revolutions before the timer expires in its slot.
+  uint16 rounds;
+  // Next timer in the same slot, or kNoTimer.
+  uint8 next;
+  // The slot of the timer, or kNoTimer if not registered.
+  uint8 slot;
+};
+
+static Timer timers[kMaxTimers];
+
+// The first timer of each slot, or kNoTimer.
+static uint8 slot_heads[kNumSlots];
+
+// The last processed tick, and the system clock time of its end.
+static uint8 current_slot;
+static uint32 wheel_time_millis;
+
+void setup() {
+  for (uint8 i = 0; i < kNumSlots; i++) {
+    slot_heads[i] = kNoTimer;
+  }
+  for (uint8 i = 0; i < kMaxTimers; i++) {
+    timers[i].slot = kNoTimer;
+  }
+  current_slot = 0;
+  wheel_time_millis = system_clock::timeMillis();
+}
+
+// Add a timer to the slot of the tick that is delay_millis from now, at
+// least the next tick.
+static void insert(uint8 timer_id, uint16 delay_millis) {
+  uint16 ticks = (delay_millis + kTickMillis - 1) / kTickMillis;
+  if (!ticks) {
+    ticks = 1;
+  }
+  Timer& timer = timers[timer_id];
+  timer.slot = (current_slot + ticks) & (kNumSlots - 1);
+  timer.rounds = (ticks - 1) / kNumSlots;
+  timer.next = slot_heads[timer.slot];
+  slot_heads[timer.slot] = timer_id;
+}
+
+uint8 start(uint16 delay_millis, uint16 period_millis, Callback callback) {
+  for (uint8 i = 0; i < kMaxTimers; i++) {
+    if (timers[i].slot == kNoTimer) {
+      timers[i].callback = callback;
+      timers[i].period_millis = period_millis;
+      insert(i, delay_millis);
+      return i;
+    }
+  }
+  return kNoTimer;
+}
+
+void stop(uint8 timer_id) {
+  if (timer_id >= kMaxTimers || timers[timer_id].slot == kNoTimer) {
+    return;
+  }
+  uint8* link = &slot_heads[timers[timer_id].slot];
+  while (*link != timer_id && *link != kNoTimer) {
+    link = &timers[*link].next;
+  }
+  if (*link == timer_id) {
+    *link = timers[timer_id].next;
+  }
+  timers[timer_id].slot = kNoTimer;
+}
+
+// Process the timers of the current slot. The expired timers are unlinked
+// first and called after the walk, so the callbacks can start and stop 
+// timers, and a periodic timer of a full revolution is not revisited.
+static void processSlot() {
+  Callback expired[kMaxTimers];
+  uint8 num_expired = 0;
+  uint8 periodic_mask = 0;
+  uint8* link = &slot_heads[current_slot];
+  while (*link != kNoTimer) {
+    const uint8 i = *link;
+    Timer& timer = timers[i];
+    if (timer.rounds) {
+      timer.rounds--;
+      link = &timer.next;
+      continue;
+    }
+    *link = timer.next;
+    timer.slot = kNoTimer;
+    expired[num_expired++] = timer.callback;
+    if (timer.period_millis) {
+      periodic_mask |= 1 << i;
+    }
+  }
+  for (uint8 i = 0; i < kMaxTimers; i++) {
+    if (periodic_mask & (1 << i)) {
+      insert(i, timers[i].period_millis);
+    }
+  }
+  for (uint8 i = 0; i < num_expired; i++) {
+    expired[i]();
+  }
+}
+
+void loop() {
+  const uint32 now_millis = system_clock::timeMillis();
+  while (now_millis - wheel_time_millis >= kTickMillis) {
+    wheel_time_millis += kTickMillis;
+    current_slot = (current_slot + 1) & (kNumSlots - 1);
+    processSlot();
+  }
+}
+
+}  // namespace timer_wheel
@@ -0,0 +1,54 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include "avr_util.h"
+
+// A hashed timer wheel for the main loop timeouts. Instead of each timer
+// polling its PassiveTimer on every loop iteration, a timer is registered
+// once with its deadline and a callback, and loop() visits only the wheel
+// slot of the current tick. A slot holds the timers whose deadline falls 
+// on it in this or a later revolution of the wheel.
+//
+// Resolution is kTickMillis, callbacks may be late by up to a tick. 
+namespace timer_wheel {
+  static const uint8 kTickMillis = 10;
+  // Number of wheel slots, a revolution of 320ms.
+  static const uint8 kNumSlots = 32;
+  // Max number of registered timers.
+  static const uint8 kMaxTimers = 8;
+
+  // Returned by start() when all the timers are in use.
+  static const uint8 kNoTimer = 0xff;
+
+  // Called from loop() when the timer expires.
+  typedef void (*Callback)();
+
+  // Call once from main setup().
+  extern void setup();
+
+  // Call from the main loop, after system_clock::loop(). Processes the
+  // slots of the ticks since the last call.
+  extern void loop();
+
+  // Register a timer that calls callback delay_millis from now, and then 
+  // every period_millis, or once if period_millis is zero. Returns its id
+  // for stop(), or kNoTimer if all the timers are in use.
+  extern uint8 start(uint16 delay_millis, uint16 period_millis, Callback callback);
+
+  // Unregister a timer. Does nothing if it already expired (one shot).
+  extern void stop(uint8 timer_id);
+}  // namespace timer_wheel
+
+#endif
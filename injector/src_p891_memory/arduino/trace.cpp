@@ -0,0 +1,91 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "trace.h"
+
+#include "sio.h"
+
+namespace trace {
+
+// Record type of the trace records, in the high nibble of the first byte.
+static const uint8 kTraceRecordType = 3;
+// Record type of the sniffer log frames.
+static const uint8 kFrameRecordType = 4;
+
+// Send the given bytes, COBS encoded. Each block of non zero bytes is 
+// prefixed with its length plus one, which replaces the zero that follows
+// it. num_bytes is less than 254.
+static void printCobs(const uint8* bytes, uint8 num_bytes) {
+  uint8 block_start = 0;
+  for (uint8 i = 0; i <= num_bytes; i++) {
+    if (i < num_bytes && bytes[i]) {
+      continue;
+    }
+    sio::printchar(i - block_start + 1);
+    for (uint8 j = block_start; j < i; j++) {
+      sio::printchar(bytes[j]);
+    }
+    block_start = i + 1;
+  }
+}
+
+void send(uint8 token, const uint8* args, uint8 num_args) {
+  uint8 record[2 + kMaxArgBytes + 1];
+  uint8 n = 0;
+  record[n++] = kTraceRecordType << 4;
+  record[n++] = token;
+  for (uint8 i = 0; i < num_args && i < kMaxArgBytes; i++) {
+    record[n++] = args[i];
+  }
+  record[n] = crc8(record, n);
+  n++;
+
+  sio::printchar(0);
+  printCobs(record, n);
+  sio::printchar(0);
+}
+
+void sendRecord(uint8 type_and_flags, const uint8* bytes, uint8 num_bytes) {
+  uint8 record[1 + kMaxRecordBytes + 1];
+  uint8 n = 0;
+  record[n++] = type_and_flags;
+  for (uint8 i = 0; i < num_bytes && i < kMaxRecordBytes; i++) {
+    record[n++] = bytes[i];
+  }
+  record[n] = crc8(record, n);
+  n++;
+
+  sio::printchar(0);
+  printCobs(record, n);
+  sio::printchar(0);
+}
+
+void sendFrame(const LinFrame& frame, boolean is_valid) {
+  uint8 record[1 + LinFrame::kMaxBytes + 1];
+  uint8 n = 0;
+  record[n++] = (kFrameRecordType << 4) 
+      | (is_valid ? 0 : frame_flags::kInvalidFlag)
+      | (frame.isSlaveResponse() ? frame_flags::kSlaveResponseFlag : 0)
+      | (frame.hasInjectedBits() ? frame_flags::kInjectedFlag : 0);
+  const uint8 num_bytes = frame.num_bytes();
+  for (uint8 i = 0; i < num_bytes; i++) {
+    record[n++] = frame.get_byte(i);
+  }
+  record[n] = crc8(record, n);
+  n++;
+
+  sio::printchar(0);
+  printCobs(record, n);
+  sio::printchar(0);
+}
+
+}  // namespace trace
@@ -0,0 +1,91 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "avr_util.h"
+#include "lin_frame.h"
+
+// Tokenized log records. Instead of formatting a text message, a log site
+// sends a token of its format and its arguments as binary bytes. The 
+// formats are kept on the host, in kTraceFormats of 
+// tools/serial/serial_dump.py, which expands the records with --binary=1.
+//
+// A record is sent as a zero byte, the COBS encoding of
+//   [0]      record type TRACE (3) in bits [7:4].
+//   [1]      the token.
+//   [2..]    the arguments, little endian.
+//   [last]   CRC-8 (polynomial 0x07, initial value 0) of the bytes above.
+// and a zero byte, so it can be told apart from the text messages.
+//
+// The frames of the sniffer log (custom_defs::kUseSnifferLog) are sent the
+// same way, as the COBS encoding of
+//   [0]      record type FRAME (4) in bits [7:4] and frame_flags in [3:0].
+//   [1..]    the frame bytes, id, data and checksum.
+//   [last]   CRC-8 of the bytes above.
+//
+// Other modules send their fixed format records the same way with 
+// sendRecord(), e.g. the health records of health_report.h (type 6).
+namespace trace {
+  static const uint8 kMaxArgBytes = 8;
+
+  // The format tokens. Must match kTraceFormats.
+  namespace tokens {
+    // A uint16 with a bit per panel signal, see custom_module.
+    static const uint8 PANEL_STATE = 1;
+  }
+
+  // Max number of bytes send() writes to sio.
+  static const uint8 kMaxPrintedBytes = 1 + 1 + kMaxArgBytes + 1 + 1 + 2;
+
+  // Flags of the frame records.
+  namespace frame_flags {
+    // The frame's checksum or length is invalid.
+    static const uint8 kInvalidFlag = H(0);
+    // The response came from the slave side or was sent by the injector,
+    // rather than from the master.
+    static const uint8 kSlaveResponseFlag = H(1);
+    // The frame has bits forced by the injector, or a response sent by it.
+    static const uint8 kInjectedFlag = H(2);
+  }
+
+  // Max number of bytes sendFrame() writes to sio.
+  static const uint8 kMaxFramePrintedBytes = 1 + LinFrame::kMaxBytes + 1 + 1 + 2;
+
+  // Send a record with the given token and argument bytes, at most 
+  // kMaxArgBytes.
+  extern void send(uint8 token, const uint8* args, uint8 num_args);
+
+  // Send a frame record of the sniffer log.
+  extern void sendFrame(const LinFrame& frame, boolean is_valid);
+
+  // Max number of bytes of a sendRecord() record, after its first byte.
+  static const uint8 kMaxRecordBytes = 32;
+
+  // Max number of bytes sendRecord() writes to sio for a record of 
+  // num_bytes bytes.
+  inline uint8 maxRecordPrintedBytes(uint8 num_bytes) {
+    return 1 + 1 + num_bytes + 1 + 1 + 2;
+  }
+
+  // Send a record with the given first byte, the record type in bits [7:4],
+  // followed by the given bytes, at most kMaxRecordBytes.
+  extern void sendRecord(uint8 type_and_flags, const uint8* bytes, uint8 num_bytes);
+
+  inline void send(uint8 token, uint16 arg) {
+    const uint8 args[] = { (uint8)arg, (uint8)(arg >> 8) };
+    send(token, args, sizeof(args));
+  }
+}  // namespace trace
+
+#endif
@@ -0,0 +1,167 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "vehicle_profiles.h"
+
+#include <avr/pgmspace.h>
+#include "custom_injector.h"
+#include "custom_signals.h"
+#include "lin_processor.h"
+#include "passive_timer.h"
+#include "settings.h"
+#include "sio.h"
+
+namespace vehicle_profiles {
+  // A signal whose location differs from custom_signals.h. byte_index is of
+  // the frame bytes.
+  struct SignalLocation {
+    uint8 signal_id;
+    uint8 byte_index;
+    uint8 bit_index;
+  };
+
+  // A button whose location differs from custom_injector.h. byte_index is
+  // of the data bytes.
+  struct ButtonLocation {
+    uint8 pulse_index;
+    uint8 byte_index;
+    uint8 bit_index;
+  };
+
+  // The detect_id of a profile without a detection frame.
+  static const uint8 kNoId = 0xff;
+
+  struct Profile {
+    const char* name;
+    // The protected id of a frame that is seen only on this model, or kNoId.
+    uint8 detect_id;
+    const SignalLocation* signals;
+    uint8 num_signals;
+    const ButtonLocation* buttons;
+    uint8 num_buttons;
+  };
+
+  static const char k981Name[] PROGMEM = "981";
+  static const char k991Name[] PROGMEM = "991";
+
+  // The 981 locations are the defaults of custom_signals.h and
+  // custom_injector.h. The 991 center console is expected to use the same
+  // frames (see README.md), so it has no overrides until verified on a car.
+  // Differences go in a SignalLocation or ButtonLocation array of the 
+  // profile, e.g. { custom_signals::signal_ids::sport_switch, 2, 2 }.
+  static const Profile kProfiles[ids::kNumProfiles] PROGMEM = {
+    { k981Name, kNoId, NULL, 0, NULL, 0 },
+    { k991Name, kNoId, NULL, 0, NULL, 0 },
+  };
+
+  // The resolved profile, one of ids, or kAuto while detecting.
+  static uint8 active_profile = kAuto;
+
+  // True while detecting. The detection frame ids are then accepted to the
+  // rx queue.
+  static boolean is_detecting;
+  static PassiveTimer detect_timer;
+
+  // Apply the overrides of the given profile. Called once.
+  static void resolve(uint8 profile_id, boolean is_detected) {
+    const Profile* const profile = &kProfiles[profile_id];
+    const SignalLocation* const signals =
+        (const SignalLocation*)pgm_read_word(&profile->signals);
+    const uint8 num_signals = pgm_read_byte(&profile->num_signals);
+    for (uint8 i = 0; i < num_signals; i++) {
+      custom_signals::setSignalLocation(pgm_read_byte(&signals[i].signal_id),
+          pgm_read_byte(&signals[i].byte_index), pgm_read_byte(&signals[i].bit_index));
+    }
+    const ButtonLocation* const buttons =
+        (const ButtonLocation*)pgm_read_word(&profile->buttons);
+    const uint8 num_buttons = pgm_read_byte(&profile->num_buttons);
+    for (uint8 i = 0; i < num_buttons; i++) {
+      custom_injector::setButtonLocation(pgm_read_byte(&buttons[i].pulse_index),
+          pgm_read_byte(&buttons[i].byte_index), pgm_read_byte(&buttons[i].bit_index));
+    }
+    active_profile = profile_id;
+    sio::print(F("vehicle "));
+    sio::print((const __FlashStringHelper*)pgm_read_word(&profile->name));
+    sio::println(is_detected ? F(" (detected)") : F(""));
+  }
+
+  // Stop accepting the detection frame ids that the config does not accept.
+  static void endDetection() {
+    is_detecting = false;
+    const settings::ConfigBlock& config = settings::config();
+    for (uint8 i = 0; i < ids::kNumProfiles; i++) {
+      const uint8 detect_id = pgm_read_byte(&kProfiles[i].detect_id);
+      if (detect_id == kNoId) {
+        continue;
+      }
+      const uint8 id = LinFrame::idFromPid(detect_id);
+      if (!(config.accepted_ids[id >> 3] & bitMask(id & 0x07))) {
+        lin_processor::acceptId(id, false);
+      }
+    }
+  }
+
+  void setup() {
+    const uint8 selected = settings::config().vehicle_profile;
+    if (selected < ids::kNumProfiles) {
+      resolve(selected, false);
+      return;
+    }
+    for (uint8 i = 0; i < ids::kNumProfiles; i++) {
+      const uint8 detect_id = pgm_read_byte(&kProfiles[i].detect_id);
+      if (detect_id != kNoId) {
+        lin_processor::acceptId(LinFrame::idFromPid(detect_id), true);
+        is_detecting = true;
+      }
+    }
+    if (!is_detecting) {
+      resolve(ids::P981, false);
+      return;
+    }
+    detect_timer.restart();
+  }
+
+  void loop() {
+    if (is_detecting && detect_timer.timeMillis() >= kDetectMillis) {
+      endDetection();
+      resolve(ids::P981, false);
+    }
+  }
+
+  void frameArrived(const LinFrame& frame) {
+    if (!is_detecting) {
+      return;
+    }
+    const uint8 id = frame.get_byte(0);
+    for (uint8 i = 0; i < ids::kNumProfiles; i++) {
+      if (pgm_read_byte(&kProfiles[i].detect_id) == id) {
+        endDetection();
+        resolve(i, true);
+        return;
+      }
+    }
+  }
+
+  boolean isResolved() {
+    return active_profile != kAuto;
+  }
+
+  boolean select(uint8 profile_id) {
+    if (profile_id >= ids::kNumProfiles && profile_id != kAuto) {
+      return false;
+    }
+    settings::ConfigBlock block = settings::config();
+    block.vehicle_profile = profile_id;
+    settings::setConfig(block);
+    return true;
+  }
+}  // namespace vehicle_profiles
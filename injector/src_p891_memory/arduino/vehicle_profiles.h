@@ -0,0 +1,61 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VEHICLE_PROFILES_H
+#define VEHICLE_PROFILES_H
+
+#include "avr_util.h"
+#include "lin_frame.h"
+
+// Per vehicle model locations of the signals and of the injected buttons,
+// in program memory, so a single firmware supports the 981 and the 991. A
+// profile lists only the locations that differ from custom_signals.h and
+// custom_injector.h. The active profile is resolved once at boot into the
+// RAM tables of custom_signals and custom_injector, so the per frame lookups
+// cost the same as with fixed locations.
+//
+// The profile is selected by the config block (see settings.h). With kAuto,
+// the profile whose detection frame id is seen first is used, or the 981
+// profile if none is seen within kDetectMillis. The signals are not tracked
+// until the profile is resolved.
+namespace vehicle_profiles {
+  namespace ids {
+    static const uint8 P981 = 0;
+    static const uint8 P991 = 1;
+    static const uint8 kNumProfiles = 2;
+  }
+
+  // The config block value of the auto detection.
+  static const uint8 kAuto = 0xff;
+
+  // Max time from setup() to the auto detection of the profile.
+  static const uint16 kDetectMillis = 2000;
+
+  // Call once from setup(), after settings::setup() and before the other
+  // custom setups.
+  extern void setup();
+
+  // Call from the main loop. Ends the auto detection on time out.
+  extern void loop();
+
+  // Call with each frame, before it is tracked. Used for the auto detection.
+  extern void frameArrived(const LinFrame& frame);
+
+  // True once the locations of the profile were applied.
+  extern boolean isResolved();
+
+  // Set the profile of the next boots, one of ids or kAuto. Persisted in the
+  // config block. Returns false if the profile is not valid.
+  extern boolean select(uint8 profile_id);
+}  // namespace vehicle_profiles
+
+#endif
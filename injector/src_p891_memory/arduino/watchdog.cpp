@@ -0,0 +1,106 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "watchdog.h"
+
+#include "custom_injector.h"
+#include "sio.h"
+#include "system_clock.h"
+
+namespace watchdog {
+  namespace private_ {
+    volatile uint8 tag;
+  }
+
+  // The post mortem record. In the .noinit section, so it is not cleared by
+  // the startup code after the watchdog reset.
+  static const uint16 kPostMortemMagic = 0x5744;
+
+  struct PostMortem {
+    uint16 magic;
+    uint8 tag;
+    uint32 time_millis;
+  };
+
+  static PostMortem post_mortem __attribute__ ((section (".noinit")));
+
+  // The reset flags of this run.
+  static uint8 reset_flags;
+
+  // The tag of the post mortem record of the previous run, kNoTag if none.
+  static uint8 stall_tag;
+
+  // The bootloader (optiboot) clears MCUSR before starting the sketch and
+  // passes its value in r2. Saved here before the startup code uses the 
+  // registers, in .noinit so clearing the .bss does not erase it.
+  static uint8 boot_mcusr __attribute__ ((section (".noinit")));
+
+  static void saveBootMcusr() __attribute__ ((naked, used, section (".init0")));
+  static void saveBootMcusr() {
+    asm volatile("sts %[mcusr], r2\n\t" :: [mcusr] "i" (&boot_mcusr) : "memory");
+  }
+
+  void setup() {
+    reset_flags = MCUSR;
+    // WDRF must be cleared before the watchdog can be disabled.
+    MCUSR = 0;
+    wdt_disable();
+    // Here when started by the bootloader.
+    if (!reset_flags) {
+      reset_flags = boot_mcusr;
+    }
+    // The record is written only by the watchdog ISR and cleared below, so
+    // it tells a watchdog reset regardless of the bootloader. After a power
+    // on, the .noinit contents are random.
+    if (post_mortem.magic == kPostMortemMagic && !(reset_flags & H(PORF))) {
+      stall_tag = post_mortem.tag;
+      reset_flags |= H(WDRF);
+    } else {
+      stall_tag = kNoTag;
+    }
+    post_mortem.magic = 0;
+  }
+
+  uint8 resetFlags() {
+    return reset_flags;
+  }
+
+  uint8 stallTag() {
+    return stall_tag;
+  }
+
+  void start() {
+    if (stall_tag != kNoTag) {
+      sio::out << F("watchdog reset: tag=") << stall_tag << F(" at ") 
+          << post_mortem.time_millis << F("ms\n");
+    }
+
+    // Interrupt and system reset mode, 0.5s timeout. The timed sequence, 
+    // the second write must be within 4 cycles of the first.
+    const uint8 sreg = SREG;
+    cli();
+    wdt_reset();
+    WDTCSR = H(WDCE) | H(WDE);
+    WDTCSR = H(WDIE) | H(WDE) | H(WDP2) | H(WDP0);
+    SREG = sreg;
+  }
+
+  // The first timeout. The hardware clears WDIE, so the next timeout resets
+  // the device.
+  ISR(WDT_vect)
+  {
+    custom_injector::disableAllForIsr();
+    post_mortem.magic = kPostMortemMagic;
+    post_mortem.tag = private_::tag;
+    post_mortem.time_millis = system_clock::timeMillisForIsr();
+  }
+}  // namespace watchdog
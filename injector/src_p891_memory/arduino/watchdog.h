@@ -0,0 +1,67 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <avr/wdt.h>
+#include "avr_util.h"
+
+// Main loop supervision with the hardware watchdog timer. The main loop 
+// must call kick() at least every kTimeoutMillis. Otherwise the watchdog 
+// interrupt disables all the injection, which could otherwise stay frozen
+// mid press, and saves a post mortem record. The watchdog resets the 
+// device kTimeoutMillis later. The record survives the reset and is 
+// printed by setup() of the next run.
+//
+// USES: the watchdog timer, interrupt and system reset mode.
+namespace watchdog {
+  static const uint16 kTimeoutMillis = 500;
+
+  // Returned by stallTag() when the run did not start with a watchdog reset.
+  static const uint8 kNoTag = 0xff;
+
+  namespace private_ {
+    // Identifies the code that runs, for the post mortem record.
+    extern volatile uint8 tag;
+  }
+
+  // Call once from main setup(), first, to stop a watchdog left enabled by
+  // a watchdog reset.
+  extern void setup();
+
+  // The MCUSR reset flags at the start of this run, as passed by the 
+  // bootloader if it cleared MCUSR, with WDRF set if the previous run left
+  // a post mortem record. Valid after setup().
+  extern uint8 resetFlags();
+
+  // The tag of the stall that reset the previous run, kNoTag if none. 
+  // Valid after setup().
+  extern uint8 stallTag();
+
+  // Call at the end of main setup(). Prints the post mortem record of the 
+  // previous run, if any, and starts the supervision.
+  extern void start();
+
+  // Restart the deadline. Call from the main loop.
+  inline void kick() {
+    wdt_reset();
+  }
+
+  // Set the tag of the post mortem record, e.g. the index of the running
+  // main loop task.
+  inline void setTag(uint8 tag) {
+    private_::tag = tag;
+  }
+}  // namespace watchdog
+
+#endif
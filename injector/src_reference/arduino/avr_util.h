@@ -42,5 +42,19 @@ inline byte bitMask(byte bit_index) {
   return *(avr_util_private::kBitMaskArray + bit_index);
 }
 
+// CRC-8 with polynomial 0x07 and initial value 0, as used by the eeprom
+// records and the binary serial records. Start with crc = 0 and update
+// with one byte at a time.
+inline uint8 crc8Update(uint8 crc, uint8 b) {
+  crc ^= b;
+  for (uint8 i = 0; i < 8; i++) {
+    crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+  }
+  return crc;
+}
+
+// CRC-8 of the given bytes. See crc8Update().
+extern uint8 crc8(const uint8* bytes, uint8 num_bytes);
+
 #endif
 
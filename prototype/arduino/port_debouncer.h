@@ -0,0 +1,108 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef PORT_DEBOUNCER_H
+#define PORT_DEBOUNCER_H
+
+#include "avr_util.h"
+#include "passive_timer.h"
+
+// Debounces up to 8 buttons of an i/o port in parallel. The port pins are
+// read once per tick and each bit has a two bit vertical counter, so a bit
+// changes its stable value after 4 consecutive ticks with the other value.
+// An alternative to one IoButton (pin + Debouncer) per button.
+class PortDebouncer {
+ public:
+  // port is the PORTx register, as in io_pins. bit_mask selects the button
+  // pins, which are set as inputs with pullups. Bits of active_high_mask are
+  // pressed when high, others when low.
+  PortDebouncer(volatile uint8& port, uint8 bit_mask, uint8 active_high_mask,
+      uint8 tick_millis)
+   :
+    pin_(*((&port)-2)),
+    bit_mask_(bit_mask),
+    active_low_mask_(~active_high_mask & bit_mask),
+    tick_millis_(tick_millis),
+    pressed_bits_(0),
+    count_bits0_(0xff),
+    count_bits1_(0xff) {
+      volatile uint8& ddr = *((&port)-1);
+      ddr &= ~bit_mask;  // input
+      port |= bit_mask;  // pullup
+  }
+
+  // Call from the main loop() method. Samples the port once per tick.
+  inline void loop() {
+    if (tick_timer_.timeMillis() < tick_millis_) {
+      return;
+    }
+    tick_timer_.restart();
+    sample();
+  }
+
+  // Sample the port and update the debounced state. Called by loop() once
+  // per tick, can also be called directly from a periodic timer.
+  inline void sample() {
+    // Bits whose pressed value differs from the stable one.
+    const uint8 changed = ((pin_ ^ active_low_mask_) & bit_mask_) ^ pressed_bits_;
+    // The counters of unchanged bits are reset to 3, others count down and
+    // the bits that roll over from 0 toggle.
+    count_bits0_ = ~(count_bits0_ & changed);
+    count_bits1_ = count_bits0_ ^ (count_bits1_ & changed);
+    pressed_bits_ ^= changed & count_bits0_ & count_bits1_;
+  }
+
+  // Is the button of the given pin pressed? (post debouncing).
+  inline boolean isPressed(uint8 bit_index) const {
+    return pressed_bits_ & bitMask(bit_index);
+  }
+
+  // Mask of the pressed buttons (post debouncing).
+  inline uint8 pressedBits() const {
+    return pressed_bits_;
+  }
+
+ private:
+  volatile uint8& pin_;
+  const uint8 bit_mask_;
+  const uint8 active_low_mask_;
+  const uint8 tick_millis_;
+  PassiveTimer tick_timer_;
+
+  // The debounced state, a bit per button, set if pressed.
+  uint8 pressed_bits_;
+
+  // Per bit vertical counter, bit planes 0 and 1.
+  uint8 count_bits0_;
+  uint8 count_bits1_;
+};
+
+// A button of a PortDebouncer, with the same isPressed() API as IoButton.
+class PortButton {
+ public:
+  PortButton(const PortDebouncer& port_debouncer, uint8 bit_index)
+   :
+    port_debouncer_(port_debouncer),
+    bit_index_(bit_index) {
+  }
+
+  // Is button pressed? (post debouncing).
+  inline boolean isPressed() const {
+    return port_debouncer_.isPressed(bit_index_);
+  }
+
+ private:
+  const PortDebouncer& port_debouncer_;
+  const uint8 bit_index_;
+};
+
+#endif
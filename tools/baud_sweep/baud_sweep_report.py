@@ -0,0 +1,97 @@
+#!/usr/bin/python
+
+# A python script that computes a frame error rate table of a baud rate 
+# sweep, from a capture of the board under test. The sweep is sent by an
+# analyzer in the generator mode with custom_defs::kUseGeneratorSweep. Its
+# frames carry their baud offset step and index, so the frames that were 
+# lost or received with errors are counted per step.
+#
+# The capture is the output of serial_dump.py, or the raw analyzer output.
+# The results are printed as a markdown table, one line per step.
+#
+# Tested with python 2.7.
+
+import optparse
+import re
+import sys
+
+# Set later when parsing args.
+FLAGS = None
+
+# The protected id of the sweep frames (id 0x2a).
+kSweepPid = 0x6a
+
+# A frame line with an optional host timestamp prefix. Frames with an ERR
+# suffix or an hardware timestamp are matched too.
+kFrameRegex = re.compile(
+    '^(?:[0-9.]+  )?([0-9a-f]{2})((?: [0-9a-f]{2})*)( ERR)?(?: [*])?(?: @[0-9]+(?: [+][0-9]+)?)?$')
+
+# Returns the baud offset step of a valid sweep frame line, in permille, or
+# None if not a valid sweep frame.
+def sweepStep(line):
+  match = kFrameRegex.match(line.rstrip())
+  if not match or match.group(3) or int(match.group(1), 16) != kSweepPid:
+    return None
+  data = [int(b, 16) for b in match.group(2).split()]
+  if len(data) != 9 or data[4:8] != [0x55, 0xaa, 0x00, 0xff]:
+    return None
+  step = data[0] | (data[1] << 8)
+  return step - 0x10000 if step & 0x8000 else step
+
+def parseArgs(argv):
+  global FLAGS
+  parser = optparse.OptionParser(usage="%prog [options] < capture")
+  parser.add_option("--max_permille", dest="max_permille", type="int", default=150,
+      help="custom_defs::kSweepMaxPermille of the generator")
+  parser.add_option("--step_permille", dest="step_permille", type="int", default=5,
+      help="custom_defs::kSweepStepPermille of the generator")
+  parser.add_option("--frames_per_step", dest="frames_per_step", type="int", 
+      default=64, help="8 * custom_defs::kSweepBurstsPerStep of the generator")
+  (FLAGS, args) = parser.parse_args(argv[1:])
+
+def main(argv):
+  parseArgs(argv)
+  steps = range(-FLAGS.max_permille, FLAGS.max_permille + 1, FLAGS.step_permille)
+  index_of = dict((step, i) for (i, step) in enumerate(steps))
+
+  # The visits of the steps, in order, as [step index, frames received]. A
+  # step with no received frame is visited when the sweep passes over it.
+  visits = []
+  for line in sys.stdin:
+    step = sweepStep(line)
+    if step is None or step not in index_of:
+      continue
+    i = index_of[step]
+    if visits and visits[-1][0] == i:
+      visits[-1][1] += 1
+      continue
+    if visits:
+      j = (visits[-1][0] + 1) % len(steps)
+      while j != i:
+        visits.append([j, 0])
+        j = (j + 1) % len(steps)
+    visits.append([i, 1])
+
+  # The first and last visits may be partial.
+  visits = visits[1:-1]
+  if not visits:
+    sys.stderr.write("No complete sweep steps in the capture.\n")
+    sys.exit(1)
+
+  expected = [0] * len(steps)
+  received = [0] * len(steps)
+  for (i, count) in visits:
+    expected[i] += FLAGS.frames_per_step
+    received[i] += min(count, FLAGS.frames_per_step)
+
+  sys.stdout.write("| baud offset % | frames | received | error rate % |\n")
+  sys.stdout.write("|---:|---:|---:|---:|\n")
+  for (i, step) in enumerate(steps):
+    if not expected[i]:
+      continue
+    rate = 100.0 * (expected[i] - received[i]) / expected[i]
+    sys.stdout.write("| %+.1f | %d | %d | %.1f |\n" % 
+        (step / 10.0, expected[i], received[i], rate))
+
+if __name__ == "__main__":
+  main(sys.argv)
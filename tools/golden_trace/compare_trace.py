@@ -0,0 +1,135 @@
+#!/usr/bin/python
+
+# A python script that compares a capture of the slave side of an injector
+# to a golden capture of the same replayed traffic, to verify that changes 
+# of the injection path force the same bits of the same frames. The master
+# side traffic is replayed by an analyzer in the generator replay mode
+# (custom_defs::kUseReplay), so the frames and their timing are the same on
+# each run.
+#
+# The captures are the output of serial_dump.py, or the raw analyzer output,
+# with the analyzer's hardware timestamps (custom_defs::kPrintFrameTimestamps).
+# Frames are compared byte by byte, in order, from the first frame of the
+# test capture that matches the first golden frame. The frame times are 
+# compared relative to that frame.
+#
+# Exits with status 1 if any difference was found.
+#
+# Tested with python 2.7.
+
+import optparse
+import re
+import sys
+
+# Set later when parsing args.
+FLAGS = None
+
+# A frame line with an optional host timestamp prefix, the protected id, 
+# data and checksum bytes, an optional ERR suffix and an optional hardware
+# timestamp.
+kFrameRegex = re.compile(
+    '^(?:[0-9.]+  )?([0-9a-f]{2})((?: [0-9a-f]{2})*)( ERR)?(?: [*])?(?: @([0-9]+)(?: [+][0-9]+)?)?$')
+
+# Analyzer hardware clock ticks per millisecond.
+kTicksPerMilli = 250
+
+# Returns the list of (ticks or None, bytes, is_error) of the frames of the
+# capture with the given id bytes, all if None. Bytes include the id and 
+# checksum.
+def parseCapture(path, ids):
+  frames = []
+  with open(path) as f:
+    for line in f:
+      match = kFrameRegex.match(line.rstrip())
+      if not match:
+        continue
+      data = [int(match.group(1), 16)] + [int(b, 16) for b in match.group(2).split()]
+      if ids is not None and data[0] not in ids:
+        continue
+      ticks = int(match.group(4)) if match.group(4) else None
+      frames.append((ticks, data, bool(match.group(3))))
+  return frames
+
+def hexBytes(data):
+  return " ".join("%02x" % b for b in data)
+
+# Returns a text with the differing bits of the frame data, e.g. 
+# 'byte 2 bits 04'.
+def bitDiffs(golden, test):
+  diffs = []
+  for i in range(min(len(golden), len(test))):
+    if golden[i] != test[i]:
+      diffs.append("byte %d bits %02x" % (i, golden[i] ^ test[i]))
+  if len(golden) != len(test):
+    diffs.append("length %d vs %d" % (len(golden), len(test)))
+  return ", ".join(diffs)
+
+def parseArgs(argv):
+  global FLAGS
+  parser = optparse.OptionParser(usage="%prog [options] golden.txt test.txt")
+  parser.add_option("--ids", dest="ids", default="0d,8e",
+      help="comma separated hex id bytes of the compared frames, as printed, all if empty")
+  parser.add_option("--max_frames", dest="max_frames", type="int", default=0,
+      help="max number of golden frames to compare, all if 0")
+  parser.add_option("--max_skew_ticks", dest="max_skew_ticks", type="int", default=25,
+      help="max difference of the relative frame times, in 4 usec ticks")
+  parser.add_option("--max_diffs", dest="max_diffs", type="int", default=20,
+      help="max number of differences to print")
+  (FLAGS, args) = parser.parse_args(argv[1:])
+  if len(args) != 2:
+    parser.error("expecting a golden and a test capture")
+  return args
+
+def main(argv):
+  (golden_path, test_path) = parseArgs(argv)
+  ids = set(int(id, 16) for id in FLAGS.ids.split(",") if id) if FLAGS.ids else None
+  golden = parseCapture(golden_path, ids)
+  test = parseCapture(test_path, ids)
+  if FLAGS.max_frames:
+    golden = golden[:FLAGS.max_frames]
+  if not golden:
+    sys.stderr.write("No frames in the golden capture.\n")
+    sys.exit(1)
+
+  # Align the test capture with the start of the golden one.
+  start = 0
+  while start < len(test) and test[start][1:] != golden[0][1:]:
+    start += 1
+  if start == len(test):
+    sys.stderr.write("The first golden frame is not in the test capture.\n")
+    sys.exit(1)
+  test = test[start:start + len(golden)]
+
+  diffs = []
+  skews = []
+  for i in range(len(test)):
+    (golden_ticks, golden_data, golden_error) = golden[i]
+    (test_ticks, test_data, test_error) = test[i]
+    if golden_data != test_data or golden_error != test_error:
+      diffs.append("frame %d: golden %s%s, test %s%s (%s)" % (i, 
+          hexBytes(golden_data), " ERR" if golden_error else "", 
+          hexBytes(test_data), " ERR" if test_error else "",
+          bitDiffs(golden_data, test_data)))
+    if None in (golden_ticks, test_ticks, golden[0][0], test[0][0]):
+      continue
+    # The analyzer ticks are 32 bit and wrap around.
+    golden_delta = (golden_ticks - golden[0][0]) & 0xffffffff
+    test_delta = (test_ticks - test[0][0]) & 0xffffffff
+    skew = test_delta - golden_delta
+    skews.append(skew)
+    if abs(skew) > FLAGS.max_skew_ticks:
+      diffs.append("frame %d: time %+.3f ms from golden" % (i, 
+          float(skew) / kTicksPerMilli))
+  if len(test) < len(golden):
+    diffs.append("test capture ends after %d of %d frames" % (len(test), len(golden)))
+
+  for line in diffs[:FLAGS.max_diffs]:
+    print(line)
+  if len(diffs) > FLAGS.max_diffs:
+    print("... %d more" % (len(diffs) - FLAGS.max_diffs))
+  skew_text = ("skew %d..%d ticks" % (min(skews), max(skews))) if skews else "no timestamps"
+  print("%d frames compared, %d differences, %s" % (len(test), len(diffs), skew_text))
+  sys.exit(1 if diffs else 0)
+
+if __name__ == "__main__":
+  main(sys.argv)
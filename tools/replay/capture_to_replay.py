@@ -0,0 +1,122 @@
+#!/usr/bin/python
+
+# A python script that converts an analyzer capture to the replay_frames.h
+# of the analyzer's generator mode (custom_defs::kUseReplay), to replay the
+# traffic of a given car onto a bench bus with its original frame timing.
+#
+# The capture is the output of serial_dump.py, or the raw analyzer output,
+# with the analyzer's hardware timestamps (custom_defs::kPrintFrameTimestamps,
+# or binary output decoded by serial_dump.py --binary=1). Frame lines without
+# a timestamp and other lines are ignored. Frames with the ERR suffix are 
+# replayed with a checksum error.
+#
+# Tested with python 2.7.
+
+import optparse
+import re
+import sys
+
+# Set later when parsing args.
+FLAGS = None
+
+# A frame line with an optional host timestamp prefix, the id, data and 
+# checksum bytes, an optional ERR suffix and the hardware timestamp.
+kFrameRegex = re.compile(
+    '^(?:[0-9.]+  )?([0-9a-f]{2})((?: [0-9a-f]{2})*)( ERR)?(?: [*])? @([0-9]+)(?: [+][0-9]+)?$')
+
+# Max ticks (4us) between two frames, per ReplayFrame::delta_ticks.
+kMaxDeltaTicks = 0xffff
+
+# Analyzer hardware clock ticks per millisecond.
+kTicksPerMilli = 250
+
+# Returns the list of (break ticks, id, data bytes, is_error) of the frames
+# of the capture.
+def parseCapture(lines):
+  frames = []
+  for line in lines:
+    match = kFrameRegex.match(line.rstrip())
+    if not match:
+      continue
+    id = int(match.group(1), 16)
+    data = [int(b, 16) for b in match.group(2).split()]
+    is_error = bool(match.group(3))
+    # Drop the checksum, the generator computes it.
+    if data:
+      data = data[:-1]
+    if len(data) > 8:
+      continue
+    frames.append((int(match.group(4)), id, data, is_error))
+  return frames
+
+# Returns the C++ row of a replay frame.
+def frameRow(delta_ticks, id, data, is_error):
+  data_text = ", ".join("0x%02x" % b for b in data) if data else "0"
+  return "    { %d, 0x%02x, %d, { %s }, %s }," % (delta_ticks, id, len(data), 
+      data_text, "errors::CHECKSUM" if is_error else "0")
+
+def parseArgs(argv):
+  global FLAGS
+  parser = optparse.OptionParser(usage="%prog [options] < capture > replay_frames.h")
+  parser.add_option("--max_frames", dest="max_frames", type="int", default=1000,
+      help="max number of frames to convert, limited by the flash size")
+  parser.add_option("--loop_gap_ms", dest="loop_gap_ms", type="int", default=50,
+      help="gap between the last and the first frame, when the replay loops")
+  (FLAGS, args) = parser.parse_args(argv[1:])
+
+def main(argv):
+  parseArgs(argv)
+  frames = parseCapture(sys.stdin)[:FLAGS.max_frames]
+  if not frames:
+    sys.stderr.write("No timestamped frames in the capture.\n")
+    sys.exit(1)
+  rows = []
+  clamped = 0
+  last_ticks = None
+  for (ticks, id, data, is_error) in frames:
+    if last_ticks is None:
+      delta = FLAGS.loop_gap_ms * kTicksPerMilli
+    else:
+      # The analyzer ticks are 32 bit and wrap around.
+      delta = (ticks - last_ticks) & 0xffffffff
+    if delta > kMaxDeltaTicks:
+      delta = kMaxDeltaTicks
+      clamped += 1
+    last_ticks = ticks
+    rows.append(frameRow(delta, id, data, is_error))
+  if clamped:
+    sys.stderr.write("%d gaps longer than %d ticks were shortened.\n" % 
+        (clamped, kMaxDeltaTicks))
+
+  sys.stdout.write("""// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REPLAY_FRAMES_H
+#define REPLAY_FRAMES_H
+
+#include <avr/pgmspace.h>
+#include "lin_generator.h"
+
+// The frames replayed by the generator with custom_defs::kUseReplay. 
+// Generated by tools/replay/capture_to_replay.py, %d frames.
+namespace lin_generator {
+  static const ReplayFrame kReplayFrames[] PROGMEM = {
+    // delta ticks, id, n, data, errors.
+%s
+  };
+}  // namespace lin_generator
+
+#endif
+""" % (len(rows), "\n".join(rows)))
+
+if __name__ == "__main__":
+  main(sys.argv)
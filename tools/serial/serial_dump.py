@@ -14,37 +14,466 @@ import os
 import re
 import select
 import serial
+import struct
 import sys
 import traceback
 import time
 
+import signal_db
+
 # Set later when parsing args.
 FLAGS = None
 
-# Pattern to parse a frame line.
+# Pattern to parse a frame line. The optional ' #<seq>' is the analyzer
+# frame sequence number (custom_defs::kPrintFrameSeq) and the optional 
+# ' @<ticks> +<ticks>' suffix is the analyzer hardware timestamp 
+# (custom_defs::kPrintFrameTimestamps). Lines of binary records have the 
+# break time only.
 # NOTE: excluding frames with ERR suffix.
-kFrameRegex = re.compile('^([0-9a-f]{2})((?: [0-9a-f]{2})+) ([0-9a-f]{2})(?: [*])?$')
+kFrameRegex = re.compile('^([0-9a-f]{2})((?: [0-9a-f]{2})+) ([0-9a-f]{2})(?: [*])?(?: [MS])?(?: #[0-9a-f]{2})?(?: @([0-9]+)(?: [+]([0-9]+))?)?$')
+
+# Pattern of the device timestamp of a frame line, text or decoded from a 
+# binary record.
+kDeviceTicksRegex = re.compile(' @([0-9]+)(?: [+][0-9]+)?$')
+
+# Pattern of the sequence number of a frame line, text or decoded from a
+# binary record.
+kSeqRegex = re.compile(' #([0-9a-f]{2})(?: @[0-9]+(?: [+][0-9]+)?)?$')
+
+# Binary frame records (custom_defs::kUseBinaryOutput, see the analyzer's
+# binary_frames.h).
+kRecordTypeFrame = 1
+kRecordTypeDelta = 2
+kRecordInvalidFlag = 0x01
+kRecordAbsoluteTimeFlag = 0x02
+kRecordChannel2Flag = 0x04
+kRecordSeqFlag = 0x08
+
+# Tokenized trace records of the injector (see trace.h): type 3, a format
+# token and the little endian argument bytes.
+kRecordTypeTrace = 3
+
+# Sniffer log frame records of the injector (custom_defs::kUseSnifferLog, see
+# trace.h): type 4 and the frame bytes, without a break time. Printed with
+# a ' M' or ' S' tag for a response from the master or the slave side.
+kRecordTypeSnifferFrame = 4
+kSnifferInvalidFlag = 0x01
+kSnifferSlaveResponseFlag = 0x02
+kSnifferInjectedFlag = 0x04
+
+# Captured rx edges of the analyzer (custom_defs::kUseEdgeCapture, see 
+# edge_capture.h): type 5, the index and time of the first edge and a 16 bit
+# word per edge, the level after the edge in bit 15 and the ticks since the
+# previous edge. Printed as 'edges <index> @<ticks>:' and H or L with the 
+# ticks of each edge.
+kRecordTypeEdges = 5
+kEdgesLastFlag = 0x01
+
+# Health records of the injector (custom_defs::kUseHealthReport, see 
+# health_report.h): type 6, uptime, frame rate, the lin error counters, max
+# loop and ISR ticks, free RAM and sio drops. Printed as a 'health' line.
+kRecordTypeHealth = 6
+kHealthErrorNames = ("FRAME_TOO_SHORT", "FRAME_TOO_LONG", "START_BIT", 
+    "STOP_BIT", "SYNC_BYTE", "BUFFER_OVERRUN", "OTHER")
+
+# Returns the bits of an integer, lsb first, as a tuple of 0/1 ints.
+def bitsOf(value, num_bits):
+  return tuple((value >> i) & 1 for i in range(num_bits))
 
-# Represents a parsed LIN frame
+# Trace token -> (format, function that returns the format args of the
+# argument bytes). Must match trace::tokens.
+kTraceFormats = {
+  1: ("AS=%d/%d PASM=%d/%d PSE=%d/%d PSM=%d/%d RC=%d RO=%d Spoil=%d/%d S=%d/%d SP=%d/%d",
+      lambda args: bitsOf(args[0] | (args[1] << 8), 16)),
+}
+
+# Analyzer hardware clock ticks per millisecond (4us per tick).
+kDeviceTicksPerMilli = 250
+
+# Pattern of a frame line for the capture files (--output), including the
+# frames with errors. Groups are the frame bytes, ' ERR', ' L2' and the 
+# device timestamp.
+kCaptureFrameRegex = re.compile('^([0-9a-f]{2}(?: [0-9a-f]{2})*)(?: [*])?(?: [MS])?( ERR)?( L2)?(?: #[0-9a-f]{2})?(?: @([0-9]+)(?: [+][0-9]+)?)?$')
+
+# Pattern of a frame line for the signal decoding (--signals). Groups are
+# the frame bytes, ' *' of frames with injected bits and ' ERR'.
+kSignalsFrameRegex = re.compile('^([0-9a-f]{2}(?: [0-9a-f]{2})*)( [*])?(?: [MS])?( ERR)?')
+
+# Max time between flushes of the capture file.
+kCaptureFlushMillis = 1000
+
+# pcap link type of LIN, and its per frame header fields. See
+# https://www.tcpdump.org/linktypes/LINKTYPE_LIN.html
+kPcapLinkTypeLin = 212
+kPcapLinRevision = 1
+kPcapLinChecksumClassic = 0
+kPcapLinChecksumEnhanced = 1
+kPcapLinErrorNoSlaveResponse = 0x01
+kPcapLinErrorChecksum = 0x08
+
+# Represents a parsed LIN frame. break_ticks is None if the line had no
+# hardware timestamp.
 class LinFrame:
-  def __init__(self, id, data, checksum):
+  def __init__(self, id, data, checksum, break_ticks):
     self.id = id
     self.data = data
     self.checksum = checksum
+    self.break_ticks = break_ticks
  
   def __str__(self):
     return "[" + self.id + "] [" + " ".join(self.data) + "] [" + self.checksum + "]"
 
   __repr__ = __str__
 
-# Convert a list of two hex digits strings to a list of a single binary digit
-# strings.
-def hexListToBitList(hex_list):
-  result = []
-  for hex_str in hex_list:
-    as_int = int(hex_str, 16)
-    bin_str = bin(as_int)[2:].zfill(8)
-    result.extend(list(bin_str))
+# Diffs the data bytes of the frames of each id (--diff). The data bytes of 
+# a frame are a single integer, the changed bits are its xor with the 
+# previous data of the id and only frames with changes are rendered, so an
+# unchanged frame costs a single xor. Also counts the changes of each bit 
+# for the heatmap (--heatmap).
+class PayloadDiffer:
+  def __init__(self):
+    # Id -> (number of data bytes, data bytes integer) of its last frame.
+    self.payloads = {}
+    # Id -> the number of changes of each data bit, indexed by the bit index
+    # in the data bytes integer.
+    self.bit_changes = {}
+    # (mask << 8) | value -> the rendered data byte, per diffStr().
+    self.byte_strs = {}
+
+  # Returns the diff string of a LinFrame, with a '0' or '1' per changed bit
+  # and '-' per other bit, or None if no bit changed or it is the first 
+  # frame of its id or of a new length.
+  def diff(self, frame):
+    num_bytes = len(frame.data)
+    payload = int("".join(frame.data), 16)
+    last = self.payloads.get(frame.id)
+    self.payloads[frame.id] = (num_bytes, payload)
+    if last is None or last[0] != num_bytes:
+      self.bit_changes[frame.id] = [0] * (8 * num_bytes)
+      return None
+    changes = payload ^ last[1]
+    if not changes:
+      return None
+    counts = self.bit_changes[frame.id]
+    bits = changes
+    while bits:
+      lowest = bits & -bits
+      counts[lowest.bit_length() - 1] += 1
+      bits ^= lowest
+    return " | ".join(self.byteStr((changes >> shift) & 0xff, (payload >> shift) & 0xff)
+        for shift in range(8 * (num_bytes - 1), -8, -8))
+
+  # Returns the rendered data byte with the given changed bits mask, msb first.
+  # Cached, there are few distinct changes on a bus.
+  def byteStr(self, mask, value):
+    key = (mask << 8) | value
+    result = self.byte_strs.get(key)
+    if result is None:
+      bits = "".join((("1" if value & (1 << i) else "0") if mask & (1 << i) else "-")
+          for i in range(7, -1, -1))
+      result = bits[:4] + " " + bits[4:]
+      self.byte_strs[key] = result
+    return result
+
+  # Returns the heatmap lines, one per id, with the change frequency of each
+  # bit as a digit from 1 to 9 relative to the bit of the id that changed 
+  # the most, and '-' for bits that never changed.
+  def heatmapLines(self):
+    lines = []
+    for id in sorted(self.bit_changes):
+      counts = self.bit_changes[id]
+      max_count = max(counts) if counts else 0
+      if not max_count:
+        continue
+      chars = [("-" if not count else str(1 + (8 * count) // max_count))
+          for count in reversed(counts)]
+      bytes = ["".join(chars[i:i + 4]) + " " + "".join(chars[i + 4:i + 8])
+          for i in range(0, len(chars), 8)]
+      lines.append("%s: | %s | %d changes" % (id, " | ".join(bytes), sum(counts)))
+    return lines
+
+# CRC-8 with polynomial 0x07 and initial value 0, of a bytearray.
+def crc8(data):
+  crc = 0
+  for b in data:
+    crc ^= b
+    for i in range(8):
+      crc = ((crc << 1) ^ 0x07) if (crc & 0x80) else (crc << 1)
+      crc &= 0xff
+  return crc
+
+# Decode a COBS encoded bytearray, without its zero delimiters. Returns None
+# if the encoding is invalid.
+def cobsDecode(data):
+  result = bytearray()
+  i = 0
+  while i < len(data):
+    code = data[i]
+    if code == 0 or i + code > len(data):
+      return None
+    result.extend(data[i + 1:i + code])
+    i += code
+    if code < 0xff and i < len(data):
+      result.append(0)
+  return result
+
+# Decodes binary records to text lines in the analyzer's text format, with
+# the absolute break time of each frame.
+class RecordDecoder:
+  def __init__(self):
+    self.break_ticks = None
+    # Id byte -> data and checksum bytes of its last valid frame, for the 
+    # delta records.
+    self.payloads = {}
+
+  # Forget the last frames, e.g. after lost records. Deltas are ignored
+  # until the next full frame of their id.
+  def reset(self):
+    self.payloads = {}
+
+  # Returns the text line of a COBS encoded record (bytearray), "" for a
+  # valid record that can't be decoded yet, or None if it is not a valid 
+  # record. 
+  def decode(self, data):
+    record = cobsDecode(data)
+    if not record or len(record) < 3 or crc8(record[:-1]) != record[-1]:
+      return None
+    record_type = record[0] >> 4
+    if record_type == kRecordTypeTrace:
+      return self.decodeTrace(record[1], record[2:-1])
+    if record_type == kRecordTypeSnifferFrame:
+      return self.decodeSnifferFrame(record[0] & 0x0f, record[1:-1])
+    if record_type == kRecordTypeEdges:
+      return self.decodeEdges(record[0] & 0x0f, record[1:-1])
+    if record_type == kRecordTypeHealth:
+      return self.decodeHealth(record[1:-1])
+    if len(record) < 4:
+      return None
+    if record_type not in (kRecordTypeFrame, kRecordTypeDelta):
+      return None
+    flags = record[0] & 0x0f
+    if flags & kRecordAbsoluteTimeFlag:
+      if len(record) < 7:
+        return None
+      self.break_ticks = (record[1] | (record[2] << 8) | (record[3] << 16) 
+          | (record[4] << 24))
+      body = record[5:-1]
+    else:
+      # A delta without a previous frame, e.g. when starting in the middle
+      # of the stream.
+      if self.break_ticks is None:
+        return ""
+      self.break_ticks = (self.break_ticks + (record[1] | (record[2] << 8))) & 0xffffffff
+      body = record[3:-1]
+    seq = None
+    if flags & kRecordSeqFlag:
+      if len(body) < 2:
+        return None
+      seq = body[0]
+      body = body[1:]
+    if record_type == kRecordTypeFrame:
+      frame_bytes = body
+      # Deltas are sent for the first bus only.
+      if not flags & (kRecordInvalidFlag | kRecordChannel2Flag):
+        self.payloads[body[0]] = body[1:]
+    else:
+      frame_bytes = self.applyDelta(body)
+      if frame_bytes is None:
+        return ""
+    line = " ".join("%02x" % b for b in frame_bytes)
+    if flags & kRecordInvalidFlag:
+      line += " ERR"
+    if flags & kRecordChannel2Flag:
+      line += " L2"
+    if seq is not None:
+      line += " #%02x" % seq
+    return "%s @%d" % (line, self.break_ticks)
+
+  # Returns the text line of a trace record, or None if its token is
+  # unknown or its arguments don't match.
+  def decodeTrace(self, token, args):
+    if token not in kTraceFormats:
+      return None
+    (format, argsOf) = kTraceFormats[token]
+    try:
+      return format % argsOf(args)
+    except (IndexError, TypeError):
+      return None
+
+  # Returns the text line of a sniffer log frame, in the injector's frame
+  # line format with the direction tag.
+  def decodeSnifferFrame(self, flags, frame_bytes):
+    if not frame_bytes:
+      return None
+    line = " ".join("%02x" % b for b in frame_bytes)
+    if flags & kSnifferInjectedFlag:
+      line += " *"
+    line += " S" if flags & kSnifferSlaveResponseFlag else " M"
+    if flags & kSnifferInvalidFlag:
+      line += " ERR"
+    return line
+
+  # Returns the text line of a captured edges record.
+  def decodeEdges(self, flags, body):
+    if len(body) < 5 or (len(body) - 5) % 2:
+      return None
+    ticks = body[1] | (body[2] << 8) | (body[3] << 16) | (body[4] << 24)
+    words = [body[i] | (body[i + 1] << 8) for i in range(5, len(body), 2)]
+    line = "edges %d @%d:" % (body[0], ticks)
+    for word in words:
+      line += " %s%d" % ("H" if word & 0x8000 else "L", word & 0x7fff)
+    if flags & kEdgesLastFlag:
+      line += " end"
+    return line
+
+  # Returns the text line of a health record.
+  def decodeHealth(self, body):
+    num_errors = len(kHealthErrorNames)
+    if len(body) != 4 + 2 + 2 * num_errors + 2 + 1 + 2 + 2:
+      return None
+    u16 = lambda i: body[i] | (body[i + 1] << 8)
+    uptime = u16(0) | (u16(2) << 16)
+    line = "health up=%ds fps=%d" % (uptime, u16(4))
+    for (i, name) in enumerate(kHealthErrorNames):
+      count = u16(6 + 2 * i)
+      if count:
+        line += " %s=%d" % (name, count)
+    i = 6 + 2 * num_errors
+    line += " loop=%dus isr=%dus ram=%d dropped=%d" % (
+        u16(i) * 4, body[i + 2] * 4, u16(i + 3), u16(i + 5))
+    return line
+
+  # Returns the frame bytes of a delta record body (id, changes mask, the
+  # changed data bytes and the checksum), or None if the last frame of the
+  # id is unknown.
+  def applyDelta(self, body):
+    if len(body) < 3 or body[0] not in self.payloads:
+      return None
+    payload = bytearray(self.payloads[body[0]])
+    changes = body[1]
+    i = 2
+    for index in range(len(payload) - 1):
+      if changes & (1 << index):
+        if i >= len(body) - 1:
+          return None
+        payload[index] = body[i]
+        i += 1
+    payload[-1] = body[-1]
+    self.payloads[body[0]] = payload
+    return bytearray([body[0]]) + payload
+
+# True if the bytes of a chunk of the binary output are a text message 
+# rather than a corrupted record.
+def isText(data):
+  return all(b == 0x0a or 0x20 <= b < 0x7f for b in data)
+
+# Reads the serial port in chunks of all the bytes that arrived so far and
+# splits them at a delimiter byte, instead of a read() call per byte or per
+# line, which can't keep up with a busy bus at the high serial rates.
+class ChunkReader:
+  def __init__(self, serial_port, delimiter):
+    self.serial_port = serial_port
+    self.delimiter = delimiter
+    # Bytes after the last delimiter.
+    self.pending = bytearray()
+
+  # Blocks until at least one item is complete and returns the list of the
+  # complete items, without their delimiters. 
+  def readItems(self):
+    while True:
+      n = max(1, self.serial_port.inWaiting())
+      self.pending.extend(self.serial_port.read(n))
+      items = self.pending.split(self.delimiter)
+      self.pending = items.pop()
+      if items:
+        return items
+
+# Returns the lines of the next chunk of a binary output stream. Records 
+# are delimited by zero bytes, the bytes between them are text messages.
+def readBinaryLines(reader, decoder):
+  while True:
+    lines = []
+    for data in reader.readItems():
+      if not data:
+        continue
+      line = decoder.decode(data)
+      if line:
+        lines.append(line)
+        continue
+      if line is not None:
+        continue
+      if not isText(data):
+        # A corrupted record, the deltas that follow may refer to it.
+        decoder.reset()
+        continue
+      text = data.decode('ascii', 'replace').strip('\n')
+      if text.startswith("dropped "):
+        decoder.reset()
+      if text:
+        lines.extend(text.split('\n'))
+    if lines:
+      return lines
+
+# Returns the lines of the next chunk of a text output stream.
+def readTextLines(reader):
+  return [data.decode('ascii', 'replace').rstrip('\r') 
+      for data in reader.readItems()]
+
+# Returns the device timestamp of a frame line, in hardware clock ticks, or
+# None if the line has none.
+def deviceTicksOf(line):
+  m = kDeviceTicksRegex.search(line)
+  return int(m.group(1)) if m else None
+
+# Finds the gaps in the frame sequence numbers (custom_defs::kPrintFrameSeq)
+# and tells how many of the lost frames the analyzer reported as dropped by
+# its serial output. The others were lost in the analyzer's frame queue 
+# (BUFFER_OVERRUN) or on the way to the host. Lines should be passed in 
+# arrival order, which is the sequence order. With changed frames only, the
+# skipped frames are gaps too.
+class SeqTracker:
+  def __init__(self):
+    self.next_seq = None
+    # Frames reported by the 'dropped <n>' lines since the last frame.
+    self.reported_drops = 0
+
+  # Returns the gap report line of a frame line, or None.
+  def check(self, line):
+    if line.startswith("dropped "):
+      try:
+        self.reported_drops += int(line.split()[1])
+      except (IndexError, ValueError):
+        pass
+      return None
+    m = kSeqRegex.search(line)
+    if not m:
+      return None
+    seq = int(m.group(1), 16)
+    expected = self.next_seq
+    self.next_seq = (seq + 1) & 0xff
+    reported = self.reported_drops
+    self.reported_drops = 0
+    if expected is None or seq == expected:
+      return None
+    lost = (seq - expected) & 0xff
+    sio_lost = min(lost, reported)
+    return "lost %d frames before #%02x: %d in serial output, %d in frame queue or host" % (
+        lost, seq, sio_lost, lost - sio_lost)
+
+# Sort the timestamped lines of a chunk by their device time, keeping the 
+# other lines in place. With kUseDualBus, a frame of one bus can be 
+# completed, and sent, after a later frame of the other one. 32 bit clock
+# wrap around safe, the times of a chunk are close.
+def orderByDeviceTicks(items):
+  slots = [i for i, (line, ticks) in enumerate(items) if ticks is not None]
+  if len(slots) < 2:
+    return items
+  base_ticks = items[slots[0]][1]
+  timed = sorted((items[i] for i in slots), 
+      key=lambda item: ((item[1] - base_ticks + 0x80000000) & 0xffffffff))
+  result = list(items)
+  for i, item in zip(slots, timed):
+    result[i] = item
   return result
 
 # If a valid frame return a LinFrame, otherwise 
@@ -54,7 +483,8 @@ def parseLine(line):
   if not m:
     print "Ignoring: [%s]" % line
     return None
-  return LinFrame(m.group(1), m.group(2).split(), m.group(3))
+  break_ticks = int(m.group(4)) if m.group(4) else None
+  return LinFrame(m.group(1), m.group(2).split(), m.group(3), break_ticks)
 
 # Parse args and set FLAGS.
 def parseArgs(argv):
@@ -68,10 +498,30 @@ def parseArgs(argv):
       "-d", "--diff", dest="diff",
       default=False,
       help="show only data changes")
+  parser.add_option(
+      "--heatmap", dest="heatmap",
+      default=0,
+      help="in diff mode, print the change frequency of each bit every N seconds and on exit")
   parser.add_option(
       "-s", "--speed", dest="speed",
       default=115200,
       help="use this serial port baud rate")
+  parser.add_option(
+      "-b", "--binary", dest="binary",
+      default=False,
+      help="decode binary records (analyzer kUseBinaryOutput, injector kUseTraceOutput)")
+  parser.add_option(
+      "-o", "--output", dest="output",
+      default=None,
+      help="also write the frames to this capture file", metavar="FILE")
+  parser.add_option(
+      "-f", "--format", dest="format",
+      default="pcap",
+      help="format of the capture file, pcap or candump")
+  parser.add_option(
+      "--signals", dest="signals",
+      default=None,
+      help="print the signal changes per this custom_signals.h of the injector", metavar="FILE")
   (FLAGS, args) = parser.parse_args()
   if args:
     print "Uexpected arguments:", args
@@ -81,6 +531,11 @@ def parseArgs(argv):
   print ("  --port ..........[%s]" % FLAGS.port)
   print ("  --speed .........[%s]" % FLAGS.speed)
   print ("  --diff ..........[%s]" % FLAGS.diff)
+  print ("  --heatmap .......[%s]" % FLAGS.heatmap)
+  print ("  --binary ........[%s]" % FLAGS.binary)
+  print ("  --output ........[%s]" % FLAGS.output)
+  print ("  --format ........[%s]" % FLAGS.format)
+  print ("  --signals .......[%s]" % FLAGS.signals)
 
 # Return time now in millis. We use it to comptute relative time.
 def timeMillis():
@@ -92,6 +547,143 @@ def formatRelativeTimeMillis(millis):
   millis_fraction = millis % 1000
   return "%05d.%03d" % (seconds, millis_fraction)
 
+# Format a device ticks delta as "sssss.mmmuuu".
+def formatRelativeDeviceTicks(ticks):
+  micros = ticks * (1000 / kDeviceTicksPerMilli)
+  return "%05d.%06d" % (micros / 1000000, micros % 1000000)
+
+# Extends the 32 bit device clock, which wraps around every ~4.7 hours, for
+# long captures. Times should be passed in order.
+class DeviceClock:
+  def __init__(self):
+    self.start_ticks = None
+    self.last_ticks = None
+    # Ticks since start_ticks of last_ticks.
+    self.elapsed_ticks = 0
+
+  # Returns the ticks since the first call.
+  def elapsedTicks(self, ticks):
+    if self.start_ticks is None:
+      self.start_ticks = ticks
+      self.last_ticks = ticks
+    delta = (ticks - self.last_ticks) & 0xffffffff
+    # A slightly earlier time, not a wrap around.
+    if delta >= 0x80000000:
+      delta -= 0x100000000
+    self.elapsed_ticks += delta
+    self.last_ticks = ticks
+    return self.elapsed_ticks
+
+# Base of the capture file writers. The file is written through a large 
+# buffer and flushed at most every kCaptureFlushMillis, rather than per 
+# frame, to keep up with a busy bus.
+class CaptureWriter:
+  def __init__(self, path):
+    self.file = open(path, 'wb', 1 << 16)
+    self.last_flush_millis = timeMillis()
+
+  # Call after each chunk of frames.
+  def maybeFlush(self):
+    now = timeMillis()
+    if now - self.last_flush_millis >= kCaptureFlushMillis:
+      self.file.flush()
+      self.last_flush_millis = now
+
+  def close(self):
+    self.file.close()
+
+# Writes a candump log (as 'candump -l'), one frame per line with the lin 
+# id as the can id, and the data bytes. Frames with errors are skipped, the
+# format has no checksum or error fields. Bus 2 frames are on 'lin1'.
+class CandumpWriter(CaptureWriter):
+  def writeFrame(self, time_secs, frame_bytes, is_valid, channel):
+    if not is_valid or len(frame_bytes) < 2:
+      return
+    self.file.write("(%.6f) lin%d %03X#%s\n" % (time_secs, channel, 
+        frame_bytes[0] & 0x3f, "".join("%02X" % b for b in frame_bytes[1:-1])))
+
+# Writes a pcap file with the LIN link type, which Wireshark decodes. The
+# bus is not recorded.
+class PcapWriter(CaptureWriter):
+  def __init__(self, path):
+    CaptureWriter.__init__(self, path)
+    self.file.write(struct.pack('<IHHiIII', 0xa1b2c3d4, 2, 4, 0, 0, 65535,
+        kPcapLinkTypeLin))
+
+  def writeFrame(self, time_secs, frame_bytes, is_valid, channel):
+    pid = frame_bytes[0]
+    data = frame_bytes[1:-1]
+    checksum = frame_bytes[-1] if len(frame_bytes) > 1 else 0
+    errors = 0
+    checksum_type = kPcapLinChecksumClassic
+    if len(frame_bytes) < 2:
+      errors |= kPcapLinErrorNoSlaveResponse
+    elif checksum == linChecksum(bytearray([pid]) + data):
+      checksum_type = kPcapLinChecksumEnhanced
+    elif checksum != linChecksum(data):
+      errors |= kPcapLinErrorChecksum
+    header = bytearray([kPcapLinRevision, 0, 0, 0, 
+        (len(data) << 4) | checksum_type, pid, checksum, errors])
+    packet = header + data
+    seconds = int(time_secs)
+    self.file.write(struct.pack('<IIII', seconds, 
+        int((time_secs - seconds) * 1000000), len(packet), len(packet)))
+    self.file.write(packet)
+
+# LIN checksum of a bytearray, the inverted sum with end around carry.
+def linChecksum(data):
+  sum = 0
+  for b in data:
+    sum += b
+    if sum > 0xff:
+      sum -= 0xff
+  return (~sum) & 0xff
+
+# Returns the capture writer per the --output and --format flags, or None.
+def openCaptureWriter():
+  if not FLAGS.output:
+    return None
+  if FLAGS.format == "candump":
+    return CandumpWriter(FLAGS.output)
+  if FLAGS.format == "pcap":
+    return PcapWriter(FLAGS.output)
+  print "Unknown --format:", FLAGS.format
+  print "Aborting"
+  sys.exit(1)
+
+# Tracks the signals of the valid frames per the signal database of the
+# injector (--signals) and returns their changes.
+class SignalDecoder:
+  def __init__(self, path):
+    self.db = signal_db.SignalDb(path)
+    # Signal name -> last value.
+    self.values = {}
+
+  # Returns the list of "<name>=<value>" of the signals of a line that 
+  # changed, and of all of them on the first frame of their id. Frames with 
+  # injected bits are skipped, as in the firmware.
+  def changes(self, line):
+    m = kSignalsFrameRegex.match(line)
+    if not m or m.group(2) or m.group(3):
+      return []
+    signals = self.db.decode(bytearray(int(b, 16) for b in m.group(1).split()))
+    if not signals:
+      return []
+    result = []
+    for (name, value) in signals:
+      if self.values.get(name) != value:
+        self.values[name] = value
+        result.append("%s=%d" % (name, value))
+    return result
+
+# Write a line to the capture writer if it is a frame line. 
+def captureLine(writer, line, time_secs):
+  m = kCaptureFrameRegex.match(line)
+  if not m:
+    return
+  frame_bytes = bytearray(int(b, 16) for b in m.group(1).split())
+  writer.writeFrame(time_secs, frame_bytes, not m.group(2), 1 if m.group(3) else 0)
+
 # Read and return a single line, without the terminating EOL char.
 #def readLine(serial_port):
 #  line = serial_port.readline().rstrip('\n')
@@ -126,55 +718,80 @@ def openPort():
     sys.exit(1)
   return serial_port
 
-# For now, assuming both are of same size.
-# Return a list of '0', '1' and '-', one per data bit.
-def diffBitLists(old_bit_list, new_bit_list):
-  result = []
-  for idx, new_val in enumerate(new_bit_list):
-    if new_val != old_bit_list[idx]:
-      result.append(new_val)
-    else:
-      result.append("-")
-  return result
-
-# Insert a seperator every n  charaters.
-def insertSeperators(str, n, sep):
-  return sep.join(str[i: i+n] for i in range(0, len(str), n))
-
 def main(argv):
   parseArgs(argv)  
   serial_port = openPort()
   start_time_millis = timeMillis();
-  last_bit_lists = {}
-  while True:
-    line = serial_port.readline().rstrip('\n')
-    rel_time_millis = timeMillis() - start_time_millis
-    timestamp = formatRelativeTimeMillis(rel_time_millis);
-    # Dump raw lines
-    if not FLAGS.diff:
-      out_line = "%s  %s\n" % (timestamp, line)
-      sys.stdout.write(out_line)
+  start_time_secs = time.time()
+  differ = PayloadDiffer()
+  heatmap_millis = int(float(FLAGS.heatmap) * 1000)
+  last_heatmap_millis = start_time_millis
+  device_clock = DeviceClock()
+  decoder = RecordDecoder()
+  seq_tracker = SeqTracker()
+  capture_writer = openCaptureWriter()
+  signal_decoder = SignalDecoder(FLAGS.signals) if FLAGS.signals else None
+  reader = ChunkReader(serial_port, b'\0' if FLAGS.binary else b'\n')
+  # Closing flushes the capture file, also on ctrl-c.
+  try:
+    while True:
+      if FLAGS.binary:
+        lines = readBinaryLines(reader, decoder)
+      else:
+        lines = readTextLines(reader)
+      gap_lines = []
+      for line in lines:
+        gap = seq_tracker.check(line)
+        if gap:
+          gap_lines.append(gap)
+      items = orderByDeviceTicks([(line, deviceTicksOf(line)) for line in lines])
+      out_lines = ["%s  %s\n" % (formatRelativeTimeMillis(timeMillis() - start_time_millis), gap)
+          for gap in gap_lines]
+      for (line, device_ticks) in items:
+        # Prefer the device timestamp, it does not have the USB jitter.
+        if device_ticks is not None:
+          elapsed_ticks = device_clock.elapsedTicks(device_ticks)
+          timestamp = formatRelativeDeviceTicks(elapsed_ticks)
+          time_secs = start_time_secs + elapsed_ticks / (kDeviceTicksPerMilli * 1000.0)
+        else:
+          rel_time_millis = timeMillis() - start_time_millis
+          timestamp = formatRelativeTimeMillis(rel_time_millis);
+          time_secs = time.time()
+        if capture_writer:
+          captureLine(capture_writer, line, time_secs)
+        if signal_decoder:
+          changes = signal_decoder.changes(line)
+          if changes:
+            out_lines.append("%s  signals %s: %s\n" % (timestamp, line[:2], " ".join(changes)))
+        # Dump raw lines
+        if not FLAGS.diff:
+          out_lines.append("%s  %s\n" % (timestamp, line))
+          continue
+        # Frames lost since the serial output could not keep up. Following diffs
+        # may include changes from the lost frames.
+        if line.startswith("dropped "):
+          out_lines.append("%s  %s\n" % (timestamp, line))
+          continue
+        # Parse and dump diffs only
+        frame = parseLine(line)
+        if not frame:
+          continue
+        diff_str = differ.diff(frame)
+        if diff_str:
+          out_lines.append("%s  %s: | %s |\n" % (timestamp, frame.id, diff_str))
+      if FLAGS.diff and heatmap_millis and timeMillis() - last_heatmap_millis >= heatmap_millis:
+        out_lines.extend("heatmap %s\n" % line for line in differ.heatmapLines())
+        last_heatmap_millis = timeMillis()
+      # A single write per chunk.
+      sys.stdout.write("".join(out_lines))
       sys.stdout.flush()
-      continue
-    # Parse and dump diffs only
-    frame = parseLine(line)
-    if not frame:
-      continue
-    id = frame.id
-    new_bit_list = hexListToBitList(frame.data)
-    if id not in last_bit_lists:
-      last_bit_lists[id] = new_bit_list
-      continue
-    old_bit_list = last_bit_lists[id]
-    last_bit_lists[id] = new_bit_list
-    if new_bit_list == old_bit_list:
-      continue
-    diff_bit_list = diffBitLists(old_bit_list, new_bit_list)
-    diff_str = insertSeperators("".join(diff_bit_list), 4, " ")
-    diff_str = insertSeperators(diff_str, 10, "| ")
-    out_line = "%s  %s: | %s |\n" % (timestamp, id, diff_str)
-    sys.stdout.write(out_line)
-    sys.stdout.flush()
+      if capture_writer:
+        capture_writer.maybeFlush()
+  finally:
+    if capture_writer:
+      capture_writer.close()
+    if FLAGS.diff and heatmap_millis:
+      sys.stdout.write("".join("heatmap %s\n" % line for line in differ.heatmapLines()))
 
 if __name__ == "__main__":
   main(sys.argv[1:])
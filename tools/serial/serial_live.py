@@ -0,0 +1,214 @@
+#!/usr/bin/python
+
+# A python script that shows a live view of the bus on the terminal: the
+# rate, period and jitter and the last data of each frame id, the records
+# that the device dropped and its latest diagnostic lines (loop latency, ISR
+# profile, bus statistics). Uses the decoding of serial_dump.py, run it from
+# this directory.
+#
+# The serial port is read by a background thread, the view is redrawn by
+# the main thread at a fixed rate, so drawing never slows the capture.
+#
+# Requires installation of the PySerial library. INSTALLATION.txt for details.
+
+import optparse
+import sys
+import threading
+import time
+
+import serial_dump
+
+# Set later when parsing args.
+FLAGS = None
+
+# Weight of a new period in the period and jitter averages, 1/8.
+kAverageWeight = 0.125
+
+# Prefixes of the device diagnostic lines to show, with the last line of
+# each kind (see lineKey()).
+kDeviceLinePrefixes = ("loop:", "ISR ", "bus", "LIN stats", "lin stats", "frame periods")
+
+# ANSI escape sequences to redraw the terminal.
+kClearScreen = "\033[H\033[2J"
+
+# Per id statistics.
+class IdStats:
+  def __init__(self):
+    self.frames = 0
+    self.invalid_frames = 0
+    # Frames count at the last redraw, for the rate.
+    self.last_view_frames = 0
+    self.rate = 0.0
+    # Average period and jitter, in seconds, None until the second frame.
+    self.period = None
+    self.jitter = None
+    self.last_secs = None
+    self.last_payload = ""
+
+# The state that the reader thread updates and the view shows. Guarded by
+# lock.
+class LiveStats:
+  def __init__(self):
+    self.lock = threading.Lock()
+    # Id byte hex string -> IdStats.
+    self.ids = {}
+    self.dropped_records = 0
+    # Line prefix -> the last device line with it.
+    self.device_lines = {}
+    self.total_frames = 0
+    self.error = None
+
+  # Called by the reader thread with a line and its time in seconds.
+  def addLine(self, line, time_secs):
+    m = serial_dump.kCaptureFrameRegex.match(line)
+    with self.lock:
+      if m:
+        self.addFrame(m.group(1), not m.group(2), time_secs)
+        return
+      if line.startswith("dropped "):
+        try:
+          self.dropped_records += int(line.split()[1])
+        except (IndexError, ValueError):
+          pass
+        return
+      if line.startswith(kDeviceLinePrefixes):
+        self.device_lines[lineKey(line)] = line
+
+  def addFrame(self, frame_str, is_valid, time_secs):
+    id = frame_str[:2]
+    stats = self.ids.get(id)
+    if stats is None:
+      stats = self.ids[id] = IdStats()
+    stats.frames += 1
+    self.total_frames += 1
+    if not is_valid:
+      stats.invalid_frames += 1
+      return
+    stats.last_payload = frame_str[3:]
+    if stats.last_secs is not None:
+      period = time_secs - stats.last_secs
+      if stats.period is None:
+        stats.period = period
+        stats.jitter = 0.0
+      else:
+        stats.jitter += kAverageWeight * (abs(period - stats.period) - stats.jitter)
+        stats.period += kAverageWeight * (period - stats.period)
+    stats.last_secs = time_secs
+
+# Returns the key of a device line, its words up to the first number or
+# name=value, such that each kind of line keeps its last value. For example
+# "loop: <64us" for "loop: <64us 12".
+def lineKey(line):
+  words = []
+  for word in line.split():
+    if "=" in word:
+      words.append(word.split("=")[0])
+      break
+    if word.isdigit():
+      break
+    words.append(word)
+  return " ".join(words)
+
+# Reads the port and feeds the lines to the stats. Runs in a background
+# thread. Timed by the device timestamps when the lines have them.
+def readerLoop(serial_port, stats):
+  decoder = serial_dump.RecordDecoder()
+  device_clock = serial_dump.DeviceClock()
+  reader = serial_dump.ChunkReader(serial_port, b'\0' if FLAGS.binary else b'\n')
+  start_secs = time.time()
+  try:
+    while True:
+      if FLAGS.binary:
+        lines = serial_dump.readBinaryLines(reader, decoder)
+      else:
+        lines = serial_dump.readTextLines(reader)
+      items = serial_dump.orderByDeviceTicks(
+          [(line, serial_dump.deviceTicksOf(line)) for line in lines])
+      for (line, device_ticks) in items:
+        if device_ticks is not None:
+          time_secs = start_secs + device_clock.elapsedTicks(device_ticks) / (
+              serial_dump.kDeviceTicksPerMilli * 1000.0)
+        else:
+          time_secs = time.time()
+        stats.addLine(line, time_secs)
+  except Exception as e:
+    with stats.lock:
+      stats.error = str(e)
+
+# Format seconds as milliseconds, or '-' if None.
+def formatMillis(secs):
+  return "-" if secs is None else "%.2f" % (secs * 1000)
+
+# Returns the text of the view and updates the rates. Called with the lock
+# held.
+def renderView(stats, elapsed_secs):
+  lines = []
+  lines.append("LIN live view, %d frames, %d dropped records, refresh %ss" % (
+      stats.total_frames, stats.dropped_records, FLAGS.refresh))
+  if stats.error:
+    lines.append("Reader stopped: %s" % stats.error)
+  lines.append("")
+  lines.append("id    frames  rate/s  period ms  jitter ms  errors  last data")
+  for id in sorted(stats.ids):
+    id_stats = stats.ids[id]
+    if elapsed_secs > 0:
+      id_stats.rate = (id_stats.frames - id_stats.last_view_frames) / elapsed_secs
+    id_stats.last_view_frames = id_stats.frames
+    lines.append("%-4s %7d %7.1f %10s %10s %7d  %s" % (id, id_stats.frames,
+        id_stats.rate, formatMillis(id_stats.period), formatMillis(id_stats.jitter),
+        id_stats.invalid_frames, id_stats.last_payload))
+  if stats.device_lines:
+    lines.append("")
+    lines.append("Device:")
+    for key in sorted(stats.device_lines):
+      lines.append("  " + stats.device_lines[key])
+  return "\n".join(lines) + "\n"
+
+# Parse args and set FLAGS.
+def parseArgs(argv):
+  global FLAGS
+  parser = optparse.OptionParser()
+  parser.add_option(
+      "-p", "--port", dest="port",
+      default="/dev/cu.usbserial-AM01VGNC",
+      help="serial port to read", metavar="PORT")
+  parser.add_option(
+      "-s", "--speed", dest="speed",
+      default=115200,
+      help="use this serial port baud rate")
+  parser.add_option(
+      "-b", "--binary", dest="binary",
+      default=False,
+      help="decode binary records (analyzer kUseBinaryOutput, injector kUseTraceOutput)")
+  parser.add_option(
+      "-r", "--refresh", dest="refresh",
+      default=0.5,
+      help="seconds between redraws of the view")
+  (FLAGS, args) = parser.parse_args()
+  if args:
+    print "Uexpected arguments:", args
+    print "Aborting"
+    sys.exit(1)
+  # For serial_dump.openPort().
+  serial_dump.FLAGS = FLAGS
+
+def main(argv):
+  parseArgs(argv)
+  serial_port = serial_dump.openPort()
+  stats = LiveStats()
+  reader = threading.Thread(target=readerLoop, args=(serial_port, stats))
+  reader.daemon = True
+  reader.start()
+  refresh_secs = float(FLAGS.refresh)
+  last_view_secs = time.time()
+  while True:
+    time.sleep(refresh_secs)
+    now = time.time()
+    with stats.lock:
+      view = renderView(stats, now - last_view_secs)
+    last_view_secs = now
+    sys.stdout.write(kClearScreen + view)
+    sys.stdout.flush()
+
+if __name__ == "__main__":
+  main(sys.argv[1:])
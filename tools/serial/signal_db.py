@@ -0,0 +1,78 @@
+#!/usr/bin/python
+
+# Host side decoding of the signal database of the p891 injector. The
+# database is the X-macro lists in its custom_signals.h, which the firmware
+# expands at compile time. This module parses the same lists, so the host
+# decodes the signals of the raw frames by the definitions the firmware was
+# built with, and a signal is added or moved in a single place.
+#
+# Used by serial_dump.py --signals=<path of custom_signals.h>.
+
+import re
+
+# A signal list, '#define <list>(X)' followed by the X(...) lines.
+kSignalListRegex = re.compile(r'#define\s+(\w+)\(X\)(.*)')
+
+# The frames list, '#define CUSTOM_SIGNALS_FRAMES(F)' followed by the
+# F(...) lines.
+kFramesListRegex = re.compile(r'#define\s+CUSTOM_SIGNALS_FRAMES\(F\)(.*)')
+
+# X(name, byte index, bit index, tracker parameters...).
+kSignalRegex = re.compile(r'X\(\s*(\w+)\s*,\s*(\w+)\s*,\s*(\w+)\s*[,)]')
+
+# F(id, number of data bytes, signal list).
+kFrameRegex = re.compile(r'F\(\s*(\w+)\s*,\s*(\w+)\s*,\s*(\w+)\s*\)')
+
+# A signal bit. byte_index is of the frame bytes, 0 is the id byte.
+class Signal:
+  def __init__(self, name, byte_index, bit_index):
+    self.name = name
+    self.byte_index = byte_index
+    self.mask = 1 << bit_index
+
+# The signals of a frame id.
+class FrameSignals:
+  def __init__(self, num_data_bytes, signals):
+    self.num_data_bytes = num_data_bytes
+    self.signals = signals
+
+# Returns the lines of a C file with the continuation lines joined and the
+# /* */ comments removed, as the preprocessor sees them.
+def logicalLines(text):
+  text = text.replace('\r\n', '\n').replace('\\\n', ' ')
+  text = re.sub(r'/\*.*?\*/', ' ', text, flags=re.DOTALL)
+  return text.split('\n')
+
+class SignalDb:
+  # Parse the given custom_signals.h. Raises ValueError if it has no frames
+  # or a frame refers to an unknown signal list.
+  def __init__(self, path):
+    lists = {}
+    frames_line = None
+    for line in logicalLines(open(path).read()):
+      m = kFramesListRegex.match(line.strip())
+      if m:
+        frames_line = m.group(1)
+        continue
+      m = kSignalListRegex.match(line.strip())
+      if m:
+        lists[m.group(1)] = [Signal(s[0], int(s[1], 0), int(s[2], 0))
+            for s in kSignalRegex.findall(m.group(2))]
+    if frames_line is None:
+      raise ValueError("No CUSTOM_SIGNALS_FRAMES in %s" % path)
+    # Id byte -> FrameSignals.
+    self.frames = {}
+    for (id, num_data_bytes, list_name) in kFrameRegex.findall(frames_line):
+      if list_name not in lists:
+        raise ValueError("Unknown signal list %s in %s" % (list_name, path))
+      self.frames[int(id, 0)] = FrameSignals(int(num_data_bytes, 0), lists[list_name])
+
+  # Returns the list of (signal name, 0 or 1) of the given frame bytes (id,
+  # data and checksum), or None if the frame has no signals or another
+  # number of data bytes, as the firmware's frameArrived().
+  def decode(self, frame_bytes):
+    frame = self.frames.get(frame_bytes[0])
+    if frame is None or len(frame_bytes) != frame.num_data_bytes + 2:
+      return None
+    return [(s.name, 1 if frame_bytes[s.byte_index] & s.mask else 0)
+        for s in frame.signals]
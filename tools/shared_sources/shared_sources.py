@@ -0,0 +1,79 @@
+#!/usr/bin/python
+
+# A python script that checks that the copies of the shared source files of
+# the products are identical. Each product is an Arduino sketch directory,
+# which is built on its own, so files such as lin_processor.cpp and sio.cpp 
+# are copied into each product that uses them. A fix or an optimization of
+# a shared file is done in its reference copy, the first directory of its
+# group, and copied to the others with --sync.
+#
+# Run from the repository root. Exits with status 1 if a copy differs, 
+# unless --sync.
+#
+# Tested with python 2.7.
+
+import difflib
+import optparse
+import os
+import shutil
+import sys
+
+# Set later when parsing args.
+FLAGS = None
+
+# The groups of shared files, as (directories, file names). The first 
+# directory of each group has the reference copies. The prototype and
+# injector/src_reference are historical and are not included, except for
+# the files that have not changed since.
+kGroups = [
+  # The listen only products, the full stack.
+  (["analyzer/arduino", "beeper/arduino"], 
+      ["action_led.h", "avr_util.cpp", "hardware_clock.cpp", "hardware_clock.h", 
+       "io_pins.h", "lin_frame.cpp", "lin_frame.h", "lin_processor.cpp", 
+       "lin_processor.h", "sio.cpp", "sio.h", "system_clock.cpp", "system_clock.h"]),
+  # The platform files that also the injector uses.
+  (["analyzer/arduino", "injector/src_p891_memory/arduino"], 
+      ["avr_util.cpp", "hardware_clock.cpp", "hardware_clock.h", "io_pins.h", 
+       "sio.cpp", "sio.h", "system_clock.cpp", "system_clock.h"]),
+  (["analyzer/arduino", "beeper/arduino", "injector/src_p891_memory/arduino", 
+    "injector/src_reference/arduino", "prototype/arduino"],
+      ["avr_util.h", "passive_timer.h"]),
+]
+
+def readLines(path):
+  with open(path, "rb") as f:
+    return f.read().decode("latin-1").splitlines(True)
+
+def parseArgs(argv):
+  global FLAGS
+  parser = optparse.OptionParser(usage="%prog [options]")
+  parser.add_option("--sync", dest="sync", action="store_true", default=False,
+      help="copy the reference copies over the differing copies")
+  parser.add_option("--diff", dest="diff", action="store_true", default=False,
+      help="print the differences of each differing copy")
+  (FLAGS, args) = parser.parse_args(argv[1:])
+
+def main(argv):
+  parseArgs(argv)
+  num_differ = 0
+  for (dirs, names) in kGroups:
+    for name in names:
+      reference = os.path.join(dirs[0], name)
+      reference_lines = readLines(reference)
+      for dir in dirs[1:]:
+        copy = os.path.join(dir, name)
+        copy_lines = readLines(copy)
+        if copy_lines == reference_lines:
+          continue
+        num_differ += 1
+        print("%s differs from %s" % (copy, reference))
+        if FLAGS.diff:
+          sys.stdout.writelines(difflib.unified_diff(
+              reference_lines, copy_lines, reference, copy))
+        if FLAGS.sync:
+          shutil.copyfile(reference, copy)
+  print("%d copies differ%s" % (num_differ, " (synced)" if FLAGS.sync and num_differ else ""))
+  sys.exit(1 if num_differ and not FLAGS.sync else 0)
+
+if __name__ == "__main__":
+  main(sys.argv)
@@ -0,0 +1,173 @@
+#!/usr/bin/python
+
+# A python script that generates bit level LIN bus waveforms, for replay 
+# by a signal generator or a logic analyzer with pattern output, to test 
+# the firmware with breaks, sync, jitter, noise and baud offsets that are 
+# hard to get from a car.
+#
+# The frames are given in the analyzer's text format, protected id byte 
+# first, e.g. "8e 00 11 22 33 44 55 66 77". The checksum is computed. A
+# frame with the id byte alone is a header with no slave response.
+# The output is a line per level change, "<time micros> <level>", level 0 
+# is dominant. With --sample_us the output is instead one '0'/'1' char per
+# sample, and with --vcd a value change dump of a single lin_rx wire, for
+# simulators that take a VCD stimulus.
+#
+# Tested with python 2.7.
+
+import optparse
+import random
+import sys
+
+# Set later when parsing args.
+FLAGS = None
+
+# Id bits parity of a protected id byte.
+def protectedId(id6):
+  bit = lambda n: (id6 >> n) & 1
+  p0 = bit(0) ^ bit(1) ^ bit(2) ^ bit(4)
+  p1 = 1 - (bit(1) ^ bit(3) ^ bit(4) ^ bit(5))
+  return id6 | (p0 << 6) | (p1 << 7)
+
+# LIN checksum, an inverted sum with carry. Version 2 includes the 
+# protected id, except for the diagnostic frames.
+def checksum(pid, data, use_v2):
+  total = pid if (use_v2 and (pid & 0x3f) not in (0x3c, 0x3d)) else 0
+  for b in data:
+    total += b
+    if total > 0xff:
+      total -= 0xff
+  return (~total) & 0xff
+
+# Parse a frame string to a list of bytes, protected id first.
+def parseFrame(text):
+  values = [int(x, 16) for x in text.split()]
+  if not values or any(v < 0 or v > 0xff for v in values):
+    raise ValueError("bad frame: " + text)
+  if protectedId(values[0] & 0x3f) != values[0]:
+    sys.stderr.write("warning: bad id parity in frame %s\n" % text)
+  return values
+
+# Returns the bits of a frame, as a list of (level, length in bits) pairs.
+def frameBits(frame):
+  pid = frame[0]
+  data = frame[1:]
+  result = [(0, FLAGS.break_bits), (1, FLAGS.delimiter_bits)]
+  payload = [0x55, pid]
+  if data:
+    payload += data + [checksum(pid, data, FLAGS.checksum_v2)]
+  for i, b in enumerate(payload):
+    if i > 0:
+      result.append((1, FLAGS.byte_space_bits))
+    # Start bit, 8 data bits lsb first, stop bit.
+    result.append((0, 1))
+    for bit in range(8):
+      result.append(((b >> bit) & 1, 1))
+    result.append((1, 1))
+  result.append((1, FLAGS.frame_space_bits))
+  return result
+
+# Returns the level changes of the frames, as a list of (time micros, 
+# level), with the baud offset, edge jitter and noise glitches.
+def edges(frames):
+  bit_us = 1e6 / (FLAGS.baud * (1.0 + FLAGS.baud_offset_percent / 100.0))
+  result = [(0.0, 1)]
+  t = 0.0
+  level = 1
+  for frame in frames:
+    for (bit_level, num_bits) in frameBits(frame):
+      if bit_level != level:
+        jitter = random.uniform(-FLAGS.jitter_us, FLAGS.jitter_us)
+        result.append((max(result[-1][0], t + jitter), bit_level))
+        level = bit_level
+      t += num_bits * bit_us
+    # Noise glitches at random times of the frame, inverting the level.
+    for _ in range(FLAGS.glitches_per_frame):
+      start = random.uniform(result[-1][0], t)
+      result.append((start, 1 - level))
+      result.append((start + FLAGS.glitch_us, level))
+  result.sort(key=lambda e: e[0])
+  return result, t
+
+# Writes the level changes as a value change dump of the wire lin_rx. 
+# Times are rounded to the 1us time scale.
+def writeVcd(changes, end_us):
+  sys.stdout.write("$timescale 1us $end\n")
+  sys.stdout.write("$scope module lin $end\n")
+  sys.stdout.write("$var wire 1 r lin_rx $end\n")
+  sys.stdout.write("$upscope $end\n")
+  sys.stdout.write("$enddefinitions $end\n")
+  last_time = -1
+  for (t, level) in changes:
+    time = int(round(t))
+    if time != last_time:
+      sys.stdout.write("#%d\n" % time)
+      last_time = time
+    sys.stdout.write("%dr\n" % level)
+  sys.stdout.write("#%d\n" % int(round(end_us)))
+
+def parseArgs(argv):
+  global FLAGS
+  parser = optparse.OptionParser(usage="%prog [options] frame...")
+  parser.add_option("--baud", dest="baud", type="int", default=19200,
+      help="nominal bus baud rate")
+  parser.add_option("--baud_offset_percent", dest="baud_offset_percent", 
+      type="float", default=0.0, help="baud rate error of the master, e.g. -2.0")
+  parser.add_option("--jitter_us", dest="jitter_us", type="float", default=0.0,
+      help="max random shift of each edge")
+  parser.add_option("--glitches_per_frame", dest="glitches_per_frame", 
+      type="int", default=0, help="number of noise glitches per frame")
+  parser.add_option("--glitch_us", dest="glitch_us", type="float", default=2.0,
+      help="length of a noise glitch")
+  parser.add_option("--break_bits", dest="break_bits", type="int", default=13,
+      help="length of the break")
+  parser.add_option("--delimiter_bits", dest="delimiter_bits", type="int", 
+      default=1, help="length of the break delimiter")
+  parser.add_option("--byte_space_bits", dest="byte_space_bits", type="int",
+      default=0, help="idle bits between bytes")
+  parser.add_option("--frame_space_bits", dest="frame_space_bits", type="int",
+      default=20, help="idle bits after each frame")
+  parser.add_option("--checksum_v1", dest="checksum_v2", action="store_false",
+      default=True, help="use the classic checksum, without the id")
+  parser.add_option("--repeat", dest="repeat", type="int", default=1,
+      help="number of times to repeat the frames")
+  parser.add_option("--sample_us", dest="sample_us", type="float", default=0,
+      help="output a level char per sample of this period")
+  parser.add_option("--vcd", dest="vcd", action="store_true", default=False,
+      help="output a value change dump with 1us time scale")
+  parser.add_option("--seed", dest="seed", type="int", default=1,
+      help="random seed, for repeatable jitter and noise")
+  (FLAGS, args) = parser.parse_args(argv[1:])
+  if not args:
+    parser.error("no frames")
+  return args
+
+def main(argv):
+  frames = [parseFrame(arg) for arg in parseArgs(argv)] * FLAGS.repeat
+  random.seed(FLAGS.seed)
+  changes, end_us = edges(frames)
+  if FLAGS.vcd:
+    writeVcd(changes, end_us)
+    return
+  if not FLAGS.sample_us:
+    for (t, level) in changes:
+      sys.stdout.write("%.2f %d\n" % (t, level))
+    return
+  i = 0
+  level = 1
+  t = 0.0
+  line = []
+  while t < end_us:
+    while i < len(changes) and changes[i][0] <= t:
+      level = changes[i][1]
+      i += 1
+    line.append("1" if level else "0")
+    if len(line) >= 100:
+      sys.stdout.write("".join(line) + "\n")
+      line = []
+    t += FLAGS.sample_us
+  if line:
+    sys.stdout.write("".join(line) + "\n")
+
+if __name__ == "__main__":
+  main(sys.argv)